@@ -0,0 +1,164 @@
+#! /usr/bin/perl -w
+
+# bench61.pl
+#    Build and run every pset's benchmarks (`make bench`) with one set of
+#    optimization flags, collect their results into one JSON report, and
+#    compare them with a baseline report.
+#
+# Usage: perl bench61.pl [-o REPORT] [-b BASELINE] [-t PCT] [-f FLAGS] [SUITE...]
+#    SUITEs are m61, io61, sh61, ftx, and breakout61 (default all).
+#    Each benchmark line's primary metric (its throughput, or its time)
+#    is compared with the matching line of BASELINE; a change of more
+#    than PCT percent (default 10) in the wrong direction is a
+#    regression, and makes the script exit with status 1.
+
+use strict;
+use Getopt::Long;
+use JSON::PP;
+use POSIX qw(strftime);
+use Sys::Hostname;
+
+my @suites = (
+    ["m61", "pset1"],
+    ["io61", "pset4"],
+    ["sh61", "pset5"],
+    ["ftx", "pset6"],
+    ["breakout61", "pset6ec"]
+);
+
+# fields that identify a benchmark line, besides its strings
+my %config_fields = map { $_ => 1 }
+    qw(accounts balls calls commands height threads trials width);
+
+# primary metrics, in order of preference: [name, higher is better]
+my @metrics = (["moves_per_sec", 1], ["ops_per_sec", 1],
+               ["commands_per_sec", 1], ["mops_per_sec", 1],
+               ["ns_per_call", 0], ["time", 0]);
+
+my ($out, $baseline, $threshold, $flags) = ("bench61.json", undef, 10, "O=3 LTO=1");
+GetOptions("o=s" => \$out, "b=s" => \$baseline, "t=f" => \$threshold,
+           "f=s" => \$flags)
+    or die "Usage: perl bench61.pl [-o REPORT] [-b BASELINE] [-t PCT] [-f FLAGS] [SUITE...]\n";
+my %want = map { $_ => 1 } @ARGV;
+foreach my $s (keys %want) {
+    die "bench61.pl: no such suite `$s`\n" if !grep { $_->[0] eq $s } @suites;
+}
+
+# sh61 needs a controlling terminal; borrow one from `script` if we
+# have none
+my $have_tty = open(my $tty, "+<", "/dev/tty");
+close($tty) if $have_tty;
+
+# run_suite(suite, dir)
+#    Run `make bench` in `dir` and return its results and exit status.
+sub run_suite ($$) {
+    my ($suite, $dir) = @_;
+    my $cmd = "make --no-print-directory -C $dir bench $flags";
+    if ($suite eq "sh61" && !$have_tty) {
+        $cmd = "script -qec " . quotemeta($cmd) . " /dev/null";
+    }
+    print STDERR "bench61: $cmd\n";
+    my @results;
+    open(my $fh, "-|", "$cmd 2>&1") or die "bench61: $cmd: $!\n";
+    while (defined(my $line = <$fh>)) {
+        $line =~ s/\r//g;
+        my $r;
+        if ($line =~ /\A\s*\{/) {
+            $r = eval { decode_json($line) };
+        } elsif ($suite eq "m61"
+                 && $line =~ m{\A(\S+)\s+([\d.]+) Mops/s\s+peak RSS\s+([\d.]+) MiB\s+frag\s+([\d.]+)}) {
+            # m61bench prints a table
+            $r = {"bench" => "m61", "workload" => $1, "mops_per_sec" => $2 + 0,
+                  "peak_rss_mib" => $3 + 0, "frag" => $4 + 0};
+        }
+        if (ref($r) eq "HASH" && exists($r->{"bench"})) {
+            $r->{"suite"} = $suite;
+            push @results, $r;
+        }
+    }
+    close($fh);
+    return (\@results, $? >> 8);
+}
+
+# result_key(r)
+#    Return a string identifying benchmark line `r` across runs.
+sub result_key ($) {
+    my ($r) = @_;
+    my @k;
+    foreach my $f (sort keys %$r) {
+        my $v = $r->{$f};
+        next if ref($v);
+        if ($v !~ /\A-?[\d.]+(?:e[-+]?\d+)?\z/i || exists($config_fields{$f})) {
+            push @k, "$f=$v";
+        }
+    }
+    return join(" ", @k);
+}
+
+# primary_metric(r)
+#    Return the name of `r`'s primary metric and whether higher is better.
+sub primary_metric ($) {
+    my ($r) = @_;
+    foreach my $m (@metrics) {
+        return @$m if exists($r->{$m->[0]}) && !ref($r->{$m->[0]});
+    }
+    return ();
+}
+
+my @results;
+my %status;
+foreach my $s (@suites) {
+    my ($suite, $dir) = @$s;
+    next if %want && !$want{$suite};
+    my ($rs, $st) = run_suite($suite, $dir);
+    push @results, @$rs;
+    $status{$suite} = $st;
+    print STDERR "bench61: $suite exited with status $st\n" if $st != 0;
+}
+
+my $report = {
+    "bench61" => 1,
+    "date" => strftime("%Y-%m-%dT%H:%M:%S%z", localtime),
+    "host" => hostname(),
+    "flags" => $flags,
+    "status" => \%status,
+    "results" => \@results
+};
+
+# compare with the baseline
+my $nregressions = 0;
+if (defined($baseline)) {
+    open(my $bf, "<", $baseline) or die "bench61: $baseline: $!\n";
+    my $base = decode_json(join("", <$bf>));
+    close($bf);
+    my %base_results = map { result_key($_) => $_ } @{$base->{"results"}};
+
+    my @diff;
+    foreach my $r (@results) {
+        my $key = result_key($r);
+        my $b = $base_results{$key};
+        my ($metric, $higher) = primary_metric($r);
+        next if !defined($b) || !defined($metric) || !exists($b->{$metric})
+            || $b->{$metric} == 0;
+        my $change = ($r->{$metric} - $b->{$metric}) * 100 / $b->{$metric};
+        my $regression = ($higher ? -$change : $change) > $threshold;
+        ++$nregressions if $regression;
+        push @diff, {"key" => $key, "metric" => $metric,
+                     "baseline" => $b->{$metric}, "current" => $r->{$metric},
+                     "change_pct" => sprintf("%.2f", $change) + 0,
+                     "regression" => $regression ? JSON::PP::true : JSON::PP::false};
+        printf "%-11s %+8.2f%%  %s %s (%s)\n",
+            $regression ? "REGRESSION" : "", $change, $metric, $key,
+            $higher ? "higher is better" : "lower is better";
+    }
+    $report->{"baseline"} = {"file" => $baseline, "date" => $base->{"date"},
+                             "threshold_pct" => $threshold + 0,
+                             "regressions" => $nregressions, "diff" => \@diff};
+}
+
+open(my $of, ">", $out) or die "bench61: $out: $!\n";
+print $of JSON::PP->new->canonical->pretty->encode($report);
+close($of);
+printf STDERR "bench61: %d results written to %s%s\n", scalar(@results), $out,
+    defined($baseline) ? ", $nregressions regressions" : "";
+exit($nregressions ? 1 : 0);
@@ -111,6 +111,39 @@ CFLAGS += $(SANFLAGS)
 CXXFLAGS += $(SANFLAGS)
 endif
 
+# link-time optimization
+ifeq ($(LTO),1)
+ ifeq ($(ISCLANG),1)
+LTOFLAGS := -flto
+ else
+LTOFLAGS := -flto=auto
+ endif
+CFLAGS += $(LTOFLAGS)
+CXXFLAGS += $(LTOFLAGS)
+endif
+
+# profile-guided optimization: build with PGO=gen, run the workloads
+# (`make PGO=gen bench`, say), then rebuild with PGO=use. Profiles
+# collect in PGODIR; `make clean` keeps them
+PGODIR ?= $(CURDIR)/.pgo
+ifeq ($(PGO),gen)
+PGOFLAGS := -fprofile-generate=$(PGODIR) -fprofile-update=prefer-atomic
+else ifeq ($(PGO),use)
+ ifeq ($(wildcard $(PGODIR)),)
+$(info ** WARNING: No profiles in $(PGODIR); build with PGO=gen and run the workloads first.)
+ endif
+ ifeq ($(ISCLANG),1)
+$(shell llvm-profdata merge -o $(PGODIR)/default.profdata $(PGODIR)/*.profraw 2>/dev/null)
+PGOFLAGS := -fprofile-use=$(PGODIR)/default.profdata -Wno-profile-instr-unprofiled
+ else
+PGOFLAGS := -fprofile-use=$(PGODIR) -fprofile-partial-training -Wno-missing-profile
+ endif
+else ifneq ($(PGO),)
+$(error "PGO=$(PGO): expected PGO=gen or PGO=use")
+endif
+CFLAGS += $(PGOFLAGS)
+CXXFLAGS += $(PGOFLAGS)
+
 # profiling
 ifeq ($(or $(PROFILE),$(PG)),1)
 CFLAGS += -pg
@@ -5,36 +5,1896 @@
 #include <cstdio>
 #include <cinttypes>
 #include <cassert>
+#include <algorithm>
 #include <sys/mman.h>
+#include <mutex>
+#include <atomic>
+#include <cmath>
+#include <pthread.h>
+#include <sys/random.h>
+#include <ctime>
+#include <cerrno>
+#include <unistd.h>
 
 
 struct m61_memory_buffer {
-    char* buffer;
+    char* buffer = nullptr;
     size_t pos = 0;
-    size_t size = 8 << 20; /* 8 MiB */
+    size_t size = 0;                    // 0 until mapped
+    size_t hwm = 0;                     // bytes ever handed out
+    m61_memory_buffer* next = nullptr;  // next buffer in `m61_buffers`
+    unsigned slot = -1U;                // index in `m61_buffer_ranges`
 
-    m61_memory_buffer();
-    ~m61_memory_buffer();
+    constexpr m61_memory_buffer() = default;
+    m61_memory_buffer(char* buf, size_t sz);
 };
 
+struct m61_buffer_range {
+    std::atomic<uintptr_t> lo = 0;
+    std::atomic<uintptr_t> hi = 0;      // 0 if the entry is unused
+    std::atomic<unsigned char>* state = nullptr;    // granule states
+};
+static constexpr unsigned char M61_GRANULE_LIVE = 1;
+static constexpr unsigned char M61_GRANULE_FREED = 2;
+static constexpr unsigned char M61_GRANULE_SLAB = 3;
+static constexpr unsigned M61_MAX_BUFFERS = 256;
+static m61_buffer_range m61_buffer_ranges[M61_MAX_BUFFERS];
+static std::atomic<unsigned> m61_nbuffer_ranges;
+
 static m61_memory_buffer default_buffer;
+static bool m61_buffer_register(m61_memory_buffer* a);
+
+
+// m61_map_buffer(sz)
+//    Map `sz` bytes of fresh memory for a heap buffer, or return
+//    `MAP_FAILED`. The `M61_HUGEPAGES` environment variable selects the
+//    backing: 0 (default) for normal pages; 1 to align the buffer to
+//    2 MiB and `madvise(MADV_HUGEPAGE)` it, for transparent huge pages;
+//    2 to try `MAP_HUGETLB` 2 MiB pages first (these need a reserved
+//    hugetlbfs pool), falling back to 1.
 
+static constexpr size_t M61_HUGEPAGE = size_t(2) << 20;
 
-m61_memory_buffer::m61_memory_buffer() {
-    void* buf = mmap(nullptr,    // Place the buffer at a random address
-        this->size,              // Buffer should be 8 MiB big
-        PROT_WRITE,              // We want to read and write the buffer
-        MAP_ANON | MAP_PRIVATE, -1, 0);
+static void* m61_map_buffer(size_t sz) {
+    static int mode = -1;
+    if (mode < 0) {
+        const char* s = getenv("M61_HUGEPAGES");
+        mode = s ? strtol(s, nullptr, 0) : 0;
+    }
+    if (mode <= 0) {
+        return mmap(nullptr,     // Place the buffer at a random address
+            sz,                  // Buffer should be `sz` bytes big
+            PROT_WRITE,          // We want to read and write the buffer
+            MAP_ANON | MAP_PRIVATE, -1, 0);
                                  // We want memory freshly allocated by the OS
+    }
+#ifdef MAP_HUGETLB
+    if (mode >= 2 && sz % M61_HUGEPAGE == 0) {
+        void* map = mmap(nullptr, sz, PROT_READ | PROT_WRITE,
+                         MAP_ANON | MAP_PRIVATE | MAP_HUGETLB
+                         | (21 << MAP_HUGE_SHIFT), -1, 0);
+        if (map != MAP_FAILED) {
+            return map;
+        }
+    }
+#endif
+    // over-map, then trim to a 2 MiB-aligned range
+    void* map = mmap(nullptr, sz + M61_HUGEPAGE, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (map == MAP_FAILED) {
+        return map;
+    }
+    uintptr_t base = reinterpret_cast<uintptr_t>(map);
+    uintptr_t start = (base + M61_HUGEPAGE - 1) & ~(M61_HUGEPAGE - 1);
+    if (start != base) {
+        munmap(map, start - base);
+    }
+    if (start + sz != base + sz + M61_HUGEPAGE) {
+        munmap(reinterpret_cast<void*>(start + sz), base + M61_HUGEPAGE - start);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(reinterpret_cast<void*>(start), sz, MADV_HUGEPAGE);
+#endif
+    return reinterpret_cast<void*>(start);
+}
+
+
+m61_memory_buffer::m61_memory_buffer(char* buf, size_t sz)
+    : buffer(buf), size(sz) {
+}
+
+// m61_default_buffer_init()
+//    Map `default_buffer`. This runs on the first allocation, not from a
+//    static constructor: as `libm61.so`, m61 serves `malloc` calls made
+//    before any constructor runs. For the same reason the buffers are
+//    never unmapped at exit.
+static void m61_default_buffer_init() {
+    constexpr size_t sz = 8 << 20; /* 8 MiB */
+    void* buf = m61_map_buffer(sz);
     assert(buf != MAP_FAILED);
-    this->buffer = (char*) buf;
+    default_buffer.buffer = (char*) buf;
+    default_buffer.size = sz;
+    m61_buffer_register(&default_buffer);
+}
+
+
+// HEAP BUFFERS
+//    The heap is a list of mmap'd buffers, starting with `default_buffer`.
+//    When no buffer has room, `m61_buffer_grow` maps a new one at least
+//    twice as big as the last, with its `m61_memory_buffer` stored in its
+//    first bytes. Fully-free buffers are unmapped (other than
+//    `default_buffer`), and when a buffer's frontier drops well below its
+//    high-water mark the unused pages are released with MADV_DONTNEED.
+//
+//    Every heap buffer is also entered in `m61_buffer_ranges`, a fixed
+//    table that integrity checks (below) can search without taking a
+//    lock. Each entry owns the buffer's state map, which has one byte per
+//    `M61_ALIGN`-byte granule: `M61_GRANULE_LIVE` if an active allocation
+//    starts there, `M61_GRANULE_FREED` if a freed one did, and
+//    `M61_GRANULE_SLAB` if a small-object slab does.
+
+static constexpr size_t M61_PAGESIZE = 4096;
+static constexpr size_t M61_BUFFER_HEADER = 64;
+static constexpr size_t M61_BUFFER_MAX_GROWTH = size_t(1) << 30;
+static constexpr size_t M61_TRIM_THRESHOLD = 1 << 20;
+
+static m61_memory_buffer* m61_buffers = &default_buffer;
+static size_t m61_next_buffer_size = size_t(16) << 20;
+
+
+// m61_buffer_register(a)
+//    Map `a`'s state map and enter it in `m61_buffer_ranges`. Returns false
+//    if out of memory. Called during initialization or with
+//    `m61_central_lock` held.
+static bool m61_buffer_register(m61_memory_buffer* a) {
+    unsigned i = 0, n = m61_nbuffer_ranges.load(std::memory_order_relaxed);
+    while (i != n && m61_buffer_ranges[i].hi.load(std::memory_order_relaxed)) {
+        ++i;
+    }
+    if (i == M61_MAX_BUFFERS) {
+        return false;
+    }
+    void* map = mmap(nullptr, a->size / 16, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    m61_buffer_range& r = m61_buffer_ranges[i];
+    r.state = static_cast<std::atomic<unsigned char>*>(map);
+    r.lo.store(reinterpret_cast<uintptr_t>(a->buffer), std::memory_order_relaxed);
+    r.hi.store(reinterpret_cast<uintptr_t>(a->buffer) + a->size,
+               std::memory_order_release);
+    if (i == n) {
+        m61_nbuffer_ranges.store(n + 1, std::memory_order_release);
+    }
+    a->slot = i;
+    return true;
+}
+
+// m61_range_of(p)
+//    Return the `m61_buffer_ranges` entry containing `p`, or `nullptr`.
+static inline m61_buffer_range* m61_range_of(const void* p) {
+    uintptr_t x = reinterpret_cast<uintptr_t>(p);
+    unsigned n = m61_nbuffer_ranges.load(std::memory_order_acquire);
+    for (unsigned i = 0; i != n; ++i) {
+        m61_buffer_range& r = m61_buffer_ranges[i];
+        if (x < r.hi.load(std::memory_order_acquire)
+            && x >= r.lo.load(std::memory_order_relaxed)) {
+            return &r;
+        }
+    }
+    return nullptr;
+}
+
+// m61_buffer_of(p)
+//    Return the buffer containing address `p`, or `nullptr`.
+static m61_memory_buffer* m61_buffer_of(const void* p) {
+    auto cp = static_cast<const char*>(p);
+    for (m61_memory_buffer* a = m61_buffers; a; a = a->next) {
+        if (cp >= a->buffer && cp < a->buffer + a->size) {
+            return a;
+        }
+    }
+    return nullptr;
+}
+
+// m61_buffer_grow(minsz)
+//    Map a new buffer with room for a `minsz`-byte block.
+static m61_memory_buffer* m61_buffer_grow(size_t minsz) {
+    size_t sz = m61_next_buffer_size;
+    if (minsz > sz - M61_BUFFER_HEADER) {
+        sz = (minsz + M61_BUFFER_HEADER + M61_PAGESIZE - 1) & ~(M61_PAGESIZE - 1);
+    }
+    void* map = m61_map_buffer(sz);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+    char* buf = static_cast<char*>(map);
+    auto a = new (buf) m61_memory_buffer(buf + M61_BUFFER_HEADER,
+                                         sz - M61_BUFFER_HEADER);
+    if (!m61_buffer_register(a)) {
+        munmap(map, sz);
+        return nullptr;
+    }
+    a->next = m61_buffers;
+    m61_buffers = a;
+    m61_next_buffer_size = std::min(sz * 2, M61_BUFFER_MAX_GROWTH);
+    return a;
+}
+
+// m61_buffer_release(a)
+//    Called when buffer `a` has no blocks left.
+static void m61_buffer_release(m61_memory_buffer* a) {
+    if (a == &default_buffer) {
+        return;
+    }
+    m61_memory_buffer** pp = &m61_buffers;
+    while (*pp != a) {
+        pp = &(*pp)->next;
+    }
+    *pp = a->next;
+    m61_buffer_range& r = m61_buffer_ranges[a->slot];
+    r.hi.store(0, std::memory_order_release);
+    munmap(r.state, a->size / 16);
+    munmap(a->buffer - M61_BUFFER_HEADER, a->size + M61_BUFFER_HEADER);
+}
+
+// m61_buffer_trim(a)
+//    Return pages above `a`'s frontier to the OS once enough accumulate.
+static void m61_buffer_trim(m61_memory_buffer* a) {
+    uintptr_t top = (reinterpret_cast<uintptr_t>(a->buffer) + a->pos
+                     + M61_PAGESIZE - 1) & ~(M61_PAGESIZE - 1);
+    size_t keep = top - reinterpret_cast<uintptr_t>(a->buffer);
+    if (a->hwm > keep && a->hwm - keep >= M61_TRIM_THRESHOLD
+        && madvise(a->buffer + keep, a->hwm - keep, MADV_DONTNEED) == 0) {
+        // (fails on MAP_HUGETLB buffers unless 2 MiB-aligned)
+        a->hwm = keep;
+    }
+}
+
+
+// SIZE CLASSES
+//    Small requests are rounded up to one of `M61_NCLASSES` size classes,
+//    spaced like jemalloc's: 16-byte steps up to 128, then four classes
+//    per doubling up to `M61_SMALL_MAX`. Small objects carry no header:
+//    their metadata lives in their slab (below). Every other payload is
+//    preceded by an `m61_header`. A freed object holds its free-list link.
+
+static constexpr size_t M61_ALIGN = alignof(std::max_align_t);
+static constexpr size_t M61_SMALL_MAX = 1024;
+static constexpr size_t m61_class_size[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024
+};
+static constexpr unsigned M61_NCLASSES =
+    sizeof(m61_class_size) / sizeof(m61_class_size[0]);
+static constexpr unsigned M61_LARGE = M61_NCLASSES;
+static constexpr unsigned M61_HUGE = M61_NCLASSES + 1;
+static constexpr size_t M61_MAX_SIZE = PTRDIFF_MAX / 2;
+
+struct m61_header {
+    size_t size;                // requested size
+    unsigned char cls;          // `M61_LARGE` or `M61_HUGE`
+    unsigned char flags;        // `M61_SAMPLED`...
+};
+static_assert(sizeof(m61_header) % M61_ALIGN == 0,
+              "m61_header must preserve payload alignment");
+static constexpr unsigned char M61_SAMPLED = 1;
+
+// m61_link<T>
+//    A free-list pointer stored in freed memory. It is kept XORed with the
+//    per-process secret `m61_secret`, so a use-after-free or overflow
+//    write cannot plant a chosen pointer in a free list. A decoded link
+//    must be `M61_ALIGN`-aligned; most garbage is not, and aborts.
+//    Encoding and decoding cost an XOR, and decoding a test and branch.
+
+static uintptr_t m61_secret;
+
+static void m61_secret_init() {
+    uintptr_t x;
+    if (getrandom(&x, sizeof(x), GRND_NONBLOCK) != ssize_t(sizeof(x))) {
+        x = reinterpret_cast<uintptr_t>(&x) ^ uintptr_t(time(nullptr))
+            ^ (uintptr_t(clock()) << 32);
+    }
+    m61_secret = x * 0x9E3779B97F4A7C15ULL;
+}
+
+[[noreturn]] static void m61_report_corrupt(const void* where) {
+    fprintf(stderr, "MEMORY BUG: corrupted free list link at %p\n", where);
+    abort();
+}
+
+template <typename T>
+struct m61_link {
+    uintptr_t v;
+
+    inline T* get() const {
+        uintptr_t p = v ^ m61_secret;
+        if (__builtin_expect(p & (M61_ALIGN - 1), 0)) {
+            m61_report_corrupt(this);
+        }
+        return reinterpret_cast<T*>(p);
+    }
+    inline void set(T* p) {
+        v = reinterpret_cast<uintptr_t>(p) ^ m61_secret;
+    }
+};
+
+struct m61_free_block {
+    m61_link<m61_free_block> next;
+};
+
+// m61_class_index[(sz + 15) / 16] is the smallest class that fits `sz`
+struct m61_class_table {
+    unsigned char index[M61_SMALL_MAX / M61_ALIGN + 1];
+
+    constexpr m61_class_table()
+        : index() {
+        unsigned c = 0;
+        for (size_t i = 0; i != sizeof(index); ++i) {
+            while (m61_class_size[c] < i * M61_ALIGN) {
+                ++c;
+            }
+            index[i] = c;
+        }
+    }
+};
+static constexpr m61_class_table m61_class_index;
+
+static inline unsigned m61_size_class(size_t sz) {
+    return m61_class_index.index[(sz + M61_ALIGN - 1) / M61_ALIGN];
+}
+
+
+// BOUNDARY TAGS
+//    Each buffer is a sequence of blocks, each starting with an
+//    `m61_btag`: large allocations, and the slabs that hold small objects.
+//    `size` is the block's total size with flag bits in its low bits.
+//    `prev_size` is the previous block's size, and is valid only when
+//    that block is free (it is the previous block's footer). Memory from
+//    a buffer's `pos` to its end is unused; a freed block that reaches
+//    `pos` (the frontier) is returned to it. Blocks never span buffers.
+//
+//    Free blocks are coalesced with their neighbors on free and split on
+//    allocation. The free list policy is chosen at compile time: by
+//    default it is address-ordered first fit; build with
+//    `-DM61_BEST_FIT=1` (`make FIT=best`) for best fit.
+
+#ifndef M61_BEST_FIT
+#define M61_BEST_FIT 0
+#endif
+
+struct m61_btag {
+    size_t prev_size;           // size of previous block, if it is free
+    size_t size;                // block size | M61_INUSE | M61_PREV_INUSE
+};
+static constexpr size_t M61_INUSE = 1;
+static constexpr size_t M61_PREV_INUSE = 2;
+static constexpr size_t M61_TAGFLAGS = M61_ALIGN - 1;
+
+struct m61_free_large : m61_btag {
+    m61_link<m61_free_large> prev_free;
+    m61_link<m61_free_large> next_free;
+};
+static constexpr size_t M61_MIN_BLOCK = sizeof(m61_free_large);
+
+static m61_free_large* m61_large_free;  // free blocks, by policy order
+
+static inline size_t m61_bsize(const m61_btag* t) {
+    return t->size & ~M61_TAGFLAGS;
+}
+
+static inline m61_btag* m61_bnext(m61_btag* t) {
+    return reinterpret_cast<m61_btag*>(reinterpret_cast<char*>(t) + m61_bsize(t));
+}
+
+static inline bool m61_is_frontier(const m61_memory_buffer* a, const void* p) {
+    return p == &a->buffer[a->pos];
+}
+
+static void m61_unlink_free(m61_free_large* b) {
+    m61_free_large* prev = b->prev_free.get();
+    m61_free_large* next = b->next_free.get();
+    if (prev) {
+        prev->next_free.set(next);
+    } else {
+        m61_large_free = next;
+    }
+    if (next) {
+        next->prev_free.set(prev);
+    }
+}
+
+static void m61_insert_free(m61_free_large* b) {
+    m61_free_large* prev = nullptr;
+#if !M61_BEST_FIT
+    // address-ordered: keep the list sorted by block address
+    for (m61_free_large* x = m61_large_free; x && x < b; x = x->next_free.get()) {
+        prev = x;
+    }
+#endif
+    m61_free_large* next = prev ? prev->next_free.get() : m61_large_free;
+    b->prev_free.set(prev);
+    b->next_free.set(next);
+    if (next) {
+        next->prev_free.set(b);
+    }
+    if (prev) {
+        prev->next_free.set(b);
+    } else {
+        m61_large_free = b;
+    }
+}
+
+static m61_free_large* m61_find_fit(size_t bsz) {
+#if M61_BEST_FIT
+    m61_free_large* best = nullptr;
+    for (m61_free_large* x = m61_large_free; x; x = x->next_free.get()) {
+        size_t xsz = m61_bsize(x);
+        if (xsz >= bsz && (!best || xsz < m61_bsize(best))) {
+            best = x;
+            if (xsz == bsz) {
+                break;
+            }
+        }
+    }
+    return best;
+#else
+    for (m61_free_large* x = m61_large_free; x; x = x->next_free.get()) {
+        if (m61_bsize(x) >= bsz) {
+            return x;
+        }
+    }
+    return nullptr;
+#endif
+}
+
+
+// m61_block_alloc(bsz, clean)
+//    Return an in-use block of exactly `bsz` bytes (a multiple of
+//    `M61_ALIGN`), splitting a free block, extending a buffer's frontier,
+//    or growing the heap. Returns `nullptr` if no space is available.
+//    If `clean` is nonnull, sets `*clean` to the start of the block's
+//    known-zero suffix: memory above a buffer's `hwm` has never been
+//    handed out (or was returned with MADV_DONTNEED), so it is zero.
+
+static m61_btag* m61_block_alloc(size_t bsz, char** clean = nullptr) {
+    if (m61_free_large* b = m61_find_fit(bsz)) {
+        m61_unlink_free(b);
+        size_t size = m61_bsize(b);
+        if (size - bsz >= M61_MIN_BLOCK) {
+            // split; the remainder (which is never next to the frontier)
+            // stays free
+            auto rest = reinterpret_cast<m61_free_large*>(
+                reinterpret_cast<char*>(b) + bsz);
+            rest->size = (size - bsz) | M61_PREV_INUSE;
+            m61_bnext(rest)->prev_size = size - bsz;
+            m61_insert_free(rest);
+            b->size = bsz | M61_INUSE | (b->size & M61_PREV_INUSE);
+        } else {
+            b->size |= M61_INUSE;
+            m61_bnext(b)->size |= M61_PREV_INUSE;
+        }
+        if (clean) {
+            *clean = reinterpret_cast<char*>(b) + bsz;
+        }
+        return b;
+    }
+
+    // carve from a buffer frontier; the block before a frontier is
+    // always in use, since free blocks there rejoin the frontier
+    m61_memory_buffer* a = m61_buffers;
+    while (a && bsz > a->size - a->pos) {
+        a = a->next;
+    }
+    if (!a && !(a = m61_buffer_grow(bsz))) {
+        return nullptr;
+    }
+    auto t = reinterpret_cast<m61_btag*>(&a->buffer[a->pos]);
+    t->size = bsz | M61_INUSE | M61_PREV_INUSE;
+    if (clean) {
+        *clean = &a->buffer[std::max(a->pos, a->hwm)];
+    }
+    a->pos += bsz;
+    a->hwm = std::max(a->hwm, a->pos);
+    return t;
+}
+
+
+// m61_block_free(t)
+//    Free block `t`, coalescing it with free neighbors.
+
+static void m61_block_free(m61_btag* t) {
+    size_t size = m61_bsize(t);
+    m61_btag* next = m61_bnext(t);
+    if (!(t->size & M61_PREV_INUSE)) {
+        auto prev = reinterpret_cast<m61_free_large*>(
+            reinterpret_cast<char*>(t) - t->prev_size);
+        m61_unlink_free(prev);
+        size += m61_bsize(prev);
+        t = prev;
+    }
+    m61_memory_buffer* a = m61_buffer_of(t);
+    if (m61_is_frontier(a, next)) {
+        a->pos = reinterpret_cast<char*>(t) - a->buffer;
+        if (a->pos == 0) {
+            m61_buffer_release(a);
+        } else {
+            m61_buffer_trim(a);
+        }
+        return;
+    }
+    if (!(next->size & M61_INUSE)) {
+        m61_unlink_free(static_cast<m61_free_large*>(next));
+        size += m61_bsize(next);
+    }
+    t->size = size | (t->size & M61_PREV_INUSE);
+    next = m61_bnext(t);
+    next->prev_size = size;
+    next->size &= ~M61_PREV_INUSE;
+    m61_insert_free(static_cast<m61_free_large*>(t));
+}
+
+
+// m61_block_resize(t, bsz)
+//    Try to change in-use block `t` to `bsz` bytes without moving it, by
+//    moving the frontier if `t` is next to it, or by absorbing a free next
+//    block. Any large enough leftover is freed. Returns true on success.
+
+static bool m61_block_resize(m61_btag* t, size_t bsz) {
+    size_t size = m61_bsize(t);
+    m61_btag* next = m61_bnext(t);
+    m61_memory_buffer* a = m61_buffer_of(t);
+    if (m61_is_frontier(a, next)) {
+        size_t pos = reinterpret_cast<char*>(t) - a->buffer;
+        if (bsz > a->size - pos) {
+            return false;
+        }
+        t->size = bsz | (t->size & M61_TAGFLAGS);
+        a->pos = pos + bsz;
+        a->hwm = std::max(a->hwm, a->pos);
+        if (bsz < size) {
+            m61_buffer_trim(a);
+        }
+        return true;
+    }
+    if (bsz > size) {
+        if ((next->size & M61_INUSE) || size + m61_bsize(next) < bsz) {
+            return false;
+        }
+        m61_unlink_free(static_cast<m61_free_large*>(next));
+        size += m61_bsize(next);
+    }
+    if (size - bsz >= M61_MIN_BLOCK) {
+        // the leftover is freed as an in-use block, so it coalesces with
+        // whatever follows
+        t->size = bsz | (t->size & M61_TAGFLAGS);
+        auto rest = m61_bnext(t);
+        rest->size = (size - bsz) | M61_INUSE | M61_PREV_INUSE;
+        m61_block_free(rest);
+    } else {
+        t->size = size | (t->size & M61_TAGFLAGS);
+        m61_bnext(t)->size |= M61_PREV_INUSE;
+    }
+    return true;
+}
+
+
+// m61_aligned_in(t, align, prefix)
+//    Return the lowest address `p` in block `t` such that `p + prefix` is
+//    `align`-aligned and the gap before `p` is empty or a whole block.
+
+static inline uintptr_t m61_aligned_in(const m61_btag* t, size_t align,
+                                       size_t prefix) {
+    uintptr_t first = reinterpret_cast<uintptr_t>(t) + prefix;
+    uintptr_t p = (first + align - 1) & ~(align - 1);
+    if (p != first && p - first < M61_MIN_BLOCK) {
+        p += align;
+    }
+    return p - prefix;
+}
+
+
+// m61_block_align(t, align, prefix, bsz)
+//    Trim in-use block `t`, which must have room, to the `bsz`-byte block
+//    at `m61_aligned_in(t, align, prefix)`, and return that block. The
+//    slack before and after it is freed again.
+
+static m61_btag* m61_block_align(m61_btag* t, size_t align, size_t prefix,
+                                 size_t bsz) {
+    uintptr_t start = m61_aligned_in(t, align, prefix);
+    if (start != reinterpret_cast<uintptr_t>(t)) {
+        // split off the front and free it
+        size_t gap = start - reinterpret_cast<uintptr_t>(t);
+        auto nt = reinterpret_cast<m61_btag*>(start);
+        nt->size = (m61_bsize(t) - gap) | M61_INUSE | M61_PREV_INUSE;
+        t->size = gap | (t->size & M61_TAGFLAGS);
+        m61_block_free(t);
+        t = nt;
+    }
+    m61_block_resize(t, bsz);
+    return t;
+}
+
+
+// SMALL-OBJECT SLABS
+//    Small objects of one class are carved from a slab: an in-use block
+//    of `M61_SLAB_SIZE` bytes, aligned to its size, that starts with an
+//    `m61_run`. Objects are packed back to back with no header, so a
+//    16-byte request costs 16 bytes. An object's metadata -- its
+//    requested size, owner, and sample flag -- is in its `m61_slot` in
+//    the slab's side table. `free` finds the slab by masking the pointer
+//    and the slot by multiplying the object's offset by a precomputed
+//    reciprocal of the class size. The slab's base granule in its
+//    buffer's state map is `M61_GRANULE_SLAB`, which tells small objects
+//    from other blocks.
+//
+//    Each slab keeps its own free list and count of active objects; each
+//    class keeps a list of slabs with free space, so allocation and free
+//    are O(1). A slab whose objects are all freed is returned to the
+//    boundary-tag allocator (unless it is the class's only slab), so its
+//    memory can coalesce into large blocks.
+
+static constexpr size_t M61_SLAB_SIZE = 64 << 10;
+
+struct m61_slot {
+    uint16_t size;              // requested size
+    uint16_t owner : 15;        // allocating thread's `m61_tcache::owner`
+    uint16_t sampled : 1;       // in the sample table
+};
+static_assert(M61_SMALL_MAX < 65536, "m61_slot::size is 16 bits");
+
+struct m61_run {
+    m61_btag tag;
+    m61_run* prev;              // links in class's partial-slab list
+    m61_run* next;
+    m61_free_block* free;       // freed objects
+    char* fresh;                // next never-used object
+    char* end;                  // end of the object area
+    char* objects;              // first object
+    uint64_t recip;             // 2^32 / class size, rounded up
+    unsigned cls;
+    unsigned ninuse;            // # active objects
+
+    inline m61_slot* slots() {
+        return reinterpret_cast<m61_slot*>(this + 1);
+    }
+};
+
+// m61_slab_layout.nobjects[cls], .offset[cls]: objects per class-`cls`
+// slab, and the offset of the first (after the run and its slots)
+struct m61_slab_layout_table {
+    unsigned nobjects[M61_NCLASSES];
+    unsigned offset[M61_NCLASSES];
+
+    constexpr m61_slab_layout_table()
+        : nobjects(), offset() {
+        for (unsigned c = 0; c != M61_NCLASSES; ++c) {
+            size_t n = (M61_SLAB_SIZE - sizeof(m61_run))
+                / (sizeof(m61_slot) + m61_class_size[c]);
+            size_t off = (sizeof(m61_run) + n * sizeof(m61_slot) + M61_ALIGN - 1)
+                & ~(M61_ALIGN - 1);
+            while (off + n * m61_class_size[c] > M61_SLAB_SIZE) {
+                --n;
+            }
+            nobjects[c] = n;
+            offset[c] = off;
+        }
+    }
+};
+static constexpr m61_slab_layout_table m61_slab_layout;
+
+static m61_run* m61_partial_runs[M61_NCLASSES];
+static unsigned long m61_class_nruns[M61_NCLASSES];   // for `m61_dump_profile`
+static unsigned long m61_class_ninuse[M61_NCLASSES];
+
+// m61_granule(r, ptr)
+//    Return the state byte for `ptr` in range `r`.
+static inline std::atomic<unsigned char>& m61_granule(const m61_buffer_range* r,
+                                                      const void* ptr) {
+    uintptr_t off = reinterpret_cast<uintptr_t>(ptr) - r->lo.load(std::memory_order_relaxed);
+    return r->state[off / M61_ALIGN];
 }
 
-m61_memory_buffer::~m61_memory_buffer() {
-    munmap(this->buffer, this->size);
+// m61_run_of(ptr)
+//    Return the slab containing small object `ptr`.
+static inline m61_run* m61_run_of(const void* ptr) {
+    return reinterpret_cast<m61_run*>(
+        reinterpret_cast<uintptr_t>(ptr) & ~(M61_SLAB_SIZE - 1));
 }
 
+// m61_slot_of(r, ptr)
+//    Return the metadata of small object `ptr` in slab `r`. Multiplying
+//    by `recip` divides exactly for any offset below 2^32.
+static inline m61_slot& m61_slot_of(m61_run* r, const void* ptr) {
+    uint64_t off = static_cast<const char*>(ptr) - r->objects;
+    return r->slots()[(off * r->recip) >> 32];
+}
+
+static inline bool m61_run_full(const m61_run* r) {
+    return !r->free && r->fresh == r->end;
+}
 
+static void m61_run_link(m61_run* r) {
+    r->prev = nullptr;
+    r->next = m61_partial_runs[r->cls];
+    if (r->next) {
+        r->next->prev = r;
+    }
+    m61_partial_runs[r->cls] = r;
+}
+
+static void m61_run_unlink(m61_run* r) {
+    if (r->prev) {
+        r->prev->next = r->next;
+    } else {
+        m61_partial_runs[r->cls] = r->next;
+    }
+    if (r->next) {
+        r->next->prev = r->prev;
+    }
+}
+
+// m61_slab_block_alloc()
+//    Return an in-use, size-aligned block for a slab. A free block with
+//    an aligned slab inside is split if there is one; otherwise a block
+//    with room to spare is allocated and trimmed. Slabs carved in a row
+//    from a frontier are contiguous.
+static m61_btag* m61_slab_block_alloc() {
+    for (m61_free_large* x = m61_large_free; x; x = x->next_free.get()) {
+        uintptr_t start = m61_aligned_in(x, M61_SLAB_SIZE, 0);
+        if (start + M61_SLAB_SIZE <= reinterpret_cast<uintptr_t>(x) + m61_bsize(x)) {
+            m61_unlink_free(x);
+            x->size |= M61_INUSE;
+            m61_bnext(x)->size |= M61_PREV_INUSE;
+            return m61_block_align(x, M61_SLAB_SIZE, 0, M61_SLAB_SIZE);
+        }
+    }
+    m61_btag* t = m61_block_alloc(2 * M61_SLAB_SIZE + M61_MIN_BLOCK);
+    if (!t) {
+        return nullptr;
+    }
+    return m61_block_align(t, M61_SLAB_SIZE, 0, M61_SLAB_SIZE);
+}
+
+static m61_run* m61_run_alloc(unsigned cls) {
+    auto r = reinterpret_cast<m61_run*>(m61_slab_block_alloc());
+    if (!r) {
+        return nullptr;
+    }
+    r->free = nullptr;
+    r->objects = r->fresh = reinterpret_cast<char*>(r) + m61_slab_layout.offset[cls];
+    r->end = r->fresh + m61_slab_layout.nobjects[cls] * m61_class_size[cls];
+    r->recip = (uint64_t(1) << 32) / m61_class_size[cls] + 1;
+    r->cls = cls;
+    r->ninuse = 0;
+    m61_granule(m61_range_of(r), r).store(M61_GRANULE_SLAB, std::memory_order_relaxed);
+    m61_run_link(r);
+    ++m61_class_nruns[cls];
+    return r;
+}
+
+static char* m61_small_alloc(unsigned cls) {
+    m61_run* r = m61_partial_runs[cls];
+    if (!r && !(r = m61_run_alloc(cls))) {
+        return nullptr;
+    }
+    char* ptr;
+    if (m61_free_block* fb = r->free) {
+        r->free = fb->next.get();
+        ptr = reinterpret_cast<char*>(fb);
+    } else {
+        ptr = r->fresh;
+        r->fresh += m61_class_size[cls];
+    }
+    ++r->ninuse;
+    ++m61_class_ninuse[cls];
+    if (m61_run_full(r)) {
+        m61_run_unlink(r);
+    }
+    return ptr;
+}
+
+static void m61_small_free(void* ptr) {
+    m61_run* r = m61_run_of(ptr);
+    if (m61_run_full(r)) {
+        m61_run_link(r);
+    }
+    auto fb = static_cast<m61_free_block*>(ptr);
+    fb->next.set(r->free);
+    r->free = fb;
+    --r->ninuse;
+    --m61_class_ninuse[r->cls];
+    if (r->ninuse == 0
+        && (m61_partial_runs[r->cls] != r || r->next)) {
+        m61_run_unlink(r);
+        --m61_class_nruns[r->cls];
+        m61_granule(m61_range_of(r), r).store(0, std::memory_order_relaxed);
+        m61_block_free(&r->tag);
+    }
+}
+
+
+// m61_block
+//    An allocation as the paths below see it: its payload and, for a
+//    small object, its slab. Other blocks keep their metadata in the
+//    `m61_header` before the payload.
+
+struct m61_block {
+    char* ptr = nullptr;
+    m61_run* run = nullptr;     // small objects only
+
+    inline m61_header* header() const {
+        return reinterpret_cast<m61_header*>(ptr) - 1;
+    }
+    inline m61_slot& slot() const {
+        return m61_slot_of(run, ptr);
+    }
+    inline size_t size() const {
+        return run ? slot().size : header()->size;
+    }
+    inline bool sampled() const {
+        return run ? slot().sampled : header()->flags & M61_SAMPLED;
+    }
+    inline void set_sampled(bool on) const {
+        if (run) {
+            slot().sampled = on;
+        } else if (on) {
+            header()->flags |= M61_SAMPLED;
+        } else {
+            header()->flags &= ~M61_SAMPLED;
+        }
+    }
+    // init(sz, owner)
+    //    Record a new allocation of `sz` bytes by thread `owner`.
+    inline void init(size_t sz, unsigned owner) const {
+        if (run) {
+            slot() = {uint16_t(sz), uint16_t(owner), 0};
+        } else {
+            header()->size = sz;
+            header()->flags = 0;
+        }
+    }
+};
+
+static inline m61_block m61_header_block(m61_header* h) {
+    return {reinterpret_cast<char*>(h + 1), nullptr};
+}
+
+// m61_block_of(ptr)
+//    Return the block whose payload is `ptr`, which is a small object if
+//    the granule at its slab base says so.
+static inline m61_block m61_block_of(void* ptr) {
+    m61_block b = {static_cast<char*>(ptr), nullptr};
+    m61_run* r = m61_run_of(ptr);
+    m61_buffer_range* range = m61_range_of(ptr);
+    if (range
+        && reinterpret_cast<uintptr_t>(r) >= range->lo.load(std::memory_order_relaxed)
+        && m61_granule(range, r).load(std::memory_order_relaxed) == M61_GRANULE_SLAB) {
+        b.run = r;
+    }
+    return b;
+}
+
+
+// THREAD CACHES
+//    Each thread keeps a magazine of free objects per size class, so the
+//    common small-object malloc and free touch only thread-local memory
+//    and take no lock. An empty magazine refills, and a full one flushes,
+//    `M61_MAG_BATCH` objects at a time under `m61_central_lock`, which
+//    protects the runs and boundary-tag lists above. A thread's magazines
+//    are flushed when it exits (via the `m61_tcache_key` destructor).
+//
+//    A small object freed by a thread other than the one that allocated
+//    it goes back to its allocating thread instead, on one of that
+//    thread's per-class remote-free queues in `m61_remote`: MPSC stacks
+//    that the owner takes over whole, with one exchange, when a magazine
+//    runs dry. A freeing thread collects up to `M61_MAG_BATCH` objects of
+//    a class bound for the same owner in a `pending` chain, then pushes
+//    the chain with one compare-and-swap. Producer/consumer handoffs thus
+//    recycle objects without touching the central lock. Queue slots are
+//    numbered by `m61_tcache::owner`. An exiting thread leaves its slot
+//    orphaned: later frees of its objects take the freeing thread's own
+//    magazine path back to the central runs, and a push that races with
+//    the exit is drained on the next central refill. A new thread may
+//    adopt an orphaned slot. Threads beyond `M61_MAX_OWNERS` get owner 0
+//    and no queue.
+//
+//    The thread cache also holds the thread's statistics counters. Only
+//    the owning thread writes them, with relaxed load/store pairs (plain
+//    adds, no locked instructions), and `m61_get_statistics` sums the
+//    counters of every registered thread on demand. An exiting thread
+//    folds its counters into `m61_retired`.
+
+static constexpr unsigned M61_MAG_SIZE = 32;
+static constexpr unsigned M61_MAG_BATCH = M61_MAG_SIZE / 2;
+
+static constexpr unsigned M61_MAX_OWNERS = 1024;
+static_assert(M61_MAX_OWNERS <= (1U << 15), "m61_slot::owner is 15 bits");
+
+struct alignas(64) m61_remote_queue {
+    std::atomic<m61_free_block*> head[M61_NCLASSES] = {};
+};
+
+struct m61_pending {            // remote frees not yet pushed
+    unsigned owner;
+    unsigned n;
+    m61_free_block* first;
+    m61_free_block* last;
+};
+
+struct m61_magazine {
+    unsigned n;
+    char* obj[M61_MAG_SIZE];
+};
+
+struct m61_counter {
+    std::atomic<unsigned long long> v = 0;
+
+    inline void add(unsigned long long delta) {
+        v.store(v.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
+    }
+    inline unsigned long long get() const {
+        return v.load(std::memory_order_relaxed);
+    }
+};
+
+// m61_log2_bucket(x)
+//    Return the `m61_dump_profile` histogram bucket for `x`: 0 for 0,
+//    otherwise k such that 2^(k-1) <= x < 2^k.
+static constexpr unsigned M61_HIST_BUCKETS = 65;
+
+static inline unsigned m61_log2_bucket(unsigned long long x) {
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+struct m61_counters {
+    m61_counter nactive;
+    m61_counter active_size;
+    m61_counter ntotal;
+    m61_counter total_size;
+    m61_counter nfail;
+    m61_counter fail_size;
+    std::atomic<uintptr_t> heap_min = UINTPTR_MAX;
+    std::atomic<uintptr_t> heap_max = 0;
+    m61_counter size_hist[M61_HIST_BUCKETS];    // allocations by size
+
+    inline void note_alloc(void* ptr, size_t sz);
+    inline void note_free(size_t sz);
+    inline void note_fail(size_t sz);
+    void accumulate(m61_statistics& stats) const;
+};
+
+// m61_site_table
+//    Per-thread allocation traffic by call site, for
+//    `m61_print_heavy_hitters`. A fixed-size open-addressing table keyed
+//    by (`file` pointer, `line`); the hash of a hot site almost always
+//    lands on its own slot, so recording costs one probe. Sites that find
+//    no slot within `M61_SITE_PROBES` probes are counted in `other`.
+//    As with `m61_counters`, only the owning thread writes.
+
+static constexpr unsigned M61_NSITES = 512;
+static constexpr unsigned M61_SITE_PROBES = 8;
+
+struct m61_site {
+    std::atomic<const char*> file = nullptr;
+    std::atomic<int> line = 0;
+    m61_counter nbytes;
+    m61_counter count;
+};
+
+struct m61_site_table {
+    m61_site site[M61_NSITES];
+    m61_counter other_nbytes;
+    m61_counter other_count;
+
+    static inline unsigned hash(const char* file, int line) {
+        uintptr_t x = reinterpret_cast<uintptr_t>(file) ^ (uintptr_t(line) << 40);
+        return (x * 0x9E3779B97F4A7C15ULL) >> 55;
+    }
+    inline void note(const char* file, int line, unsigned long long count,
+                     unsigned long long nbytes);
+};
+
+inline void m61_site_table::note(const char* file, int line,
+                                 unsigned long long cnt,
+                                 unsigned long long nb) {
+    unsigned i = hash(file, line);
+    for (unsigned probe = 0; probe != M61_SITE_PROBES; ++probe) {
+        m61_site& st = site[(i + probe) % M61_NSITES];
+        const char* f = st.file.load(std::memory_order_acquire);
+        if (!f) {
+            st.line.store(line, std::memory_order_relaxed);
+            st.file.store(file ? file : "?", std::memory_order_release);
+        } else if (f != (file ? file : "?")
+                   || st.line.load(std::memory_order_relaxed) != line) {
+            continue;
+        }
+        st.count.add(cnt);
+        st.nbytes.add(nb);
+        return;
+    }
+    other_count.add(cnt);
+    other_nbytes.add(nb);
+}
+
+struct m61_tcache {
+    bool registered = false;
+    m61_tcache* prev = nullptr; // links in `m61_tcaches`
+    m61_tcache* next = nullptr;
+    m61_counters stats;
+    m61_site_table sites;
+    long long sample_countdown = 0; // bytes until next allocation sample
+    uint64_t sample_rng = 0;
+    unsigned long long sample_clock = 0;    // `ntotal` at last clock sync
+    unsigned owner = 0;         // index in `m61_remote`, or 0
+    m61_pending pending[M61_NCLASSES] = {};
+    m61_free_block* stash[M61_NCLASSES] = {};   // taken remote frees
+    m61_magazine mag[M61_NCLASSES] = {};
+};
+
+// (initial-exec: in `libm61.so`, the default TLS model's first access
+// can call `malloc`)
+static thread_local m61_tcache m61_tc __attribute__((tls_model("initial-exec")));
+static std::mutex m61_central_lock;
+static pthread_key_t m61_tcache_key;
+static pthread_once_t m61_tcache_once = PTHREAD_ONCE_INIT;
+static m61_tcache* m61_tcaches;     // registered threads
+static m61_counters m61_retired;    // counters from exited threads
+static m61_site_table m61_retired_sites;
+static m61_remote_queue m61_remote[M61_MAX_OWNERS];
+enum m61_owner_state : unsigned char {
+    M61_OWNER_FREE = 0, M61_OWNER_LIVE, M61_OWNER_ORPHANED
+};
+// (written under `m61_central_lock`)
+static std::atomic<m61_owner_state> m61_owner[M61_MAX_OWNERS];
+static std::atomic<bool> m61_orphan_pushed;     // orphaned queue nonempty?
+
+
+inline void m61_counters::note_alloc(void* ptr, size_t sz) {
+    nactive.add(1);
+    active_size.add(sz);
+    ntotal.add(1);
+    total_size.add(sz);
+    size_hist[m61_log2_bucket(sz)].add(1);
+    uintptr_t first = reinterpret_cast<uintptr_t>(ptr);
+    uintptr_t last = first + (sz ? sz - 1 : 0);
+    if (first < heap_min.load(std::memory_order_relaxed)) {
+        heap_min.store(first, std::memory_order_relaxed);
+    }
+    if (last > heap_max.load(std::memory_order_relaxed)) {
+        heap_max.store(last, std::memory_order_relaxed);
+    }
+}
+
+inline void m61_counters::note_free(size_t sz) {
+    nactive.add(-1ULL);
+    active_size.add(-static_cast<unsigned long long>(sz));
+}
+
+inline void m61_counters::note_fail(size_t sz) {
+    nfail.add(1);
+    fail_size.add(sz);
+}
+
+void m61_counters::accumulate(m61_statistics& stats) const {
+    stats.nactive += nactive.get();
+    stats.active_size += active_size.get();
+    stats.ntotal += ntotal.get();
+    stats.total_size += total_size.get();
+    stats.nfail += nfail.get();
+    stats.fail_size += fail_size.get();
+    stats.heap_min = std::min(stats.heap_min,
+                              heap_min.load(std::memory_order_relaxed));
+    stats.heap_max = std::max(stats.heap_max,
+                              heap_max.load(std::memory_order_relaxed));
+}
+
+// m61_tcache_flush_locked(tc, cls, n)
+//    Return `n` objects from `tc`'s class-`cls` magazine to the central
+//    runs. The caller holds `m61_central_lock`.
+static void m61_tcache_flush_locked(m61_tcache* tc, unsigned cls, unsigned n) {
+    m61_magazine& m = tc->mag[cls];
+    while (n != 0 && m.n != 0) {
+        m61_small_free(m.obj[--m.n]);
+        --n;
+    }
+}
+
+// m61_tcache_send_pending(tc, cls)
+//    Push `tc`'s pending class-`cls` remote frees onto their owner's queue.
+static void m61_tcache_send_pending(m61_tcache* tc, unsigned cls) {
+    m61_pending& p = tc->pending[cls];
+    if (p.n == 0) {
+        return;
+    }
+    std::atomic<m61_free_block*>& q = m61_remote[p.owner].head[cls];
+    m61_free_block* head = q.load(std::memory_order_relaxed);
+    do {
+        p.last->next.set(head);
+    } while (!q.compare_exchange_weak(head, p.first, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed));
+    // The owner may have exited since the free checked: if so, have the
+    // next refill drain the queue
+    if (m61_owner[p.owner].load() == M61_OWNER_ORPHANED) {
+        m61_orphan_pushed.store(true, std::memory_order_release);
+    }
+    p.n = 0;
+}
+
+// m61_drain_remote_locked(owner)
+//    Return every object queued for `owner` to the central runs. The
+//    caller holds `m61_central_lock`.
+static void m61_drain_remote_locked(unsigned owner) {
+    for (unsigned cls = 0; cls != M61_NCLASSES; ++cls) {
+        m61_free_block* fb = m61_remote[owner].head[cls].exchange(nullptr);
+        while (fb) {
+            m61_free_block* next = fb->next.get();
+            m61_small_free(fb);
+            fb = next;
+        }
+    }
+}
+
+// m61_drain_orphans_locked()
+//    Drain the queues of exited threads that frees reached late. The
+//    caller holds `m61_central_lock`.
+static void m61_drain_orphans_locked() {
+    if (!m61_orphan_pushed.load(std::memory_order_relaxed)
+        || !m61_orphan_pushed.exchange(false)) {
+        return;
+    }
+    for (unsigned i = 1; i != M61_MAX_OWNERS; ++i) {
+        if (m61_owner[i].load(std::memory_order_relaxed) == M61_OWNER_ORPHANED) {
+            m61_drain_remote_locked(i);
+        }
+    }
+}
+
+// m61_tcache_take_remote(tc, cls)
+//    Move the class-`cls` objects other threads freed for `tc` into its
+//    stash.
+static void m61_tcache_take_remote(m61_tcache* tc, unsigned cls) {
+    std::atomic<m61_free_block*>& q = m61_remote[tc->owner].head[cls];
+    if (!q.load(std::memory_order_relaxed)) {
+        return;
+    }
+    m61_free_block* fb = q.exchange(nullptr, std::memory_order_acquire);
+    if (tc->stash[cls]) {
+        // rare: append the old stash
+        m61_free_block* last = fb;
+        while (m61_free_block* next = last->next.get()) {
+            last = next;
+        }
+        last->next.set(tc->stash[cls]);
+    }
+    tc->stash[cls] = fb;
+}
+
+// m61_tcache_flush_all_locked(tc)
+//    Return every object cached by `tc` to the central runs, and send its
+//    pending remote frees.
+static void m61_tcache_flush_all_locked(m61_tcache* tc) {
+    for (unsigned cls = 0; cls != M61_NCLASSES; ++cls) {
+        m61_tcache_send_pending(tc, cls);
+        if (tc->owner) {
+            m61_tcache_take_remote(tc, cls);
+        }
+        m61_tcache_flush_locked(tc, cls, M61_MAG_SIZE);
+        while (m61_free_block* fb = tc->stash[cls]) {
+            tc->stash[cls] = fb->next.get();
+            m61_small_free(fb);
+        }
+    }
+}
+
+static void m61_tcache_exit(void* arg) {
+    auto tc = static_cast<m61_tcache*>(arg);
+    std::lock_guard guard(m61_central_lock);
+    m61_tcache_flush_all_locked(tc);
+    if (tc->owner) {
+        // Orphan the slot, then take back whatever was queued before
+        // other threads could see that
+        m61_owner[tc->owner].store(M61_OWNER_ORPHANED);
+        m61_drain_remote_locked(tc->owner);
+        tc->owner = 0;
+    }
+    // fold statistics into `m61_retired`
+    m61_statistics stats = {};
+    tc->stats.accumulate(stats);
+    m61_retired.nactive.add(stats.nactive);
+    m61_retired.active_size.add(stats.active_size);
+    m61_retired.ntotal.add(stats.ntotal);
+    m61_retired.total_size.add(stats.total_size);
+    m61_retired.nfail.add(stats.nfail);
+    m61_retired.fail_size.add(stats.fail_size);
+    m61_retired.heap_min = std::min(m61_retired.heap_min.load(), tc->stats.heap_min.load());
+    m61_retired.heap_max = std::max(m61_retired.heap_max.load(), tc->stats.heap_max.load());
+    for (unsigned b = 0; b != M61_HIST_BUCKETS; ++b) {
+        m61_retired.size_hist[b].add(tc->stats.size_hist[b].get());
+    }
+    new (&tc->stats) m61_counters;
+    tc->sample_clock = 0;
+    for (m61_site& st : tc->sites.site) {
+        if (const char* f = st.file.load()) {
+            m61_retired_sites.note(f, st.line, st.count.get(), st.nbytes.get());
+        }
+    }
+    m61_retired_sites.note("?", 0, tc->sites.other_count.get(),
+                           tc->sites.other_nbytes.get());
+    new (&tc->sites) m61_site_table;
+    // unregister
+    if (tc->prev) {
+        tc->prev->next = tc->next;
+    } else {
+        m61_tcaches = tc->next;
+    }
+    if (tc->next) {
+        tc->next->prev = tc->prev;
+    }
+    tc->registered = false;
+}
+
+static void m61_sample_init();
+static void m61_check_init();
+static long long m61_sample_next(m61_tcache& tc);
+static void m61_fork_prepare();
+static void m61_fork_release();
+
+static void m61_tcache_key_init() {
+    pthread_key_create(&m61_tcache_key, m61_tcache_exit);
+    pthread_atfork(m61_fork_prepare, m61_fork_release, m61_fork_release);
+    m61_default_buffer_init();
+    m61_secret_init();
+    m61_sample_init();
+    m61_check_init();
+}
+
+// m61_tcache_self()
+//    Return this thread's cache, registering it on first use.
+static void m61_tcache_register();
+
+static inline m61_tcache& m61_tcache_self() {
+    if (__builtin_expect(!m61_tc.registered, 0)) {
+        m61_tcache_register();
+    }
+    return m61_tc;
+}
+
+static void m61_tcache_register() {
+    pthread_once(&m61_tcache_once, m61_tcache_key_init);
+    pthread_setspecific(m61_tcache_key, &m61_tc);
+    std::lock_guard guard(m61_central_lock);
+    m61_tc.prev = nullptr;
+    m61_tc.next = m61_tcaches;
+    if (m61_tc.next) {
+        m61_tc.next->prev = &m61_tc;
+    }
+    m61_tcaches = &m61_tc;
+    for (unsigned i = 1; i != M61_MAX_OWNERS; ++i) {
+        if (m61_owner[i].load(std::memory_order_relaxed) != M61_OWNER_LIVE) {
+            m61_owner[i].store(M61_OWNER_LIVE, std::memory_order_relaxed);
+            m61_tc.owner = i;
+            break;
+        }
+    }
+    m61_tc.sample_rng = reinterpret_cast<uintptr_t>(&m61_tc) | 1;
+    m61_tc.sample_countdown = m61_sample_next(m61_tc);
+    m61_tc.registered = true;
+}
+
+// m61_remote_free(tc, b, owner)
+//    Queue small object `b` for return to its allocating thread, `owner`.
+static inline void m61_remote_free(m61_tcache& tc, m61_block b, unsigned owner) {
+    unsigned cls = b.run->cls;
+    m61_pending& p = tc.pending[cls];
+    if (p.n != 0 && p.owner != owner) {
+        m61_tcache_send_pending(&tc, cls);
+    }
+    auto fb = reinterpret_cast<m61_free_block*>(b.ptr);
+    if (p.n == 0) {
+        p.owner = owner;
+        p.last = fb;
+    }
+    fb->next.set(p.first);
+    p.first = fb;
+    if (++p.n == M61_MAG_BATCH) {
+        m61_tcache_send_pending(&tc, cls);
+    }
+}
+
+// m61_tcache_refill(cls)
+//    Move up to `M61_MAG_BATCH` objects of class `cls` from this thread's
+//    remote frees, or else the central runs, into its magazine.
+static void m61_tcache_refill(unsigned cls) {
+    m61_magazine& m = m61_tc.mag[cls];
+    if (!m61_tc.stash[cls] && m61_tc.owner) {
+        m61_tcache_take_remote(&m61_tc, cls);
+    }
+    while (m.n != M61_MAG_BATCH && m61_tc.stash[cls]) {
+        m61_free_block* fb = m61_tc.stash[cls];
+        m61_tc.stash[cls] = fb->next.get();
+        m.obj[m.n++] = reinterpret_cast<char*>(fb);
+    }
+    if (m.n != 0) {
+        return;
+    }
+    std::lock_guard guard(m61_central_lock);
+    m61_drain_orphans_locked();
+    while (m.n != M61_MAG_BATCH) {
+        char* ptr = m61_small_alloc(cls);
+        if (!ptr) {
+            break;
+        }
+        m.obj[m.n++] = ptr;
+    }
+}
+
+// m61_large_alloc_locked(bsz, clean)
+//    Allocate a boundary-tag block. If the heap looks full, first return
+//    this thread's cached objects, whose runs may then coalesce, and retry.
+static m61_btag* m61_large_alloc_locked(size_t bsz, char** clean = nullptr) {
+    m61_btag* t = m61_block_alloc(bsz, clean);
+    if (!t) {
+        m61_tcache_flush_all_locked(&m61_tc);
+        t = m61_block_alloc(bsz, clean);
+    }
+    return t;
+}
+
+// m61_large_aligned_alloc_locked(align, bsz)
+//    Return an in-use block of `bsz` bytes whose payload (after its tag
+//    and `m61_header`) is `align`-aligned. A block with room to spare is
+//    allocated, then the slack before and after the aligned block is
+//    freed again, so at most `M61_MIN_BLOCK` bytes are wasted.
+static m61_btag* m61_large_aligned_alloc_locked(size_t align, size_t bsz) {
+    m61_btag* t = m61_large_alloc_locked(bsz + align + M61_MIN_BLOCK);
+    if (!t) {
+        return nullptr;
+    }
+    return m61_block_align(t, align, sizeof(m61_btag) + sizeof(m61_header), bsz);
+}
+
+
+// HUGE BLOCKS
+//    Requests above `M61_HUGE_THRESHOLD` bypass the buffers: each gets its
+//    own mapping, which starts with an `m61_huge` record followed by the
+//    block's `m61_header`, and is unmapped on free. Huge blocks are kept
+//    on the `m61_huge_blocks` list (under `m61_central_lock`) so that
+//    statistics and leak reports can find them.
+
+static constexpr size_t M61_HUGE_THRESHOLD = 128 << 10;
+
+struct m61_huge {
+    m61_huge* prev;
+    m61_huge* next;
+    size_t mapsize;             // size of the mapping
+    size_t offset;              // offset of this record in the mapping
+};
+static_assert(sizeof(m61_huge) % M61_ALIGN == 0,
+              "m61_huge must preserve payload alignment");
+
+static m61_huge* m61_huge_blocks;
+
+static constexpr size_t m61_huge_mapsize(size_t sz) {
+    return (sizeof(m61_huge) + sizeof(m61_header) + sz + M61_PAGESIZE - 1)
+        & ~(M61_PAGESIZE - 1);
+}
+
+static void m61_huge_link(m61_huge* hb) {
+    std::lock_guard guard(m61_central_lock);
+    hb->prev = nullptr;
+    hb->next = m61_huge_blocks;
+    if (hb->next) {
+        hb->next->prev = hb;
+    }
+    m61_huge_blocks = hb;
+}
+
+static void m61_huge_unlink(m61_huge* hb) {
+    std::lock_guard guard(m61_central_lock);
+    if (hb->prev) {
+        hb->prev->next = hb->next;
+    } else {
+        m61_huge_blocks = hb->next;
+    }
+    if (hb->next) {
+        hb->next->prev = hb->prev;
+    }
+}
+
+static m61_header* m61_huge_alloc(size_t sz) {
+    size_t mapsize = m61_huge_mapsize(sz);
+    void* map = mmap(nullptr, mapsize, PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+    auto hb = static_cast<m61_huge*>(map);
+    hb->mapsize = mapsize;
+    hb->offset = 0;
+    m61_huge_link(hb);
+    auto h = reinterpret_cast<m61_header*>(hb + 1);
+    h->cls = M61_HUGE;
+    return h;
+}
+
+// m61_huge_aligned_alloc(align, sz)
+//    Like `m61_huge_alloc`, but the payload is `align`-aligned.
+static m61_header* m61_huge_aligned_alloc(size_t align, size_t sz) {
+    size_t prefix = sizeof(m61_huge) + sizeof(m61_header);
+    size_t mapsize = m61_huge_mapsize(align + sz);
+    void* map = mmap(nullptr, mapsize, PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+    uintptr_t base = reinterpret_cast<uintptr_t>(map);
+    uintptr_t payload = (base + prefix + align - 1) & ~(align - 1);
+    auto hb = reinterpret_cast<m61_huge*>(payload - prefix);
+    hb->mapsize = mapsize;
+    hb->offset = payload - prefix - base;
+    m61_huge_link(hb);
+    auto h = reinterpret_cast<m61_header*>(hb + 1);
+    h->cls = M61_HUGE;
+    return h;
+}
+
+static void m61_huge_free(m61_header* h) {
+    auto hb = reinterpret_cast<m61_huge*>(h) - 1;
+    m61_huge_unlink(hb);
+    munmap(reinterpret_cast<char*>(hb) - hb->offset, hb->mapsize);
+}
+
+// m61_huge_resize(h, sz)
+//    Resize huge block `h` to hold `sz` bytes with `mremap`, which may
+//    move it. Returns the new header, or `nullptr` (leaving `h` intact).
+static m61_header* m61_huge_resize(m61_header* h, size_t sz) {
+    auto hb = reinterpret_cast<m61_huge*>(h) - 1;
+    size_t offset = hb->offset;
+    size_t mapsize = m61_huge_mapsize(offset + sz);
+    if (mapsize == hb->mapsize) {
+        return h;
+    }
+    m61_huge_unlink(hb);
+    void* map = mremap(reinterpret_cast<char*>(hb) - offset, hb->mapsize,
+                       mapsize, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        m61_huge_link(hb);
+        return nullptr;
+    }
+    hb = reinterpret_cast<m61_huge*>(static_cast<char*>(map) + offset);
+    hb->mapsize = mapsize;
+    m61_huge_link(hb);
+    return reinterpret_cast<m61_header*>(hb + 1);
+}
+
+
+// ALLOCATION SAMPLES
+//    Leak reports are built from `m61_sample` records, each giving the
+//    call site of one live allocation. By default every allocation is
+//    recorded. If the `M61_SAMPLE` environment variable is a positive
+//    number N, then instead an allocation is recorded about once every N
+//    allocated bytes: each thread counts down a geometrically-distributed
+//    number of bytes (mean N) and samples the allocation that crosses zero.
+//    The report then scales each sample by its inverse sampling
+//    probability. Sampled blocks are flagged in their header or slot, so
+//    freeing an unsampled block never consults the table.
+//
+//    Records live in a chained hash table keyed by payload address and
+//    come from mmap'd chunks, never from m61 itself. Both are protected
+//    by `m61_sample_lock`.
+//
+//    Records also carry their allocation time, measured in allocations,
+//    for the lifetime histogram in `m61_dump_profile`. The clock,
+//    `m61_sample_clock`, advances only when a thread takes the lock: it
+//    adds the allocations the thread made since its last visit. It is
+//    exact for one thread and close enough for many.
+
+struct m61_sample {
+    m61_sample* next;           // next in bucket or free list
+    void* ptr;
+    size_t size;
+    const char* file;
+    int line;
+    unsigned long long birth;   // `m61_sample_clock` at allocation
+};
+
+static std::mutex m61_sample_lock;
+static size_t m61_sample_interval;  // 0 means record every allocation
+static m61_sample** m61_sample_table;
+static size_t m61_sample_nbuckets;
+static size_t m61_sample_count;
+static m61_sample* m61_sample_freelist;
+static unsigned long long m61_sample_clock;
+static double m61_lifetime_hist[M61_HIST_BUCKETS];
+
+static void m61_sample_init() {
+    if (const char* s = getenv("M61_SAMPLE")) {
+        m61_sample_interval = strtoul(s, nullptr, 0);
+    }
+}
+
+// m61_sample_next(tc)
+//    Return a geometrically-distributed byte countdown with mean
+//    `m61_sample_interval`, or 0 if every allocation is recorded.
+static long long m61_sample_next(m61_tcache& tc) {
+    if (m61_sample_interval == 0) {
+        return 0;
+    }
+    // xorshift64
+    uint64_t x = tc.sample_rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    tc.sample_rng = x;
+    double u = ((x >> 11) + 1) * 0x1p-53;   // in (0, 1]
+    return static_cast<long long>(-std::log(u) * m61_sample_interval) + 1;
+}
+
+// m61_should_sample(tc, sz)
+//    Return true if an allocation of `sz` bytes should be recorded.
+static inline bool m61_should_sample(m61_tcache& tc, size_t sz) {
+    if (m61_sample_interval == 0) {
+        return true;
+    }
+    tc.sample_countdown -= static_cast<long long>(sz);
+    if (__builtin_expect(tc.sample_countdown > 0, 1)) {
+        return false;
+    }
+    tc.sample_countdown = m61_sample_next(tc);
+    return true;
+}
+
+// m61_sample_bucket(ptr)
+//    Return the hash bucket for payload address `ptr`.
+static inline m61_sample** m61_sample_bucket(const void* ptr) {
+    uintptr_t x = reinterpret_cast<uintptr_t>(ptr) >> 4;
+    x *= 0x9E3779B97F4A7C15ULL;
+    return &m61_sample_table[x >> 20 & (m61_sample_nbuckets - 1)];
+}
+
+// m61_sample_grow_locked()
+//    Double the hash table (keep the load factor at most 1).
+static bool m61_sample_grow_locked() {
+    size_t oldn = m61_sample_nbuckets;
+    size_t newn = std::max(oldn * 2, size_t(M61_PAGESIZE / sizeof(void*)));
+    void* map = mmap(nullptr, newn * sizeof(void*), PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    m61_sample** oldt = m61_sample_table;
+    m61_sample_table = static_cast<m61_sample**>(map);
+    m61_sample_nbuckets = newn;
+    for (size_t i = 0; i != oldn; ++i) {
+        while (m61_sample* r = oldt[i]) {
+            oldt[i] = r->next;
+            m61_sample** b = m61_sample_bucket(r->ptr);
+            r->next = *b;
+            *b = r;
+        }
+    }
+    if (oldt) {
+        munmap(oldt, oldn * sizeof(void*));
+    }
+    return true;
+}
+
+// m61_sample_tick_locked(tc)
+//    Advance `m61_sample_clock` by `tc`'s allocations since its last call.
+static inline void m61_sample_tick_locked(m61_tcache& tc) {
+    unsigned long long n = tc.stats.ntotal.get();
+    m61_sample_clock += n - tc.sample_clock;
+    tc.sample_clock = n;
+}
+
+// m61_sample_record(tc, b, file, line)
+//    Record the call site of block `b`.
+static void m61_sample_record(m61_tcache& tc, m61_block b,
+                              const char* file, int line) {
+    std::lock_guard guard(m61_sample_lock);
+    m61_sample_tick_locked(tc);
+    if (m61_sample_count >= m61_sample_nbuckets && !m61_sample_grow_locked()) {
+        return;
+    }
+    if (!m61_sample_freelist) {
+        constexpr size_t chunk = 64 << 10;
+        void* map = mmap(nullptr, chunk, PROT_READ | PROT_WRITE,
+                         MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (map == MAP_FAILED) {
+            return;
+        }
+        auto rs = static_cast<m61_sample*>(map);
+        for (size_t i = 0; i != chunk / sizeof(m61_sample); ++i) {
+            rs[i].next = m61_sample_freelist;
+            m61_sample_freelist = &rs[i];
+        }
+    }
+    m61_sample* r = m61_sample_freelist;
+    m61_sample_freelist = r->next;
+    r->ptr = b.ptr;
+    r->size = b.size();
+    r->file = file;
+    r->line = line;
+    r->birth = m61_sample_clock;
+    m61_sample** bucket = m61_sample_bucket(r->ptr);
+    r->next = *bucket;
+    *bucket = r;
+    ++m61_sample_count;
+    b.set_sampled(true);
+}
+
+// m61_sample_weight(sz)
+//    Return the estimated number of bytes represented by one sample of
+//    size `sz`; that is, `sz` divided by its sampling probability.
+static double m61_sample_weight(size_t sz) {
+    if (m61_sample_interval == 0) {
+        return sz;
+    } else if (sz == 0) {
+        return 0;
+    }
+    double n = m61_sample_interval;
+    return sz / -std::expm1(-double(sz) / n);
+}
+
+// m61_sample_forget(tc, b)
+//    Remove the record for sampled block `b`, and count its lifetime.
+static void m61_sample_forget(m61_tcache& tc, m61_block b) {
+    std::lock_guard guard(m61_sample_lock);
+    m61_sample_tick_locked(tc);
+    for (m61_sample** pr = m61_sample_bucket(b.ptr); *pr; pr = &(*pr)->next) {
+        if ((*pr)->ptr == b.ptr) {
+            m61_sample* r = *pr;
+            *pr = r->next;
+            // a sample stands for 1/p frees
+            double n = r->size ? m61_sample_weight(r->size) / r->size : 1;
+            m61_lifetime_hist[m61_log2_bucket(m61_sample_clock - r->birth)] += n;
+            r->next = m61_sample_freelist;
+            m61_sample_freelist = r;
+            --m61_sample_count;
+            break;
+        }
+    }
+    b.set_sampled(false);
+}
+
+
+// FORK
+//    `fork` copies m61's locks in whatever state other threads left them,
+//    which could deadlock the child's first allocation. The `pthread_atfork`
+//    handlers hold both locks across the fork. (m61 never nests them.)
+
+static void m61_fork_prepare() {
+    m61_sample_lock.lock();
+    m61_central_lock.lock();
+}
+
+static void m61_fork_release() {
+    m61_central_lock.unlock();
+    m61_sample_lock.unlock();
+}
+
+
+// INTEGRITY CHECKS
+//    The `M61_CHECK` environment variable sets a checking level; the
+//    default, 1, checks every free, and 0 turns checks off. Checks are
+//    designed to be cheap enough to leave on.
+//
+//    Every checked block is followed by an 8-byte canary (derived from
+//    its address), which is validated only on free, to catch writes past
+//    the end. A pointer being freed must be marked live in its buffer's
+//    state map (see HEAP BUFFERS), which needs no side table. The map uses
+//    a byte rather than a bit per granule so that threads freeing
+//    neighboring objects can update it with plain stores instead of
+//    atomic read-modify-writes, which would cost more than the rest of
+//    the check. Huge blocks are checked against `m61_huge_blocks`.
+//    Classifying and reporting a bad free is slow, but happens only once.
+
+static int m61_check_level = 1;
+static constexpr size_t M61_CANARY_SIZE = 8;
+static constexpr uint64_t M61_CANARY = 0xBADC0FFEE0DDF00DULL;
+
+static void m61_check_init() {
+    if (const char* s = getenv("M61_CHECK")) {
+        m61_check_level = strtol(s, nullptr, 0);
+    }
+}
+
+// m61_canary_size()
+//    Return the number of bytes reserved after each payload.
+static inline size_t m61_canary_size() {
+    return m61_check_level > 0 ? M61_CANARY_SIZE : 0;
+}
+
+static inline uint64_t m61_canary(const void* ptr) {
+    return M61_CANARY ^ reinterpret_cast<uintptr_t>(ptr);
+}
+
+static bool m61_huge_contains(const void* ptr) {
+    std::lock_guard guard(m61_central_lock);
+    for (m61_huge* hb = m61_huge_blocks; hb; hb = hb->next) {
+        if (reinterpret_cast<m61_header*>(hb + 1) + 1 == ptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// m61_check_alloc(b)
+//    Mark new block `b` as allocated and write its canary.
+static inline void m61_check_alloc(m61_block b) {
+    if (m61_check_level <= 0) {
+        return;
+    }
+    uint64_t canary = m61_canary(b.ptr);
+    memcpy(b.ptr + b.size(), &canary, sizeof(canary));
+    if (m61_buffer_range* r = m61_range_of(b.ptr)) {
+        m61_granule(r, b.ptr).store(M61_GRANULE_LIVE, std::memory_order_relaxed);
+    }
+}
+
+[[noreturn]] static void m61_report_bad_free(void* ptr, const char* file, int line);
+[[noreturn]] static void m61_report_wild_write(void* ptr, const char* file, int line);
+
+// m61_check_free(b, file, line, release)
+//    Abort with a report unless `b` is an active allocation with an
+//    intact canary. If `release`, also mark it freed.
+static inline void m61_check_free(m61_block b, const char* file, int line,
+                                  bool release) {
+    if (m61_check_level <= 0) {
+        return;
+    }
+    void* ptr = b.ptr;
+    bool ok;
+    if (reinterpret_cast<uintptr_t>(ptr) % M61_ALIGN != 0) {
+        ok = false;
+    } else if (m61_buffer_range* r = m61_range_of(ptr)) {
+        std::atomic<unsigned char>& g = m61_granule(r, ptr);
+        ok = g.load(std::memory_order_relaxed) == M61_GRANULE_LIVE;
+        if (ok && release) {
+            g.store(M61_GRANULE_FREED, std::memory_order_relaxed);
+        }
+    } else {
+        ok = m61_huge_contains(ptr);
+    }
+    if (!ok) {
+        m61_report_bad_free(ptr, file, line);
+    }
+    uint64_t canary;
+    memcpy(&canary, b.ptr + b.size(), sizeof(canary));
+    if (canary != m61_canary(ptr)) {
+        m61_report_wild_write(ptr, file, line);
+    }
+}
+
+static void m61_report_bad_free(void* ptr, const char* file, int line) {
+    m61_statistics stats = m61_get_statistics();
+    uintptr_t p = reinterpret_cast<uintptr_t>(ptr);
+    const char* what = "not allocated";
+    if (p < stats.heap_min || p > stats.heap_max) {
+        what = "not in heap";
+    } else if (m61_buffer_range* r = m61_range_of(ptr);
+               r && p % M61_ALIGN == 0) {
+        if (m61_granule(r, ptr).load(std::memory_order_relaxed) == M61_GRANULE_FREED) {
+            what = "double free";
+        }
+    }
+    fprintf(stderr, "MEMORY BUG: %s:%d: invalid free of pointer %p, %s\n",
+            file, line, ptr, what);
+    // report the containing block, if it was recorded
+    std::lock_guard guard(m61_sample_lock);
+    for (size_t i = 0; i != m61_sample_nbuckets; ++i) {
+        for (m61_sample* r = m61_sample_table[i]; r; r = r->next) {
+            uintptr_t rp = reinterpret_cast<uintptr_t>(r->ptr);
+            if (p > rp && p < rp + r->size) {
+                fprintf(stderr, "  %s:%d: %p is %zu bytes inside a %zu byte region allocated here\n",
+                        r->file, r->line, ptr, size_t(p - rp), r->size);
+            }
+        }
+    }
+    abort();
+}
+
+static void m61_report_wild_write(void* ptr, const char* file, int line) {
+    fprintf(stderr, "MEMORY BUG: %s:%d: detected wild write during free of pointer %p\n",
+            file, line, ptr);
+    abort();
+}
+
+
+// m61_alloc_block(tc, sz, clean)
+//    Allocate a block for `sz` bytes (at most `M61_MAX_SIZE` plus the
+//    canary) and return it; its `ptr` is `nullptr` on failure. If `clean`
+//    is nonnull, sets `*clean` to the start of the block's known-zero
+//    suffix.
+
+static inline m61_block m61_alloc_block(m61_tcache& tc, size_t sz,
+                                        char** clean = nullptr) {
+    if (sz <= M61_SMALL_MAX) {
+        // Small object: pop this thread's magazine
+        unsigned cls = m61_size_class(sz);
+        m61_magazine& m = tc.mag[cls];
+        if (m.n == 0) {
+            m61_tcache_refill(cls);
+            if (m.n == 0) {
+                return {};
+            }
+        }
+        char* ptr = m.obj[--m.n];
+        if (clean) {
+            *clean = ptr + sz;
+        }
+        return {ptr, m61_run_of(ptr)};
+    } else if (sz > M61_HUGE_THRESHOLD) {
+        m61_header* h = m61_huge_alloc(sz);
+        if (!h) {
+            return {};
+        }
+        if (clean) {
+            *clean = reinterpret_cast<char*>(h + 1);   // fresh mapping
+        }
+        return m61_header_block(h);
+    } else {
+        // Large object: boundary-tag block with an `m61_header` after the tag
+        size_t bsz = (sizeof(m61_btag) + sizeof(m61_header) + sz + M61_ALIGN - 1)
+            & ~(M61_ALIGN - 1);
+        std::unique_lock guard(m61_central_lock);
+        m61_btag* t = m61_large_alloc_locked(bsz, clean);
+        guard.unlock();
+        if (!t) {
+            return {};
+        }
+        auto h = reinterpret_cast<m61_header*>(t + 1);
+        h->cls = M61_LARGE;
+        return m61_header_block(h);
+    }
+}
+
+
+// m61_dealloc_block(tc, b)
+//    Return block `b` to the heap.
+
+static inline void m61_dealloc_block(m61_tcache& tc, m61_block b) {
+    if (b.run) {
+        unsigned owner = b.slot().owner;
+        if (owner != tc.owner && owner != 0
+            && m61_owner[owner].load(std::memory_order_relaxed) == M61_OWNER_LIVE) {
+            // Another live thread's small object: return it to that thread
+            m61_remote_free(tc, b, owner);
+            return;
+        }
+        // Small object: push onto this thread's magazine
+        m61_magazine& m = tc.mag[b.run->cls];
+        if (m.n == M61_MAG_SIZE) {
+            std::lock_guard guard(m61_central_lock);
+            m61_tcache_flush_locked(&tc, b.run->cls, M61_MAG_BATCH);
+        }
+        m.obj[m.n++] = b.ptr;
+    } else if (b.header()->cls == M61_HUGE) {
+        m61_huge_free(b.header());
+    } else {
+        std::lock_guard guard(m61_central_lock);
+        m61_block_free(reinterpret_cast<m61_btag*>(b.header()) - 1);
+    }
+}
+
+
+// m61_finish_alloc(tc, b, sz, file, line)
+//    Initialize new block `b` for `sz` bytes, account for it, and return
+//    its payload.
+
+static inline void* m61_finish_alloc(m61_tcache& tc, m61_block b, size_t sz,
+                                     const char* file, int line) {
+    b.init(sz, tc.owner);
+    m61_check_alloc(b);
+    tc.stats.note_alloc(b.ptr, sz);
+    tc.sites.note(file, line, 1, sz);
+    if (m61_should_sample(tc, sz)) {
+        m61_sample_record(tc, b, file, line);
+    }
+    return b.ptr;
+}
 
 
 /// m61_malloc(sz, file, line)
@@ -44,17 +1904,16 @@ m61_memory_buffer::~m61_memory_buffer() {
 ///    The allocation request was made at source code location `file`:`line`.
 
 void* m61_malloc(size_t sz, const char* file, int line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
-    // Your code here.
-    if (default_buffer.pos + sz > default_buffer.size) {
-        // Not enough space left in default buffer for allocation
+    m61_tcache& tc = m61_tcache_self();
+    m61_block b;
+    if (sz <= M61_MAX_SIZE) {
+        b = m61_alloc_block(tc, sz + m61_canary_size());
+    }
+    if (!b.ptr) {
+        tc.stats.note_fail(sz);
         return nullptr;
     }
-
-    // Otherwise there is enough space; claim the next `sz` bytes
-    void* ptr = &default_buffer.buffer[default_buffer.pos];
-    default_buffer.pos += sz;
-    return ptr;
+    return m61_finish_alloc(tc, b, sz, file, line);
 }
 
 
@@ -65,9 +1924,17 @@ void* m61_malloc(size_t sz, const char* file, int line) {
 ///    `file`:`line`.
 
 void m61_free(void* ptr, const char* file, int line) {
-    // avoid uninitialized variable warnings
-    (void) ptr, (void) file, (void) line;
-    // Your code here. The handout code does nothing!
+    if (!ptr) {
+        return;
+    }
+    m61_tcache& tc = m61_tcache_self();
+    m61_block b = m61_block_of(ptr);
+    m61_check_free(b, file, line, true);
+    tc.stats.note_free(b.size());
+    if (b.sampled()) {
+        m61_sample_forget(tc, b);
+    }
+    m61_dealloc_block(tc, b);
 }
 
 
@@ -75,16 +1942,138 @@ void m61_free(void* ptr, const char* file, int line) {
 ///    Returns a pointer a fresh dynamic memory allocation big enough to
 ///    hold an array of `count` elements of `sz` bytes each. Returned
 ///    memory is initialized to zero. The allocation request was at
-///    location `file`:`line`. Returns `nullptr` if out of memory; may
-///    also return `nullptr` if `count == 0` or `size == 0`.
+///    location `file`:`line`. Returns `nullptr` if out of memory or if
+///    `count * sz` overflows; may also return `nullptr` if `count == 0`
+///    or `size == 0`. Memory known to be fresh from the OS is not zeroed
+///    again.
 
 void* m61_calloc(size_t count, size_t sz, const char* file, int line) {
-    // Your code here (not needed for first tests).
-    void* ptr = m61_malloc(count * sz, file, line);
-    if (ptr) {
-        memset(ptr, 0, count * sz);
+    m61_tcache& tc = m61_tcache_self();
+    size_t n;
+    if (__builtin_mul_overflow(count, sz, &n) || n > M61_MAX_SIZE) {
+        tc.stats.note_fail(SIZE_MAX);
+        return nullptr;
     }
-    return ptr;
+    char* clean;
+    m61_block b = m61_alloc_block(tc, n + m61_canary_size(), &clean);
+    if (!b.ptr) {
+        tc.stats.note_fail(n);
+        return nullptr;
+    }
+    // zero only memory that might have been used before
+    if (clean > b.ptr) {
+        memset(b.ptr, 0, std::min(n, size_t(clean - b.ptr)));
+    }
+    return m61_finish_alloc(tc, b, n, file, line);
+}
+
+
+/// m61_realloc(ptr, sz, file, line)
+///    Changes the size of the dynamic allocation pointed to by `ptr` to
+///    `sz` bytes and returns a pointer to the (possibly moved) allocation,
+///    whose first bytes are unchanged. Blocks grow in place when they can;
+///    huge blocks are moved with `mremap`. `m61_realloc(nullptr, sz)` acts
+///    like `m61_malloc(sz)`. If `sz == 0`, frees `ptr` and returns
+///    `nullptr`. On failure returns `nullptr` and leaves `ptr` alone.
+
+void* m61_realloc(void* ptr, size_t sz, const char* file, int line) {
+    if (!ptr) {
+        return m61_malloc(sz, file, line);
+    } else if (sz == 0) {
+        m61_free(ptr, file, line);
+        return nullptr;
+    }
+    m61_tcache& tc = m61_tcache_self();
+    m61_block b = m61_block_of(ptr);
+    m61_check_free(b, file, line, false);
+    m61_block nb;
+    size_t isz = sz + m61_canary_size();
+    if (sz > M61_MAX_SIZE) {
+        // fail
+    } else if (b.run) {
+        if (isz <= M61_SMALL_MAX && m61_size_class(isz) == b.run->cls) {
+            nb = b;
+        }
+    } else if (b.header()->cls == M61_HUGE) {
+        if (isz > M61_HUGE_THRESHOLD / 2) {
+            if (m61_header* nh = m61_huge_resize(b.header(), isz)) {
+                nb = m61_header_block(nh);
+            }
+        }
+    } else if (isz > M61_SMALL_MAX) {
+        size_t bsz = (sizeof(m61_btag) + sizeof(m61_header) + isz + M61_ALIGN - 1)
+            & ~(M61_ALIGN - 1);
+        std::lock_guard guard(m61_central_lock);
+        if (m61_block_resize(reinterpret_cast<m61_btag*>(b.header()) - 1, bsz)) {
+            nb = b;
+        }
+    }
+
+    if (!nb.ptr) {
+        // fall back to copying
+        void* nptr = m61_malloc(sz, file, line);
+        if (nptr) {
+            memcpy(nptr, ptr, std::min(sz, b.size()));
+            m61_free(ptr, file, line);
+        }
+        return nptr;
+    }
+
+    // resized in place: account as a free followed by an allocation
+    if (nb.sampled()) {
+        m61_sample_forget(tc, nb);
+    }
+    tc.stats.note_free(nb.size());
+    return m61_finish_alloc(tc, nb, sz, file, line);
+}
+
+
+/// m61_aligned_alloc(align, sz, file, line)
+///    Returns a pointer to `sz` bytes of fresh dynamic memory aligned to
+///    an `align`-byte boundary. `align` must be a power of two. Returns
+///    `nullptr` if out of memory or if `align` is invalid.
+
+void* m61_aligned_alloc(size_t align, size_t sz, const char* file, int line) {
+    if (align <= M61_ALIGN && align != 0 && (align & (align - 1)) == 0) {
+        return m61_malloc(sz, file, line);
+    }
+    m61_tcache& tc = m61_tcache_self();
+    m61_header* h = nullptr;
+    if (align == 0 || (align & (align - 1)) != 0
+        || sz > M61_MAX_SIZE || align > M61_MAX_SIZE) {
+        // invalid
+    } else if (sz + align > M61_HUGE_THRESHOLD) {
+        h = m61_huge_aligned_alloc(align, sz + m61_canary_size());
+    } else {
+        size_t bsz = (sizeof(m61_btag) + sizeof(m61_header) + sz
+                      + m61_canary_size() + M61_ALIGN - 1)
+            & ~(M61_ALIGN - 1);
+        std::unique_lock guard(m61_central_lock);
+        m61_btag* t = m61_large_aligned_alloc_locked(align, bsz);
+        guard.unlock();
+        if (t) {
+            h = reinterpret_cast<m61_header*>(t + 1);
+            h->cls = M61_LARGE;
+        }
+    }
+    if (!h) {
+        tc.stats.note_fail(sz);
+        return nullptr;
+    }
+    return m61_finish_alloc(tc, m61_header_block(h), sz, file, line);
+}
+
+
+/// m61_usable_size(ptr)
+///    Returns the number of bytes usable at `ptr`, which must point to an
+///    active allocation: the size it was allocated with. Returns 0 if
+///    `ptr == nullptr`.
+
+size_t m61_usable_size(void* ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    return m61_block_of(ptr).size();
 }
 
 
@@ -92,10 +2081,16 @@ void* m61_calloc(size_t count, size_t sz, const char* file, int line) {
 ///    Return the current memory statistics.
 
 m61_statistics m61_get_statistics() {
-    // Your code here.
-    // The handout code sets all statistics to enormous numbers.
-    m61_statistics stats;
-    memset(&stats, 255, sizeof(m61_statistics));
+    m61_statistics stats = {};
+    stats.heap_min = UINTPTR_MAX;
+    std::lock_guard guard(m61_central_lock);
+    for (m61_tcache* tc = m61_tcaches; tc; tc = tc->next) {
+        tc->stats.accumulate(stats);
+    }
+    m61_retired.accumulate(stats);
+    if (stats.heap_min > stats.heap_max) {
+        stats.heap_min = stats.heap_max = 0;
+    }
     return stats;
 }
 
@@ -117,5 +2112,265 @@ void m61_print_statistics() {
 ///    memory.
 
 void m61_print_leak_report() {
-    // Your code here.
+    std::lock_guard guard(m61_sample_lock);
+    double estimate = 0;
+    for (size_t i = 0; i != m61_sample_nbuckets; ++i) {
+        for (m61_sample* r = m61_sample_table[i]; r; r = r->next) {
+            printf("LEAK CHECK: %s:%d: allocated object %p with size %zu\n",
+                   r->file, r->line, r->ptr, r->size);
+            estimate += m61_sample_weight(r->size);
+        }
+    }
+    if (m61_sample_interval != 0 && m61_sample_count != 0) {
+        printf("LEAK CHECK: %zu sampled objects, about %.0f bytes leaked\n",
+               m61_sample_count, estimate);
+    }
+}
+
+
+/// m61_print_heavy_hitters(pct)
+///    Prints the allocation call sites responsible for more than `pct`
+///    percent of all allocated bytes, heaviest first.
+
+void m61_print_heavy_hitters(double pct) {
+    // merge every thread's table into scratch memory (not from m61!)
+    struct merged {
+        const char* file;
+        int line;
+        unsigned long long count;
+        unsigned long long nbytes;
+    };
+    constexpr size_t cap = 4 * M61_NSITES;
+    size_t mapsize = cap * sizeof(merged);
+    void* map = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    auto ms = static_cast<merged*>(map);
+    ms[0] = {"?", 0, 0, 0};     // sites that found no slot
+    size_t n = 1;
+    unsigned long long total = 0;
+
+    auto merge = [&] (const char* file, int line,
+                      unsigned long long count, unsigned long long nbytes) {
+        total += nbytes;
+        size_t i = 0;
+        while (i != n && (ms[i].file != file || ms[i].line != line)) {
+            ++i;
+        }
+        if (i == n && n != cap) {
+            ms[n] = {file, line, 0, 0};
+            ++n;
+        } else if (i == n) {
+            i = 0;
+        }
+        ms[i].count += count;
+        ms[i].nbytes += nbytes;
+    };
+    auto merge_table = [&] (const m61_site_table& t) {
+        for (const m61_site& st : t.site) {
+            if (const char* f = st.file.load(std::memory_order_acquire)) {
+                merge(f, st.line.load(std::memory_order_relaxed),
+                      st.count.get(), st.nbytes.get());
+            }
+        }
+        merge("?", 0, t.other_count.get(), t.other_nbytes.get());
+    };
+
+    {
+        std::lock_guard guard(m61_central_lock);
+        for (m61_tcache* tc = m61_tcaches; tc; tc = tc->next) {
+            merge_table(tc->sites);
+        }
+        merge_table(m61_retired_sites);
+    }
+
+    std::sort(ms, ms + n, [] (const merged& a, const merged& b) {
+        return a.nbytes > b.nbytes;
+    });
+    for (size_t i = 0; i != n; ++i) {
+        double share = total ? 100.0 * ms[i].nbytes / total : 0;
+        if (share <= pct) {
+            break;
+        }
+        printf("HEAVY HITTER: %s:%d: %llu bytes (~%.1f%%) in %llu allocations\n",
+               ms[i].file, ms[i].line, ms[i].nbytes, share, ms[i].count);
+    }
+    munmap(map, mapsize);
+}
+
+
+
+/// m61_dump_profile(fd)
+///    Writes a one-line JSON allocation profile to file descriptor `fd`:
+///    `size_hist` counts allocations by requested size, where bucket k
+///    holds sizes in [2^(k-1), 2^k) (bucket 0 holds size 0);
+///    `lifetime_hist` counts frees by the block's age in allocations,
+///    bucketed the same way and estimated from the allocation samples;
+///    and `classes` gives each size class's runs, object slots, and
+///    slots in use (including objects cached by threads).
+
+void m61_dump_profile(int fd) {
+    unsigned long long sizes[M61_HIST_BUCKETS] = {};
+    unsigned long nruns[M61_NCLASSES], ninuse[M61_NCLASSES];
+    {
+        std::lock_guard guard(m61_central_lock);
+        auto add = [&] (const m61_counters& c) {
+            for (unsigned b = 0; b != M61_HIST_BUCKETS; ++b) {
+                sizes[b] += c.size_hist[b].get();
+            }
+        };
+        for (m61_tcache* tc = m61_tcaches; tc; tc = tc->next) {
+            add(tc->stats);
+        }
+        add(m61_retired);
+        std::copy(m61_class_nruns, m61_class_nruns + M61_NCLASSES, nruns);
+        std::copy(m61_class_ninuse, m61_class_ninuse + M61_NCLASSES, ninuse);
+    }
+    double lifetimes[M61_HIST_BUCKETS];
+    {
+        std::lock_guard guard(m61_sample_lock);
+        std::copy(m61_lifetime_hist, m61_lifetime_hist + M61_HIST_BUCKETS,
+                  lifetimes);
+    }
+
+    // format into a local buffer (not from m61!)
+    char buf[8192];
+    size_t len = 0;
+    auto print = [&] (const char* fmt, auto... args) {
+        int n = snprintf(buf + len, sizeof(buf) - len, fmt, args...);
+        len = std::min(len + std::max(n, 0), sizeof(buf) - 1);
+    };
+    unsigned nsizes = M61_HIST_BUCKETS, nlifetimes = M61_HIST_BUCKETS;
+    while (nsizes > 1 && sizes[nsizes - 1] == 0) {
+        --nsizes;
+    }
+    while (nlifetimes > 1 && lifetimes[nlifetimes - 1] == 0) {
+        --nlifetimes;
+    }
+    print("{\"sample_interval\":%zu, \"size_hist\":[", m61_sample_interval);
+    for (unsigned b = 0; b != nsizes; ++b) {
+        print(b ? ",%llu" : "%llu", sizes[b]);
+    }
+    print("], \"lifetime_hist\":[");
+    for (unsigned b = 0; b != nlifetimes; ++b) {
+        print(b ? ",%.0f" : "%.0f", lifetimes[b]);
+    }
+    print("], \"classes\":[");
+    for (unsigned cls = 0; cls != M61_NCLASSES; ++cls) {
+        size_t per_run = m61_slab_layout.nobjects[cls];
+        print("%s{\"size\":%zu, \"runs\":%lu, \"slots\":%lu, \"in_use\":%lu}",
+              cls ? ", " : "", m61_class_size[cls], nruns[cls],
+              nruns[cls] * per_run, ninuse[cls]);
+    }
+    print("]}\n");
+
+    size_t off = 0;
+    while (off != len) {
+        ssize_t nw = write(fd, buf + off, len - off);
+        if (nw > 0) {
+            off += nw;
+        } else if (nw == 0 || (errno != EINTR && errno != EAGAIN)) {
+            return;
+        }
+    }
+}
+
+// REGION ARENAS
+//    An `m61_arena` bump-allocates from a list of mmap'd chunks, each
+//    headed by an `m61_memory_buffer` exactly like a heap buffer. Frees
+//    are no-ops; `m61_arena_reset` unmaps every chunk but the newest
+//    (largest) and rewinds it, so after the first few resets a reset is
+//    O(1). Chunk sizes double, as heap buffers do. The descriptor itself
+//    comes from the m61 heap but is not counted in statistics; arena
+//    allocations are, and a reset frees them all at once. An arena is not
+//    thread-safe.
+
+struct m61_arena {
+    m61_memory_buffer* chunks;  // newest first
+    size_t next_chunk_size;
+    unsigned long long nactive; // allocations since the last reset
+    unsigned long long active_size;
+};
+
+m61_arena* m61_arena_create(size_t chunk_size) {
+    m61_tcache& tc = m61_tcache_self();
+    m61_block b = m61_alloc_block(tc, sizeof(m61_arena));
+    if (!b.ptr) {
+        return nullptr;
+    }
+    b.init(sizeof(m61_arena), tc.owner);
+    auto arena = new (b.ptr) m61_arena;
+    arena->chunks = nullptr;
+    arena->next_chunk_size = std::max(chunk_size, size_t(64) << 10);
+    arena->nactive = arena->active_size = 0;
+    return arena;
+}
+
+void* m61_arena_alloc(m61_arena* arena, size_t sz, const char* file, int line) {
+    m61_tcache& tc = m61_tcache_self();
+    size_t asz = (sz + M61_ALIGN - 1) & ~(M61_ALIGN - 1);
+    m61_memory_buffer* c = arena->chunks;
+    if (sz > M61_MAX_SIZE) {
+        tc.stats.note_fail(sz);
+        return nullptr;
+    }
+    if (!c || c->size - c->pos < std::max(asz, M61_ALIGN)) {
+        size_t csz = arena->next_chunk_size;
+        if (asz > csz - M61_BUFFER_HEADER) {
+            csz = (asz + M61_BUFFER_HEADER + M61_PAGESIZE - 1) & ~(M61_PAGESIZE - 1);
+        }
+        void* map = mmap(nullptr, csz, PROT_READ | PROT_WRITE,
+                         MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (map == MAP_FAILED) {
+            tc.stats.note_fail(sz);
+            return nullptr;
+        }
+        char* buf = static_cast<char*>(map);
+        c = new (buf) m61_memory_buffer(buf + M61_BUFFER_HEADER,
+                                        csz - M61_BUFFER_HEADER);
+        c->next = arena->chunks;
+        arena->chunks = c;
+        arena->next_chunk_size = std::min(csz * 2, M61_BUFFER_MAX_GROWTH);
+    }
+    void* ptr = c->buffer + c->pos;
+    c->pos += std::max(asz, M61_ALIGN);  // distinct pointers for `sz == 0`
+    c->hwm = std::max(c->hwm, c->pos);
+    ++arena->nactive;
+    arena->active_size += sz;
+    tc.stats.note_alloc(ptr, sz);
+    tc.sites.note(file, line, 1, sz);
+    return ptr;
+}
+
+// m61_arena_unmap(c)
+//    Unmap arena chunk `c`.
+static void m61_arena_unmap(m61_memory_buffer* c) {
+    munmap(c->buffer - M61_BUFFER_HEADER, c->size + M61_BUFFER_HEADER);
+}
+
+void m61_arena_reset(m61_arena* arena) {
+    m61_tcache& tc = m61_tcache_self();
+    tc.stats.nactive.add(-arena->nactive);
+    tc.stats.active_size.add(-arena->active_size);
+    arena->nactive = arena->active_size = 0;
+    if (m61_memory_buffer* c = arena->chunks) {
+        while (m61_memory_buffer* old = c->next) {
+            c->next = old->next;
+            m61_arena_unmap(old);
+        }
+        c->pos = 0;
+    }
+}
+
+void m61_arena_destroy(m61_arena* arena) {
+    if (!arena) {
+        return;
+    }
+    m61_arena_reset(arena);
+    if (m61_memory_buffer* c = arena->chunks) {
+        m61_arena_unmap(c);
+    }
+    m61_dealloc_block(m61_tcache_self(), m61_block_of(arena));
 }
@@ -5,6 +5,7 @@
 #include <cinttypes>
 #include <cstdio>
 #include <new>
+#include <mutex>
 #include <random>
 
 
@@ -22,6 +23,21 @@ void m61_free(void* ptr, const char* file = __builtin_FILE(), int line = __built
 ///    is initialized to zero.
 void* m61_calloc(size_t count, size_t sz, const char* file = __builtin_FILE(), int line = __builtin_LINE());
 
+/// m61_realloc(ptr, sz, file, line)
+///    Change the size of the allocation pointed to by `ptr` to `sz` bytes,
+///    growing it in place when possible. Return a pointer to the
+///    allocation, which may have moved, or `nullptr` on failure.
+void* m61_realloc(void* ptr, size_t sz, const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+/// m61_aligned_alloc(align, sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated dynamic memory
+///    aligned to `align` bytes, which must be a power of two.
+void* m61_aligned_alloc(size_t align, size_t sz, const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+/// m61_usable_size(ptr)
+///    Return the number of bytes usable in the active allocation `ptr`.
+size_t m61_usable_size(void* ptr);
+
 
 /// m61_statistics
 ///    Structure tracking memory statistics.
@@ -49,6 +65,39 @@ void m61_print_statistics();
 ///    memory.
 void m61_print_leak_report();
 
+/// m61_print_heavy_hitters(pct)
+///    Print the allocation call sites responsible for more than `pct`
+///    percent of allocated bytes.
+void m61_print_heavy_hitters(double pct = 10);
+
+/// m61_dump_profile(fd)
+///    Write a JSON profile of allocation sizes, block lifetimes, and
+///    size-class occupancy to file descriptor `fd`.
+void m61_dump_profile(int fd = 100);
+
+
+/// m61_arena
+///    A region of dynamic memory whose allocations are released together.
+struct m61_arena;
+
+/// m61_arena_create(chunk_size)
+///    Return a new, empty arena that maps memory `chunk_size` bytes (or
+///    more) at a time, or `nullptr` if out of memory.
+m61_arena* m61_arena_create(size_t chunk_size = 0);
+
+/// m61_arena_alloc(arena, sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated memory in `arena`.
+///    This memory is never freed individually.
+void* m61_arena_alloc(m61_arena* arena, size_t sz, const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+/// m61_arena_reset(arena)
+///    Free every allocation in `arena` at once.
+void m61_arena_reset(m61_arena* arena);
+
+/// m61_arena_destroy(arena)
+///    Free every allocation in `arena`, and `arena` itself.
+void m61_arena_destroy(m61_arena* arena);
+
 
 /// This magic class lets standard C++ containers use your allocator
 /// instead of the system allocator.
@@ -61,7 +110,11 @@ public:
     template <typename U> m61_allocator(m61_allocator<U>&) noexcept {}
 
     T* allocate(size_t n) {
-        return reinterpret_cast<T*>(m61_malloc(n * sizeof(T), "?", 0));
+        size_t sz;
+        if (__builtin_mul_overflow(n, sizeof(T), &sz)) {
+            sz = SIZE_MAX;      // fails
+        }
+        return reinterpret_cast<T*>(m61_malloc(sz, "?", 0));
     }
     void deallocate(T* ptr, size_t) {
         m61_free(ptr, "?", 0);
@@ -72,6 +125,131 @@ inline constexpr bool operator==(const m61_allocator<T>&, const m61_allocator<U>
     return true;
 }
 
+/// m61_pool<T>
+///    A pool of fixed-size objects of type `T`. Objects are carved from
+///    slabs of `SlabSize` bytes obtained from `m61_malloc`; freed objects
+///    go on an intrusive free list, so objects have no per-object header.
+///    Slabs are returned to m61 when the pool is destroyed. Not
+///    thread-safe.
+template <typename T, size_t SlabSize = 64 << 10>
+class m61_pool {
+public:
+    m61_pool() noexcept = default;
+    m61_pool(const m61_pool<T, SlabSize>&) = delete;
+    m61_pool<T, SlabSize>& operator=(const m61_pool<T, SlabSize>&) = delete;
+    ~m61_pool() {
+        while (slab* s = slabs_) {
+            slabs_ = s->next;
+            m61_free(s, "?", 0);
+        }
+    }
+
+    T* allocate() {
+        if (!free_) {
+            refill();
+            if (!free_) {
+                return nullptr;
+            }
+        }
+        node* n = free_;
+        free_ = n->next;
+        return reinterpret_cast<T*>(n);
+    }
+    void deallocate(T* ptr) noexcept {
+        node* n = reinterpret_cast<node*>(ptr);
+        n->next = free_;
+        free_ = n;
+    }
+
+private:
+    union node {
+        node* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+    struct slab {
+        slab* next;
+    };
+    static constexpr size_t first = (sizeof(slab) + alignof(node) - 1)
+        / alignof(node) * alignof(node);
+    static constexpr size_t per_slab = (SlabSize - first) / sizeof(node);
+    static_assert(alignof(node) <= 16, "m61_pool objects are over-aligned");
+    static_assert(per_slab > 0, "m61_pool slabs are too small");
+
+    node* free_ = nullptr;
+    slab* slabs_ = nullptr;
+
+    void refill() {
+        slab* s = reinterpret_cast<slab*>(m61_malloc(SlabSize, "?", 0));
+        if (!s) {
+            return;
+        }
+        s->next = slabs_;
+        slabs_ = s;
+        node* ns = reinterpret_cast<node*>(reinterpret_cast<char*>(s) + first);
+        for (size_t i = per_slab; i != 0; --i) {
+            ns[i - 1].next = free_;
+            free_ = &ns[i - 1];
+        }
+    }
+};
+
+
+/// m61_node_allocator<T>
+///    Like `m61_allocator`, but single-object allocations (the nodes of
+///    `std::map`, `std::list`, and friends) come from a process-wide,
+///    lock-protected `m61_pool<T>`. Array allocations fall through to
+///    `m61_malloc`. The shared pools are never destroyed, so their slabs
+///    outlive every container.
+template <typename T>
+class m61_node_allocator {
+public:
+    using value_type = T;
+    m61_node_allocator() noexcept = default;
+    m61_node_allocator(const m61_node_allocator<T>&) noexcept = default;
+    template <typename U> m61_node_allocator(const m61_node_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        T* ptr;
+        if (n == 1) {
+            std::lock_guard guard(shared().lock);
+            ptr = shared().pool.allocate();
+        } else {
+            size_t sz;
+            if (__builtin_mul_overflow(n, sizeof(T), &sz)) {
+                throw std::bad_alloc();
+            }
+            ptr = reinterpret_cast<T*>(m61_malloc(sz, "?", 0));
+        }
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+    void deallocate(T* ptr, size_t n) {
+        if (n == 1) {
+            std::lock_guard guard(shared().lock);
+            shared().pool.deallocate(ptr);
+        } else {
+            m61_free(ptr, "?", 0);
+        }
+    }
+
+private:
+    struct shared_pool {
+        std::mutex lock;
+        m61_pool<T> pool;
+    };
+    static shared_pool& shared() {
+        static shared_pool* sp = new (storage) shared_pool;
+        return *sp;
+    }
+    alignas(shared_pool) static inline unsigned char storage[sizeof(shared_pool)];
+};
+template <typename T, typename U>
+inline constexpr bool operator==(const m61_node_allocator<T>&, const m61_node_allocator<U>&) {
+    return true;
+}
+
 /// Returns a random integer between `min` and `max`, using randomness from
 /// `randomness`.
 template <typename Engine, typename T>
@@ -0,0 +1,289 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+// Allocator microbenchmarks. Run `make bench`, or `./m61bench [-t THREADS]
+// [-n OPS] [WORKLOAD...]`. Each workload reports allocator operations per
+// second, peak resident set size, and a fragmentation ratio: peak RSS
+// over the peak active bytes reported by `m61_statistics`.
+
+static unsigned nthreads = 4;
+static unsigned long nops = 4000000;
+
+// random size with a realistic heavy-small skew
+template <typename Engine>
+static size_t random_size(Engine& randomness) {
+    unsigned r = uniform_int(0U, 99U, randomness);
+    if (r < 70) {
+        return uniform_int(size_t(1), size_t(128), randomness);
+    } else if (r < 95) {
+        return uniform_int(size_t(129), size_t(1024), randomness);
+    } else if (r < 99) {
+        return uniform_int(size_t(1025), size_t(32768), randomness);
+    } else {
+        return uniform_int(size_t(32769), size_t(262144), randomness);
+    }
+}
+
+struct frag_probe {
+    std::mutex m;
+    unsigned long long peak_active = 0;
+
+    // record the current active bytes
+    void sample() {
+        m61_statistics stat = m61_get_statistics();
+        std::lock_guard<std::mutex> guard(m);
+        peak_active = std::max(peak_active, stat.active_size);
+    }
+};
+
+
+// churn: each thread replaces random slots with random-size objects
+static unsigned long churn(unsigned long ops, frag_probe& fp) {
+    std::default_random_engine randomness(std::random_device{}());
+    std::vector<void*> slots(1024, nullptr);
+    for (unsigned long i = 0; i != ops; ++i) {
+        size_t k = uniform_int(size_t(0), slots.size() - 1, randomness);
+        m61_free(slots[k]);
+        slots[k] = m61_malloc(random_size(randomness));
+        if (i % 65536 == 0) {
+            fp.sample();
+        }
+    }
+    for (void* p : slots) {
+        m61_free(p);
+    }
+    return 2 * ops + slots.size();
+}
+
+
+// prodcons: producers allocate, consumers (other threads) free
+struct handoff {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::vector<void*>> batches;
+    bool done = false;
+};
+
+static unsigned long prodcons(unsigned long ops, frag_probe& fp) {
+    handoff h;
+    std::thread consumer([&] {
+        std::unique_lock<std::mutex> guard(h.m);
+        while (true) {
+            h.cv.wait(guard, [&] { return !h.batches.empty() || h.done; });
+            if (h.batches.empty()) {
+                return;
+            }
+            std::vector<void*> batch = std::move(h.batches.front());
+            h.batches.pop_front();
+            guard.unlock();
+            for (void* p : batch) {
+                m61_free(p);
+            }
+            guard.lock();
+        }
+    });
+    std::default_random_engine randomness(std::random_device{}());
+    std::vector<void*> batch;
+    for (unsigned long i = 0; i != ops; ++i) {
+        batch.push_back(m61_malloc(uniform_int(size_t(8), size_t(512), randomness)));
+        if (batch.size() == 256) {
+            fp.sample();
+            std::lock_guard<std::mutex> guard(h.m);
+            h.batches.push_back(std::move(batch));
+            batch.clear();
+            h.cv.notify_one();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(h.m);
+        h.batches.push_back(std::move(batch));
+        h.done = true;
+        h.cv.notify_one();
+    }
+    consumer.join();
+    return 2 * ops;
+}
+
+
+// larson: like churn, but in generations: each thread's successor
+// inherits its objects, so most frees are of objects allocated by
+// threads that have exited
+static std::vector<std::vector<void*>> larson_slots;
+
+static void larson_round(unsigned tid, unsigned long ops, frag_probe& fp) {
+    std::default_random_engine randomness(std::random_device{}());
+    std::vector<void*>& slots = larson_slots[tid];
+    for (unsigned long i = 0; i != ops; ++i) {
+        size_t k = uniform_int(size_t(0), slots.size() - 1, randomness);
+        m61_free(slots[k]);
+        slots[k] = m61_malloc(uniform_int(size_t(10), size_t(500), randomness));
+    }
+    fp.sample();
+}
+
+static unsigned long larson(unsigned long ops, frag_probe& fp) {
+    static std::mutex lock;
+    static unsigned started = 0;
+    unsigned tid;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (larson_slots.empty()) {
+            larson_slots.assign(nthreads, std::vector<void*>(1000, nullptr));
+        }
+        tid = started++ % nthreads;
+    }
+    for (int gen = 0; gen != 10; ++gen) {
+        std::thread t(larson_round, tid, ops / 10, std::ref(fp));
+        t.join();
+    }
+    return 2 * (ops / 10) * 10;
+}
+
+static void larson_cleanup() {
+    for (auto& slots : larson_slots) {
+        for (void* p : slots) {
+            m61_free(p);
+        }
+    }
+    larson_slots.clear();
+}
+
+
+// frag: fill with small objects, free every other one, then allocate
+// objects that cannot fit in the holes
+static unsigned long frag(unsigned long ops, frag_probe& fp) {
+    std::vector<void*> ptrs;
+    unsigned long n = ops / 8;
+    for (unsigned long i = 0; i != n; ++i) {
+        ptrs.push_back(m61_malloc(48 + (i % 4) * 16));
+    }
+    for (unsigned long i = 0; i < n; i += 2) {
+        m61_free(ptrs[i]);
+        ptrs[i] = nullptr;
+    }
+    fp.sample();
+    for (unsigned long i = 0; i < n; i += 2) {
+        ptrs[i] = m61_malloc(1100 + (i % 7) * 64);
+    }
+    fp.sample();
+    for (void* p : ptrs) {
+        m61_free(p);
+    }
+    return 3 * n;
+}
+
+
+// peak RSS, in bytes, since the last `reset_peak_rss`
+static size_t peak_rss() {
+    FILE* f = fopen("/proc/self/status", "r");
+    size_t kb = 0;
+    char line[256];
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    return kb << 10;
+}
+
+static void reset_peak_rss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        ssize_t w = write(fd, "5", 1);
+        (void) w;
+        close(fd);
+    }
+}
+
+
+// Each workload runs `ops` iterations and returns its allocator calls.
+struct workload {
+    const char* name;
+    unsigned long (*run)(unsigned long ops, frag_probe& fp);
+    void (*cleanup)();
+};
+
+static workload workloads[] = {
+    {"churn", churn, nullptr},
+    {"prodcons", prodcons, nullptr},
+    {"larson", larson, larson_cleanup},
+    {"frag", frag, nullptr}
+};
+
+static void run(const workload& w) {
+    frag_probe fp;
+    reset_peak_rss();
+    std::vector<unsigned long> calls(nthreads, 0);
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> ts;
+    for (unsigned i = 0; i != nthreads; ++i) {
+        ts.emplace_back([&, i] {
+            calls[i] = w.run(nops / nthreads / 2, fp);
+        });
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    if (w.cleanup) {
+        w.cleanup();
+    }
+    double secs = std::chrono::duration<double>(t1 - t0).count();
+    double ops = 0;
+    for (unsigned long c : calls) {
+        ops += c;
+    }
+    size_t rss = peak_rss();
+    printf("%-10s %9.2f Mops/s   peak RSS %8.1f MiB   frag %6.2f\n",
+           w.name, ops / secs / 1e6, rss / 1048576.0,
+           fp.peak_active ? double(rss) / fp.peak_active : 0.0);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "t:n:")) != -1) {
+        if (ch == 't') {
+            nthreads = strtoul(optarg, nullptr, 0);
+        } else if (ch == 'n') {
+            nops = strtoul(optarg, nullptr, 0);
+        } else {
+            fprintf(stderr, "Usage: m61bench [-t THREADS] [-n OPS] [WORKLOAD...]\n");
+            return 1;
+        }
+    }
+    assert(nthreads > 0);
+    bool any = false;
+    for (const workload& w : workloads) {
+        bool wanted = optind == argc;
+        for (int i = optind; i < argc; ++i) {
+            wanted = wanted || strcmp(argv[i], w.name) == 0;
+        }
+        if (wanted) {
+            run(w);
+            any = true;
+        }
+    }
+    if (!any) {
+        fprintf(stderr, "m61bench: no such workload\n");
+        return 1;
+    }
+    m61_statistics stat = m61_get_statistics();
+    if (stat.nactive != 0) {
+        fprintf(stderr, "m61bench: %llu allocations leaked\n", stat.nactive);
+        return 1;
+    }
+}
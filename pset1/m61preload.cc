@@ -0,0 +1,185 @@
+#include "m61.hh"
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <malloc.h>
+#include <unistd.h>
+// Interposition layer for `libm61.so`: the C allocation functions and the
+// replaceable C++ `operator new`/`operator delete` set, all served by m61.
+// Run any program on m61 with `LD_PRELOAD=./libm61.so PROGRAM`. The
+// functions follow the glibc interfaces, errno settings included. Call
+// sites are unknown, so every allocation is attributed to `?:0`.
+//
+// m61 records every allocation and checks every free by default; for
+// benchmarking against glibc, set `M61_SAMPLE` (e.g., 524288) and
+// `M61_CHECK=0`.
+
+extern "C" {
+
+void* malloc(size_t sz) noexcept {
+    void* ptr = m61_malloc(sz, "?", 0);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void* ptr) noexcept {
+    m61_free(ptr, "?", 0);
+}
+
+void* calloc(size_t count, size_t sz) noexcept {
+    void* ptr = m61_calloc(count, sz, "?", 0);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t sz) noexcept {
+    void* nptr = m61_realloc(ptr, sz, "?", 0);
+    if (!nptr && sz != 0) {
+        errno = ENOMEM;
+    }
+    return nptr;
+}
+
+void* reallocarray(void* ptr, size_t count, size_t sz) noexcept {
+    size_t n;
+    if (__builtin_mul_overflow(count, sz, &n)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(ptr, n);
+}
+
+int posix_memalign(void** ptrp, size_t align, size_t sz) noexcept {
+    if (align % sizeof(void*) != 0 || (align & (align - 1)) != 0
+        || align == 0) {
+        return EINVAL;
+    }
+    void* ptr = m61_aligned_alloc(align, sz, "?", 0);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *ptrp = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t sz) noexcept {
+    void* ptr = m61_aligned_alloc(align, sz, "?", 0);
+    if (!ptr) {
+        errno = align == 0 || (align & (align - 1)) != 0 ? EINVAL : ENOMEM;
+    }
+    return ptr;
+}
+
+void* memalign(size_t align, size_t sz) noexcept {
+    return aligned_alloc(align, sz);
+}
+
+void* valloc(size_t sz) noexcept {
+    return aligned_alloc(sysconf(_SC_PAGESIZE), sz);
+}
+
+void* pvalloc(size_t sz) noexcept {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    if (sz > SIZE_MAX - pagesize) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return aligned_alloc(pagesize, (sz + pagesize - 1) & ~(pagesize - 1));
+}
+
+size_t malloc_usable_size(void* ptr) noexcept {
+    return m61_usable_size(ptr);
+}
+
+}
+
+
+// operator new: call the new handler until m61 succeeds, or throw
+static void* m61_new(size_t sz, size_t align) {
+    while (true) {
+        void* ptr = align ? m61_aligned_alloc(align, sz, "?", 0)
+            : m61_malloc(sz, "?", 0);
+        if (ptr) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+static void* m61_new_nothrow(size_t sz, size_t align) noexcept {
+    try {
+        return m61_new(sz, align);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new(size_t sz) {
+    return m61_new(sz, 0);
+}
+void* operator new[](size_t sz) {
+    return m61_new(sz, 0);
+}
+void* operator new(size_t sz, const std::nothrow_t&) noexcept {
+    return m61_new_nothrow(sz, 0);
+}
+void* operator new[](size_t sz, const std::nothrow_t&) noexcept {
+    return m61_new_nothrow(sz, 0);
+}
+void* operator new(size_t sz, std::align_val_t align) {
+    return m61_new(sz, size_t(align));
+}
+void* operator new[](size_t sz, std::align_val_t align) {
+    return m61_new(sz, size_t(align));
+}
+void* operator new(size_t sz, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return m61_new_nothrow(sz, size_t(align));
+}
+void* operator new[](size_t sz, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return m61_new_nothrow(sz, size_t(align));
+}
+
+void operator delete(void* ptr) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete[](void* ptr) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete(void* ptr, size_t) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete[](void* ptr, size_t) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    m61_free(ptr, "?", 0);
+}
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    m61_free(ptr, "?", 0);
+}
@@ -0,0 +1,21 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that the heavy-hitter report finds the dominant call sites.
+
+int main() {
+    for (int i = 0; i != 300; ++i) {
+        m61_free(m61_malloc(1000));
+    }
+    for (int i = 0; i != 1000; ++i) {
+        m61_free(m61_malloc(100));
+    }
+    for (int i = 0; i != 100; ++i) {
+        m61_free(m61_malloc(10));
+    }
+    m61_print_heavy_hitters(5);
+}
+
+//! HEAVY HITTER: test???.cc:9: 300000 bytes (~74.8%) in 300 allocations
+//! HEAVY HITTER: test???.cc:12: 100000 bytes (~24.9%) in 1000 allocations
@@ -0,0 +1,54 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <map>
+// Check m61_pool and m61_node_allocator.
+
+struct point {
+    long x, y;
+};
+
+int main() {
+    {
+        m61_pool<point> pool;
+        point* ps[5000];
+        for (int i = 0; i != 5000; ++i) {
+            ps[i] = pool.allocate();
+            assert(ps[i]);
+            ps[i]->x = ps[i]->y = i;
+        }
+        for (int i = 0; i < 5000; i += 2) {
+            pool.deallocate(ps[i]);
+        }
+        for (int i = 1; i < 5000; i += 2) {
+            assert(ps[i]->x == i && ps[i]->y == i);
+        }
+        // Freed objects are reused before new slabs are allocated
+        point* p = pool.allocate();
+        assert(p == ps[4998]);
+        m61_statistics stat = m61_get_statistics();
+        printf("pool slabs: %llu\n", stat.nactive);
+    }
+    m61_statistics stat = m61_get_statistics();
+    printf("after pool: %llu\n", stat.nactive);
+
+    std::map<int, int, std::less<int>, m61_node_allocator<std::pair<const int, int>>> m;
+    for (int i = 0; i != 10000; ++i) {
+        m[i] = i * i;
+    }
+    for (int i = 0; i < 10000; i += 3) {
+        m.erase(i);
+    }
+    for (int i = 0; i != 10000; ++i) {
+        assert(m.count(i) == (i % 3 != 0));
+    }
+    stat = m61_get_statistics();
+    // map nodes are far fewer allocations than map entries
+    assert(stat.ntotal < 100);
+    printf("OK\n");
+}
+
+//! pool slabs: 2
+//! after pool: 0
+//! OK
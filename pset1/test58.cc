@@ -0,0 +1,38 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check m61_arena allocation, statistics, and bulk reset.
+
+int main() {
+    m61_arena* arena = m61_arena_create();
+    assert(arena);
+    for (int round = 0; round != 3; ++round) {
+        char* ptrs[1000];
+        for (int i = 0; i != 1000; ++i) {
+            ptrs[i] = (char*) m61_arena_alloc(arena, 100 + round);
+            assert(ptrs[i]);
+            assert(reinterpret_cast<uintptr_t>(ptrs[i]) % 16 == 0);
+            memset(ptrs[i], i, 100 + round);
+        }
+        for (int i = 0; i != 1000; ++i) {
+            assert(ptrs[i][99] == char(i));
+        }
+        m61_print_statistics();
+        m61_arena_reset(arena);
+    }
+    m61_print_statistics();
+    m61_arena_destroy(arena);
+    m61_print_statistics();
+}
+
+//! alloc count: active       1000   total       1000   fail          0
+//! alloc size:  active     100000   total     100000   fail          0
+//! alloc count: active       1000   total       2000   fail          0
+//! alloc size:  active     101000   total     201000   fail          0
+//! alloc count: active       1000   total       3000   fail          0
+//! alloc size:  active     102000   total     303000   fail          0
+//! alloc count: active          0   total       3000   fail          0
+//! alloc size:  active          0   total     303000   fail          0
+//! alloc count: active          0   total       3000   fail          0
+//! alloc size:  active          0   total     303000   fail          0
@@ -0,0 +1,41 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check m61_realloc: contents, in-place growth, and statistics.
+
+int main() {
+    // grow a buffer by doubling, from small through huge sizes
+    size_t cap = 8;
+    char* buf = (char*) m61_realloc(nullptr, cap);
+    for (size_t i = 0; i != cap; ++i) {
+        buf[i] = char(i * 7);
+    }
+    while (cap < (size_t(4) << 20)) {
+        buf = (char*) m61_realloc(buf, cap * 2);
+        assert(buf);
+        for (size_t i = 0; i != cap; ++i) {
+            assert(buf[i] == char(i * 7));
+        }
+        for (size_t i = cap; i != cap * 2; ++i) {
+            buf[i] = char(i * 7);
+        }
+        cap *= 2;
+    }
+
+    // a large block at the top of the heap grows without moving
+    char* a = (char*) m61_malloc(2000);
+    char* b = (char*) m61_realloc(a, 8000);
+    assert(a == b);
+
+    // shrinking never moves
+    char* c = (char*) m61_realloc(b, 3000);
+    assert(c == b);
+
+    m61_free(buf);
+    m61_free(c);
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total         23   fail          0
+//! alloc size:  active          0   total ???   fail          0
@@ -0,0 +1,32 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check m61_aligned_alloc.
+
+int main() {
+    void* ptrs[64];
+    int n = 0;
+    for (size_t align = 1; align <= (size_t(1) << 20); align *= 2) {
+        for (size_t sz : {1, 100, 5000, 300000}) {
+            char* p = (char*) m61_aligned_alloc(align, sz);
+            assert(p);
+            assert(reinterpret_cast<uintptr_t>(p) % align == 0);
+            memset(p, 'A', sz);
+            if (n < 64) {
+                ptrs[n++] = p;
+            } else {
+                m61_free(p);
+            }
+        }
+    }
+    for (int i = 0; i != n; ++i) {
+        m61_free(ptrs[i]);
+    }
+    assert(!m61_aligned_alloc(48, 100));
+    assert(!m61_aligned_alloc(0, 100));
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total         84   fail          2
+//! alloc size:  active          0   total   ???   fail        200
@@ -0,0 +1,34 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that m61_calloc zeroes reused memory of every kind.
+
+static void check_zero(const char* p, size_t n) {
+    for (size_t i = 0; i != n; ++i) {
+        assert(p[i] == 0);
+    }
+}
+
+int main() {
+    for (size_t sz : {24, 1000, 3000, 100000, 500000}) {
+        for (int round = 0; round != 3; ++round) {
+            char* p = (char*) m61_calloc(sz, 1);
+            assert(p);
+            check_zero(p, sz);
+            memset(p, 0xFF, sz);
+            m61_free(p);
+        }
+    }
+    // reuse a block that extends past previously-used memory
+    char* a = (char*) m61_malloc(4000);
+    memset(a, 0xFF, 4000);
+    m61_free(a);
+    char* b = (char*) m61_calloc(2, 4000);
+    check_zero(b, 8000);
+    m61_free(b);
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total         17   fail          0
+//! alloc size:  active          0   total ???   fail          0
@@ -0,0 +1,26 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that a corrupted free-list link is detected, not followed.
+
+int main() {
+    uintptr_t* ptrs[100];
+    for (int i = 0; i != 100; ++i) {
+        ptrs[i] = (uintptr_t*) m61_malloc(32);
+    }
+    for (int i = 0; i != 100; ++i) {
+        m61_free(ptrs[i]);
+    }
+    // use after free: flip a bit in each freed object's first word
+    for (int i = 0; i != 100; ++i) {
+        *ptrs[i] ^= 1;
+    }
+    for (int i = 0; i != 100; ++i) {
+        ptrs[i] = (uintptr_t*) m61_malloc(32);
+    }
+    m61_print_statistics();
+}
+
+//! MEMORY BUG: corrupted free list link at ???
+//!!ABORT
@@ -0,0 +1,24 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <unistd.h>
+// Check the JSON allocation profile.
+
+int main() {
+    // 100 blocks freed at once: age 0
+    for (int i = 0; i != 100; ++i) {
+        m61_free(m61_malloc(100));
+    }
+    // 10 blocks freed after all are allocated: ages 9 down to 0
+    void* ptrs[10];
+    for (int i = 0; i != 10; ++i) {
+        ptrs[i] = m61_malloc(1000);
+    }
+    for (int i = 0; i != 10; ++i) {
+        m61_free(ptrs[i]);
+    }
+    m61_dump_profile(STDOUT_FILENO);
+}
+
+//! {"sample_interval":0, "size_hist":[0,0,0,0,0,0,0,100,0,0,10], "lifetime_hist":[101,1,2,4,2], "classes":[{"size":16, "runs":0, "slots":0, "in_use":0}, ???{"size":1024, "runs":??>=1??, ???}]}
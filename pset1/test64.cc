@@ -0,0 +1,56 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <atomic>
+#include <thread>
+// Check that objects freed by another thread return to their allocator.
+
+static std::atomic<int> phase;
+static void* ptrs[16];
+static void* again[16];
+
+static void wait_for(int p) {
+    while (phase.load() != p) {
+        std::this_thread::yield();
+    }
+}
+
+int main() {
+    std::thread t([] {
+        for (int i = 0; i != 16; ++i) {
+            ptrs[i] = m61_malloc(100);
+        }
+        phase = 1;
+        wait_for(2);
+        for (int i = 0; i != 16; ++i) {
+            again[i] = m61_malloc(100);
+        }
+        phase = 3;
+        wait_for(4);
+    });
+
+    wait_for(1);
+    for (int i = 0; i != 16; ++i) {
+        m61_free(ptrs[i]);
+    }
+    phase = 2;
+    wait_for(3);
+    int reused = 0;
+    for (int i = 0; i != 16; ++i) {
+        for (int j = 0; j != 16; ++j) {
+            reused += again[i] == ptrs[j];
+        }
+    }
+    printf("reused %d of 16\n", reused);
+    for (int i = 0; i != 16; ++i) {
+        m61_free(again[i]);
+    }
+    phase = 4;
+    t.join();
+    m61_print_statistics();
+}
+
+//! reused 16 of 16
+//! alloc count: active          0   total         32   fail          0
+//! alloc size:  active          0   total       3200   fail          0
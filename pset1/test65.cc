@@ -0,0 +1,39 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <thread>
+// Check that objects of an exited thread, freed by another, are reused.
+
+static void* ptrs[2000];
+
+int main() {
+    m61_free(m61_malloc(64));   // take an owner slot first
+    std::thread t([] {
+        for (int i = 0; i != 2000; ++i) {
+            ptrs[i] = m61_malloc(64);
+        }
+    });
+    t.join();
+
+    for (int i = 0; i != 2000; ++i) {
+        m61_free(ptrs[i]);
+    }
+    static void* again[2000];
+    int reused = 0;
+    for (int i = 0; i != 2000; ++i) {
+        again[i] = m61_malloc(64);
+        for (int j = 0; j != 2000; ++j) {
+            reused += again[i] == ptrs[j];
+        }
+    }
+    printf("reused %s\n", reused > 1000 ? "most" : "few");
+    for (int i = 0; i != 2000; ++i) {
+        m61_free(again[i]);
+    }
+    m61_print_statistics();
+}
+
+//! reused most
+//! alloc count: active          0   total       4001   fail          0
+//! alloc size:  active          0   total     256064   fail          0
@@ -0,0 +1,70 @@
+#include "ktrace.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cinttypes>
+#include <vector>
+
+// ktracedump
+//    Decode a kernel trace ring buffer saved by the `ktrace-dump` GDB
+//    command. Prints records oldest first, with timestamps relative to the
+//    oldest record, then a count of each event type.
+
+static const char* event_name(unsigned event) {
+    switch (event) {
+    case KT_EXCEPTION: return "exception";
+    case KT_SYSCALL:   return "syscall";
+    case KT_KFREE:     return "kfree";
+    case KT_SCHEDULE:  return "schedule";
+    case KT_IDLE:      return "idle";
+    default:           return "?";
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: ktracedump TRACEFILE\n");
+        return 1;
+    }
+    FILE* f = fopen(argv[1], "rb");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    static ktrace_buffer buf;
+    size_t n = fread(&buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (n != sizeof(buf) || buf.magic != KTRACE_MAGIC) {
+        fprintf(stderr, "%s: not a kernel trace dump\n", argv[1]);
+        return 1;
+    }
+
+    uint64_t first = buf.head > KTRACE_NRECORDS ? buf.head - KTRACE_NRECORDS : 0;
+    if (first != 0) {
+        printf("# %" PRIu64 " older records were overwritten\n", first);
+    }
+    std::vector<unsigned long> counts(KT_IDLE + 2, 0);
+    uint64_t tsc0 = 0;
+    for (uint64_t i = first; i != buf.head; ++i) {
+        const ktrace_record& r = buf.records[i % KTRACE_NRECORDS];
+        if (i == first) {
+            tsc0 = r.tsc;
+        }
+        printf("%14" PRIu64 "  cpu %u  pid %2d  %-9s ",
+               r.tsc - tsc0, unsigned(r.cpu), int(r.pid), event_name(r.event));
+        if (r.event == KT_KFREE) {
+            printf("%#" PRIx64 "\n", r.arg);
+        } else {
+            printf("%" PRIu64 "\n", r.arg);
+        }
+        ++counts[r.event <= KT_IDLE ? r.event : KT_IDLE + 1];
+    }
+
+    printf("#");
+    for (unsigned e = 1; e != counts.size(); ++e) {
+        if (counts[e]) {
+            printf(" %s %lu", e <= KT_IDLE ? event_name(e) : "?", counts[e]);
+        }
+    }
+    printf("\n");
+}
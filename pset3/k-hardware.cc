@@ -21,7 +21,6 @@ pcistate pcistate::state;
 static void init_kernel_memory();
 static void init_interrupts();
 static void init_constructors();
-static void init_cpu_hardware();
 static void stash_kernel_data(bool restore);
 
 void init_hardware() {
@@ -39,6 +38,7 @@ void init_hardware() {
     init_constructors();
 
     // initialize this CPU
+    this_cpu()->init(0);
     init_cpu_hardware();
 }
 
@@ -88,20 +88,20 @@ static void set_gate(x86_64_gatedescriptor* gate, uintptr_t addr,
 }
 
 x86_64_pagetable kernel_pagetable[5];
-static uint64_t gdt_segments[7];
+static uint64_t boot_gdt_segments[7];
 
 void init_kernel_memory() {
     stash_kernel_data(false);
 
     // initialize segment descriptors for kernel code and data
-    gdt_segments[0] = 0;
-    set_app_segment(&gdt_segments[SEGSEL_KERN_CODE >> 3],
+    boot_gdt_segments[0] = 0;
+    set_app_segment(&boot_gdt_segments[SEGSEL_KERN_CODE >> 3],
                     X86SEG_X | X86SEG_L, 0);
-    set_app_segment(&gdt_segments[SEGSEL_KERN_DATA >> 3],
+    set_app_segment(&boot_gdt_segments[SEGSEL_KERN_DATA >> 3],
                     X86SEG_W, 0);
     x86_64_pseudodescriptor gdt;
-    gdt.limit = sizeof(gdt_segments[0]) * 3 - 1;
-    gdt.base = (uint64_t) gdt_segments;
+    gdt.limit = sizeof(boot_gdt_segments[0]) * 3 - 1;
+    gdt.base = (uint64_t) boot_gdt_segments;
 
     asm volatile("lgdt %0" : : "m" (gdt.limit));
 
@@ -126,14 +126,13 @@ void init_kernel_memory() {
     kernel_pagetable[1].entry[3] =
         (3UL << 30) | PTE_P | PTE_W | PTE_PS;
 
-    // user-accessible mappings for physical memory,
-    // except that (for debuggability) nullptr is totally inaccessible
-    for (vmiter it(kernel_pagetable, 0);
-         it.va() < MEMSIZE_PHYSICAL;
-         it += PAGESIZE) {
-        if (it.va() != 0) {
-            it.map(it.va(), PTE_P | PTE_W | PTE_U);
-        }
+    // identity mappings for physical memory, using 2 MiB pages to save
+    // TLB entries (process page tables map the kernel with 4 KiB pages;
+    // see `process_pagetable` in kernel.cc)
+    static_assert(MEMSIZE_PHYSICAL % (1UL << 21) == 0);
+    for (uintptr_t pa = 0; pa < MEMSIZE_PHYSICAL; pa += 1UL << 21) {
+        kernel_pagetable[2].entry[pa >> 21] =
+            pa | PTE_P | PTE_W | PTE_U | PTE_PS;
     }
 
     wrcr3(kptr2pa(kernel_pagetable));
@@ -190,9 +189,20 @@ void init_constructors() {
 }
 
 
-static x86_64_taskstate taskstate;
+// cpustate::init(index)
+//    Clear this CPU's state and set its index.
+
+void cpustate::init(int i) {
+    memset(this, 0, sizeof(*this));
+    this->index = i;
+}
+
 
 void init_cpu_hardware() {
+    cpustate* c = this_cpu();
+    uint64_t* gdt_segments = c->gdt_segments;
+    x86_64_taskstate& taskstate = c->taskstate;
+
     // initialize per-CPU segments
     gdt_segments[0] = 0;
     set_app_segment(&gdt_segments[SEGSEL_KERN_CODE >> 3],
@@ -209,10 +219,10 @@ void init_cpu_hardware() {
 
     // taskstate lets the kernel receive interrupts
     memset(&taskstate, 0, sizeof(taskstate));
-    taskstate.ts_rsp[0] = KERNEL_STACK_TOP;
+    taskstate.ts_rsp[0] = c->stack_top();
 
     x86_64_pseudodescriptor gdt, idt;
-    gdt.limit = sizeof(gdt_segments) - 1;
+    gdt.limit = sizeof(c->gdt_segments) - 1;
     gdt.base = (uint64_t) gdt_segments;
     idt.limit = sizeof(interrupt_descriptors) - 1;
     idt.base = (uint64_t) interrupt_descriptors;
@@ -235,11 +245,20 @@ void init_cpu_hardware() {
     cr0 |= CR0_PE | CR0_PG | CR0_WP | CR0_AM | CR0_MP | CR0_NE;
     wrcr0(cr0);
 
+    // enable global pages, and PCIDs if the CPU supports them
+    uint64_t cr4 = rdcr4() | CR4_PGE;
+    if (cpuid(1).ecx & (1U << 17)) {
+        cr4 |= CR4_PCIDE;
+        pcid_enabled = true;
+        kernel_cr3 = kptr2pa(kernel_pagetable) | CR3_NOFLUSH;
+    }
+    wrcr4(cr4);
+
 
     // set up syscall/sysret
     wrmsr(MSR_IA32_STAR, (uintptr_t(SEGSEL_KERN_CODE) << 32)
           | (uintptr_t(SEGSEL_APP_CODE) << 48));
-    wrmsr(MSR_IA32_LSTAR, reinterpret_cast<uint64_t>(syscall_entry));
+    wrmsr(MSR_IA32_LSTAR, syscall_entries[c->index]);
     wrmsr(MSR_IA32_FMASK, EFLAGS_TF | EFLAGS_DF | EFLAGS_IF
           | EFLAGS_IOPL_MASK | EFLAGS_AC | EFLAGS_NT);
 
@@ -247,6 +266,7 @@ void init_cpu_hardware() {
     // initialize local APIC (interrupt controller)
     auto& lapic = lapicstate::get();
     lapic.enable_lapic(INT_IRQ + IRQ_SPURIOUS);
+    c->lapic_id = lapic.id();
 
     // timer is in periodic mode
     lapic.write(lapic.reg_timer_divide, lapic.timer_divide_1);
@@ -268,6 +288,40 @@ void init_cpu_hardware() {
 }
 
 
+// init_aps()
+//    Start the application processors with the INIT-SIPI-SIPI sequence.
+//    The startup IPI's vector is the physical page number of `ap_entry`,
+//    which must lie below 1 MiB.
+
+static void ap_delay(unsigned usec) {
+    for (unsigned i = 0; i != usec; ++i) {
+        inb(0x84);              // each port read takes about 1 microsecond
+    }
+}
+
+static void wait_ipi_delivered(lapicstate& lapic) {
+    while (lapic.ipi_pending()) {
+        pause();
+    }
+}
+
+void init_aps() {
+    extern char ap_entry[];
+    uintptr_t ap_entry_pa = kptr2pa(ap_entry);
+    assert(ap_entry_pa % PAGESIZE == 0 && ap_entry_pa < 0x100000);
+
+    auto& lapic = lapicstate::get();
+    lapic.ipi_others(lapic.ipi_init);
+    wait_ipi_delivered(lapic);
+    ap_delay(10000);
+    for (int i = 0; i != 2; ++i) {
+        lapic.ipi_others(lapic.ipi_startup, ap_entry_pa >> 12);
+        wait_ipi_delivered(lapic);
+        ap_delay(200);
+    }
+}
+
+
 // init_timer(rate)
 //    Set the timer interrupt to fire `rate` times a second. Disables the
 //    timer interrupt if `rate <= 0`.
@@ -286,11 +340,11 @@ void init_timer(int rate) {
 //    Allocate and return a new, empty page table.
 
 x86_64_pagetable* kalloc_pagetable() {
-    x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>(kalloc(PAGESIZE));
-    if (pt) {
-        memset(&pt->entry[0], 0, sizeof(x86_64_pagetable));
+    if (x86_64_pagetable* pt = pagetable_cache_pop()) {
+        return pt;
     }
-    return pt;
+    // `kalloc` returns zeroed memory
+    return reinterpret_cast<x86_64_pagetable*>(kalloc(PAGESIZE));
 }
 
 
@@ -310,12 +364,16 @@ void check_process_registers(const proc* p) {
 
 void check_pagetable(x86_64_pagetable* pagetable) {
     assert(((uintptr_t) pagetable % PAGESIZE) == 0); // must be page aligned
+
     assert(vmiter(pagetable, (uintptr_t) exception_entry).pa()
            == kptr2pa(exception_entry));
     assert(vmiter(kernel_pagetable, (uintptr_t) pagetable).pa()
            == kptr2pa(pagetable));
     assert(vmiter(pagetable, (uintptr_t) kernel_pagetable).pa()
            == kptr2pa(kernel_pagetable));
+    // the kernel identity-maps low memory with a 2 MiB page
+    vmiter kit(kernel_pagetable, 0);
+    assert(kit.pa() == 0 && kit.range_size() == (1UL << 21));
 }
 
 
@@ -349,7 +407,7 @@ bool allocatable_physical_address(uintptr_t pa) {
         && (pa < KERNEL_START_ADDR
             || pa >= round_up((uintptr_t) _kernel_end, PAGESIZE))
         && (pa < KERNEL_STACK_TOP - PAGESIZE
-            || pa >= KERNEL_STACK_TOP)
+            || pa >= KERNEL_STACK_TOP + (NCPU_MAX - 1) * PAGESIZE)
         && pa < MEMSIZE_PHYSICAL;
 }
 
@@ -818,7 +876,7 @@ __always_inline const regstate& backtrace_current_regs() {
 }
 
 __always_inline x86_64_pagetable* backtrace_current_pagetable() {
-    return pa2kptr<x86_64_pagetable*>(rdcr3());
+    return pa2kptr<x86_64_pagetable*>(rdcr3() & PTE_PAMASK);
 }
 
 
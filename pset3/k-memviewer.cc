@@ -4,7 +4,22 @@
 // k-memviewer.cc
 //
 //    The `memusage` class tracks memory usage by walking page tables,
-//    looks for errors, and prints the memory map to the console.
+//    looks for errors, and prints the memory map to the console. It
+//    rewalks only the page tables that changed since the last refresh.
+
+
+// memviewer_dirty
+//    Bit N is set if physical page N may have changed since the viewer
+//    last drew it (see `memviewer_touch`). The viewer redraws only those
+//    pages' cells, plus virtual cells that are now unmapped, except on a
+//    full redraw.
+
+uint64_t memviewer_dirty[(NPAGES + 63) / 64];
+
+static bool memviewer_is_dirty(uintptr_t pa) {
+    unsigned pn = pa / PAGESIZE;
+    return pn >= NPAGES || (memviewer_dirty[pn / 64] >> (pn % 64)) & 1;
+}
 
 
 class memusage {
@@ -25,7 +40,7 @@ class memusage {
     // `f_process(pid)` is for memory associated with process `pid`
     static constexpr unsigned f_process(int pid) {
         if (pid >= 29) {
-            return 4U << 31;
+            return 1U << 31;
         } else if (pid >= 1) {
             return 4U << pid;
         } else {
@@ -36,7 +51,8 @@ class memusage {
     // both as kernel-only and process-associated.
 
 
-    // Refresh the memory map from current state
+    // Refresh the memory map from current state. Only processes whose
+    // page tables changed (see `memviewer_touch`) are walked again.
     void refresh();
 
     // Return the symbol (character & color) associated with `pa`
@@ -52,7 +68,21 @@ class memusage {
     }
 
   private:
-    unsigned* v_ = nullptr;
+    static constexpr unsigned npages = maxpa / PAGESIZE;
+    static constexpr unsigned nwords = (PID_MAX + 63) / 64;
+
+    // Per-page marks. A process's marks are kept apart from the others'
+    // so that it can be walked again without walking everybody.
+    struct pagemarks {
+        unsigned flags;             // marks not tied to a process
+        uint64_t pt[nwords];        // pids whose page tables use this page
+        uint64_t user[nwords];      // pids that map this page for user
+        uint64_t nonidentity[nwords]; // ...at a different virtual address
+    };
+    pagemarks* m_ = nullptr;        // `npages` entries
+    // page table walked for each pid (`nullptr` if none)
+    x86_64_pagetable* walked_[PID_MAX] = {};
+    bool walked_kernel_ = false;
     mutable unsigned nerrors_ = 0;
     bool separate_tables_ = false;
     int error_sympos_ = -1;
@@ -61,9 +91,21 @@ class memusage {
     // This is safe to call even if `pa >= maxpa`.
     void mark(uintptr_t pa, unsigned flags) {
         if (pa < maxpa) {
-            v_[pa / PAGESIZE] |= flags;
+            m_[pa / PAGESIZE].flags |= flags;
         }
     }
+    // add `pid`'s bit to the page containing `pa` in `pagemarks::*set`
+    void mark_pid(uintptr_t pa, uint64_t (pagemarks::*set)[nwords], int pid) {
+        if (pa < maxpa) {
+            (m_[pa / PAGESIZE].*set)[pid / 64] |= 1UL << (pid % 64);
+        }
+    }
+    // walk the kernel page table
+    void walk_kernel();
+    // forget `pid`'s marks, then walk `pt` (if nonnull) on its behalf
+    void walk_process(int pid, x86_64_pagetable* pt);
+    // return the flags for page number `pn`
+    unsigned flags(unsigned pn) const;
     // return one of the processes set in a mark
     static int marked_pid(unsigned v) {
         return lsb(v >> 3);
@@ -78,52 +120,38 @@ class memusage {
 //    table.
 
 void memusage::refresh() {
-    if (!v_) {
-        v_ = reinterpret_cast<unsigned*>(kalloc(PAGESIZE));
-        assert(v_ != nullptr);
+    if (!m_) {
+        m_ = reinterpret_cast<pagemarks*>(kalloc(npages * sizeof(*m_)));
+        assert(m_ != nullptr);
+        memset(m_, 0, npages * sizeof(*m_));
     }
 
-    memset(v_, 0, (maxpa / PAGESIZE) * sizeof(*v_));
-
-    // mark kernel page tables
-    for (ptiter it(kernel_pagetable); !it.done(); it.next()) {
-        mark(it.pa(), f_kernel);
+    // rewalk the kernel page table if it changed
+    if (!walked_kernel_ || memviewer_is_dirty(kptr2pa(kernel_pagetable))) {
+        walk_kernel();
     }
-    mark(kptr2pa(kernel_pagetable), f_kernel);
-    mark(kptr2pa(v_), f_kernel);
 
-    // mark pages accessible from each process's page table
+    // rewalk each process page table that changed or was replaced
     separate_tables_ = false;
     for (int pid = 1; pid < PID_MAX; ++pid) {
-        unsigned pidflag = f_process(pid);
         proc* p = &ptable[pid];
+        x86_64_pagetable* pt = nullptr;
         if (p->state != P_FREE
             && p->pagetable
             && p->pagetable != kernel_pagetable) {
+            pt = p->pagetable;
             separate_tables_ = true;
-
-            for (ptiter it(p); it.va() < VA_LOWEND; it.next()) {
-                mark(it.pa(), f_kernel | pidflag);
-            }
-            mark(kptr2pa(p->pagetable), f_kernel | pidflag);
-
-            for (vmiter it(p, 0); it.va() < VA_LOWEND; ) {
-                if (it.user()) {
-                    if (it.va() == it.pa()) {
-                        mark(it.pa(), f_user | pidflag);
-                    } else {
-                        mark(it.pa(), f_user | f_nonidentity | pidflag);
-                    }
-                    it.next();
-                } else {
-                    it.next_range();
-                }
-            }
+        }
+        if (pt != walked_[pid]
+            || (pt && memviewer_is_dirty(kptr2pa(pt)))) {
+            walk_process(pid, pt);
         }
     }
 
     // if no different process page tables, use physical address instead
+    // (kernel page table mappings are tracked in `pagemarks::flags`)
     if (!separate_tables_) {
+        walk_kernel();
         for (vmiter it(kernel_pagetable, 0); it.va() < VA_LOWEND; ) {
             if (it.user()
                 && it.pa() < MEMSIZE_PHYSICAL
@@ -135,7 +163,66 @@ void memusage::refresh() {
                 it.next_range();
             }
         }
+        walked_kernel_ = false;
+    }
+}
+
+void memusage::walk_kernel() {
+    for (unsigned pn = 0; pn != npages; ++pn) {
+        m_[pn].flags = 0;
+    }
+    for (ptiter it(kernel_pagetable); !it.done(); it.next()) {
+        mark(it.pa(), f_kernel);
+    }
+    mark(kptr2pa(kernel_pagetable), f_kernel);
+    for (size_t off = 0; off < npages * sizeof(*m_); off += PAGESIZE) {
+        mark(kptr2pa(m_) + off, f_kernel);
+    }
+    walked_kernel_ = true;
+}
+
+void memusage::walk_process(int pid, x86_64_pagetable* pt) {
+    uint64_t keep = ~(1UL << (pid % 64));
+    for (unsigned pn = 0; pn != npages; ++pn) {
+        m_[pn].pt[pid / 64] &= keep;
+        m_[pn].user[pid / 64] &= keep;
+        m_[pn].nonidentity[pid / 64] &= keep;
+    }
+    walked_[pid] = pt;
+    if (!pt) {
+        return;
+    }
+
+    for (ptiter it(pt); it.va() < VA_LOWEND; it.next()) {
+        mark_pid(it.pa(), &pagemarks::pt, pid);
+    }
+    mark_pid(kptr2pa(pt), &pagemarks::pt, pid);
+
+    for (vmiter it(pt, 0); it.va() < VA_LOWEND; ) {
+        if (it.user()) {
+            mark_pid(it.pa(), &pagemarks::user, pid);
+            if (it.va() != it.pa()) {
+                mark_pid(it.pa(), &pagemarks::nonidentity, pid);
+            }
+            it.next();
+        } else {
+            it.next_range();
+        }
+    }
+}
+
+unsigned memusage::flags(unsigned pn) const {
+    const pagemarks& m = m_[pn];
+    unsigned v = m.flags;
+    for (unsigned w = 0; w != nwords; ++w) {
+        v |= m.pt[w] ? f_kernel : 0;
+        v |= m.user[w] ? f_user : 0;
+        v |= m.nonidentity[w] ? f_nonidentity : 0;
+        for (uint64_t pids = m.pt[w] | m.user[w]; pids; pids &= pids - 1) {
+            v |= f_process(w * 64 + lsb(pids) - 1);
+        }
     }
+    return v;
 }
 
 void memusage::page_error(uintptr_t pa, const char* desc, int pid) const {
@@ -174,7 +261,7 @@ uint16_t memusage::symbol_at(uintptr_t pa) const {
     }
 
     // flags for this physical page
-    auto v = v_[pn];
+    auto v = flags(pn);
     // lowest process involved with this page; 0 if no process
     pid_t pid = marked_pid(v);
     if (pa >= (uintptr_t) console && pa < (uintptr_t) console + PAGESIZE) {
@@ -240,24 +327,38 @@ uint16_t memusage::symbol_at(uintptr_t pa) const {
 }
 
 
-static void console_memviewer_virtual(memusage& mu, proc* vmp) {
+// write one viewer cell, skipping the console write if it's unchanged
+static void set_cell(int cpos, uint16_t ch) {
+    if (console[cpos] != ch) {
+        console[cpos] = ch;
+    }
+}
+
+
+static void console_memviewer_virtual(memusage& mu, proc* vmp, bool full) {
     assert(vmp->pagetable != nullptr);
 
     const char* statemsg = vmp->state == P_FAULTED ? " (faulted)" : "";
     console_printf(CPOS(10, 26), 0x0F00,
                    "VIRTUAL ADDRESS SPACE FOR %d%C%s\n", vmp->pid,
                    0x0700, statemsg);
+    meminfo mi;
+    proc_meminfo(vmp, &mi);
+    console_printf(CPOS(10, 0), 0x0700, "rss %3u sh %3u cow %3u",
+                   mi.resident, mi.shared, mi.cow);
 
     for (vmiter it(vmp, 0);
          it.va() < memusage::max_view_va;
          it += PAGESIZE) {
         unsigned long pn = it.va() / PAGESIZE;
-        if (pn % 64 == 0) {
+        if (full && pn % 64 == 0) {
             console_printf(mu.sympos(11, pn) - 9, 0x0F00, "0x%06X ", it.va());
         }
         uint16_t ch;
         if (!it.present()) {
             ch = ' ';
+        } else if (!full && !memviewer_is_dirty(it.pa())) {
+            continue;
         } else {
             ch = mu.symbol_at(it.pa());
             if (it.user()) { // switch foreground & background colors
@@ -269,7 +370,7 @@ static void console_memviewer_virtual(memusage& mu, proc* vmp) {
                 }
             }
         }
-        console[mu.sympos(11, pn)] = ch;
+        set_cell(mu.sympos(11, pn), ch);
     }
 }
 
@@ -278,23 +379,44 @@ void console_memviewer(proc* vmp) {
     // Process 0 must never be used.
     assert(ptable[0].state == P_FREE);
 
+    // Redraw everything when the viewed process changes and every 32
+    // calls (in case console output scrolled over the viewer); otherwise
+    // redraw only pages that changed, and nothing if none did.
+    static proc* last_vmp = nullptr;
+    static unsigned ncalls = 0;
+    bool full = vmp != last_vmp || ++ncalls % 32 == 0;
+    last_vmp = vmp;
+    bool dirty = full;
+    for (uint64_t w : memviewer_dirty) {
+        dirty = dirty || w != 0;
+    }
+    if (!dirty) {
+        return;
+    }
+
     // track physical memory
     static memusage mu;
     mu.refresh();
 
     // print physical memory
-    console_printf(CPOS(0, 32), 0x0F00, "PHYSICAL MEMORY\n");
+    if (full) {
+        console_printf(CPOS(0, 32), 0x0F00, "PHYSICAL MEMORY\n");
+    }
     for (int pn = 0; pn * PAGESIZE < memusage::max_view_pa; ++pn) {
-        if (pn % 64 == 0) {
+        if (full && pn % 64 == 0) {
             console_printf(mu.sympos(1, pn) - 9, 0x0F00, "0x%06X ", pn << 12);
         }
-        mu.set_error_sympos(mu.sympos(1, pn));
-        console[mu.sympos(1, pn)] = mu.symbol_at(pn * PAGESIZE);
+        if (full || memviewer_is_dirty(pn * PAGESIZE)) {
+            mu.set_error_sympos(mu.sympos(1, pn));
+            set_cell(mu.sympos(1, pn), mu.symbol_at(pn * PAGESIZE));
+        }
     }
     mu.set_error_sympos(-1);
 
     // print virtual memory
     if (vmp) {
-        console_memviewer_virtual(mu, vmp);
+        console_memviewer_virtual(mu, vmp, full);
     }
+
+    memset(memviewer_dirty, 0, sizeof(memviewer_dirty));
 }
@@ -32,15 +32,60 @@ void vmiter::real_find(uintptr_t va, bool stepping) {
         lbits_ = noncanonical_lbits;
         perm_ = 0;
         pep_ = const_cast<x86_64_pageentry_t*>(&zero_pe);
+    } else if (vmc_ && cached_find(va)) {
+        // level-1 page table found in the page walk cache
     } else {
         lbits_ = initial_lbits;
         perm_ = initial_perm;
         pep_ = &pt_->entry[(va >> lbits_) & 0x1FF];
+        va_ = va;
+        down();
+        if (vmc_ && lbits_ == PAGEOFFBITS) {
+            cache_fill();
+        }
+        return;
     }
     va_ = va;
     down();
 }
 
+// vmiter::cached_find(va)
+//    If the page walk cache holds the level-1 page table covering `va`,
+//    point `pep_` at `va`'s entry there and return true. Discards the
+//    cache if it describes another page table or generation.
+bool vmiter::cached_find(uintptr_t va) {
+    if (vmc_->pagetable != pt_ || vmc_->generation != pagetable_generation) {
+        *vmc_ = vmcache();
+        vmc_->pagetable = pt_;
+        vmc_->generation = pagetable_generation;
+        return false;
+    }
+    uintptr_t region = va >> L1_REGION_BITS;
+    auto& e = vmc_->e[region % NVMCACHE];
+    if (!e.l1 || e.region != region) {
+        return false;
+    }
+    lbits_ = PAGEOFFBITS;
+    perm_ = e.perm;
+    pep_ = &e.l1->entry[(va >> PAGEOFFBITS) & 0x1FF];
+    return true;
+}
+
+// vmiter::cache_fill()
+//    Remember the level-1 page table `pep_` points into, which a full walk
+//    to `va_` just reached, in the page walk cache.
+void vmiter::cache_fill() {
+    if (vmc_->pagetable != pt_ || vmc_->generation != pagetable_generation) {
+        return;
+    }
+    uintptr_t region = va_ >> L1_REGION_BITS;
+    auto& e = vmc_->e[region % NVMCACHE];
+    e.region = region;
+    e.l1 = reinterpret_cast<x86_64_pagetable*>(
+        reinterpret_cast<uintptr_t>(pep_) & ~uintptr_t(PAGESIZE - 1));
+    e.perm = perm_;
+}
+
 void vmiter::next() {
     int lbits = PAGEOFFBITS;
     if (lbits_ > PAGEOFFBITS && !perm()) {
@@ -68,23 +113,54 @@ int vmiter::try_map(uintptr_t pa, int perm) {
 
     while (lbits_ > PAGEOFFBITS && perm) {
         assert(!(*pep_ & PTE_P));
-        x86_64_pagetable* pt = static_cast<x86_64_pagetable*>(kalloc(PAGESIZE));
+        x86_64_pagetable* pt = kalloc_pagetable();
         if (!pt) {
             return -1;
         }
-        memset(pt, 0, PAGESIZE);
+        memviewer_touch(kptr2pa(pt));
         std::atomic_thread_fence(std::memory_order_release);
         *pep_ = reinterpret_cast<uintptr_t>(pt) | PTE_P | PTE_W | PTE_U;
+        ++pagetable_generation;         // page walk caches may be stale
         down();
     }
 
     if (lbits_ == PAGEOFFBITS) {
+        memviewer_touch(kptr2pa(pt_));  // viewer rewalks this page table
+        if (*pep_ & PTE_P) {
+            memviewer_touch(*pep_ & PTE_PAMASK);
+            ++tlb_generation;           // cached translations may be stale
+        }
+        if (perm & PTE_P) {
+            memviewer_touch(pa);
+        }
         std::atomic_thread_fence(std::memory_order_release);
         *pep_ = pa | perm;
     }
     return 0;
 }
 
+int vmiter::try_map_range(uintptr_t pa, size_t sz, int perm) {
+    assert((sz % PAGESIZE) == 0, "vmiter::try_map_range size not aligned");
+    uintptr_t end = va_ + sz;
+    while (va_ != end) {
+        if (!perm && !(*pep_ & PTE_P) && lbits_ > PAGEOFFBITS) {
+            // unmapping an already-unmapped region: skip it whole
+            uintptr_t next = last_va() < end ? last_va() : end;
+            pa += next - va_;
+            real_find(next, true);
+            continue;
+        }
+        int r = try_map(perm ? pa : 0, perm);
+        if (r != 0) {
+            return r;
+        }
+        pa += PAGESIZE;
+        // steps within the current page table without re-walking it
+        real_find(va_ + PAGESIZE, true);
+    }
+    return 0;
+}
+
 
 uint64_t vmiter::range_perm(size_t sz) const {
     uint64_t p = sz > 0 ? perm() : uint64_t(-1);
@@ -14,6 +14,8 @@ class vmiter {
   public:
     // Initialize a `vmiter` for `pt`, with initial virtual address `va`
     inline vmiter(x86_64_pagetable* pt, uintptr_t va);
+    // Same, for `p`'s page table; walks use and fill `p`'s page walk
+    // cache (`p->vmc`)
     inline vmiter(const proc* p, uintptr_t va);
 
     // Return page table
@@ -98,6 +100,25 @@ class vmiter {
     [[gnu::warn_unused_result]] inline int try_map(void* kptr, int perm);
     [[gnu::warn_unused_result]] inline int try_map(volatile void* kptr, int perm);
 
+    // RANGE MAPPING
+    // Map the `sz` bytes starting at `this->va()` to physical addresses
+    // starting at `pa`, with permissions `perm`, and advance to
+    // `this->va() + sz`. `this->va()`, `pa`, and `sz` must be page-aligned.
+    // Each page table level is walked once per range, not once per page.
+    // Returns 0 on success. If `kalloc` fails, returns a negative error
+    // code; a prefix of the range may have been mapped.
+    [[gnu::warn_unused_result]] int try_map_range(uintptr_t pa, size_t sz, int perm);
+
+    // For each present page in `[src.va(), src.va() + sz)`, call `f(src)`.
+    // If it returns `perm >= 0`, map the corresponding page of `this`
+    // (at the same offset from `this->va()`) to `src.pa()` with `perm`.
+    // Large unmapped regions of `src` are skipped without visiting each
+    // page. Returns 0 on success, leaving both iterators at the end of the
+    // range. If `kalloc` fails, returns a negative error code, leaving
+    // `src` at the page whose mapping failed.
+    template <typename F>
+    [[gnu::warn_unused_result]] int try_copy_range(vmiter& src, size_t sz, F f);
+
   private:
     static constexpr int initial_lbits = PAGEOFFBITS + 3 * PAGEINDEXBITS;
     static constexpr int noncanonical_lbits = 47;
@@ -108,6 +129,7 @@ class vmiter {
     int lbits_;
     int perm_;
     uintptr_t va_;
+    vmcache* vmc_;
 
     static constexpr int initial_perm = 0xFFF;
     static const x86_64_pageentry_t zero_pe;
@@ -115,6 +137,8 @@ class vmiter {
     inline static constexpr uintptr_t lbits_mask(int lbits);
     void down();
     void real_find(uintptr_t va, bool stepping);
+    bool cached_find(uintptr_t va);
+    void cache_fill();
     friend class ptiter;
 };
 
@@ -166,11 +190,13 @@ class ptiter {
 
 inline vmiter::vmiter(x86_64_pagetable* pt, uintptr_t va)
     : pt_(pt), pep_(&pt_->entry[0]), lbits_(initial_lbits),
-      perm_(initial_perm), va_(0) {
+      perm_(initial_perm), va_(0), vmc_(nullptr) {
     real_find(va, false);
 }
 inline vmiter::vmiter(const proc* p, uintptr_t va)
-    : vmiter(p->pagetable, va) {
+    : pt_(p->pagetable), pep_(&pt_->entry[0]), lbits_(initial_lbits),
+      perm_(initial_perm), va_(0), vmc_(&p->vmc) {
+    real_find(va, false);
 }
 inline x86_64_pagetable* vmiter::pagetable() const {
     return pt_;
@@ -288,6 +314,27 @@ inline int vmiter::try_map(volatile void* kp, int perm) {
     return try_map(reinterpret_cast<uintptr_t>(kp), perm);
 }
 
+template <typename F>
+int vmiter::try_copy_range(vmiter& src, size_t sz, F f) {
+    uintptr_t delta = va_ - src.va();
+    uintptr_t end = src.va() + sz;
+    while (!src.done() && src.va() < end) {
+        if (src.present()) {
+            int perm = f(src);
+            if (perm >= 0) {
+                find(src.va() + delta);
+                if (try_map(src.pa(), perm) != 0) {
+                    return -1;
+                }
+            }
+        }
+        src.next();
+    }
+    src.find(end);
+    find(end + delta);
+    return 0;
+}
+
 inline ptiter::ptiter(const proc* p)
     : ptiter(p->pagetable) {
 }
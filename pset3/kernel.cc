@@ -35,19 +35,82 @@ extern "C" void __assert_fail(const char* assertion, const char* file, unsigned
 
 proc ptable[PID_MAX];           // array of process descriptors
                                 // Note that `ptable[0]` is never used.
-proc* current = nullptr;        // pointer to currently executing proc
+cpustate* cpus[NCPU_MAX];       // started CPUs, by index
+int ncpu = 0;                   // number of started CPUs
+bool pcid_enabled = false;      // see "TLB tagging" in kernel.hh
+uint64_t tlb_generation = 0;
+uint64_t pagetable_generation = 1; // see `vmcache` in kernel.hh
+uintptr_t kernel_cr3 = (uintptr_t) kernel_pagetable;
+ktrace_buffer ktrace_buf;       // kernel trace ring buffer (see `ktrace`)
+
+// `current` is the process running on this CPU
+#define current (this_cpu()->current_)
 
 #define HZ 100                  // timer interrupt frequency (interrupts/sec)
 static std::atomic<unsigned long> ticks{0}; // # timer interrupts so far
 
+#define SCHED_BOOST_TICKS HZ    // ticks between scheduler priority boosts
+#define TIMER_WHEEL_SLOTS 64    // `sys_sleep` timer wheel size
+
+// The memory viewer and kernel log run from CPU 0's timer interrupt, every
+// `VIEWER_TICKS` ticks, rather than on every system call and exception
+// (which are recorded with `ktrace` instead). `make VIEWER=entry` defines
+// `WEENSYOS_ENTRY_VIEWER` to restore per-entry redraws.
+#ifndef WEENSYOS_ENTRY_VIEWER
+#define WEENSYOS_ENTRY_VIEWER 0
+#endif
+#define VIEWER_TICKS (HZ / 25)
+static unsigned long nsyscalls = 0;     // system calls since last log line
+static unsigned long nexceptions = 0;   // exceptions since last log line
+
 // Memory state - see `kernel.hh`
 physpageinfo physpages[NPAGES];
 
-// Free list for memory allocation
-uintptr_t free_list_head = 0;
+// Buddy allocator free lists: `buddy_free[order]` and `buddy_tail[order]`
+// are the page numbers of the first and last free blocks of that order.
+// Page 0 is never allocatable, so page number 0 ends a list. Zeroed
+// blocks are kept at the front of each list and dirty blocks at the back,
+// so `kalloc` prefers zeroed blocks and the idle loop zeroes from the back.
+static unsigned buddy_free[KALLOC_MAX_ORDER + 1];
+static unsigned buddy_tail[KALLOC_MAX_ORDER + 1];
+static unsigned nfree_pages = 0;        // pages on the free lists
+
+// Page deduplication runs (from `schedule`) when fewer than
+// `KSM_LOW_PAGES` pages are free, at most once per `KSM_INTERVAL` ticks.
+#define KSM_LOW_PAGES 16
+#define KSM_INTERVAL (HZ / 4)
+static bool ksm_wanted = false;
+
+// BIG KERNEL LOCK
+//    `kernel_lock` protects all kernel state, including `ptable`, the run
+//    queues, and physical memory. A CPU acquires it on every kernel entry
+//    (`exception`, `syscall`, `ap_start`) and releases it only when
+//    returning to user mode (`run`) or halting while idle (`schedule`).
+//    The kernel runs with interrupts disabled, so a CPU never waits for
+//    the lock while holding it.
+
+struct spinlock {
+    std::atomic_flag f = ATOMIC_FLAG_INIT;
+
+    void lock() {
+        while (f.test_and_set(std::memory_order_acquire)) {
+            pause();
+        }
+    }
+    void unlock() {
+        f.clear(std::memory_order_release);
+    }
+};
+static spinlock kernel_lock;
 
 // Function Prototypes
 [[noreturn]] void schedule();
+static void sched_init_proc(proc* p);
+static void sched_enqueue(proc* p);
+static bool sched_tick(proc* p);
+static void sched_boost();
+static void timer_interrupt();
+[[noreturn]] static void syscall_sleep(unsigned long nticks);
 [[noreturn]] void run(proc* p);
 void exception(regstate* regs);
 uintptr_t syscall(regstate* regs);
@@ -59,18 +122,42 @@ static void initialize_memory();
 static void initialize_process_table();
 static void load_initial_processes(const char* command);
 static void process_setup(pid_t pid, const char* program_name);
+static void process_load(proc* p, x86_64_pagetable* pagetable,
+                         const program_image& pgm);
+static bool vma_fault(proc* p, uintptr_t addr);
+static bool cow_fault(proc* p, uintptr_t addr);
 
 // Memory Allocation Functions
 void* kalloc(size_t sz);
 void kfree(void* kptr);
+static void buddy_release(unsigned pn, int order, bool zeroed);
+static void* kalloc_reclaim(size_t sz);
+static void* kalloc_user(proc* p);
+static unsigned ksm_merge();
 
 // Process Management Functions
+static pid_t find_free_pid();
+static void pid_claim(pid_t pid);
+static void pid_release(pid_t pid);
 pid_t syscall_fork();
+static pid_t syscall_spawn(int program_number);
+static pid_t syscall_vfork();
+static int syscall_meminfo(pid_t pid, uintptr_t addr);
 void sys_exit();
+static void zombie_push(x86_64_pagetable* pagetable);
+static bool reap_zombie();
+static bool reap_zombies();
 
 // Helper Functions
 void cleanup_pagetable(x86_64_pagetable* pagetable);
+static x86_64_pagetable* process_pagetable();
+static void pagetable_cache_drain();
 int syscall_page_alloc(uintptr_t addr);
+static int syscall_page_alloc_range(uintptr_t addr, size_t npages);
+static int syscall_batch(uintptr_t addr, size_t n);
+static int syscall_shm_create(size_t sz);
+static int syscall_shm_map(int id, uintptr_t addr);
+static void shm_gc();
 
 // kernel_start(command)
 //    Initialize the hardware and processes and start running. The `command`
@@ -78,6 +165,10 @@ int syscall_page_alloc(uintptr_t addr);
 
 void kernel_start(const char* command) {
     initialize_hardware();
+    kernel_lock.lock();
+    cpus[0] = this_cpu();
+    ncpu = 1;
+    ktrace_buf.magic = KTRACE_MAGIC;
     log_printf("Starting WeensyOS\n");
 
     ticks = 1;
@@ -95,8 +186,27 @@ void kernel_start(const char* command) {
     // Load initial processes
     load_initial_processes(command);
 
-    // Switch to first process using run()
-    run(&ptable[1]);
+    // Start other CPUs; they wait for `kernel_lock`
+    init_aps();
+
+    // Switch to the first process
+    schedule();
+}
+
+// ap_start(index)
+//    Entry point for application processor `index`, called by `ap_entry`
+//    (in k-exception.S) on that CPU's kernel stack.
+
+extern "C" [[noreturn]] void ap_start(int index) {
+    this_cpu()->init(index);
+    init_cpu_hardware();
+    init_timer(HZ);
+
+    kernel_lock.lock();
+    cpus[index] = this_cpu();
+    ncpu = max(ncpu, index + 1);
+    log_printf("CPU %d started\n", index);
+    schedule();
 }
 
 // initialize_hardware()
@@ -110,28 +220,13 @@ static void initialize_hardware() {
 //    Set up the initial memory mappings and free list.
 
 static void initialize_memory() {
-    // Initialize kernel page table with identity mapping
-    for (uintptr_t addr = 0; addr < MEMSIZE_PHYSICAL; addr += PAGESIZE) {
-        int perm = PTE_P | PTE_W;
-        if (addr >= PROC_START_ADDR || addr == CONSOLE_ADDR) {
-            perm |= PTE_U;
-        } else if (addr == 0) {
-            perm = 0; // Inaccessible
-        }
-
-        // Install identity mapping
-        int r = vmiter(kernel_pagetable, addr).try_map(addr, perm);
-        assert(r == 0); // mappings during kernel_start MUST NOT fail
-
-        // Initialize free list for user pages
-        if (addr >= PROC_START_ADDR && addr != CONSOLE_ADDR) {
-            int page_index = addr / PAGESIZE;
-            physpages[page_index].refcount = 0; // Mark as free
+    // (The kernel page table already identity-maps physical memory with
+    // 2 MiB pages; see `init_kernel_memory`.)
 
-            // Add to free list
-            *(uintptr_t*)addr = free_list_head;
-            free_list_head = addr;
-        }
+    // Give user pages to the buddy allocator, which coalesces them
+    for (uintptr_t addr = PROC_START_ADDR; addr < MEMSIZE_PHYSICAL; addr += PAGESIZE) {
+        physpages[addr / PAGESIZE].refcount = 0; // Mark as free
+        buddy_release(addr / PAGESIZE, 0, false);
     }
 }
 
@@ -143,6 +238,9 @@ static void initialize_process_table() {
         ptable[i].pid = i;
         ptable[i].state = P_FREE;
         ptable[i].pagetable = nullptr;
+        if (i != 0) {
+            pid_release(i);
+        }
     }
 }
 
@@ -169,117 +267,216 @@ static void load_initial_processes(const char* command) {
 //    Load application program `program_name` as process number `pid`.
 
 void process_setup(pid_t pid, const char* program_name) {
-    init_process(&ptable[pid], 0);
+    // Allocate a new page table for the process, with kernel mappings
+    x86_64_pagetable* pagetable = process_pagetable();
+    assert(pagetable != nullptr);
 
-    // Allocate a new empty page table for the process
-    ptable[pid].pagetable = kalloc_pagetable();
-    assert(ptable[pid].pagetable != nullptr);
+    process_load(&ptable[pid], pagetable, program_image(program_name));
+}
 
-    // Map kernel memory into the process's page table
-    for (vmiter src(kernel_pagetable, 0), dst(ptable[pid].pagetable, 0);
-         src.va() < PROC_START_ADDR;
-         src += PAGESIZE, dst += PAGESIZE) {
-        if (src.present()) {
-            int r = dst.try_map(src.pa(), src.perm());
-            assert(r == 0);
-        }
-    }
+// process_load(p, pagetable, pgm)
+//    Make `p` a new runnable process running `pgm` on `pagetable`, which
+//    must hold only kernel mappings. Allocates no memory.
 
-    // Obtain reference to program image
-    program_image pgm(program_name);
+static void process_load(proc* p, x86_64_pagetable* pagetable,
+                         const program_image& pgm) {
+    init_process(p, 0);
+    p->pagetable = pagetable;
+    p->vfork_parent = 0;
 
-    // Allocate and map process memory as specified in program image
+    // Describe process memory; pages are mapped on first access by
+    // `vma_fault`, so untouched code, data, and stack cost nothing
+    p->nvmas = 0;
     for (auto seg = pgm.begin(); seg != pgm.end(); ++seg) {
-        for (uintptr_t a = round_down(seg.va(), PAGESIZE);
-             a < seg.va() + seg.size();
-             a += PAGESIZE) {
-
-            if (seg.writable()) {
-                // Writable segment: allocate new physical page
-                void* new_page = kalloc(PAGESIZE);
-                assert(new_page != nullptr);
-                memset(new_page, 0, PAGESIZE); // Initialize with 0
-
-                // Map writable page
-                int perm = PTE_P | PTE_W | PTE_U;
-                int r = vmiter(ptable[pid].pagetable, a).try_map((uintptr_t)new_page, perm);
-                assert(r == 0);
-            } else {
-                // Non-writable (read-only): share page across processes
-                void* shared_page = kalloc(PAGESIZE);
-                assert(shared_page != nullptr);
-                memset(shared_page, 0, PAGESIZE); // Initialize with 0
-
-                // Map read-only page
-                int perm = PTE_P | PTE_U;
-                int r = vmiter(ptable[pid].pagetable, a).try_map((uintptr_t)shared_page, perm);
-                assert(r == 0);
-
-                // Increment reference count in `physpages`
-                ++physpages[(uintptr_t)shared_page / PAGESIZE].refcount;
-            }
-        }
+        assert(p->nvmas < NVMA - 1);
+        vma& v = p->vmas[p->nvmas];
+        ++p->nvmas;
+        v.start = round_down(seg.va(), PAGESIZE);
+        v.end = round_up(seg.va() + seg.size(), PAGESIZE);
+        v.perm = seg.writable() ? PTE_P | PTE_W | PTE_U : PTE_P | PTE_U;
+        v.data_va = seg.va();
+        v.data = seg.data();
+        v.data_size = seg.data_size();
     }
 
-    // Copy instructions and data into process memory as needed
-    for (auto seg = pgm.begin(); seg != pgm.end(); ++seg) {
-        uintptr_t start_ptr = (uintptr_t)seg.data();
-        for (uintptr_t a = round_down(seg.va(), PAGESIZE);
-             a < seg.va() + seg.size();
-             a += PAGESIZE) {
+    // Set entry point
+    p->regs.reg_rip = pgm.entry();
+
+    // Set up the stack area, which grows down on demand
+    vma& stack = p->vmas[p->nvmas];
+    ++p->nvmas;
+    stack = vma();
+    stack.start = MEMSIZE_VIRTUAL - STACK_MAXSIZE;
+    stack.end = MEMSIZE_VIRTUAL;
+    stack.perm = PTE_P | PTE_W | PTE_U;
+
+    p->regs.reg_rsp = MEMSIZE_VIRTUAL;
+    p->state = P_RUNNABLE;
+    pid_claim(p->pid);
+    sched_init_proc(p);
+    sched_enqueue(p);
+}
 
-            uintptr_t page = vmiter(ptable[pid].pagetable, a).pa();
-            size_t copy_size = (a + PAGESIZE <= seg.va() + seg.data_size()) ? PAGESIZE : seg.data_size() % PAGESIZE;
-            memcpy((void*)page, (void*)start_ptr, copy_size);
-            start_ptr += copy_size;
+// buddy_push(pn, order, zeroed), buddy_remove(pn)
+//    Add the free block headed by page `pn` to its free list, or remove it.
+
+static void buddy_push(unsigned pn, int order, bool zeroed) {
+    physpageinfo& pg = physpages[pn];
+    nfree_pages += 1U << order;
+    pg.free_block = true;
+    pg.order = order;
+    pg.zeroed = zeroed;
+    if (zeroed) {
+        pg.prev = 0;
+        pg.next = buddy_free[order];
+        if (pg.next) {
+            physpages[pg.next].prev = pn;
+        } else {
+            buddy_tail[order] = pn;
+        }
+        buddy_free[order] = pn;
+    } else {
+        pg.next = 0;
+        pg.prev = buddy_tail[order];
+        if (pg.prev) {
+            physpages[pg.prev].next = pn;
+        } else {
+            buddy_free[order] = pn;
         }
+        buddy_tail[order] = pn;
     }
+}
 
-    // Set entry point
-    ptable[pid].regs.reg_rip = pgm.entry();
+static void buddy_remove(unsigned pn) {
+    physpageinfo& pg = physpages[pn];
+    nfree_pages -= 1U << pg.order;
+    if (pg.prev) {
+        physpages[pg.prev].next = pg.next;
+    } else {
+        buddy_free[pg.order] = pg.next;
+    }
+    if (pg.next) {
+        physpages[pg.next].prev = pg.prev;
+    } else {
+        buddy_tail[pg.order] = pg.prev;
+    }
+    pg.free_block = false;
+}
 
-    // Set up the stack segment
-    uintptr_t stack_addr = MEMSIZE_VIRTUAL - PAGESIZE;
-    void* new_stack_pa = kalloc(PAGESIZE);
-    memset(new_stack_pa, 0, PAGESIZE); // Initialize with 0
-    assert(new_stack_pa != nullptr);
+// buddy_release(pn, order, zeroed)
+//    Free the block of `1 << order` pages starting at page `pn`, merging
+//    it with its buddy for as long as the buddy is also free. `zeroed`
+//    says whether the block is known to be zero.
+
+static void buddy_release(unsigned pn, int order, bool zeroed) {
+    while (order < KALLOC_MAX_ORDER) {
+        unsigned buddy = pn ^ (1U << order);
+        if (buddy >= NPAGES
+            || !physpages[buddy].free_block
+            || physpages[buddy].order != order) {
+            break;
+        }
+        zeroed = zeroed && physpages[buddy].zeroed;
+        buddy_remove(buddy);
+        pn &= ~(1U << order);
+        ++order;
+    }
+    buddy_push(pn, order, zeroed);
+}
 
-    int r = vmiter(ptable[pid].pagetable, stack_addr).try_map((uintptr_t)new_stack_pa, PTE_P | PTE_W | PTE_U);
-    assert(r == 0);
+// vma_fault(p, addr)
+//    Handle a user fault by `p` on unmapped address `addr`. If `addr` lies
+//    in one of `p`'s areas, map a page there, initialized from the area's
+//    data, and return true. Returns false if the fault is a real error or
+//    memory is exhausted.
+
+static bool vma_fault(proc* p, uintptr_t addr) {
+    const vma* v = nullptr;
+    for (int i = 0; i != p->nvmas && !v; ++i) {
+        if (p->vmas[i].contains(addr)) {
+            v = &p->vmas[i];
+        }
+    }
+    if (!v) {
+        return false;
+    }
 
-    ptable[pid].regs.reg_rsp = stack_addr + PAGESIZE;
-    ptable[pid].state = P_RUNNABLE;
+    uintptr_t va = round_down(addr, PAGESIZE);
+    char* page = reinterpret_cast<char*>(kalloc_user(p));
+    if (!page) {
+        return false;
+    }
+    uintptr_t first = va > v->data_va ? va : v->data_va;
+    uintptr_t last = v->data_va + v->data_size;
+    if (last > va + PAGESIZE) {
+        last = va + PAGESIZE;
+    }
+    if (first < last) {
+        memcpy(page + (first - va), v->data + (first - v->data_va), last - first);
+    }
+    if (vmiter(p, va).try_map(page, v->perm) != 0) {
+        kfree(page);
+        return false;
+    }
+    return true;
 }
 
 // kalloc(sz)
-//    Kernel physical memory allocator using a free list.
+//    Kernel physical memory allocator: a buddy allocator over `physpages`.
 
 void* kalloc(size_t sz) {
-    if (sz > PAGESIZE) {
-        return nullptr;
+    int order = 0;
+    while ((size_t(PAGESIZE) << order) < sz) {
+        if (++order > KALLOC_MAX_ORDER) {
+            return nullptr;
+        }
     }
 
-    // Allocate from the free list
-    if (free_list_head == 0) {
-        return nullptr; // No free pages available
+    // Find the smallest free block that fits
+    int o = order;
+    while (o <= KALLOC_MAX_ORDER && !buddy_free[o]) {
+        ++o;
+    }
+    if (o > KALLOC_MAX_ORDER) {
+        // No free pages available; reclaim exited processes' memory
+        if (reap_zombies()) {
+            return kalloc(sz);
+        }
+        return nullptr;
+    }
+    unsigned pn = buddy_free[o];
+    bool zeroed = physpages[pn].zeroed;
+    buddy_remove(pn);
+
+    // Split it, returning the upper halves to the free lists
+    while (o > order) {
+        --o;
+        buddy_push(pn + (1U << o), o, zeroed);
     }
 
-    // Remove the first page from the free list
-    uintptr_t pa = free_list_head;
-    free_list_head = *(uintptr_t*)pa;
-
-    // Initialize memory to zero
-    memset((void*)pa, 0, PAGESIZE);
+    // Update reference counts; the head page holds the real count
+    physpages[pn].order = order;
+    for (unsigned i = 0; i != (1U << order); ++i) {
+        physpages[pn + i].refcount = 1;
+        memviewer_touch((pn + i) * PAGESIZE);
+    }
 
-    // Update reference count
-    physpages[pa / PAGESIZE].refcount = 1;
+    if (nfree_pages < KSM_LOW_PAGES) {
+        ksm_wanted = true;
+    }
 
-    return (void*)pa;
+    // Initialize memory to zero, unless it already is
+    uintptr_t pa = pn * PAGESIZE;
+    if (!zeroed) {
+        memset((void*) pa, 0, PAGESIZE << order);
+    }
+    return (void*) pa;
 }
 
 // kfree(kptr)
 //    Free `kptr`, which must have been previously returned by `kalloc`.
-//    If `kptr == nullptr` does nothing.
+//    If `kptr == nullptr` does nothing. Freed memory is zeroed lazily, by
+//    `kalloc_zero_idle` or the next `kalloc`.
 
 void kfree(void* kptr) {
     if (!kptr) {
@@ -289,140 +486,507 @@ void kfree(void* kptr) {
     uintptr_t pa = (uintptr_t)kptr;
     assert(pa % PAGESIZE == 0); // Ensure page alignment
 
-    int page_index = pa / PAGESIZE;
-    assert(static_cast<unsigned int>(page_index) < NPAGES); // Fix signedness
-
-    assert(physpages[page_index].refcount > 0); // Ensure the page is in use
+    unsigned pn = pa / PAGESIZE;
+    assert(pn < NPAGES);
+    assert(physpages[pn].refcount > 0); // Ensure the page is in use
 
     // Decrement reference count
-    --physpages[page_index].refcount;
+    --physpages[pn].refcount;
+    memviewer_touch(pa);
 
-    // Optionally, log the freeing action
-    log_printf("kfree: freeing page at 0x%lx, new refcount=%d\n", pa, physpages[page_index].refcount);
+    ktrace(KT_KFREE, pa);
 
-    if (physpages[page_index].refcount == 0) {
-        // Add the page back to the free list
-        *(uintptr_t*)pa = free_list_head;
-        free_list_head = pa;
+    if (physpages[pn].refcount == 0) {
+        int order = physpages[pn].order;
+        physpages[pn].owner = 0;
+        for (unsigned i = 1; i != (1U << order); ++i) {
+            physpages[pn + i].refcount = 0;
+            memviewer_touch((pn + i) * PAGESIZE);
+        }
 
-        // Clear memory for safety
-        memset(kptr, 0, PAGESIZE);
+        // Return the block to the buddy allocator
+        buddy_release(pn, order, false);
     }
 }
 
-// syscall_fork()
-//    Handles the fork system call to create a new process.
-
-pid_t syscall_fork() {
-    // Find a free slot for the child process
-    pid_t child_pid = -1;
-    for (pid_t i = 1; i < PID_MAX; ++i) { // Skip PID 0
-        if (ptable[i].state == P_FREE) {
-            child_pid = i;
-            break;
+// kalloc_zero_idle()
+//    Zero the smallest dirty free block and move it to the zeroed end of
+//    its free list. Returns false if every free block is already zero.
+
+bool kalloc_zero_idle() {
+    for (int order = 0; order <= KALLOC_MAX_ORDER; ++order) {
+        unsigned pn = buddy_tail[order];
+        if (pn && !physpages[pn].zeroed) {
+            buddy_remove(pn);
+            memset((void*) (pn * PAGESIZE), 0, PAGESIZE << order);
+            buddy_push(pn, order, true);
+            return true;
         }
     }
+    return false;
+}
 
-    if (child_pid == -1) {
-        return -1; // No free slots available
+// kalloc_reclaim(sz)
+//    Like `kalloc`, but if memory is exhausted, release cached page-table
+//    pages and merge duplicate user pages, then try again. Must not be called while a page table walk is in
+//    progress, since merging rewrites user mappings.
+
+static void* kalloc_reclaim(size_t sz) {
+    void* ptr = kalloc(sz);
+    if (!ptr) {
+        pagetable_cache_drain();
+        ptr = kalloc(sz);
+    }
+    if (!ptr && ksm_merge() != 0) {
+        ptr = kalloc(sz);
     }
+    return ptr;
+}
 
-    // Allocate a new page table for the child
-    x86_64_pagetable* child_pagetable = kalloc_pagetable();
-    if (!child_pagetable) {
-        return -1; // Allocation failed
+// kalloc_user(p)
+//    Allocate a user page for process `p` with `kalloc_reclaim`, and record
+//    `p` as its owner.
+
+static void* kalloc_user(proc* p) {
+    void* page = kalloc_reclaim(PAGESIZE);
+    if (page) {
+        physpages[kptr2pa(page) / PAGESIZE].owner = p->pid;
     }
+    return page;
+}
 
-    // Copy kernel mappings
-    for (vmiter src(kernel_pagetable, 0), dst(child_pagetable, 0);
-         src.va() < PROC_START_ADDR;
-         src += PAGESIZE, dst += PAGESIZE) {
-        if (src.present()) {
-            int r = dst.try_map(src.pa(), src.perm());
-            if (r != 0) {
-                cleanup_pagetable(child_pagetable);
-                return -1;
-            }
+// PAGE DEDUPLICATION
+//
+//    `ksm_merge` finds user pages with identical contents and maps them
+//    all to one physical page, shared copy-on-write, freeing the rest.
+//    Only unshared pages (`refcount == 1`) are merged, so pages that are
+//    already shared keep their meaning. A write to a merged page takes
+//    the usual `cow_fault` path.
+
+struct ksm_entry {
+    uint64_t hash;
+    uintptr_t va;           // address and process of the page's mapping
+    pid_t pid;
+    unsigned pn;            // 0 means empty
+};
+static ksm_entry ksm_table[2 * NPAGES];
+
+static uint64_t page_hash(const void* page) {
+    // FNV-1a over 64-bit words
+    const uint64_t* w = reinterpret_cast<const uint64_t*>(page);
+    uint64_t h = 14695981039346656037UL;
+    for (size_t i = 0; i != PAGESIZE / sizeof(uint64_t); ++i) {
+        h = (h ^ w[i]) * 1099511628211UL;
+    }
+    return h;
+}
+
+// ksm_share(p, va)
+//    Make `p`'s mapping at `va` read-only and, if it was writable,
+//    copy-on-write.
+
+static void ksm_share(proc* p, uintptr_t va) {
+    vmiter it(p, va);
+    int perm = it.perm();
+    if (perm & (PTE_W | PTE_COW)) {
+        it.map(it.pa(), (perm & ~PTE_W) | PTE_COW);
+    }
+}
+
+// running_elsewhere(p)
+//    Return true iff `p`, or a `sys_vfork` child borrowing its page table,
+//    is running on another CPU. The page table must not change under it
+//    there, since that CPU's TLB would go stale.
+
+static bool running_elsewhere(proc* p) {
+    for (int i = 0; i < ncpu; ++i) {
+        proc* q = cpus[i] ? cpus[i]->current_ : nullptr;
+        if (q && cpus[i] != this_cpu()
+            && (q == p || q->pagetable == p->pagetable)) {
+            return true;
         }
     }
+    return false;
+}
+
+// ksm_merge()
+//    Merge identical unshared user pages. Returns the number of pages
+//    freed.
 
-    // Copy user space mappings
-    for (vmiter src(current->pagetable, PROC_START_ADDR), dst(child_pagetable, PROC_START_ADDR);
-         src.va() < MEMSIZE_VIRTUAL;
-         src += PAGESIZE, dst += PAGESIZE) {
-        if (!src.present()) continue;
+static unsigned ksm_merge() {
+    ksm_wanted = false;
+    memset(ksm_table, 0, sizeof(ksm_table));
+    unsigned nfreed = 0;
 
-        if (!src.writable() && src.user() && src.va() != CONSOLE_ADDR) {
-            // Share read-only page
-            int r = dst.try_map(src.pa(), src.perm());
-            if (r != 0) {
-                cleanup_pagetable(child_pagetable);
-                return -1;
+    for (pid_t pid = 1; pid < PID_MAX; ++pid) {
+        proc* p = &ptable[pid];
+        if (p->state == P_FREE || !p->pagetable || p->vfork_parent
+            || running_elsewhere(p)) {
+            continue;
+        }
+        for (vmiter it(p, PROC_START_ADDR);
+             it.va() < MEMSIZE_VIRTUAL;
+             it += PAGESIZE) {
+            if (!it.user() || it.va() == CONSOLE_ADDR
+                || (it.perm() & PTE_SHM)
+                || physpages[it.pa() / PAGESIZE].refcount != 1) {
+                continue;
             }
-            ++physpages[src.pa() / PAGESIZE].refcount;
-        }
-        else if (src.writable() && src.user() && src.va() != CONSOLE_ADDR) {
-            // Copy-on-write: allocate new page and copy content
-            void* new_page = kalloc(PAGESIZE);
-            if (!new_page) {
-                cleanup_pagetable(child_pagetable);
-                return -1;
+            uint64_t h = page_hash(it.kptr());
+            size_t i = h % arraysize(ksm_table);
+            while (ksm_table[i].pn
+                   && (ksm_table[i].hash != h
+                       || memcmp(it.kptr(),
+                                 reinterpret_cast<void*>(ksm_table[i].pn * PAGESIZE),
+                                 PAGESIZE) != 0)) {
+                i = (i + 1) % arraysize(ksm_table);
             }
-
-            memcpy(new_page, (void*)src.pa(), PAGESIZE);
-            int r = dst.try_map((uintptr_t)new_page, src.perm());
-            if (r != 0) {
-                kfree(new_page);
-                cleanup_pagetable(child_pagetable);
-                return -1;
+            ksm_entry& e = ksm_table[i];
+            if (!e.pn || physpages[e.pn].refcount >= PID_MAX) {
+                // First copy (or the existing copy is full): remember it
+                e = {h, it.va(), pid, unsigned(it.pa() / PAGESIZE)};
+                continue;
+            }
+            // Duplicate: share `e`'s page copy-on-write and free ours
+            if (physpages[e.pn].refcount == 1) {
+                ksm_share(&ptable[e.pid], e.va);
+            }
+            void* dup = it.kptr();
+            int perm = it.perm();
+            if (perm & (PTE_W | PTE_COW)) {
+                perm = (perm & ~PTE_W) | PTE_COW;
             }
+            it.map(e.pn * PAGESIZE, perm);
+            ++physpages[e.pn].refcount;
+            kfree(dup);
+            ++nfreed;
+        }
+    }
+
+    log_printf("ksm: merged %u duplicate pages\n", nfreed);
+    return nfreed;
+}
+
+// syscall_fork()
+//    Handles the fork system call to create a new process.
+
+pid_t syscall_fork() {
+    // Find a free slot for the child process
+    pid_t child_pid = find_free_pid();
+    if (child_pid == -1) {
+        return -1; // No free slots available
+    }
+
+    // Allocate a new page table for the child, with kernel mappings
+    x86_64_pagetable* child_pagetable = process_pagetable();
+    if (!child_pagetable) {
+        return -1; // Allocation failed
+    }
+
+    // Copy user space mappings. Share every user page: writable pages
+    // become copy-on-write in both processes, and `cow_fault` copies them
+    // on first write.
+    vmiter src(current, PROC_START_ADDR);
+    vmiter dst(child_pagetable, PROC_START_ADDR);
+    int r = dst.try_copy_range(src, MEMSIZE_VIRTUAL - PROC_START_ADDR,
+                               [] (vmiter& it) {
+        if (!it.user() || it.va() == CONSOLE_ADDR) {
+            return -1;
+        }
+        int perm = it.perm();
+        if ((perm & (PTE_W | PTE_COW)) && !(perm & PTE_SHM)) {
+            perm = (perm & ~PTE_W) | PTE_COW;
+            it.map(it.pa(), perm);
         }
-        // Kernel mappings are already copied
+        ++physpages[it.pa() / PAGESIZE].refcount;
+        return perm;
+    });
+    if (r != 0) {
+        // The page at `src` was counted but not mapped in the child
+        kfree(src.kptr());
+        cleanup_pagetable(child_pagetable);
+        return -1;
     }
 
     // Set up child process descriptor
     ptable[child_pid].regs = current->regs;
     ptable[child_pid].regs.reg_rax = 0; // Child returns 0 from fork
+    ptable[child_pid].nvmas = current->nvmas;
+    for (int i = 0; i != current->nvmas; ++i) {
+        ptable[child_pid].vmas[i] = current->vmas[i];
+    }
     ptable[child_pid].pagetable = child_pagetable;
+    ptable[child_pid].vfork_parent = 0;
     ptable[child_pid].state = P_RUNNABLE;
+    pid_claim(child_pid);
+    sched_init_proc(&ptable[child_pid]);
+    sched_enqueue(&ptable[child_pid]);
 
     // Parent receives child's PID
     return child_pid;
 }
+// find_free_pid(), pid_claim(pid), pid_release(pid)
+//    `free_pids` has bit `pid % 64` of word `pid / 64` set iff `ptable[pid]`
+//    is free, so finding a free pid takes a `ctz` per 64 pids rather than
+//    a process table scan. `find_free_pid` returns the lowest free pid, or
+//    -1 if the process table is full; it doesn't claim it. Whatever takes a
+//    pid out of `P_FREE` must call `pid_claim`, and whatever sets `P_FREE`
+//    must call `pid_release`.
+
+static uint64_t free_pids[(PID_MAX + 63) / 64];
+
+static pid_t find_free_pid() {
+    for (unsigned w = 0; w != arraysize(free_pids); ++w) {
+        if (free_pids[w]) {
+            return w * 64 + __builtin_ctzll(free_pids[w]);
+        }
+    }
+    return -1;
+}
+
+static void pid_claim(pid_t pid) {
+    free_pids[pid / 64] &= ~(1ULL << (pid % 64));
+}
+
+static void pid_release(pid_t pid) {
+    free_pids[pid / 64] |= 1ULL << (pid % 64);
+}
+
+// syscall_spawn(program_number)
+//    Handles the SYSCALL_SPAWN system call: start program `program_number`
+//    in a new process, without copying anything from `current`.
+
+static pid_t syscall_spawn(int program_number) {
+    program_image pgm(program_number);
+    pid_t pid = find_free_pid();
+    if (pgm.empty() || pid == -1) {
+        return -1;
+    }
+    x86_64_pagetable* pagetable = process_pagetable();
+    if (!pagetable) {
+        return -1;
+    }
+    process_load(&ptable[pid], pagetable, pgm);
+    return pid;
+}
+
+// syscall_vfork()
+//    Handles the SYSCALL_VFORK system call: start a child that runs on
+//    `current`'s page table, and block `current` until the child exits
+//    (see `sys_exit`).
+
+static pid_t syscall_vfork() {
+    pid_t child_pid = find_free_pid();
+    if (child_pid == -1) {
+        return -1;
+    }
+    proc* child = &ptable[child_pid];
+    child->regs = current->regs;
+    child->regs.reg_rax = 0;
+    child->nvmas = current->nvmas;
+    for (int i = 0; i != current->nvmas; ++i) {
+        child->vmas[i] = current->vmas[i];
+    }
+    child->pagetable = current->pagetable;
+    child->vfork_parent = current->pid;
+    child->state = P_RUNNABLE;
+    pid_claim(child_pid);
+    sched_init_proc(child);
+    sched_enqueue(child);
+
+    current->regs.reg_rax = child_pid;
+    current->state = P_BLOCKED;
+    schedule(); // Does not return
+}
+
+// proc_meminfo(p, mi)
+//    Count `p`'s memory usage by walking its page table.
+
+void proc_meminfo(const proc* p, meminfo* mi) {
+    memset(mi, 0, sizeof(*mi));
+    for (vmiter it(p, PROC_START_ADDR);
+         it.va() < MEMSIZE_VIRTUAL;
+         ) {
+        if (!it.user()) {
+            it.next_range();
+            continue;
+        }
+        ++mi->resident;
+        if (physpages[it.pa() / PAGESIZE].refcount > 1) {
+            ++mi->shared;
+        }
+        if (it.perm() & PTE_COW) {
+            ++mi->cow;
+        }
+        it.next();
+    }
+    for (unsigned pn = 0; pn != NPAGES; ++pn) {
+        if (physpages[pn].used() && physpages[pn].owner == p->pid) {
+            ++mi->owned;
+        }
+    }
+    mi->free = nfree_pages;
+}
+
+// copy_to_user(p, va, src, sz)
+//    Copy `sz` bytes from kernel memory `src` to `p`'s memory at `va`,
+//    faulting in or copying (if copy-on-write) its pages as needed.
+//    Returns 0 on success and -1 if the destination isn't writable.
+
+static int copy_to_user(proc* p, uintptr_t va, const void* src, size_t sz) {
+    const char* s = reinterpret_cast<const char*>(src);
+    while (sz != 0) {
+        if (va < PROC_START_ADDR || va >= MEMSIZE_VIRTUAL) {
+            return -1;
+        }
+        vmiter it(p, va);
+        if (!it.user() && !vma_fault(p, va)) {
+            return -1;
+        }
+        it.find(va);
+        if ((it.perm() & PTE_COW) && !cow_fault(p, va)) {
+            return -1;
+        }
+        it.find(va);
+        if (!it.writable() || !it.user()) {
+            return -1;
+        }
+        size_t n = min(sz, PAGESIZE - va % PAGESIZE);
+        memcpy(it.kptr(), s, n);
+        s += n;
+        va += n;
+        sz -= n;
+    }
+    return 0;
+}
+
+// copy_from_user(p, dst, va, sz)
+//    Copy `sz` bytes from `p`'s memory at `va` to kernel memory `dst`,
+//    faulting in its pages as needed. Returns 0 on success and -1 if the
+//    source isn't user-accessible.
+
+static int copy_from_user(proc* p, void* dst, uintptr_t va, size_t sz) {
+    char* d = reinterpret_cast<char*>(dst);
+    while (sz != 0) {
+        if (va < PROC_START_ADDR || va >= MEMSIZE_VIRTUAL) {
+            return -1;
+        }
+        vmiter it(p, va);
+        if (!it.user() && !vma_fault(p, va)) {
+            return -1;
+        }
+        it.find(va);
+        if (!it.user()) {
+            return -1;
+        }
+        size_t n = min(sz, PAGESIZE - va % PAGESIZE);
+        memcpy(d, it.kptr(), n);
+        d += n;
+        va += n;
+        sz -= n;
+    }
+    return 0;
+}
+
+// syscall_meminfo(pid, addr)
+//    Handles the SYSCALL_MEMINFO system call.
+
+static int syscall_meminfo(pid_t pid, uintptr_t addr) {
+    proc* p = pid == 0 ? current : nullptr;
+    if (pid > 0 && pid < PID_MAX) {
+        p = &ptable[pid];
+    }
+    if (!p || p->state == P_FREE || !p->pagetable) {
+        return -1;
+    }
+    meminfo mi;
+    proc_meminfo(p, &mi);
+    return copy_to_user(current, addr, &mi, sizeof(mi));
+}
+
+
+// cow_fault(p, addr)
+//    Handle a user write fault by `p` on `addr`. If `addr` is mapped
+//    copy-on-write, give `p` a private writable copy of the page and
+//    return true. Returns false if the fault is a real error or memory is
+//    exhausted.
+
+static bool cow_fault(proc* p, uintptr_t addr) {
+    vmiter it(p, round_down(addr, PAGESIZE));
+    if (!it.user() || !(it.perm() & PTE_COW)) {
+        return false;
+    }
+
+    uintptr_t pa = it.pa();
+    if (physpages[pa / PAGESIZE].refcount > 1) {
+        // Still shared: copy the page and drop our reference
+        void* copy = kalloc_user(p);
+        if (!copy) {
+            return false;
+        }
+        memcpy(copy, (void*) pa, PAGESIZE);
+        kfree((void*) pa);
+        pa = (uintptr_t) copy;
+    }
+    // Otherwise every other sharer has copied or exited; reuse in place
+    it.map(pa, (it.perm() & ~PTE_COW) | PTE_W);
+    return true;
+}
 
 // exception(regs)
 //    Exception handler (for interrupts, traps, and faults).
 
 void exception(regstate* regs) {
+    // Timer interrupts taken while the kernel is idle (see `schedule`)
+    // only advance time; return to the idle loop
+    if ((regs->reg_cs & 3) == 0 && regs->reg_intno == INT_IRQ + IRQ_TIMER) {
+        kernel_lock.lock();
+        timer_interrupt();
+        kernel_lock.unlock();
+        return;
+    }
+
+    kernel_lock.lock();
+
     // Save current register state
     current->regs = *regs;
     regs = &current->regs;
 
-    // Log exception details
-    log_printf("Process %d: Exception %d at RIP %p\n",
-               current->pid, regs->reg_intno, regs->reg_rip);
+    ktrace(KT_EXCEPTION, regs->reg_intno);
+    if (WEENSYOS_ENTRY_VIEWER) {
+        // Show the current cursor location and memory state
+        console_show_cursor(cursorpos);
+        if (regs->reg_intno != INT_PF || (regs->reg_errcode & PTE_U)) {
+            memshow();
+        }
 
-    // Show the current cursor location and memory state
-    console_show_cursor(cursorpos);
-    if (regs->reg_intno != INT_PF || (regs->reg_errcode & PTE_U)) {
-        memshow();
+        // If Control-C was typed, exit the virtual machine.
+        check_keyboard();
+    } else {
+        ++nexceptions;
     }
 
-    // If Control-C was typed, exit the virtual machine.
-    check_keyboard();
-
     // Handle the exception
     switch (regs->reg_intno) {
 
     case INT_IRQ + IRQ_TIMER:
-        ++ticks;
-        lapicstate::get().ack();
-        schedule();
-        break; // Will not be reached
+        timer_interrupt();
+        if (sched_tick(current)) {
+            schedule();
+        }
+        break;
 
     case INT_PF: {
         // Analyze faulting address and access type.
         uintptr_t addr = rdcr2();
+        if ((regs->reg_errcode & (PTE_P | PTE_W | PTE_U)) == (PTE_P | PTE_W | PTE_U)
+            && cow_fault(current, addr)) {
+            break;
+        }
+        if ((regs->reg_errcode & (PTE_P | PTE_U)) == PTE_U
+            && vma_fault(current, addr)) {
+            break;
+        }
         const char* operation = (regs->reg_errcode & PTE_W) ? "write" : "read";
         const char* problem = (regs->reg_errcode & PTE_P) ? "protection" : "missing page";
 
@@ -454,21 +1018,33 @@ void exception(regstate* regs) {
 // syscall(regs)
 //    Handle a system call initiated by a `syscall` instruction.
 
+static uintptr_t syscall_dispatch(regstate* regs);
+static uintptr_t user_cr3(proc* p);
+
 uintptr_t syscall(regstate* regs) {
+    kernel_lock.lock();
+    uintptr_t r = syscall_dispatch(regs);
+    this_cpu()->user_cr3_ = user_cr3(current);
+    kernel_lock.unlock();
+    return r;
+}
+
+static uintptr_t syscall_dispatch(regstate* regs) {
     // Save current register state
     current->regs = *regs;
     regs = &current->regs;
 
-    // Log syscall details
-    log_printf("Process %d: Syscall %ld at RIP %p\n",
-               current->pid, regs->reg_rax, regs->reg_rip);
-
-    // Show the current cursor location and memory state
-    console_show_cursor(cursorpos);
-    memshow();
+    ktrace(KT_SYSCALL, regs->reg_rax);
+    if (WEENSYOS_ENTRY_VIEWER) {
+        // Show the current cursor location and memory state
+        console_show_cursor(cursorpos);
+        memshow();
 
-    // If Control-C was typed, exit the virtual machine.
-    check_keyboard();
+        // If Control-C was typed, exit the virtual machine.
+        check_keyboard();
+    } else {
+        ++nsyscalls;
+    }
 
     // Handle the system call
     switch (regs->reg_rax) {
@@ -487,9 +1063,34 @@ uintptr_t syscall(regstate* regs) {
     case SYSCALL_PAGE_ALLOC:
         return syscall_page_alloc(current->regs.reg_rdi);
 
+    case SYSCALL_PAGE_ALLOC_RANGE:
+        return syscall_page_alloc_range(current->regs.reg_rdi,
+                                        current->regs.reg_rsi);
+
+    case SYSCALL_BATCH:
+        return syscall_batch(current->regs.reg_rdi, current->regs.reg_rsi);
+
+    case SYSCALL_SHM_CREATE:
+        return syscall_shm_create(current->regs.reg_rdi);
+
+    case SYSCALL_SHM_MAP:
+        return syscall_shm_map(current->regs.reg_rdi, current->regs.reg_rsi);
+
     case SYSCALL_FORK:
         return syscall_fork();
 
+    case SYSCALL_SPAWN:
+        return syscall_spawn(current->regs.reg_rdi);
+
+    case SYSCALL_VFORK:
+        return syscall_vfork();
+
+    case SYSCALL_MEMINFO:
+        return syscall_meminfo(current->regs.reg_rdi, current->regs.reg_rsi);
+
+    case SYSCALL_SLEEP:
+        syscall_sleep(current->regs.reg_rdi); // Does not return
+
     case SYSCALL_EXIT:
         sys_exit();
         schedule(); // Should not be reached
@@ -502,6 +1103,67 @@ uintptr_t syscall(regstate* regs) {
     panic("Syscall handler should not return here!\n");
 }
 
+// TIMER WHEEL
+//
+//    Sleeping processes wait in `timer_wheel[wake_tick % TIMER_WHEEL_SLOTS]`,
+//    linked through `proc::sleep_next`. Each tick examines one slot, so
+//    advancing time costs O(1) plus the sleepers hashed to that slot.
+
+static proc* timer_wheel[TIMER_WHEEL_SLOTS];
+
+// timer_interrupt()
+//    Handle a timer interrupt. Every CPU gets timer interrupts, but only
+//    CPU 0 advances `ticks`, runs periodic scheduler work and the memory
+//    viewer, and wakes processes whose sleep has ended.
+
+static void timer_interrupt() {
+    lapicstate::get().ack();
+    if (this_cpu()->index != 0) {
+        return;
+    }
+    ++ticks;
+    if (ticks % SCHED_BOOST_TICKS == 0) {
+        sched_boost();
+    }
+    if (!WEENSYOS_ENTRY_VIEWER && ticks % VIEWER_TICKS == 0) {
+        console_show_cursor(cursorpos);
+        memshow();
+        check_keyboard();
+        if (ticks % HZ == 0 && (nsyscalls || nexceptions)) {
+            log_printf("%lu syscalls, %lu exceptions in the last second\n",
+                       nsyscalls, nexceptions);
+            nsyscalls = nexceptions = 0;
+        }
+    }
+
+    proc** pp = &timer_wheel[ticks % TIMER_WHEEL_SLOTS];
+    while (proc* p = *pp) {
+        if (p->wake_tick <= ticks) {
+            *pp = p->sleep_next;
+            p->state = P_RUNNABLE;
+            sched_enqueue(p);
+        } else {
+            pp = &p->sleep_next;
+        }
+    }
+}
+
+// syscall_sleep(nticks)
+//    Handles the SYSCALL_SLEEP system call: block `current` on the timer
+//    wheel for `nticks` ticks, then switch to another process.
+
+static void syscall_sleep(unsigned long nticks) {
+    current->regs.reg_rax = 0;
+    if (nticks != 0) {
+        current->wake_tick = ticks + nticks;
+        proc*& slot = timer_wheel[current->wake_tick % TIMER_WHEEL_SLOTS];
+        current->sleep_next = slot;
+        slot = current;
+        current->state = P_BLOCKED;
+    }
+    schedule(); // Does not return
+}
+
 // syscall_page_alloc(addr)
 //    Handles the SYSCALL_PAGE_ALLOC system call.
 
@@ -512,71 +1174,402 @@ int syscall_page_alloc(uintptr_t addr) {
     }
 
     // Allocate a new physical page
-    void* new_page = kalloc(PAGESIZE);
+    void* new_page = kalloc_user(current);
     if (!new_page) {
         return -1; // Allocation failed
     }
 
-    // Initialize with zero
-    memset(new_page, 0, PAGESIZE);
-
-    // Map the new page into the current process's page table
-    int r = vmiter(current->pagetable, addr).try_map((uintptr_t)new_page, PTE_P | PTE_W | PTE_U);
+    // Map the new page into the current process's page table, replacing
+    // any page that was already faulted in there
+    vmiter it(current, addr);
+    void* old_page = it.user() ? it.kptr() : nullptr;
+    bool old_shared = it.user() && (it.perm() & PTE_SHM);
+    int r = it.try_map((uintptr_t)new_page, PTE_P | PTE_W | PTE_U);
     if (r != 0) {
         kfree(new_page);
         return -1; // Mapping failed
     }
+    kfree(old_page);
+    if (old_shared) {
+        shm_gc();
+    }
 
     return 0; // Success
 }
 
+// syscall_page_alloc_range(addr, npages)
+//    Handles the SYSCALL_PAGE_ALLOC_RANGE system call.
+
+static int syscall_page_alloc_range(uintptr_t addr, size_t npages) {
+    if (npages > (MEMSIZE_VIRTUAL - PROC_START_ADDR) / PAGESIZE) {
+        return -1;
+    }
+    for (size_t i = 0; i != npages; ++i) {
+        if (syscall_page_alloc(addr + i * PAGESIZE) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// syscall_batch(addr, n)
+//    Handles the SYSCALL_BATCH system call: run the `batch_call`s at user
+//    address `addr`, which must not block or exit.
+
+static int syscall_batch(uintptr_t addr, size_t n) {
+    if (n > BATCH_MAX) {
+        return -1;
+    }
+    for (size_t i = 0; i != n; ++i) {
+        uintptr_t va = addr + i * sizeof(batch_call);
+        batch_call c;
+        if (copy_from_user(current, &c, va, sizeof(c)) != 0) {
+            return -1;
+        }
+        switch (c.num) {
+        case SYSCALL_GETPID:
+            c.result = current->pid;
+            break;
+        case SYSCALL_PAGE_ALLOC:
+            c.result = syscall_page_alloc(c.arg0);
+            break;
+        case SYSCALL_PAGE_ALLOC_RANGE:
+            c.result = syscall_page_alloc_range(c.arg0, c.arg1);
+            break;
+        case SYSCALL_SHM_CREATE:
+            c.result = syscall_shm_create(c.arg0);
+            break;
+        case SYSCALL_SHM_MAP:
+            c.result = syscall_shm_map(c.arg0, c.arg1);
+            break;
+        case SYSCALL_MEMINFO:
+            c.result = syscall_meminfo(c.arg0, c.arg1);
+            break;
+        default:
+            c.result = -1;
+            break;
+        }
+        if (copy_to_user(current, va, &c, sizeof(c)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// SHARED MEMORY
+//
+//    `sys_shm_create` allocates a segment of zeroed pages in `shms`, and
+//    `sys_shm_map` maps a segment's pages into the caller with `PTE_SHM`.
+//    Each mapping holds a reference on its page and the segment holds one
+//    more, so a segment page whose `refcount` is 1 is mapped nowhere.
+//    `shm_gc` frees segments that were mapped but no longer are.
+
+#define NSHM 8                  // max shared memory segments
+#define SHM_MAXPAGES 16         // max pages per segment
+
+struct shm_segment {
+    unsigned npages = 0;        // 0 iff slot is free
+    bool mapped = false;        // true once `sys_shm_map` has used it
+    void* pages[SHM_MAXPAGES];
+};
+static shm_segment shms[NSHM];
+
+// syscall_shm_create(sz)
+//    Handles the SYSCALL_SHM_CREATE system call.
+
+static int syscall_shm_create(size_t sz) {
+    if (sz == 0 || sz > SHM_MAXPAGES * PAGESIZE) {
+        return -1;
+    }
+    int id = 0;
+    while (id != NSHM && shms[id].npages != 0) {
+        ++id;
+    }
+    if (id == NSHM) {
+        return -1;
+    }
+
+    shm_segment& seg = shms[id];
+    unsigned npages = (sz + PAGESIZE - 1) / PAGESIZE;
+    for (unsigned i = 0; i != npages; ++i) {
+        seg.pages[i] = kalloc_user(current);
+        if (!seg.pages[i]) {
+            while (i != 0) {
+                --i;
+                kfree(seg.pages[i]);
+            }
+            return -1;
+        }
+    }
+    seg.npages = npages;
+    seg.mapped = false;
+    return id;
+}
+
+// syscall_shm_map(id, addr)
+//    Handles the SYSCALL_SHM_MAP system call.
+
+static int syscall_shm_map(int id, uintptr_t addr) {
+    if (id < 0 || id >= NSHM || shms[id].npages == 0) {
+        return -1;
+    }
+    shm_segment& seg = shms[id];
+    if (addr % PAGESIZE != 0 || addr < PROC_START_ADDR || addr >= MEMSIZE_VIRTUAL
+        || seg.npages > (MEMSIZE_VIRTUAL - addr) / PAGESIZE
+        || physpages[kptr2pa(seg.pages[0]) / PAGESIZE].refcount >= PID_MAX) {
+        return -1;
+    }
+
+    int r = 0;
+    bool replaced_shared = false;
+    vmiter it(current, addr);
+    for (unsigned i = 0; i != seg.npages; ++i, it += PAGESIZE) {
+        void* old_page = it.user() ? it.kptr() : nullptr;
+        replaced_shared = replaced_shared || (it.user() && (it.perm() & PTE_SHM));
+        r = it.try_map(seg.pages[i], PTE_P | PTE_W | PTE_U | PTE_SHM);
+        if (r != 0) {
+            break;
+        }
+        ++physpages[kptr2pa(seg.pages[i]) / PAGESIZE].refcount;
+        seg.mapped = true;
+        kfree(old_page);
+    }
+    if (replaced_shared) {
+        shm_gc();
+    }
+    return r == 0 ? 0 : -1;
+}
+
+// shm_gc()
+//    Free every shared memory segment that has been mapped but is no
+//    longer mapped anywhere.
+
+static void shm_gc() {
+    for (shm_segment& seg : shms) {
+        if (seg.npages == 0 || !seg.mapped) {
+            continue;
+        }
+        bool unmapped = true;
+        for (unsigned i = 0; i != seg.npages && unmapped; ++i) {
+            unmapped = physpages[kptr2pa(seg.pages[i]) / PAGESIZE].refcount == 1;
+        }
+        if (unmapped) {
+            for (unsigned i = 0; i != seg.npages; ++i) {
+                kfree(seg.pages[i]);
+            }
+            seg = shm_segment();
+        }
+    }
+}
+
+// SCHEDULER
+//
+//    Multilevel feedback queues, one set per CPU. Runnable processes that
+//    aren't running wait on `cpus[p->sched_cpu]->runq[level]`, and bit L
+//    of that CPU's `runq_mask` is set iff `runq[L]` is nonempty, so picking
+//    the next process is O(1). A CPU whose queues are empty steals from
+//    another CPU's queues before it goes idle. A process that uses
+//    up its time slice drops a level; slices double at each level. Every
+//    `SCHED_BOOST_TICKS`, all processes return to level 0, so CPU-bound
+//    processes cannot starve.
+//
+//    The policy lives entirely behind `sched_init_proc`, `sched_enqueue`,
+//    `sched_pick`, `sched_tick`, and `sched_boost`; with
+//    `SCHED_NLEVELS == 1` it is plain round-robin.
+
+static unsigned sched_slice(int level) {
+    return 1U << level;
+}
+
+// sched_init_proc(p)
+//    Reset `p`'s scheduling state for a new process.
+
+static void sched_init_proc(proc* p) {
+    p->sched_level = 0;
+    p->sched_slice = sched_slice(0);
+    p->sched_queued = false;
+    p->sched_next = nullptr;
+    p->cputime = 0;
+    p->sched_cpu = this_cpu()->index;
+}
+
+// sched_enqueue(p)
+//    Put runnable process `p` at the back of its run queue on the CPU
+//    that last ran it.
+
+static void sched_enqueue(proc* p) {
+    assert(p->state == P_RUNNABLE);
+    if (p->sched_queued) {
+        return;
+    }
+    cpustate* c = cpus[p->sched_cpu];
+    runqueue& q = c->runq[p->sched_level];
+    p->sched_next = nullptr;
+    if (q.tail) {
+        q.tail->sched_next = p;
+    } else {
+        q.head = p;
+    }
+    q.tail = p;
+    p->sched_queued = true;
+    c->runq_mask |= 1U << p->sched_level;
+}
+
+// sched_pop(c)
+//    Remove and return the first process on CPU `c`'s highest-priority
+//    nonempty run queue, or `nullptr` if all its queues are empty.
+
+static proc* sched_pop(cpustate* c) {
+    if (!c->runq_mask) {
+        return nullptr;
+    }
+    int level = __builtin_ctz(c->runq_mask);
+    runqueue& q = c->runq[level];
+    proc* p = q.head;
+    q.head = p->sched_next;
+    if (!q.head) {
+        q.tail = nullptr;
+        c->runq_mask &= ~(1U << level);
+    }
+    p->sched_queued = false;
+    return p;
+}
+
+// sched_pick()
+//    Remove and return the next process for this CPU to run: the first
+//    process on its own queues, or else one stolen from another CPU.
+//    Returns `nullptr` if every queue is empty.
+
+static proc* sched_pick() {
+    cpustate* self = this_cpu();
+    if (proc* p = sched_pop(self)) {
+        return p;
+    }
+    for (int i = 1; i < ncpu; ++i) {
+        cpustate* victim = cpus[(self->index + i) % ncpu];
+        if (victim) {
+            if (proc* p = sched_pop(victim)) {
+                return p;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// sched_tick(p)
+//    Charge a timer tick to running process `p`. Returns true if `p` has
+//    used up its time slice and should be preempted.
+
+static bool sched_tick(proc* p) {
+    ++p->cputime;
+    if (--p->sched_slice != 0) {
+        return false;
+    }
+    if (p->sched_level < SCHED_NLEVELS - 1) {
+        ++p->sched_level;
+    }
+    p->sched_slice = sched_slice(p->sched_level);
+    return true;
+}
+
+// sched_boost()
+//    Move every process back to level 0 with a fresh time slice.
+
+static void sched_boost() {
+    for (pid_t i = 1; i < PID_MAX; ++i) {
+        ptable[i].sched_level = 0;
+        ptable[i].sched_slice = sched_slice(0);
+    }
+    for (int i = 0; i < ncpu; ++i) {
+        cpustate* c = cpus[i];
+        if (!c) {
+            continue;
+        }
+        runqueue* runq = c->runq;
+        for (int level = 1; level < SCHED_NLEVELS; ++level) {
+            if (runq[level].head) {
+                if (runq[0].tail) {
+                    runq[0].tail->sched_next = runq[level].head;
+                } else {
+                    runq[0].head = runq[level].head;
+                }
+                runq[0].tail = runq[level].tail;
+                runq[level] = runqueue();
+            }
+        }
+        if (c->runq_mask) {
+            c->runq_mask = 1;
+        }
+    }
+}
+
 // schedule()
 //    Pick the next process to run and then run it.
-//    If there are no runnable processes, spins forever.
+//    If there are no runnable processes, idles until there are.
 
 void schedule() {
-    static pid_t last_pid = 0;
+    if (current && current->state == P_RUNNABLE) {
+        sched_enqueue(current);
+    }
+    current = nullptr;
+
+    // Reclaim duplicate pages when memory is low (safe here: no page
+    // table walk is in progress)
+    static unsigned long ksm_tick = 0;
+    if (ksm_wanted && ticks - ksm_tick >= KSM_INTERVAL) {
+        ksm_tick = ticks;
+        ksm_merge();
+    }
 
     while (true) {
-        // Iterate through all possible PIDs starting from last_pid + 1
-        for (int i = 0; i < PID_MAX; ++i) {
-            last_pid = (last_pid + 1) % PID_MAX;
-            proc* p = &ptable[last_pid];
-
+        while (proc* p = sched_pick()) {
             if (p->state == P_RUNNABLE) {
+                ktrace(KT_SCHEDULE, p->pid);
                 run(p);
             }
         }
 
-        // If no runnable process was found, spin
-        // Optionally, implement a low-power wait or halt here
+        // No runnable process was found
 
-        // Periodically display memory state
-        if (ticks % (HZ / 4) == 0) { // Every 0.25 seconds
+        // Periodically display memory state (otherwise the timer
+        // interrupt does this)
+        if (WEENSYOS_ENTRY_VIEWER && ticks % (HZ / 4) == 0) {
             memshow();
         }
 
         // Handle keyboard interrupts
         check_keyboard();
-    }
 
-    // Spin indefinitely if no runnable processes
-    while (true) {
-       
+        // Use idle time to tear down exited processes' address spaces and
+        // zero freed pages; once there is nothing left to do, halt
+        // until the next interrupt (`exception` returns here for timer
+        // interrupts taken while idle)
+        if (!reap_zombie() && !kalloc_zero_idle()) {
+            ktrace(KT_IDLE, 0);
+            kernel_lock.unlock();
+            sti();
+            halt();
+            cli();
+            kernel_lock.lock();
+        }
     }
 }
 
 // run(p)
-//    Run process `p`. This involves setting `current = p` and calling
-//    `exception_return` to restore its page table and registers.
+//    Run process `p`. This involves setting `current = p`, releasing
+//    `kernel_lock`, and calling `exception_return` to restore its page
+//    table and registers.
 
 void run(proc* p) {
     assert(p->state == P_RUNNABLE);
     current = p;
+    p->sched_cpu = this_cpu()->index;
 
     // Validate process state
     check_process_registers(p);
     check_pagetable(p->pagetable);
+    this_cpu()->user_cr3_ = user_cr3(p);
+    kernel_lock.unlock();
 
     // Transition to user mode
     exception_return(p);
@@ -585,6 +1578,28 @@ void run(proc* p) {
     while (true) {}
 }
 
+// user_cr3(p)
+//    Return the `%cr3` value that switches this CPU to `p`'s page table.
+//    With PCIDs, keep `p`'s TLB entries unless its page table, or any
+//    present page table entry (see `tlb_generation`), changed since this
+//    CPU last loaded them.
+
+static uintptr_t user_cr3(proc* p) {
+    uintptr_t cr3 = kptr2pa(p->pagetable);
+    if (!pcid_enabled) {
+        return cr3;
+    }
+    cpustate* c = this_cpu();
+    pid_t pcid = p->pid;
+    if (c->pcid_pagetable[pcid] == p->pagetable
+        && c->pcid_generation[pcid] == tlb_generation) {
+        cr3 |= CR3_NOFLUSH;
+    }
+    c->pcid_pagetable[pcid] = p->pagetable;
+    c->pcid_generation[pcid] = tlb_generation;
+    return cr3 | pcid;
+}
+
 // memshow()
 //    Draw a picture of memory (physical and virtual) on the CGA console.
 //    Switches to a new process's virtual memory map every 0.25 sec.
@@ -627,34 +1642,162 @@ void memshow() {
 //    Handles the exit system call by cleaning up the current process.
 
 void sys_exit() {
-    // Clean up the current process's page table
-    cleanup_pagetable(current->pagetable);
+    if (current->vfork_parent) {
+        // Give the borrowed address space back to the `sys_vfork` caller
+        proc* parent = &ptable[current->vfork_parent];
+        current->vfork_parent = 0;
+        parent->state = P_RUNNABLE;
+        sched_enqueue(parent);
+    } else {
+        // Tear down the address space later, off this process's time
+        zombie_push(current->pagetable);
+    }
+    current->pagetable = nullptr;
 
     // Mark the process as free
     current->state = P_FREE;
+    pid_release(current->pid);
 
     // Schedule the next runnable process
     schedule(); // This will switch to another process
 }
 
-// cleanup_pagetable(pagetable)
-//    Frees all pages mapped in the given page table.
+// ZOMBIE REAPING
+//
+//    `sys_exit` frees the exiting process's slot at once but doesn't tear
+//    down its address space: it queues the page table on `zombies`. An idle
+//    CPU reaps one queued address space per pass through the idle loop,
+//    and `kalloc` reaps them all when it runs out of memory.
 
-void cleanup_pagetable(x86_64_pagetable* pagetable) {
-    // Iterate through all user-space mappings
-    for (vmiter it(pagetable, PROC_START_ADDR); it.va() < MEMSIZE_VIRTUAL; it += PAGESIZE) {
-        if (it.present() && it.user() && it.va() != CONSOLE_ADDR) {
-            kfree((void*)it.pa());
+static x86_64_pagetable* zombies[PID_MAX];
+static unsigned nzombies = 0;
+
+static void zombie_push(x86_64_pagetable* pagetable) {
+    if (nzombies == arraysize(zombies)) {
+        reap_zombie();
+    }
+    zombies[nzombies] = pagetable;
+    ++nzombies;
+}
+
+// reap_zombie()
+//    Tear down one queued address space. Returns false if there was none.
+
+static bool reap_zombie() {
+    if (nzombies == 0) {
+        return false;
+    }
+    --nzombies;
+    cleanup_pagetable(zombies[nzombies]);
+    return true;
+}
+
+// reap_zombies()
+//    Tear down every queued address space. Returns false if there was none.
+
+static bool reap_zombies() {
+    bool any = false;
+    while (reap_zombie()) {
+        any = true;
+    }
+    return any;
+}
+
+// PAGE TABLES
+//
+//    `cleanup_pagetable` clears each entry of a page-table page as it tears
+//    down the mapping, so freed page-table pages are already zero. Up to
+//    `PT_CACHE_SIZE` of them wait in `pt_cache` for `kalloc_pagetable`,
+//    which then needs neither the buddy allocator nor a memset. (WeensyOS
+//    runs on one CPU, so the cache is global.)
+
+#define PT_CACHE_SIZE 8
+static x86_64_pagetable* pt_cache[PT_CACHE_SIZE];
+static int pt_cache_n = 0;
+
+x86_64_pagetable* pagetable_cache_pop() {
+    return pt_cache_n ? pt_cache[--pt_cache_n] : nullptr;
+}
+
+static void pagetable_cache_free(x86_64_pagetable* pt) {
+    memviewer_touch(kptr2pa(pt));   // no longer owned by its process
+    if (pt_cache_n < PT_CACHE_SIZE) {
+        pt_cache[pt_cache_n] = pt;
+        ++pt_cache_n;
+    } else {
+        kfree(pt);
+    }
+}
+
+static void pagetable_cache_drain() {
+    while (pt_cache_n) {
+        kfree(pagetable_cache_pop());
+    }
+}
+
+// process_pagetable()
+//    Allocate a page table for a new process, containing the kernel's
+//    mappings below PROC_START_ADDR: page 0 is inaccessible, the kernel is
+//    kernel-only, and the console is user-accessible. (The kernel's own
+//    page table maps this memory with a 2 MiB page, but user pages share
+//    the same 2 MiB region, so processes need 4 KiB mappings.) Returns
+//    `nullptr` on failure.
+
+static x86_64_pagetable* process_pagetable() {
+    x86_64_pagetable* pt = kalloc_pagetable();
+    if (!pt) {
+        return nullptr;
+    }
+    // These mappings are the same in every address space, so they are
+    // global and stay in the TLB across context switches
+    struct { uintptr_t start, end; int perm; } ranges[] = {
+        {PAGESIZE, CONSOLE_ADDR, PTE_P | PTE_W | PTE_G},
+        {CONSOLE_ADDR, CONSOLE_ADDR + PAGESIZE, PTE_P | PTE_W | PTE_U | PTE_G},
+        {CONSOLE_ADDR + PAGESIZE, PROC_START_ADDR, PTE_P | PTE_W | PTE_G}
+    };
+    for (auto& r : ranges) {
+        if (vmiter(pt, r.start).try_map_range(r.start, r.end - r.start, r.perm) != 0) {
+            cleanup_pagetable(pt);
+            return nullptr;
         }
     }
+    return pt;
+}
 
-    // Iterate and free lower-level page tables
-    for (ptiter pt_it(pagetable); pt_it.va() < MEMSIZE_VIRTUAL; pt_it.next()) {
-        if (pt_it.kptr()) {
-            kfree(pt_it.kptr());
+// free_pagetable(pt, level, va)
+//    Free page-table page `pt`, at `level` (3 is the top, 0 the leaves),
+//    which maps addresses from `va` on. Also frees the user pages it maps.
+//    Kernel mappings (below PROC_START_ADDR) and the console are shared,
+//    so are not freed.
+
+static void free_pagetable(x86_64_pagetable* pt, int level, uintptr_t va) {
+    for (int i = 0; i != (1 << PAGEINDEXBITS); ++i) {
+        x86_64_pageentry_t pte = pt->entry[i];
+        if (!pte) {
+            continue;
+        }
+        pt->entry[i] = 0;
+        uintptr_t eva = va + (uintptr_t(i) << (PAGEOFFBITS + level * PAGEINDEXBITS));
+        uintptr_t pa = pte & PTE_PAMASK;
+        if (!(pte & PTE_P)) {
+            continue;
+        } else if (level > 0 && !(pte & PTE_PS)) {
+            free_pagetable(reinterpret_cast<x86_64_pagetable*>(pa), level - 1, eva);
+        } else if ((pte & PTE_U) && eva >= PROC_START_ADDR && eva != CONSOLE_ADDR) {
+            kfree(reinterpret_cast<void*>(pa));
         }
     }
+    pagetable_cache_free(pt);
+}
 
-    // Free the top-level page table
-    kfree(pagetable);
+// cleanup_pagetable(pagetable)
+//    Frees all pages mapped in the given page table.
+
+void cleanup_pagetable(x86_64_pagetable* pagetable) {
+    // Walk the page-table pages directly, so teardown costs O(page-table
+    // pages) rather than a four-level walk per user page
+    free_pagetable(pagetable, 3, 0);
+    ++tlb_generation;
+    ++pagetable_generation;             // page walk caches may point here
+    shm_gc();
 }
@@ -2,6 +2,7 @@
 #define WEENSYOS_KERNEL_HH
 #include "x86-64.h"
 #include "lib.hh"
+#include "ktrace.h"
 #if WEENSYOS_PROCESS
 #error "kernel.hh should not be used by process code."
 #endif
@@ -23,12 +24,71 @@ class vmiter;
 #define P_FAULTED   3                   // faulted process
 
 // Process descriptor type
+// Virtual memory area: a page-aligned range of user virtual memory that
+// the page fault handler maps on first access. Bytes in
+// `[data_va, data_va + data_size)` are copied from `data`; the rest of
+// the area is zero-filled.
+struct vma {
+    uintptr_t start = 0;                // first address (page-aligned)
+    uintptr_t end = 0;                  // one past last address (page-aligned)
+    int perm = 0;                       // mapping permissions
+    uintptr_t data_va = 0;
+    const char* data = nullptr;
+    size_t data_size = 0;
+
+    bool contains(uintptr_t va) const {
+        return va >= this->start && va < this->end;
+    }
+};
+
+#define NVMA                    8       // max areas per process
+#define STACK_MAXSIZE           (16 * PAGESIZE) // max stack area size
+
+// Page walk cache: a process's recently walked level-1 page table pages,
+// keyed by 2 MiB region, so a `vmiter` constructed from the process can
+// skip the upper three levels of its walk. The cache is valid only while
+// `pagetable` and `generation` match the iterator's page table and
+// `pagetable_generation`, which changes whenever upper-level page table
+// entries are installed or page table pages are freed.
+#define NVMCACHE                4       // cached regions per process
+
+struct vmcache {
+    struct entry {
+        uintptr_t region = 0;           // `va >> L1_REGION_BITS`
+        x86_64_pagetable* l1 = nullptr; // level-1 page table (or nullptr)
+        int perm = 0;                   // permissions of upper levels
+    };
+    x86_64_pagetable* pagetable = nullptr;
+    uint64_t generation = 0;
+    entry e[NVMCACHE];
+};
+#define L1_REGION_BITS          (PAGEOFFBITS + PAGEINDEXBITS)
+
+extern uint64_t pagetable_generation;
+
 struct proc {
     x86_64_pagetable* pagetable;        // process's page table
     pid_t pid;                          // process ID
     int state;                          // process state (see above)
     regstate regs;                      // process's current registers
     // The first 4 members of `proc` must not change, but you can add more.
+    vma vmas[NVMA];                     // demand-paged areas
+    int nvmas;                          // number of used `vmas`
+
+    int sched_level;                    // feedback queue level (0 = highest)
+    unsigned sched_slice;               // timer ticks left in time slice
+    bool sched_queued;                  // true iff on a run queue
+    proc* sched_next;                   // next process on run queue
+    unsigned long cputime;              // timer ticks spent running
+    int sched_cpu;                      // CPU whose run queues hold `this`
+
+    unsigned long wake_tick;            // `sys_sleep`: tick to wake at
+    proc* sleep_next;                   // next process in timer wheel slot
+
+    pid_t vfork_parent;                 // `sys_vfork`: parent whose page
+                                        // table this borrows (0 if none)
+
+    mutable vmcache vmc;                // page walk cache (see `vmiter`)
 };
 
 // Process table
@@ -37,7 +97,7 @@ extern proc ptable[PID_MAX];
 
 // Kernel start address
 #define KERNEL_START_ADDR       0x40000
-// Top of the kernel stack
+// Top of CPU 0's kernel stack (see `cpustate`)
 #define KERNEL_STACK_TOP        0x80000
 
 // First application-accessible address
@@ -51,6 +111,83 @@ extern proc ptable[PID_MAX];
 // Virtual memory size
 #define MEMSIZE_VIRTUAL         0x300000
 
+
+// Scheduler run queue (see `schedule` in kernel.cc)
+#define SCHED_NLEVELS           4       // scheduler feedback queue levels
+
+struct runqueue {
+    proc* head = nullptr;
+    proc* tail = nullptr;
+};
+
+// Per-CPU state
+//    Each CPU's `cpustate` lives at the bottom of its one-page kernel stack,
+//    so `this_cpu()` can find it from `%rsp`. CPU I's stack top is
+//    `KERNEL_STACK_TOP + I * PAGESIZE`. `current_` and `user_cr3_` must
+//    remain the first members; `syscall_entry` and `exception_return` read
+//    them.
+#define NCPU_MAX                8       // max supported CPUs
+
+struct cpustate {
+    proc* current_;                     // process running on this CPU
+    uintptr_t user_cr3_;                // %cr3 for returning to `current_`
+    int index;                          // CPU number (0 = boot CPU)
+    uint32_t lapic_id;                  // local APIC ID
+    runqueue runq[SCHED_NLEVELS];       // this CPU's run queues
+    unsigned runq_mask;                 // bit L set iff `runq[L]` nonempty
+    uint64_t gdt_segments[7];
+    x86_64_taskstate taskstate;
+    // page table and `tlb_generation` last loaded for each PCID (= pid)
+    x86_64_pagetable* pcid_pagetable[PID_MAX];
+    uint64_t pcid_generation[PID_MAX];
+
+    // Initialize the state for CPU `index`.
+    void init(int i);
+
+    uintptr_t stack_top() const {
+        return KERNEL_STACK_TOP + this->index * PAGESIZE;
+    }
+};
+
+// this_cpu()
+//    Return the current CPU's state.
+inline cpustate* this_cpu() {
+    return reinterpret_cast<cpustate*>(rdrsp() & ~(PAGESIZE - 1));
+}
+
+extern cpustate* cpus[NCPU_MAX];        // started CPUs, by index
+extern int ncpu;                        // number of started CPUs
+
+
+// TLB tagging
+//    With PCIDs, each process's TLB entries are tagged with its pid and
+//    survive switches to other address spaces; the kernel page table uses
+//    PCID 0. Any change to a present page table entry bumps
+//    `tlb_generation`, and a PCID is flushed when it is next loaded if the
+//    generation moved since. `kernel_cr3` is the `%cr3` value kernel entry
+//    code loads.
+extern bool pcid_enabled;
+extern uint64_t tlb_generation;
+extern uintptr_t kernel_cr3;
+
+
+// ktrace(event, arg)
+//    Append an event record (see `ktrace.h`) to the kernel trace ring
+//    buffer. This neither formats nor does I/O, so it is cheap enough for
+//    hot paths. The caller must hold the kernel lock.
+extern ktrace_buffer ktrace_buf;
+
+inline void ktrace(unsigned event, uint64_t arg) {
+    ktrace_record& r = ktrace_buf.records[ktrace_buf.head % KTRACE_NRECORDS];
+    ++ktrace_buf.head;
+    cpustate* c = this_cpu();
+    r.tsc = rdtsc();
+    r.pid = c->current_ ? c->current_->pid : 0;
+    r.event = event;
+    r.cpu = c->index;
+    r.arg = arg;
+}
+
 // physpages
 //    Status of physical memory.
 //
@@ -65,8 +202,24 @@ extern proc ptable[PID_MAX];
 //
 //    You can add more information to `physpageinfo` if you need to.
 //    The memory viewer calls `used()` and `valid()` to check for bugs.
+//
+//    `kalloc` is a buddy allocator over `physpages`. A block of
+//    `PAGESIZE << order` bytes is described by its first ("head") page:
+//    `order` is the block's order, and free blocks have `free_block` set
+//    and are linked by page number through `next` and `prev`. Every page
+//    of an allocated block has nonzero `refcount`, but only the head's
+//    `refcount` counts references. A free block with `zeroed` set is
+//    known to contain only zero bytes. `owner` is the process that
+//    allocated a user page (0 for kernel pages); sharing the page with
+//    `fork` or `sys_shm_map` doesn't change it.
 struct physpageinfo {
     uint8_t refcount = 0;
+    uint8_t order = 0;
+    bool free_block = false;
+    bool zeroed = false;
+    uint8_t owner = 0;
+    uint16_t next = 0;
+    uint16_t prev = 0;
 
     bool used() const {
         return this->refcount != 0;
@@ -77,6 +230,15 @@ struct physpageinfo {
 };
 extern physpageinfo physpages[NPAGES];
 
+// `PTE_COW` marks a user mapping that `fork` shared copy-on-write. Such
+// mappings are read-only; the first write fault copies the page (or, if
+// no other process still shares it, just makes it writable again).
+#define PTE_COW                 PTE_OS1
+
+// `PTE_SHM` marks a user mapping of a shared memory segment (see
+// `sys_shm_map`). Such mappings stay writable and shared across `fork`.
+#define PTE_SHM                 PTE_OS2
+
 
 // Segment selectors
 #define SEGSEL_BOOT_CODE        0x8             // boot code segment
@@ -101,15 +263,39 @@ extern physpageinfo physpages[NPAGES];
 //    and writable to both kernel and application code.
 void init_hardware();
 
+// init_cpu_hardware()
+//    Initialize the current CPU's segments, interrupt state, and local APIC.
+//    `this_cpu()->index` must already be set.
+void init_cpu_hardware();
+
+// init_aps()
+//    Start the application processors. Each runs `ap_entry` (in
+//    k-exception.S) and then `ap_start` (in kernel.cc).
+void init_aps();
+
 // init_timer(rate)
 //    Set the timer interrupt to fire `rate` times a second. Disables the
 //    timer interrupt if `rate <= 0`.
 void init_timer(int rate);
 
 
+// kalloc(sz)
+//    Allocate and zero a physically contiguous, naturally aligned block of
+//    at least `sz` bytes (rounded up to a power-of-two number of pages,
+//    at most `PAGESIZE << KALLOC_MAX_ORDER`). Returns `nullptr` on failure.
+#define KALLOC_MAX_ORDER 9
 void* kalloc(size_t sz);
+
+// kfree(ptr)
+//    Drop a reference to the block at `ptr`, which must have been returned
+//    by `kalloc`, and free it when the last reference goes away.
 void kfree(void* ptr);
 
+// kalloc_zero_idle()
+//    Zero one free block that isn't known to be zero. Returns false if
+//    there was no such block. Called when the CPU is otherwise idle.
+bool kalloc_zero_idle();
+
 
 // kernel page table (used for virtual memory)
 extern x86_64_pagetable kernel_pagetable[];
@@ -126,6 +312,11 @@ bool allocatable_physical_address(uintptr_t pa);
 //    Allocate and initialize a new,e empty level-4 page table.
 x86_64_pagetable* kalloc_pagetable();
 
+// pagetable_cache_pop
+//    Return an already-zeroed page-table page from the page table cache,
+//    or `nullptr` if the cache is empty.
+x86_64_pagetable* pagetable_cache_pop();
+
 // check_process_registers
 //    Validate a process by checking its registers for common errors.
 void check_process_registers(const proc* p);
@@ -149,10 +340,11 @@ void check_page_table_mappings(x86_64_pagetable* pagetable);
 //    in `k-exception.S`; “called” only by hardware.
 void exception_entry();
 
-// syscall_entry
-//    Entry point for system calls (the `syscall` instruction). Defined in
+// syscall_entries
+//    Entry points for system calls (the `syscall` instruction), one per
+//    CPU: `syscall_entries[I]` switches to CPU I's kernel stack. Defined in
 //    `k-exception.S`; “called” only by hardware.
-void syscall_entry();
+extern uintptr_t syscall_entries[NCPU_MAX];
 
 // exception_return
 //    Return from an exception to user mode: load the page table
@@ -170,6 +362,23 @@ void console_show_cursor(int cpos);
 //    space for `vmp`.
 void console_memviewer(proc* vmp);
 
+// proc_meminfo(p, mi)
+//    Fill in `*mi` with `p`'s memory usage (see `sys_meminfo`).
+void proc_meminfo(const proc* p, meminfo* mi);
+
+// memviewer_touch(pa)
+//    Record that physical page `pa`'s reference count or mappings changed,
+//    so the memory viewer must redraw it. `kalloc`, `kfree`, and
+//    `vmiter::try_map` call this; other code that changes `physpages[]` or
+//    page tables directly should too. A touched top-level page table tells
+//    the viewer to walk that page table again.
+extern uint64_t memviewer_dirty[(NPAGES + 63) / 64];
+inline void memviewer_touch(uintptr_t pa) {
+    if (pa < MEMSIZE_PHYSICAL) {
+        memviewer_dirty[pa / PAGESIZE / 64] |= 1UL << (pa / PAGESIZE % 64);
+    }
+}
+
 
 // keyboard_readc
 //    Read a character from the keyboard. Returns -1 if there is no character
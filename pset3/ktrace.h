@@ -0,0 +1,41 @@
+#ifndef WEENSYOS_KTRACE_H
+#define WEENSYOS_KTRACE_H
+#if defined(WEENSYOS_KERNEL) || defined(WEENSYOS_PROCESS)
+#include "types.h"
+#else
+#include <inttypes.h>
+#include <stddef.h>
+#endif
+
+// ktrace.h
+//
+//    Layout of the kernel trace ring buffer, shared by the kernel (see
+//    `ktrace` in kernel.hh) and the host decoder (build/ktracedump.cc).
+//    In GDB, `ktrace-dump` saves the buffer to `obj/ktrace.bin`; decode
+//    it with `obj/ktracedump obj/ktrace.bin`.
+
+#define KTRACE_MAGIC    0x4543415254534F57UL    // "WOSTRACE"
+#define KTRACE_NRECORDS 512                     // must be a power of 2
+
+// Event types
+#define KT_EXCEPTION    1       // arg: interrupt number
+#define KT_SYSCALL      2       // arg: system call number
+#define KT_KFREE        3       // arg: physical address freed
+#define KT_SCHEDULE     4       // arg: process ID chosen to run
+#define KT_IDLE         5       // CPU halted; arg unused
+
+typedef struct ktrace_record {
+    uint64_t tsc;               // timestamp counter
+    int32_t pid;                // running process, or 0
+    uint16_t event;             // KT_ constant
+    uint16_t cpu;               // CPU index
+    uint64_t arg;
+} ktrace_record;
+
+typedef struct ktrace_buffer {
+    uint64_t magic;             // KTRACE_MAGIC
+    uint64_t head;              // total records ever written
+    ktrace_record records[KTRACE_NRECORDS];
+} ktrace_buffer;
+
+#endif /* !WEENSYOS_KTRACE_H */
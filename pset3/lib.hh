@@ -221,6 +221,34 @@ inline uint32_t crc32c(const void* buf, size_t sz) {
 #define SYSCALL_PAGE_ALLOC      4
 #define SYSCALL_FORK            5
 #define SYSCALL_EXIT            6
+#define SYSCALL_SLEEP           7
+#define SYSCALL_SHM_CREATE      8
+#define SYSCALL_SHM_MAP         9
+#define SYSCALL_SPAWN           10
+#define SYSCALL_VFORK           11
+#define SYSCALL_MEMINFO         12
+#define SYSCALL_PAGE_ALLOC_RANGE 13
+#define SYSCALL_BATCH           14
+
+// One request in a `sys_batch` array. The kernel runs system call `num`
+// with arguments `arg0` and `arg1` and stores its return value in
+// `result`.
+struct batch_call {
+    uintptr_t num;
+    uintptr_t arg0;
+    uintptr_t arg1;
+    intptr_t result;
+};
+#define BATCH_MAX               64      // max calls per `sys_batch`
+
+// Memory usage report filled in by `sys_meminfo` (in pages)
+struct meminfo {
+    unsigned resident;          // user pages mapped
+    unsigned shared;            // ...of which are also mapped elsewhere
+    unsigned cow;               // ...of which are copy-on-write
+    unsigned owned;             // physical pages this process allocated
+    unsigned free;              // free physical pages, system-wide
+};
 
 
 // System call error return values
@@ -240,7 +268,7 @@ inline bool is_error(uintptr_t r) {
 // Maximum number of processes
 
 #ifndef PID_MAX
-#define PID_MAX         16
+#define PID_MAX         32
 #endif
 
 
@@ -0,0 +1,48 @@
+#include "u-lib.hh"
+
+// p-cowbench
+//    Measure what copy-on-write fork saves: allocate heap pages, fork,
+//    and report `sys_meminfo` for the child before and after it writes
+//    every page. Run with `make run-cowbench`.
+
+#define NPAGES_TOUCHED 32
+
+extern uint8_t end[];
+
+static void report(int row, const char* what) {
+    meminfo mi;
+    if (sys_meminfo(0, &mi) < 0) {
+        panic("sys_meminfo failed\n");
+    }
+    console_printf(CPOS(row, 0), 0x0F00,
+                   "%-14s rss %3u shared %3u cow %3u owned %3u free %4u\n",
+                   what, mi.resident, mi.shared, mi.cow, mi.owned, mi.free);
+}
+
+void process_main() {
+    uint8_t* heap = reinterpret_cast<uint8_t*>(round_up((uintptr_t) end, PAGESIZE));
+    for (int i = 0; i != NPAGES_TOUCHED; ++i) {
+        uint8_t* addr = heap + i * PAGESIZE;
+        if (sys_page_alloc(addr) < 0) {
+            panic("sys_page_alloc failed\n");
+        }
+        *addr = i;
+    }
+    report(18, "parent");
+
+    pid_t p = sys_fork();
+    if (p < 0) {
+        panic("sys_fork failed\n");
+    } else if (p == 0) {
+        report(19, "child (fork)");
+        for (int i = 0; i != NPAGES_TOUCHED; ++i) {
+            heap[i * PAGESIZE] = i + 1;
+        }
+        report(20, "child (wrote)");
+        sys_exit();
+    }
+
+    while (true) {
+        sys_yield();
+    }
+}
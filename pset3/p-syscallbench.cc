@@ -0,0 +1,40 @@
+#include "u-lib.hh"
+
+// p-syscallbench
+//    Measure system call latency: time batches of `sys_getpid` and
+//    `sys_yield` calls with `rdtsc` and print the best cycles per call.
+//    Compare kernels built with `make run-syscallbench` and
+//    `make VIEWER=entry run-syscallbench`.
+
+#define NCALLS 1000             // calls per timed batch
+#define NROUNDS 20              // batches per measurement
+
+template <typename F>
+static uint64_t best_cycles_per_call(F f) {
+    uint64_t best = ~uint64_t(0);
+    for (int round = 0; round != NROUNDS; ++round) {
+        uint64_t start = rdtsc();
+        for (int i = 0; i != NCALLS; ++i) {
+            f();
+        }
+        best = min(best, (rdtsc() - start) / NCALLS);
+    }
+    return best;
+}
+
+void process_main() {
+    uint64_t getpid = best_cycles_per_call([] {
+        (void) sys_getpid();
+    });
+    uint64_t yield = best_cycles_per_call([] {
+        sys_yield();
+    });
+
+    console_printf(CPOS(22, 0), 0x0F00,
+                   "sys_getpid: %lu cycles/call   sys_yield: %lu cycles/call\n",
+                   getpid, yield);
+
+    while (true) {
+        sys_yield();
+    }
+}
@@ -34,3 +34,170 @@ void assert_fail(const char* file, int line, const char* msg,
     }
     sys_panic(buf);
 }
+
+
+// HEAP ALLOCATOR
+//
+//    `malloc` serves small requests from per-size-class free lists. Each
+//    heap page holds objects of one class, recorded in `page_class`, so
+//    `free` needs no per-object header. Requests larger than the biggest
+//    class get whole pages, headed by a `bigblock`; freed big blocks wait
+//    on a first-fit list. The heap starts at the first page past the
+//    program image and grows toward the stack, obtaining pages from the
+//    kernel `HEAP_BATCH` at a time with `sys_page_alloc_range`.
+//
+//    Programs that use `malloc` must not `sys_page_alloc` heap addresses
+//    themselves.
+
+#define HEAP_NCLASSES   8       // size classes: 16, 32, ..., 2048 bytes
+#define HEAP_MINSHIFT   4
+#define HEAP_BATCH      4       // pages requested per system call
+#define HEAP_MAXPAGES   512     // heap spans at most 2 MiB
+#define HEAP_BIG        0xFF    // `page_class` for pages of big blocks
+
+extern uint8_t end[];
+
+namespace {
+struct freeobj {
+    freeobj* next;
+};
+struct bigblock {
+    size_t npages;
+    bigblock* next;             // next free big block
+};
+}
+
+static freeobj* class_free[HEAP_NCLASSES];
+static bigblock* big_free;
+static uint8_t page_class[HEAP_MAXPAGES];   // 0 means not yet handed out
+static uintptr_t heap_start;    // first heap page
+static uintptr_t heap_used;     // first page not handed out
+static uintptr_t heap_mapped;   // first page not yet allocated by kernel
+
+static unsigned heap_pageno(uintptr_t addr) {
+    return (addr - heap_start) / PAGESIZE;
+}
+
+// heap_grab(npages)
+//    Hand out `npages` fresh contiguous heap pages, mapping more in
+//    batches as needed. Returns their address, or 0 on failure.
+static uintptr_t heap_grab(size_t npages) {
+    if (!heap_start) {
+        heap_start = heap_used = heap_mapped = round_up((uintptr_t) end, PAGESIZE);
+    }
+    uintptr_t stack_bottom = round_down(rdrsp() - 1, PAGESIZE);
+    uintptr_t limit = min(stack_bottom, heap_start + HEAP_MAXPAGES * PAGESIZE);
+    if (npages > (limit - heap_used) / PAGESIZE) {
+        return 0;
+    }
+    uintptr_t want = heap_used + npages * PAGESIZE;
+    if (want > heap_mapped) {
+        size_t n = max(size_t(HEAP_BATCH), (want - heap_mapped) / PAGESIZE);
+        n = min(n, (limit - heap_mapped) / PAGESIZE);
+        if (sys_page_alloc_range((void*) heap_mapped, n) < 0) {
+            return 0;
+        }
+        heap_mapped += n * PAGESIZE;
+    }
+    uintptr_t addr = heap_used;
+    heap_used = want;
+    return addr;
+}
+
+// malloc(sz)
+//    Return a pointer to `sz` bytes of uninitialized heap memory, aligned
+//    to 16 bytes, or `nullptr` if `sz == 0` or the heap is full.
+void* malloc(size_t sz) {
+    if (sz == 0) {
+        return nullptr;
+    }
+    unsigned c = 0;
+    while (c != HEAP_NCLASSES && (size_t(1) << (c + HEAP_MINSHIFT)) < sz) {
+        ++c;
+    }
+
+    if (c == HEAP_NCLASSES) {
+        // big block: first fit from the free list, else fresh pages
+        if (sz > HEAP_MAXPAGES * PAGESIZE) {
+            return nullptr;
+        }
+        size_t npages = round_up(sz + sizeof(bigblock), PAGESIZE) / PAGESIZE;
+        bigblock** pprev = &big_free;
+        while (*pprev && (*pprev)->npages < npages) {
+            pprev = &(*pprev)->next;
+        }
+        bigblock* b = *pprev;
+        if (b) {
+            *pprev = b->next;
+        } else {
+            b = (bigblock*) heap_grab(npages);
+            if (!b) {
+                return nullptr;
+            }
+            b->npages = npages;
+            for (size_t i = 0; i != npages; ++i) {
+                page_class[heap_pageno((uintptr_t) b) + i] = HEAP_BIG;
+            }
+        }
+        return b + 1;
+    }
+
+    if (!class_free[c]) {
+        // carve a fresh page into objects of this class
+        uintptr_t page = heap_grab(1);
+        if (!page) {
+            return nullptr;
+        }
+        page_class[heap_pageno(page)] = c + 1;
+        size_t objsz = size_t(1) << (c + HEAP_MINSHIFT);
+        for (uintptr_t a = page + PAGESIZE - objsz; ; a -= objsz) {
+            freeobj* o = (freeobj*) a;
+            o->next = class_free[c];
+            class_free[c] = o;
+            if (a == page) {
+                break;
+            }
+        }
+    }
+    freeobj* o = class_free[c];
+    class_free[c] = o->next;
+    return o;
+}
+
+// free(ptr)
+//    Return `ptr`, which `malloc` or `calloc` returned, to the heap.
+//    `free(nullptr)` does nothing.
+void free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    uintptr_t addr = (uintptr_t) ptr;
+    assert(addr >= heap_start && addr < heap_used, "free of non-heap pointer");
+    unsigned c = page_class[heap_pageno(addr)];
+    if (c == HEAP_BIG) {
+        bigblock* b = (bigblock*) ptr - 1;
+        assert(addr % PAGESIZE == sizeof(bigblock), "free of interior pointer");
+        b->next = big_free;
+        big_free = b;
+    } else {
+        assert(c != 0, "free of unallocated pointer");
+        freeobj* o = (freeobj*) ptr;
+        o->next = class_free[c - 1];
+        class_free[c - 1] = o;
+    }
+}
+
+// calloc(count, sz)
+//    Like `malloc(count * sz)`, but the memory is zeroed. Returns `nullptr`
+//    if `count * sz` overflows.
+void* calloc(size_t count, size_t sz) {
+    size_t n;
+    if (__builtin_mul_overflow(count, sz, &n)) {
+        return nullptr;
+    }
+    void* ptr = malloc(n);
+    if (ptr) {
+        memset(ptr, 0, n);
+    }
+    return ptr;
+}
@@ -89,6 +89,13 @@ inline void sys_yield() {
     make_syscall(SYSCALL_YIELD);
 }
 
+// sys_sleep(nticks)
+//    Block this process for at least `nticks` timer ticks (there are 100
+//    ticks per second). `sys_sleep(0)` acts like `sys_yield()`. Returns 0.
+inline int sys_sleep(unsigned nticks) {
+    return make_syscall(SYSCALL_SLEEP, nticks);
+}
+
 // sys_page_alloc(addr)
 //    Allocate a page of memory at address `addr` for this process. The
 //    newly-allocated memory is initialized to 0. Any memory previously
@@ -103,6 +110,47 @@ inline int sys_page_alloc(void* addr) {
     return make_syscall(SYSCALL_PAGE_ALLOC, (uintptr_t) addr);
 }
 
+// sys_page_alloc_range(addr, npages)
+//    Like `sys_page_alloc` on each of the `npages` pages starting at
+//    `addr`, in one system call. Returns 0 on success. On failure returns
+//    a negative error code; pages before the failing one stay allocated.
+inline int sys_page_alloc_range(void* addr, size_t npages) {
+    return make_syscall(SYSCALL_PAGE_ALLOC_RANGE, (uintptr_t) addr, npages);
+}
+
+// sys_batch(calls, n)
+//    Run the `n` system calls described by `calls[0...n-1]` in order, in a
+//    single trap, storing each return value in `calls[i].result`. Only
+//    calls that return to the caller may be batched: `SYSCALL_GETPID`,
+//    `SYSCALL_PAGE_ALLOC`, `SYSCALL_PAGE_ALLOC_RANGE`, `SYSCALL_SHM_CREATE`,
+//    `SYSCALL_SHM_MAP`, and `SYSCALL_MEMINFO`; others get result -1.
+//    Returns 0, or a negative error code if `n > BATCH_MAX` or `calls`
+//    isn't accessible.
+inline int sys_batch(batch_call* calls, size_t n) {
+    return make_syscall(SYSCALL_BATCH, (uintptr_t) calls, n);
+}
+
+// sys_shm_create(sz)
+//    Create a shared memory segment of `sz` bytes (rounded up to whole
+//    pages, at most 16 pages), initialized to 0. Returns the segment's ID,
+//    which any process may pass to `sys_shm_map`, or a negative error code.
+//    A segment lives until it has been mapped and every mapping is gone.
+inline int sys_shm_create(size_t sz) {
+    return make_syscall(SYSCALL_SHM_CREATE, sz);
+}
+
+// sys_shm_map(id, addr)
+//    Map shared memory segment `id` at `addr` for this process, replacing
+//    (and freeing) any memory there. Writes through the mapping are seen by
+//    every process that maps the segment, including across `sys_fork`.
+//    `addr` must be page-aligned, and the segment must fit between
+//    PROC_START_ADDR and MEMSIZE_VIRTUAL. Returns 0 on success and a
+//    negative error code on failure; if memory runs out partway, some of
+//    the segment may be mapped.
+inline int sys_shm_map(int id, void* addr) {
+    return make_syscall(SYSCALL_SHM_MAP, id, (uintptr_t) addr);
+}
+
 // sys_fork()
 //    Fork the current process. On success, returns the child's process ID to
 //    the parent, and returns 0 to the child. On failure, returns a negative
@@ -111,6 +159,33 @@ inline pid_t sys_fork() {
     return make_syscall(SYSCALL_FORK);
 }
 
+// sys_spawn(program_number)
+//    Start a new process running program `program_number` (an index into
+//    the kernel's built-in program images, in the order listed in
+//    `obj/k-foreachimage.h`). Unlike `sys_fork`, this copies nothing from
+//    the caller. Returns the new process ID, or a negative error code.
+inline pid_t sys_spawn(int program_number) {
+    return make_syscall(SYSCALL_SPAWN, program_number);
+}
+
+// sys_vfork()
+//    Create a child process that borrows this process's address space,
+//    including its stack. The caller is suspended until the child exits,
+//    then returns the child's process ID; the child returns 0. The child
+//    must not return from the function that called `sys_vfork` and
+//    should only call `sys_exit`. Returns a negative error code on failure.
+inline pid_t sys_vfork() {
+    return make_syscall(SYSCALL_VFORK);
+}
+
+// sys_meminfo(pid, mi)
+//    Fill in `*mi` with the memory usage of process `pid` (0 means this
+//    process). Returns 0 on success and a negative error code if `pid`
+//    isn't running or `mi` isn't writable.
+inline int sys_meminfo(pid_t pid, meminfo* mi) {
+    return make_syscall(SYSCALL_MEMINFO, pid, (uintptr_t) mi);
+}
+
 // sys_exit()
 //    Exit this process. Does not return.
 [[noreturn]] inline void sys_exit() {
@@ -122,6 +197,14 @@ inline pid_t sys_fork() {
     }
 }
 
+// malloc(sz), free(ptr), calloc(count, sz)
+//    A small heap allocator built on `sys_page_alloc_range` (see u-lib.cc).
+//    Programs that use it must not `sys_page_alloc` heap addresses (those
+//    above the program image) themselves.
+void* malloc(size_t sz);
+void free(void* ptr);
+void* calloc(size_t count, size_t sz);
+
 // sys_panic(msg)
 //    Panic.
 [[noreturn]] inline void sys_panic(const char* msg) {
@@ -27,6 +27,7 @@
 #define PTE_D           0x40UL   // entry was Dirtied (written)
 // Other special-purpose flags
 #define PTE_PS          0x80UL   // entry has a large Page Size
+#define PTE_G           0x100UL  // entry is Global (kept across %cr3 loads)
 #define PTE_PWT         0x8UL
 #define PTE_PCD         0x10UL
 #define PTE_XD          0x8000000000000000UL // entry is eXecute Disabled
@@ -179,6 +180,11 @@ typedef struct x86_64_msr_t {
 #define CR4_PCE                 0x00000100      // Perfmonitor Counter Enable
 #define CR4_OSFXSR              0x00000200      // OS FXSAVE/FXRSTOR support
 #define CR4_VMXE                0x00004000      // VMX Enable
+#define CR4_PCIDE               0x00020000      // Process-Context IDs Enable
+
+// %cr3 flag bits (with CR4_PCIDE)
+#define CR3_PCIDMASK            0xFFFUL         // process-context ID
+#define CR3_NOFLUSH             0x8000000000000000UL // keep PCID's TLB entries
 
 // eflags bits (useful for rdeflags() and wreflags())
 #define EFLAGS_CF               0x00000001      // Carry Flag
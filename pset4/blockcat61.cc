@@ -3,19 +3,24 @@
 // Usage: ./blockcat61 [-b BLOCKSIZE] [-o OUTFILE] [FILE]
 //    Copies the input FILE to standard output in blocks.
 //    With `-R`, reads bytewise; with `-W`, writes bytewise.
+//    With `-K`, prints the CRC-32C of the output to standard error.
 //    Default BLOCKSIZE is 4096.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("b:o:i:D:FRWy", 4096).parse(argc, argv);
+    io61_args args = io61_args("b:o:i:B:D:FKRWyd", 4096).parse(argc, argv);
 
     // Allocate buffer, open files
     unsigned char* buf = new unsigned char[args.block_size];
-    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY | args.direct);
     io61_file* outf = io61_open_check(args.output_file,
-                                      O_WRONLY | O_CREAT | O_TRUNC);
+                                      O_WRONLY | O_CREAT | O_TRUNC | args.direct);
     args.after_open(inf, O_RDONLY);
     args.after_open(outf, O_WRONLY);
+    if (args.checksum && io61_set_checksum(outf, true) < 0) {
+        perror("checksum");
+        exit(1);
+    }
 
     // Copy file data
     while (true) {
@@ -40,6 +45,9 @@ int main(int argc, char* argv[]) {
         args.after_write(outf);
     }
 
+    if (args.checksum) {
+        fprintf(stderr, "%08x\n", io61_checksum(outf));
+    }
     io61_close(inf);
     io61_close(outf);
     delete[] buf;
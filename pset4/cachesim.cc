@@ -0,0 +1,442 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+// Usage: ./cachesim [-b BLOCKSIZE] [-n SLOTS] [-p POLICY,...] TRACE...
+//    Replays io61 access traces (recorded with `IO61_TRACE=TRACE`)
+//    against simple cache designs, and reports the system calls, bytes,
+//    and wall time each took. POLICY is one of:
+//      none     every read and write is a system call
+//      single   one block-sized slot
+//      lru      SLOTS slots, least recently used evicted
+//      clock    SLOTS slots, CLOCK (second chance) eviction
+//      stride   clock, plus reading ahead on a detected stride
+//    Reads replay against the traced file, which must still exist;
+//    writes go to a scratch file. Traced files that were neither regular
+//    nor written (e.g., input pipes) are skipped. Default BLOCKSIZE is
+//    32768, SLOTS is 8, and every POLICY runs.
+
+enum policy { P_NONE, P_SINGLE, P_LRU, P_CLOCK, P_STRIDE };
+static const char* const policy_names[] = {
+    "none", "single", "lru", "clock", "stride"
+};
+
+// Stride prefetch reads this many predicted blocks per miss
+static constexpr unsigned PREFETCH = 3;
+
+struct event {
+    unsigned file;          // index into `files`
+    char op;                // 'r', 'w', 's', or 'c'
+    off_t off;
+    size_t len;
+};
+
+struct traced_file {
+    std::string name;       // PID.N
+    char mode;              // 'r' or 'w'
+    long long size;         // -1 if not a regular file
+    std::string path;
+    bool skip = false;
+};
+
+struct counters {
+    unsigned long long syscalls = 0;
+    unsigned long long bytes_read = 0;
+    unsigned long long bytes_written = 0;
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+};
+
+struct slot {
+    off_t tag = -1;         // block offset, or -1 if empty
+    size_t size = 0;        // bytes read from the file
+    size_t dirty_lo = 0, dirty_hi = 0;  // dirty range, empty if equal
+    unsigned long long used = 0;        // LRU timestamp
+    bool referenced = false;            // CLOCK bit
+};
+
+// One replayed file under one policy
+struct replay {
+    int fd;
+    policy pol;
+    size_t bsize;
+    std::vector<slot> slots;
+    std::vector<unsigned char> buf;     // slot data, `bsize` per slot
+    unsigned hand = 0;
+    unsigned long long tick = 0;
+    off_t last_miss = -1;   // stride detector
+    off_t delta = 0;
+    unsigned run = 0;
+    counters& c;
+
+    replay(int fd_, policy pol_, size_t bsize_, unsigned nslots, counters& c_)
+        : fd(fd_), pol(pol_), bsize(bsize_), c(c_) {
+        if (pol == P_SINGLE) {
+            nslots = 1;
+        } else if (pol == P_NONE) {
+            nslots = 0;
+        }
+        slots.resize(nslots);
+        buf.resize(nslots * bsize);
+    }
+
+    unsigned char* data(unsigned i) {
+        return buf.data() + i * bsize;
+    }
+
+    int find(off_t tag) {
+        for (unsigned i = 0; i != slots.size(); ++i) {
+            if (slots[i].tag == tag) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void write_back(unsigned i) {
+        slot& s = slots[i];
+        if (s.dirty_lo != s.dirty_hi) {
+            ++c.syscalls;
+            ssize_t nw = pwrite(fd, data(i) + s.dirty_lo,
+                                s.dirty_hi - s.dirty_lo, s.tag + s.dirty_lo);
+            c.bytes_written += std::max(nw, ssize_t(0));
+            s.dirty_lo = s.dirty_hi = 0;
+        }
+    }
+
+    // Pick a slot for `tag` and empty it, never choosing one in `pinned`
+    unsigned claim(off_t tag, unsigned pinned) {
+        unsigned v = 0;
+        for (unsigned i = 0; i != slots.size(); ++i) {
+            if (slots[i].tag < 0 && !(pinned & (1U << i))) {
+                v = i;
+                goto found;
+            }
+        }
+        if (pol == P_LRU || pol == P_SINGLE) {
+            unsigned long long best = ~0ULL;
+            for (unsigned i = 0; i != slots.size(); ++i) {
+                if (!(pinned & (1U << i)) && slots[i].used < best) {
+                    best = slots[i].used;
+                    v = i;
+                }
+            }
+        } else {
+            while (true) {
+                unsigned i = hand;
+                hand = (hand + 1) % slots.size();
+                if (pinned & (1U << i)) {
+                    continue;
+                } else if (!slots[i].referenced) {
+                    v = i;
+                    break;
+                }
+                slots[i].referenced = false;
+            }
+        }
+    found:
+        write_back(v);
+        slots[v].tag = tag;
+        slots[v].size = 0;
+        return v;
+    }
+
+    // Fill slots `idx[0, n)`, which hold consecutive blocks, with one
+    // system call
+    void fill(const unsigned* idx, unsigned n) {
+        iovec iov[PREFETCH + 1];
+        for (unsigned k = 0; k != n; ++k) {
+            iov[k] = {data(idx[k]), bsize};
+        }
+        ++c.syscalls;
+        ssize_t nr = preadv(fd, iov, n, slots[idx[0]].tag);
+        size_t left = std::max(nr, ssize_t(0));
+        c.bytes_read += left;
+        for (unsigned k = 0; k != n; ++k) {
+            slots[idx[k]].size = std::min(left, bsize);
+            left -= slots[idx[k]].size;
+        }
+    }
+
+    // Note a miss at `tag` and read ahead on a repeated stride
+    void prefetch(off_t tag, unsigned pinned) {
+        off_t d = last_miss >= 0 ? tag - last_miss : 0;
+        run = d != 0 && d == delta ? run + 1 : 0;
+        delta = d;
+        last_miss = tag;
+        if (pol != P_STRIDE || run < 2) {
+            return;
+        }
+        unsigned idx[PREFETCH];
+        unsigned n = 0;
+        for (unsigned k = 1; k <= PREFETCH && k < slots.size(); ++k) {
+            off_t t = tag + off_t(k) * delta;
+            if (t < 0 || find(t) >= 0) {
+                break;
+            }
+            idx[n] = claim(t, pinned);
+            pinned |= 1U << idx[n];
+            ++n;
+        }
+        // Adjacent blocks share a system call; others get one each
+        if (delta == off_t(bsize)) {
+            fill(idx, n);
+        } else {
+            for (unsigned k = 0; k != n; ++k) {
+                fill(&idx[k], 1);
+            }
+        }
+    }
+
+    void access(char op, off_t off, size_t len) {
+        if (slots.empty()) {
+            std::vector<unsigned char> tmp(len);
+            ++c.syscalls;
+            ++c.misses;
+            ssize_t n = op == 'r' ? pread(fd, tmp.data(), len, off)
+                : pwrite(fd, tmp.data(), len, off);
+            n = std::max(n, ssize_t(0));
+            (op == 'r' ? c.bytes_read : c.bytes_written) += n;
+            return;
+        }
+        while (len != 0) {
+            off_t tag = off - off % bsize;
+            size_t boff = off - tag;
+            size_t n = std::min(len, bsize - boff);
+            int i = find(tag);
+            bool miss = i < 0;
+            if (miss) {
+                i = claim(tag, 0);
+                if (op == 'r') {
+                    prefetch(tag, 1U << i);
+                }
+            }
+            slot& s = slots[i];
+            // A read past what the slot holds needs the file
+            bool need_read = op == 'r' && boff + n > s.size
+                && !(s.dirty_lo <= boff && boff + n <= s.dirty_hi);
+            if (need_read) {
+                write_back(i);
+                unsigned idx = i;
+                fill(&idx, 1);
+                miss = true;
+            }
+            ++(miss ? c.misses : c.hits);
+            if (op == 'w') {
+                if (s.dirty_lo != s.dirty_hi
+                    && (boff > s.dirty_hi || boff + n < s.dirty_lo)) {
+                    write_back(i);
+                }
+                if (s.dirty_lo == s.dirty_hi) {
+                    s.dirty_lo = boff;
+                    s.dirty_hi = boff + n;
+                } else {
+                    s.dirty_lo = std::min(s.dirty_lo, boff);
+                    s.dirty_hi = std::max(s.dirty_hi, boff + n);
+                }
+            }
+            s.used = ++tick;
+            s.referenced = true;
+            off += n;
+            len -= n;
+        }
+    }
+
+    void flush() {
+        for (unsigned i = 0; i != slots.size(); ++i) {
+            write_back(i);
+        }
+    }
+};
+
+static double now() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: ./cachesim [-b BLOCKSIZE] [-n SLOTS] [-p POLICY,...] TRACE...\n");
+    exit(1);
+}
+
+// Read trace `fn` into `files` and `events`
+static void load(const char* fn, std::vector<traced_file>& files,
+                 std::vector<event>& events) {
+    FILE* f = fopen(fn, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", fn, strerror(errno));
+        exit(1);
+    }
+    std::map<std::string, unsigned> ids;
+    char line[8192];
+    unsigned lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ++lineno;
+        char op, name[64];
+        long long a = 0, b = 0;
+        int pos = 0;
+        if (sscanf(line, "%c %63s %n", &op, name, &pos) < 2) {
+            goto bad;
+        }
+        if (op == 'o') {
+            char mode;
+            int pathpos = 0;
+            if (sscanf(line + pos, "%c %lld %n", &mode, &a, &pathpos) < 2) {
+                goto bad;
+            }
+            traced_file tf;
+            tf.name = name;
+            tf.mode = mode;
+            tf.size = a;
+            tf.path = line + pos + pathpos;
+            tf.path.erase(tf.path.find_last_not_of("\n") + 1);
+            tf.skip = mode == 'r' && a < 0;
+            ids[name] = files.size();
+            files.push_back(tf);
+            continue;
+        }
+        if (!ids.count(name)) {
+            goto bad;
+        }
+        if ((op == 'r' || op == 'w')
+            && sscanf(line + pos, "%lld %lld", &a, &b) == 2 && a >= 0 && b >= 0) {
+            events.push_back({ids[name], op, off_t(a), size_t(b)});
+        } else if (op == 's' && sscanf(line + pos, "%lld", &a) == 1) {
+            events.push_back({ids[name], op, off_t(a), 0});
+        } else if (op == 'c') {
+            events.push_back({ids[name], op, 0, 0});
+        } else {
+            goto bad;
+        }
+        continue;
+    bad:
+        fprintf(stderr, "%s:%u: bad trace line\n", fn, lineno);
+        exit(1);
+    }
+    fclose(f);
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    size_t bsize = 32768;
+    unsigned nslots = 8;
+    std::vector<policy> policies;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:p:")) != -1) {
+        char* end;
+        if (opt == 'b') {
+            bsize = strtoul(optarg, &end, 0);
+            if (bsize == 0 || *end) {
+                usage();
+            }
+        } else if (opt == 'n') {
+            nslots = strtoul(optarg, &end, 0);
+            if (nslots == 0 || nslots > 32 || *end) {
+                usage();
+            }
+        } else if (opt == 'p') {
+            for (char* p = strtok(optarg, ","); p; p = strtok(nullptr, ",")) {
+                unsigned k = 0;
+                while (k != 5 && strcmp(p, policy_names[k]) != 0) {
+                    ++k;
+                }
+                if (k == 5) {
+                    usage();
+                }
+                policies.push_back(policy(k));
+            }
+        } else {
+            usage();
+        }
+    }
+    if (optind == argc) {
+        usage();
+    }
+    if (policies.empty()) {
+        policies = {P_NONE, P_SINGLE, P_LRU, P_CLOCK, P_STRIDE};
+    }
+
+    for (int ai = optind; ai != argc; ++ai) {
+        std::vector<traced_file> files;
+        std::vector<event> events;
+        load(argv[ai], files, events);
+        printf("%s: %zu files, %zu events\n", argv[ai], files.size(), events.size());
+        for (auto& tf : files) {
+            if (tf.skip) {
+                printf("  skipping %s %s (not a regular file)\n",
+                       tf.name.c_str(), tf.path.c_str());
+            }
+        }
+        printf("  %-7s %5s %7s %10s %12s %12s %10s %10s %9s\n",
+               "policy", "slots", "block", "syscalls", "bytes_read",
+               "bytes_written", "hits", "misses", "time");
+
+        for (policy pol : policies) {
+            // Open every file fresh: sources for reads, scratch for writes
+            std::vector<int> fds(files.size(), -1);
+            for (size_t i = 0; i != files.size(); ++i) {
+                if (files[i].skip) {
+                    continue;
+                } else if (files[i].mode == 'r') {
+                    fds[i] = open(files[i].path.c_str(), O_RDONLY);
+                    if (fds[i] < 0) {
+                        fprintf(stderr, "%s: %s\n", files[i].path.c_str(), strerror(errno));
+                        exit(1);
+                    }
+                } else {
+                    FILE* tmp = tmpfile();
+                    assert(tmp);
+                    fds[i] = dup(fileno(tmp));
+                    fclose(tmp);
+                }
+            }
+
+            counters c;
+            std::vector<replay*> rs(files.size(), nullptr);
+            double start = now();
+            for (const event& e : events) {
+                if (fds[e.file] < 0) {
+                    continue;
+                }
+                replay*& r = rs[e.file];
+                if (!r) {
+                    r = new replay(fds[e.file], pol, bsize, nslots, c);
+                }
+                if (e.op == 'r' || e.op == 'w') {
+                    r->access(e.op, e.off, e.len);
+                } else if (e.op == 'c') {
+                    r->flush();
+                }
+            }
+            for (replay* r : rs) {
+                if (r) {
+                    r->flush();
+                    delete r;
+                }
+            }
+            double elapsed = now() - start;
+            for (int fd : fds) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+
+            unsigned ns = pol == P_NONE ? 0 : pol == P_SINGLE ? 1 : nslots;
+            printf("  %-7s %5u %7zu %10llu %12llu %12llu %10llu %10llu %8.5fs\n",
+                   policy_names[pol], ns, bsize, c.syscalls, c.bytes_read,
+                   c.bytes_written, c.hits, c.misses, elapsed);
+        }
+    }
+}
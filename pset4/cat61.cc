@@ -2,15 +2,20 @@
 
 // Usage: ./cat61 [-s SIZE] [-o OUTFILE] [FILE]
 //    Copies the input FILE to OUTFILE one character at a time.
+//    With `-K`, prints the CRC-32C of the output to standard error.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("s:o:i:D:a:Fy").parse(argc, argv);
+    io61_args args = io61_args("s:o:i:D:a:FKyd").parse(argc, argv);
 
-    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY | args.direct);
     io61_file* outf = io61_open_check(args.output_file,
-                                      O_WRONLY | O_CREAT | O_TRUNC);
+                                      O_WRONLY | O_CREAT | O_TRUNC | args.direct);
     args.after_open();
+    if (args.checksum && io61_set_checksum(outf, true) < 0) {
+        perror("checksum");
+        exit(1);
+    }
 
     while (args.file_size != 0) {
         int ch = io61_readc(inf);
@@ -25,6 +30,9 @@ int main(int argc, char* argv[]) {
         args.after_write(outf);
     }
 
+    if (args.checksum) {
+        fprintf(stderr, "%08x\n", io61_checksum(outf));
+    }
     io61_close(inf);
     io61_close(outf);
 }
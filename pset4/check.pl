@@ -279,9 +279,10 @@ sub run_sh61 ($;%) {
         return $answer;
     }
 
-    $nb = POSIX::read(fileno(PR), $buf, 2000);
+    $nb = POSIX::read(fileno(PR), $buf, 16384);
     close(PR);
     $buf = $nb > 0 ? substr($buf, 0, $nb) : "";
+    $buf =~ s/,\s*\"files\".*//s;  # per-file io61 counters
 
     while ($buf =~ m,\"(.*?)\"\s*:\s*([\d.]+),g) {
         $answer->{$1} = $2;
@@ -794,6 +795,16 @@ sub print_stdio ($) {
     }
 }
 
+sub print_io61_stats ($) {
+    my($t) = @_;
+    if (exists($t->{"syscalls"})) {
+        printf("           %d syscalls, %.1fMiB read, %.1fMiB written, %d hits, %d misses, %d seeks, %d bypassed, %d flushes\n",
+               $t->{"syscalls"}, $t->{"bytes_read"} / 1048576.0,
+               $t->{"bytes_written"} / 1048576.0, $t->{"hits"}, $t->{"misses"},
+               $t->{"seeks"}, $t->{"bypasses"}, $t->{"flushes"});
+    }
+}
+
 sub check_trial_errors ($$) {
     my($tt, $qitem) = @_;
     my($error) = 0;
@@ -920,6 +931,7 @@ sub run () {
             printf("%.5fs (%.5fs user, %.5fs system, %.0fMiB memory, %d trial%s)\n",
                $tt->{"time"}, $tt->{"utime"}, $tt->{"stime"}, $tt->{"maxrss"} / 1024.0,
                $tt->{"medianof"}, $tt->{"medianof"} == 1 ? "" : "s");
+            print_io61_stats($tt);
             push @runtimes, $tt->{"time"};
         }
 
@@ -1035,6 +1047,8 @@ sub summary () {
     "MAKESILENT" => boolenv("MAKESILENT"),
     "NOMAKE" => boolenv("NOMAKE"),
     "STRACE" => boolenv("STRACE"),
+    "MATRIX" => nonemptyenv("MATRIX") ? $ENV{"MATRIX"} : undef,
+    "HARNESS" => nonemptyenv("HARNESS") ? $ENV{"HARNESS"} : undef,
     "TMP" => nonemptyenv("TMP") ? boolenv("TMP") : undef
 );
 
@@ -1156,6 +1170,165 @@ $SIG{"INT"} = sub {
 };
 
 
+# BENCHMARK MATRIX
+#    `perl check.pl MATRIX=FILE.csv` (or `make matrix`) runs no tests.
+#    Instead it times every combination of program, medium, file size,
+#    block size, stride, and kernel buffer size, TRIALS times for each
+#    engine, in a fixed order, and writes one CSV row per combination and
+#    engine with median times and the stdio/engine time ratio. Override
+#    any list with the parameter of its name, e.g., `BLOCKS=1,4096`.
+#    Strided programs need a seekable input, so they only run on files;
+#    BUFSIZES sets pipe (`-B`) and socket (`socketpipe -B`) buffers.
+
+sub matrix_list ($$) {
+    my ($name, $default) = @_;
+    my ($v) = defined($param{$name}) ? $param{$name} : $ENV{$name};
+    return split(/,/, defined($v) && $v ne "" ? $v : $default);
+}
+
+sub median_of (@) {
+    my (@x) = sort { $a <=> $b } @_;
+    return @x % 2 ? $x[$#x / 2] : ($x[@x / 2 - 1] + $x[@x / 2]) / 2;
+}
+
+sub matrix_command ($$$$$$$) {
+    my ($engine, $program, $medium, $infile, $block, $stride, $bufsize) = @_;
+    my ($prog) = $engine eq "io61" ? "./$program" : "./$engine-$program";
+    my ($args) = "-b $block" . ($stride ne "-" ? " -t $stride" : "");
+    if ($medium eq "file") {
+        return "$prog $args -o outputs/out.txt $infile";
+    } elsif ($medium eq "pipe") {
+        $args .= " -B $bufsize" if $bufsize;
+        return "cat $infile | $prog $args | cat > outputs/out.txt";
+    } else {
+        my ($sockbuf) = $bufsize ? "-B $bufsize " : "";
+        return "./socketpipe ${sockbuf}cat $infile '|' $prog $args -o outputs/out.txt";
+    }
+}
+
+sub matrix () {
+    my ($csvname) = $param{"MATRIX"} =~ /\A\d+\z/ ? "matrix.csv" : $param{"MATRIX"};
+    my (@engines) = matrix_list("ENGINES", "io61,stdio,syscall");
+    my (@programs) = matrix_list("PROGRAMS", "blockcat61,stridecat61");
+    my (@media) = matrix_list("MEDIA", "file,pipe,socketpipe");
+    my (@sizes) = matrix_list("SIZES", "90k,10m");
+    my (@blocks) = matrix_list("BLOCKS", "512,4096,65536");
+    my (@strides) = matrix_list("STRIDES", "4096");
+    my (@bufsizes) = matrix_list("BUFSIZES", "0,65536");
+    open(CSV, ">", $csvname) or die "*** $csvname: $!\n";
+    select((select(CSV), $| = 1)[0]);
+    print CSV "program,medium,size,block,stride,bufsize,engine,trials,errors,time,utime,stime,maxrss,ratio\n";
+
+    foreach my $program (@programs) {
+        my ($strided) = $program =~ /stride/;
+        foreach my $medium (@media) {
+            next if $strided && $medium ne "file";
+            foreach my $size (@sizes) {
+                my ($infile) = register_file("inputs/text$size.txt", 0);
+                my ($insize) = verify_file($infile);
+                foreach my $block (@blocks) {
+                    foreach my $stride ($strided ? @strides : ("-")) {
+                        foreach my $bufsize ($medium eq "file" ? (0) : @bufsizes) {
+                            my (%rows);
+                            foreach my $engine (@engines) {
+                                my ($command) = matrix_command($engine, $program, $medium, $infile, $block, $stride, $bufsize);
+                                maybe_make($command);
+                                $command =~ s/\b(inputs|outputs)\//${ROOT}$1\//g;
+                                my (@t) = ();
+                                my ($errors) = 0;
+                                for (my $i = 0; $i < $param{"TRIALS"}; ++$i) {
+                                    decache("${ROOT}$infile");
+                                    Time::HiRes::usleep(100000);
+                                    my ($t) = run_sh61($command,
+                                                       "size_limit_file" => ["${ROOT}outputs/out.txt"],
+                                                       "time_limit" => $param{"MAXTIME"},
+                                                       "size_limit" => 2 * $insize);
+                                    if (exists($t->{"killed"})
+                                        || $t->{"outputsize"} != $insize) {
+                                        ++$errors;
+                                    } else {
+                                        push @t, $t;
+                                    }
+                                }
+                                $rows{$engine} = [$command, scalar(@t), $errors,
+                                                  map { my $k = $_; @t ? median_of(map { $_->{$k} } @t) : "" }
+                                                  ("time", "utime", "stime", "maxrss")];
+                            }
+                            foreach my $engine (@engines) {
+                                my ($r) = $rows{$engine};
+                                my ($ratio) = "";
+                                if (exists($rows{"stdio"}) && $rows{"stdio"}->[3] ne ""
+                                    && $r->[3] ne "" && $r->[3] > 0) {
+                                    $ratio = sprintf("%.3f", $rows{"stdio"}->[3] / $r->[3]);
+                                }
+                                print CSV join(",", $program, $medium, $size, $block, $stride,
+                                               $bufsize, $engine, @$r[1..2],
+                                               map({ $_ eq "" ? "" : sprintf("%.6f", $_) } @$r[3..5]),
+                                               $r->[6], $ratio), "\n";
+                                printf("%-12s %-10s %5s %6s %5s %7s %-8s %s%s\n",
+                                       $program, $medium, $size, $block, $stride, $bufsize,
+                                       $engine, $r->[3] eq "" ? "ERROR" : sprintf("%.5fs", $r->[3]),
+                                       $ratio eq "" ? "" : " (${ratio}x stdio)");
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    close(CSV);
+    print "Wrote $csvname\n";
+}
+
+if (defined($param{"MATRIX"})) {
+    matrix();
+    exit(0);
+}
+
+
+# CACHE POLICY HARNESS
+#    `perl check.pl HARNESS=1` (or `make harness`) runs no tests. Instead
+#    it records an io61 access trace (`IO61_TRACE`) of each of PROGRAMS
+#    copying each size of text file, then replays every trace with
+#    `cachesim` against POLICIES, using SLOTS slots of BLOCK bytes, and
+#    prints the system calls and time each policy needed. Lists default
+#    as below and are overridden like the matrix's.
+
+my (%harness_args) = ("reordercat61" => "-b 1024");
+
+sub harness () {
+    my (@programs) = matrix_list("PROGRAMS", "cat61,stridecat61,reordercat61,randblockcat61");
+    my (@sizes) = matrix_list("SIZES", "90k");
+    my ($simargs) = "";
+    $simargs .= " -b " . $param{"BLOCK"} if defined($param{"BLOCK"});
+    $simargs .= " -n " . $param{"SLOTS"} if defined($param{"SLOTS"});
+    $simargs .= " -p " . join(",", matrix_list("POLICIES", "")) if matrix_list("POLICIES", "");
+    maybe_make("./cachesim");
+    foreach my $program (@programs) {
+        foreach my $size (@sizes) {
+            my ($infile) = register_file("inputs/text$size.txt", 0);
+            verify_file($infile);
+            my ($trace) = "${ROOT}outputs/$program-$size.trace";
+            my ($args) = $harness_args{$program} // "";
+            my ($command) = "./$program $args -o outputs/out.txt $infile";
+            maybe_make($command);
+            $command =~ s/\b(inputs|outputs)\//${ROOT}$1\//g;
+            unlink($trace);
+            print "$program $size\n";
+            if (system("IO61_TRACE=$trace $command") != 0
+                || system("./cachesim$simargs $trace") != 0) {
+                print STDERR "*** $program $size: failed\n";
+            }
+        }
+    }
+}
+
+if (defined($param{"HARNESS"})) {
+    harness();
+    exit(0);
+}
+
+
 # SEQUENTIAL CORRECTNESS
 enqueue("C1",
     "./cat61 -o outputs/out.txt $texttiny",
@@ -1257,6 +1430,86 @@ enqueue("C20",
     "magic random file, byte I/O, sequential",
     "perf" => 0, "compare" => -1, "insize" => 400000, "check_random" => 1);
 
+enqueue("C21",
+    "./copy61 -o outputs/out.txt $texttiny",
+    "whole-file copy, sequential correctness",
+    "perf" => 0, "expect" => $texttiny);
+
+enqueue("C22",
+    "cat $texttiny | ./copy61 | cat > outputs/out.txt",
+    "whole-file copy, piped, sequential correctness",
+    "perf" => 0, "expect" => $texttiny);
+
+enqueue("C23",
+    "./copy61 -s 4096 -o outputs/out.txt /dev/urandom",
+    "unmappable file, whole-file copy, sequential",
+    "perf" => 0, "compare" => -1, "insize" => 4096);
+
+enqueue("C24",
+    "cat $texttiny | ./pollcat61 -b 1021 | cat > outputs/out.txt",
+    "nonblocking event loop, piped, sequential correctness",
+    "perf" => 0, "expect" => $texttiny);
+
+enqueue("C25",
+    "./blockcat61 -d -b 1021 -o outputs/out.txt $texttiny",
+    "direct I/O, 1021B block I/O, sequential correctness",
+    "perf" => 0, "expect" => $texttiny);
+
+enqueue("C26",
+    "./parcat61 -j 4 -b 1021 -o outputs/out.txt $texttiny",
+    "4 threads sharing files, 1021B block I/O, correctness",
+    "perf" => 0, "expect" => $texttiny);
+
+enqueue("C27",
+    "./parcat61 -j 8 -b 65536 -o outputs/out.txt $textsm",
+    "8 threads sharing files, 64KiB block I/O, correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C28",
+    "./zcat61 -z -b 1000 -o outputs/c28.gz $texttiny && gzip -dc outputs/c28.gz > outputs/out.txt",
+    "gzip members of 1000B, decompressed by gzip, correctness",
+    "perf" => 0, "expect" => $texttiny);
+
+enqueue("C29",
+    "gzip -c $textsm | ./zcat61 -o outputs/out.txt",
+    "gzip stream, piped, decompression correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C30",
+    "./zcat61 -z -b 4096 -o outputs/c30.gz $textsm && ./zcat61 -p 30000 -s 40000 -o outputs/c30.txt outputs/c30.gz",
+    "gzip members of 4KiB, indexed seek, correctness",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C31",
+    "cat $textsm | IO61_FLUSH=1000,100 ./blockcat61 -W -b 1021 | cat > outputs/out.txt",
+    "flush policy, piped, byte writes, sequential correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C32",
+    "IO61_NOREUSE=1 ./blockcat61 -b 65536 -o outputs/out.txt $textmd",
+    "drop-behind, block reads and writes, sequential correctness",
+    "perf" => 0, "expect" => $textmd);
+
+enqueue("C33",
+    "IO61_BUFSIZE=4096 ./scattergather61 -b 509 -o outputs/c33a.txt -o outputs/c33b.txt -o outputs/c33c.txt -o outputs/c33d.txt -i $textsm -i $revtextsm -i $textsm",
+    "scatter/gather 4/3 files, 4KiB buffers, 509B block I/O, sequential",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C34",
+    "./tee61 -o outputs/c34a.txt -o outputs/c34b.txt -o outputs/c34c.txt $textsm",
+    "fan-out to 3 files, sequential correctness",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C35",
+    "cat $textsm | ./tee61 -o outputs/c35b.txt -o /dev/stdout | cat > outputs/out.txt",
+    "fan-out to a file and a pipe, piped, sequential correctness",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C36",
+    "{ cat $textsm | ./tee61 -o /dev/fd/3 -o /dev/stdout | cat > outputs/c36b.txt; } 3>&1 | cat > outputs/out.txt",
+    "fan-out to 2 pipes, piped, sequential correctness",
+    "perf" => 0, "compare" => 1);
+
 
 # NONSEQUENTIAL CORRECTNESS
 enqueue("CN1",
@@ -1333,6 +1586,18 @@ enqueue("MP9",
     "./blockcat61 -b 1024 $textmd | cat > outputs/out.txt",
     "mixed-piped medium file, 1KB block I/O, sequential");
 
+enqueue("MP10",
+    "./copy61 -o outputs/out.txt $textmd",
+    "regular medium file, whole-file copy, sequential");
+
+enqueue("MP11",
+    "cat $textmd | ./copy61 | cat > outputs/out.txt",
+    "piped medium file, whole-file copy, sequential");
+
+enqueue("MP12",
+    "{ cat $textmd | ./tee61 -o /dev/fd/3 -o /dev/stdout | cat > outputs/mp12b.txt; } 3>&1 | cat > outputs/out.txt",
+    "piped medium file, fan-out to 2 pipes, sequential");
+
 
 # NONSEQUENTIAL
 enqueue("MPN1",
@@ -1390,6 +1655,14 @@ enqueue("LP9",
     "./randblockcat61 $textlg > outputs/out.txt",
     "redirected large file, 1B-4KB block I/O, sequential");
 
+enqueue("LP10",
+    "./copy61 -o outputs/out.txt $textlg",
+    "regular large file, whole-file copy, sequential");
+
+enqueue("LP11",
+    "cat $textlg | ./copy61 -o outputs/out.txt",
+    "mixed-piped large file, whole-file copy, sequential");
+
 enqueue("LPN1",
     "./reverse61 -s 8388608 -o outputs/out.txt $textlg",
     "regular large file, byte I/O, reverse order");
@@ -0,0 +1,20 @@
+#include "io61.hh"
+
+// Usage: ./copy61 [-s SIZE] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE with one `io61_copy` call.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("s:o:i:").parse(argc, argv);
+
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    args.after_open();
+
+    ssize_t n = io61_copy(inf, outf, args.file_size);
+    assert(n >= 0);
+
+    io61_close(inf);
+    io61_close(outf);
+}
@@ -1,7 +1,14 @@
 #include "io61.hh"
+#include "prof61.hh"
 #include <ctime>
 #include <csignal>
 #include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <string>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <sys/time.h>
 #include <sys/resource.h>
 
@@ -89,6 +96,228 @@ ssize_t io61_write_bytes(io61_file* f, const unsigned char* buf, size_t sz) {
 }
 
 
+// io61_readline_bytes(f, buf, sz)
+//    Read a line of at most `sz` bytes into `buf`, but using `io61_readc`
+//    calls.
+
+ssize_t io61_readline_bytes(io61_file* f, unsigned char* buf, size_t sz) {
+    size_t nr = 0;
+    while (nr != sz) {
+        int ch = io61_readc(f);
+        if (ch < 0) {
+            break;
+        }
+        buf[nr] = ch;
+        ++nr;
+        if (ch == '\n') {
+            break;
+        }
+    }
+    return nr;
+}
+
+
+// io61_copy_buffered(inf, outf, sz)
+//    Copy up to `sz` bytes from `inf` to `outf` with `io61_read` and
+//    `io61_write` calls. Returns the number of bytes copied, or -1 if an
+//    error occurred before any were.
+
+ssize_t io61_copy_buffered(io61_file* inf, io61_file* outf, size_t sz) {
+    unsigned char buf[65536];
+    size_t ncopied = 0;
+    while (ncopied != sz) {
+        ssize_t nr = io61_read(inf, buf, std::min(sz - ncopied, sizeof(buf)));
+        if (nr <= 0) {
+            if (nr < 0 && ncopied == 0) {
+                return -1;
+            }
+            break;
+        }
+        ssize_t nw = io61_write(outf, buf, nr);
+        if (nw > 0) {
+            ncopied += nw;
+        }
+        if (nw != nr) {
+            if (ncopied == 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+    return ncopied;
+}
+
+
+// io61_tee_buffered(inf, outfs, n, sz)
+//    Copy up to `sz` bytes from `inf` to each of the `n` files in `outfs`
+//    with `io61_read` and `io61_write` calls. Returns the number of bytes
+//    every output received, or -1 if an error occurred before any were.
+
+ssize_t io61_tee_buffered(io61_file* inf, io61_file* const* outfs, size_t n,
+                          size_t sz) {
+    unsigned char buf[65536];
+    size_t ncopied = 0;
+    while (ncopied != sz) {
+        ssize_t nr = io61_read(inf, buf, std::min(sz - ncopied, sizeof(buf)));
+        if (nr <= 0) {
+            if (nr < 0 && ncopied == 0) {
+                return -1;
+            }
+            break;
+        }
+        ssize_t nall = nr;
+        for (size_t i = 0; i != n; ++i) {
+            ssize_t nw = io61_write(outfs[i], buf, nr);
+            nall = std::min(nall, std::max(nw, ssize_t(0)));
+        }
+        ncopied += nall;
+        if (nall != nr) {
+            if (ncopied == 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+    return ncopied;
+}
+
+
+// crc32c(crc, data, n)
+//    Return the CRC-32C (Castagnoli) of `data[0, n)`, continuing from a
+//    `crc` returned earlier (0 to start). Uses the SSE4.2 `crc32`
+//    instruction when the processor has it, and a table otherwise.
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, size_t n) {
+    uint64_t c = crc;
+    for (; n != 0 && (uintptr_t(p) & 7) != 0; --n, ++p) {
+        c = __builtin_ia32_crc32qi(c, *p);
+    }
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = __builtin_ia32_crc32di(c, w);
+    }
+    for (; n != 0; --n, ++p) {
+        c = __builtin_ia32_crc32qi(c, *p);
+    }
+    return c;
+}
+#endif
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char* p, size_t n) {
+    static const std::vector<uint32_t> table = [] () {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i != 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k != 8; ++k) {
+                c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    for (; n != 0; --n, ++p) {
+        crc = table[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t n) {
+    auto p = reinterpret_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    if (hw) {
+        return ~crc32c_sse42(~crc, p, n);
+    }
+#endif
+    return ~crc32c_table(~crc, p, n);
+}
+
+
+// io61_fd_share
+//    Shared mode (`io61_share`) for the reference versions of io61.cc:
+//    no buffering, just preadv/pwritev at per-thread positions, kept in
+//    a map under one lock. Appends use writev() with O_APPEND, which the
+//    kernel keeps atomic.
+
+struct io61_fd_share {
+    int fd;
+    bool append;
+    off_t start;                           // position of a new thread
+    std::mutex m;
+    std::map<std::thread::id, off_t> pos;  // position of each thread
+};
+
+
+// io61_fd_share_start(fd, pos)
+//    Returns shared-mode state for `fd`, whose threads start at `pos`.
+//    Returns nullptr and sets errno if `fd` is not seekable.
+
+io61_fd_share* io61_fd_share_start(int fd, off_t pos) {
+    if (lseek(fd, 0, SEEK_CUR) < 0) {
+        return nullptr;
+    }
+    io61_fd_share* sh = new io61_fd_share;
+    sh->fd = fd;
+    sh->append = (fcntl(fd, F_GETFL) & O_APPEND) != 0;
+    sh->start = pos;
+    return sh;
+}
+
+
+// io61_fd_share_end(sh)
+//    Frees `sh`.
+
+void io61_fd_share_end(io61_fd_share* sh) {
+    delete sh;
+}
+
+
+// io61_fd_share_seek(sh, pos)
+//    Moves the calling thread's position to `pos`.
+
+void io61_fd_share_seek(io61_fd_share* sh, off_t pos) {
+    std::lock_guard<std::mutex> guard(sh->m);
+    sh->pos[std::this_thread::get_id()] = pos;
+}
+
+
+// io61_fd_share_transfer(sh, iov, iovcnt, write)
+//    Reads or writes `iov` at the calling thread's position, advancing
+//    it. Returns like read() or write().
+
+static ssize_t io61_fd_share_transfer(io61_fd_share* sh, const iovec* iov,
+                                      int iovcnt, bool write) {
+    std::lock_guard<std::mutex> guard(sh->m);
+    auto it = sh->pos.emplace(std::this_thread::get_id(), sh->start).first;
+    iovcnt = std::min(iovcnt, IOV_MAX);
+    ssize_t n;
+    do {
+        if (!write) {
+            n = preadv(sh->fd, iov, iovcnt, it->second);
+        } else if (sh->append) {
+            n = writev(sh->fd, iov, iovcnt);
+        } else {
+            n = pwritev(sh->fd, iov, iovcnt, it->second);
+        }
+    } while (n < 0 && errno == EINTR);
+    if (n > 0 && !(write && sh->append)) {
+        it->second += n;
+    }
+    return n;
+}
+
+ssize_t io61_fd_share_read(io61_fd_share* sh, const iovec* iov, int iovcnt) {
+    return io61_fd_share_transfer(sh, iov, iovcnt, false);
+}
+
+ssize_t io61_fd_share_write(io61_fd_share* sh, const iovec* iov, int iovcnt) {
+    return io61_fd_share_transfer(sh, iov, iovcnt, true);
+}
+
+
 // io61_args functions
 
 io61_args::io61_args(const char* opts_, size_t block_size_)
@@ -159,6 +388,21 @@ io61_args& io61_args::parse(int argc, char** argv) {
         case 'n':
             this->nonblocking = true;
             break;
+        case 'd':
+            this->direct = O_DIRECT;
+            break;
+        case 'z':
+            this->compress = true;
+            break;
+        case 'K':
+            this->checksum = true;
+            break;
+        case 'j':
+            this->nthreads = (unsigned) strtoul(optarg, &endptr, 0);
+            if (this->nthreads == 0 || endptr == optarg || *endptr) {
+                goto usage;
+            }
+            break;
         case 'q':
             this->quiet = true;
             break;
@@ -291,6 +535,18 @@ void io61_args::usage() {
     if (strchr(this->opts, 'X')) {
         fprintf(stderr, "    -X            Use powers of two for block sizes\n");
     }
+    if (strchr(this->opts, 'd')) {
+        fprintf(stderr, "    -d            Use direct I/O (O_DIRECT)\n");
+    }
+    if (strchr(this->opts, 'z')) {
+        fprintf(stderr, "    -z            Compress\n");
+    }
+    if (strchr(this->opts, 'K')) {
+        fprintf(stderr, "    -K            Print output CRC-32C to stderr\n");
+    }
+    if (strchr(this->opts, 'j')) {
+        fprintf(stderr, "    -j THREADS    Set thread count (default %u)\n", this->nthreads);
+    }
     if (strchr(this->opts, 'B')) {
         fprintf(stderr, "    -B BUFSIZ     Set input pipe buffer size on Linux\n");
     }
@@ -370,6 +626,27 @@ void io61_args::after_write(FILE* f) {
 
 namespace {
 
+// Counters of closed files, in closing order; the profiler lists at most
+// MAX_STATS_FILES of them after their totals
+struct io61_file_stats {
+    int fd;
+    int mode;
+    io61_stats st;
+};
+static std::vector<io61_file_stats> closed_stats;
+static constexpr size_t MAX_STATS_FILES = 32;
+
+static std::string stats_json(const io61_stats& st) {
+    char buf[500];
+    snprintf(buf, sizeof(buf),
+        "\"syscalls\":%llu, \"bytes_read\":%llu, \"bytes_written\":%llu, "
+        "\"hits\":%llu, \"misses\":%llu, \"seeks\":%llu, "
+        "\"bypasses\":%llu, \"flushes\":%llu",
+        st.syscalls, st.bytes_read, st.bytes_written, st.hits, st.misses,
+        st.seeks, st.bypasses, st.flushes);
+    return buf;
+}
+
 struct io61_profiler {
     double begin_at;
     io61_profiler();
@@ -404,27 +681,52 @@ io61_profiler::~io61_profiler() {
 #endif
 
     char buf[1000];
-    ssize_t len = snprintf(buf, sizeof(buf),
-        "{\"time\":%.6f, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld}\n",
+    snprintf(buf, sizeof(buf),
+        "{\"time\":%.6f, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld",
         real_elapsed,
         usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
         usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
         maxrss);
-
-    off_t off = lseek(100, 0, SEEK_CUR);
-    int fd = (off != (off_t) -1 || errno == ESPIPE ? 100 : STDERR_FILENO);
-    if (fd == STDERR_FILENO && !getenv("TIMING")) {
-        return;
-    } else if (fd == STDERR_FILENO) {
-        fflush(stderr);
-    }
-    while (true) {
-        ssize_t nw = write(fd, buf, len);
-        if (nw == len) {
-            break;
+    std::string json = buf;
+
+    // io61 counters: totals over all closed files, then each file
+    if (!closed_stats.empty()) {
+        io61_stats total;
+        for (auto& cs : closed_stats) {
+            total.syscalls += cs.st.syscalls;
+            total.bytes_read += cs.st.bytes_read;
+            total.bytes_written += cs.st.bytes_written;
+            total.hits += cs.st.hits;
+            total.misses += cs.st.misses;
+            total.seeks += cs.st.seeks;
+            total.bypasses += cs.st.bypasses;
+            total.flushes += cs.st.flushes;
         }
-        assert(nw == -1 && (errno == EINTR || errno == EAGAIN));
+        json += ", " + stats_json(total) + ", \"files\":[";
+        for (size_t i = 0; i != closed_stats.size() && i != MAX_STATS_FILES; ++i) {
+            auto& cs = closed_stats[i];
+            snprintf(buf, sizeof(buf), "%s{\"fd\":%d, \"mode\":\"%s\", ",
+                     i ? ", " : "", cs.fd,
+                     cs.mode == O_RDONLY ? "r" : cs.mode == O_WRONLY ? "w" : "rw");
+            json += buf + stats_json(cs.st) + "}";
+        }
+        json += "]";
+    }
+    // metrics from prof61.hh, if any recorded something
+    std::string metrics = prof61_json();
+    if (!metrics.empty()) {
+        json += ", \"prof61\":" + metrics;
     }
+    json += "}\n";
+    prof61_emit(json);
+}
+
 }
 
+
+// io61_record_stats(fd, mode, st)
+//    Saves the counters of a file being closed for the profiler.
+
+void io61_record_stats(int fd, int mode, const io61_stats& st) {
+    closed_stats.push_back({fd, mode, st});
 }
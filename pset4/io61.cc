@@ -1,289 +1,2709 @@
 #include "io61.hh"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <poll.h>
 #include <climits>
+#include <algorithm>
 #include <cerrno>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <string>
+#include <vector>
 
-// Define buffer size constant
-static constexpr size_t BUFFER_SIZE = 32768;  // 32KB buffer
+// Cache geometry: NSLOTS blocks of `f->bsize` bytes, managed by CLOCK.
+// The block size is a power of two picked from the medium at open, and
+// doubled on seekable files after GROW_RUN sequential misses in a row,
+// unless io61_set_buffer fixed it (to as little as DIRECT_ALIGN).
+static constexpr size_t MIN_BUFFER_SIZE = 32768;
+static constexpr size_t MAX_BUFFER_SIZE = 262144;
+static constexpr unsigned NSLOTS = 8;
+static constexpr unsigned GROW_RUN = 4;
 
-struct io61_file {
+// A detected forward or reverse stream reads this many extra blocks in
+// the same system call as a miss
+static constexpr unsigned PREFETCH_BLOCKS = 3;
+
+// A reverse stream also asks the kernel to start reading this many bytes
+// below what it just read (posix_fadvise on buffered files, madvise on
+// mapped ones), so the next backward miss finds them in the page cache
+static constexpr size_t REVERSE_PREFETCH = 1 << 20;
+
+// Dirty runs shorter than a block are moved into the file's extent map
+// rather than written; the map is written out, sorted and coalesced, on
+// io61_flush, on close, before reads, or once it holds DIRTY_LIMIT bytes
+static constexpr size_t DIRTY_LIMIT = 32 << 20;
+static constexpr int EXTENT_IOVS = 1024;  // iovecs per pwritev()
+
+// Memory-mapped files switch to MADV_RANDOM after this many seeks that
+// move the position, and back to MADV_SEQUENTIAL after this many bytes
+// read without one
+static constexpr unsigned MAP_RANDOM_JUMPS = 16;
+static constexpr size_t MAP_SEQUENTIAL_RUN = 1 << 20;
+
+// Direct I/O (files opened O_DIRECT) bypasses the page cache, but only
+// for transfers whose file offset, buffer addresses, and lengths are all
+// multiples of DIRECT_ALIGN; slot buffers are aligned to it
+static constexpr size_t DIRECT_ALIGN = 4096;
+
+// Slot buffers come from a process-wide pool, one free list per block
+// size, when a slot is first claimed. Write-only files give theirs back
+// on every flush. The pool keeps at most POOL_LIMIT bytes of free
+// buffers and frees the rest.
+static constexpr size_t POOL_LIMIT = 8 << 20;
+
+// A direct write of at least STREAM_MIN bytes copies its data into cache
+// slots with non-temporal stores, since the device, not the CPU, reads
+// those slots next; this leaves the program's hot working set in L2 and
+// L3. (Reads don't stream: their destination is the caller's buffer,
+// which the caller reads next.)
+static constexpr size_t STREAM_MIN = 1 << 20;
+
+// io61_tee writes a chunk of at least TEE_DIRECT_MIN bytes to each output
+// straight from the input's buffer; smaller chunks are cheaper to copy
+// into the outputs' buffers than to write once per output
+static constexpr size_t TEE_DIRECT_MIN = 16384;
+
+// Page-cache hints for buffered files: a forward stream keeps WILLNEED
+// issued HINT_AHEAD bytes past what it has read; FADV_RANDOM_MISSES
+// misses in a row that follow no stream switch the file to
+// POSIX_FADV_RANDOM, and the next stream switches it back. Files
+// advised POSIX_FADV_NOREUSE drop the cache behind their position, up
+// to DROP_STEP bytes at a time (mapped files too).
+static constexpr size_t HINT_AHEAD = 1 << 20;
+static constexpr unsigned FADV_RANDOM_MISSES = 16;
+static constexpr size_t DROP_STEP = 8 << 20;
+
+// One cached block. On seekable files `tag` is a multiple of `f->bsize`;
+// on pipes it is wherever the stream was when the slot was claimed.
+struct io61_slot {
+   off_t tag = -1;            // File offset of `buf[0]`, or -1 if unused
+   size_t size = 0;           // `buf[0, size)` matches the file
+   size_t dirty_start = 0;    // `buf[dirty_start, dirty_end)` is unflushed
+   size_t dirty_end = 0;
+   bool referenced = false;   // CLOCK reference bit
+   unsigned char* buf = nullptr;  // Pool buffer, or nullptr
+   size_t cap = 0;            // Size of `buf`
+};
+
+// Background read-ahead for pipes (set `IO61_READAHEAD=1`): a thread
+// reads into one buffer while the caller drains the other
+struct io61_readahead {
+   std::thread thread;
+   std::mutex m;
+   std::condition_variable cv;
+   unsigned char buf[2][MAX_BUFFER_SIZE];
+   size_t len[2] = {0, 0};    // Bytes in each buffer; 0 means empty
+   size_t off[2] = {0, 0};    // Bytes already consumed
+   unsigned head = 0;         // Buffer the caller reads next
+   unsigned tail = 0;         // Buffer the thread fills next
+   bool done = false;         // Thread saw end of file or an error
+   int error = 0;             // errno of that error
+   bool stop = false;         // io61_close wants the thread gone
+   int wakefd = -1;           // eventfd that interrupts the thread's poll()
+   unsigned long long nsyscalls = 0;  // poll() and read() calls made
+};
+
+// A contiguous range of dirty bytes, kept as the chunks it was built from
+struct io61_extent {
+   size_t len = 0;
+   std::vector<std::vector<unsigned char>> chunks;
+};
+
+// Shared mode (io61_share): each thread using the file gets a position,
+// a read buffer, and a write staging buffer of its own. Threads find
+// theirs through a thread-local list, so the data path touches no
+// common state but the append offset.
+struct io61_thread {
+   off_t pos;                 // This thread's file position
+   off_t rtag = -1;           // File offset of `rbuf[0]`, or -1
+   size_t rsize = 0;          // `rbuf[0, rsize)` matches the file
+   off_t wtag = -1;           // File offset of `wbuf[0]`, or -1 (also for
+                              // appends whose offset isn't reserved yet)
+   size_t wsize = 0;          // Staged bytes in `wbuf`
+   io61_stats stats;          // Merged into the file's on close
+   std::unique_ptr<unsigned char[]> rbuf;
+   std::unique_ptr<unsigned char[]> wbuf;
+};
+
+struct io61_shared {
+   unsigned long long id;     // Unique among shared files
+   off_t start;               // Position of a thread's first access
+   bool append = false;       // Writes go to `end`, not the position
+   std::atomic<off_t> end{0}; // Next append offset
+   std::mutex m;              // Protects `threads`
+   std::vector<io61_thread*> threads;
+};
+
+struct io61_file : io61_fast {
    int fd = -1;     // file descriptor
    int mode;        // open mode
+   bool seekable;   // whether `fd` supports lseek()
 
-   // Main buffer for reading/writing
-   unsigned char cbuf[BUFFER_SIZE];
-   size_t cbuf_size;          // Valid bytes in buffer
-   size_t cbuf_pos;           // Current position in buffer
-   off_t tag_position;        // File offset of buffer start
    off_t pos;                 // Current logical file position
+   off_t fd_pos;              // File offset of `fd`
+   size_t bsize;              // Block size
+   bool bsize_fixed = false;  // io61_set_buffer chose it; never grow
+
+   // Direct mode: all transfers go through the slots, and `fd` has
+   // O_DIRECT set (`fd_direct`) exactly while an aligned one is issued
+   bool direct = false;
+   bool fd_direct = false;
+
+   io61_stats stats;          // Counters for the profiler
+
+   // Flush policy (io61_set_flush): the budgets, the bytes buffered since
+   // the last flush, and when the first of them arrived (microseconds)
+   size_t flush_bytes = 0;
+   unsigned long flush_usec = 0;
+   size_t unflushed = 0;
+   unsigned long long unflushed_at = 0;
+
+   // The inline window (io61_fast) started at `win_base`, which is file
+   // offset `win_off`; reads window slot `cur` or `map`, writes slot `cur`
+   unsigned char* win_base = nullptr;
+   off_t win_off = 0;
+
+   // Block cache
+   io61_slot slots[NSLOTS];
+   unsigned cur = 0;          // Slot of the most recent access
+   unsigned clock_hand = 0;   // Next CLOCK eviction candidate
+
+   // Stream detector: the distance between the last two missed blocks,
+   // and how many misses in a row have repeated it
+   off_t stream_last = -1;
+   off_t stream_delta = 0;
+   unsigned stream_run = 0;
+
+   // Sequential detector for block growth: where the next miss of a
+   // sequential workload falls, and how many misses in a row fell there
+   off_t seq_next = -1;
+   unsigned seq_run = 0;
+
+   io61_readahead* ra = nullptr;  // Read-ahead thread, if any
+
+   // Dirty extents by file offset; they never overlap or touch
+   std::map<off_t, io61_extent> extents;
+   size_t extent_bytes = 0;
+
+   // Memory-mapped mode (regular read-only files): reads and seeks use
+   // `map` directly and never touch the cache
+   unsigned char* map = nullptr;  // File contents, or nullptr
+   size_t map_size = 0;       // Mapped bytes
+   int map_advice = -1;       // Current madvise() advice
+   unsigned map_jumps = 0;    // Position-changing seeks since last run
+   size_t map_run = 0;        // Bytes read since last such seek
+   off_t map_back = -1;       // Lowest offset prefetched for a reverse run
+
+   // Page-cache hints: how far WILLNEED has been issued, whether the file
+   // is in POSIX_FADV_RANDOM and the misses counted toward it, and for
+   // NOREUSE files, the start of what is still cached and (writers) the
+   // end of what has been queued for writeback
+   off_t hint_ahead = 0;
+   bool fadv_random = false;
+   unsigned fadv_misses = 0;
+   bool fadv_caller = false;  // io61_advise set the access pattern
+   bool noreuse = false;
+   off_t drop_from = 0;
+   off_t drop_synced = 0;
+
+   // Streaming checksum (io61_set_checksum): CRC-32C of the bytes the
+   // caller has transferred, in order
+   bool sum_on = false;
+   uint32_t sum = 0;
+
+   std::shared_ptr<io61_shared> shared;  // Shared-mode state, if shared
+
+   unsigned trace_id = 0;     // Access trace name, or 0 if not traced
+};
+
+// Set the madvise() advice for a mapped file, if it changed
+static void io61_map_advise(io61_file* f, int advice) {
+    if (f->map_advice != advice) {
+        madvise(f->map, f->map_size, advice);
+        f->map_advice = advice;
+    }
+}
+
+// Map a regular read-only file; on any failure, leave it buffered
+static void io61_try_map(io61_file* f) {
+    struct stat st;
+    if (fstat(f->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        return;
+    }
+    off_t off = lseek(f->fd, 0, SEEK_CUR);
+    if (off < 0) {
+        return;
+    }
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+    if (p == MAP_FAILED) {
+        return;
+    }
+    f->map = reinterpret_cast<unsigned char*>(p);
+    f->map_size = st.st_size;
+    f->pos = off;
+    io61_map_advise(f, MADV_SEQUENTIAL);
+}
+
+// Ask the kernel to start reading `[off, off + len)` of `f`, clipped to
+// the file start, without waiting for it
+static void io61_prefetch(io61_file* f, off_t off, size_t len) {
+    if (off < 0) {
+        len = off + off_t(len) > 0 ? off + off_t(len) : 0;
+        off = 0;
+    }
+    if (len == 0) {
+        return;
+    }
+    ++f->stats.syscalls;
+    if (f->map) {
+        // madvise() wants a page-aligned start
+        off_t page = off & ~off_t(sysconf(_SC_PAGESIZE) - 1);
+        len = std::min(len + (off - page), f->map_size - size_t(page));
+        madvise(f->map + page, len, MADV_WILLNEED);
+    } else {
+        posix_fadvise(f->fd, off, len, POSIX_FADV_WILLNEED);
+    }
+}
+
+// Drop what a NOREUSE file has left behind, once the position is a
+// DROP_STEP past the last drop. Written data is queued for writeback a
+// step before it is dropped, so dropping rarely waits.
+static void io61_drop_behind(io61_file* f) {
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t to = f->pos & ~(page - 1);
+    if (to < f->drop_from) {
+        // Moved backward: keep everything from here on
+        f->drop_from = f->drop_synced = to;
+        return;
+    } else if (to - std::max(f->drop_from, f->drop_synced) < off_t(DROP_STEP)) {
+        return;
+    }
+    off_t end = to;
+    if (f->mode != O_RDONLY) {
+        f->stats.syscalls += 2;
+        off_t from = std::max(f->drop_synced, f->drop_from);
+        sync_file_range(f->fd, from, to - from, SYNC_FILE_RANGE_WRITE);
+        end = f->drop_synced;
+        f->drop_synced = to;
+        sync_file_range(f->fd, f->drop_from, end - f->drop_from,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                        | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    if (end > f->drop_from) {
+        if (f->map) {
+            // Our own mapping pins the pages
+            size_t mend = std::min(size_t(end), f->map_size);
+            if (mend > size_t(f->drop_from)) {
+                ++f->stats.syscalls;
+                madvise(f->map + f->drop_from, mend - f->drop_from, MADV_DONTNEED);
+            }
+        }
+        ++f->stats.syscalls;
+        posix_fadvise(f->fd, f->drop_from, end - f->drop_from,
+                      POSIX_FADV_DONTNEED);
+        f->drop_from = end;
+    }
+}
 
-   // State tracking
-   bool reverse_mode;         // Whether we're in reverse mode
-   off_t file_size;           // Cached file size
-   bool size_known;           // Whether file size is known
+// Advise the kernel after a buffered read of `[start, start + n)`:
+// WILLNEED ahead of a forward stream, RANDOM while misses follow none
+static void io61_hint_read(io61_file* f, off_t start, size_t n) {
+    if (f->stream_run == 0) {
+        if (++f->fadv_misses >= FADV_RANDOM_MISSES && !f->fadv_random
+            && !f->fadv_caller) {
+            ++f->stats.syscalls;
+            posix_fadvise(f->fd, 0, 0, POSIX_FADV_RANDOM);
+            f->fadv_random = true;
+        }
+        return;
+    }
+    f->fadv_misses = 0;
+    if (f->fadv_random && !f->fadv_caller) {
+        ++f->stats.syscalls;
+        posix_fadvise(f->fd, 0, 0, POSIX_FADV_NORMAL);
+        f->fadv_random = false;
+    }
+    off_t end = start + n;
+    if (f->stream_delta > 0
+        && f->stream_delta <= off_t((PREFETCH_BLOCKS + 1) * f->bsize)
+        && end + off_t(HINT_AHEAD / 2) > f->hint_ahead) {
+        off_t from = std::max(end, f->hint_ahead);
+        io61_prefetch(f, from, end + HINT_AHEAD - from);
+        f->hint_ahead = end + HINT_AHEAD;
+    }
+}
+
+// Note `n` bytes read from a mapped file; long runs are sequential
+static void io61_map_ran(io61_file* f, size_t n) {
+    f->map_run += n;
+    if (f->map_run >= MAP_SEQUENTIAL_RUN) {
+        f->map_jumps = 0;
+        io61_map_advise(f, MADV_SEQUENTIAL);
+    }
+    if (f->noreuse) {
+        io61_drop_behind(f);
+    }
+}
+
+// Access traces (set `IO61_TRACE=FILE`): every process appends one line
+// per open, read, write, seek, and close of an unshared file, for
+// `cachesim` to replay against other cache designs:
+//     o PID.N MODE SIZE PATH      (SIZE is -1 if not a regular file)
+//     r PID.N OFF LEN    w PID.N OFF LEN    s PID.N OFF    c PID.N
+// Runs of io61_readc or io61_writec appear as one line per inline window.
+// Lines are buffered and appended whole, so processes can share FILE.
+struct io61_tracer {
+    int fd = -1;
+    unsigned next_id = 1;
+    std::string buf;
+    std::mutex m;
+
+    void write_out() {
+        if (!buf.empty()) {
+            ssize_t nw = write(fd, buf.data(), buf.size());
+            (void) nw;
+            buf.clear();
+        }
+    }
+    ~io61_tracer() {
+        if (fd >= 0) {
+            write_out();
+        }
+    }
 };
+static io61_tracer io61_trace_log;
+
+static void io61_trace(io61_file* f, char op, off_t off, long long len = -1) {
+    if (!f->trace_id) {
+        return;
+    }
+    char line[64];
+    const char* fmt = op == 'c' ? "%c %d.%u\n"
+        : len < 0 ? "%c %d.%u %lld\n" : "%c %d.%u %lld %lld\n";
+    int n = snprintf(line, sizeof(line), fmt, op, int(getpid()),
+                     f->trace_id, (long long) off, len);
+    std::lock_guard<std::mutex> guard(io61_trace_log.m);
+    io61_trace_log.buf.append(line, n);
+    if (io61_trace_log.buf.size() >= 65536 || op == 'c') {
+        io61_trace_log.write_out();
+    }
+}
 
-static void init_filesize(io61_file* f) {
-    if (!f->size_known) {
-        struct stat st;
-        if (fstat(f->fd, &st) == 0 && S_ISREG(st.st_mode)) {
-            f->file_size = st.st_size;
-            f->size_known = true;
+// Start tracing `f`, if enabled
+static void io61_trace_open(io61_file* f) {
+    const char* path = getenv("IO61_TRACE");
+    if (!path || !*path) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(io61_trace_log.m);
+    if (io61_trace_log.fd < 0) {
+        io61_trace_log.fd = open(path, O_WRONLY | O_CREAT | O_APPEND
+                                 | O_CLOEXEC, 0666);
+        if (io61_trace_log.fd < 0) {
+            return;
         }
     }
+    char name[64], target[PATH_MAX];
+    snprintf(name, sizeof(name), "/proc/self/fd/%d", f->fd);
+    ssize_t n = readlink(name, target, sizeof(target) - 1);
+    target[std::max(n, ssize_t(0))] = '\0';
+    struct stat st;
+    long long size = -1;
+    if (fstat(f->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        size = st.st_size;
+    }
+    f->trace_id = io61_trace_log.next_id++;
+    char line[64];
+    int len = snprintf(line, sizeof(line), "o %d.%u %c %lld ", int(getpid()),
+                       f->trace_id, f->mode == O_RDONLY ? 'r' : 'w', size);
+    io61_trace_log.buf.append(line, len);
+    io61_trace_log.buf.append(n > 0 ? target : "?");
+    io61_trace_log.buf.push_back('\n');
 }
 
-static int io61_fill_buffer(io61_file* f) {
-    if (f->reverse_mode) {
-        // Ensure we know the file size
-        if (!f->size_known) {
-            init_filesize(f);
-            if (!f->size_known) {
-                errno = ESPIPE;  // Illegal seek
-                return -1;
+// Files with a latency budget set by this thread, which its blocking
+// reads flush first
+static thread_local std::vector<io61_file*> io61_latency_files;
+
+static unsigned long long io61_now_usec() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+// Note `n` more bytes buffered for writing
+static void io61_buffered(io61_file* f, size_t n) {
+    if (f->unflushed == 0 && n != 0 && f->flush_usec) {
+        f->unflushed_at = io61_now_usec();
+    }
+    f->unflushed += n;
+}
+
+// Flush `f` if its policy's budgets are spent. Errors leave the data
+// buffered for a later flush.
+static void io61_flush_policy(io61_file* f) {
+    if (f->unflushed != 0
+        && ((f->flush_bytes && f->unflushed >= f->flush_bytes)
+            || (f->flush_usec
+                && io61_now_usec() - f->unflushed_at >= f->flush_usec))) {
+        int saved_errno = errno;
+        io61_flush(f);
+        errno = saved_errno;
+    }
+}
+
+// Before a read on `f` that may block, flush this thread's other files
+// holding data under a latency budget. Returns true if it flushed any.
+static bool io61_flush_latency(io61_file* f) {
+    bool any = false;
+    for (io61_file* g : io61_latency_files) {
+        if (g != f && g->unflushed != 0) {
+            if (!any) {
+                // Skip it all if the read won't block
+                pollfd pfd = {f->fd, POLLIN, 0};
+                ++f->stats.syscalls;
+                if (f->ra || poll(&pfd, 1, 0) == 0) {
+                    any = true;
+                } else {
+                    return false;
+                }
             }
+            int saved_errno = errno;
+            io61_flush(g);
+            errno = saved_errno;
+        }
+    }
+    return any;
+}
+
+// Add `n` bytes the caller transferred at `data` to `f`'s checksum
+static inline void io61_sum(io61_file* f, const void* data, size_t n) {
+    if (f->sum_on) {
+        f->sum = crc32c(f->sum, data, n);
+    }
+}
+
+// Return true if a transfer of `sz` bytes on `f` should stream
+static inline bool io61_streams(io61_file* f, size_t sz) {
+    return sz >= STREAM_MIN && !f->sum_on;
+}
+
+// Copy `n` bytes from `src` to `dst`, like memcpy, but with non-temporal
+// stores, which bypass the caches, if `stream` is true
+static void io61_copy_bytes(unsigned char* dst, const unsigned char* src,
+                            size_t n, bool stream) {
+#if defined(__SSE2__)
+    if (stream && n >= 256) {
+        size_t head = -uintptr_t(dst) & 15;
+        memcpy(dst, src, head);
+        dst += head, src += head, n -= head;
+        for (; n >= 64; dst += 64, src += 64, n -= 64) {
+            auto s = reinterpret_cast<const __m128i*>(src);
+            __m128i x0 = _mm_loadu_si128(s), x1 = _mm_loadu_si128(s + 1),
+                x2 = _mm_loadu_si128(s + 2), x3 = _mm_loadu_si128(s + 3);
+            auto d = reinterpret_cast<__m128i*>(dst);
+            _mm_stream_si128(d, x0);
+            _mm_stream_si128(d + 1, x1);
+            _mm_stream_si128(d + 2, x2);
+            _mm_stream_si128(d + 3, x3);
+        }
+        // order the streaming stores before anything that follows
+        _mm_sfence();
+    }
+#else
+    (void) stream;
+#endif
+    memcpy(dst, src, n);
+}
+
+// Add the first `n` bytes of `iov` to `f`'s checksum
+static void io61_sum_iov(io61_file* f, const iovec* iov, int iovcnt,
+                         size_t n) {
+    for (int k = 0; f->sum_on && k != iovcnt && n != 0; ++k) {
+        size_t m = std::min(n, iov[k].iov_len);
+        f->sum = crc32c(f->sum, iov[k].iov_base, m);
+        n -= m;
+    }
+}
+
+// Fold the inline window's progress into `f->pos`, and for a write
+// window into slot `cur`'s dirty run, then close the window. Every
+// out-of-line entry point calls this first.
+static void io61_sync(io61_file* f) {
+    if (f->rpos) {
+        size_t n = f->rpos - f->win_base;
+        f->pos = f->win_off + n;
+        io61_sum(f, f->win_base, n);
+        if (n != 0) {
+            io61_trace(f, 'r', f->win_off, n);
+        }
+        if (f->map) {
+            io61_map_ran(f, n);
+        }
+    } else if (f->wpos) {
+        size_t n = f->wpos - f->win_base;
+        io61_slot* s = &f->slots[f->cur];
+        f->pos = f->win_off + n;
+        io61_sum(f, f->win_base, n);
+        if (s->dirty_end <= s->size) {
+            s->size = std::max(s->size, s->dirty_end + n);
+        }
+        s->dirty_end += n;
+        io61_buffered(f, n);
+        if (n != 0) {
+            io61_trace(f, 'w', f->win_off, n);
+        }
+    }
+    f->rpos = f->rend = f->wpos = f->wend = nullptr;
+}
+
+// Move the file descriptor's offset to `off`, if it isn't there already
+static int io61_fd_seek(io61_file* f, off_t off) {
+    if (f->fd_pos != off) {
+        ++f->stats.syscalls;
+        if (lseek(f->fd, off, SEEK_SET) < 0) {
+            return -1;
+        }
+        f->fd_pos = off;
+    }
+    return 0;
+}
+
+// Set `fd`'s O_DIRECT flag for a transfer of `iov[0, n)` at `off`: on
+// only in direct mode and only if the transfer is aligned
+static void io61_direct_for(io61_file* f, off_t off, const iovec* iov, int n) {
+    bool aligned = f->direct && off % DIRECT_ALIGN == 0;
+    for (int k = 0; aligned && k != n; ++k) {
+        aligned = uintptr_t(iov[k].iov_base) % DIRECT_ALIGN == 0
+            && iov[k].iov_len % DIRECT_ALIGN == 0;
+    }
+    if (aligned != f->fd_direct) {
+        int fl = fcntl(f->fd, F_GETFL);
+        if (fl >= 0
+            && fcntl(f->fd, F_SETFL, aligned ? fl | O_DIRECT : fl & ~O_DIRECT) == 0) {
+            f->fd_direct = aligned;
+        } else if (aligned) {
+            f->direct = false;
         }
+    }
+}
+
+// An EINVAL from an O_DIRECT transfer means the filesystem won't do
+// direct I/O here after all: leave direct mode for good and return true
+// so the caller retries
+static bool io61_direct_failed(io61_file* f) {
+    if (errno != EINVAL || !f->fd_direct) {
+        return false;
+    }
+    f->direct = false;
+    io61_direct_for(f, 0, nullptr, 0);
+    return !f->fd_direct;
+}
 
-        if (f->pos <= 0) {
-            f->cbuf_size = 0;
-            return 0;  // EOF
+static void io61_ra_run(io61_readahead* ra, int fd) {
+    std::unique_lock<std::mutex> guard(ra->m);
+    while (true) {
+        ra->cv.wait(guard, [&] { return ra->stop || ra->len[ra->tail] == 0; });
+        if (ra->stop) {
+            return;
         }
+        unsigned t = ra->tail;
+        guard.unlock();
 
-        // Calculate how much to read
-        size_t desired_size = BUFFER_SIZE;
-        if (f->pos < (off_t)desired_size) {
-            desired_size = f->pos;
+        pollfd pfd[2] = {{fd, POLLIN, 0}, {ra->wakefd, POLLIN, 0}};
+        ssize_t nr = -1;
+        unsigned calls = 1;
+        int r = poll(pfd, 2, -1);
+        if (r > 0 && !pfd[1].revents) {
+            nr = read(fd, ra->buf[t], MAX_BUFFER_SIZE);
+            ++calls;
+        } else if (r < 0 || pfd[1].revents) {
+            errno = r < 0 ? errno : EINTR;
         }
+        int err = errno;
 
-        off_t read_pos = f->pos - desired_size;
+        guard.lock();
+        ra->nsyscalls += calls;
+        if (nr < 0 && (err == EINTR || err == EAGAIN)) {
+            continue;
+        } else if (nr <= 0) {
+            ra->done = true;
+            ra->error = nr < 0 ? err : 0;
+            ra->cv.notify_all();
+            return;
+        }
+        ra->len[t] = nr;
+        ra->tail = t ^ 1;
+        ra->cv.notify_all();
+    }
+}
 
-        // Seek to the correct position
-        if (lseek(f->fd, read_pos, SEEK_SET) < 0) {
+// Start read-ahead on `f`, if enabled; on failure, `f` reads normally
+static void io61_ra_start(io61_file* f) {
+    const char* e = getenv("IO61_READAHEAD");
+    if (!e || !*e || strcmp(e, "0") == 0) {
+        return;
+    }
+    io61_readahead* ra = new io61_readahead;
+    ra->wakefd = eventfd(0, EFD_CLOEXEC);
+    try {
+        if (ra->wakefd >= 0) {
+            ra->thread = std::thread(io61_ra_run, ra, f->fd);
+            f->ra = ra;
+            return;
+        }
+    } catch (...) {
+    }
+    if (ra->wakefd >= 0) {
+        close(ra->wakefd);
+    }
+    delete ra;
+}
+
+static void io61_ra_stop(io61_file* f) {
+    io61_readahead* ra = f->ra;
+    {
+        std::lock_guard<std::mutex> guard(ra->m);
+        ra->stop = true;
+    }
+    ra->cv.notify_all();
+    uint64_t one = 1;
+    ssize_t nw = write(ra->wakefd, &one, sizeof(one));
+    (void) nw;
+    ra->thread.join();
+    f->stats.syscalls += ra->nsyscalls;
+    close(ra->wakefd);
+    delete ra;
+    f->ra = nullptr;
+}
+
+// Copy up to `sz` read-ahead bytes into `buf`, waiting if none are ready.
+// Returns like read().
+static ssize_t io61_ra_read(io61_file* f, unsigned char* buf, size_t sz) {
+    io61_readahead* ra = f->ra;
+    std::unique_lock<std::mutex> guard(ra->m);
+    if (ra->len[ra->head] == 0 && !ra->done
+        && (fcntl(f->fd, F_GETFL) & O_NONBLOCK)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (ra->len[ra->head] == 0 && !ra->done
+        && !io61_latency_files.empty()) {
+        guard.unlock();
+        io61_flush_latency(f);
+        guard.lock();
+    }
+    ra->cv.wait(guard, [&] { return ra->len[ra->head] != 0 || ra->done; });
+    unsigned h = ra->head;
+    if (ra->len[h] == 0) {
+        if (ra->error) {
+            errno = ra->error;
             return -1;
         }
+        return 0;
+    }
+    size_t n = std::min(sz, ra->len[h] - ra->off[h]);
+    memcpy(buf, ra->buf[h] + ra->off[h], n);
+    ra->off[h] += n;
+    if (ra->off[h] == ra->len[h]) {
+        ra->len[h] = ra->off[h] = 0;
+        ra->head = h ^ 1;
+        ra->cv.notify_all();
+    }
+    return n;
+}
+
+static bool io61_slot_dirty(const io61_slot* s) {
+    return s->dirty_start != s->dirty_end;
+}
+
+static void io61_slot_release(io61_slot* s) {
+    s->tag = -1;
+    s->size = s->dirty_start = s->dirty_end = 0;
+}
+
+// Allocator (io61_set_allocator). Files and cache buffers come from
+// `io61_alloc_hook` and go back to `io61_free_hook`; `io61_nallocated`
+// counts what is outstanding, so the hooks never change under live memory.
+static void* io61_default_alloc(size_t align, size_t size) {
+    // aligned_alloc wants a multiple of the alignment
+    return aligned_alloc(align, (size + align - 1) & ~(align - 1));
+}
+
+static void io61_default_free(void* ptr, size_t size) {
+    (void) size;
+    ::free(ptr);
+}
+
+static void* (*io61_alloc_hook)(size_t, size_t) = io61_default_alloc;
+static void (*io61_free_hook)(void*, size_t) = io61_default_free;
+static std::atomic<size_t> io61_nallocated;
+
+void* io61_allocate(size_t align, size_t size) {
+    void* ptr = io61_alloc_hook(align, size);
+    if (ptr) {
+        ++io61_nallocated;
+    } else {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void io61_deallocate(void* ptr, size_t size) {
+    if (ptr) {
+        io61_free_hook(ptr, size);
+        --io61_nallocated;
+    }
+}
+
+struct io61_pool {
+    std::mutex m;
+    std::vector<unsigned char*> free[16];  // By log2(size / DIRECT_ALIGN)
+    size_t bytes = 0;          // Total size of the free buffers
+};
+
+// Never destroyed, so files closed by static destructors can use it
+static io61_pool* io61_the_pool = new io61_pool;
+
+static unsigned io61_pool_class(size_t size) {
+    unsigned c = 0;
+    while ((DIRECT_ALIGN << c) < size) {
+        ++c;
+    }
+    return c;
+}
+
+// Return slot `s`'s buffer to the pool, freeing the biggest free buffers
+// once the pool is over its limit. Call with the pool locked.
+static void io61_pool_put(io61_pool* p, io61_slot* s) {
+    if (!s->buf) {
+        return;
+    }
+    p->free[io61_pool_class(s->cap)].push_back(s->buf);
+    p->bytes += s->cap;
+    s->buf = nullptr;
+    s->cap = 0;
+    for (unsigned c = 16; p->bytes > POOL_LIMIT && c-- != 0; ) {
+        while (p->bytes > POOL_LIMIT && !p->free[c].empty()) {
+            io61_deallocate(p->free[c].back(), DIRECT_ALIGN << c);
+            p->free[c].pop_back();
+            p->bytes -= DIRECT_ALIGN << c;
+        }
+    }
+}
 
-        // Read the block
-        ssize_t nr = read(f->fd, f->cbuf, desired_size);
-        if (nr <= 0) {
-            return nr;
+// Give slot `s` a buffer of `size` bytes, aligned for direct I/O.
+// Returns -1 (ENOMEM) if none can be had.
+static int io61_slot_buffer(io61_slot* s, size_t size) {
+    if (s->buf && s->cap == size) {
+        return 0;
+    }
+    io61_pool* p = io61_the_pool;
+    std::lock_guard<std::mutex> guard(p->m);
+    io61_pool_put(p, s);
+    auto& fl = p->free[io61_pool_class(size)];
+    if (!fl.empty()) {
+        s->buf = fl.back();
+        fl.pop_back();
+        p->bytes -= size;
+    } else if (!(s->buf = reinterpret_cast<unsigned char*>(
+                     io61_allocate(DIRECT_ALIGN, size)))) {
+        return -1;
+    }
+    s->cap = size;
+    return 0;
+}
+
+// Drop every slot of `f` from the cache, dirty or not, and return their
+// buffers to the pool
+static void io61_slots_free(io61_file* f) {
+    io61_pool* p = io61_the_pool;
+    std::lock_guard<std::mutex> guard(p->m);
+    for (io61_slot& s : f->slots) {
+        io61_slot_release(&s);
+        io61_pool_put(p, &s);
+    }
+}
+
+// Return the slot caching file offset `off`, or -1
+static int io61_find(io61_file* f, off_t off) {
+    const io61_slot* s = &f->slots[f->cur];
+    if (s->tag >= 0 && off >= s->tag && off - s->tag < off_t(f->bsize)) {
+        return f->cur;
+    }
+    for (unsigned i = 0; i != NSLOTS; ++i) {
+        s = &f->slots[i];
+        if (s->tag >= 0 && off >= s->tag && off - s->tag < off_t(f->bsize)) {
+            return i;
         }
+    }
+    return -1;
+}
 
-        f->cbuf_size = nr;
-        f->cbuf_pos = f->cbuf_size;  // Start from end
-        f->tag_position = read_pos + nr;
-        return nr;
+// Return true if any dirty extent overlaps `[lo, hi)`
+static bool io61_extents_overlap(io61_file* f, off_t lo, off_t hi) {
+    auto it = f->extents.lower_bound(hi);
+    if (it == f->extents.begin()) {
+        return false;
+    }
+    --it;
+    return it->first + off_t(it->second.len) > lo;
+}
+
+// Record `data[0, n)` as dirty at `off`, merging with the extents it
+// touches. Appends just extend a chunk; overlaps are rare and copied.
+static void io61_spill(io61_file* f, off_t off, const unsigned char* data,
+                       size_t n) {
+    off_t end = off + n;
+    auto last = f->extents.upper_bound(end), first = last;
+    bool overlap = false;
+    while (first != f->extents.begin()) {
+        auto p = std::prev(first);
+        off_t pend = p->first + off_t(p->second.len);
+        if (pend < off) {
+            break;
+        }
+        overlap = overlap || (p->first < end && pend > off);
+        first = p;
+    }
+
+    if (first == last) {
+        io61_extent e;
+        e.len = n;
+        e.chunks.emplace_back(data, data + n);
+        f->extents.emplace(off, std::move(e));
+    } else if (!overlap && first->first + off_t(first->second.len) == off) {
+        // Extend the extent on the left, then absorb one on the right
+        io61_extent& e = first->second;
+        e.chunks.back().insert(e.chunks.back().end(), data, data + n);
+        e.len += n;
+        auto next = std::next(first);
+        if (next != last) {
+            for (auto& c : next->second.chunks) {
+                e.chunks.push_back(std::move(c));
+            }
+            e.len += next->second.len;
+            f->extents.erase(next);
+        }
+    } else if (!overlap) {
+        // Prepend to the extent on the right
+        io61_extent e;
+        e.len = n + first->second.len;
+        e.chunks.emplace_back(data, data + n);
+        for (auto& c : first->second.chunks) {
+            e.chunks.push_back(std::move(c));
+        }
+        f->extents.erase(first);
+        f->extents.emplace(off, std::move(e));
     } else {
-        // Forward reading
-        if (f->pos != f->tag_position) {
-            if (lseek(f->fd, f->pos, SEEK_SET) < 0) {
+        off_t lo = std::min(off, first->first);
+        auto p = std::prev(last);
+        off_t hi = std::max(end, p->first + off_t(p->second.len));
+        std::vector<unsigned char> merged(hi - lo);
+        for (auto it = first; it != last; ++it) {
+            size_t at = it->first - lo;
+            for (auto& c : it->second.chunks) {
+                memcpy(merged.data() + at, c.data(), c.size());
+                at += c.size();
+            }
+            f->extent_bytes -= it->second.len;
+        }
+        memcpy(merged.data() + (off - lo), data, n);
+        f->extents.erase(first, last);
+        io61_extent e;
+        e.len = hi - lo;
+        e.chunks.push_back(std::move(merged));
+        f->extents.emplace(lo, std::move(e));
+        n = hi - lo;
+    }
+    f->extent_bytes += n;
+}
+
+// Write out every dirty extent, in file order
+static int io61_flush_extents(io61_file* f) {
+    while (!f->extents.empty()) {
+        auto it = f->extents.begin();
+        off_t off = it->first;
+        auto& chunks = it->second.chunks;
+        size_t ci = 0, co = 0;  // next chunk and offset in it
+        while (ci != chunks.size()) {
+            iovec iov[EXTENT_IOVS];
+            int n = 0;
+            for (size_t k = ci; k != chunks.size() && n != EXTENT_IOVS; ++k) {
+                size_t skip = k == ci ? co : 0;
+                iov[n++] = {chunks[k].data() + skip, chunks[k].size() - skip};
+            }
+            ++f->stats.syscalls;
+            ssize_t nw = pwritev(f->fd, iov, n, off);
+            if (nw < 0 && errno == EINTR) {
+                continue;
+            } else if (nw <= 0) {
+                return -1;
+            }
+            f->stats.bytes_written += nw;
+            off += nw;
+            for (size_t left = nw; left != 0; ) {
+                size_t m = std::min(left, chunks[ci].size() - co);
+                co += m;
+                left -= m;
+                if (co == chunks[ci].size()) {
+                    ++ci;
+                    co = 0;
+                }
+            }
+        }
+        f->extent_bytes -= it->second.len;
+        f->extents.erase(it);
+    }
+    return 0;
+}
+
+// The length to write of `s`'s dirty run. In direct mode, an aligned run
+// that ends the file is padded to an aligned length, so even the file's
+// last block bypasses the page cache; io61_slot_flush truncates after.
+static size_t io61_direct_len(io61_file* f, io61_slot* s) {
+    size_t n = s->dirty_end - s->dirty_start;
+    struct stat st;
+    if (!f->direct || n % DIRECT_ALIGN == 0
+        || s->dirty_start % DIRECT_ALIGN != 0
+        || fstat(f->fd, &st) != 0
+        || s->tag + off_t(s->dirty_end) < st.st_size) {
+        return n;
+    }
+    size_t end = (s->dirty_end + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+    return end - s->dirty_start;
+}
+
+static int io61_slot_flush(io61_file* f, io61_slot* s) {
+    if (!io61_slot_dirty(s)) {
+        return 0;
+    }
+    off_t off = s->tag + s->dirty_start;
+    size_t n = s->dirty_end - s->dirty_start;
+    if (f->seekable && !f->direct
+        && (n < f->bsize || io61_extents_overlap(f, off, off + n))) {
+        io61_spill(f, off, s->buf + s->dirty_start, n);
+        s->dirty_start = s->dirty_end = 0;
+        if (f->extent_bytes >= DIRTY_LIMIT) {
+            return io61_flush_extents(f);
+        }
+        return 0;
+    }
+    if (io61_fd_seek(f, s->tag + s->dirty_start) < 0) {
+        return -1;
+    }
+    while (s->dirty_start != s->dirty_end) {
+        iovec iov = {s->buf + s->dirty_start, io61_direct_len(f, s)};
+        io61_direct_for(f, s->tag + s->dirty_start, &iov, 1);
+        ++f->stats.syscalls;
+        ssize_t nw = write(f->fd, iov.iov_base, iov.iov_len);
+        if (nw < 0 && (errno == EINTR || io61_direct_failed(f))) {
+            continue;
+        } else if (nw <= 0) {
+            return -1;
+        }
+        f->fd_pos += nw;
+        f->stats.bytes_written += nw;
+        if (size_t(nw) > s->dirty_end - s->dirty_start) {
+            // Cut the padding back off
+            ++f->stats.syscalls;
+            if (ftruncate(f->fd, s->tag + s->dirty_end) < 0) {
                 return -1;
             }
-            f->tag_position = f->pos;
+            nw = s->dirty_end - s->dirty_start;
+        }
+        s->dirty_start += nw;
+    }
+    s->dirty_start = s->dirty_end = 0;
+    return 0;
+}
+
+// Claim a slot for the block at `tag`, evicting with CLOCK but never
+// evicting a slot in `pinned`. Returns the slot index, or -1 if the
+// evicted slot's dirty data could not be written.
+static int io61_claim(io61_file* f, off_t tag, unsigned pinned) {
+    while (true) {
+        unsigned i = f->clock_hand;
+        f->clock_hand = (i + 1) % NSLOTS;
+        io61_slot* s = &f->slots[i];
+        if (pinned & (1U << i)) {
+            continue;
+        }
+        if (s->tag >= 0 && s->referenced) {
+            s->referenced = false;
+            continue;
+        }
+        if (io61_slot_flush(f, s) < 0) {
+            return -1;
+        }
+        io61_slot_release(s);
+        if (io61_slot_buffer(s, f->bsize) < 0) {
+            return -1;
+        }
+        s->tag = tag;
+        s->referenced = true;
+        return i;
+    }
+}
+
+// Note a miss at `f->pos` on a seekable file for the sequential detector,
+// and double the block size once it has seen GROW_RUN sequential misses
+// at a position the larger block would start at. Cached blocks would be
+// misaligned, so every slot is written back and dropped first.
+static int io61_seq_miss(io61_file* f) {
+    off_t tag = f->pos & ~off_t(f->bsize - 1);
+    f->seq_run = tag == f->seq_next ? f->seq_run + 1 : 0;
+    if (f->seq_run < GROW_RUN || f->bsize >= MAX_BUFFER_SIZE
+        || f->bsize_fixed || tag % off_t(2 * f->bsize) != 0) {
+        return 0;
+    }
+    if (io61_flush(f) < 0) {
+        return -1;
+    }
+    io61_slots_free(f);
+    f->bsize *= 2;
+    f->seq_run = 0;
+    f->stream_last = -1;
+    f->stream_run = 0;
+    return 0;
+}
+
+// Note a missed block for the stream detector
+static void io61_stream_miss(io61_file* f, off_t tag) {
+    off_t delta = tag - f->stream_last;
+    if (f->stream_last >= 0 && delta == f->stream_delta) {
+        ++f->stream_run;
+    } else {
+        f->stream_delta = delta;
+        f->stream_run = 0;
+    }
+    f->stream_last = tag;
+}
+
+// Make the slot `f->cur` hold the byte at `f->pos`, reading the missing
+// block plus any predicted neighbors in one readv(). Returns the number
+// of cached bytes from `f->pos` on, 0 at end of file, or -1 on error.
+static ssize_t io61_fill(io61_file* f) {
+    int i = io61_find(f, f->pos);
+    if (i >= 0 && f->pos - f->slots[i].tag < off_t(f->slots[i].size)) {
+        ++f->stats.hits;
+        f->cur = i;
+        f->slots[i].referenced = true;
+        return f->slots[i].size - (f->pos - f->slots[i].tag);
+    }
+    ++f->stats.misses;
+    if (i >= 0 && io61_slot_flush(f, &f->slots[i]) < 0) {
+        return -1;
+    }
+    if (i < 0) {
+        if (f->seekable && io61_seq_miss(f) < 0) {
+            return -1;
+        }
+        off_t tag = f->pos;
+        if (f->seekable) {
+            tag &= ~off_t(f->bsize - 1);
+        }
+        i = io61_claim(f, tag, 0);
+        if (i < 0) {
+            return -1;
+        }
+        io61_stream_miss(f, tag);
+    }
+    io61_slot* s = &f->slots[i];
+    s->referenced = true;
+
+    if (f->ra) {
+        ssize_t nr = io61_ra_read(f, s->buf + s->size, f->bsize - s->size);
+        if (nr < 0) {
+            return -1;
+        }
+        s->size += nr;
+        f->fd_pos += nr;
+        f->stats.bytes_read += nr;
+        f->cur = i;
+        return nr;
+    }
+
+    bool stream = f->stream_run > 0;
+    bool forward = !f->seekable
+        || (stream && f->stream_delta == off_t(f->bsize));
+    bool reverse = stream && f->seekable && s->size == 0
+        && f->stream_delta == -off_t(f->bsize);
+
+    // Gather the slots to read, in file order
+    io61_slot* order[2 * PREFETCH_BLOCKS + 1];
+    unsigned n = 0, pinned = 1U << i;
+    for (unsigned k = 1; reverse && k <= PREFETCH_BLOCKS; ++k) {
+        off_t tag = s->tag - off_t(k * f->bsize);
+        if (tag < 0 || io61_find(f, tag) >= 0) {
+            break;
+        }
+        int j = io61_claim(f, tag, pinned);
+        if (j < 0) {
+            return -1;
+        }
+        pinned |= 1U << j;
+        order[n++] = &f->slots[j];
+    }
+    std::reverse(order, order + n);
+    off_t start = n ? order[0]->tag : s->tag + s->size;
+    order[n++] = s;
+    for (unsigned k = 1; forward && k <= PREFETCH_BLOCKS; ++k) {
+        off_t tag = s->tag + off_t(k * f->bsize);
+        if (io61_find(f, tag) >= 0) {
+            break;
+        }
+        int j = io61_claim(f, tag, pinned);
+        if (j < 0) {
+            return -1;
         }
+        pinned |= 1U << j;
+        order[n++] = &f->slots[j];
+    }
+
+    f->seq_next = order[n - 1]->tag + f->bsize;
 
-        f->cbuf_pos = 0;
-        f->cbuf_size = read(f->fd, f->cbuf, BUFFER_SIZE);
-        if (f->cbuf_size > 0) {
-            f->tag_position += f->cbuf_size;
+    iovec iov[2 * PREFETCH_BLOCKS + 1];
+    size_t len = 0;
+    for (unsigned k = 0; k != n; ++k) {
+        iov[k] = {order[k]->buf + order[k]->size, f->bsize - order[k]->size};
+        len += iov[k].iov_len;
+    }
+    // Dirty extents in the range (including any just evicted) go first.
+    // Seekable files read with preadv(), which leaves the fd offset alone.
+    ssize_t nr = -1;
+    if ((!io61_extents_overlap(f, start, start + len)
+         || io61_flush_extents(f) == 0)
+        && (f->seekable || io61_fd_seek(f, start) == 0)) {
+        if (!f->seekable && !io61_latency_files.empty()) {
+            io61_flush_latency(f);
+        }
+        io61_direct_for(f, start, iov, n);
+        for (int tries = 0; tries != 2 && nr < 0; ++tries) {
+            ++f->stats.syscalls;
+            nr = f->seekable ? preadv(f->fd, iov, n, start)
+                : readv(f->fd, iov, n);
+            if (nr >= 0 || !io61_direct_failed(f)) {
+                break;
+            }
         }
-        return f->cbuf_size;
     }
+    size_t left = std::max(nr, ssize_t(0));
+    if (!f->seekable) {
+        f->fd_pos += left;
+    }
+    f->stats.bytes_read += left;
+    if (reverse && nr > 0 && !f->direct) {
+        io61_prefetch(f, start - off_t(REVERSE_PREFETCH), REVERSE_PREFETCH);
+    } else if (f->seekable && nr > 0 && !f->direct) {
+        io61_hint_read(f, start, nr);
+    }
+    if (f->noreuse) {
+        io61_drop_behind(f);
+    }
+    for (unsigned k = 0; k != n; ++k) {
+        size_t m = std::min(left, iov[k].iov_len);
+        order[k]->size += m;
+        left -= m;
+        if (order[k] != s && order[k]->size == 0) {
+            io61_slot_release(order[k]);
+        }
+    }
+    if (nr < 0) {
+        return -1;
+    }
+
+    f->cur = i;
+    off_t off = f->pos - s->tag;
+    return off < off_t(s->size) ? s->size - off : 0;
+}
+
+// Write a large transfer, the `n` buffers in `data`, at `f->pos` straight
+// to the file with writev(), preceded by any dirty run that ends where it
+// starts. Returns the number of bytes of `data` written, or -1 on error.
+static ssize_t io61_write_direct(io61_file* f, const iovec* data, int n) {
+    size_t sz = 0;
+    for (int k = 0; k != n; ++k) {
+        sz += data[k].iov_len;
+    }
+    off_t end = f->pos + sz;
+    io61_slot* tail = nullptr;
+    for (io61_slot& s : f->slots) {
+        if (s.tag < 0 || !io61_slot_dirty(&s)) {
+            continue;
+        } else if (s.tag + off_t(s.dirty_end) == f->pos) {
+            tail = &s;
+        } else if ((s.tag + off_t(f->bsize) > f->pos && s.tag < end)
+                   || !f->seekable) {
+            if (io61_slot_flush(f, &s) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    size_t ndirty = tail ? tail->dirty_end - tail->dirty_start : 0;
+    if (io61_extents_overlap(f, f->pos - ndirty, end)
+        && io61_flush_extents(f) < 0) {
+        return -1;
+    }
+    if (io61_fd_seek(f, f->pos - ndirty) < 0) {
+        return -1;
+    }
+    std::vector<iovec> iov;
+    iov.reserve(n + 1);
+    iov.push_back({tail ? tail->buf + tail->dirty_start : nullptr, ndirty});
+    iov.insert(iov.end(), data, data + n);
+    size_t first = 0, nwritten = 0;
+    while (first != iov.size() && iov[first].iov_len == 0) {
+        ++first;
+    }
+    ++f->stats.bypasses;
+    while (first != iov.size()) {
+        int cnt = std::min(iov.size() - first, size_t(IOV_MAX));
+        ++f->stats.syscalls;
+        ssize_t nw = writev(f->fd, &iov[first], cnt);
+        if (nw < 0 && errno == EINTR) {
+            continue;
+        } else if (nw <= 0) {
+            break;
+        }
+        f->fd_pos += nw;
+        f->stats.bytes_written += nw;
+        for (size_t left = nw; left != 0; ) {
+            size_t m = std::min(left, iov[first].iov_len);
+            iov[first].iov_base = (unsigned char*) iov[first].iov_base + m;
+            iov[first].iov_len -= m;
+            left -= m;
+            if (first != 0) {
+                nwritten += m;
+            }
+            while (first != iov.size() && iov[first].iov_len == 0) {
+                ++first;
+            }
+        }
+    }
+    if (tail) {
+        tail->dirty_start = tail->dirty_end - iov[0].iov_len;
+        if (iov[0].iov_len != 0) {
+            return -1;
+        }
+        tail->dirty_start = tail->dirty_end = 0;
+    }
+
+    // Cached copies of the overwritten bytes are stale
+    for (io61_slot& s : f->slots) {
+        if (s.tag >= 0 && s.tag < f->pos + off_t(nwritten)
+            && s.tag + off_t(f->bsize) > f->pos) {
+            io61_slot_release(&s);
+        }
+    }
+    f->pos += nwritten;
+    return nwritten;
+}
+
+// Write all of `iov` at `off` with pwritev(), for as long as it makes
+// progress. Returns the number of bytes written.
+static size_t io61_pwritev_all(int fd, std::vector<iovec>& iov, off_t off,
+                               io61_stats& stats) {
+    size_t first = 0, nwritten = 0;
+    while (first != iov.size()) {
+        if (iov[first].iov_len == 0) {
+            ++first;
+            continue;
+        }
+        int cnt = std::min(iov.size() - first, size_t(IOV_MAX));
+        ++stats.syscalls;
+        ssize_t nw = pwritev(fd, &iov[first], cnt, off + nwritten);
+        if (nw < 0 && errno == EINTR) {
+            continue;
+        } else if (nw <= 0) {
+            break;
+        }
+        stats.bytes_written += nw;
+        nwritten += nw;
+        for (size_t left = nw; left != 0; ) {
+            size_t m = std::min(left, iov[first].iov_len);
+            iov[first].iov_base = (unsigned char*) iov[first].iov_base + m;
+            iov[first].iov_len -= m;
+            left -= m;
+            if (iov[first].iov_len == 0) {
+                ++first;
+            }
+        }
+    }
+    return nwritten;
+}
+
+// This thread's state for each shared file it has used
+struct io61_thread_ref {
+    unsigned long long id;
+    std::weak_ptr<io61_shared> shared;
+    io61_thread* t;
+};
+static thread_local std::vector<io61_thread_ref> io61_my_threads;
+static std::atomic<unsigned long long> io61_next_share_id{1};
+
+// Return the calling thread's state for shared file `f`, registering
+// it on first use
+static io61_thread* io61_me(io61_file* f) {
+    io61_shared* sh = f->shared.get();
+    for (const io61_thread_ref& r : io61_my_threads) {
+        if (r.id == sh->id) {
+            return r.t;
+        }
+    }
+    // Forget files closed since the last registration
+    io61_my_threads.erase(std::remove_if(io61_my_threads.begin(),
+                                         io61_my_threads.end(),
+                                         [] (const io61_thread_ref& r) {
+                                             return r.shared.expired();
+                                         }),
+                          io61_my_threads.end());
+    io61_thread* t = new io61_thread;
+    t->pos = sh->start;
+    t->rbuf.reset(new unsigned char[f->bsize]);
+    t->wbuf.reset(new unsigned char[f->bsize]);
+    {
+        std::lock_guard<std::mutex> guard(sh->m);
+        sh->threads.push_back(t);
+    }
+    io61_my_threads.push_back({sh->id, f->shared, t});
+    return t;
+}
+
+// Write thread `t`'s staged bytes, first reserving their offset if the
+// file is appending
+static int io61_thread_flush(io61_file* f, io61_thread* t) {
+    if (t->wsize == 0) {
+        return 0;
+    } else if (t->wtag < 0) {
+        t->wtag = f->shared->end.fetch_add(t->wsize);
+    }
+    std::vector<iovec> iov = {{t->wbuf.get(), t->wsize}};
+    size_t nw = io61_pwritev_all(f->fd, iov, t->wtag, t->stats);
+    if (nw != t->wsize) {
+        memmove(t->wbuf.get(), t->wbuf.get() + nw, t->wsize - nw);
+        t->wtag += nw;
+        t->wsize -= nw;
+        return -1;
+    }
+    t->wtag = -1;
+    t->wsize = 0;
+    return 0;
+}
+
+// Return true if `t`'s read buffer holds the byte at its position
+static bool io61_thread_has(io61_thread* t) {
+    return t->rtag >= 0 && t->pos >= t->rtag
+        && t->pos < t->rtag + off_t(t->rsize);
+}
+
+// Make `t`'s read buffer hold the byte at its position. Returns the
+// number of buffered bytes from there on, 0 at end of file, or -1.
+static ssize_t io61_thread_fill(io61_file* f, io61_thread* t) {
+    if (io61_thread_has(t)) {
+        ++t->stats.hits;
+        return t->rtag + t->rsize - t->pos;
+    }
+    // The thread's own staged writes reach the file first
+    if (io61_thread_flush(f, t) < 0) {
+        return -1;
+    }
+    ++t->stats.misses;
+    off_t tag = t->pos & ~off_t(f->bsize - 1);
+    ssize_t nr;
+    do {
+        ++t->stats.syscalls;
+        nr = pread(f->fd, t->rbuf.get(), f->bsize, tag);
+    } while (nr < 0 && errno == EINTR);
+    t->rtag = nr < 0 ? -1 : tag;
+    t->rsize = std::max(nr, ssize_t(0));
+    if (nr < 0) {
+        return -1;
+    }
+    t->stats.bytes_read += nr;
+    return t->pos < tag + nr ? tag + nr - t->pos : 0;
+}
+
+static ssize_t io61_shared_read(io61_file* f, unsigned char* buf, size_t sz) {
+    io61_thread* t = io61_me(f);
+    if (f->map) {
+        size_t n = 0;
+        if (size_t(t->pos) < f->map_size) {
+            n = std::min(sz, f->map_size - t->pos);
+        }
+        if (n != 0) {
+            memcpy(buf, f->map + t->pos, n);
+            t->pos += n;
+        }
+        return n;
+    }
+
+    size_t nread = 0;
+    while (nread != sz) {
+        ssize_t nr;
+        if (sz - nread >= f->bsize && !io61_thread_has(t)) {
+            // Large transfers skip the read buffer
+            ++t->stats.bypasses;
+            nr = io61_thread_flush(f, t);
+            if (nr == 0) {
+                ++t->stats.syscalls;
+                nr = pread(f->fd, buf + nread, sz - nread, t->pos);
+            }
+            if (nr < 0 && errno == EINTR) {
+                continue;
+            } else if (nr > 0) {
+                t->stats.bytes_read += nr;
+            }
+        } else {
+            nr = io61_thread_fill(f, t);
+            if (nr > 0) {
+                nr = std::min(size_t(nr), sz - nread);
+                memcpy(buf + nread, t->rbuf.get() + (t->pos - t->rtag), nr);
+            }
+        }
+        if (nr <= 0) {
+            if (nr < 0 && nread == 0) {
+                return -1;
+            }
+            break;
+        }
+        t->pos += nr;
+        nread += nr;
+    }
+    return nread;
+}
+
+// Write `iov[0, n)` as a unit: staged if it fits, otherwise straight to
+// the file. A staged run stays contiguous, so bytes that don't extend it
+// or don't fit flush it first.
+static ssize_t io61_shared_writev(io61_file* f, const iovec* iov, int n) {
+    io61_thread* t = io61_me(f);
+    io61_shared* sh = f->shared.get();
+    size_t sz = 0;
+    for (int k = 0; k != n; ++k) {
+        sz += iov[k].iov_len;
+    }
+    bool extends = sh->append || t->pos == t->wtag + off_t(t->wsize);
+    if (t->wsize != 0 && (!extends || t->wsize + sz > f->bsize)
+        && io61_thread_flush(f, t) < 0) {
+        return -1;
+    }
+    // The thread's read buffer must not hide what it wrote
+    if (!sh->append && t->rtag >= 0 && t->rtag < t->pos + off_t(sz)
+        && t->rtag + off_t(t->rsize) > t->pos) {
+        t->rtag = -1;
+        t->rsize = 0;
+    }
+
+    if (sz >= f->bsize) {
+        ++t->stats.bypasses;
+        off_t off = sh->append ? sh->end.fetch_add(sz) : t->pos;
+        std::vector<iovec> v(iov, iov + n);
+        size_t nw = io61_pwritev_all(f->fd, v, off, t->stats);
+        if (!sh->append) {
+            t->pos += nw;
+        }
+        return nw != 0 || sz == 0 ? ssize_t(nw) : -1;
+    }
+    ++t->stats.hits;
+    if (t->wsize == 0) {
+        t->wtag = sh->append ? -1 : t->pos;
+    }
+    for (int k = 0; k != n; ++k) {
+        memcpy(t->wbuf.get() + t->wsize, iov[k].iov_base, iov[k].iov_len);
+        t->wsize += iov[k].iov_len;
+    }
+    if (!sh->append) {
+        t->pos += sz;
+    }
+    return sz;
+}
+
+// Flush every thread's staged writes and fold in its counters
+static int io61_shared_close(io61_file* f) {
+    int r = 0;
+    for (io61_thread* t : f->shared->threads) {
+        if (io61_thread_flush(f, t) < 0) {
+            r = -1;
+        }
+        io61_stats& st = f->stats;
+        st.syscalls += t->stats.syscalls;
+        st.bytes_read += t->stats.bytes_read;
+        st.bytes_written += t->stats.bytes_written;
+        st.hits += t->stats.hits;
+        st.misses += t->stats.misses;
+        st.seeks += t->stats.seeks;
+        st.bypasses += t->stats.bypasses;
+        st.flushes += t->stats.flushes;
+        delete t;
+    }
+    f->shared.reset();
+    return r;
+}
+
+// Pick the initial block size for `fd` from its medium: the preferred I/O
+// size of files and devices, the capacity of pipes, the buffer size of
+// sockets
+static size_t io61_pick_bsize(int fd, int mode) {
+    size_t want = 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        // use the minimum
+    } else if (S_ISFIFO(st.st_mode)) {
+        want = std::max(fcntl(fd, F_GETPIPE_SZ), 0);
+    } else if (S_ISSOCK(st.st_mode)) {
+        int sz = 0;
+        socklen_t len = sizeof(sz);
+        int opt = mode == O_RDONLY ? SO_RCVBUF : SO_SNDBUF;
+        if (getsockopt(fd, SOL_SOCKET, opt, &sz, &len) == 0 && sz > 0) {
+            want = sz;
+        }
+    } else {
+        want = st.st_blksize;
+    }
+    size_t bsize = MIN_BUFFER_SIZE;
+    while (bsize < want && bsize < MAX_BUFFER_SIZE) {
+        bsize *= 2;
+    }
+    return bsize;
 }
 
 io61_file* io61_fdopen(int fd, int mode) {
    assert(fd >= 0);
-   io61_file* f = new io61_file;
+   void* mem = io61_allocate(std::max(alignof(io61_file), size_t(64)),
+                             sizeof(io61_file));
+   if (!mem) {
+       return nullptr;
+   }
+   io61_file* f = new (mem) io61_file;
    f->fd = fd;
    f->mode = mode;
-   f->cbuf_size = 0;
-   f->cbuf_pos = (mode == O_WRONLY || mode == O_RDWR) ? BUFFER_SIZE : 0;
-   f->tag_position = 0;
-   f->pos = 0;
-   f->reverse_mode = false;
-   f->size_known = false;
-   f->file_size = 0;
+   off_t off = lseek(fd, 0, SEEK_CUR);
+   f->seekable = off >= 0;
+   f->pos = f->fd_pos = std::max(off, off_t(0));
+   f->bsize = io61_pick_bsize(fd, mode);
+   struct stat st;
+   int fl = fcntl(fd, F_GETFL);
+   if (fl >= 0 && (fl & O_DIRECT)) {
+       // O_DIRECT on a pipe means packet mode; only files go direct
+       f->direct = f->fd_direct = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+   }
+   if (mode == O_RDONLY && !f->direct) {
+       io61_try_map(f);
+   }
+   if (mode == O_RDONLY && !f->map && !f->seekable) {
+       io61_ra_start(f);
+   }
+   const char* e = getenv("IO61_FLUSH");
+   if (mode != O_RDONLY && !f->seekable && e && *e) {
+       char* end;
+       size_t bytes = strtoul(e, &end, 0);
+       unsigned long usec = *end == ',' ? strtoul(end + 1, nullptr, 0) : 0;
+       io61_set_flush(f, bytes, usec);
+   }
+   e = getenv("IO61_BUFSIZE");
+   if (e && *e) {
+       io61_set_buffer(f, strtoul(e, nullptr, 0));
+   }
+   e = getenv("IO61_NOREUSE");
+   if (e && *e && strcmp(e, "0") != 0 && f->seekable) {
+       io61_advise(f, 0, 0, POSIX_FADV_NOREUSE);
+   }
+   io61_trace_open(f);
    return f;
 }
 
 int io61_close(io61_file* f) {
-   io61_flush(f);
+   io61_sync(f);
+   io61_set_flush(f, 0, 0);
+   io61_trace(f, 'c', -1);
+   if (f->shared) {
+       io61_shared_close(f);
+   }
+   // A nonblocking descriptor may need several tries to drain
+   while (io61_flush(f) < 0 && (errno == EAGAIN || errno == EINTR)) {
+       pollfd pfd = {f->fd, POLLOUT, 0};
+       poll(&pfd, 1, -1);
+   }
+   if (f->ra) {
+       io61_ra_stop(f);
+   }
+   if (f->map) {
+       munmap(f->map, f->map_size);
+   }
+   io61_slots_free(f);
+   io61_record_stats(f->fd, f->mode, f->stats);
    int r = close(f->fd);
-   delete f;
+   f->~io61_file();
+   io61_deallocate(f, sizeof(io61_file));
    return r;
 }
 
-int io61_readc(io61_file* f) {
-    unsigned char ch;
-    ssize_t nr = io61_read(f, &ch, 1);
-    if (nr == 1) {
-        return ch;
+// Called by the inline io61_readc when its window is empty: read a byte
+// the slow way, then window the rest of its block
+int io61_readc_slow(io61_file* f) {
+    if (f->shared) {
+        unsigned char ch;
+        return io61_shared_read(f, &ch, 1) == 1 ? ch : -1;
+    }
+    io61_sync(f);
+    if (f->map) {
+        if ((size_t) f->pos >= f->map_size) {
+            return -1;
+        }
+        // Mapped windows are one block long so io61_map_ran sees progress
+        f->win_base = f->rpos = f->map + f->pos;
+        f->rend = f->rpos + std::min(f->map_size - f->pos, f->bsize);
     } else {
-        return -1;
+        io61_slot* s = &f->slots[f->cur];
+        off_t off = f->pos - s->tag;
+        if (s->tag < 0 || off < 0 || off >= off_t(s->size)) {
+            if (io61_fill(f) <= 0) {
+                return -1;
+            }
+            s = &f->slots[f->cur];
+        }
+        f->win_base = f->rpos = s->buf + (f->pos - s->tag);
+        f->rend = s->buf + s->size;
     }
+    f->win_off = f->pos;
+    return *f->rpos++;
 }
 
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
+   if (f->shared) {
+       return io61_shared_read(f, buf, sz);
+   }
+   io61_sync(f);
+   if (f->map) {
+       size_t n = 0;
+       if ((size_t) f->pos < f->map_size) {
+           n = std::min(sz, f->map_size - f->pos);
+       }
+       if (n != 0) {
+           io61_trace(f, 'r', f->pos, n);
+           memcpy(buf, f->map + f->pos, n);
+           io61_sum(f, buf, n);
+           f->pos += n;
+       }
+       io61_map_ran(f, n);
+       return n;
+   }
+   off_t start = f->pos;
+
    size_t nread = 0;
+   while (nread != sz) {
+       io61_slot* s = &f->slots[f->cur];
+       off_t off = f->pos - s->tag;
+       if (s->tag >= 0 && off >= 0 && off < off_t(s->size)) {
+           size_t n = std::min(sz - nread, s->size - off);
+           memcpy(buf + nread, s->buf + off, n);
+           s->referenced = true;
+           ++f->stats.hits;
+           f->pos += n;
+           nread += n;
+           continue;
+       }
 
-   while (nread < sz) {
-       if (f->reverse_mode) {
-           if (f->cbuf_pos == 0) {
-               ssize_t nr = io61_fill_buffer(f);
-               if (nr <= 0) break;
+       ssize_t nr;
+       if (sz - nread >= f->bsize && !f->direct
+           && io61_find(f, f->pos) < 0) {
+           // Large transfers skip the cache
+           ++f->stats.bypasses;
+           nr = -1;
+           if (f->ra) {
+               nr = io61_ra_read(f, buf + nread, sz - nread);
+           } else if ((f->mode == O_RDONLY || io61_flush(f) == 0)
+               && io61_fd_seek(f, f->pos) == 0) {
+               if (!f->seekable && !io61_latency_files.empty()) {
+                   io61_flush_latency(f);
+               }
+               ++f->stats.syscalls;
+               nr = read(f->fd, buf + nread, sz - nread);
+           }
+           if (nr > 0) {
+               f->fd_pos += nr;
+               f->stats.bytes_read += nr;
+               f->pos += nr;
+               nread += nr;
            }
-
-           size_t avail = f->cbuf_pos;
-           size_t to_copy = std::min(sz - nread, avail);
-           memcpy(buf + nread, f->cbuf + f->cbuf_pos - to_copy, to_copy);
-           f->cbuf_pos -= to_copy;
-           f->pos -= to_copy;
-           nread += to_copy;
        } else {
-           if (f->cbuf_pos >= f->cbuf_size) {
-               ssize_t nr = io61_fill_buffer(f);
-               if (nr <= 0) break;
+           nr = io61_fill(f);
+       }
+       if (nr <= 0) {
+           if (nr < 0 && nread == 0) {
+               return -1;
            }
+           break;
+       }
+   }
+   if (nread != 0) {
+       io61_trace(f, 'r', start, nread);
+       io61_sum(f, buf, nread);
+   }
+   if (f->noreuse) {
+       io61_drop_behind(f);
+   }
+   return nread;
+}
+
+ssize_t io61_peek(io61_file* f, const unsigned char** ptr) {
+   if (f->shared) {
+       io61_thread* t = io61_me(f);
+       if (f->map) {
+           *ptr = f->map + t->pos;
+           return size_t(t->pos) < f->map_size ? f->map_size - t->pos : 0;
+       }
+       ssize_t nr = io61_thread_fill(f, t);
+       if (nr > 0) {
+           *ptr = t->rbuf.get() + (t->pos - t->rtag);
+       }
+       return nr;
+   }
+   io61_sync(f);
+   if (f->map) {
+       if ((size_t) f->pos >= f->map_size) {
+           return 0;
+       }
+       *ptr = f->map + f->pos;
+       return f->map_size - f->pos;
+   }
 
-           size_t avail = f->cbuf_size - f->cbuf_pos;
-           size_t to_copy = std::min(sz - nread, avail);
-           memcpy(buf + nread, f->cbuf + f->cbuf_pos, to_copy);
-           f->cbuf_pos += to_copy;
-           f->pos += to_copy;
-           nread += to_copy;
+   io61_slot* s = &f->slots[f->cur];
+   off_t off = f->pos - s->tag;
+   if (s->tag < 0 || off < 0 || off >= off_t(s->size)) {
+       ssize_t nr = io61_fill(f);
+       if (nr <= 0) {
+           return nr;
        }
+       s = &f->slots[f->cur];
+       off = f->pos - s->tag;
    }
+   *ptr = s->buf + off;
+   return s->size - off;
+}
 
-   return (nread > 0 || sz == 0) ? nread : -1;
+void io61_consume(io61_file* f, size_t n) {
+   if (f->shared) {
+       io61_me(f)->pos += n;
+       return;
+   }
+   io61_sync(f);
+   if (n != 0) {
+       io61_trace(f, 'r', f->pos, n);
+   }
+   if (f->sum_on && n != 0) {
+       const io61_slot* s = &f->slots[f->cur];
+       io61_sum(f, f->map ? f->map + f->pos : s->buf + (f->pos - s->tag), n);
+   }
+   f->pos += n;
+   if (f->map) {
+       io61_map_ran(f, n);
+   } else {
+       assert(f->pos <= f->slots[f->cur].tag
+              + off_t(f->slots[f->cur].size));
+   }
 }
 
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
+   if (f->shared) {
+       iovec iov = {const_cast<unsigned char*>(buf), sz};
+       return io61_shared_writev(f, &iov, 1);
+   }
+   io61_sync(f);
+   off_t start = f->pos;
+   // Buffered writes stage their data for write(), which reads it right
+   // back; only direct writes, read by the device, stream
+   bool stream = f->direct && io61_streams(f, sz);
    size_t nwritten = 0;
+   while (nwritten != sz) {
+       size_t n = sz - nwritten;
+       if (n >= f->bsize && !f->direct) {
+           iovec iov = {const_cast<unsigned char*>(buf + nwritten), n};
+           ssize_t nw = io61_write_direct(f, &iov, 1);
+           if (nw <= 0) {
+               break;
+           }
+           nwritten += nw;
+           continue;
+       }
 
-   if (f->reverse_mode) {
-       // Reverse writing
-       while (nwritten < sz) {
-           if (f->cbuf_pos == 0) {
-               if (io61_flush(f) == -1) {
-                   if (nwritten == 0) return -1;
-                   break;
-               }
+       int i = io61_find(f, f->pos);
+       ++(i < 0 ? f->stats.misses : f->stats.hits);
+       if (i < 0) {
+           // Pipes must see dirty blocks in order
+           if (!f->seekable && io61_flush(f) < 0) {
+               break;
+           } else if (f->seekable && io61_seq_miss(f) < 0) {
+               break;
+           }
+           off_t tag = f->pos;
+           if (f->seekable) {
+               tag &= ~off_t(f->bsize - 1);
+               f->seq_next = tag + f->bsize;
            }
+           i = io61_claim(f, tag, 0);
+           if (i < 0) {
+               break;
+           }
+       }
+       io61_slot* s = &f->slots[i];
+       size_t off = f->pos - s->tag;
+       n = std::min(n, f->bsize - off);
 
-           size_t space = f->cbuf_pos;
-           size_t to_copy = std::min(sz - nwritten, space);
-           f->cbuf_pos -= to_copy;
-           memcpy(f->cbuf + f->cbuf_pos, buf + nwritten, to_copy);
-           f->pos -= to_copy;
-           nwritten += to_copy;
+       // The new bytes must join the dirty run, possibly across cached
+       // file data; otherwise flush the old run first
+       if (io61_slot_dirty(s)) {
+           size_t gap_end = off > s->dirty_end ? off
+               : off + n < s->dirty_start ? s->dirty_start : 0;
+           if (gap_end > s->size && io61_slot_flush(f, s) < 0) {
+               break;
+           }
+       }
+       io61_copy_bytes(s->buf + off, buf + nwritten, n, stream);
+       io61_buffered(f, n);
+       if (io61_slot_dirty(s)) {
+           s->dirty_start = std::min(s->dirty_start, off);
+           s->dirty_end = std::max(s->dirty_end, off + n);
+       } else {
+           s->dirty_start = off;
+           s->dirty_end = off + n;
+       }
+       if (off <= s->size) {
+           s->size = std::max(s->size, off + n);
        }
+       s->referenced = true;
+       f->cur = i;
+       f->pos += n;
+       nwritten += n;
+   }
+   io61_flush_policy(f);
+   if (nwritten != 0) {
+       io61_trace(f, 'w', start, nwritten);
+       io61_sum(f, buf, nwritten);
+   }
+   if (f->noreuse) {
+       io61_drop_behind(f);
+   }
+
+   if (nwritten != 0 || sz == 0) {
+       return nwritten;
    } else {
-       // Forward writing
-       while (nwritten < sz) {
-           if (f->cbuf_pos >= BUFFER_SIZE) {
-               if (io61_flush(f) == -1) {
-                   if (nwritten == 0) return -1;
-                   break;
+       return -1;
+   }
+}
+
+ssize_t io61_readv(io61_file* f, const iovec* iov, int iovcnt) {
+   if (f->shared) {
+       size_t nread = 0;
+       for (int k = 0; k != iovcnt; ++k) {
+           ssize_t nr = io61_shared_read(f, (unsigned char*) iov[k].iov_base,
+                                         iov[k].iov_len);
+           if (nr < 0 && nread == 0) {
+               return -1;
+           } else if (nr > 0) {
+               nread += nr;
+           }
+           if (nr != ssize_t(iov[k].iov_len)) {
+               break;
+           }
+       }
+       return nread;
+   }
+   io61_sync(f);
+   size_t left = 0;
+   for (int k = 0; k != iovcnt; ++k) {
+       left += iov[k].iov_len;
+   }
+   size_t nread = 0;
+   int k = 0;
+   size_t koff = 0;  // bytes of `iov[k]` already filled
+   while (left != 0) {
+       if (koff == iov[k].iov_len) {
+           ++k;
+           koff = 0;
+           continue;
+       }
+       unsigned char* base = (unsigned char*) iov[k].iov_base + koff;
+       size_t want = iov[k].iov_len - koff;
+       ssize_t nr;
+       if (left >= f->bsize && want < left && !f->map && !f->ra
+           && !f->direct && io61_find(f, f->pos) < 0) {
+           // Large gathers read straight into the user buffers
+           iovec local[IOV_MAX];
+           int n = 0;
+           local[n++] = {base, want};
+           for (int j = k + 1; j != iovcnt && n != IOV_MAX; ++j) {
+               local[n++] = iov[j];
+           }
+           ++f->stats.bypasses;
+           nr = -1;
+           if ((f->mode == O_RDONLY || io61_flush(f) == 0)
+               && io61_fd_seek(f, f->pos) == 0) {
+               if (!f->seekable && !io61_latency_files.empty()) {
+                   io61_flush_latency(f);
                }
+               ++f->stats.syscalls;
+               nr = readv(f->fd, local, n);
+           }
+           if (nr > 0) {
+               io61_trace(f, 'r', f->pos, nr);
+               io61_sum_iov(f, local, n, nr);
+               f->fd_pos += nr;
+               f->stats.bytes_read += nr;
+               f->pos += nr;
+           }
+       } else {
+           nr = io61_read(f, base, want);
+           if (nr >= 0 && size_t(nr) < want) {
+               left = nr;  // end of file
+           }
+       }
+       if (nr <= 0) {
+           if (nr < 0 && nread == 0) {
+               return -1;
+           }
+           break;
+       }
+       nread += nr;
+       left -= std::min(left, size_t(nr));
+       for (size_t m = nr; m != 0; ) {
+           size_t step = std::min(m, iov[k].iov_len - koff);
+           koff += step;
+           m -= step;
+           if (m != 0) {
+               ++k;
+               koff = 0;
            }
+       }
+   }
+   return nread;
+}
 
-           size_t space = BUFFER_SIZE - f->cbuf_pos;
-           size_t to_copy = std::min(sz - nwritten, space);
-           memcpy(f->cbuf + f->cbuf_pos, buf + nwritten, to_copy);
-           f->cbuf_pos += to_copy;
-           f->pos += to_copy;
-           nwritten += to_copy;
+ssize_t io61_writev(io61_file* f, const iovec* iov, int iovcnt) {
+   if (f->shared) {
+       return io61_shared_writev(f, iov, iovcnt);
+   }
+   io61_sync(f);
+   size_t sz = 0;
+   for (int k = 0; k != iovcnt; ++k) {
+       sz += iov[k].iov_len;
+   }
+   if (sz >= f->bsize && !f->direct) {
+       off_t start = f->pos;
+       ssize_t nw = io61_write_direct(f, iov, iovcnt);
+       if (nw > 0) {
+           io61_trace(f, 'w', start, nw);
+           io61_sum_iov(f, iov, iovcnt, nw);
        }
+       return nw > 0 ? nw : -1;
    }
+   size_t nwritten = 0;
+   for (int k = 0; k != iovcnt; ++k) {
+       ssize_t nw = io61_write(f, (const unsigned char*) iov[k].iov_base,
+                               iov[k].iov_len);
+       if (nw > 0) {
+           nwritten += nw;
+       }
+       if (nw != ssize_t(iov[k].iov_len)) {
+           break;
+       }
+   }
+   if (nwritten != 0 || sz == 0) {
+       return nwritten;
+   } else {
+       return -1;
+   }
+}
 
-   return nwritten;
+// Kernel copy methods for io61_copy, in the order they are tried
+enum io61_copy_method { COPY_RANGE, COPY_SENDFILE, COPY_SPLICE, COPY_NONE };
+
+// Return the first method that could copy from `infd` to `outfd`
+static int io61_copy_first(int infd, int outfd) {
+    struct stat ist, ost;
+    if (fstat(infd, &ist) < 0 || fstat(outfd, &ost) < 0) {
+        return COPY_NONE;
+    } else if (S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode)) {
+        return COPY_RANGE;
+    } else if (S_ISREG(ist.st_mode) || S_ISBLK(ist.st_mode)) {
+        return COPY_SENDFILE;
+    } else if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode)) {
+        return COPY_SPLICE;
+    } else {
+        return COPY_NONE;
+    }
 }
 
-int io61_flush(io61_file* f) {
-   if (f->mode != O_RDONLY) {
-       size_t data_size = 0;
-       unsigned char* data_ptr = nullptr;
-       off_t write_pos = 0;
-
-       if (f->reverse_mode) {
-           if (f->cbuf_pos < BUFFER_SIZE) {
-               data_size = BUFFER_SIZE - f->cbuf_pos;
-               data_ptr = f->cbuf + f->cbuf_pos;
-               write_pos = f->pos;
-           }
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t sz) {
+   if (inf->shared || outf->shared) {
+       return io61_copy_buffered(inf, outf, sz);
+   }
+   io61_sync(inf);
+   io61_sync(outf);
+   // Bytes `inf` has already cached go through `outf`'s cache
+   size_t ncopied = 0;
+   while (ncopied != sz && !inf->map) {
+       int i = io61_find(inf, inf->pos);
+       io61_slot* s = i >= 0 ? &inf->slots[i] : nullptr;
+       if (!s || inf->pos - s->tag >= off_t(s->size)) {
+           break;
+       }
+       size_t off = inf->pos - s->tag;
+       size_t n = std::min(sz - ncopied, s->size - off);
+       ssize_t nw = io61_write(outf, s->buf + off, n);
+       if (nw <= 0) {
+           return ncopied ? ssize_t(ncopied) : -1;
+       }
+       io61_sum(inf, s->buf + off, nw);
+       inf->pos += nw;
+       ncopied += nw;
+   }
+
+   // The rest moves between the descriptors without entering user space,
+   // once both files' dirty data is written and their offsets are right
+   // (and unless a checksum needs to see it)
+   int method = COPY_NONE;
+   if (ncopied != sz && !inf->ra && !inf->direct && !outf->direct
+       && !inf->sum_on && !outf->sum_on
+       && (inf->mode == O_RDONLY || io61_flush(inf) == 0)
+       && io61_flush(outf) == 0
+       && (!inf->seekable || io61_fd_seek(inf, inf->pos) == 0)
+       && (!outf->seekable || io61_fd_seek(outf, outf->pos) == 0)) {
+       method = io61_copy_first(inf->fd, outf->fd);
+   }
+   off_t out_start = outf->pos;
+   bool error = false;
+   while (ncopied != sz && method != COPY_NONE) {
+       size_t n = std::min(sz - ncopied, size_t(1) << 30);
+       ssize_t r;
+       ++inf->stats.syscalls;
+       if (method == COPY_RANGE) {
+           r = copy_file_range(inf->fd, nullptr, outf->fd, nullptr, n, 0);
+       } else if (method == COPY_SENDFILE) {
+           r = sendfile(outf->fd, inf->fd, nullptr, n);
        } else {
-           if (f->cbuf_pos > 0) {
-               data_size = f->cbuf_pos;
-               data_ptr = f->cbuf;
-               write_pos = f->pos - f->cbuf_pos;
+           r = splice(inf->fd, nullptr, outf->fd, nullptr, n, SPLICE_F_MOVE);
+       }
+       if (r < 0 && errno == EINTR) {
+           continue;
+       } else if (r < 0 && (errno == EINVAL || errno == EXDEV
+                            || errno == ENOSYS || errno == EOPNOTSUPP)) {
+           // This pairing is unsupported; try the next method
+           ++method;
+           if (method == COPY_SPLICE && inf->seekable && outf->seekable) {
+               method = COPY_NONE;
+           }
+           continue;
+       } else if (r <= 0) {
+           error = r < 0;
+           break;
+       }
+       inf->pos += r;
+       inf->fd_pos += r;
+       inf->stats.bytes_read += r;
+       outf->pos += r;
+       outf->fd_pos += r;
+       outf->stats.bytes_written += r;
+       ncopied += r;
+   }
+
+   // Cached copies of the bytes the kernel wrote are stale
+   for (io61_slot& s : outf->slots) {
+       if (outf->pos != out_start && s.tag >= 0 && s.tag < outf->pos
+           && s.tag + off_t(outf->bsize) > out_start) {
+           io61_slot_release(&s);
+       }
+   }
+
+   if (error) {
+       return ncopied ? ssize_t(ncopied) : -1;
+   } else if (method == COPY_NONE && ncopied != sz) {
+       ssize_t n = io61_copy_buffered(inf, outf, sz - ncopied);
+       if (n < 0) {
+           return ncopied ? ssize_t(ncopied) : -1;
+       }
+       ncopied += n;
+   }
+   return ncopied;
+}
+
+// Write `data[0, n)`, which another file buffers, to `f` for io61_tee:
+// straight to the descriptor if the chunk is large enough
+static ssize_t io61_tee_write(io61_file* f, const unsigned char* data,
+                              size_t n) {
+    if (f->shared || f->direct || n < TEE_DIRECT_MIN) {
+        return io61_write(f, data, n);
+    }
+    io61_sync(f);
+    off_t start = f->pos;
+    iovec iov = {const_cast<unsigned char*>(data), n};
+    ssize_t nw = io61_write_direct(f, &iov, 1);
+    if (nw > 0) {
+        io61_trace(f, 'w', start, nw);
+        io61_sum(f, data, nw);
+    }
+    if (f->noreuse) {
+        io61_drop_behind(f);
+    }
+    return nw > 0 ? nw : -1;
+}
+
+// Return true if io61_tee may move bytes from `inf` to `outfs[0, n)`
+// inside the kernel: every descriptor is a pipe, and no file needs to see
+// the bytes
+static bool io61_tee_kernel_ok(io61_file* inf, io61_file* const* outfs,
+                               size_t n) {
+    struct stat st;
+    if (n == 0 || inf->shared || inf->map || inf->ra || inf->sum_on
+        || fstat(inf->fd, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+        return false;
+    }
+    for (size_t i = 0; i != n; ++i) {
+        io61_file* f = outfs[i];
+        if (f->shared || f->direct || f->sum_on || f == inf
+            || fstat(f->fd, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Note `n` bytes moved to or from `f`'s descriptor by the kernel
+static void io61_tee_moved(io61_file* f, size_t n, bool write) {
+    f->pos += n;
+    f->fd_pos += n;
+    (write ? f->stats.bytes_written : f->stats.bytes_read) += n;
+}
+
+// Move up to `sz` bytes from pipe `inf` to every pipe in `outfs[0, n)`
+// inside the kernel: tee() copies them into all outputs but the last,
+// leaving them in `inf`'s pipe, and splice() moves them into the last.
+// Bytes that did not make it that way are read and written to the
+// outputs that missed them. Returns the number of bytes every output
+// received, 0 at end of file, or -1 on error.
+static ssize_t io61_tee_kernel(io61_file* inf, io61_file* const* outfs,
+                               size_t n, size_t sz) {
+    for (size_t i = 0; i != n; ++i) {
+        if (io61_wants_write(outfs[i]) && io61_flush(outfs[i]) < 0) {
+            return -1;
+        }
+    }
+    size_t len = std::min(sz, size_t(1) << 30);
+    io61_file* last = outfs[n - 1];
+    ssize_t r;
+    if (n == 1) {
+        do {
+            ++inf->stats.syscalls;
+            r = splice(inf->fd, nullptr, last->fd, nullptr, len, SPLICE_F_MOVE);
+        } while (r < 0 && errno == EINTR);
+        if (r > 0) {
+            io61_tee_moved(inf, r, false);
+            io61_tee_moved(last, r, true);
+        }
+        return r;
+    }
+
+    // `got[i]`: how many of the `r` bytes at the front of `inf`'s pipe
+    // output `i` has
+    std::vector<size_t> got(n, 0);
+    for (size_t i = 0; i != n - 1; ++i) {
+        ssize_t t;
+        do {
+            ++inf->stats.syscalls;
+            t = tee(inf->fd, outfs[i]->fd, i == 0 ? len : got[0], 0);
+        } while (t < 0 && errno == EINTR);
+        if (i == 0 && t <= 0) {
+            return t;
+        }
+        got[i] = std::max(t, ssize_t(0));
+        io61_tee_moved(outfs[i], got[i], true);
+    }
+    r = got[0];
+
+    // If every tee() delivered them all, the last output takes the bytes
+    // themselves; otherwise they are all read
+    size_t taken = 0;
+    while (taken != size_t(r)
+           && std::all_of(got.begin(), got.end() - 1,
+                          [&] (size_t g) { return g == size_t(r); })) {
+        ++inf->stats.syscalls;
+        ssize_t t = splice(inf->fd, nullptr, last->fd, nullptr, r - taken,
+                           SPLICE_F_MOVE);
+        if (t < 0 && errno == EINTR) {
+            continue;
+        } else if (t <= 0) {
+            break;
+        }
+        taken += t;
+        io61_tee_moved(inf, t, false);
+        io61_tee_moved(last, t, true);
+    }
+    got[n - 1] = taken;
+
+    unsigned char buf[65536];
+    for (size_t off = taken; off != size_t(r); ) {
+        ++inf->stats.syscalls;
+        ssize_t nr = read(inf->fd, buf, std::min(size_t(r) - off, sizeof(buf)));
+        if (nr < 0 && errno == EINTR) {
+            continue;
+        } else if (nr <= 0) {
+            return -1;
+        }
+        io61_tee_moved(inf, nr, false);
+        for (size_t i = 0; i != n; ++i) {
+            if (got[i] < off + nr) {
+                size_t skip = got[i] > off ? got[i] - off : 0;
+                if (io61_write(outfs[i], buf + skip, nr - skip)
+                    != ssize_t(nr - skip)) {
+                    return -1;
+                }
+                got[i] = off + nr;
+            }
+        }
+        off += nr;
+    }
+    return r;
+}
+
+ssize_t io61_tee(io61_file* inf, io61_file* const* outfs, size_t n, size_t sz) {
+   bool kernel = io61_tee_kernel_ok(inf, outfs, n);
+   size_t ncopied = 0;
+   while (ncopied != sz) {
+       // Bytes `inf` has already buffered are written from its buffer
+       if (kernel && io61_wants_read(inf)) {
+           ssize_t r = io61_tee_kernel(inf, outfs, n, sz - ncopied);
+           if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+               kernel = false;
+               continue;
+           } else if (r <= 0) {
+               if (r < 0 && ncopied == 0) {
+                   return -1;
+               }
+               break;
            }
+           ncopied += r;
+           continue;
        }
 
-       if (data_size > 0) {
-           if (lseek(f->fd, write_pos, SEEK_SET) == -1) return -1;
+       const unsigned char* data;
+       ssize_t nr = io61_peek(inf, &data);
+       if (nr <= 0) {
+           if (nr < 0 && ncopied == 0) {
+               return -1;
+           }
+           break;
+       }
+       size_t k = std::min(sz - ncopied, size_t(nr));
+       size_t nall = k;
+       for (size_t i = 0; i != n; ++i) {
+           ssize_t nw = io61_tee_write(outfs[i], data, k);
+           nall = std::min(nall, size_t(std::max(nw, ssize_t(0))));
+       }
+       io61_consume(inf, nall);
+       ncopied += nall;
+       if (nall != k) {
+           return ncopied ? ssize_t(ncopied) : -1;
+       }
+   }
+   return ncopied;
+}
 
-           size_t total_written = 0;
-           while (total_written < data_size) {
-               ssize_t nw = write(f->fd, data_ptr + total_written, data_size - total_written);
-               if (nw <= 0) return -1;
-               total_written += nw;
+// Scan whole buffers with memchr, which glibc vectorizes
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz) {
+   size_t nread = 0;
+   while (nread != sz) {
+       const unsigned char* data;
+       ssize_t n = io61_peek(f, &data);
+       if (n <= 0) {
+           if (n < 0 && nread == 0) {
+               return -1;
            }
+           break;
+       }
+       size_t m = std::min(size_t(n), sz - nread);
+       auto nl = (const unsigned char*) memchr(data, '\n', m);
+       if (nl) {
+           m = nl + 1 - data;
+       }
+       memcpy(buf + nread, data, m);
+       io61_consume(f, m);
+       nread += m;
+       if (nl) {
+           break;
+       }
+   }
+   return nread;
+}
+
+int io61_flush(io61_file* f) {
+   if (f->shared) {
+       io61_thread* t = io61_me(f);
+       ++t->stats.flushes;
+       return io61_thread_flush(f, t);
+   }
+   io61_sync(f);
+   ++f->stats.flushes;
+   for (io61_slot& s : f->slots) {
+       if (s.tag >= 0 && io61_slot_flush(f, &s) < 0) {
+           return -1;
+       }
+   }
+   if (io61_flush_extents(f) < 0) {
+       return -1;
+   }
+   f->unflushed = 0;
+   if (f->mode == O_WRONLY) {
+       // Nothing reads the clean blocks back
+       io61_slots_free(f);
+   }
+   return 0;
+}
+
+bool io61_wants_read(io61_file* f) {
+   if (f->shared) {
+       return !f->map && !io61_thread_has(io61_me(f));
+   }
+   if (f->rpos != f->rend) {
+       return false;
+   }
+   io61_sync(f);
+   if (f->map) {
+       return false;
+   } else if (f->ra) {
+       std::lock_guard<std::mutex> guard(f->ra->m);
+       return f->ra->len[f->ra->head] == 0 && !f->ra->done;
+   }
+   int i = io61_find(f, f->pos);
+   return i < 0 || f->pos - f->slots[i].tag >= off_t(f->slots[i].size);
+}
 
-           f->tag_position = write_pos + (f->reverse_mode ? 0 : total_written);
+bool io61_wants_write(io61_file* f) {
+   if (f->shared) {
+       return io61_me(f)->wsize != 0;
+   }
+   io61_sync(f);
+   for (io61_slot& s : f->slots) {
+       if (s.tag >= 0 && io61_slot_dirty(&s)) {
+           return true;
        }
+   }
+   return !f->extents.empty();
+}
 
-       // Reset buffer positions
-       if (f->reverse_mode) {
-           f->cbuf_pos = BUFFER_SIZE;
-           f->cbuf_size = BUFFER_SIZE;
-       } else {
-           f->cbuf_pos = 0;
-           f->cbuf_size = 0;
+int io61_advise(io61_file* f, off_t off, off_t len, int advice) {
+   if (off < 0 || len < 0) {
+       errno = EINVAL;
+       return -1;
+   }
+   if (!f->shared) {
+       io61_sync(f);
+       ++f->stats.syscalls;
+       if (advice == POSIX_FADV_NOREUSE && f->seekable) {
+           f->noreuse = true;
+           f->drop_from = f->drop_synced = f->pos & ~off_t(sysconf(_SC_PAGESIZE) - 1);
+       } else if (advice == POSIX_FADV_RANDOM || advice == POSIX_FADV_NORMAL
+                  || advice == POSIX_FADV_SEQUENTIAL) {
+           // The caller knows best; stop switching on our own
+           f->fadv_random = advice == POSIX_FADV_RANDOM;
+           f->fadv_caller = true;
+       }
+   }
+   if (f->map) {
+       static const int madv[] = {
+           MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED,
+           MADV_DONTNEED, -1
+       };
+       static_assert(POSIX_FADV_NORMAL == 0 && POSIX_FADV_RANDOM == 1
+                     && POSIX_FADV_SEQUENTIAL == 2 && POSIX_FADV_WILLNEED == 3
+                     && POSIX_FADV_DONTNEED == 4 && POSIX_FADV_NOREUSE == 5,
+                     "POSIX_FADV_* values");
+       off_t page = off & ~off_t(sysconf(_SC_PAGESIZE) - 1);
+       if (advice >= 0 && advice <= 5 && madv[advice] >= 0
+           && size_t(page) < f->map_size) {
+           size_t end = len ? std::min(size_t(off + len), f->map_size) : f->map_size;
+           madvise(f->map + page, end - page, madv[advice]);
+       }
+   }
+   int r = posix_fadvise(f->fd, off, len, advice);
+   if (r != 0) {
+       errno = r;
+       return -1;
+   }
+   return 0;
+}
+
+int io61_set_allocator(void* (*alloc)(size_t align, size_t size),
+                       void (*dealloc)(void* ptr, size_t size)) {
+   if (!alloc != !dealloc) {
+       errno = EINVAL;
+       return -1;
+   }
+   io61_pool* p = io61_the_pool;
+   std::lock_guard<std::mutex> guard(p->m);
+   // Free buffers go back to the allocator they came from
+   for (unsigned c = 0; c != 16; ++c) {
+       for (unsigned char* buf : p->free[c]) {
+           io61_deallocate(buf, DIRECT_ALIGN << c);
+       }
+       p->free[c].clear();
+   }
+   p->bytes = 0;
+   if (io61_nallocated != 0) {
+       errno = EBUSY;
+       return -1;
+   }
+   io61_alloc_hook = alloc ? alloc : io61_default_alloc;
+   io61_free_hook = dealloc ? dealloc : io61_default_free;
+   return 0;
+}
+
+int io61_set_buffer(io61_file* f, size_t size) {
+   io61_sync(f);
+   if (f->shared) {
+       errno = EINVAL;
+       return -1;
+   }
+   size_t bsize = size ? DIRECT_ALIGN : io61_pick_bsize(f->fd, f->mode);
+   while (bsize < size && bsize < MAX_BUFFER_SIZE) {
+       bsize *= 2;
+   }
+   if (bsize != f->bsize) {
+       if (io61_flush(f) < 0) {
+           return -1;
+       }
+       io61_slots_free(f);
+       f->bsize = bsize;
+       f->seq_run = 0;
+       f->stream_last = -1;
+       f->stream_run = 0;
+   }
+   f->bsize_fixed = size != 0;
+   return 0;
+}
+
+int io61_set_checksum(io61_file* f, bool on) {
+   io61_sync(f);
+   if (f->shared) {
+       errno = EINVAL;
+       return -1;
+   }
+   f->sum_on = on;
+   f->sum = 0;
+   return 0;
+}
+
+uint32_t io61_checksum(io61_file* f) {
+   io61_sync(f);
+   return f->sum;
+}
+
+int io61_set_flush(io61_file* f, size_t bytes, unsigned long usec) {
+   if (f->shared) {
+       errno = EINVAL;
+       return -1;
+   }
+   io61_sync(f);
+   auto& lf = io61_latency_files;
+   auto it = std::find(lf.begin(), lf.end(), f);
+   if (usec && it == lf.end()) {
+       lf.push_back(f);
+   } else if (!usec && it != lf.end()) {
+       lf.erase(it);
+   }
+   if (usec && !f->flush_usec && f->unflushed) {
+       f->unflushed_at = io61_now_usec();
+   }
+   f->flush_bytes = bytes;
+   f->flush_usec = usec;
+   io61_flush_policy(f);
+   return 0;
+}
+
+int io61_share(io61_file* f) {
+   io61_sync(f);
+   if (f->shared) {
+       return 0;
+   } else if (!f->seekable) {
+       errno = ESPIPE;
+       return -1;
+   } else if (io61_flush(f) < 0) {
+       return -1;
+   }
+   io61_set_flush(f, 0, 0);
+   f->sum_on = false;
+   // Threads use their own buffers, and their transfers aren't aligned
+   io61_slots_free(f);
+   f->direct = false;
+   io61_direct_for(f, 0, nullptr, 0);
+
+   auto sh = std::make_shared<io61_shared>();
+   sh->id = io61_next_share_id++;
+   sh->start = f->pos;
+   int fl = fcntl(f->fd, F_GETFL);
+   if (fl >= 0 && (fl & O_APPEND)) {
+       // pwrite() ignores its offset on O_APPEND descriptors, so appends
+       // reserve offsets past the current end instead
+       struct stat st;
+       if (fstat(f->fd, &st) < 0
+           || fcntl(f->fd, F_SETFL, fl & ~O_APPEND) < 0) {
+           return -1;
        }
+       sh->append = true;
+       sh->end = st.st_size;
    }
+   f->shared = std::move(sh);
    return 0;
 }
 
 int io61_seek(io61_file* f, off_t pos) {
+    // Shared files move the calling thread's position
+    if (f->shared && pos >= 0) {
+        io61_thread* t = io61_me(f);
+        ++t->stats.seeks;
+        t->pos = pos;
+        return 0;
+    } else if (f->shared) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    io61_sync(f);
+    ++f->stats.seeks;
     // Validate position
     if (pos < 0) {
         errno = EINVAL;
         return -1;
     }
+    io61_trace(f, 's', pos);
 
-    // Determine direction
-    bool new_reverse_mode = (pos < f->pos);
+    // Mapped files just move the position
+    if (f->map) {
+        if (pos < f->pos && f->pos - pos <= off_t(f->bsize)) {
+            // A short backward step: keep at least half a REVERSE_PREFETCH
+            // below `pos` on its way in
+            off_t lo = f->map_back;
+            if (lo < 0 || pos < lo || pos - lo > off_t(2 * REVERSE_PREFETCH)) {
+                lo = pos + 1;
+            }
+            if (lo > 0 && pos - lo < off_t(REVERSE_PREFETCH / 2)) {
+                off_t next = std::max(lo - off_t(REVERSE_PREFETCH), off_t(0));
+                io61_prefetch(f, next, lo - next);
+                lo = next;
+            }
+            f->map_back = lo;
+        }
+        if (pos != f->pos) {
+            f->pos = pos;
+            f->map_run = 0;
+            if (++f->map_jumps >= MAP_RANDOM_JUMPS) {
+                io61_map_advise(f, MADV_RANDOM);
+            }
+        }
+        return 0;
+    }
 
-    // Flush any pending writes
-    if (io61_flush(f) < 0) {
+    if (!f->seekable) {
+        errno = ESPIPE;
         return -1;
     }
 
-    // Update file state
+    // Cached and dirty blocks stay put
     f->pos = pos;
-    f->tag_position = pos;
-    f->cbuf_size = 0;
+    return 0;
+}
 
-    if (new_reverse_mode) {
-        f->reverse_mode = true;
-        f->cbuf_pos = BUFFER_SIZE;
-        f->cbuf_size = BUFFER_SIZE;
-    } else {
-        f->reverse_mode = false;
-        f->cbuf_pos = 0;
-        f->cbuf_size = 0;
+// Positioned I/O borrows the file position for one transfer: the cache
+// finds blocks by offset, so hits never care how the offset was reached
+ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz, off_t off) {
+    if (off < 0) {
+        errno = EINVAL;
+        return -1;
+    } else if (f->shared) {
+        io61_thread* t = io61_me(f);
+        off_t pos = t->pos;
+        t->pos = off;
+        ssize_t nr = io61_shared_read(f, buf, sz);
+        t->pos = pos;
+        return nr;
+    }
+    io61_sync(f);
+    if (!f->seekable) {
+        errno = ESPIPE;
+        return -1;
     }
+    off_t pos = f->pos;
+    f->pos = off;
+    ssize_t nr = io61_read(f, buf, sz);
+    f->pos = pos;
+    return nr;
+}
 
-    return 0;
+ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
+                    off_t off) {
+    if (off < 0) {
+        errno = EINVAL;
+        return -1;
+    } else if (f->shared) {
+        io61_thread* t = io61_me(f);
+        off_t pos = t->pos;
+        t->pos = off;
+        iovec iov = {const_cast<unsigned char*>(buf), sz};
+        ssize_t nw = io61_shared_writev(f, &iov, 1);
+        t->pos = pos;
+        return nw;
+    }
+    io61_sync(f);
+    if (!f->seekable) {
+        errno = ESPIPE;
+        return -1;
+    }
+    off_t pos = f->pos;
+    f->pos = off;
+    ssize_t nw = io61_write(f, buf, sz);
+    f->pos = pos;
+    return nw;
 }
 
-int io61_writec(io61_file* f, int c) {
+// Called by the inline io61_writec when its window is full: write the
+// byte the slow way, then window the rest of the block after the dirty
+// run it joined
+int io61_writec_slow(io61_file* f, int c) {
    unsigned char buf = c;
-   if (io61_write(f, &buf, 1) == 1) {
-       return 0;
-   } else {
+   if (f->shared) {
+       iovec iov = {&buf, 1};
+       return io61_shared_writev(f, &iov, 1) == 1 ? 0 : -1;
+   }
+   io61_sync(f);
+   if (io61_write(f, &buf, 1) != 1) {
        return -1;
    }
+   io61_slot* s = &f->slots[f->cur];
+   if (s->tag >= 0 && io61_slot_dirty(s)
+       && f->pos == s->tag + off_t(s->dirty_end)) {
+       f->win_base = f->wpos = s->buf + s->dirty_end;
+       f->wend = s->buf + f->bsize;
+       if (f->flush_bytes) {
+           // Stop the window where the byte budget runs out
+           size_t left = f->flush_bytes - std::min(f->unflushed, f->flush_bytes);
+           f->wend = std::min(f->wend, f->wpos + left);
+       }
+       f->win_off = f->pos;
+   }
+   return 0;
 }
 
 int io61_fileno(io61_file* f) {
@@ -304,6 +2724,10 @@ io61_file* io61_open_check(const char* filename, int mode) {
    int fd;
    if (filename) {
        fd = open(filename, mode, 0666);
+       if (fd < 0 && errno == EINVAL && (mode & O_DIRECT)) {
+           // This filesystem does not support direct I/O
+           fd = open(filename, mode & ~O_DIRECT, 0666);
+       }
    } else if ((mode & O_ACCMODE) == O_RDONLY) {
        fd = STDIN_FILENO;
    } else {
@@ -7,11 +7,23 @@
 #include <vector>
 #include <random>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <sched.h>
 
 struct io61_file;
 
+// Every io61_file derives from io61_fast, a window onto its buffer that
+// the inline io61_readc and io61_writec use without a function call, as
+// getc_unlocked does. A backend opens a window in io61_readc_slow or
+// io61_writec_slow; backends that never do leave the pointers null.
+struct io61_fast {
+    unsigned char* rpos = nullptr;  // Next byte io61_readc returns
+    unsigned char* rend = nullptr;  // End of the read window
+    unsigned char* wpos = nullptr;  // Where io61_writec stores next
+    unsigned char* wend = nullptr;  // End of the write window
+};
+
 io61_file* io61_fdopen(int fd, int mode);
 io61_file* io61_open_check(const char* filename, int mode);
 int io61_fileno(io61_file* f);
@@ -21,14 +33,159 @@ off_t io61_filesize(io61_file* f);
 
 int io61_seek(io61_file* f, off_t off);
 
-int io61_readc(io61_file* f);
-int io61_writec(io61_file* f, int c);
+int io61_readc_slow(io61_file* f);
+int io61_writec_slow(io61_file* f, int c);
+
+inline int io61_readc(io61_file* f) {
+    io61_fast* w = reinterpret_cast<io61_fast*>(f);
+    if (w->rpos != w->rend) {
+        return *w->rpos++;
+    }
+    return io61_readc_slow(f);
+}
+
+inline int io61_writec(io61_file* f, int c) {
+    io61_fast* w = reinterpret_cast<io61_fast*>(f);
+    if (w->wpos != w->wend) {
+        *w->wpos++ = c;
+        return 0;
+    }
+    return io61_writec_slow(f, c);
+}
 
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz);
 
+// Positioned I/O: like `io61_read` and `io61_write` at file offset `off`,
+// but leave the file position alone. Both go through the cache, so
+// random block access hits whatever it already holds. Returns -1 (ESPIPE)
+// on unseekable files.
+ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz,
+                   off_t off);
+ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
+                    off_t off);
+
+// Zero-copy reads: `io61_peek` points `*ptr` at the bytes available at the
+// file position and returns how many there are (0 at end of file, -1 on
+// error); `*ptr` is valid until the next call on `f`. `io61_consume`
+// advances past `n <= io61_peek(...)` of those bytes.
+ssize_t io61_peek(io61_file* f, const unsigned char** ptr);
+void io61_consume(io61_file* f, size_t n);
+
+// Read one line, through its newline, but at most `sz` bytes. Returns the
+// number of bytes read: 0 at end of file, -1 on error before any.
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz);
+
+// Vectored I/O: like `io61_read` and `io61_write` on the concatenation
+// of the `iovcnt` buffers in `iov`, in order.
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt);
+
+// Copy up to `sz` bytes (SIZE_MAX for all) from `inf` to `outf`, inside
+// the kernel when both descriptors allow it. Returns the number of bytes
+// copied, or -1 on an error before any were.
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t sz);
+
+// Fan-out: copy up to `sz` bytes (SIZE_MAX for all) from `inf` to each of
+// the `n` files in `outfs`. Large chunks go to every output straight from
+// `inf`'s buffer, without being copied into the outputs' own; when `inf`
+// and every output are pipes, the bytes move inside the kernel (tee() to
+// all outputs but the last, splice() to the last). Returns the number of
+// bytes every output received, or -1 on an error before any were. After
+// an error, the outputs may have received different numbers of bytes.
+ssize_t io61_tee(io61_file* inf, io61_file* const* outfs, size_t n, size_t sz);
+
 int io61_flush(io61_file* f);
 
+// Nonblocking use: on an O_NONBLOCK descriptor, a call that would block
+// returns what it transferred so far, or -1 with errno EAGAIN, and keeps
+// buffered state for the next call. `io61_wants_read` is true if the next
+// read needs the descriptor (poll for POLLIN); `io61_wants_write` is true
+// while written data is still buffered (poll for POLLOUT, then flush).
+bool io61_wants_read(io61_file* f);
+bool io61_wants_write(io61_file* f);
+
+// Page-cache advice: `io61_advise(f, off, len, advice)` passes the
+// POSIX_FADV_* hint `advice` for `[off, off + len)` (len 0: to the end)
+// to the kernel, and to madvise() for mapped files. POSIX_FADV_NOREUSE
+// also has io61 drop the cache behind `f`'s position as it moves
+// forward, so a single pass over a big file leaves the rest of the cache
+// alone; `IO61_NOREUSE=1` does that for every seekable file. Without
+// advice, buffered files get WILLNEED ahead of forward streams, and
+// POSIX_FADV_RANDOM while misses follow no pattern.
+int io61_advise(io61_file* f, off_t off, off_t len, int advice);
+
+// Buffer size: `io61_set_buffer(f, size)` makes `f` cache blocks of
+// `size` bytes (rounded up to a power of two between 4 KiB and 256 KiB)
+// and stops io61 from growing them; 0 goes back to the automatic size.
+// Buffers are taken from a shared pool when first needed, and write-only
+// files return theirs on every flush, so idle files hold no buffer
+// memory. `IO61_BUFSIZE=SIZE` sets every file's size at open. Returns -1
+// (EINVAL) for shared files.
+int io61_set_buffer(io61_file* f, size_t size);
+
+// Allocator: io61 takes each io61_file (cache-line aligned) and each
+// cache buffer (aligned for direct I/O) from `alloc(align, size)`, and
+// returns them to `dealloc(ptr, size)`, so a program can place all of
+// its I/O memory -- in huge-page arenas, say. `io61_set_allocator(alloc,
+// dealloc)` installs them, and nullptrs the default (aligned_alloc).
+// Call it before opening files: it first releases the pool's free
+// buffers, then returns -1 (EBUSY) if io61 still holds memory from the
+// current allocator. `io61_allocate` and `io61_deallocate` allocate from
+// the installed allocator, for structures a program keeps next to its
+// files; `io61_allocate` returns nullptr (ENOMEM) on failure. Versions
+// that take their memory only from the system return -1 (ENOTSUP).
+int io61_set_allocator(void* (*alloc)(size_t align, size_t size),
+                       void (*dealloc)(void* ptr, size_t size));
+void* io61_allocate(size_t align, size_t size);
+void io61_deallocate(void* ptr, size_t size);
+
+// Checksums: after `io61_set_checksum(f, true)`, `io61_checksum(f)`
+// returns the CRC-32C of every byte read from or written to `f` since,
+// in the order the calls transferred them, so a copy can be verified
+// without reading its output again. Kernel-side copies are off while a
+// checksum is on. Setting a checksum (on or off) restarts it; sharing
+// the file turns it off. Returns -1 (EINVAL) for shared files, and
+// (ENOTSUP) in versions that keep no checksum.
+int io61_set_checksum(io61_file* f, bool on);
+uint32_t io61_checksum(io61_file* f);
+
+// Flush policy: after `io61_set_flush(f, bytes, usec)`, written data is
+// flushed without an io61_flush call once `bytes` of it are buffered, or
+// once the oldest of it has waited `usec` microseconds; 0 turns a budget
+// off. Budgets are checked by write calls (io61_writec only when it
+// leaves its inline window). While `f` holds data under a latency
+// budget, a read by the same thread that would block on a pipe flushes
+// it first, so a pipeline's output never waits on its input. Setting
+// `IO61_FLUSH=BYTES,USEC` in the environment gives every unseekable
+// output that policy at open. Returns -1 (EINVAL) for shared files.
+int io61_set_flush(io61_file* f, size_t bytes, unsigned long usec);
+
+// Shared mode: once `io61_share(f)` returns 0, any number of threads may
+// call io61_readc, io61_writec, io61_read, io61_write, io61_readv,
+// io61_writev, io61_seek, and io61_flush on `f` at once. Each thread has
+// its own position, starting at `f`'s, and its own buffers, which reach
+// the file with pread/pwrite. If `f`'s descriptor is O_APPEND, each write
+// call lands whole at the end of the file instead. A thread sees other
+// threads' writes once they are flushed; io61_flush flushes the calling
+// thread's, and io61_close, called after every thread is done, the rest.
+// Returns -1 (ESPIPE) for unseekable files.
+int io61_share(io61_file* f);
+
+// Per-file counters. io61_close hands them to `io61_record_stats`, and the
+// profiler reports them with its timing results. Reads from a mapped
+// file make no system calls and count nothing.
+struct io61_stats {
+    unsigned long long syscalls = 0;       // I/O system calls issued
+    unsigned long long bytes_read = 0;     // bytes moved by those calls
+    unsigned long long bytes_written = 0;
+    unsigned long long hits = 0;           // accesses served by the cache
+    unsigned long long misses = 0;         // accesses that needed the file
+    unsigned long long seeks = 0;          // io61_seek calls
+    unsigned long long bypasses = 0;       // transfers that skipped the cache
+    unsigned long long flushes = 0;        // io61_flush calls
+};
+
 int fd_open_check(const char* filename, int mode);
 FILE* stdio_open_check(const char* filename, int mode);
 
@@ -56,6 +213,10 @@ struct io61_args {
     double delay = 0.0;                 // `-D`: delay
     size_t pipebuf_size = 0;            // `-B`: pipe buffer size
     bool nonblocking = false;           // `-n`: nonblocking
+    int direct = 0;                     // `-d`: O_DIRECT (or 0) for open
+    unsigned nthreads = 1;              // `-j`: threads
+    bool compress = false;              // `-z`: compress
+    bool checksum = false;              // `-K`: print output checksum
 
     explicit io61_args(const char* opts, size_t block_size = 0);
 
@@ -78,5 +239,18 @@ struct io61_args {
 
 ssize_t io61_read_bytes(io61_file* f, unsigned char* buf, size_t sz);
 ssize_t io61_write_bytes(io61_file* f, const unsigned char* buf, size_t sz);
+ssize_t io61_copy_buffered(io61_file* inf, io61_file* outf, size_t sz);
+ssize_t io61_tee_buffered(io61_file* inf, io61_file* const* outfs, size_t n,
+                          size_t sz);
+uint32_t crc32c(uint32_t crc, const void* data, size_t n);
+ssize_t io61_readline_bytes(io61_file* f, unsigned char* buf, size_t sz);
+void io61_record_stats(int fd, int mode, const io61_stats& st);
+
+struct io61_fd_share;
+io61_fd_share* io61_fd_share_start(int fd, off_t pos);
+void io61_fd_share_end(io61_fd_share* sh);
+void io61_fd_share_seek(io61_fd_share* sh, off_t pos);
+ssize_t io61_fd_share_read(io61_fd_share* sh, const struct iovec* iov, int iovcnt);
+ssize_t io61_fd_share_write(io61_fd_share* sh, const struct iovec* iov, int iovcnt);
 
 #endif
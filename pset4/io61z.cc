@@ -0,0 +1,276 @@
+#include "io61z.hh"
+#include <zlib.h>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+
+// io61z.cc
+//    The compressed stream layer. It uses only the public io61 interface,
+//    so it works over every version of io61.cc.
+
+static constexpr size_t DEFAULT_BLOCK = 131072;
+static constexpr size_t MAX_BLOCK = 1 << 30;
+static constexpr size_t INPUT_SIZE = 65536;   // compressed bytes per read
+
+// A member this layer writes starts with a gzip header with FEXTRA set,
+// XLEN 12, and one 8-byte subfield "I6": the member's total compressed
+// size and its uncompressed size, as little-endian 32-bit numbers. It
+// ends with the usual CRC-32 and size trailer.
+static constexpr size_t HEADER_SIZE = 24;
+static constexpr size_t TRAILER_SIZE = 8;
+
+// An entry of the block index
+struct io61_zmember {
+    off_t coff;                 // file offset of the member's header
+    off_t uoff;                 // uncompressed offset of its first byte
+};
+
+struct io61_zfile {
+    io61_file* f;
+    int mode;
+    z_stream zs;
+    size_t block;               // uncompressed bytes per written member
+    int error = 0;              // first write error, or corrupt input
+
+    // Writing: uncompressed bytes of the member being built, and room to
+    // compress it. Reading: compressed input, with `zs.next_in` in it.
+    std::vector<unsigned char> ubuf;
+    std::vector<unsigned char> cbuf;
+
+    // Reading
+    off_t pos = 0;              // uncompressed position
+    off_t cpos = 0;             // file offset after the bytes in `cbuf`
+    bool eof = false;           // no compressed input left
+    bool in_member = false;     // inflate is partway through a member
+
+    // Block index: members in file order, then the next header to visit,
+    // if every header so far carried an "I6" field
+    std::vector<io61_zmember> index;
+    io61_zmember index_next = {0, 0};
+    bool index_open = true;
+};
+
+static uint32_t get32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+static void put32(unsigned char* p, uint32_t x) {
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+io61_zfile* io61_zopen(io61_file* f, int mode, size_t block) {
+    io61_zfile* z = new io61_zfile;
+    z->f = f;
+    z->mode = mode;
+    z->block = std::min(block ? block : DEFAULT_BLOCK, MAX_BLOCK);
+    z->zs.zalloc = Z_NULL;
+    z->zs.zfree = Z_NULL;
+    z->zs.opaque = Z_NULL;
+    int r;
+    if (mode == O_RDONLY) {
+        // zlib parses gzip headers and trailers itself on reads
+        z->zs.next_in = Z_NULL;
+        z->zs.avail_in = 0;
+        r = inflateInit2(&z->zs, 16 + MAX_WBITS);
+        z->cbuf.resize(INPUT_SIZE);
+    } else {
+        // but writes use raw deflate, because the header needs sizes
+        r = deflateInit2(&z->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        z->ubuf.reserve(z->block);
+    }
+    if (r != Z_OK) {
+        delete z;
+        return nullptr;
+    }
+    return z;
+}
+
+// Compress and write the pending bytes as one member
+static int io61_zemit(io61_zfile* z) {
+    size_t n = z->ubuf.size();
+    if (n == 0) {
+        return 0;
+    }
+    deflateReset(&z->zs);
+    size_t bound = deflateBound(&z->zs, n);
+    z->cbuf.resize(HEADER_SIZE + bound + TRAILER_SIZE);
+    z->zs.next_in = z->ubuf.data();
+    z->zs.avail_in = n;
+    z->zs.next_out = z->cbuf.data() + HEADER_SIZE;
+    z->zs.avail_out = bound;
+    int r = deflate(&z->zs, Z_FINISH);
+    assert(r == Z_STREAM_END);
+    size_t total = HEADER_SIZE + (bound - z->zs.avail_out) + TRAILER_SIZE;
+
+    static const unsigned char header[16] = {
+        0x1f, 0x8b, Z_DEFLATED, 4 /* FEXTRA */, 0, 0, 0, 0, 0, 3 /* Unix */,
+        12, 0, 'I', '6', 8, 0
+    };
+    unsigned char* p = z->cbuf.data();
+    memcpy(p, header, sizeof(header));
+    put32(p + 16, total);
+    put32(p + 20, n);
+    put32(p + total - 8, crc32(0, z->ubuf.data(), n));
+    put32(p + total - 4, n);
+
+    z->ubuf.clear();
+    if (io61_write(z->f, p, total) != ssize_t(total)) {
+        z->error = errno ? errno : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t io61_zwrite(io61_zfile* z, const unsigned char* buf, size_t sz) {
+    assert(z->mode != O_RDONLY);
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        size_t n = std::min(sz - nwritten, z->block - z->ubuf.size());
+        z->ubuf.insert(z->ubuf.end(), buf + nwritten, buf + nwritten + n);
+        nwritten += n;
+        if (z->ubuf.size() == z->block && io61_zemit(z) < 0) {
+            return -1;
+        }
+    }
+    return nwritten;
+}
+
+int io61_zflush(io61_zfile* z) {
+    if (z->mode == O_RDONLY) {
+        return 0;
+    } else if (io61_zemit(z) < 0) {
+        return -1;
+    }
+    return io61_flush(z->f);
+}
+
+ssize_t io61_zread(io61_zfile* z, unsigned char* buf, size_t sz) {
+    assert(z->mode == O_RDONLY);
+    sz = std::min(sz, size_t(UINT_MAX));
+    z->zs.next_out = buf;
+    z->zs.avail_out = sz;
+    while (z->zs.avail_out != 0 && !z->eof && !z->error) {
+        if (z->zs.avail_in == 0) {
+            ssize_t nr = io61_read(z->f, z->cbuf.data(), z->cbuf.size());
+            if (nr < 0) {
+                break;
+            } else if (nr == 0) {
+                // A member cut short is corrupt
+                z->eof = true;
+                z->error = z->in_member ? EIO : 0;
+                break;
+            }
+            z->cpos += nr;
+            z->zs.next_in = z->cbuf.data();
+            z->zs.avail_in = nr;
+        }
+        int r = inflate(&z->zs, Z_NO_FLUSH);
+        if (r == Z_STREAM_END) {
+            // Concatenated members form one stream
+            inflateReset(&z->zs);
+            z->in_member = false;
+        } else if (r == Z_OK || r == Z_BUF_ERROR) {
+            z->in_member = true;
+        } else {
+            z->error = EIO;
+        }
+    }
+    size_t n = sz - z->zs.avail_out;
+    z->pos += n;
+    if (n == 0 && sz != 0 && z->error) {
+        errno = z->error;
+        return -1;
+    }
+    return n;
+}
+
+// Extend the block index until it covers offset `off`, or until a header
+// without an "I6" field (or the end of the file) stops it. This moves the
+// underlying file; returns true if it did.
+static bool io61_zindex(io61_zfile* z, off_t off) {
+    bool moved = false;
+    while (z->index_open && z->index_next.uoff <= off) {
+        unsigned char h[HEADER_SIZE];
+        z->index_open = io61_seek(z->f, z->index_next.coff) == 0;
+        moved = moved || z->index_open;
+        z->index_open = z->index_open
+            && io61_read(z->f, h, HEADER_SIZE) == ssize_t(HEADER_SIZE)
+            && h[0] == 0x1f && h[1] == 0x8b && h[2] == Z_DEFLATED
+            && (h[3] & 4) && h[10] == 12 && h[11] == 0
+            && h[12] == 'I' && h[13] == '6' && h[14] == 8 && h[15] == 0;
+        if (z->index_open) {
+            z->index.push_back(z->index_next);
+            z->index_next.coff += get32(h + 16);
+            z->index_next.uoff += get32(h + 20);
+        }
+    }
+    return moved;
+}
+
+int io61_zseek(io61_zfile* z, off_t off) {
+    if (z->mode != O_RDONLY || off < 0) {
+        errno = EINVAL;
+        return -1;
+    } else if (off == z->pos) {
+        return 0;
+    }
+    bool moved = io61_zindex(z, off);
+
+    // Find the last member starting at or before `off`; restart there
+    // unless the stream is already between it and `off`
+    io61_zmember m = {0, 0};
+    auto it = std::upper_bound(z->index.begin(), z->index.end(), off,
+                               [] (off_t o, const io61_zmember& x) {
+                                   return o < x.uoff;
+                               });
+    if (it != z->index.begin()) {
+        m = *--it;
+    }
+    if (m.uoff <= z->pos && z->pos <= off) {
+        if (moved && io61_seek(z->f, z->cpos) < 0) {
+            return -1;
+        }
+    } else {
+        if (io61_seek(z->f, m.coff) < 0) {
+            return -1;
+        }
+        inflateReset(&z->zs);
+        z->zs.avail_in = 0;
+        z->pos = m.uoff;
+        z->cpos = m.coff;
+        z->eof = z->in_member = false;
+        z->error = 0;
+    }
+
+    // Decompress the rest of the way
+    unsigned char discard[8192];
+    while (z->pos < off) {
+        ssize_t n = io61_zread(z, discard, std::min(off_t(sizeof(discard)),
+                                                    off - z->pos));
+        if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int io61_zclose(io61_zfile* z) {
+    int r = 0;
+    if (z->mode == O_RDONLY) {
+        inflateEnd(&z->zs);
+    } else {
+        r = io61_zemit(z);
+        deflateEnd(&z->zs);
+    }
+    if (io61_close(z->f) < 0 || z->error) {
+        r = -1;
+    }
+    delete z;
+    return r;
+}
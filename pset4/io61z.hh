@@ -0,0 +1,32 @@
+#ifndef IO61Z_HH
+#define IO61Z_HH
+#include "io61.hh"
+
+// io61z: a compressed stream layered on an io61_file, using zlib.
+// Writing produces gzip members of at most `block` uncompressed bytes
+// each, so `gzip -d` reads the result. Every member carries an extra
+// field ("I6") recording its compressed and uncompressed sizes; a reader
+// hops from header to header to build a block index, so io61_zseek
+// decompresses only from the start of the member holding the target.
+// Other gzip files read fine, but seek by decompressing from the last
+// member the index knows (or from the start).
+struct io61_zfile;
+
+// Wrap `f`, opened with `mode` (O_RDONLY or O_WRONLY). The io61_zfile owns
+// `f` from now on. `block` sets the member size for writing (0 means the
+// default). Returns nullptr if zlib can't be set up.
+io61_zfile* io61_zopen(io61_file* f, int mode, size_t block = 0);
+int io61_zclose(io61_zfile* z);
+
+// Like io61_read and io61_write, on the uncompressed data.
+ssize_t io61_zread(io61_zfile* z, unsigned char* buf, size_t sz);
+ssize_t io61_zwrite(io61_zfile* z, const unsigned char* buf, size_t sz);
+
+// Move a file being read to uncompressed offset `off`. Needs a seekable
+// underlying file unless the stream only moves forward.
+int io61_zseek(io61_zfile* z, off_t off);
+
+// End the member being written and flush the underlying file.
+int io61_zflush(io61_zfile* z);
+
+#endif
@@ -0,0 +1,61 @@
+#include "io61.hh"
+#include <thread>
+
+// Usage: ./parcat61 [-b BLOCKSIZE] [-j THREADS] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE in blocks, using THREADS threads
+//    that share both files in io61 shared mode. Thread k copies blocks
+//    k, k + THREADS, k + 2*THREADS, ..., seeking both files to each, so
+//    both must be seekable. Default BLOCKSIZE is 4096 and default
+//    THREADS is 4.
+
+static void copy_blocks(io61_file* inf, io61_file* outf, const io61_args& args,
+                        unsigned k) {
+    unsigned char* buf = new unsigned char[args.block_size];
+    for (size_t off = k * args.block_size; off < args.file_size;
+         off += args.nthreads * args.block_size) {
+        size_t n = std::min(args.block_size, args.file_size - off);
+        int r = io61_seek(inf, off);
+        assert(r == 0);
+        r = io61_seek(outf, off);
+        assert(r == 0);
+
+        ssize_t nr = io61_read(inf, buf, n);
+        assert(nr == ssize_t(n));
+        ssize_t nw = io61_write(outf, buf, n);
+        assert(nw == ssize_t(n));
+    }
+    delete[] buf;
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:j:o:", 4096);
+    args.nthreads = 4;
+    args.parse(argc, argv);
+
+    // Open files, measure file size, share both files
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    args.file_size = io61_filesize(inf);
+    if ((ssize_t) args.file_size < 0) {
+        fprintf(stderr, "parcat61: can't get size of input file\n");
+        exit(1);
+    }
+    if (io61_share(inf) < 0 || io61_share(outf) < 0) {
+        fprintf(stderr, "parcat61: files are not seekable\n");
+        exit(1);
+    }
+
+    // Copy
+    std::vector<std::thread> threads;
+    for (unsigned k = 0; k != args.nthreads; ++k) {
+        threads.emplace_back(copy_blocks, inf, outf, std::cref(args), k);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+}
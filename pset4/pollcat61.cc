@@ -0,0 +1,101 @@
+#include "io61.hh"
+#include <poll.h>
+#include <vector>
+
+// Usage: ./pollcat61 [-b BLOCKSIZE] [-i IFILE]... [-o OFILE]...
+//    Copies each IFILE to the corresponding OFILE, running every copy
+//    from a single `poll` loop on nonblocking descriptors. There must
+//    be as many IFILEs as OFILEs. Default BLOCKSIZE is 4096.
+
+struct stream {
+    io61_file* inf;
+    io61_file* outf;
+    std::vector<unsigned char> buf;
+    size_t len = 0;             // bytes in `buf`
+    size_t off = 0;             // bytes of `buf` already written
+    bool eof = false;
+    bool done = false;
+};
+
+static bool would_block() {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// Make as much progress on `s` as possible without blocking
+static void advance(stream& s) {
+    while (!s.done) {
+        if (s.off == s.len && !s.eof) {
+            ssize_t nr = io61_read(s.inf, s.buf.data(), s.buf.size());
+            if (nr < 0 && would_block()) {
+                // Push buffered output out while waiting for input
+                io61_flush(s.outf);
+                return;
+            }
+            assert(nr >= 0);
+            s.len = nr;
+            s.off = 0;
+            s.eof = nr == 0;
+        } else if (s.off != s.len) {
+            ssize_t nw = io61_write(s.outf, s.buf.data() + s.off,
+                                    s.len - s.off);
+            if (nw < 0 && would_block()) {
+                return;
+            }
+            assert(nw > 0);
+            s.off += nw;
+        } else {
+            if (io61_flush(s.outf) < 0 && would_block()) {
+                return;
+            }
+            io61_close(s.inf);
+            io61_close(s.outf);
+            s.done = true;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:i:o:##", 4096).parse(argc, argv);
+    if (args.input_files.size() != args.output_files.size()) {
+        args.usage();
+    }
+
+    // Open files in nonblocking mode
+    args.nonblocking = true;
+    std::vector<stream> streams(args.input_files.size());
+    for (size_t i = 0; i != streams.size(); ++i) {
+        streams[i].inf = io61_open_check(args.input_files[i], O_RDONLY);
+        streams[i].outf = io61_open_check(args.output_files[i],
+                                          O_WRONLY | O_CREAT | O_TRUNC);
+        args.after_open(streams[i].inf, O_RDONLY);
+        args.after_open(streams[i].outf, O_WRONLY);
+        streams[i].buf.resize(args.block_size);
+    }
+
+    // Advance every stream, then wait for the descriptors they need
+    while (true) {
+        std::vector<pollfd> pfds;
+        bool active = false;
+        for (auto& s : streams) {
+            advance(s);
+            if (s.done) {
+                continue;
+            }
+            active = true;
+            if (s.off == s.len && !s.eof && io61_wants_read(s.inf)) {
+                pfds.push_back({io61_fileno(s.inf), POLLIN, 0});
+            }
+            if (s.off != s.len || io61_wants_write(s.outf)) {
+                pfds.push_back({io61_fileno(s.outf), POLLOUT, 0});
+            }
+        }
+        if (!active) {
+            break;
+        } else if (pfds.empty()) {
+            continue;
+        }
+        int r = poll(pfds.data(), pfds.size(), -1);
+        assert(r > 0 || errno == EINTR);
+    }
+}
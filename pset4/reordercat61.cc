@@ -59,18 +59,12 @@ int main(int argc, char* argv[]) {
         --nblocks;
 
         // Transfer that block
-        int r = io61_seek(inf, pos);
-        assert(r == 0);
-
-        ssize_t nr = io61_read(inf, buf, args.block_size);
+        ssize_t nr = io61_pread(inf, buf, args.block_size, pos);
         if (nr <= 0) {
             break;
         }
 
-        r = io61_seek(outf, pos);
-        assert(r == 0);
-
-        ssize_t nw = io61_write(outf, buf, nr);
+        ssize_t nw = io61_pwrite(outf, buf, nr, pos);
         assert(nw == nr);
 
         args.after_write(outf);
@@ -10,29 +10,13 @@
 //    input files and "scattered" to many output files.
 //    Default BLOCKSIZE is 1.
 
-ssize_t read_line(io61_file* f, unsigned char* buf, size_t sz) {
-    size_t i = 0;
-    while (i != sz) {
-        int ch = io61_readc(f);
-        if (ch == EOF) {
-            break;
-        }
-        buf[i] = ch;
-        ++i;
-        if (ch == '\n') {
-            break;
-        }
-    }
-    return i;
-}
-
-
 int main(int argc, char* argv[]) {
     // Parse arguments
     io61_args args = io61_args("b:i:o:l##", 1).parse(argc, argv);
 
-    // Allocate buffer, open files
-    unsigned char* buf = new unsigned char[args.block_size];
+    // Allocate a buffer for one block per input, open files
+    size_t nin = std::max(args.input_files.size(), size_t(1));
+    unsigned char* buf = new unsigned char[nin * args.block_size];
 
     std::vector<io61_file*> infs, outfs;
     for (auto filename : args.input_files) {
@@ -44,24 +28,41 @@ int main(int argc, char* argv[]) {
         outfs.push_back(f);
     }
 
-    // Copy file data
-    size_t ini = -1, outi = 0;
+    // Copy file data a round at a time: gather one block from each
+    // input, then scatter each output's blocks with one vectored write
+    size_t outi = 0;
+    std::vector<std::vector<iovec>> outiov(outfs.size());
     while (!infs.empty()) {
-        ini = (ini + 1) % infs.size();
-        ssize_t nr;
-        if (args.read_lines) {
-            nr = read_line(infs[ini], buf, args.block_size);
-        } else {
-            nr = io61_read(infs[ini], buf, args.block_size);
+        unsigned char* p = buf;
+        for (size_t ini = 0; ini != infs.size(); ) {
+            ssize_t nr;
+            if (args.read_lines) {
+                nr = io61_readline(infs[ini], p, args.block_size);
+            } else {
+                nr = io61_read(infs[ini], p, args.block_size);
+            }
+            if (nr <= 0) {
+                io61_close(infs[ini]);
+                infs.erase(infs.begin() + ini);
+            } else {
+                outiov[outi].push_back({p, size_t(nr)});
+                p += nr;
+                outi = (outi + 1) % outfs.size();
+                ++ini;
+            }
         }
-        if (nr <= 0) {
-            io61_close(infs[ini]);
-            infs.erase(infs.begin() + ini);
-            --ini;
-        } else {
-            ssize_t nw = io61_write(outfs[outi], buf, nr);
-            assert(nw == nr);
-            outi = (outi + 1) % outfs.size();
+
+        for (size_t i = 0; i != outfs.size(); ++i) {
+            size_t sz = 0;
+            for (auto& iov : outiov[i]) {
+                sz += iov.iov_len;
+            }
+            if (sz != 0) {
+                ssize_t nw = io61_writev(outfs[i], outiov[i].data(),
+                                         outiov[i].size());
+                assert(nw == ssize_t(sz));
+            }
+            outiov[i].clear();
         }
     }
 
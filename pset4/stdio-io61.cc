@@ -1,6 +1,7 @@
 #include "io61.hh"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdio_ext.h>
 #include <climits>
 #include <cerrno>
 
@@ -11,8 +12,10 @@
 // io61_file
 //    Data structure for io61 file wrappers.
 
-struct io61_file {
+struct io61_file : io61_fast {
     FILE* f;
+    unsigned char peekc;  // byte returned by `io61_peek`
+    io61_fd_share* share = nullptr;  // shared-mode state, if shared
 };
 
 
@@ -34,21 +37,64 @@ io61_file* io61_fdopen(int fd, int mode) {
 
 int io61_close(io61_file* f) {
     io61_flush(f);
+    if (f->share) {
+        io61_fd_share_end(f->share);
+    }
     int r = fclose(f->f);
     delete f;
     return r;
 }
 
 
-// io61_readc(f)
+// io61_readc_slow(f)
 //    Reads a single (unsigned) byte from `f` and returns it. Returns EOF,
-//    which equals -1, on end of file or error.
-
-int io61_readc(io61_file* f) {
+//    which equals -1, on end of file or error. This version opens no
+//    read window, so the inline `io61_readc` calls it for every byte.
+
+int io61_readc_slow(io61_file* f) {
+    if (f->share) {
+        unsigned char ch;
+        struct iovec iov = {&ch, 1};
+        return io61_fd_share_read(f->share, &iov, 1) == 1 ? ch : -1;
+    }
     return fgetc(f->f);
 }
 
 
+// io61_clear_wouldblock(f)
+//    A nonblocking descriptor's EAGAIN sets the stream's error flag;
+//    clear it so the next call tries again, but keep `errno`.
+
+static void io61_clear_wouldblock(io61_file* f) {
+    if (ferror(f->f) && errno == EAGAIN) {
+        clearerr(f->f);
+        errno = EAGAIN;
+    }
+}
+
+
+// io61_block(f), io61_unblock(f, flags)
+//    stdio cannot resume a write that failed with EAGAIN partway through
+//    its buffer, so output on a nonblocking descriptor blocks: these
+//    clear O_NONBLOCK around a write and then restore it.
+
+static int io61_block(io61_file* f) {
+    int fl = fcntl(fileno(f->f), F_GETFL);
+    if (fl >= 0 && (fl & O_NONBLOCK)) {
+        fcntl(fileno(f->f), F_SETFL, fl & ~O_NONBLOCK);
+    }
+    return fl;
+}
+
+static void io61_unblock(io61_file* f, int fl) {
+    if (fl >= 0 && (fl & O_NONBLOCK)) {
+        int err = errno;
+        fcntl(fileno(f->f), F_SETFL, fl);
+        errno = err;
+    }
+}
+
+
 // io61_read(f, buf, sz)
 //    Reads up to `sz` bytes from `f` into `buf`. Returns the number of
 //    bytes read on success. Returns 0 if end-of-file is encountered before
@@ -60,20 +106,65 @@ int io61_readc(io61_file* f) {
 //    This is called a “short read.”
 
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
+    if (f->share) {
+        struct iovec iov = {buf, sz};
+        return io61_fd_share_read(f->share, &iov, 1);
+    }
     size_t n = fread(buf, 1, sz, f->f);
-    if (n != 0 || sz == 0 || !ferror(f->f)) {
-        return (ssize_t) n;
-    } else {
-        return (ssize_t) -1;
+    bool failed = n == 0 && sz != 0 && ferror(f->f);
+    io61_clear_wouldblock(f);
+    return failed ? (ssize_t) -1 : (ssize_t) n;
+}
+
+
+// io61_peek(f, ptr)
+//    Sets `*ptr` to point at the next byte of `f` and returns 1, or
+//    returns 0 at end of file and -1 on error. This version looks just
+//    one byte ahead, using `ungetc`.
+
+ssize_t io61_peek(io61_file* f, const unsigned char** ptr) {
+    int ch = fgetc(f->f);
+    if (ch == EOF) {
+        return ferror(f->f) ? -1 : 0;
     }
+    ungetc(ch, f->f);
+    f->peekc = ch;
+    *ptr = &f->peekc;
+    return 1;
 }
 
 
-// io61_writec(f)
-//    Write a single character `c` to `f` (converted to unsigned char).
-//    Returns 0 on success and -1 on error.
+// io61_consume(f, n)
+//    Advances past `n` bytes returned by `io61_peek`.
+
+void io61_consume(io61_file* f, size_t n) {
+    assert(n <= 1);
+    if (n != 0) {
+        fgetc(f->f);
+    }
+}
+
 
-int io61_writec(io61_file* f, int c) {
+// io61_readline(f, buf, sz)
+//    Reads a line of at most `sz` bytes into `buf`. This version reads a
+//    byte at a time.
+
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz) {
+    return io61_readline_bytes(f, buf, sz);
+}
+
+
+// io61_writec_slow(f)
+//    Write a single character `c` to `f` (converted to unsigned char).
+//    Returns 0 on success and -1 on error. This version opens no write
+//    window, so the inline `io61_writec` calls it for every byte.
+
+int io61_writec_slow(io61_file* f, int c) {
+    if (f->share) {
+        unsigned char ch = c;
+        struct iovec iov = {&ch, 1};
+        return io61_fd_share_write(f->share, &iov, 1) == 1 ? 0 : -1;
+    }
     int r = fputc(c, f->f);
     if (r == EOF) {
         return -1;
@@ -91,7 +182,13 @@ int io61_writec(io61_file* f, int c) {
 //    before the error occurred.
 
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
+    if (f->share) {
+        struct iovec iov = {const_cast<unsigned char*>(buf), sz};
+        return io61_fd_share_write(f->share, &iov, 1);
+    }
+    int fl = io61_block(f);
     size_t n = fwrite(buf, 1, sz, f->f);
+    io61_unblock(f, fl);
     if (n != 0 || sz == 0 || !ferror(f->f)) {
         return (ssize_t) n;
     } else {
@@ -100,6 +197,76 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 }
 
 
+// io61_readv(f, iov, iovcnt)
+//    Reads into the `iovcnt` buffers in `iov`, in order, as if they were
+//    one buffer passed to `io61_read`.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nread = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t nr = io61_read(f, (unsigned char*) iov[i].iov_base,
+                               iov[i].iov_len);
+        if (nr < 0 && nread == 0) {
+            return -1;
+        } else if (nr > 0) {
+            nread += nr;
+        }
+        if (nr != ssize_t(iov[i].iov_len)) {
+            break;
+        }
+    }
+    return nread;
+}
+
+
+// io61_writev(f, iov, iovcnt)
+//    Writes the `iovcnt` buffers in `iov`, in order, as if they were one
+//    buffer passed to `io61_write`.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    if (f->share) {
+        return io61_fd_share_write(f->share, iov, iovcnt);
+    }
+    size_t nwritten = 0, sz = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        sz += iov[i].iov_len;
+    }
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t nw = io61_write(f, (const unsigned char*) iov[i].iov_base,
+                                iov[i].iov_len);
+        if (nw > 0) {
+            nwritten += nw;
+        }
+        if (nw != ssize_t(iov[i].iov_len)) {
+            break;
+        }
+    }
+    if (nwritten != 0 || sz == 0) {
+        return nwritten;
+    } else {
+        return -1;
+    }
+}
+
+
+// io61_copy(inf, outf, sz)
+//    Copies up to `sz` bytes from `inf` to `outf`. This version copies
+//    through a user-space buffer.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t sz) {
+    return io61_copy_buffered(inf, outf, sz);
+}
+
+
+// io61_tee(inf, outfs, n, sz)
+//    Copies up to `sz` bytes from `inf` to each of the `n` files in
+//    `outfs`. This version copies through a user-space buffer.
+
+ssize_t io61_tee(io61_file* inf, io61_file* const* outfs, size_t n, size_t sz) {
+    return io61_tee_buffered(inf, outfs, n, sz);
+}
+
+
 // io61_flush(f)
 //    If `f` was opened write-only, `io61_flush(f)` forces a write of any
 //    cached data written to `f`. Returns 0 on success; returns -1 if an error
@@ -109,7 +276,24 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 //    drop any data cached for reading.
 
 int io61_flush(io61_file* f) {
-    return fflush(f->f);
+    int fl = io61_block(f);
+    int r = fflush(f->f);
+    io61_unblock(f, fl);
+    return r;
+}
+
+
+// io61_wants_read(f), io61_wants_write(f)
+//    Return true if the next read on `f` needs its descriptor, and if `f`
+//    holds written data that has not reached its descriptor.
+
+bool io61_wants_read(io61_file* f) {
+    (void) f;
+    return true;
+}
+
+bool io61_wants_write(io61_file* f) {
+    return __fpending(f->f) != 0;
 }
 
 
@@ -118,10 +302,146 @@ int io61_flush(io61_file* f) {
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t off) {
+    if (f->share && off < 0) {
+        errno = EINVAL;
+        return -1;
+    } else if (f->share) {
+        io61_fd_share_seek(f->share, off);
+        return 0;
+    }
     return fseek(f->f, off, SEEK_SET);
 }
 
 
+// io61_pread(f, buf, sz, off), io61_pwrite(f, buf, sz, off)
+//    Read or write at offset `off` without changing the file position.
+//    This version seeks there and back around the transfer.
+
+ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz,
+                   off_t off) {
+    if (f->share) {
+        return pread(fileno(f->f), buf, sz, off);
+    }
+    off_t pos = ftello(f->f);
+    if (pos < 0 || off < 0 || fseeko(f->f, off, SEEK_SET) != 0) {
+        return -1;
+    }
+    size_t nr = fread(buf, 1, sz, f->f);
+    bool error = nr == 0 && ferror(f->f);
+    if (fseeko(f->f, pos, SEEK_SET) != 0 || error) {
+        return -1;
+    }
+    return nr;
+}
+
+ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
+                    off_t off) {
+    if (f->share) {
+        return pwrite(fileno(f->f), buf, sz, off);
+    }
+    off_t pos = ftello(f->f);
+    if (pos < 0 || off < 0 || fseeko(f->f, off, SEEK_SET) != 0) {
+        return -1;
+    }
+    size_t nw = fwrite(buf, 1, sz, f->f);
+    if (fseeko(f->f, pos, SEEK_SET) != 0 || (nw == 0 && sz != 0)) {
+        return -1;
+    }
+    return nw;
+}
+
+
+// io61_share(f)
+//    Puts `f` in shared mode, where each thread has its own position.
+//    This version bypasses stdio there, making one system call per
+//    read/write.
+
+int io61_share(io61_file* f) {
+    off_t pos = ftello(f->f);
+    if (pos < 0 || fflush(f->f) != 0) {
+        return -1;
+    }
+    f->share = io61_fd_share_start(fileno(f->f), pos);
+    return f->share ? 0 : -1;
+}
+
+
+// io61_advise(f, off, len, advice)
+//    Passes page-cache advice for `f` to the kernel. This version adds
+//    no hints of its own.
+
+int io61_advise(io61_file* f, off_t off, off_t len, int advice) {
+    int r = posix_fadvise(fileno(f->f), off, len, advice);
+    if (r != 0) {
+        errno = r;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_set_buffer(f, size)
+//    Sets the size of `f`'s buffers. This version ignores it: stdio
+//    allows setvbuf() only before the first transfer.
+
+int io61_set_buffer(io61_file* f, size_t size) {
+    (void) f, (void) size;
+    return 0;
+}
+
+
+// io61_set_checksum(f, on), io61_checksum(f)
+//    Control and return `f`'s streaming checksum. This version keeps
+//    none.
+
+int io61_set_checksum(io61_file* f, bool on) {
+    (void) f, (void) on;
+    errno = ENOTSUP;
+    return -1;
+}
+
+uint32_t io61_checksum(io61_file* f) {
+    (void) f;
+    return 0;
+}
+
+
+// io61_set_allocator(alloc, dealloc), io61_allocate(align, size),
+// io61_deallocate(ptr, size)
+//    Install and use io61's allocator. This version takes its memory
+//    from the system allocator only.
+
+int io61_set_allocator(void* (*alloc)(size_t align, size_t size),
+                       void (*dealloc)(void* ptr, size_t size)) {
+    (void) alloc, (void) dealloc;
+    errno = ENOTSUP;
+    return -1;
+}
+
+void* io61_allocate(size_t align, size_t size) {
+    void* ptr = aligned_alloc(align, (size + align - 1) & ~(align - 1));
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void io61_deallocate(void* ptr, size_t size) {
+    (void) size;
+    free(ptr);
+}
+
+
+// io61_set_flush(f, bytes, usec)
+//    Sets `f`'s flush policy. This version ignores it: stdio flushes
+//    when its buffer fills.
+
+int io61_set_flush(io61_file* f, size_t bytes, unsigned long usec) {
+    (void) f, (void) bytes, (void) usec;
+    return 0;
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -133,7 +453,8 @@ int io61_seek(io61_file* f, off_t off) {
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
     if (filename) {
-        fd = open(filename, mode, 0666);
+        // This version does not do direct I/O
+        fd = open(filename, mode & ~O_DIRECT, 0666);
     } else if ((mode & O_ACCMODE) == O_RDONLY) {
         fd = STDIN_FILENO;
     } else {
@@ -11,9 +11,12 @@
 // io61_file
 //    Data structure for io61 file wrappers.
 
-struct io61_file {
+struct io61_file : io61_fast {
     int fd = -1;     // file descriptor
     int mode;        // open mode (O_RDONLY or O_WRONLY)
+    unsigned char peekc;  // byte read by `io61_peek`
+    bool peeked = false;  // whether `peekc` is unconsumed
+    io61_fd_share* share = nullptr;  // shared-mode state, if shared
 };
 
 
@@ -36,17 +39,30 @@ io61_file* io61_fdopen(int fd, int mode) {
 
 int io61_close(io61_file* f) {
     io61_flush(f);
+    if (f->share) {
+        io61_fd_share_end(f->share);
+    }
     int r = close(f->fd);
     delete f;
     return r;
 }
 
 
-// io61_readc(f)
+// io61_readc_slow(f)
 //    Reads a single (unsigned) byte from `f` and returns it. Returns EOF,
-//    which equals -1, on end of file or error.
-
-int io61_readc(io61_file* f) {
+//    which equals -1, on end of file or error. This version opens no
+//    read window, so the inline `io61_readc` calls it for every byte.
+
+int io61_readc_slow(io61_file* f) {
+    if (f->share) {
+        unsigned char ch;
+        struct iovec iov = {&ch, 1};
+        return io61_fd_share_read(f->share, &iov, 1) == 1 ? ch : -1;
+    }
+    if (f->peeked) {
+        f->peeked = false;
+        return f->peekc;
+    }
     unsigned char ch;
     ssize_t nr = read(f->fd, &ch, 1);
     if (nr == 1) {
@@ -72,16 +88,69 @@ int io61_readc(io61_file* f) {
 //    This is called a “short read.”
 
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
+    if (f->share) {
+        struct iovec iov = {buf, sz};
+        return io61_fd_share_read(f->share, &iov, 1);
+    }
+    if (f->peeked && sz != 0) {
+        buf[0] = f->peekc;
+        f->peeked = false;
+        ssize_t nr = read(f->fd, buf + 1, sz - 1);
+        return nr > 0 ? nr + 1 : 1;
+    }
     return read(f->fd, buf, sz);
 }
 
 
-// io61_writec(f)
+// io61_peek(f, ptr)
+//    Sets `*ptr` to point at the next byte of `f` and returns 1, or
+//    returns 0 at end of file and -1 on error. This version reads just
+//    one byte ahead.
+
+ssize_t io61_peek(io61_file* f, const unsigned char** ptr) {
+    if (!f->peeked) {
+        ssize_t nr = read(f->fd, &f->peekc, 1);
+        if (nr <= 0) {
+            return nr;
+        }
+        f->peeked = true;
+    }
+    *ptr = &f->peekc;
+    return 1;
+}
+
+
+// io61_consume(f, n)
+//    Advances past `n` bytes returned by `io61_peek`.
+
+void io61_consume(io61_file* f, size_t n) {
+    assert(n <= size_t(f->peeked));
+    if (n != 0) {
+        f->peeked = false;
+    }
+}
+
+
+// io61_readline(f, buf, sz)
+//    Reads a line of at most `sz` bytes into `buf`. This version reads a
+//    byte at a time.
+
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz) {
+    return io61_readline_bytes(f, buf, sz);
+}
+
+
+// io61_writec_slow(f)
 //    Write a single character `c` to `f` (converted to unsigned char).
-//    Returns 0 on success and -1 on error.
+//    Returns 0 on success and -1 on error. This version opens no write
+//    window, so the inline `io61_writec` calls it for every byte.
 
-int io61_writec(io61_file* f, int c) {
+int io61_writec_slow(io61_file* f, int c) {
     unsigned char ch = c;
+    if (f->share) {
+        struct iovec iov = {&ch, 1};
+        return io61_fd_share_write(f->share, &iov, 1) == 1 ? 0 : -1;
+    }
     ssize_t nw = write(f->fd, &ch, 1);
     if (nw == 1) {
         return 0;
@@ -99,10 +168,73 @@ int io61_writec(io61_file* f, int c) {
 //    before the error occurred.
 
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
+    if (f->share) {
+        struct iovec iov = {const_cast<unsigned char*>(buf), sz};
+        return io61_fd_share_write(f->share, &iov, 1);
+    }
     return write(f->fd, buf, sz);
 }
 
 
+// io61_readv(f, iov, iovcnt)
+//    Reads into the `iovcnt` buffers in `iov`, in order, with one
+//    `readv` system call. Like `io61_read`, this can return a short read.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    if (f->share) {
+        return io61_fd_share_read(f->share, iov, iovcnt);
+    }
+    if (!f->peeked) {
+        return readv(f->fd, iov, iovcnt);
+    }
+    // Deliver the peeked byte into the first nonempty buffer
+    int i = 0;
+    while (i != iovcnt && iov[i].iov_len == 0) {
+        ++i;
+    }
+    if (i == iovcnt) {
+        return 0;
+    }
+    std::vector<struct iovec> rest(iov + i, iov + iovcnt);
+    *(unsigned char*) rest[0].iov_base = f->peekc;
+    f->peeked = false;
+    rest[0].iov_base = (unsigned char*) rest[0].iov_base + 1;
+    --rest[0].iov_len;
+    ssize_t nr = readv(f->fd, rest.data(), rest.size());
+    return nr > 0 ? nr + 1 : 1;
+}
+
+
+// io61_writev(f, iov, iovcnt)
+//    Writes the `iovcnt` buffers in `iov`, in order, with one `writev`
+//    system call.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    if (f->share) {
+        return io61_fd_share_write(f->share, iov, iovcnt);
+    }
+    return writev(f->fd, iov, iovcnt);
+}
+
+
+// io61_copy(inf, outf, sz)
+//    Copies up to `sz` bytes from `inf` to `outf`. This version copies
+//    through a user-space buffer.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t sz) {
+    return io61_copy_buffered(inf, outf, sz);
+}
+
+
+// io61_tee(inf, outfs, n, sz)
+//    Copies up to `sz` bytes from `inf` to each of the `n` files in
+//    `outfs`. This version copies through a user-space buffer.
+
+ssize_t io61_tee(io61_file* inf, io61_file* const* outfs, size_t n, size_t sz) {
+    return io61_tee_buffered(inf, outfs, n, sz);
+}
+
+
 // io61_flush(f)
 //    If `f` was opened write-only, `io61_flush(f)` forces a write of any
 //    cached data written to `f`. Returns 0 on success; returns -1 if an error
@@ -117,11 +249,32 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_wants_read(f), io61_wants_write(f)
+//    Return true if the next read on `f` needs its descriptor, and if `f`
+//    holds written data that has not reached its descriptor.
+
+bool io61_wants_read(io61_file* f) {
+    return !f->peeked;
+}
+
+bool io61_wants_write(io61_file* f) {
+    (void) f;
+    return false;
+}
+
+
 // io61_seek(f, off)
 //    Changes the file pointer for file `f` to `off` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t off) {
+    if (f->share && off < 0) {
+        errno = EINVAL;
+        return -1;
+    } else if (f->share) {
+        io61_fd_share_seek(f->share, off);
+        return 0;
+    }
     off_t r = lseek(f->fd, (off_t) off, SEEK_SET);
     // Ignore the returned offset unless it’s an error.
     if (r == -1) {
@@ -132,6 +285,112 @@ int io61_seek(io61_file* f, off_t off) {
 }
 
 
+// io61_pread(f, buf, sz, off), io61_pwrite(f, buf, sz, off)
+//    Read or write at offset `off` without changing the file position.
+//    This version makes one pread/pwrite system call.
+
+ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz,
+                   off_t off) {
+    return pread(f->fd, buf, sz, off);
+}
+
+ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
+                    off_t off) {
+    return pwrite(f->fd, buf, sz, off);
+}
+
+
+// io61_share(f)
+//    Puts `f` in shared mode, where each thread has its own position.
+//    This version makes one system call per read/write there too.
+
+int io61_share(io61_file* f) {
+    off_t pos = lseek(f->fd, 0, SEEK_CUR);
+    if (pos >= 0 && f->peeked) {
+        --pos;
+        f->peeked = false;
+    }
+    f->share = pos < 0 ? nullptr : io61_fd_share_start(f->fd, pos);
+    return f->share ? 0 : -1;
+}
+
+
+// io61_advise(f, off, len, advice)
+//    Passes page-cache advice for `f` to the kernel. This version adds
+//    no hints of its own.
+
+int io61_advise(io61_file* f, off_t off, off_t len, int advice) {
+    int r = posix_fadvise(f->fd, off, len, advice);
+    if (r != 0) {
+        errno = r;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_set_buffer(f, size)
+//    Sets the size of `f`'s buffers. This version buffers nothing, so
+//    there is no size to set.
+
+int io61_set_buffer(io61_file* f, size_t size) {
+    (void) f, (void) size;
+    return 0;
+}
+
+
+// io61_set_checksum(f, on), io61_checksum(f)
+//    Control and return `f`'s streaming checksum. This version keeps
+//    none.
+
+int io61_set_checksum(io61_file* f, bool on) {
+    (void) f, (void) on;
+    errno = ENOTSUP;
+    return -1;
+}
+
+uint32_t io61_checksum(io61_file* f) {
+    (void) f;
+    return 0;
+}
+
+
+// io61_set_allocator(alloc, dealloc), io61_allocate(align, size),
+// io61_deallocate(ptr, size)
+//    Install and use io61's allocator. This version takes its memory
+//    from the system allocator only.
+
+int io61_set_allocator(void* (*alloc)(size_t align, size_t size),
+                       void (*dealloc)(void* ptr, size_t size)) {
+    (void) alloc, (void) dealloc;
+    errno = ENOTSUP;
+    return -1;
+}
+
+void* io61_allocate(size_t align, size_t size) {
+    void* ptr = aligned_alloc(align, (size + align - 1) & ~(align - 1));
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void io61_deallocate(void* ptr, size_t size) {
+    (void) size;
+    free(ptr);
+}
+
+
+// io61_set_flush(f, bytes, usec)
+//    Sets `f`'s flush policy. This version buffers nothing, so every
+//    policy holds already.
+
+int io61_set_flush(io61_file* f, size_t bytes, unsigned long usec) {
+    (void) f, (void) bytes, (void) usec;
+    return 0;
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -143,7 +402,8 @@ int io61_seek(io61_file* f, off_t off) {
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
     if (filename) {
-        fd = open(filename, mode, 0666);
+        // This version does not do direct I/O
+        fd = open(filename, mode & ~O_DIRECT, 0666);
     } else if ((mode & O_ACCMODE) == O_RDONLY) {
         fd = STDIN_FILENO;
     } else {
@@ -0,0 +1,30 @@
+#include "io61.hh"
+#include <vector>
+
+// Usage: ./tee61 [-s SIZE] [-o OUTFILE]... [FILE]
+//    Copies the input FILE to every OUTFILE (standard output if none)
+//    with one `io61_tee` call.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("s:o:i:##").parse(argc, argv);
+    if (args.input_files.size() > 1) {
+        args.usage();
+        exit(1);
+    }
+
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    std::vector<io61_file*> outfs;
+    for (auto filename : args.output_files) {
+        outfs.push_back(io61_open_check(filename, O_WRONLY | O_CREAT | O_TRUNC));
+    }
+    args.after_open();
+
+    ssize_t n = io61_tee(inf, outfs.data(), outfs.size(), args.file_size);
+    assert(n >= 0);
+
+    io61_close(inf);
+    for (auto f : outfs) {
+        io61_close(f);
+    }
+}
@@ -0,0 +1,964 @@
+#include "io61.hh"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <climits>
+#include <cerrno>
+
+// uring-io61.cc
+//    This version of io61.cc does its I/O through io_uring. Reads and
+//    writes go through NBUF registered buffers; writes are queued and
+//    submitted in batches without waiting for them, and sequential reads
+//    keep the next blocks in flight. If io_uring is unavailable (for
+//    instance, under a seccomp policy that blocks it), the same code
+//    performs each request synchronously.
+
+
+static constexpr size_t BUFSZ = 32768;      // bytes per buffer
+static constexpr unsigned NBUF = 16;        // registered buffers
+static constexpr unsigned RING_ENTRIES = 32;
+static constexpr unsigned PREFETCH = 4;     // blocks read ahead
+static constexpr unsigned SUBMIT_BATCH = 4; // queued requests per enter
+
+enum iobuf_state { B_FREE, B_READING, B_CLEAN, B_DIRTY, B_WRITING };
+
+// One buffer. Reads on seekable files use BUFSZ-aligned tags; writes
+// and pipes use whatever position the data started at.
+struct iobuf {
+    iobuf_state state = B_FREE;
+    off_t tag = 0;              // file offset of the buffer's first byte
+    size_t size = 0;            // valid (or dirty) bytes
+    int result = 0;             // negative errno of a failed read
+    unsigned long lru = 0;      // last use, for picking a victim
+};
+
+// Submission and completion rings, mapped from the kernel
+struct uring {
+    int fd = -1;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    void* sq_ptr = MAP_FAILED;
+    size_t sq_len = 0;
+    void* cq_ptr = MAP_FAILED;
+    size_t cq_len = 0;
+    size_t sqes_len = 0;
+    unsigned queued = 0;        // SQEs not yet passed to the kernel
+};
+
+
+// io61_file
+//    Data structure for io61 file wrappers.
+
+struct io61_file : io61_fast {
+    int fd = -1;                // file descriptor
+    int mode;                   // open mode (O_RDONLY or O_WRONLY)
+    bool seekable;              // whether `fd` supports lseek()
+    off_t pos;                  // logical file position
+    off_t stream_pos;           // pipes: offset of next read or write
+    bool stream_eof = false;    // pipes: a read returned 0
+
+    uring ring;
+    bool fixed = false;         // buffers are registered with `ring`
+    unsigned char* mem;         // NBUF * BUFSZ bytes of buffer space
+    iobuf bufs[NBUF];
+    int cur = -1;               // buffer of the most recent access
+    int wbuf = -1;              // buffer collecting writes, or -1
+    off_t last_miss = -1;       // block of the last read miss
+    unsigned long clock = 0;
+    unsigned inflight = 0;      // requests the kernel holds
+    int error = 0;              // first asynchronous write error
+    io61_fd_share* share = nullptr;  // shared-mode state, if shared
+};
+
+
+static int uring_setup(uring* r) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_len = r->cq_len = std::max(r->sq_len, r->cq_len);
+    }
+    r->sq_ptr = mmap(nullptr, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(nullptr, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            return -1;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, r->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        r->sqes_len = 0;
+        return -1;
+    }
+    auto sq = reinterpret_cast<unsigned char*>(r->sq_ptr);
+    auto cq = reinterpret_cast<unsigned char*>(r->cq_ptr);
+    r->sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    r->sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    r->sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    r->sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    r->sqes = reinterpret_cast<io_uring_sqe*>(sqes);
+    r->cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    r->cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    r->cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    r->cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(uring* r) {
+    if (r->sqes_len) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    if (r->sq_ptr != MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_len);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    r->fd = -1;
+}
+
+
+static void buf_complete(io61_file* f, int i, int res);
+
+// Pass queued requests to the kernel and reap completions, waiting for
+// at least `min_complete` of them
+static void uring_enter(io61_file* f, unsigned min_complete) {
+    uring* r = &f->ring;
+    if (r->fd < 0) {
+        return;
+    }
+    if (r->queued || min_complete) {
+        int n = syscall(__NR_io_uring_enter, r->fd, r->queued, min_complete,
+                        min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (n >= 0) {
+            r->queued -= std::min(unsigned(n), r->queued);
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // The ring is unusable, and its requests cannot be recovered
+            perror("io_uring_enter");
+            abort();
+        }
+    }
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        ++head;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        --f->inflight;
+        buf_complete(f, cqe->user_data, cqe->res);
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+// Start reading or writing buffer `i`. Without a ring, the request
+// completes before this returns.
+static void buf_submit(io61_file* f, int i) {
+    iobuf* b = &f->bufs[i];
+    bool reading = b->state == B_READING;
+    unsigned char* data = f->mem + i * BUFSZ;
+    size_t len = reading ? BUFSZ : b->size;
+    off_t off = f->seekable ? b->tag : -1;
+
+    if (f->ring.fd < 0) {
+        ssize_t n;
+        if (reading) {
+            n = off >= 0 ? pread(f->fd, data, len, off) : read(f->fd, data, len);
+        } else {
+            n = off >= 0 ? pwrite(f->fd, data, len, off) : write(f->fd, data, len);
+        }
+        buf_complete(f, i, n < 0 ? -errno : n);
+        return;
+    }
+
+    uring* r = &f->ring;
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    if (f->fixed) {
+        sqe->opcode = reading ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = i;
+    } else {
+        sqe->opcode = reading ? IORING_OP_READ : IORING_OP_WRITE;
+    }
+    sqe->fd = f->fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(data);
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = i;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->queued;
+    ++f->inflight;
+}
+
+static void buf_complete(io61_file* f, int i, int res) {
+    iobuf* b = &f->bufs[i];
+    if (b->state == B_READING) {
+        b->state = B_CLEAN;
+        b->result = std::min(res, 0);
+        b->size = std::max(res, 0);
+        b->lru = ++f->clock;
+        if (!f->seekable) {
+            f->stream_pos += b->size;
+            f->stream_eof = res == 0;
+        }
+        return;
+    }
+
+    assert(b->state == B_WRITING);
+    size_t done = std::max(res, 0);
+    // Finish short writes synchronously
+    while (res >= 0 && done < b->size) {
+        ssize_t n = f->seekable
+            ? pwrite(f->fd, f->mem + i * BUFSZ + done, b->size - done,
+                     b->tag + done)
+            : write(f->fd, f->mem + i * BUFSZ + done, b->size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        res = n <= 0 ? -(n < 0 ? errno : EIO) : res;
+        done += std::max(n, ssize_t(0));
+    }
+    if (res < 0 && !f->error) {
+        f->error = -res;
+    }
+    b->state = B_FREE;
+}
+
+static void buf_wait(io61_file* f, int i) {
+    while (f->bufs[i].state == B_READING || f->bufs[i].state == B_WRITING) {
+        uring_enter(f, 1);
+    }
+}
+
+// Return a buffer that can be reused, evicting the least recently used
+// clean one; if `wait`, wait for in-flight requests when none can be
+static int buf_alloc(io61_file* f, bool wait) {
+    while (true) {
+        int victim = -1;
+        for (unsigned i = 0; i != NBUF; ++i) {
+            iobuf* b = &f->bufs[i];
+            if (b->state == B_FREE) {
+                return i;
+            } else if (b->state == B_CLEAN && int(i) != f->cur
+                       && (victim < 0 || b->lru < f->bufs[victim].lru)) {
+                victim = i;
+            }
+        }
+        if (victim >= 0) {
+            f->bufs[victim].state = B_FREE;
+            return victim;
+        } else if (!wait || f->inflight == 0) {
+            return -1;
+        }
+        uring_enter(f, 1);
+    }
+}
+
+// Return the buffer that holds, or is reading, file offset `off`. On
+// pipes, a read covers only the bytes it returned.
+static int buf_find(io61_file* f, off_t off) {
+    for (unsigned i = 0; i != NBUF; ++i) {
+        iobuf* b = &f->bufs[i];
+        if (b->state != B_READING && b->state != B_CLEAN) {
+            continue;
+        }
+        off_t end = b->tag + off_t(BUFSZ);
+        if (!f->seekable) {
+            end = b->state == B_READING ? b->tag + 1 : b->tag + b->size;
+        }
+        if (off >= b->tag && off < end) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool reading_any(io61_file* f) {
+    for (unsigned i = 0; i != NBUF; ++i) {
+        if (f->bufs[i].state == B_READING) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Start reading the block at `tag` into a new buffer
+static int buf_start_read(io61_file* f, off_t tag, bool wait) {
+    int i = buf_alloc(f, wait);
+    if (i >= 0) {
+        f->bufs[i].state = B_READING;
+        f->bufs[i].tag = tag;
+        f->bufs[i].size = 0;
+        buf_submit(f, i);
+    }
+    return i;
+}
+
+// Make `f->cur` a clean buffer holding the byte at `f->pos`. Returns
+// the number of buffered bytes from `f->pos` on, 0 at end of file, or
+// -1 on error.
+static ssize_t io61_fill(io61_file* f) {
+    int i;
+    if (f->seekable) {
+        off_t tag = f->pos & ~off_t(BUFSZ - 1);
+        i = buf_find(f, f->pos);
+        if (i < 0) {
+            i = buf_start_read(f, tag, true);
+            if (i < 0) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        // Sequential misses keep the next blocks in flight; `f->cur` keeps
+        // buffer `i` from being evicted for them
+        f->cur = i;
+        if (f->last_miss >= 0 && tag == f->last_miss + off_t(BUFSZ)) {
+            for (unsigned k = 1; k <= PREFETCH; ++k) {
+                off_t ptag = tag + k * BUFSZ;
+                if (buf_find(f, ptag) < 0 && buf_start_read(f, ptag, false) < 0) {
+                    break;
+                }
+            }
+        }
+        f->last_miss = tag;
+        buf_wait(f, i);
+    } else {
+        // Pipes have at most one read in flight, which starts where the
+        // data so far ends
+        i = buf_find(f, f->pos);
+        if (i < 0 && f->stream_eof) {
+            return 0;
+        } else if (i < 0) {
+            assert(f->pos == f->stream_pos && !reading_any(f));
+            i = buf_start_read(f, f->stream_pos, true);
+            if (i < 0) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        buf_wait(f, i);
+        if (f->bufs[i].result == 0 && f->bufs[i].size == 0) {
+            f->bufs[i].state = B_FREE;
+            return 0;
+        }
+        // Read ahead while the caller consumes the last buffer
+        iobuf* b = &f->bufs[i];
+        if (b->result == 0 && b->tag + off_t(b->size) == f->stream_pos
+            && !f->stream_eof && !reading_any(f)) {
+            f->cur = i;
+            buf_start_read(f, f->stream_pos, false);
+        }
+    }
+    uring_enter(f, 0);
+
+    iobuf* b = &f->bufs[i];
+    if (b->result < 0) {
+        errno = -b->result;
+        b->state = B_FREE;
+        return -1;
+    }
+    f->cur = i;
+    b->lru = ++f->clock;
+    off_t off = f->pos - b->tag;
+    return off < off_t(b->size) ? b->size - off : 0;
+}
+
+// Queue the write buffer's contents
+static void wbuf_submit(io61_file* f) {
+    int i = f->wbuf;
+    if (i < 0) {
+        return;
+    }
+    f->wbuf = -1;
+    iobuf* b = &f->bufs[i];
+    if (b->size == 0) {
+        b->state = B_FREE;
+        return;
+    }
+    // Writes to pipes happen in order, one at a time; on files, wait for
+    // any earlier write to the same bytes
+    for (unsigned j = 0; j != NBUF; ++j) {
+        iobuf* w = &f->bufs[j];
+        if (w->state == B_WRITING
+            && (!f->seekable
+                || (w->tag < b->tag + off_t(b->size)
+                    && b->tag < w->tag + off_t(w->size)))) {
+            buf_wait(f, j);
+        }
+    }
+    if (!f->seekable) {
+        b->tag = f->stream_pos;
+        f->stream_pos += b->size;
+    }
+    b->state = B_WRITING;
+    buf_submit(f, i);
+    if (f->ring.queued >= SUBMIT_BATCH || !f->seekable) {
+        uring_enter(f, 0);
+    }
+}
+
+
+// io61_fdopen(fd, mode)
+//    Returns a new io61_file for file descriptor `fd`. `mode` is either
+//    O_RDONLY for a read-only file or O_WRONLY for a write-only file.
+//    You need not support read/write files.
+
+io61_file* io61_fdopen(int fd, int mode) {
+    assert(fd >= 0);
+    io61_file* f = new io61_file;
+    f->fd = fd;
+    f->mode = mode;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    f->seekable = off >= 0;
+    f->pos = f->stream_pos = std::max(off, off_t(0));
+    f->mem = reinterpret_cast<unsigned char*>(aligned_alloc(4096, NBUF * BUFSZ));
+    assert(f->mem);
+    if (uring_setup(&f->ring) == 0) {
+        iovec iov[NBUF];
+        for (unsigned i = 0; i != NBUF; ++i) {
+            iov[i] = {f->mem + i * BUFSZ, BUFSZ};
+        }
+        f->fixed = syscall(__NR_io_uring_register, f->ring.fd,
+                           IORING_REGISTER_BUFFERS, iov, NBUF) == 0;
+    } else {
+        uring_teardown(&f->ring);
+    }
+    return f;
+}
+
+
+// io61_close(f)
+//    Closes the io61_file `f` and releases all its resources.
+
+int io61_close(io61_file* f) {
+    io61_flush(f);
+    while (f->inflight) {
+        uring_enter(f, 1);
+    }
+    uring_teardown(&f->ring);
+    if (f->share) {
+        io61_fd_share_end(f->share);
+    }
+    int r = close(f->fd);
+    free(f->mem);
+    delete f;
+    return r;
+}
+
+
+// io61_readc_slow(f)
+//    Reads a single (unsigned) byte from `f` and returns it. Returns EOF,
+//    which equals -1, on end of file or error. This version opens no
+//    read window, so the inline `io61_readc` calls it for every byte.
+
+int io61_readc_slow(io61_file* f) {
+    if (f->share) {
+        unsigned char ch;
+        struct iovec iov = {&ch, 1};
+        return io61_fd_share_read(f->share, &iov, 1) == 1 ? ch : -1;
+    }
+    if (f->cur >= 0) {
+        iobuf* b = &f->bufs[f->cur];
+        off_t off = f->pos - b->tag;
+        if (b->state == B_CLEAN && off >= 0 && off < off_t(b->size)) {
+            ++f->pos;
+            return f->mem[f->cur * BUFSZ + off];
+        }
+    }
+    if (io61_fill(f) <= 0) {
+        return -1;
+    }
+    return f->mem[f->cur * BUFSZ + (f->pos++ - f->bufs[f->cur].tag)];
+}
+
+
+// io61_read(f, buf, sz)
+//    Reads up to `sz` bytes from `f` into `buf`. Returns the number of
+//    bytes read on success. Returns 0 if end-of-file is encountered before
+//    any bytes are read, and -1 if an error is encountered before any
+//    bytes are read.
+//
+//    Note that the return value might be positive, but less than `sz`,
+//    if end-of-file or error is encountered before all `sz` bytes are read.
+//    This is called a “short read.”
+
+ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
+    if (f->share) {
+        struct iovec iov = {buf, sz};
+        return io61_fd_share_read(f->share, &iov, 1);
+    }
+    size_t nread = 0;
+    while (nread != sz) {
+        ssize_t n = io61_fill(f);
+        if (n <= 0) {
+            if (n < 0 && nread == 0) {
+                return -1;
+            }
+            break;
+        }
+        iobuf* b = &f->bufs[f->cur];
+        n = std::min(size_t(n), sz - nread);
+        memcpy(buf + nread, f->mem + f->cur * BUFSZ + (f->pos - b->tag), n);
+        f->pos += n;
+        nread += n;
+    }
+    return nread;
+}
+
+
+// io61_peek(f, ptr)
+//    Sets `*ptr` to the bytes buffered at the file position and returns
+//    how many there are; returns 0 at end of file and -1 on error.
+
+ssize_t io61_peek(io61_file* f, const unsigned char** ptr) {
+    ssize_t n = io61_fill(f);
+    if (n > 0) {
+        *ptr = f->mem + f->cur * BUFSZ + (f->pos - f->bufs[f->cur].tag);
+    }
+    return n;
+}
+
+
+// io61_consume(f, n)
+//    Advances past `n` bytes returned by `io61_peek`.
+
+void io61_consume(io61_file* f, size_t n) {
+    f->pos += n;
+}
+
+
+// io61_readline(f, buf, sz)
+//    Reads a line of at most `sz` bytes into `buf`, scanning each peeked
+//    buffer with `memchr`.
+
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz) {
+    size_t nread = 0;
+    while (nread != sz) {
+        const unsigned char* data;
+        ssize_t n = io61_peek(f, &data);
+        if (n <= 0) {
+            if (n < 0 && nread == 0) {
+                return -1;
+            }
+            break;
+        }
+        size_t m = std::min(size_t(n), sz - nread);
+        auto nl = (const unsigned char*) memchr(data, '\n', m);
+        if (nl) {
+            m = nl + 1 - data;
+        }
+        memcpy(buf + nread, data, m);
+        io61_consume(f, m);
+        nread += m;
+        if (nl) {
+            break;
+        }
+    }
+    return nread;
+}
+
+
+// io61_writec_slow(f)
+//    Write a single character `c` to `f` (converted to unsigned char).
+//    Returns 0 on success and -1 on error. This version opens no write
+//    window, so the inline `io61_writec` calls it for every byte.
+
+int io61_writec_slow(io61_file* f, int c) {
+    if (f->share) {
+        unsigned char ch = c;
+        struct iovec iov = {&ch, 1};
+        return io61_fd_share_write(f->share, &iov, 1) == 1 ? 0 : -1;
+    }
+    if (f->wbuf >= 0) {
+        iobuf* b = &f->bufs[f->wbuf];
+        if (f->pos == b->tag + off_t(b->size) && b->size != BUFSZ) {
+            f->mem[f->wbuf * BUFSZ + b->size] = c;
+            ++b->size;
+            ++f->pos;
+            return 0;
+        }
+    }
+    unsigned char ch = c;
+    return io61_write(f, &ch, 1) == 1 ? 0 : -1;
+}
+
+
+// io61_write(f, buf, sz)
+//    Writes `sz` characters from `buf` to `f`. Returns `sz` on success.
+//    Can write fewer than `sz` characters when there is an error, such as
+//    a drive running out of space. In this case io61_write returns the
+//    number of characters written, or -1 if no characters were written
+//    before the error occurred.
+
+ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
+    if (f->share) {
+        struct iovec iov = {const_cast<unsigned char*>(buf), sz};
+        return io61_fd_share_write(f->share, &iov, 1);
+    }
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        iobuf* b = f->wbuf >= 0 ? &f->bufs[f->wbuf] : nullptr;
+        if (!b || f->pos != b->tag + off_t(b->size) || b->size == BUFSZ) {
+            wbuf_submit(f);
+            int i = buf_alloc(f, true);
+            if (i < 0) {
+                errno = ENOMEM;
+                break;
+            }
+            b = &f->bufs[i];
+            b->state = B_DIRTY;
+            b->tag = f->pos;
+            b->size = 0;
+            f->wbuf = i;
+        }
+        size_t n = std::min(sz - nwritten, BUFSZ - b->size);
+        memcpy(f->mem + f->wbuf * BUFSZ + b->size, buf + nwritten, n);
+        b->size += n;
+        f->pos += n;
+        nwritten += n;
+    }
+    if (f->error && nwritten == 0 && sz != 0) {
+        errno = f->error;
+        return -1;
+    }
+    return nwritten != 0 || sz == 0 ? nwritten : -1;
+}
+
+
+// io61_readv(f, iov, iovcnt)
+//    Reads into the `iovcnt` buffers in `iov`, in order, as if they were
+//    one buffer passed to `io61_read`.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nread = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t nr = io61_read(f, (unsigned char*) iov[i].iov_base,
+                               iov[i].iov_len);
+        if (nr < 0 && nread == 0) {
+            return -1;
+        } else if (nr > 0) {
+            nread += nr;
+        }
+        if (nr != ssize_t(iov[i].iov_len)) {
+            break;
+        }
+    }
+    return nread;
+}
+
+
+// io61_writev(f, iov, iovcnt)
+//    Writes the `iovcnt` buffers in `iov`, in order, as if they were one
+//    buffer passed to `io61_write`.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    if (f->share) {
+        return io61_fd_share_write(f->share, iov, iovcnt);
+    }
+    size_t nwritten = 0, sz = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        sz += iov[i].iov_len;
+    }
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t nw = io61_write(f, (const unsigned char*) iov[i].iov_base,
+                                iov[i].iov_len);
+        if (nw > 0) {
+            nwritten += nw;
+        }
+        if (nw != ssize_t(iov[i].iov_len)) {
+            break;
+        }
+    }
+    if (nwritten != 0 || sz == 0) {
+        return nwritten;
+    } else {
+        return -1;
+    }
+}
+
+
+// io61_copy(inf, outf, sz)
+//    Copies up to `sz` bytes from `inf` to `outf`. This version copies
+//    through a user-space buffer.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t sz) {
+    return io61_copy_buffered(inf, outf, sz);
+}
+
+
+// io61_tee(inf, outfs, n, sz)
+//    Copies up to `sz` bytes from `inf` to each of the `n` files in
+//    `outfs`. This version copies through a user-space buffer.
+
+ssize_t io61_tee(io61_file* inf, io61_file* const* outfs, size_t n, size_t sz) {
+    return io61_tee_buffered(inf, outfs, n, sz);
+}
+
+
+// io61_flush(f)
+//    If `f` was opened write-only, `io61_flush(f)` forces a write of any
+//    cached data written to `f`. Returns 0 on success; returns -1 if an error
+//    is encountered before all cached data was written.
+//
+//    If `f` was opened read-only, `io61_flush(f)` returns 0. It may also
+//    drop any data cached for reading.
+
+int io61_flush(io61_file* f) {
+    if (f->mode == O_RDONLY) {
+        return 0;
+    }
+    wbuf_submit(f);
+    for (unsigned i = 0; i != NBUF; ++i) {
+        buf_wait(f, i);
+    }
+    if (f->error) {
+        errno = f->error;
+        f->error = 0;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_wants_read(f), io61_wants_write(f)
+//    Return true if the next read on `f` needs its descriptor, and if `f`
+//    holds written data that has not reached its descriptor.
+
+bool io61_wants_read(io61_file* f) {
+    int i = buf_find(f, f->pos);
+    return i < 0 || f->bufs[i].state != B_CLEAN
+        || f->pos >= f->bufs[i].tag + off_t(f->bufs[i].size);
+}
+
+bool io61_wants_write(io61_file* f) {
+    for (unsigned i = 0; i != NBUF; ++i) {
+        if (f->bufs[i].state == B_DIRTY || f->bufs[i].state == B_WRITING) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// io61_seek(f, off)
+//    Changes the file pointer for file `f` to `off` bytes into the file.
+//    Returns 0 on success and -1 on failure.
+
+int io61_seek(io61_file* f, off_t off) {
+    if (!f->seekable) {
+        errno = ESPIPE;
+        return -1;
+    } else if (off < 0) {
+        errno = EINVAL;
+        return -1;
+    } else if (f->share) {
+        io61_fd_share_seek(f->share, off);
+        return 0;
+    }
+    f->pos = off;
+    return 0;
+}
+
+
+// io61_pread(f, buf, sz, off), io61_pwrite(f, buf, sz, off)
+//    Read or write at offset `off` without changing the file position,
+//    through the same buffers as `io61_read` and `io61_write`.
+
+ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz,
+                   off_t off) {
+    if (f->share) {
+        return pread(f->fd, buf, sz, off);
+    }
+    off_t pos = f->pos;
+    if (io61_seek(f, off) < 0) {
+        return -1;
+    }
+    ssize_t nr = io61_read(f, buf, sz);
+    f->pos = pos;
+    return nr;
+}
+
+ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
+                    off_t off) {
+    if (f->share) {
+        return pwrite(f->fd, buf, sz, off);
+    }
+    off_t pos = f->pos;
+    if (io61_seek(f, off) < 0) {
+        return -1;
+    }
+    ssize_t nw = io61_write(f, buf, sz);
+    f->pos = pos;
+    return nw;
+}
+
+
+// io61_share(f)
+//    Puts `f` in shared mode, where each thread has its own position.
+//    This version bypasses the ring there, making one system call per
+//    read/write.
+
+int io61_share(io61_file* f) {
+    if (!f->seekable) {
+        errno = ESPIPE;
+        return -1;
+    } else if (io61_flush(f) < 0) {
+        return -1;
+    }
+    f->share = io61_fd_share_start(f->fd, f->pos);
+    return f->share ? 0 : -1;
+}
+
+
+// io61_advise(f, off, len, advice)
+//    Passes page-cache advice for `f` to the kernel. This version adds
+//    no hints of its own.
+
+int io61_advise(io61_file* f, off_t off, off_t len, int advice) {
+    int r = posix_fadvise(f->fd, off, len, advice);
+    if (r != 0) {
+        errno = r;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_set_buffer(f, size)
+//    Sets the size of `f`'s buffers. This version ignores it; its
+//    registered buffers all have one fixed size.
+
+int io61_set_buffer(io61_file* f, size_t size) {
+    (void) f, (void) size;
+    return 0;
+}
+
+
+// io61_set_checksum(f, on), io61_checksum(f)
+//    Control and return `f`'s streaming checksum. This version keeps
+//    none.
+
+int io61_set_checksum(io61_file* f, bool on) {
+    (void) f, (void) on;
+    errno = ENOTSUP;
+    return -1;
+}
+
+uint32_t io61_checksum(io61_file* f) {
+    (void) f;
+    return 0;
+}
+
+
+// io61_set_allocator(alloc, dealloc), io61_allocate(align, size),
+// io61_deallocate(ptr, size)
+//    Install and use io61's allocator. This version takes its memory
+//    from the system allocator only.
+
+int io61_set_allocator(void* (*alloc)(size_t align, size_t size),
+                       void (*dealloc)(void* ptr, size_t size)) {
+    (void) alloc, (void) dealloc;
+    errno = ENOTSUP;
+    return -1;
+}
+
+void* io61_allocate(size_t align, size_t size) {
+    void* ptr = aligned_alloc(align, (size + align - 1) & ~(align - 1));
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void io61_deallocate(void* ptr, size_t size) {
+    (void) size;
+    free(ptr);
+}
+
+
+// io61_set_flush(f, bytes, usec)
+//    Sets `f`'s flush policy. This version ignores it, writing buffers
+//    when they fill.
+
+int io61_set_flush(io61_file* f, size_t bytes, unsigned long usec) {
+    (void) f, (void) bytes, (void) usec;
+    return 0;
+}
+
+
+// You shouldn't need to change these functions.
+
+// io61_open_check(filename, mode)
+//    Opens the file corresponding to `filename` and returns its io61_file.
+//    If `!filename`, returns either the standard input or the
+//    standard output, depending on `mode`. Exits with an error message if
+//    `filename != nullptr` and the named file cannot be opened.
+
+io61_file* io61_open_check(const char* filename, int mode) {
+    int fd;
+    if (filename) {
+        // This version does not do direct I/O
+        fd = open(filename, mode & ~O_DIRECT, 0666);
+    } else if ((mode & O_ACCMODE) == O_RDONLY) {
+        fd = STDIN_FILENO;
+    } else {
+        fd = STDOUT_FILENO;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    return io61_fdopen(fd, mode & O_ACCMODE);
+}
+
+
+// io61_fileno(f)
+//    Returns the file descriptor associated with `f`.
+
+int io61_fileno(io61_file* f) {
+    return f->fd;
+}
+
+
+// io61_filesize(f)
+//    Returns the size of `f` in bytes. Returns -1 if `f` does not have a
+//    well-defined size (for instance, if it is a pipe).
+
+off_t io61_filesize(io61_file* f) {
+    struct stat s;
+    int r = fstat(f->fd, &s);
+    if (r >= 0 && S_ISREG(s.st_mode)) {
+        return s.st_size;
+    } else {
+        return -1;
+    }
+}
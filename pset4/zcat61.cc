@@ -0,0 +1,55 @@
+#include "io61z.hh"
+
+// Usage: ./zcat61 [-z] [-b BLOCKSIZE] [-p POS] [-s SIZE] [-o OUTFILE] [FILE]
+//    Decompresses the gzip FILE, copying SIZE uncompressed bytes starting
+//    at POS to OUTFILE. With `-z`, compresses FILE instead, writing gzip
+//    members that each hold BLOCKSIZE uncompressed bytes (default 131072).
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("zb:p:s:o:", 131072).parse(argc, argv);
+
+    // Allocate buffer, open files
+    size_t bufsize = 65536;
+    unsigned char* buf = new unsigned char[bufsize];
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    if (args.compress) {
+        io61_zfile* zf = io61_zopen(outf, O_WRONLY, args.block_size);
+        assert(zf);
+        while (true) {
+            ssize_t nr = io61_read(inf, buf, bufsize);
+            if (nr <= 0) {
+                break;
+            }
+            ssize_t nw = io61_zwrite(zf, buf, nr);
+            assert(nw == nr);
+        }
+        io61_close(inf);
+        int r = io61_zclose(zf);
+        assert(r == 0);
+    } else {
+        io61_zfile* zf = io61_zopen(inf, O_RDONLY);
+        assert(zf);
+        if (args.initial_offset != 0) {
+            int r = io61_zseek(zf, args.initial_offset);
+            assert(r == 0);
+        }
+        size_t pos = 0;
+        while (pos < args.file_size) {
+            ssize_t nr = io61_zread(zf, buf, std::min(bufsize, args.file_size - pos));
+            assert(nr >= 0);
+            if (nr == 0) {
+                break;
+            }
+            ssize_t nw = io61_write(outf, buf, nr);
+            assert(nw == nr);
+            pos += nr;
+        }
+        io61_zclose(zf);
+        io61_close(outf);
+    }
+    delete[] buf;
+}
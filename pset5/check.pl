@@ -611,6 +611,153 @@ sub CMD_KILL ()           { "CMD_KILL" }
       '/' ],
 
 
+# hash
+    [ 'Test HASH1',
+      'empty command path cache',
+      'hash -r ; hash',
+      'hash: hash table empty' ],
+
+    [ 'Test HASH2',
+      'command path cache',
+      'cat /dev/null ; cat /dev/null ; hash | grep cat | wc -l',
+      '1' ],
+
+    [ 'Test HASH3',
+      'hash lookup failure',
+      'hash nosuchcommand61 2> /dev/null || echo not found',
+      'not found' ],
+
+
+# parallel, wait
+    [ 'Test PARALLEL1',
+      'wait for background job',
+      'echo a & wait ; echo b',
+      'a b' ],
+
+    [ 'Test PARALLEL2',
+      'background job limit',
+      'parallel -j 1 ; echo a & echo b & echo c & wait ; echo d',
+      'a b c d' ],
+
+    [ 'Test PARALLEL3',
+      'background job limit setting',
+      'parallel -j 4 ; parallel',
+      'parallel -j 4' ],
+
+    [ 'Test BUILTIN1',
+      'test builtin in conditionals',
+      '[ -d / ] && echo a ; test 3 -lt 2 || echo b ; [ x = y -o ! -z x ] && echo c',
+      'a b c' ],
+
+    [ 'Test BUILTIN2',
+      'printf builtin',
+      'printf \'%s=%03d\\n\' a 7 b 12',
+      'a=007 b=012' ],
+
+    [ 'Test BUILTIN3',
+      'builtins at pipeline ends',
+      'echo abc | tr b x ; seq 3 | false || echo d ; echo e | echo f',
+      'axc d f' ],
+
+    [ 'Test BUILTIN4',
+      'builtin writing to a closed pipe',
+      'printf \'%0200000d\' 0 | head -c 3 ; echo',
+      '000' ],
+
+    [ 'Test LONGLINE1',
+      'command line longer than BUFSIZ',
+      'echo ' . join(' ', 1..4000) . ' | wc -w',
+      '4000' ],
+
+    [ 'Test CATPIPE1',
+      'cat stages in pipelines',
+      'echo a > cat%%.txt ; cat cat%%.txt | cat | tr a b ; cat nosuch%%.txt 2> /dev/null | wc -l',
+      'b 0' ],
+
+    [ 'Test CATPIPE2',
+      'cat of a directory in a pipeline',
+      'cat . 2> /dev/null | wc -c 2> err%%.txt ; wc -c < err%%.txt',
+      '0 0' ],
+
+    [ 'Test GROUP1',
+      'subshell in pipeline',
+      '( echo a ; echo b ) | wc -l',
+      '2' ],
+
+    [ 'Test GROUP2',
+      'brace group with redirection',
+      '{ echo a ; echo b ; } > grp%%.txt ; cat grp%%.txt',
+      'a b' ],
+
+    [ 'Test GROUP3',
+      'subshell directory change',
+      'cd / ; ( cd /tmp ) ; pwd ; { cd /tmp ; } ; pwd',
+      '/ /tmp' ],
+
+    [ 'Test GROUP4',
+      'nested groups',
+      '( echo a | { cat ; echo b ; } ) | tr ab AB',
+      'A B' ],
+
+    [ 'Test GROUP5',
+      'group status',
+      '( false ) || { echo a ; true ; } && echo b',
+      'a b' ],
+
+    [ 'Test HEREDOC1',
+      'here-strings',
+      'tr a-z A-Z <<< hello ; cat <<< "two words" | wc -w',
+      'HELLO 2' ],
+
+    [ 'Test HEREDOC2',
+      'heredocs',
+      "cat <<EOF | tr a-z A-Z\nfirst\n  second\nEOF\necho after",
+      'FIRST SECOND after' ],
+
+    [ 'Test COPROC1',
+      'coprocess calls',
+      'coproc up sed -u s/a/A/ ; up banana ; printf \'x\\nbar\\n\' | up ; coproc up ; up x',
+      'bAnana x bAr up: command not found' ],
+
+    [ 'Test COPROC2',
+      'coprocess in a pipeline',
+      'coproc cc cat ; seq 1 5000 | cc | wc -l ; cc last ; coproc cc',
+      '5000 last' ],
+
+    [ 'Test COPROC3',
+      'coprocesses that filter or buffer output',
+      'coproc g grep a ; g bbb ; coproc t tr a b ; t aaa ; coproc s sed -u /a/d ; s aaa ; s bbb ; echo done ; coproc g ; coproc t ; coproc s',
+      'bbb done' ],
+
+    [ 'Test COPROC4',
+      'coprocess calls ended by a marker',
+      'coproc -e @@ m sh -c "while read x; do sleep 0.2; echo \\$x; done" ; m one ; echo between ; printf \'a\\nb\' | m ; coproc m',
+      'one between a b' ],
+
+    [ 'Test HEREDOC3',
+      'two heredocs on one line, one large',
+      "wc -c <<A ; cat <<B\n" . ('x' x 9999) . "\nA\nsmall\nB",
+      '10000 small' ],
+
+    [ 'Test TIME1',
+      'timed pipeline',
+      '../sh61 -q cmd%%.sh 2> /dev/null',
+      'b c',
+      CMD_FILE => [ "cmd%%.sh" => "time echo a | tr a b ; echo c" ] ],
+
+    [ 'Test TIME2',
+      'timing report',
+      '../sh61 -q cmd%%.sh 2> err%%.txt > /dev/null ; grep -c \'"stages":\\[{"command":"echo a", "utime"\' err%%.txt',
+      '1',
+      CMD_FILE => [ "cmd%%.sh" => "time echo a | tr a b ; echo c" ] ],
+
+    [ 'Test TIME3',
+      'profiling every pipeline',
+      'env SH61_PROFILE=1 ../sh61 -q cmd%%.sh 2> err%%.txt > /dev/null ; grep -c utime err%%.txt',
+      '2',
+      CMD_FILE => [ "cmd%%.sh" => "echo a | tr a b ; echo c" ] ],
+
+
 # Interrupts
     [ 'Test INTR1',
       'interrupt stopping conditional',
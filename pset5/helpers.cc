@@ -1,7 +1,7 @@
 #include "sh61.hh"
 #include <cctype>
 #include <cstring>
-#include <sstream>
+#include <algorithm>
 
 // isshellspecial(ch)
 //    Test if `ch` is a command that's special to the shell (that ends
@@ -53,10 +53,15 @@ void shell_tokenizer::next() {
         ++p;
     }
     if (p != _end && (*p == '<' || *p == '>')) {
-        // Redirection
+        // Redirection; `<<` and `<<<` take the text that follows as input
         ++p;
         if (p != _end && *p == '>') {
             ++p;
+        } else if (p != _end && p[-1] == '<' && *p == '<') {
+            ++p;
+            if (p != _end && *p == '<') {
+                ++p;
+            }
         } else {
             while (p != _end && isdigit((unsigned char) *p)) {
                 ++p;
@@ -115,10 +120,18 @@ void shell_tokenizer::next() {
 }
 
 std::string shell_tokenizer::str() const {
+    std::string s(_len, '\0');
+    s.resize(copy(s.data()));
+    return s;
+}
+
+size_t shell_tokenizer::copy(char* buf) const {
     if (!_quoted) {
-        return std::string(_s, _len);
+        memcpy(buf, _s, _len);
+        buf[_len] = '\0';
+        return _len;
     }
-    std::ostringstream build;
+    char* out = buf;
     int curquote = 0;
     for (unsigned pos = 0; pos != _len; ++pos) {
         if ((_s[pos] == '\"' || _s[pos] == '\'') && !curquote) {
@@ -128,13 +141,14 @@ std::string shell_tokenizer::str() const {
         } else if (_s[pos] == '\\'
                    && _s[pos+1] != '\0'
                    && curquote != '\'') {
-            build << _s[pos+1];
+            *out++ = _s[pos+1];
             ++pos;
         } else {
-            build << _s[pos];
+            *out++ = _s[pos];
         }
     }
-    return build.str();
+    *out = '\0';
+    return out - buf;
 }
 
 const char* shell_tokenizer::type_name() const {
@@ -203,9 +217,7 @@ void shell_parser::next_command() {
 
 shell_parser shell_parser::first_delimited(unsigned long fl) const {
     shell_tokenizer it(_s, _stop);
-    while (it.type() >= 0 && (fl & (1 << it.type())) == 0) {
-        it.next();
-    }
+    skip_delimited(it, fl);
     return shell_parser(_s, it._s, _stop);
 }
 
@@ -215,10 +227,71 @@ void shell_parser::next_delimited(unsigned long fl) {
         it.next();
     }
     _s = it._s;
-    while (it.type() >= 0 && (fl & (1 << it.type())) == 0) {
+    skip_delimited(it, fl);
+    _stop = it._s;
+}
+
+// Return 1 if token `it` opens a group, -1 if it closes one, and 0
+// otherwise. `{` and `}` are only special as unquoted words that start
+// a command (`start`).
+int shell_parser::group_delta(const shell_tokenizer& it, bool start) {
+    if (it._type == TYPE_LPAREN) {
+        return 1;
+    } else if (it._type == TYPE_RPAREN) {
+        return -1;
+    } else if (start && it._type == TYPE_NORMAL && !it._quoted
+               && it._len == 1 && (it._s[0] == '{' || it._s[0] == '}')) {
+        return it._s[0] == '{' ? 1 : -1;
+    }
+    return 0;
+}
+
+// Return true if a command starts after a token of type `type`
+static bool starts_command(int type, int delta) {
+    return (type >= TYPE_SEQUENCE && type != TYPE_RPAREN) || delta > 0;
+}
+
+// Advance `it` to the next token outside any group whose type is in `fl`
+void shell_parser::skip_delimited(shell_tokenizer& it, unsigned long fl) {
+    int depth = 0;
+    bool start = true;
+    while (it && it.type() >= 0
+           && (depth != 0 || (fl & (1 << it.type())) == 0)) {
+        int delta = group_delta(it, start);
+        depth = std::max(depth + delta, 0);
+        start = starts_command(it.type(), delta);
         it.next();
     }
-    _stop = it._s;
+}
+
+int shell_parser::group(shell_parser* body, shell_tokenizer* rest) const {
+    shell_tokenizer it(_s, _stop);
+    if (group_delta(it, true) <= 0) {
+        return 0;
+    }
+    int kind = it.type() == TYPE_LPAREN ? '(' : '{';
+    const char* first = it._s + it._len;
+    std::string opens;
+    bool start = true;
+    for (; it; it.next()) {
+        int delta = group_delta(it, start);
+        start = starts_command(it.type(), delta);
+        char ch = it.type() == TYPE_NORMAL ? it._s[0] : it.type() == TYPE_LPAREN ? '(' : ')';
+        if (delta > 0) {
+            opens += ch;
+        } else if (delta < 0) {
+            if (opens.empty() || (opens.back() == '(') != (ch == ')')) {
+                return -1;
+            }
+            opens.pop_back();
+            if (opens.empty()) {
+                *body = shell_parser(first, it._s);
+                *rest = shell_tokenizer(it._s + it._len, _stop);
+                return kind;
+            }
+        }
+    }
+    return -1;
 }
 
 
@@ -2,58 +2,1455 @@
 #include <cstring>
 #include <cerrno>
 #include <vector>
+#include <unordered_map>
+#include <string_view>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <climits>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <ctime>
 #include <fcntl.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
 
 #undef exit
 #define exit __DO_NOT_CALL_EXIT__READ_PROBLEM_SET_DESCRIPTION__
 
+// shell_arena
+//    Memory for parsed commands, carved out of large blocks. Everything
+//    allocated after a `mark()` is freed at once by `release()`, and the
+//    blocks stay around for the next command line.
+struct shell_arena {
+    struct mark_type {
+        size_t block;
+        size_t pos;
+    };
+
+    mark_type mark() const {
+        return {_cur, _pos};
+    }
+    void release(mark_type m) {
+        _cur = m.block;
+        _pos = m.pos;
+    }
+
+    void* allocate(size_t sz, size_t align = alignof(std::max_align_t));
+
+private:
+    static constexpr size_t block_size = 65536;
+    struct block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    std::vector<block> _blocks;
+    size_t _cur = 0;           // Block being allocated from
+    size_t _pos = 0;           // Offset of its free space
+};
+
+void* shell_arena::allocate(size_t sz, size_t align) {
+    while (true) {
+        if (_cur < _blocks.size()) {
+            size_t p = (_pos + align - 1) & ~(align - 1);
+            if (p + sz <= _blocks[_cur].size) {
+                _pos = p + sz;
+                return _blocks[_cur].data.get() + p;
+            } else if (_cur + 1 < _blocks.size()) {
+                ++_cur;
+                _pos = 0;
+                continue;
+            }
+        }
+        // `new char[]` memory is aligned for any type
+        size_t n = std::max(sz, block_size);
+        _blocks.push_back({std::unique_ptr<char[]>(new char[n]), n});
+        _cur = _blocks.size() - 1;
+        _pos = 0;
+    }
+}
+
+static shell_arena line_arena;
+
+// Return the length of the complete line at the start of the `n` bytes
+// at `s`, or 0 if more input is needed; the first `from` bytes are known
+// to hold no newline. At end of file, a last line may lack its newline.
+static size_t next_line(const char* s, size_t n, bool eof, size_t from = 0) {
+    if (auto nl = (const char*) memchr(s + from, '\n', n - from)) {
+        return nl + 1 - s;
+    }
+    return eof ? n : 0;
+}
+
+
+// A `<<` heredoc's text: the lines after its command line, up to one
+// holding just the delimiter word
+struct heredoc_body {
+    const char* op;             // the `<<` token
+    std::string text;
+};
+
+// Find the heredoc bodies that the command line [`s`, `line_end`) needs.
+// They follow it, in order, in the input up to `end`. Returns the end of
+// the last body, or nullptr if more input is needed; at end of file, an
+// unterminated body runs to the end. Appends the bodies to `*bodies` if
+// it is given.
+static const char* find_heredocs(const char* s, const char* line_end,
+                                 const char* end, bool eof,
+                                 std::vector<heredoc_body>* bodies) {
+    const char* p = line_end;
+    for (shell_tokenizer tok(s, line_end); tok; tok.next()) {
+        if (tok.type() != TYPE_REDIRECT_OP || tok.raw_size() != 2
+            || tok.raw_data()[0] != '<' || tok.raw_data()[1] != '<') {
+            continue;
+        }
+        const char* op = tok.raw_data();
+        tok.next();
+        if (!tok || tok.type() != TYPE_NORMAL) {
+            break;
+        }
+        std::string delim = tok.str();
+        const char* body = p;
+        const char* body_end = nullptr;
+        while (size_t len = next_line(p, end - p, eof)) {
+            size_t n = len - (p[len - 1] == '\n');
+            if (n == delim.size() && memcmp(p, delim.data(), n) == 0) {
+                body_end = p;
+            }
+            p += len;
+            if (body_end) {
+                break;
+            }
+        }
+        if (!body_end && !eof) {
+            return nullptr;
+        } else if (bodies) {
+            bodies->push_back({op, std::string(body, body_end ? body_end : p)});
+        }
+    }
+    return p;
+}
+
+
+// shell_program
+//    A command list compiled to flat bytecode, so running it needs no
+//    tokenizing. `code` is a sequence of 32-bit words:
+//
+//      OP_CONDITIONAL background end     one conditional; `end` is the
+//                                        offset just past its pipelines
+//      OP_PIPELINE prev_op end           one pipeline; `prev_op` is the
+//                                        operator before it (TYPE_SEQUENCE,
+//                                        TYPE_AND, or TYPE_OR)
+//      OP_COMMAND argc nredirect         one command, followed by `argc`
+//        arg... (op file)...             argument strings and `nredirect`
+//                                        redirections
+//      OP_GROUP subshell nredirect end   a `{ }` or, if `subshell`, `( )`
+//        (op file)... conditional...     group: its redirections, then the
+//                                        list inside, ending at `end`
+//      OP_ERROR message 0                a syntax error, reported when the
+//                                        pipeline runs
+//
+//    Strings are offsets into `strings`, stored null-terminated; a
+//    redirection missing its filename has file NO_STRING. `lines` holds
+//    the code offset where each input line starts, plus the end.
+enum : uint32_t {
+    OP_CONDITIONAL = 0xC0, OP_PIPELINE, OP_COMMAND, OP_GROUP, OP_ERROR
+};
+
+struct shell_program {
+    static constexpr uint32_t NO_STRING = UINT32_MAX;
+
+    std::vector<uint32_t> code;
+    std::vector<char> strings;
+    std::vector<uint32_t> lines = {0};
+
+    void clear() {
+        code.clear();
+        strings.clear();
+        lines.assign(1, 0);
+    }
+    char* str(uint32_t off) {
+        return strings.data() + off;
+    }
+
+    // Compile the input line [`first`, `last`) and append it. Any `<<`
+    // heredoc bodies it needs follow it, up to `end`.
+    void compile_line(const char* first, const char* last, const char* end);
+
+    // Check that the program is well formed and its offsets in bounds
+    bool valid() const;
+
+private:
+    uint32_t add_string(const char* s, size_t n);
+    uint32_t add_string(const shell_tokenizer& token);
+    void compile_list(shell_parser parser);
+    void compile_command(shell_parser cmd);
+    bool valid_list(size_t pc, size_t end, std::vector<uint32_t>* starts) const;
+    bool valid_stage(size_t& pc, size_t end) const;
+    bool valid_string(uint32_t off) const;
+    bool valid_redirects(const uint32_t* redirect, size_t nredirect) const;
+
+    std::vector<heredoc_body> heredocs;     // bodies for the current line
+};
+
+uint32_t shell_program::add_string(const char* s, size_t n) {
+    size_t off = strings.size();
+    strings.insert(strings.end(), s, s + n);
+    strings.push_back('\0');
+    return off;
+}
+
+uint32_t shell_program::add_string(const shell_tokenizer& token) {
+    size_t off = strings.size();
+    strings.resize(off + token.raw_size() + 1);
+    size_t n = token.copy(&strings[off]);
+    strings.resize(off + n + 1);
+    return off;
+}
+
+void shell_program::compile_line(const char* first, const char* last,
+                                 const char* end) {
+    heredocs.clear();
+    find_heredocs(first, last, end, true, &heredocs);
+    compile_list(shell_parser{first, last});
+    lines.push_back(code.size());
+}
+
+void shell_program::compile_list(shell_parser parser) {
+    for (auto cond = parser.first_conditional(); cond; cond.next_conditional()) {
+        size_t cpos = code.size();
+        code.insert(code.end(), {OP_CONDITIONAL,
+                                 cond.op() == TYPE_BACKGROUND, 0});
+        int prev_op = TYPE_SEQUENCE;
+        for (auto pipe = cond.first_pipeline(); pipe; pipe.next_pipeline()) {
+            size_t ppos = code.size();
+            code.insert(code.end(), {OP_PIPELINE, uint32_t(prev_op), 0});
+            for (auto cmd = pipe.first_command(); cmd; cmd.next_command()) {
+                compile_command(cmd);
+            }
+            code[ppos + 2] = code.size();
+            prev_op = pipe.op();
+        }
+        code[cpos + 2] = code.size();
+    }
+}
+
+void shell_program::compile_command(shell_parser cmd) {
+    // `args` and `redirects` are scratch space; a group's body is only
+    // compiled once they have been used
+    static std::vector<uint32_t> args, redirects;
+    args.clear();
+    redirects.clear();
+    shell_parser body("");
+    shell_tokenizer tok("");
+    int group = cmd.group(&body, &tok);
+    std::string error;
+    if (group < 0) {
+        error = "unterminated group";
+    } else if (group == 0) {
+        tok = cmd.first_token();
+    }
+
+    for (; tok && error.empty(); tok.next()) {
+        if (tok.type() == TYPE_NORMAL && group == 0) {
+            args.push_back(add_string(tok));
+        } else if (tok.type() == TYPE_REDIRECT_OP) {
+            // `<<` and `<<<` store their input text as the file
+            const char* op = tok.raw_data();
+            redirects.push_back(add_string(tok));
+            int here = strcmp(str(redirects.back()), "<<") == 0 ? 2
+                : strcmp(str(redirects.back()), "<<<") == 0 ? 3 : 0;
+            tok.next();
+            if (!tok || tok.type() != TYPE_NORMAL) {
+                redirects.push_back(NO_STRING);
+                break;
+            }
+            if (here == 2) {
+                auto it = std::find_if(heredocs.begin(), heredocs.end(),
+                                       [&] (const heredoc_body& h) {
+                                           return h.op == op;
+                                       });
+                std::string_view text;
+                if (it != heredocs.end()) {
+                    text = it->text;
+                }
+                redirects.push_back(add_string(text.data(), text.size()));
+            } else if (here == 3) {
+                std::string text = tok.str() + "\n";
+                redirects.push_back(add_string(text.data(), text.size()));
+            } else {
+                redirects.push_back(add_string(tok));
+            }
+        } else {
+            error = "unexpected `" + tok.str() + "'";
+        }
+    }
+
+    if (!error.empty()) {
+        code.insert(code.end(), {OP_ERROR,
+                                 add_string(error.data(), error.size()), 0});
+    } else if (group == 0) {
+        code.insert(code.end(), {OP_COMMAND, uint32_t(args.size()),
+                                 uint32_t(redirects.size() / 2)});
+        code.insert(code.end(), args.begin(), args.end());
+        code.insert(code.end(), redirects.begin(), redirects.end());
+    } else {
+        size_t gpos = code.size();
+        code.insert(code.end(), {OP_GROUP, group == '(',
+                                 uint32_t(redirects.size() / 2), 0});
+        code.insert(code.end(), redirects.begin(), redirects.end());
+        compile_list(body);
+        code[gpos + 3] = code.size();
+    }
+}
+
+bool shell_program::valid() const {
+    std::vector<uint32_t> starts;
+    if (!valid_list(0, code.size(), &starts)) {
+        return false;
+    }
+    starts.push_back(code.size());
+    return std::is_sorted(lines.begin(), lines.end())
+        && lines.front() == 0 && lines.back() == code.size()
+        && std::all_of(lines.begin(), lines.end(), [&] (uint32_t l) {
+               return std::binary_search(starts.begin(), starts.end(), l);
+           });
+}
+
+// Check the conditionals in [pc, end), collecting their offsets in
+// `*starts` if it's set
+bool shell_program::valid_list(size_t pc, size_t end,
+                               std::vector<uint32_t>* starts) const {
+    while (pc != end) {
+        size_t cend = end - pc >= 3 ? code[pc + 2] : 0;
+        if (cend < pc + 3 || cend > end
+            || code[pc] != OP_CONDITIONAL || code[pc + 1] > 1) {
+            return false;
+        }
+        if (starts) {
+            starts->push_back(pc);
+        }
+        for (pc += 3; pc != cend; ) {
+            size_t pend = cend - pc >= 3 ? code[pc + 2] : 0;
+            uint32_t prev_op = code[pc + 1];
+            if (pend < pc + 3 || pend > cend || code[pc] != OP_PIPELINE
+                || (prev_op != TYPE_SEQUENCE && prev_op != TYPE_AND
+                    && prev_op != TYPE_OR)) {
+                return false;
+            }
+            for (pc += 3; pc != pend; ) {
+                if (!valid_stage(pc, pend)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Check the pipeline stage at `pc`, which must end by `end`, and move
+// `pc` past it
+bool shell_program::valid_stage(size_t& pc, size_t end) const {
+    if (end - pc < 3) {
+        return false;
+    }
+    uint32_t op = code[pc];
+    if (op == OP_COMMAND) {
+        size_t argc = code[pc + 1], nredirect = code[pc + 2];
+        size_t len = 3 + argc + 2 * nredirect;
+        if (len > end - pc
+            || !std::all_of(&code[pc + 3], &code[pc + 3 + argc],
+                            [&] (uint32_t s) { return valid_string(s); })
+            || !valid_redirects(&code[pc + 3 + argc], nredirect)) {
+            return false;
+        }
+        pc += len;
+        return true;
+    } else if (op == OP_ERROR) {
+        if (!valid_string(code[pc + 1])) {
+            return false;
+        }
+        pc += 3;
+        return true;
+    } else if (op == OP_GROUP && end - pc >= 4 && code[pc + 1] <= 1) {
+        size_t body = pc + 4 + 2 * size_t(code[pc + 2]);
+        size_t gend = code[pc + 3];
+        if (body > gend || gend > end
+            || !valid_redirects(&code[pc + 4], code[pc + 2])
+            || !valid_list(body, gend, nullptr)) {
+            return false;
+        }
+        pc = gend;
+        return true;
+    }
+    return false;
+}
+
+bool shell_program::valid_string(uint32_t off) const {
+    return off < strings.size()
+        && memchr(&strings[off], 0, strings.size() - off);
+}
+
+// Check `nredirect` (op, file) string pairs at `redirect`
+bool shell_program::valid_redirects(const uint32_t* redirect,
+                                    size_t nredirect) const {
+    for (size_t i = 0; i != nredirect; ++i, redirect += 2) {
+        if (!valid_string(redirect[0])
+            || (redirect[1] != NO_STRING && !valid_string(redirect[1]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Compiled script cache
+//    Compiled scripts are saved under $SH61_CACHE (default
+//    $XDG_CACHE_HOME/sh61 or ~/.cache/sh61), named by a hash of the
+//    script's contents, so a later run of the same script skips
+//    parsing. An empty $SH61_CACHE turns the cache off.
+
+struct program_cache_header {
+    char magic[8];
+    uint64_t source_size;
+    uint64_t source_hash;
+    uint32_t ncode;
+    uint32_t nstrings;
+    uint32_t nlines;
+    uint32_t reserved;
+};
+
+static constexpr char program_cache_magic[8] = {'s', 'h', '6', '1', 'p', 'r', 'g', '3'};
+
+static uint64_t fnv1a_hash(const char* data, size_t n) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i != n; ++i) {
+        h = (h ^ (unsigned char) data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Return the cache file name for a script with hash `h`, creating the
+// cache directory if needed; empty if the cache is off
+static std::string program_cache_file(uint64_t h) {
+    std::string dir;
+    if (const char* env = getenv("SH61_CACHE")) {
+        dir = env;
+    } else if (const char* xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        dir = std::string(xdg) + "/sh61";
+    } else if (const char* home = getenv("HOME"); home && *home) {
+        dir = std::string(home) + "/.cache";
+        mkdir(dir.c_str(), 0777);
+        dir += "/sh61";
+    }
+    if (dir.empty()) {
+        return dir;
+    }
+    mkdir(dir.c_str(), 0777);
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.prg", (unsigned long long) h);
+    return dir + name;
+}
+
+static bool read_exact(int fd, void* buf, size_t n) {
+    char* p = static_cast<char*>(buf);
+    while (n != 0) {
+        ssize_t nr = read(fd, p, n);
+        if (nr <= 0 && !(nr < 0 && errno == EINTR)) {
+            return false;
+        } else if (nr > 0) {
+            p += nr;
+            n -= nr;
+        }
+    }
+    return true;
+}
+
+static bool program_cache_load(const std::string& fn, std::string_view src,
+                               uint64_t h, shell_program& prog) {
+    int fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    program_cache_header hdr;
+    bool ok = read_exact(fd, &hdr, sizeof(hdr))
+        && memcmp(hdr.magic, program_cache_magic, sizeof(hdr.magic)) == 0
+        && hdr.source_size == src.size()
+        && hdr.source_hash == h
+        && hdr.nlines != 0;
+    if (ok) {
+        prog.code.resize(hdr.ncode);
+        prog.strings.resize(hdr.nstrings);
+        prog.lines.resize(hdr.nlines);
+        ok = read_exact(fd, prog.code.data(), hdr.ncode * sizeof(uint32_t))
+            && read_exact(fd, prog.strings.data(), hdr.nstrings)
+            && read_exact(fd, prog.lines.data(), hdr.nlines * sizeof(uint32_t))
+            && prog.valid();
+    }
+    close(fd);
+    if (!ok) {
+        prog.clear();
+    }
+    return ok;
+}
+
+// Save `prog`. It's written to a temporary file and renamed into place,
+// so concurrent runs never see half a program.
+static void program_cache_save(const std::string& fn, std::string_view src,
+                               uint64_t h, const shell_program& prog) {
+    program_cache_header hdr = {};
+    memcpy(hdr.magic, program_cache_magic, sizeof(hdr.magic));
+    hdr.source_size = src.size();
+    hdr.source_hash = h;
+    hdr.ncode = prog.code.size();
+    hdr.nstrings = prog.strings.size();
+    hdr.nlines = prog.lines.size();
+    std::string out(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    out.append(reinterpret_cast<const char*>(prog.code.data()),
+               prog.code.size() * sizeof(uint32_t));
+    out.append(prog.strings.data(), prog.strings.size());
+    out.append(reinterpret_cast<const char*>(prog.lines.data()),
+               prog.lines.size() * sizeof(uint32_t));
+
+    std::string tmp = fn + "." + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        return;
+    }
+    size_t pos = 0;
+    ssize_t nw = 0;
+    while (pos != out.size()
+           && ((nw = write(fd, out.data() + pos, out.size() - pos)) > 0
+               || errno == EINTR)) {
+        pos += std::max(nw, ssize_t(0));
+    }
+    if (close(fd) < 0 || pos != out.size() || rename(tmp.c_str(), fn.c_str()) < 0) {
+        unlink(tmp.c_str());
+    }
+}
+
+
+// Command path cache, like bash's `hash`: maps command names to the
+// executables PATH resolved them to. It is emptied when PATH changes.
+struct path_entry {
+    std::string path;
+    unsigned hits = 0;
+};
+
+// Lets `path_cache` look names up without building a std::string
+struct path_hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const {
+        return std::hash<std::string_view>{}(s);
+    }
+};
+
+static std::unordered_map<std::string, path_entry, path_hash,
+                          std::equal_to<>> path_cache;
+static std::string path_cache_path;    // PATH the cache was built for
+
+// Search PATH for an executable regular file named `name`
+static bool path_search(const char* name, std::string& result) {
+    const char* path = getenv("PATH");
+    if (!path) {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+    while (true) {
+        const char* colon = strchr(path, ':');
+        size_t len = colon ? colon - path : strlen(path);
+        std::string file = len ? std::string(path, len) : ".";
+        file += '/';
+        file += name;
+        struct stat st;
+        if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode)
+            && access(file.c_str(), X_OK) == 0) {
+            result = std::move(file);
+            return true;
+        }
+        if (!colon) {
+            return false;
+        }
+        path = colon + 1;
+    }
+}
+
+// Return the cache entry for command `name`, searching PATH on a miss,
+// or nullptr if PATH has no such command
+static path_entry* path_lookup(const char* name) {
+    const char* path = getenv("PATH");
+    if (path_cache_path != (path ? path : "")) {
+        path_cache.clear();
+        path_cache_path = path ? path : "";
+    }
+    auto it = path_cache.find(std::string_view(name));
+    if (it == path_cache.end()) {
+        std::string file;
+        if (!path_search(name, file)) {
+            return nullptr;
+        }
+        it = path_cache.emplace(name, path_entry{std::move(file)}).first;
+    }
+    return &it->second;
+}
+
+// Background jobs: the conditionals started with `&` that haven't been
+// reaped. `parallel -j N` caps how many run at once (0: no cap); starting
+// one more first waits for one to exit. The shell keeps SIGCHLD blocked
+// and waits for it with sigsuspend, so waiting doesn't spin.
+static std::vector<pid_t> bg_jobs;
+static unsigned long bg_limit = 0;
+
+// Pipe capacity for pipelines, set by `-B SIZE` (0 means the default)
+static int pipe_capacity = 0;
+
+// Coprocesses, started by `coproc [-e MARKER] [-t SECONDS] NAME
+// COMMAND...`: workers that keep running between commands. The shell
+// holds both ends of their pipes.
+struct coprocess {
+    pid_t pid;
+    int to;                     // the worker's standard input
+    int from;                   // its standard output
+    std::string marker;         // line that ends a call, or empty
+    double idle;                // quiet time that ends a call; 0: none
+    std::string pending;        // output held back from the last call
+};
+static std::unordered_map<std::string, coprocess> coprocs;
+static constexpr double COPROC_IDLE = 0.1;  // default without a marker
+static volatile sig_atomic_t coproc_interrupted = 0;
+
+static void coproc_sigint_handler(int) {
+    coproc_interrupted = 1;
+}
+
+static double monotonic_time() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void sigchld_handler(int) {
+}
+
+// Forget background job `p`, which has been reaped
+static void job_exited(pid_t p) {
+    auto it = std::find(bg_jobs.begin(), bg_jobs.end(), p);
+    if (it != bg_jobs.end()) {
+        bg_jobs.erase(it);
+    }
+    for (auto& cp : coprocs) {
+        if (cp.second.pid == p) {
+            cp.second.pid = -1;
+        }
+    }
+}
+
+// Reap exited background jobs, first waiting until at most `max_running`
+// are left
+static void reap_jobs(size_t max_running) {
+    while (true) {
+        pid_t p;
+        while ((p = waitpid(-1, nullptr, WNOHANG)) > 0) {
+            job_exited(p);
+        }
+        if (p < 0 && errno == ECHILD) {
+            // Jobs started by some other process (we're a child shell)
+            bg_jobs.clear();
+        }
+        if (bg_jobs.size() <= max_running) {
+            return;
+        }
+        sigset_t mask;
+        sigprocmask(SIG_BLOCK, nullptr, &mask);
+        sigdelset(&mask, SIGCHLD);
+        sigsuspend(&mask);
+    }
+}
+
+// Utility builtins
+//    These common utilities run inside the shell, with no fork, when they
+//    stand alone or sit at either end of a pipeline. Each takes the
+//    command's arguments and output and error file descriptors.
+
+static bool write_all(int fd, std::string_view s) {
+    size_t pos = 0;
+    while (pos != s.size()) {
+        ssize_t nw = write(fd, s.data() + pos, s.size() - pos);
+        if (nw < 0 && errno != EINTR) {
+            return false;
+        } else if (nw > 0) {
+            pos += nw;
+        }
+    }
+    return true;
+}
+
+static int builtin_true(int, char**, int, int) {
+    return 0;
+}
+
+static int builtin_false(int, char**, int, int) {
+    return 1;
+}
+
+static int builtin_pwd(int, char**, int outfd, int errfd) {
+    char* dir = getcwd(nullptr, 0);
+    if (!dir) {
+        dprintf(errfd, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    std::string s = dir;
+    free(dir);
+    s += '\n';
+    return write_all(outfd, s) ? 0 : 1;
+}
+
+// `echo [-n] [ARG]...`
+static int builtin_echo(int argc, char** argv, int outfd, int) {
+    int i = 1;
+    bool newline = true;
+    if (i < argc && strcmp(argv[i], "-n") == 0) {
+        newline = false;
+        ++i;
+    }
+    std::string s;
+    for (; i < argc; ++i) {
+        s += argv[i];
+        if (i + 1 < argc) {
+            s += ' ';
+        }
+    }
+    if (newline) {
+        s += '\n';
+    }
+    return write_all(outfd, s) ? 0 : 1;
+}
+
+// Append the escape sequence starting at `p` (which points at a
+// backslash) to `out`. Returns a pointer to its last character, or
+// nullptr for `\c`, which ends the output.
+static const char* printf_escape(std::string& out, const char* p) {
+    static const char from[] = "\\abfnrtv\"'";
+    static const char to[] = "\\\a\b\f\n\r\t\v\"'";
+    if (!p[1]) {
+        out += '\\';
+        return p;
+    } else if (const char* e = strchr(from, p[1])) {
+        out += to[e - from];
+        return p + 1;
+    } else if (p[1] == 'c') {
+        return nullptr;
+    } else if (p[1] >= '0' && p[1] <= '7') {
+        int ch = 0, n = 0;
+        for (++p; n != 3 && *p >= '0' && *p <= '7'; ++p, ++n) {
+            ch = ch * 8 + (*p - '0');
+        }
+        out += char(ch);
+        return p - 1;
+    }
+    out += '\\';
+    out += p[1];
+    return p + 1;
+}
+
+// Append `value` to `out` formatted by `spec`, a single printf conversion
+template <typename T>
+static void printf_append(std::string& out, const std::string& spec, T value) {
+    int n = snprintf(nullptr, 0, spec.c_str(), value);
+    size_t pos = out.size();
+    out.resize(pos + n + 1);
+    snprintf(&out[pos], n + 1, spec.c_str(), value);
+    out.resize(pos + n);
+}
+
+// Parse a numeric printf argument; `'c` and `"c` give the character code
+static long long printf_number(const char* arg, int errfd, int& status) {
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char) arg[1];
+    }
+    char* end;
+    errno = 0;
+    long long v = strtoll(arg, &end, 0);
+    if (end == arg || *end || errno) {
+        dprintf(errfd, "printf: %s: invalid number\n", arg);
+        status = 1;
+    }
+    return v;
+}
+
+// `printf FORMAT [ARG]...`: handles %d %i %o %u %x %X %c %s, with flags,
+// width, and precision; the format is reused while arguments remain
+static int builtin_printf(int argc, char** argv, int outfd, int errfd) {
+    if (argc < 2) {
+        dprintf(errfd, "printf: usage: printf FORMAT [ARG]...\n");
+        return 1;
+    }
+    std::string out;
+    int status = 0;
+    int argi = 2;
+    int start;
+    do {
+        start = argi;
+        for (const char* p = argv[1]; *p; ++p) {
+            if (*p == '\\') {
+                if (!(p = printf_escape(out, p))) {
+                    return write_all(outfd, out) ? status : 1;
+                }
+                continue;
+            } else if (*p != '%') {
+                out += *p;
+                continue;
+            } else if (p[1] == '%') {
+                out += '%';
+                ++p;
+                continue;
+            }
+            const char* q = p + 1;
+            q += strspn(q, "-+ #0");
+            q += strspn(q, "0123456789");
+            if (*q == '.') {
+                ++q;
+                q += strspn(q, "0123456789");
+            }
+            if (!*q || !strchr("diouxXcs", *q)) {
+                dprintf(errfd, "printf: %.*s: invalid directive\n",
+                        int(q - p + (*q != 0)), p);
+                return 1;
+            }
+            std::string spec(p, q - p);
+            const char* arg = argi < argc ? argv[argi++] : nullptr;
+            if (*q == 's' || *q == 'c') {
+                std::string s = arg ? arg : "";
+                if (*q == 'c') {
+                    s = s.substr(0, 1);
+                }
+                printf_append(out, spec + 's', s.c_str());
+            } else {
+                long long v = arg ? printf_number(arg, errfd, status) : 0;
+                spec += "ll";
+                spec += *q;
+                if (*q == 'd' || *q == 'i') {
+                    printf_append(out, spec, v);
+                } else {
+                    printf_append(out, spec, (unsigned long long) v);
+                }
+            }
+            p = q;
+        }
+    } while (argi < argc && argi != start);
+    return write_all(outfd, out) ? status : 1;
+}
+
+// Expression parser for `test` and `[`. Grammar, from loosest binding:
+// EXPR -o EXPR, EXPR -a EXPR, ! EXPR, ( EXPR ), and primaries: unary
+// file and string tests, binary string and integer comparisons, and
+// bare strings (true if nonempty).
+struct test_parser {
+    char** args;
+    int n;
+    int errfd;
+    int i = 0;
+    bool error = false;
+
+    const char* peek(int k = 0) const {
+        return i + k < n ? args[i + k] : nullptr;
+    }
+    bool is(int k, const char* s) const {
+        const char* a = peek(k);
+        return a && strcmp(a, s) == 0;
+    }
+    void fail(const char* msg, const char* arg = nullptr) {
+        if (!error) {
+            if (arg) {
+                dprintf(errfd, "test: %s: %s\n", arg, msg);
+            } else {
+                dprintf(errfd, "test: %s\n", msg);
+            }
+        }
+        error = true;
+    }
+
+    bool parse_or() {
+        bool v = parse_and();
+        while (!error && is(0, "-o")) {
+            ++i;
+            v = parse_and() || v;
+        }
+        return v;
+    }
+    bool parse_and() {
+        bool v = parse_not();
+        while (!error && is(0, "-a")) {
+            ++i;
+            v = parse_not() && v;
+        }
+        return v;
+    }
+    bool parse_not() {
+        if (is(0, "!") && peek(1)) {
+            ++i;
+            return !parse_not();
+        }
+        return parse_primary();
+    }
+    bool parse_primary() {
+        const char* a = peek();
+        if (!a) {
+            fail("argument expected");
+            return false;
+        }
+        if (peek(1) && peek(2) && is_binary(peek(1))) {
+            i += 3;
+            return binary(a, args[i - 2], args[i - 1]);
+        } else if (strcmp(a, "(") == 0) {
+            ++i;
+            bool v = parse_or();
+            if (!is(0, ")")) {
+                fail("')' expected");
+            }
+            ++i;
+            return v;
+        } else if (a[0] == '-' && a[1] && !a[2]
+                   && strchr("defhLnrswxz", a[1]) && peek(1)) {
+            i += 2;
+            return unary(a[1], args[i - 1]);
+        }
+        ++i;
+        return a[0] != '\0';
+    }
+
+    static bool is_binary(const char* op) {
+        static const char* const ops[] = {
+            "=", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge"
+        };
+        for (const char* o : ops) {
+            if (strcmp(op, o) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+    bool unary(char op, const char* arg) {
+        struct stat st;
+        switch (op) {
+        case 'n':
+            return arg[0] != '\0';
+        case 'z':
+            return arg[0] == '\0';
+        case 'h':
+        case 'L':
+            return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r':
+            return access(arg, R_OK) == 0;
+        case 'w':
+            return access(arg, W_OK) == 0;
+        case 'x':
+            return access(arg, X_OK) == 0;
+        }
+        if (stat(arg, &st) != 0) {
+            return false;
+        }
+        return op == 'e'
+            || (op == 'f' && S_ISREG(st.st_mode))
+            || (op == 'd' && S_ISDIR(st.st_mode))
+            || (op == 's' && st.st_size > 0);
+    }
+    long long integer(const char* arg) {
+        char* end;
+        errno = 0;
+        long long v = strtoll(arg, &end, 10);
+        if (end == arg || *end || errno) {
+            fail("integer expression expected", arg);
+        }
+        return v;
+    }
+    bool binary(const char* a, const char* op, const char* b) {
+        if (op[0] != '-') {
+            return (strcmp(a, b) == 0) == (op[0] == '=');
+        }
+        long long x = integer(a), y = integer(b);
+        switch (op[1] * 256 + op[2]) {
+        case 'e' * 256 + 'q': return x == y;
+        case 'n' * 256 + 'e': return x != y;
+        case 'l' * 256 + 't': return x < y;
+        case 'l' * 256 + 'e': return x <= y;
+        case 'g' * 256 + 't': return x > y;
+        default:              return x >= y;
+        }
+    }
+};
+
+// `test EXPR` and `[ EXPR ]`: exits 0 if EXPR is true, 1 if it is false
+// or empty, and 2 on errors
+static int builtin_test(int argc, char** argv, int, int errfd) {
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            dprintf(errfd, "[: missing ']'\n");
+            return 2;
+        }
+        --argc;
+    }
+    test_parser tp{argv + 1, argc - 1, errfd};
+    if (tp.n == 0) {
+        return 1;
+    }
+    bool v = tp.parse_or();
+    if (!tp.error && tp.i != tp.n) {
+        tp.fail("extra argument", tp.peek());
+    }
+    return tp.error ? 2 : !v;
+}
+
+struct utility {
+    const char* name;
+    int (*run)(int argc, char** argv, int outfd, int errfd);
+};
+
+static const utility utilities[] = {
+    {"[", builtin_test}, {"echo", builtin_echo}, {"false", builtin_false},
+    {"printf", builtin_printf}, {"pwd", builtin_pwd},
+    {"test", builtin_test}, {"true", builtin_true}
+};
+
+static const utility* find_utility(const char* name) {
+    for (auto& u : utilities) {
+        if (strcmp(name, u.name) == 0) {
+            return &u;
+        }
+    }
+    return nullptr;
+}
+
+int run_list(shell_program& prog, size_t pc, size_t end);
+
+// Every descriptor the shell opens itself is close-on-exec. Above
+// `inherited_fd_max`, the highest descriptor the shell inherited open
+// across exec, there are no others.
+static int inherited_fd_max = STDERR_FILENO;
+
+static void find_inherited_fds() {
+    if (DIR* dir = opendir("/proc/self/fd")) {
+        int dfd = dirfd(dir);
+        while (dirent* de = readdir(dir)) {
+            int fd = atoi(de->d_name);
+            int flags = fd > inherited_fd_max && fd != dfd ? fcntl(fd, F_GETFD) : -1;
+            if (flags >= 0 && !(flags & FD_CLOEXEC)) {
+                inherited_fd_max = fd;
+            }
+        }
+        closedir(dir);
+    }
+}
+
+// Close the shell's own descriptors, as an exec would. A forked child
+// that runs shell code must drop the shell's pipe ends, or readers of
+// those pipes never see end of file. Usually that's one close_range.
+static void close_shell_fds() {
+    for (int fd = STDERR_FILENO + 1; fd <= inherited_fd_max; ++fd) {
+        int flags = fcntl(fd, F_GETFD);
+        if (flags >= 0 && (flags & FD_CLOEXEC)) {
+            close(fd);
+        }
+    }
+    if (close_range(inherited_fd_max + 1, ~0U, 0) < 0) {
+        for (long fd = inherited_fd_max + 1; fd < sysconf(_SC_OPEN_MAX); ++fd) {
+            close(fd);
+        }
+    }
+}
+
 struct command {
-    std::vector<std::string> args;
+    char** argv = nullptr;     // Null-terminated, in `line_arena`
+    int argc = 0;
     pid_t pid = -1;      
     int input_fd = STDIN_FILENO;
     int output_fd = STDOUT_FILENO;
     int error_fd = STDERR_FILENO;
 
-    command() = default;
-    ~command() {
-        // Only close file descriptors if they were redirected
-        if (input_fd != STDIN_FILENO) close(input_fd);
-        if (output_fd != STDOUT_FILENO) close(output_fd);
-        if (error_fd != STDERR_FILENO) close(error_fd);
+    // A group runs the list at [body, body_end) in `prog` instead
+    int group = 0;             // '(' or '{', or 0 for a simple command
+    shell_program* prog = nullptr;
+    size_t body = 0;
+    size_t body_end = 0;
+
+    command() = default;
+    ~command() {
+        release_fds();
+    }
+
+    // Close the shell's copies of redirected file descriptors, once the
+    // command has been started and holds its own
+    void release_fds() {
+        if (input_fd != STDIN_FILENO) {
+            close(input_fd);
+            input_fd = STDIN_FILENO;
+        }
+        if (output_fd != STDOUT_FILENO) {
+            close(output_fd);
+            output_fd = STDOUT_FILENO;
+        }
+        if (error_fd != STDERR_FILENO) {
+            close(error_fd);
+            error_fd = STDERR_FILENO;
+        }
+    }
+
+    bool is_builtin() const {
+        static const char* const names[] = {
+            "cd", "coproc", "hash", "parallel", "wait"
+        };
+        for (const char* name : names) {
+            if (argc != 0 && strcmp(argv[0], name) == 0) {
+                return true;
+            }
+        }
+        return is_utility();
+    }
+
+    // Test if this is a `cat` that just copies its input or a single
+    // file to its standard output
+    bool is_plain_cat() const {
+        return (argc == 1 || (argc == 2 && argv[1][0] != '-'))
+            && strcmp(argv[0], "cat") == 0
+            && output_fd == STDOUT_FILENO;
+    }
+
+    // Test if this command talks to a running coprocess
+    bool is_coproc_call() const {
+        return argc != 0 && !group && !coprocs.empty()
+            && coprocs.count(argv[0]) != 0;
+    }
+
+    // Utility builtins don't touch shell state, so they may run in the
+    // shell even inside a pipeline
+    bool is_utility() const {
+        return argc != 0 && find_utility(argv[0]);
+    }
+
+    int execute_builtin() {
+        if (const utility* u = find_utility(argv[0])) {
+            return u->run(argc, argv, output_fd, error_fd);
+        }
+        if (strcmp(argv[0], "cd") == 0) {
+            const char* dir = argc > 1 ? argv[1] : getenv("HOME");
+            if (!dir) {
+                if (error_fd == STDERR_FILENO) {
+                    fprintf(stderr, "cd: HOME not set\n");
+                }
+                return 1;
+            }
+            if (chdir(dir) < 0) {
+                if (error_fd == STDERR_FILENO) {
+                    fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+                }
+                return 1;
+            }
+            return 0;
+        }
+        if (strcmp(argv[0], "coproc") == 0) {
+            return execute_coproc();
+        }
+        if (strcmp(argv[0], "hash") == 0) {
+            return execute_hash();
+        }
+        if (strcmp(argv[0], "parallel") == 0) {
+            return execute_parallel();
+        }
+        if (strcmp(argv[0], "wait") == 0) {
+            reap_jobs(0);
+            return 0;
+        }
+        return 1;
+    }
+
+    // `parallel -j N` lets at most N background jobs run at once (0 means
+    // any number); `parallel` prints the current limit
+    int execute_parallel() {
+        if (argc == 1) {
+            dprintf(output_fd, "parallel -j %lu\n", bg_limit);
+            return 0;
+        }
+        char* end = nullptr;
+        unsigned long n = 0;
+        if (argc == 3 && strcmp(argv[1], "-j") == 0) {
+            n = strtoul(argv[2], &end, 10);
+        }
+        if (!end || end == argv[2] || *end) {
+            dprintf(error_fd, "parallel: usage: parallel [-j N]\n");
+            return 1;
+        }
+        bg_limit = n;
+        return 0;
     }
 
-    bool is_builtin() const {
-        return !args.empty() && args[0] == "cd";
+    // `coproc NAME COMMAND...` starts COMMAND as coprocess NAME, ending
+    // any earlier one by that name; `coproc NAME` ends it by closing its
+    // input and waiting for it; `coproc` lists the running ones
+    int execute_coproc() {
+        if (argc == 1) {
+            for (auto& cp : coprocs) {
+                dprintf(output_fd, "%d\t%s\n", cp.second.pid, cp.first.c_str());
+            }
+            return 0;
+        }
+        int a = 1;
+        std::string marker;
+        double idle = -1;
+        while (a + 1 < argc && argv[a][0] == '-') {
+            bool ok = false;
+            if (strcmp(argv[a], "-e") == 0) {
+                marker = argv[a + 1];
+                ok = !marker.empty() && marker.find('\n') == std::string::npos;
+            } else if (strcmp(argv[a], "-t") == 0) {
+                char* end;
+                idle = strtod(argv[a + 1], &end);
+                ok = end != argv[a + 1] && *end == '\0' && idle >= 0;
+            }
+            if (!ok) {
+                break;
+            }
+            a += 2;
+        }
+        if (a == argc || argv[a][0] == '-') {
+            dprintf(error_fd, "coproc: usage: coproc [-e MARKER] "
+                    "[-t SECONDS] NAME [COMMAND...]\n");
+            return 1;
+        }
+        if (idle < 0) {
+            idle = marker.empty() ? COPROC_IDLE : 0;
+        }
+        auto it = coprocs.find(argv[a]);
+        if (it != coprocs.end()) {
+            close(it->second.to);
+            close(it->second.from);
+            pid_t p = it->second.pid;
+            coprocs.erase(it);
+            int st;
+            while (p > 0 && waitpid(p, &st, 0) < 0 && errno == EINTR) {
+            }
+        }
+        if (a + 1 == argc) {
+            return 0;
+        }
+
+        int in[2], out[2];
+        if (pipe2(in, O_CLOEXEC) < 0) {
+            dprintf(error_fd, "coproc: %s\n", strerror(errno));
+            return 1;
+        } else if (pipe2(out, O_CLOEXEC) < 0) {
+            dprintf(error_fd, "coproc: %s\n", strerror(errno));
+            close(in[0]);
+            close(in[1]);
+            return 1;
+        }
+        command worker;
+        worker.argc = argc - a - 1;
+        worker.argv = argv + a + 1;
+        worker.input_fd = in[0];
+        worker.output_fd = out[1];
+        worker.execute();
+        worker.release_fds();
+        if (worker.pid <= 0) {
+            close(in[1]);
+            close(out[0]);
+            return 1;
+        }
+        // The shell's ends never block, so a relay can't wedge on them
+        fcntl(in[1], F_SETFL, O_NONBLOCK);
+        fcntl(out[0], F_SETFL, O_NONBLOCK);
+        coprocs[argv[a]] = {worker.pid, in[1], out[0], marker, idle, {}};
+        return 0;
     }
 
-    int execute_builtin() {
-        if (args[0] == "cd") {
-            const char* dir = args.size() > 1 ? args[1].c_str() : getenv("HOME");
-            if (!dir) {
-                if (error_fd == STDERR_FILENO) {
-                    fprintf(stderr, "cd: HOME not set\n");
+    // Run a command naming a coprocess. The shell sends the worker this
+    // command's input, or its arguments as one line if it has any, and
+    // copies the worker's output back as it arrives; a final input line
+    // without a newline gets one. The call ends when the worker closes
+    // its output, on Ctrl-C, or:
+    //
+    // - With a marker (`coproc -e MARKER`), when the worker echoes the
+    //   marker line, which the shell sends after the input and doesn't
+    //   copy. Output is thus never split between calls; suits workers
+    //   that pass the marker through, like `cat` or `sed`.
+    // - Otherwise, once the input is sent, when the worker has answered
+    //   as many lines as it was sent.
+    //
+    // As a fallback for workers that filter or buffer their output, a
+    // call also ends after the worker's idle time (`coproc -t SECONDS`)
+    // passes with no output: COPROC_IDLE by default without a marker,
+    // none with one, and none if SECONDS is 0. Output that arrives after
+    // a call ends goes to the next call.
+    int execute_coproc_call() {
+        coprocess& cp = coprocs.find(argv[0])->second;
+        std::string send;
+        size_t nsent = 0, nanswered = 0;
+        bool input_open = argc == 1;
+        if (!input_open) {
+            for (int i = 1; i != argc; ++i) {
+                send += (i > 1 ? " " : "") + std::string(argv[i]);
+            }
+            send += '\n';
+            nsent = 1;
+        }
+        bool ended_line = true, marker_sent = false, done = false;
+        int status = 0;
+        char buf[8192];
+        double last_activity = monotonic_time();
+
+        coproc_interrupted = 0;
+        struct sigaction sa, old_sa;
+        sa.sa_handler = coproc_sigint_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        sigaction(SIGINT, &sa, &old_sa);
+
+        // Copy complete lines of `cp.pending` to the output, stopping
+        // after the marker. A partial line that might become the marker
+        // is held back.
+        auto relay = [&] () {
+            size_t pos = 0, nl;
+            while (!done
+                   && (nl = cp.pending.find('\n', pos)) != std::string::npos) {
+                std::string_view line(cp.pending.data() + pos, nl - pos);
+                if (!cp.marker.empty() && line == cp.marker) {
+                    write_all(output_fd, std::string_view(cp.pending).substr(0, pos));
+                    cp.pending.erase(0, nl + 1);
+                    done = true;
+                    return;
                 }
-                return 1;
+                ++nanswered;
+                pos = nl + 1;
             }
-            if (chdir(dir) < 0) {
-                if (error_fd == STDERR_FILENO) {
-                    fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+            std::string_view tail = std::string_view(cp.pending).substr(pos);
+            if (tail.empty() || cp.marker.compare(0, tail.size(), tail) != 0) {
+                pos = cp.pending.size();
+            }
+            write_all(output_fd, std::string_view(cp.pending).substr(0, pos));
+            cp.pending.erase(0, pos);
+        };
+        relay();
+
+        while (!done && !coproc_interrupted) {
+            int timeout = -1;
+            if (!input_open && send.empty()) {
+                if (!cp.marker.empty() && !marker_sent) {
+                    send = cp.marker + '\n';
+                    marker_sent = true;
+                    continue;
+                } else if (cp.marker.empty() && nanswered >= nsent) {
+                    break;
                 }
-                return 1;
+                if (cp.idle > 0) {
+                    double left = last_activity + cp.idle - monotonic_time();
+                    if (left <= 0) {
+                        break;
+                    }
+                    timeout = int(left * 1000) + 1;
+                }
+            }
+
+            pollfd pfd[3] = {{cp.from, POLLIN, 0}, {cp.to, POLLOUT, 0},
+                             {input_fd, POLLIN, 0}};
+            pfd[1].fd = send.empty() ? -1 : cp.to;
+            pfd[2].fd = input_open && send.size() < sizeof(buf) ? input_fd : -1;
+            int np = poll(pfd, 3, timeout);
+            if (np < 0 && errno == EINTR) {
+                continue;
+            } else if (np < 0) {
+                status = 1;
+                break;
+            }
+            if (pfd[0].revents) {
+                ssize_t nr = read(cp.from, buf, sizeof(buf));
+                if (nr > 0) {
+                    cp.pending.append(buf, nr);
+                    relay();
+                    last_activity = monotonic_time();
+                } else if (nr == 0) {
+                    // the worker is done; so is the call
+                    write_all(output_fd, cp.pending);
+                    cp.pending.clear();
+                    break;
+                } else if (errno != EAGAIN && errno != EINTR) {
+                    dprintf(error_fd, "%s: %s\n", argv[0], strerror(errno));
+                    status = 1;
+                    break;
+                }
+            }
+            if (pfd[1].revents) {
+                ssize_t nw = write(cp.to, send.data(), send.size());
+                if (nw > 0) {
+                    send.erase(0, nw);
+                    last_activity = monotonic_time();
+                } else if (errno != EAGAIN) {
+                    dprintf(error_fd, "%s: coprocess exited\n", argv[0]);
+                    status = 1;
+                    break;
+                }
+            }
+            if (pfd[2].revents) {
+                ssize_t nr = read(input_fd, buf, sizeof(buf));
+                if (nr > 0) {
+                    send.append(buf, nr);
+                    nsent += std::count(buf, buf + nr, '\n');
+                    ended_line = buf[nr - 1] == '\n';
+                } else if (nr == 0 || (errno != EINTR && errno != EAGAIN)) {
+                    input_open = false;
+                    if (!ended_line) {
+                        send += '\n';
+                        ++nsent;
+                    }
+                }
+            }
+        }
+
+        sigaction(SIGINT, &old_sa, nullptr);
+        if (coproc_interrupted) {
+            status = 1;
+        }
+        return status;
+    }
+
+    // `hash` lists the cached command paths; `hash -r` empties the
+    // cache; `hash NAME...` looks up each NAME and caches it
+    int execute_hash() {
+        if (argc == 1) {
+            std::vector<std::pair<std::string, path_entry>> entries(
+                path_cache.begin(), path_cache.end());
+            std::sort(entries.begin(), entries.end(),
+                      [] (const auto& a, const auto& b) {
+                          return a.first < b.first;
+                      });
+            if (entries.empty()) {
+                dprintf(output_fd, "hash: hash table empty\n");
+            } else {
+                dprintf(output_fd, "hits\tcommand\n");
+            }
+            for (auto& e : entries) {
+                dprintf(output_fd, "%4u\t%s\n", e.second.hits,
+                        e.second.path.c_str());
             }
             return 0;
         }
-        return 1;
+        int status = 0;
+        for (int i = 1; i != argc; ++i) {
+            if (strcmp(argv[i], "-r") == 0) {
+                path_cache.clear();
+            } else if (!strchr(argv[i], '/') && !path_lookup(argv[i])) {
+                dprintf(error_fd, "hash: %s: not found\n", argv[i]);
+                status = 1;
+            }
+        }
+        return status;
     }
 
     int execute() {
-        if (args.empty()) return 1;
-
-        if (is_builtin()) {
-            return execute_builtin();
-        }
+        if (argc == 0 && !group) return 1;
 
         // Handle input redirection errors before forking
         if (input_fd != STDIN_FILENO && input_fd < 0) {
@@ -61,6 +1458,102 @@ struct command {
             return 1;
         }
 
+        if (group || is_builtin()) {
+            return execute_child();
+        }
+
+        // posix_spawn uses vfork-style process creation, so launching a
+        // command doesn't copy the shell's page tables
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        // Commands start with SIGCHLD unblocked
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        sigset_t mask;
+        sigemptyset(&mask);
+        posix_spawnattr_setsigmask(&attr, &mask);
+        // and with SIGPIPE, which the shell ignores, back to its default
+        sigset_t dfl;
+        sigemptyset(&dfl);
+        sigaddset(&dfl, SIGPIPE);
+        posix_spawnattr_setsigdefault(&attr, &dfl);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK
+                                 | POSIX_SPAWN_SETSIGDEF);
+        // The redirected descriptors are all close-on-exec, so the exec
+        // closes the originals
+        if (input_fd != STDIN_FILENO) {
+            posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+        }
+        if (output_fd != STDOUT_FILENO) {
+            posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+        }
+        if (error_fd != STDERR_FILENO) {
+            posix_spawn_file_actions_adddup2(&actions, error_fd, STDERR_FILENO);
+        }
+
+        // Names without a slash go through the path cache; a cached path
+        // that has disappeared is dropped and searched for again
+        int r = ENOENT;
+        if (strchr(argv[0], '/')) {
+            r = posix_spawn(&pid, argv[0], &actions, &attr,
+                            argv, environ);
+        } else {
+            for (int tries = 0; tries != 2 && r == ENOENT; ++tries) {
+                path_entry* e = path_lookup(argv[0]);
+                if (!e) {
+                    break;
+                }
+                r = posix_spawn(&pid, e->path.c_str(), &actions, &attr,
+                                argv, environ);
+                if (r == ENOENT) {
+                    path_cache.erase(path_cache.find(std::string_view(argv[0])));
+                } else {
+                    ++e->hits;
+                }
+            }
+        }
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        if (r != 0) {
+            pid = -1;
+            if (r == ENOENT) {
+                fprintf(stderr, "%s: command not found\n", argv[0]);
+            } else {
+                fprintf(stderr, "%s: %s\n", argv[0], strerror(r));
+            }
+            return 1;
+        }
+        return 0;
+    }
+
+    // Run a `{ }` group in the shell itself, with its redirections
+    // applied to the shell's standard file descriptors meanwhile
+    int execute_group() {
+        int fds[3] = {input_fd, output_fd, error_fd};
+        int saved[3] = {-1, -1, -1};
+        for (int i = 0; i != 3; ++i) {
+            if (fds[i] != i) {
+                saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+                dup2(fds[i], i);
+            }
+        }
+        int status = run_list(*prog, body, body_end);
+        for (int i = 0; i != 3; ++i) {
+            if (saved[i] >= 0) {
+                dup2(saved[i], i);
+                close(saved[i]);
+            } else if (fds[i] != i) {
+                close(i);
+            }
+        }
+        return status;
+    }
+
+    // A builtin or group inside a pipeline, or a `( )` subshell, runs in
+    // a forked child, like any other stage, so it can't change the shell
+    // itself. A subshell's pipelines fork from that child; the subshell
+    // costs only the one fork.
+    int execute_child() {
         pid = fork();
         if (pid < 0) {
             perror("fork");
@@ -68,134 +1561,343 @@ struct command {
         }
 
         if (pid == 0) {  // Child process
-            // Handle redirections
-            if (input_fd != STDIN_FILENO) {
-                if (dup2(input_fd, STDIN_FILENO) < 0) {
-                    perror("dup2");
-                    _exit(1);
-                }
-                close(input_fd);
-            }
-            if (output_fd != STDOUT_FILENO) {
-                if (dup2(output_fd, STDOUT_FILENO) < 0) {
-                    perror("dup2");
-                    _exit(1);
-                }
-                close(output_fd);
-            }
-            if (error_fd != STDERR_FILENO) {
-                if (dup2(error_fd, STDERR_FILENO) < 0) {
+            // Handle redirections; close_shell_fds closes the originals
+            int fds[3] = {input_fd, output_fd, error_fd};
+            for (int i = 0; i != 3; ++i) {
+                if (fds[i] != i && dup2(fds[i], i) < 0) {
                     perror("dup2");
                     _exit(1);
                 }
-                close(error_fd);
-            }
-
-            std::vector<char*> c_args;
-            for (const auto& arg : args) {
-                c_args.push_back(const_cast<char*>(arg.c_str()));
             }
-            c_args.push_back(nullptr);
-
-            execvp(c_args[0], c_args.data());
-            fprintf(stderr, "%s: command not found\n", c_args[0]);
-            _exit(1);
+            input_fd = STDIN_FILENO;
+            output_fd = STDOUT_FILENO;
+            error_fd = STDERR_FILENO;
+            close_shell_fds();
+            _exit(group ? run_list(*prog, body, body_end) : execute_builtin());
         }
 
         return 0;
     }
 };
 
-int run_pipeline(shell_parser pipeline) {
+// Pipeline timing
+//    `time PIPELINE` reports the pipeline's wall, user, and system time
+//    and max RSS, and so does every pipeline when SH61_PROFILE is set.
+//    Each report is a line of JSON in the format of the pset4 io61
+//    profiler, with a command string, the exit status, and the same
+//    numbers for each stage. Reports go to file descriptor 100 if it's
+//    open, as the profiler's do, and otherwise to standard error.
+
+static bool profile_all = false;
+
+struct stage_usage {
+    std::string command;
+    struct rusage ru = {};
+};
+
+static void append_json_string(std::string& out, const std::string& s) {
+    out += '"';
+    for (unsigned char ch : s) {
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (ch < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", ch);
+            out += buf;
+        } else {
+            out += ch;
+        }
+    }
+    out += '"';
+}
+
+static void append_usage_json(std::string& out, const struct rusage& ru) {
+    char buf[200];
+    snprintf(buf, sizeof(buf),
+             "\"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld",
+             ru.ru_utime.tv_sec, (long) ru.ru_utime.tv_usec,
+             ru.ru_stime.tv_sec, (long) ru.ru_stime.tv_usec,
+             ru.ru_maxrss);
+    out += buf;
+}
+
+// Report a timed pipeline. The totals add up the stages' times; max RSS
+// is the largest stage's.
+static void report_pipeline(double elapsed, int status,
+                            const std::vector<stage_usage>& stages) {
+    struct rusage total = {};
+    std::string command;
+    for (auto& s : stages) {
+        timeradd(&total.ru_utime, &s.ru.ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &s.ru.ru_stime, &total.ru_stime);
+        total.ru_maxrss = std::max(total.ru_maxrss, s.ru.ru_maxrss);
+        command += (command.empty() ? "" : " | ") + s.command;
+    }
+
+    char buf[100];
+    snprintf(buf, sizeof(buf), "{\"time\":%.6f, ", elapsed);
+    std::string json = buf;
+    append_usage_json(json, total);
+    snprintf(buf, sizeof(buf), ", \"status\":%d, \"command\":", status);
+    json += buf;
+    append_json_string(json, command);
+    json += ", \"stages\":[";
+    for (size_t i = 0; i != stages.size(); ++i) {
+        json += i ? ", {\"command\":" : "{\"command\":";
+        append_json_string(json, stages[i].command);
+        json += ", ";
+        append_usage_json(json, stages[i].ru);
+        json += "}";
+    }
+    json += "]}\n";
+
+    off_t off = lseek(100, 0, SEEK_CUR);
+    int fd = off != (off_t) -1 || errno == ESPIPE ? 100 : STDERR_FILENO;
+    write_all(fd, json);
+}
+
+static int execute_pipeline(shell_program& prog, size_t pc, size_t end,
+                            std::vector<stage_usage>* usage);
+
+int run_pipeline(shell_program& prog, size_t pc, size_t end) {
+    bool timed = pc != end && prog.code[pc] == OP_COMMAND
+        && prog.code[pc + 1] != 0
+        && strcmp(prog.str(prog.code[pc + 3]), "time") == 0;
+    if (!timed && !profile_all) {
+        return execute_pipeline(prog, pc, end, nullptr);
+    }
+    std::vector<stage_usage> stages;
+    double start = monotonic_time();
+    int status = execute_pipeline(prog, pc, end, &stages);
+    report_pipeline(monotonic_time() - start, status, stages);
+    return status;
+}
+
+// Return a file descriptor reading `text`, the input of a `<<` or `<<<`
+// redirection. Text that fits in a pipe's atomic write goes through one;
+// anything longer goes in a memfd, so the shell never blocks writing it.
+// Neither touches the disk.
+static int here_input(std::string_view text) {
+    if (text.size() <= PIPE_BUF) {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
+            return -1;
+        }
+        bool ok = write_all(pipefd[1], text);
+        close(pipefd[1]);
+        if (!ok) {
+            close(pipefd[0]);
+            return -1;
+        }
+        return pipefd[0];
+    }
+    int fd = memfd_create("sh61-heredoc", MFD_CLOEXEC);
+    if (fd >= 0 && (!write_all(fd, text) || lseek(fd, 0, SEEK_SET) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Run a pipeline. If `usage` is set, it collects each stage's command
+// and resource usage, and a leading `time` word is skipped.
+static int execute_pipeline(shell_program& prog, size_t pc, size_t end,
+                            std::vector<stage_usage>* usage) {
+    // Commands and their argument arrays live in `line_arena` until the
+    // pipeline is done; the strings they point to belong to `prog`
+    auto mark = line_arena.mark();
     std::vector<command*> commands;
+    auto cleanup = [&] () {
+        for (auto c : commands) {
+            c->~command();
+        }
+        line_arena.release(mark);
+    };
     
-    // Parse all commands in pipeline
-    shell_parser cmd_parser = pipeline.first_command();
-    while (cmd_parser) {
-        command* cmd = new command();
-        
-        auto token = cmd_parser.first_token();
-        while (token) {
-            if (token.type() == TYPE_NORMAL) {
-                cmd->args.push_back(token.str());
-            } 
-            else if (token.type() == TYPE_REDIRECT_OP) {
-                std::string op = token.str();
-                token.next();
-                if (!token || token.type() != TYPE_NORMAL) {
-                    fprintf(stderr, "Syntax error: missing filename after redirection\n");
-                    delete cmd;
-                    for (auto c : commands) delete c;
-                    return 1;
-                }
+    size_t start = pc;
+    while (pc != end) {
+        const uint32_t* op = &prog.code[pc];
+        if (op[0] == OP_ERROR) {
+            fprintf(stderr, "Syntax error: %s\n", prog.str(op[1]));
+            cleanup();
+            return 1;
+        }
+        command* cmd = new (line_arena.allocate(sizeof(command))) command();
+        uint32_t argc = 0, nredirect = op[2];
+        const uint32_t* redirect;
+        if (op[0] == OP_GROUP) {
+            cmd->group = op[1] ? '(' : '{';
+            cmd->prog = &prog;
+            cmd->body = pc + 4 + 2 * nredirect;
+            cmd->body_end = op[3];
+            redirect = op + 4;
+            pc = op[3];
+        } else {
+            assert(op[0] == OP_COMMAND);
+            argc = op[1];
+            redirect = op + 3 + argc;
+            pc += 3 + argc + 2 * nredirect;
+        }
 
-                std::string filename = token.str();
-                int fd = -1;
+        for (uint32_t i = 0; i != nredirect; ++i, redirect += 2) {
+            const char* rop = prog.str(redirect[0]);
+            if (redirect[1] == shell_program::NO_STRING) {
+                fprintf(stderr, "Syntax error: missing filename after redirection\n");
+                cmd->~command();
+                cleanup();
+                return 1;
+            }
 
-                if (op == "<") {
-                    fd = open(filename.c_str(), O_RDONLY);
-                    if (fd >= 0 || cmd->input_fd == STDIN_FILENO) {
-                        if (cmd->input_fd != STDIN_FILENO) close(cmd->input_fd);
-                        cmd->input_fd = fd;
-                    }
-                } 
-                else if (op == ">") {
-                    fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-                    if (fd >= 0 || cmd->output_fd == STDOUT_FILENO) {
-                        if (cmd->output_fd != STDOUT_FILENO) close(cmd->output_fd);
-                        cmd->output_fd = fd;
-                    }
-                } 
-                else if (op == "2>") {
-                    fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-                    if (fd >= 0 || cmd->error_fd == STDERR_FILENO) {
-                        if (cmd->error_fd != STDERR_FILENO) close(cmd->error_fd);
-                        cmd->error_fd = fd;
-                    }
-                }
+            const char* filename = prog.str(redirect[1]);
+            int fd = -1;
 
-                if (fd < 0) {
-                    fprintf(stderr, "%s: %s\n", filename.c_str(), strerror(errno));
-                    delete cmd;
-                    for (auto c : commands) delete c;
-                    return 1;
+            bool here = strcmp(rop, "<<") == 0 || strcmp(rop, "<<<") == 0;
+            if (strcmp(rop, "<") == 0 || here) {
+                fd = here ? here_input(filename)
+                    : open(filename, O_RDONLY | O_CLOEXEC);
+                if (fd >= 0 || cmd->input_fd == STDIN_FILENO) {
+                    if (cmd->input_fd != STDIN_FILENO) close(cmd->input_fd);
+                    cmd->input_fd = fd;
+                }
+            } 
+            else if (strcmp(rop, ">") == 0) {
+                fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                if (fd >= 0 || cmd->output_fd == STDOUT_FILENO) {
+                    if (cmd->output_fd != STDOUT_FILENO) close(cmd->output_fd);
+                    cmd->output_fd = fd;
+                }
+            } 
+            else if (strcmp(rop, "2>") == 0) {
+                fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                if (fd >= 0 || cmd->error_fd == STDERR_FILENO) {
+                    if (cmd->error_fd != STDERR_FILENO) close(cmd->error_fd);
+                    cmd->error_fd = fd;
                 }
             }
-            token.next();
+
+            if (fd < 0) {
+                fprintf(stderr, "%s: %s\n", here ? "sh61: here-document" : filename,
+                        strerror(errno));
+                cmd->~command();
+                cleanup();
+                return 1;
+            }
         }
 
-        if (!cmd->args.empty()) {
+        uint32_t skip = usage && op == &prog.code[start] && argc != 0
+            && strcmp(prog.str(op[3]), "time") == 0;
+        if (argc != skip) {
+            cmd->argc = argc - skip;
+            cmd->argv = static_cast<char**>(
+                line_arena.allocate((cmd->argc + 1) * sizeof(char*)));
+            for (int i = 0; i != cmd->argc; ++i) {
+                cmd->argv[i] = prog.str(op[3 + skip + i]);
+            }
+            cmd->argv[cmd->argc] = nullptr;
+            commands.push_back(cmd);
+        } else if (cmd->group) {
             commands.push_back(cmd);
         } else {
-            delete cmd;
+            cmd->~command();
         }
-        cmd_parser.next_command();
     }
 
     if (commands.empty()) {
+        cleanup();
         return 0;
     }
 
-    // Handle single builtin command without pipeline
-    if (commands.size() == 1 && commands[0]->is_builtin()) {
+    // A plain `cat` feeding another command only copies bytes, so skip
+    // it: the next command reads cat's input, or its file, directly.
+    // If the file can't be opened, or isn't something a reader can take
+    // its bytes from (a directory, say), cat runs and reports the error.
+    // The last stage always runs, since it decides the pipeline's status.
+    for (size_t i = 0; i + 1 < commands.size(); ) {
+        command* cat = commands[i];
+        if (!cat->is_plain_cat() || commands[i + 1]->input_fd != STDIN_FILENO) {
+            ++i;
+            continue;
+        }
+        int fd = cat->input_fd;
+        if (cat->argc == 2) {
+            fd = open(cat->argv[1], O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (fd >= 0
+                && (fstat(fd, &st) != 0
+                    || !(S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)
+                         || S_ISCHR(st.st_mode)))) {
+                close(fd);
+                fd = -1;
+            }
+            if (fd < 0) {
+                ++i;
+                continue;
+            }
+        } else {
+            cat->input_fd = STDIN_FILENO;
+        }
+        commands[i + 1]->input_fd = fd;
+        cat->~command();
+        commands.erase(commands.begin() + i);
+    }
+
+    if (usage) {
+        for (auto cmd : commands) {
+            stage_usage s;
+            if (cmd->group) {
+                s.command = cmd->group == '(' ? "( ... )" : "{ ... }";
+            }
+            for (int i = 0; i != cmd->argc; ++i) {
+                s.command += (i ? " " : "") + std::string(cmd->argv[i]);
+            }
+            usage->push_back(std::move(s));
+        }
+    }
+
+    // Handle single builtin command or `{ }` group without pipeline
+    if (commands.size() == 1 && commands[0]->group == '{') {
+        int status = commands[0]->execute_group();
+        cleanup();
+        return status;
+    } else if (commands.size() == 1 && commands[0]->is_coproc_call()) {
+        int status = commands[0]->execute_coproc_call();
+        cleanup();
+        return status;
+    } else if (commands.size() == 1 && commands[0]->is_builtin()) {
         int status = commands[0]->execute_builtin();
-        delete commands[0];
+        cleanup();
         return status;
     }
 
-    // Create pipes between commands
-    std::vector<int> pipe_fds;
+    // A coprocess call is relayed by the shell itself, once every other
+    // stage is running, so a pipeline can hold only one
+    size_t n = commands.size();
+    size_t relay = n;
+    for (size_t i = 0; i != n; ++i) {
+        if (commands[i]->is_coproc_call() && relay != n) {
+            fprintf(stderr, "%s: only one coprocess call per pipeline\n",
+                    commands[i]->argv[0]);
+            cleanup();
+            return 1;
+        } else if (commands[i]->is_coproc_call()) {
+            relay = i;
+        }
+    }
+
+    // Create pipes between commands. Each end belongs to the command
+    // that uses it, which releases it once started.
     for (size_t i = 0; i < commands.size() - 1; ++i) {
         int pipefd[2];
-        if (pipe(pipefd) < 0) {
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
             perror("pipe");
-            for (auto cmd : commands) delete cmd;
+            cleanup();
             return 1;
         }
 
-        // Set close-on-exec flag for both pipe ends
-        fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
-        fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+        if (pipe_capacity > 0) {
+            fcntl(pipefd[1], F_SETPIPE_SZ, pipe_capacity);
+        }
         
         // Only set up pipe if no explicit redirection exists
         if (commands[i]->output_fd == STDOUT_FILENO) {
@@ -209,47 +1911,95 @@ int run_pipeline(shell_parser pipeline) {
         } else {
             close(pipefd[0]);
         }
-
-        pipe_fds.push_back(pipefd[0]);
-        pipe_fds.push_back(pipefd[1]);
     }
 
-    // Execute all commands in reverse order
-    for (int i = commands.size() - 1; i >= 0; --i) {
-        commands[i]->execute();
+    // Execute all commands in reverse order, releasing each one's pipe
+    // ends as soon as it starts. A utility builtin at the end of the
+    // pipeline runs in the shell before anything else starts. One at the
+    // start runs in the shell last, once its reader is going and the
+    // shell holds no other pipe end, so a reader that quits early gives
+    // it EPIPE instead of leaving it blocked. A coprocess call goes after
+    // everything else.
+    bool inproc_last = relay == n - 1 || commands[n - 1]->is_utility();
+    int inproc_status = 0;
+    for (size_t i = n - 1; i != 0; --i) {
+        if (i == relay) {
+            continue;
+        } else if (i == n - 1 && inproc_last) {
+            inproc_status = commands[i]->execute_builtin();
+        } else {
+            commands[i]->execute();
+        }
+        commands[i]->release_fds();
     }
-
-    // Close all pipe file descriptors in the parent
-    for (int fd : pipe_fds) {
-        close(fd);
+    if (relay != 0) {
+        if (n > 1 && commands[0]->is_utility() && commands[1]->pid > 0) {
+            commands[0]->execute_builtin();
+        } else {
+            commands[0]->execute();
+        }
+        commands[0]->release_fds();
+    }
+    if (relay != n) {
+        int status = commands[relay]->execute_coproc_call();
+        commands[relay]->release_fds();
+        if (relay == n - 1) {
+            inproc_status = status;
+        }
     }
 
-    // Wait for completion and get status
+    // Wait for completion and get status; a command that couldn't be
+    // launched has no process and fails. One wait loop covers every
+    // stage, in whatever order they exit, and reaps background jobs
+    // that finish meanwhile.
     int status = 0;
-    if (!commands.empty()) {
-        waitpid(commands.back()->pid, &status, 0);
-        
-        // Clean up other processes
-        for (size_t i = 0; i < commands.size() - 1; ++i) {
-            waitpid(commands[i]->pid, nullptr, 0);
+    bool launched = commands.back()->pid > 0 || inproc_last;
+    size_t running = 0;
+    for (auto cmd : commands) {
+        running += cmd->pid > 0;
+    }
+    while (running != 0) {
+        int st;
+        struct rusage ru;
+        pid_t p = wait4(-1, &st, 0, &ru);
+        if (p < 0 && errno == EINTR) {
+            continue;
+        } else if (p < 0) {
+            break;
         }
+        auto it = std::find_if(commands.begin(), commands.end(),
+                               [&] (command* c) { return c->pid == p; });
+        if (it == commands.end()) {
+            job_exited(p);
+            continue;
+        }
+        if (*it == commands.back()) {
+            status = st;
+        }
+        if (usage) {
+            (*usage)[it - commands.begin()].ru = ru;
+        }
+        --running;
     }
 
     // Cleanup commands
-    for (auto cmd : commands) {
-        delete cmd;
-    }
+    cleanup();
 
+    if (!launched) {
+        return 1;
+    } else if (inproc_last) {
+        return inproc_status;
+    }
     return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
 }
 
-int run_conditional(shell_parser conditional) {
+int run_conditional(shell_program& prog, size_t pc, size_t end) {
     int last_status = 0;
-    shell_parser pipeline = conditional.first_pipeline();
-    int prev_operator = TYPE_SEQUENCE;
     
-    while (pipeline) {
-        int next_operator = pipeline.op();
+    while (pc != end) {
+        assert(prog.code[pc] == OP_PIPELINE);
+        int prev_operator = prog.code[pc + 1];
+        size_t next = prog.code[pc + 2];
         bool should_run = true;
 
         if (prev_operator == TYPE_AND && last_status != 0) {
@@ -260,68 +2010,223 @@ int run_conditional(shell_parser conditional) {
         }
 
         if (should_run) {
-            last_status = run_pipeline(pipeline);
+            last_status = run_pipeline(prog, pc + 3, next);
         }
 
-        prev_operator = next_operator;
-        pipeline.next_pipeline();
+        pc = next;
     }
 
     return last_status;
 }
 
-void run_list(shell_parser parser) {
-    shell_parser conditional = parser.first_conditional();
-    
-    while (conditional) {
-        bool is_background = (conditional.op() == TYPE_BACKGROUND);
+// Run the conditionals at [pc, end). Returns the status of the last one
+// run in the foreground, or 0.
+int run_list(shell_program& prog, size_t pc, size_t end) {
+    int status = 0;
+    while (pc != end) {
+        assert(prog.code[pc] == OP_CONDITIONAL);
+        bool is_background = prog.code[pc + 1];
+        size_t next = prog.code[pc + 2];
         
         if (is_background) {
+            if (bg_limit != 0) {
+                reap_jobs(bg_limit - 1);
+            }
             pid_t bg_pid = fork();
             if (bg_pid < 0) {
                 perror("fork");
-                return;
+                return 1;
             }
             
             if (bg_pid == 0) {
                 setpgid(0, 0);  // Put in its own process group
-                _exit(run_conditional(conditional));
+                _exit(run_conditional(prog, pc + 3, next));
             }
+            bg_jobs.push_back(bg_pid);
+            status = 0;
         } 
         else {
-            run_conditional(conditional);
+            status = run_conditional(prog, pc + 3, next);
         }
         
-        conditional.next_conditional();
+        pc = next;
+    }
+    return status;
+}
+
+
+// input_buffer
+//    Command input, read in large chunks. Lines are parsed in place, and
+//    a line too long for the buffer makes it grow, so lines of any length
+//    arrive whole.
+struct input_buffer {
+    std::vector<char> buf = std::vector<char>(65536);
+    size_t head = 0;            // start of unconsumed input
+    size_t tail = 0;            // end of input read so far
+    size_t scanned = 0;         // bytes after `head` without a newline
+    bool eof = false;
+
+    const char* data() const {
+        return &buf[head];
+    }
+
+    // Return the length of the next complete line, or 0 if there is none
+    size_t line() {
+        size_t len = next_line(data(), tail - head, eof, scanned);
+        scanned = len ? 0 : tail - head;
+        return len;
+    }
+    void consume(size_t n) {
+        head += n;
+    }
+
+    // Read more input from `fd`. Returns the number of bytes read
+    // (0 at end of file), or -1 on error.
+    ssize_t fill(int fd);
+};
+
+ssize_t input_buffer::fill(int fd) {
+    if (head != 0) {
+        memmove(buf.data(), &buf[head], tail - head);
+        tail -= head;
+        head = 0;
+    }
+    if (tail == buf.size()) {
+        buf.resize(2 * buf.size());
+    }
+    ssize_t nr = read(fd, &buf[tail], buf.size() - tail);
+    if (nr > 0) {
+        tail += nr;
+    } else if (nr == 0) {
+        eof = true;
+    }
+    return nr;
+}
+
+// Run the script open on `fd`, a regular file
+static int run_script(int fd, shell_program& prog, bool quiet) {
+    input_buffer in;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        in.buf.resize(std::max(in.buf.size(), size_t(st.st_size) + 1));
+    }
+    while (!in.eof) {
+        if (in.fill(fd) < 0 && errno != EINTR) {
+            perror("sh61");
+            return 1;
+        }
+    }
+    std::string_view src(in.data(), in.tail);
+
+    uint64_t h = fnv1a_hash(src.data(), src.size());
+    std::string cache = program_cache_file(h);
+    if (cache.empty() || !program_cache_load(cache, src, h, prog)) {
+        const char* s = src.data();
+        size_t pos = 0, len;
+        while ((len = next_line(s + pos, src.size() - pos, true)) != 0) {
+            const char* e = find_heredocs(s + pos, s + pos + len,
+                                          s + src.size(), true, nullptr);
+            prog.compile_line(s + pos, s + pos + len, e);
+            pos = e - s;
+        }
+        if (!cache.empty()) {
+            program_cache_save(cache, src, h, prog);
+        }
+    }
+
+    for (size_t i = 0; i + 1 < prog.lines.size(); ++i) {
+        reap_jobs(SIZE_MAX);
+        if (!quiet) {
+            printf("sh61[%d]$ ", getpid());
+            fflush(stdout);
+        }
+        run_list(prog, prog.lines[i], prog.lines[i + 1]);
     }
+    reap_jobs(SIZE_MAX);
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
-    FILE* command_file = stdin;
+    int command_fd = STDIN_FILENO;
     bool quiet = false;
 
-    if (argc > 1 && strcmp(argv[1], "-q") == 0) {
-        quiet = true;
+    while (argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+        if (strcmp(argv[1], "-q") == 0) {
+            quiet = true;
+        } else if (strcmp(argv[1], "-B") == 0 && argc > 2) {
+            char* end;
+            long n = strtol(argv[2], &end, 10);
+            if (end == argv[2] || *end || n <= 0 || n > INT_MAX) {
+                fprintf(stderr, "sh61: bad pipe size %s\n", argv[2]);
+                return 1;
+            }
+            pipe_capacity = n;
+            --argc, ++argv;
+        } else {
+            fprintf(stderr, "Usage: sh61 [-q] [-B SIZE] [FILE]\n");
+            return 1;
+        }
         --argc, ++argv;
     }
 
     if (argc > 1) {
-        command_file = fopen(argv[1], "rb");
-        if (!command_file) {
+        command_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (command_fd < 0) {
             perror(argv[1]);
             return 1;
         }
     }
 
     claim_foreground(0);
+    find_inherited_fds();
+    const char* profile = getenv("SH61_PROFILE");
+    profile_all = profile && *profile;
+
     set_signal_handler(SIGTTOU, SIG_IGN);
+    set_signal_handler(SIGPIPE, SIG_IGN);
+    set_signal_handler(SIGCHLD, sigchld_handler);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+
+    // Scripts in regular files are compiled whole, or loaded from the
+    // cache, and then run line by line
+    shell_program prog;
+    struct stat st;
+    if (command_fd != STDIN_FILENO && fstat(command_fd, &st) == 0
+        && S_ISREG(st.st_mode)) {
+        int r = run_script(command_fd, prog, quiet);
+        close(command_fd);
+        return r;
+    }
 
-    char buf[BUFSIZ];
-    int bufpos = 0;
+    // Read commands straight from the file descriptor. While the shell
+    // waits for input, a signalfd reports exiting background jobs, so
+    // they are reaped at once rather than at the next prompt.
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    input_buffer in;
     bool needprompt = true;
 
-    while (!feof(command_file)) {
-        while (waitpid(-1, nullptr, WNOHANG) > 0) {}
+    while (true) {
+        // Run the next complete line, once its heredocs have arrived
+        size_t len = in.line();
+        const char* e = len ? find_heredocs(in.data(), in.data() + len,
+                                            in.data() + (in.tail - in.head),
+                                            in.eof, nullptr)
+            : nullptr;
+        if (e) {
+            prog.clear();
+            prog.compile_line(in.data(), in.data() + len, e);
+            run_list(prog, 0, prog.code.size());
+            in.consume(e - in.data());
+            needprompt = true;
+            continue;
+        } else if (in.eof) {
+            break;
+        }
+
+        reap_jobs(SIZE_MAX);
 
         if (needprompt && !quiet) {
             printf("sh61[%d]$ ", getpid());
@@ -329,31 +2234,38 @@ int main(int argc, char* argv[]) {
             needprompt = false;
         }
 
-        if (fgets(&buf[bufpos], BUFSIZ - bufpos, command_file) == nullptr) {
-            if (ferror(command_file) && errno == EINTR) {
-                clearerr(command_file);
-                buf[bufpos] = 0;
-            } else {
-                if (ferror(command_file)) {
-                    perror("sh61");
-                }
-                break;
+
+        pollfd pfd[2] = {{command_fd, POLLIN, 0}, {sigfd, POLLIN, 0}};
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            perror("sh61");
+            break;
         }
-
-        bufpos = strlen(buf);
-        if (bufpos == BUFSIZ - 1 || (bufpos > 0 && buf[bufpos - 1] == '\n')) {
-            run_list(shell_parser{buf});
-            bufpos = 0;
-            needprompt = true;
+        if (pfd[1].revents) {
+            signalfd_siginfo si;
+            while (read(sigfd, &si, sizeof(si)) == ssize_t(sizeof(si))) {
+            }
+            reap_jobs(SIZE_MAX);
+        }
+        if (pfd[0].revents) {
+            if (in.fill(command_fd) < 0
+                && errno != EINTR && errno != EAGAIN) {
+                perror("sh61");
+                break;
+            }
         }
     }
 
-    while (waitpid(-1, nullptr, WNOHANG) > 0) {}
+    reap_jobs(SIZE_MAX);
 
-    if (command_file != stdin) {
-        fclose(command_file);
+    if (sigfd >= 0) {
+        close(sigfd);
+    }
+    if (command_fd != STDIN_FILENO) {
+        close(command_fd);
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -9,7 +9,7 @@
 #include <unistd.h>
 
 #define TYPE_NORMAL        0   // normal command word
-#define TYPE_REDIRECT_OP   1   // redirection operator (>, <, 2>)
+#define TYPE_REDIRECT_OP   1   // redirection operator (>, <, 2>, <<, <<<)
 
 // All other tokens are control operators that terminate the current command.
 #define TYPE_SEQUENCE      2   // `;` sequence operator or end of command line
@@ -65,6 +65,14 @@ struct shell_parser {
     // Return `shell_tokenizer` that navigates by tokens within a command
     shell_tokenizer first_token() const;
 
+    // Test if the current command is a group, `( LIST )` or `{ LIST; }`.
+    // Returns '(' or '{' if so, setting `*body` to navigate the list
+    // inside and `*rest` to the tokens after the group; returns -1 if the
+    // group isn't closed, and 0 if the command isn't a group. Navigation
+    // functions treat a group as a unit, so operators inside it don't
+    // split the regions around it.
+    int group(shell_parser* body, shell_tokenizer* rest) const;
+
 private:
     const char* _s;
     const char* _stop;
@@ -72,6 +80,8 @@ private:
 
     shell_parser first_delimited(unsigned long fl) const;
     void next_delimited(unsigned long fl);
+    static void skip_delimited(shell_tokenizer& it, unsigned long fl);
+    static int group_delta(const shell_tokenizer& it, bool start);
     shell_parser(const char* first, const char* stop, const char* last);
 };
 
@@ -90,6 +100,17 @@ struct shell_tokenizer {
     // Return the current token’s contents as a string
     std::string str() const;
 
+    // Copy the current token’s contents, null-terminated, into `buf`,
+    // which must have room for `raw_size() + 1` bytes. Returns the
+    // length of the contents.
+    size_t copy(char* buf) const;
+
+    // Return the length of the current token as written, quotes and all
+    inline constexpr size_t raw_size() const;
+
+    // Return a pointer to the current token as written
+    inline constexpr const char* raw_data() const;
+
     // Return the current token’s type
     inline constexpr int type() const;
     const char* type_name() const;
@@ -156,4 +177,12 @@ inline constexpr int shell_tokenizer::type() const {
     return _type;
 }
 
+inline constexpr size_t shell_tokenizer::raw_size() const {
+    return _len;
+}
+
+inline constexpr const char* shell_tokenizer::raw_data() const {
+    return _s;
+}
+
 #endif
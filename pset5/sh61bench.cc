@@ -0,0 +1,249 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+// Shell throughput benchmarks. Run `make bench`, or `./sh61bench [-n N]
+// [-t TRIALS] [-s SHELL]... [WORKLOAD...]`. Each workload is a generated
+// script of about N commands; each trial runs it as `SHELL SCRIPT`, and
+// the median trial is reported as one line of JSON in the format of the
+// pset4 profiler, plus the workload, the shell, and commands per second.
+// SHELL may include arguments; the default is `./sh61 -q`. Compare other
+// shells with `-s ./sh61\ -q -s bash -s dash`. Like check.pl, run it
+// from a terminal: sh61 claims the foreground of its controlling tty.
+
+static unsigned long ncommands = 2000;
+static unsigned ntrials = 5;
+static std::string scratch;     // directory for scripts and redirections
+
+struct workload {
+    const char* name;
+    // Append about `n` commands to `script`; return the exact count
+    unsigned long (*generate)(std::string& script, unsigned long n);
+};
+
+// sequential trivial commands, each its own fork and exec
+static unsigned long generate_seq(std::string& script, unsigned long n) {
+    for (unsigned long i = 0; i != n; ++i) {
+        script += "/bin/true\n";
+    }
+    return n;
+}
+
+// wide pipelines: 64 stages, all running at once
+static unsigned long generate_pipeline(std::string& script, unsigned long n) {
+    unsigned long lines = std::max(n / 64, 1UL);
+    for (unsigned long i = 0; i != lines; ++i) {
+        script += "/bin/echo x";
+        for (int j = 1; j != 63; ++j) {
+            script += " | /bin/cat";
+        }
+        script += " | /bin/cat > /dev/null\n";
+    }
+    return lines * 64;
+}
+
+// deep `&&` chains: 64 commands per conditional
+static unsigned long generate_andchain(std::string& script, unsigned long n) {
+    unsigned long lines = std::max(n / 64, 1UL);
+    for (unsigned long i = 0; i != lines; ++i) {
+        script += "/bin/true";
+        for (int j = 1; j != 64; ++j) {
+            script += " && /bin/true";
+        }
+        script += "\n";
+    }
+    return lines * 64;
+}
+
+// every command opens files for all three standard descriptors
+static unsigned long generate_redirect(std::string& script, unsigned long n) {
+    std::string a = scratch + "/a.txt", b = scratch + "/b.txt";
+    script += "/bin/echo x > " + a + "\n";
+    for (unsigned long i = 1; i < n; ++i) {
+        script += "/bin/cat < " + a + " > " + b + " 2> /dev/null\n";
+    }
+    return std::max(n, 1UL);
+}
+
+// background jobs, launched without waiting
+static unsigned long generate_background(std::string& script, unsigned long n) {
+    for (unsigned long i = 0; i != n; ++i) {
+        script += "/bin/true &\n";
+    }
+    return n;
+}
+
+static const workload workloads[] = {
+    { "seq", generate_seq },
+    { "pipeline", generate_pipeline },
+    { "andchain", generate_andchain },
+    { "redirect", generate_redirect },
+    { "background", generate_background }
+};
+
+struct trial {
+    double time;
+    rusage usage;
+    int status;
+};
+
+// Split a shell specification like "./sh61 -q" into words
+static std::vector<std::string> split_words(const char* spec) {
+    std::vector<std::string> words;
+    const char* s = spec;
+    while (*s) {
+        size_t n = strcspn(s, " \t");
+        if (n) {
+            words.emplace_back(s, n);
+        }
+        s += n + strspn(s + n, " \t");
+    }
+    return words;
+}
+
+static double timestamp() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run `shell` on `script` once, with standard input from /dev/null and
+// standard output discarded
+static trial run_trial(const std::vector<std::string>& shell,
+                       const std::string& script) {
+    std::vector<const char*> argv;
+    for (auto& w : shell) {
+        argv.push_back(w.c_str());
+    }
+    argv.push_back(script.c_str());
+    argv.push_back(nullptr);
+
+    trial t;
+    double t0 = timestamp();
+    pid_t p = fork();
+    if (p == 0) {
+        int fd = open("/dev/null", O_RDWR);
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+        execvp(argv[0], const_cast<char**>(argv.data()));
+        fprintf(stderr, "sh61bench: %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    if (p < 0 || wait4(p, &t.status, 0, &t.usage) != p) {
+        perror("sh61bench");
+        exit(1);
+    }
+    t.time = timestamp() - t0;
+    return t;
+}
+
+static void run(const workload& w, const char* shell) {
+    std::string script;
+    unsigned long n = w.generate(script, ncommands);
+    std::string fn = scratch + "/" + w.name + ".sh";
+    FILE* f = fopen(fn.c_str(), "w");
+    if (!f || fwrite(script.data(), 1, script.size(), f) != script.size()
+        || fclose(f) != 0) {
+        perror(fn.c_str());
+        exit(1);
+    }
+
+    std::vector<std::string> words = split_words(shell);
+    std::vector<trial> trials;
+    for (unsigned i = 0; i != ntrials; ++i) {
+        trials.push_back(run_trial(words, fn));
+    }
+    std::sort(trials.begin(), trials.end(), [] (const trial& a, const trial& b) {
+        return a.time < b.time;
+    });
+    const trial& t = trials[trials.size() / 2];
+
+    std::string shell_json;
+    for (const char* s = shell; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            shell_json += '\\';
+        }
+        shell_json += *s;
+    }
+    printf("{\"bench\":\"%s\", \"shell\":\"%s\", \"commands\":%lu, "
+           "\"time\":%.6f, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, "
+           "\"maxrss\":%ld, \"commands_per_sec\":%.1f, \"status\":%d, "
+           "\"trials\":%u}\n",
+           w.name, shell_json.c_str(), n, t.time,
+           t.usage.ru_utime.tv_sec, (long) t.usage.ru_utime.tv_usec,
+           t.usage.ru_stime.tv_sec, (long) t.usage.ru_stime.tv_usec,
+           t.usage.ru_maxrss, n / t.time,
+           WIFEXITED(t.status) ? WEXITSTATUS(t.status) : 128 + WTERMSIG(t.status),
+           ntrials);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    std::vector<const char*> shells;
+    int ch;
+    while ((ch = getopt(argc, argv, "n:t:s:")) != -1) {
+        if (ch == 'n') {
+            ncommands = strtoul(optarg, nullptr, 0);
+        } else if (ch == 't') {
+            ntrials = strtoul(optarg, nullptr, 0);
+        } else if (ch == 's') {
+            shells.push_back(optarg);
+        } else {
+            fprintf(stderr, "Usage: sh61bench [-n N] [-t TRIALS] [-s SHELL]... [WORKLOAD...]\n");
+            return 1;
+        }
+    }
+    if (shells.empty()) {
+        shells.push_back("./sh61 -q");
+    }
+    if (ncommands == 0 || ntrials == 0) {
+        fprintf(stderr, "sh61bench: -n and -t must be positive\n");
+        return 1;
+    }
+
+    const char* tmpdir = getenv("TMPDIR");
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/sh61bench.XXXXXX",
+             tmpdir && *tmpdir ? tmpdir : "/tmp");
+    if (!mkdtemp(dir)) {
+        perror("sh61bench");
+        return 1;
+    }
+    scratch = dir;
+
+    bool any = false;
+    for (const workload& w : workloads) {
+        bool wanted = optind == argc;
+        for (int i = optind; i < argc; ++i) {
+            wanted = wanted || strcmp(argv[i], w.name) == 0;
+        }
+        if (wanted) {
+            for (const char* shell : shells) {
+                run(w, shell);
+            }
+            any = true;
+        }
+    }
+
+    for (const workload& w : workloads) {
+        unlink((scratch + "/" + w.name + ".sh").c_str());
+    }
+    unlink((scratch + "/a.txt").c_str());
+    unlink((scratch + "/b.txt").c_str());
+    rmdir(dir);
+    if (!any) {
+        fprintf(stderr, "sh61bench: no such workload\n");
+        return 1;
+    }
+}
@@ -497,6 +497,71 @@ if (testid_runnable("FTX5")) {
     run_one_check("./ftxxfer bigaccounts.fdb", "./diff-ftxdb.pl bigaccounts.fdb");
 }
 
+if (testid_runnable("FTX6")) {
+    print OUT "\n${Cyan}Test FTX6: ./ftxrocket -L check...${Off}\n";
+    run_one_check("./ftxrocket -L", "./diff-ftxdb.pl");
+}
+
+if (testid_runnable("FTX7")) {
+    print OUT "\n${Cyan}Test FTX7: ./ftxxfer -m check...${Off}\n";
+    run_one_check("./ftxxfer -m", "./diff-ftxdb.pl");
+}
+
+if (testid_runnable("FTX8")) {
+    print OUT "\n${Cyan}Test FTX8: ./ftxblockchain -c check...${Off}\n";
+    run_one_check("./ftxblockchain -c", "./diff-ftxdb.pl -l");
+}
+
+if (testid_runnable("FTX9")) {
+    print OUT "\n${Cyan}Test FTX9: ./ftxxfer -f -n 1000000 check...${Off}\n";
+    run_one_check("./ftxxfer -f -n 1000000", "./diff-ftxdb.pl");
+}
+
+if (testid_runnable("FTX10")) {
+    print OUT "\n${Cyan}Test FTX10: ./ftxrocket -O -J2 check...${Off}\n";
+    run_one_check("./ftxrocket -O -J2", "./diff-ftxdb.pl");
+}
+
+if (testid_runnable("FTX11")) {
+    print OUT "\n${Cyan}Test FTX11: ./ftxxfer -w check...${Off}\n";
+    run_one_check("./ftxxfer -w -n 20000", "./diff-ftxdb.pl");
+}
+
+if (testid_runnable("FTX12")) {
+    print OUT "\n${Cyan}Test FTX12: ./ftxblockchain -L check...${Off}\n";
+    run_one_check("./ftxblockchain -L", "./diff-ftxdb.pl -l");
+}
+
+if (testid_runnable("FTX13")) {
+    print OUT "\n${Cyan}Test FTX13: ./ftxrocket -Z 1.1 check...${Off}\n";
+    run_one_check("./ftxrocket -Z 1.1", "./diff-ftxdb.pl");
+}
+
+if (testid_runnable("FTX14")) {
+    print OUT "\n${Cyan}Test FTX14: ./ftxxfer -k 16 check...${Off}\n";
+    run_one_check("./ftxxfer -k 16", "./diff-ftxdb.pl");
+}
+
+if (testid_runnable("FTX15")) {
+    print OUT "\n${Cyan}Test FTX15: ./ftxxfer -P 4 -L check...${Off}\n";
+    run_one_check("./ftxxfer -P 4 -L", "cat /tmp/newaccounts.fdb.0 /tmp/newaccounts.fdb.1 /tmp/newaccounts.fdb.2 /tmp/newaccounts.fdb.3 | ./diff-ftxdb.pl accounts.fdb -");
+}
+
+if (testid_runnable("FTX16")) {
+    print OUT "\n${Cyan}Test FTX16: two ./ftxxfer -x -M processes check...${Off}\n";
+    run_one_check("cp accounts.fdb /tmp/newaccounts.fdb && { ./ftxxfer -x -M /tmp/newaccounts.fdb & ./ftxxfer -x -M /tmp/newaccounts.fdb && wait \$!; }", "./diff-ftxdb.pl");
+}
+
+if (testid_runnable("FTX17")) {
+    print OUT "\n${Cyan}Test FTX17: ./ftxxfer -V check...${Off}\n";
+    run_one_check("./ftxxfer -V -n 20000", "./diff-ftxdb.pl");
+}
+
+if (testid_runnable("FTX18")) {
+    print OUT "\n${Cyan}Test FTX18: ./ftxxfer -c -k 16 -V check...${Off}\n";
+    run_one_check("./ftxxfer -c -k 16 -V", "./diff-ftxdb.pl");
+}
+
 
 set_param("SAN", 1);
 
@@ -0,0 +1,182 @@
+#include "ftxdb.hh"
+#include <chrono>
+#include <thread>
+#include <mutex>
+
+// Usage: ./ftxbench [-j MAXTHREADS] [-n NOPS] [-A] [-L] [-m] [-c] [-f] [-w]
+//                   [-Z S|-H PCT|-S] [FILE...]
+//    Transfer throughput and latency benchmarks. Run `make bench`. For
+//    each FILE (default accounts.fdb), each thread count 1, 2, 4, ...,
+//    MAXTHREADS (default 64), and each workload, run NOPS transfers per
+//    thread on a fresh copy of FILE and print one line of JSON with
+//    transfers per second and per-transfer latency percentiles. The
+//    workload is the one `-Z`, `-H`, or `-S` selects (see
+//    `ftx_workload`); without them, uniform, a 90% hotspot on accounts
+//    0-2, and Zipf 0.99 are each run. Transfers lock as ftxrocket does,
+//    without its modeled delay; `-A` pins them to CPUs; the other flags
+//    select the `ftx_db` mode, as in the ftx programs.
+
+
+// latency_histogram
+//    Counts of latencies in nanoseconds, in buckets with 1/8-power-of-two
+//    resolution: values below 16 have their own buckets, and each larger
+//    power of two is split into 8.
+
+struct alignas(64) latency_histogram {
+    static constexpr unsigned nbuckets = 16 + 60 * 8;
+    unsigned long count[nbuckets] = {};
+    unsigned long total = 0;
+
+    static unsigned bucket(unsigned long ns) {
+        if (ns < 16) {
+            return ns;
+        }
+        unsigned e = 63 - __builtin_clzl(ns);
+        return 16 + (e - 4) * 8 + ((ns >> (e - 3)) & 7);
+    }
+    // Largest latency that falls in bucket `b`
+    static unsigned long bucket_max(unsigned b) {
+        if (b < 16) {
+            return b;
+        }
+        unsigned e = (b - 16) / 8 + 4;
+        return ((8UL + (b - 16) % 8 + 1) << (e - 3)) - 1;
+    }
+
+    void add(unsigned long ns) {
+        ++this->count[bucket(ns)];
+        ++this->total;
+    }
+    void merge(const latency_histogram& h) {
+        for (unsigned b = 0; b != nbuckets; ++b) {
+            this->count[b] += h.count[b];
+        }
+        this->total += h.total;
+    }
+    // Latency below which fraction `p` of the samples fall (an upper
+    // bound within the bucket's resolution)
+    unsigned long percentile(double p) const {
+        unsigned long rank = std::max(1UL, (unsigned long) (p * this->total + 0.5));
+        unsigned long seen = 0;
+        for (unsigned b = 0; b != nbuckets; ++b) {
+            seen += this->count[b];
+            if (seen >= rank) {
+                return bucket_max(b);
+            }
+        }
+        return 0;
+    }
+};
+
+
+static bool lockfree;
+
+// workloads swept when no `-Z`, `-H`, or `-S` is given
+static const std::pair<ftx_workload::kind_type, double> default_workloads[] = {
+    {ftx_workload::uniform, 0},
+    {ftx_workload::hotspot, 90},
+    {ftx_workload::zipf, 0.99}
+};
+
+static void bench_thread(ftx_db& db, const ftx_workload& workload,
+                         size_t nops, latency_histogram& hist,
+                         unsigned seed) {
+    std::mt19937 randomness(seed);
+    ftx_workload::picker picker(workload, randomness());
+    std::normal_distribution pick_amount(100.0, 10.0);
+
+    for (size_t i = 0; i != nops; ++i) {
+        size_t aindex[2];
+        picker.pick(aindex);
+        long amount = pick_amount(randomness);
+
+        auto t0 = std::chrono::steady_clock::now();
+        if (db.binary && lockfree) {
+            db.transfer(aindex[0], aindex[1], amount);
+        } else {
+            ftx_acct acct1{db, aindex[0]};
+            ftx_acct acct2{db, aindex[1]};
+            db.lock_accounts(aindex);
+            long bal[2];
+            acct1.read(nullptr, 0, &bal[0]);
+            acct2.read(nullptr, 0, &bal[1]);
+            long delta = std::min(bal[0], amount);
+            delta = std::min(delta, 9999999 - bal[1]);
+            ftx_update update[2] = {
+                {aindex[0], bal[0] - delta}, {aindex[1], bal[1] + delta}
+            };
+            off_t lsn = db.commit(update, 2);
+            db.unlock_accounts(aindex);
+            db.sync(lsn);
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        hist.add(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+    }
+}
+
+static void run_bench(io61_args& args, const char* file, int nthreads,
+                      ftx_workload::kind_type kind, double param) {
+    args.input_file = file;
+    args.input_files.assign(1, file);
+    ftx_db* db = ftx_db::open_args(args);
+    ftx_workload workload(db->naccounts, kind, param);
+    std::random_device seed_randomness;
+
+    std::vector<latency_histogram> hists(nthreads);
+    std::vector<std::thread> th(nthreads);
+    double start_time = monotonic_timestamp();
+    for (int i = 0; i != nthreads; ++i) {
+        th[i] = std::thread(bench_thread, std::ref(*db), std::cref(workload),
+                            args.noperations, std::ref(hists[i]),
+                            seed_randomness());
+        if (args.affinity) {
+            pin_thread(th[i].native_handle(), i);
+        }
+    }
+    latency_histogram hist;
+    for (int i = 0; i != nthreads; ++i) {
+        th[i].join();
+        hist.merge(hists[i]);
+    }
+    double end_time = monotonic_timestamp();
+    delete db;
+
+    double t = end_time - start_time;
+    printf("{\"bench\":\"ftx\", \"file\":\"%s\", \"accounts\":%zu, "
+           "\"threads\":%d, \"workload\":\"%s\", \"operations\":%lu, "
+           "\"time\":%.6f, \"ops_per_sec\":%.0f, \"p50_ns\":%lu, "
+           "\"p90_ns\":%lu, \"p99_ns\":%lu, \"max_ns\":%lu}\n",
+           file, workload.naccounts, nthreads, workload.name().c_str(),
+           hist.total, t, hist.total / t, hist.percentile(0.5),
+           hist.percentile(0.9), hist.percentile(0.99), hist.percentile(1.0));
+    fflush(stdout);
+}
+
+
+int main(int argc, char* argv[]) {
+    io61_args args = io61_args("j:n:LmcfwZ:H:SAP:#").set_nthreads(64)
+        .set_noperations(20'000)
+        .parse(argc, argv);
+    lockfree = args.lockfree;
+    std::vector<const char*> files = args.input_files;
+    if (!files[0]) {
+        files[0] = "accounts.fdb";
+    }
+
+    std::vector<std::pair<ftx_workload::kind_type, double>> workloads;
+    if (args.zipf > 0 || args.hotspot > 0 || args.scan) {
+        ftx_workload w = ftx_workload::from_args(args, 2);
+        workloads.emplace_back(w.kind, w.param);
+    } else {
+        workloads.assign(std::begin(default_workloads),
+                         std::end(default_workloads));
+    }
+
+    for (const char* file : files) {
+        for (int n = 1; n <= args.nthreads; n *= 2) {
+            for (auto [kind, param] : workloads) {
+                run_bench(args, file, n, kind, param);
+            }
+        }
+    }
+}
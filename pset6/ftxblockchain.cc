@@ -3,34 +3,31 @@
 #include <thread>
 #include <mutex>
 
-// Usage: ./ftxblockchain [-j NTHREADS] [-n NOPS] [FILE]
+// Usage: ./ftxblockchain [-j NTHREADS] [-n NOPS] [-Z S|-H PCT|-S] [FILE]
 //    Perform NOPS * NTHREADS “bank transfers” within FILE, writing
-//    a ledger to LEDGER (defaults to ledger.db).
+//    a ledger to LEDGER (defaults to ledger.db). `-Z`, `-H`, and `-S`
+//    skew the accounts picked (see `ftx_workload`).
 
 static io61_file* ledgerf;
+static ftx_ledger* ledger;
 
-static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
-                            unsigned seed) {
+static void transfer_thread(ftx_db& db, const ftx_workload& workload,
+                            size_t nops, size_t& opcount, unsigned seed) {
     // Obtain a source of random account numbers
     std::default_random_engine randomness(seed);
-    std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
+    ftx_workload::picker picker(workload, randomness());
     std::normal_distribution pick_amount(100.0, 10.0);
 
     size_t i = 0;
     while (i != nops) {
-        // Pick two random accounts for transfer
-        size_t aindex[2] = {
-            pick_account(randomness), pick_account(randomness)
-        };
-        if (aindex[0] == aindex[1]) {
-            continue;
-        }
+        // Pick two accounts for transfer
+        size_t aindex[2];
+        picker.pick(aindex);
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        // Lock both accounts at once (`lock_accounts` orders them)
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        db.lock_accounts(aindex);
 
         // Read current balances
         char name1[16], name2[16];
@@ -51,14 +48,14 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
         acct1.write(bal[0]);
         acct2.write(bal[1]);
 
-        // Write to ledger
+        // Write to ledger; the locks keep it in transaction order
         char report[128];
         size_t n = snprintf(report, sizeof(report),
                             "%-7s %+7ld\n%-7s %+7ld\n",
                             name1, -delta, name2, +delta);
         assert(n == db.asize * 2 && n < sizeof(report));
-        ssize_t np = io61_write(ledgerf, report, n);
-        assert(np == ssize_t(n));
+        ledger->append(report, n);
+        db.unlock_accounts(aindex);
 
         ++i;
     }
@@ -68,38 +65,46 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("i:D:j:n:").set_nthreads(4)
+    io61_args args = io61_args("i:D:j:n:LmcZ:H:SAP:").set_nthreads(4)
         .set_noperations(100'000)
         .parse(argc, argv);
 
     // Allocate buffer, open account database and ledger file
     ftx_db* db = ftx_db::open_args(args);
     args.after_open(db->f, O_RDWR);
+    ftx_workload workload = ftx_workload::from_args(args, db->naccounts);
     if (!args.output_file) {
         args.output_file = "/tmp/ledger.fdb";
     }
     ledgerf = io61_open_check(args.output_file, O_WRONLY | O_CREAT | O_TRUNC);
     args.after_open(ledgerf, O_WRONLY);
+    ledger = new ftx_ledger(ledgerf);
     std::random_device seed_randomness;
     double start_time = monotonic_timestamp();
 
     // Run transfers
     std::vector<std::thread> th(args.nthreads);
-    std::vector<size_t> opcounts(args.nthreads, 0);
+    std::vector<ftx_padded<size_t>> opcounts(args.nthreads);
     for (int i = 0; i != args.nthreads; ++i) {
         th[i] = std::thread(transfer_thread, std::ref(*db),
-                            args.noperations, std::ref(opcounts[i]),
-                            seed_randomness());
+                            std::cref(workload), args.noperations,
+                            std::ref(opcounts[i].value), seed_randomness());
+        if (args.affinity) {
+            pin_thread(th[i].native_handle(), i);
+        }
     }
 
     size_t totalops = 0;
     for (int i = 0; i != args.nthreads; ++i) {
         th[i].join();
-        totalops += opcounts[i];
+        totalops += opcounts[i].value;
     }
 
     // Flush and close
     delete db;
+    int lr = ledger->flush();
+    assert(lr == 0);
+    delete ledger;
     io61_close(ledgerf);
 
     double end_time = monotonic_timestamp();
@@ -1,27 +1,418 @@
 #ifndef FTXDB_HH
 #define FTXDB_HH
 #include "io61.hh"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <random>
+#include <set>
+#include <shared_mutex>
+#include <span>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 struct ftx_acct;
+struct ftx_wal;
+struct ftx_snapshot;
+
+
+// ftx_padded<T>
+//    A `T` on cache lines of its own, for per-thread state that threads
+//    write side by side (like the ftx programs' operation counts).
+
+template <typename T>
+struct alignas(64) ftx_padded {
+    T value = T();
+};
+
+
+// ftx_update
+//    A new balance for one account.
+
+struct ftx_update {
+    size_t aindex;
+    long balance;
+};
+
+
+// ftx_run
+//    The text of a run of consecutive account records, at file offset `off`.
+
+struct ftx_run {
+    off_t off;
+    std::vector<char> text;
+};
+
+
+// ftx_acct_lock
+//    One entry of an `ftx_db`'s in-memory lock table, padded to a cache
+//    line so threads locking neighboring accounts don't share one.
+//    `version` counts writes to the account; `ftx_txn` uses it to detect
+//    conflicts.
+
+struct alignas(64) ftx_acct_lock {
+    std::shared_mutex m;
+    std::atomic<unsigned long> version = 0;
+};
+
+
+// ftx_acct_history
+//    An account's versions, for snapshots. `epoch` is the commit epoch
+//    of the current balance, or `pending` while a commit is writing it.
+//    `old` lists earlier balances, newest first, each with the epoch
+//    that wrote it; writers keep them only while a snapshot might
+//    need them.
+
+struct ftx_version {
+    uint64_t epoch;
+    long balance;
+    ftx_version* next;
+};
+
+struct ftx_acct_history {
+    static constexpr uint64_t pending = ~uint64_t(0);
+    std::atomic<uint64_t> epoch = 0;
+    uint64_t prev_epoch = 0;             // writer's, under the account lock
+    std::atomic<ftx_version*> old = nullptr;
+
+    ftx_acct_history() = default;
+    ~ftx_acct_history();
+    ftx_acct_history(const ftx_acct_history&) = delete;
+    ftx_acct_history& operator=(const ftx_acct_history&) = delete;
+};
 
 
 // ftx_db
 //    Structure representing an open account database.
+//
+//    Accounts are fixed-size records, so threads of this process lock
+//    them through `locks`, indexed by account number, without touching
+//    any file-wide state. With `range_locks` (`-L`), accounts are also
+//    locked with io61 range locks, which protect the file from other
+//    processes that `io61_share` it too (`-x`). `lock_accounts` locks a whole set of accounts at
+//    once, in account order, with one `io61_lock_many` call. The lock
+//    table, like the binary-mode dirty bitmap, comes from io61's
+//    allocator (`io61_array`), next to the files' caches.
+//
+//    In mmap mode (`-m`), `map` points at the whole file, mapped shared,
+//    and accounts are read and written there directly rather than
+//    through io61. The destructor `msync`s the mapping.
+//
+//    In binary mode (`-c`), the constructor parses every record once into
+//    `balances` and `names`, and accounts are read and written there.
+//    Writes mark their records `dirty`; `write_back` turns runs of dirty
+//    records back into text, one write per run, and the destructor calls
+//    it.
+//
+//    WAL mode (`-w`, which implies `-c`) makes transfers crash-safe.
+//    `commit` logs each transaction's new balances to FILE.wal before
+//    storing them; the log is made durable in groups, and `sync` waits
+//    for it. A checkpointer thread writes logged changes to the account
+//    file every 100ms, after which that part of the log is dropped.
+//    Opening a database in place (`-M`) replays what a crash left in the
+//    log.
+//
+//    A sharded database (`-P N`) is split across several files, each
+//    holding a run of consecutive accounts behind its own `io61_file`,
+//    with its own cache and range-lock table. `ftx_acct` finds an
+//    account's shard, so the rest of the API is unchanged.
+//    `lock_accounts` locks accounts in account order, which is shard
+//    order, so transfers across shards are ordered two-phase locking.
+//
+//    `snapshot` returns a consistent view of every balance without
+//    locking anything (see `ftx_snapshot`). Each locked write -- through
+//    `commit`, and so `ftx_batch` and `ftx_txn`, or `ftx_acct::write` --
+//    is a commit with its own epoch from `epoch`. The writer marks its
+//    accounts `pending`, takes the epoch, saves their old balances in
+//    `history` if some snapshot is open, writes, and then stamps each
+//    account with the epoch. Lock-free `transfer`s are not versioned,
+//    so don't mix them with snapshots.
 
 struct ftx_db {
-    io61_file* f;              // the file
+    io61_file* f;              // the file (the first shard, if sharded)
+    std::vector<io61_file*> shards;   // files, in account order
+    std::vector<size_t> shard_base;   // first account in each shard
     size_t naccounts;          // number of accounts in the file
     size_t asize = 16;         // size of an account record
     size_t balance_offset = 8; // offset of balance field within record
     size_t balance_size = 7;   // size of balance field within record
     static constexpr size_t max_asize = 512; // maximum asize allowed
+    io61_array<ftx_acct_lock> locks;  // one per account
+    bool range_locks = false;  // also take io61 range locks
+    char* map = nullptr;       // mapped file, in mmap mode
+
+    // binary mode
+    bool binary = false;
+    long balance_min, balance_max;  // range the balance field can hold
+    mutable std::vector<std::atomic<long>> balances;
+    std::vector<char> names;        // name fields, `balance_offset` each
+    io61_array<std::atomic<uint64_t>> dirty;  // bitmap of records
+
+    // snapshots
+    static constexpr uint64_t no_snapshot = ~uint64_t(0);
+    mutable std::atomic<uint64_t> epoch = 0;  // newest commit epoch
+    io61_array<ftx_acct_history> history;     // one per account
+    std::mutex snapshot_m;
+    std::multiset<uint64_t> snapshot_epochs;  // open snapshots' epochs
+    mutable std::atomic<uint64_t> snapshot_min = no_snapshot;
+
+    // WAL mode
+    std::unique_ptr<ftx_wal> wal;
+    std::shared_mutex commit_m;     // `checkpoint` pauses `commit`s
+    std::thread checkpointer;
+    std::mutex checkpoint_m;
+    std::condition_variable checkpoint_cv;
+    bool checkpoint_stop = false;
+
+    static constexpr int mmap_flag = 1;
+    static constexpr int binary_flag = 2;
 
-    ftx_db(io61_file* f);
+    ftx_db(io61_file* f, int flags = 0);
+    ftx_db(std::vector<io61_file*> shards, int flags = 0);
     ~ftx_db();
     static ftx_db* open_args(const io61_args& args);
+
+    int write_back();
+    void lock_accounts(std::span<const size_t> aindexes);
+    void unlock_accounts(std::span<const size_t> aindexes);
+    inline long transfer(size_t from, size_t to, long amount);
+    inline size_t shard_of(size_t aindex) const;
+    inline size_t shard_end(size_t shard) const;
+
+    off_t commit(const ftx_update* updates, size_t n);
+    void sync(off_t lsn);
+    inline ftx_snapshot snapshot();
+
+    // bracket a commit's writes (for snapshots)
+    uint64_t begin_update(const ftx_update* updates, size_t n) const;
+    void end_update(const ftx_update* updates, size_t n, uint64_t e) const;
+    void open_wal(const char* filename, bool recover);
+    int checkpoint();
+
+  private:
+    void write_updates(const ftx_update* updates, size_t n);
+    int sync_files();
+    void collect_dirty(std::vector<ftx_run>& runs);
+    int write_runs(const std::vector<ftx_run>& runs);
+    void checkpoint_thread();
+};
+
+
+// ftx_wal
+//    A redo log of balance updates with group commit. `append` buffers a
+//    transaction and returns its end position; a flusher thread writes
+//    and `fdatasync`s everything buffered at once, and `sync` waits for
+//    a position to become durable.
+
+struct ftx_wal {
+    struct record {
+        uint32_t aindex;
+        int32_t balance;
+    };
+
+    explicit ftx_wal(const char* filename);
+    ~ftx_wal();
+
+    size_t replay(const std::function<void(size_t, long)>& apply);
+    int reset();
+    off_t append(const ftx_update* updates, size_t n);
+    off_t end();
+    off_t checkpointed();
+    void sync(off_t lsn);
+    int checkpoint(off_t lsn);
+
+  private:
+    static constexpr char magic[8] = {'F', 'T', 'X', 'W', 'A', 'L', '1', '\0'};
+    struct header {
+        char magic[8];
+        off_t checkpoint;
+    };
+    struct txn_header {
+        uint32_t n;
+        uint32_t hash;
+    };
+
+    int fd;
+    std::mutex m;
+    std::condition_variable cv;          // wakes the flusher
+    std::condition_variable durable_cv;  // wakes `sync`
+    std::vector<char> buf;               // appended, not yet written
+    off_t buf_start = 0;                 // log position of `buf`
+    off_t end_ = 0;
+    off_t durable = 0;
+    off_t checkpoint_ = 0;
+    bool stop = false;
+    std::thread flusher;
+
+    void flush_thread();
+};
+
+
+// ftx_snapshot
+//    A point-in-time view of an `ftx_db`'s balances: `read` returns an
+//    account's balance as of the commit epoch `epoch`, so every commit
+//    at or before it is wholly visible and every later one invisible.
+//    Reads take no locks and never block writers; a read of an account
+//    that a commit is writing at that moment waits for the commit to
+//    finish. While a snapshot is open, writers keep the old balances
+//    it might need, so close snapshots promptly.
+
+struct ftx_snapshot {
+    ftx_db& db;
+    uint64_t epoch;
+
+    explicit ftx_snapshot(ftx_db& db);
+    ~ftx_snapshot();
+
+    // snapshots can't be copied, moved, or assigned
+    ftx_snapshot(const ftx_snapshot&) = delete;
+    ftx_snapshot& operator=(const ftx_snapshot&) = delete;
+
+    long read(size_t aindex) const;
+    long total() const;
+
+  private:
+    uint64_t registered;        // entry in `db.snapshot_epochs`
+};
+
+
+// ftx_txn
+//    An optimistic transaction on an `ftx_db`. `read` records each
+//    account's version and balance without locking it, and `write`
+//    only buffers the new balance. `commit` then locks the accounts in
+//    order (shared for accounts only read), checks that no version has
+//    changed, and applies the writes; if some account changed, it
+//    applies nothing and returns false, and the caller should `reset`
+//    and try again. Locks are held only during `commit`.
+//
+//    `ftx_db::transfer` takes no locks, so don't mix it with `ftx_txn`.
+
+struct ftx_txn {
+    ftx_db& db;
+
+    inline ftx_txn(ftx_db& db);
+
+    inline long read(size_t aindex);
+    inline void write(size_t aindex, long balance);
+    inline bool commit();
+    inline void reset();
+
+  private:
+    struct entry {
+        size_t aindex;
+        unsigned long version;
+        long balance;
+        bool written;
+    };
+    std::vector<entry> entries;
+
+    inline entry* find(size_t aindex);
+};
+
+
+// ftx_batch
+//    A batch of transfers, executed together. `add` queues a transfer;
+//    `execute` locks every account the batch touches at once (with
+//    `lock_accounts`), applies the transfers in order to balances read
+//    once, and commits all the new balances together, after which the
+//    batch is empty. Each transfer moves as much of its amount as the
+//    source has and the destination can hold, as in the transfer
+//    programs. In text mode, `commit` writes each run of adjacent
+//    records with one `io61_pwrite`.
+
+struct ftx_batch {
+    ftx_db& db;
+    static constexpr long balance_limit = 9999999;
+
+    inline ftx_batch(ftx_db& db);
+
+    inline void add(size_t from, size_t to, long amount);
+    inline size_t size() const;
+    long execute();
+
+  private:
+    struct transfer {
+        size_t from;
+        size_t to;
+        long amount;
+    };
+    std::vector<transfer> transfers;
+    std::vector<size_t> aindexes;
+    std::vector<ftx_update> updates;   // sorted by account
+};
+
+
+// ftx_ledger
+//    An append-only ledger file written with group commit. `append`
+//    reserves the next range of file offsets with one atomic add and
+//    copies the record into an in-memory chunk; the thread that
+//    completes a chunk writes it to the file in one `pwrite`. Records
+//    appear in the order their offsets were reserved, so reserving
+//    while holding the affected accounts' locks keeps the ledger in
+//    transaction order. `flush` writes the partial chunk at the end,
+//    and must not run concurrently with `append`.
+
+struct ftx_ledger {
+    explicit ftx_ledger(io61_file* f);
+    ~ftx_ledger();
+
+    void append(const char* data, size_t n);
+    int flush();
+
+  private:
+    static constexpr size_t chunksz = 1 << 20;
+    static constexpr size_t nchunks = 8;
+    struct alignas(64) chunk {
+        std::atomic<off_t> base;         // file offset this chunk holds
+        std::atomic<size_t> filled = 0;  // bytes copied in so far
+        std::unique_ptr<char[]> buf;
+    };
+
+    int fd;
+    std::atomic<off_t> end = 0;          // next offset to reserve
+    std::atomic<int> error = 0;
+    chunk chunks[nchunks];
+};
+
+
+// ftx_workload
+//    How transfer programs pick accounts. `uniform` picks any two
+//    accounts. `zipf` (`-Z S`) picks account i with probability
+//    proportional to 1/(i+1)^S. `hotspot` (`-H PCT`) sends PCT% of
+//    transfers among accounts 0-2 and picks the rest uniformly. `scan`
+//    (`-S`) walks each thread through consecutive pairs of accounts,
+//    from a random start. A workload is shared; each thread picks with
+//    its own `picker`, which never returns the same account twice.
+
+struct ftx_workload {
+    enum kind_type { uniform, zipf, hotspot, scan };
+    kind_type kind;
+    double param;               // Zipf exponent or hotspot percentage
+    size_t naccounts;
+    std::vector<double> cdf;    // Zipf: chance account is <= i
+
+    ftx_workload(size_t naccounts, kind_type kind = uniform, double param = 0);
+    static ftx_workload from_args(const io61_args& args, size_t naccounts);
+    std::string name() const;
+
+    struct picker {
+        const ftx_workload& w;
+        std::mt19937 randomness;
+        std::uniform_int_distribution<size_t> pick_account;
+        std::uniform_real_distribution<double> pick_real;
+        size_t cursor;
+
+        inline picker(const ftx_workload& w, unsigned seed);
+        inline void pick(size_t aindex[2]);
+
+      private:
+        inline size_t pick_one();
+    };
 };
 
 
@@ -30,15 +421,21 @@ struct ftx_db {
 
 struct ftx_acct {
     const ftx_db& db;
-    off_t offset;
+    size_t aindex;
+    io61_file* f;              // file holding the account (its shard)
+    off_t offset;              // offset of the record in `f`
     bool locked = false;
 
     inline ftx_acct(const ftx_db& db, size_t aindex);
 
     inline void lock();
     inline void unlock();
+    inline void lock_shared();
+    inline void unlock_shared();
     inline int read(char* namebuf, size_t namesz, long* balance) const;
     inline int write(long balance) const;
+    inline int store(long balance) const;
+    inline int write_text(long balance) const;
 
     static int parse(
         const char* buf, size_t len, const ftx_db& db,
@@ -50,19 +447,41 @@ struct ftx_acct {
 };
 
 
+// Return the shard holding account `aindex`
+inline size_t ftx_db::shard_of(size_t aindex) const {
+    if (this->shards.size() == 1) {
+        return 0;
+    }
+    auto it = std::upper_bound(this->shard_base.begin(), this->shard_base.end(),
+                               aindex);
+    return it - this->shard_base.begin() - 1;
+}
+
+// Return one past the last account in shard `shard`
+inline size_t ftx_db::shard_end(size_t shard) const {
+    return shard + 1 < this->shards.size() ? this->shard_base[shard + 1]
+        : this->naccounts;
+}
+
+
 // Create an account object for account number `aindex`
-inline ftx_acct::ftx_acct(const ftx_db& db_, size_t aindex)
-    : db(db_) {
-    assert(aindex < this->db.naccounts);
-    this->offset = aindex * this->db.asize;
+inline ftx_acct::ftx_acct(const ftx_db& db_, size_t aindex_)
+    : db(db_), aindex(aindex_) {
+    assert(this->aindex < this->db.naccounts);
+    size_t shard = this->db.shard_of(this->aindex);
+    this->f = this->db.shards[shard];
+    this->offset = (this->aindex - this->db.shard_base[shard]) * this->db.asize;
 }
 
 
 // Lock this account
 inline void ftx_acct::lock() {
     assert(!this->locked);
-    int r = io61_lock(this->db.f, this->offset, this->db.asize, LOCK_EX);
-    assert(r == 0);
+    this->db.locks[this->aindex].m.lock();
+    if (this->db.range_locks) {
+        int r = io61_lock(this->f, this->offset, this->db.asize, LOCK_EX);
+        assert(r == 0);
+    }
     this->locked = true;
 }
 
@@ -70,18 +489,64 @@ inline void ftx_acct::lock() {
 // Unlock this account
 inline void ftx_acct::unlock() {
     assert(this->locked);
-    int r = io61_unlock(this->db.f, this->offset, this->db.asize);
-    assert(r == 0);
+    if (this->db.range_locks) {
+        int r = io61_unlock(this->f, this->offset, this->db.asize);
+        assert(r == 0);
+    }
     this->locked = false;
+    this->db.locks[this->aindex].m.unlock();
+}
+
+
+// Lock this account for reading only; other readers may hold it too.
+// (With `lock_shared` and `unlock_shared`, `std::shared_lock` works.)
+inline void ftx_acct::lock_shared() {
+    assert(!this->locked);
+    this->db.locks[this->aindex].m.lock_shared();
+    if (this->db.range_locks) {
+        int r = io61_lock(this->f, this->offset, this->db.asize, LOCK_SH);
+        assert(r == 0);
+    }
+    this->locked = true;
+}
+
+inline void ftx_acct::unlock_shared() {
+    assert(this->locked);
+    if (this->db.range_locks) {
+        int r = io61_unlock(this->f, this->offset, this->db.asize);
+        assert(r == 0);
+    }
+    this->locked = false;
+    this->db.locks[this->aindex].m.unlock_shared();
 }
 
 
 // Read this account’s current name and/or balance, storing the name
 // in `namebuf[0..namesz-1]` and the balance in `*balance`
 inline int ftx_acct::read(char* namebuf, size_t namesz, long* balance) const {
+    if (this->db.binary) {
+        if (namebuf && namesz > 0) {
+            const char* name = &this->db.names[this->aindex * this->db.balance_offset];
+            size_t off = 0;
+            while (off != namesz - 1 && off != this->db.balance_offset
+                   && name[off] != ' ') {
+                namebuf[off] = name[off];
+                ++off;
+            }
+            namebuf[off] = '\0';
+        }
+        if (balance) {
+            *balance = this->db.balances[this->aindex].load(std::memory_order_relaxed);
+        }
+        return 0;
+    } else if (this->db.map) {
+        return parse(this->db.map + this->offset, this->db.asize, this->db,
+                     namebuf, namesz, balance);
+    }
+
     // Read account from file; short reads are errors
     char buf[ftx_db::max_asize];
-    ssize_t nr = io61_pread(this->db.f, buf, this->db.asize, this->offset);
+    ssize_t nr = io61_pread(this->f, buf, this->db.asize, this->offset);
     if (nr == 0 || nr == -1) {
         return nr;
     }
@@ -91,8 +556,84 @@ inline int ftx_acct::read(char* namebuf, size_t namesz, long* balance) const {
 }
 
 
-// Write `balance` to the account database as this account’s new balance
+// Write `balance` to the account database as this account’s new balance:
+// a commit of its own, which the caller must have locked
 inline int ftx_acct::write(long balance) const {
+    ftx_update u = {this->aindex, balance};
+    uint64_t e = this->db.begin_update(&u, 1);
+    int r = this->store(balance);
+    this->db.end_update(&u, 1, e);
+    return r;
+}
+
+
+// Store `balance` as this account's balance, as part of a commit
+inline int ftx_acct::store(long balance) const {
+    if (this->db.binary) {
+        if (balance < this->db.balance_min || balance > this->db.balance_max) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+        // release: after the pending mark, for `ftx_snapshot::read`
+        this->db.balances[this->aindex].store(balance, std::memory_order_release);
+        this->db.dirty[this->aindex / 64].fetch_or(uint64_t(1) << (this->aindex % 64),
+                                                  std::memory_order_relaxed);
+    } else if (this->write_text(balance) != 0) {
+        return -1;
+    }
+    this->db.locks[this->aindex].version.fetch_add(1, std::memory_order_release);
+    return 0;
+}
+
+
+// ftx_db::transfer(from, to, amount)
+//    In binary mode, move up to `amount` from account `from` to account
+//    `to` without locks, and return the amount moved. As in the transfer
+//    programs, the amount is limited by `from`'s balance and by the room
+//    left under `balance_max` in `to`. The transfer first claims room in
+//    `to` with a capped CAS, then debits `from` with a CAS that keeps it
+//    non-negative, and finally gives back any room it couldn't fill. No
+//    balance ever leaves [0, balance_max], though a concurrent reader can
+//    see `to` credited before `from` is debited. Snapshots don't see
+//    lock-free transfers consistently.
+
+inline long ftx_db::transfer(size_t from, size_t to, long amount) {
+    assert(this->binary && from != to && amount >= 0);
+    std::atomic<long>& src = this->balances[from];
+    std::atomic<long>& dst = this->balances[to];
+
+    long d = dst.load(std::memory_order_relaxed);
+    long room;
+    do {
+        room = std::min(amount, this->balance_max - d);
+        if (room <= 0) {
+            return 0;
+        }
+    } while (!dst.compare_exchange_weak(d, d + room, std::memory_order_relaxed));
+
+    long s = src.load(std::memory_order_relaxed);
+    long delta;
+    do {
+        delta = std::min(room, s);
+    } while (delta > 0
+             && !src.compare_exchange_weak(s, s - delta, std::memory_order_relaxed));
+    delta = std::max(delta, 0L);
+
+    if (delta != room) {
+        dst.fetch_sub(room - delta, std::memory_order_relaxed);
+    }
+    if (delta != 0) {
+        this->dirty[from / 64].fetch_or(uint64_t(1) << (from % 64),
+                                        std::memory_order_relaxed);
+        this->dirty[to / 64].fetch_or(uint64_t(1) << (to % 64),
+                                      std::memory_order_relaxed);
+    }
+    return delta;
+}
+
+
+// Write `balance` to this account's text record in the file (or map)
+inline int ftx_acct::write_text(long balance) const {
     // Stringify balance to stack buffer
     char buf[ftx_db::max_asize];
     auto [ptr, len] = unparse(buf, sizeof(buf), this->db, balance);
@@ -100,8 +641,12 @@ inline int ftx_acct::write(long balance) const {
         return -1;
     }
 
-    // Write unparsed balance to database file
-    ssize_t nw = io61_pwrite(this->db.f, ptr, len,
+    // Write unparsed balance to database file, or straight into the map
+    if (this->db.map) {
+        memcpy(this->db.map + this->offset + this->db.balance_offset, ptr, len);
+        return 0;
+    }
+    ssize_t nw = io61_pwrite(this->f, ptr, len,
                              this->offset + this->db.balance_offset);
     if (size_t(nw) != len) {
         errno = EINVAL;
@@ -111,4 +656,148 @@ inline int ftx_acct::write(long balance) const {
     }
 }
 
+
+inline ftx_txn::ftx_txn(ftx_db& db_)
+    : db(db_) {
+    this->entries.reserve(4);
+}
+
+inline ftx_txn::entry* ftx_txn::find(size_t aindex) {
+    for (auto& e : this->entries) {
+        if (e.aindex == aindex) {
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+// Return account `aindex`'s balance as this transaction sees it
+inline long ftx_txn::read(size_t aindex) {
+    if (entry* e = this->find(aindex)) {
+        return e->balance;
+    }
+    // A write that lands between these loads changes the version, so
+    // `commit` will catch it
+    unsigned long v = this->db.locks[aindex].version.load(std::memory_order_acquire);
+    long balance;
+    int r = ftx_acct{this->db, aindex}.read(nullptr, 0, &balance);
+    assert(r == 0);
+    this->entries.push_back({aindex, v, balance, false});
+    return balance;
+}
+
+// Set account `aindex`'s balance when this transaction commits
+inline void ftx_txn::write(size_t aindex, long balance) {
+    entry* e = this->find(aindex);
+    if (!e) {
+        this->read(aindex);
+        e = &this->entries.back();
+    }
+    e->balance = balance;
+    e->written = true;
+}
+
+inline bool ftx_txn::commit() {
+    std::vector<ftx_update> updates;
+    // Lock in account order to prevent deadlock
+    std::sort(this->entries.begin(), this->entries.end(),
+              [] (const entry& a, const entry& b) {
+                  return a.aindex < b.aindex;
+              });
+    std::vector<ftx_acct> accts;
+    accts.reserve(this->entries.size());
+    for (auto& e : this->entries) {
+        accts.emplace_back(this->db, e.aindex);
+        if (e.written) {
+            accts.back().lock();
+        } else {
+            accts.back().lock_shared();
+        }
+    }
+
+    bool ok = true;
+    for (auto& e : this->entries) {
+        ok = ok && this->db.locks[e.aindex].version.load(std::memory_order_relaxed)
+            == e.version;
+    }
+    for (size_t i = 0; ok && i != this->entries.size(); ++i) {
+        if (this->entries[i].written) {
+            updates.push_back({this->entries[i].aindex, this->entries[i].balance});
+        }
+    }
+    off_t lsn = this->db.commit(updates.data(), updates.size());
+
+    for (size_t i = 0; i != this->entries.size(); ++i) {
+        if (this->entries[i].written) {
+            accts[i].unlock();
+        } else {
+            accts[i].unlock_shared();
+        }
+    }
+    this->db.sync(lsn);
+    return ok;
+}
+
+inline ftx_batch::ftx_batch(ftx_db& db_)
+    : db(db_) {
+}
+
+// Queue a transfer of up to `amount` from account `from` to `to`
+inline void ftx_batch::add(size_t from, size_t to, long amount) {
+    assert(from != to && amount >= 0);
+    this->transfers.push_back({from, to, amount});
+}
+
+// Return the number of queued transfers
+inline size_t ftx_batch::size() const {
+    return this->transfers.size();
+}
+
+
+inline ftx_workload::picker::picker(const ftx_workload& w_, unsigned seed)
+    : w(w_), randomness(seed), pick_account(0, w_.naccounts - 1) {
+    assert(this->w.naccounts >= 2);
+    this->cursor = this->pick_account(this->randomness);
+}
+
+inline size_t ftx_workload::picker::pick_one() {
+    if (this->w.kind == zipf) {
+        double u = this->pick_real(this->randomness);
+        auto it = std::upper_bound(this->w.cdf.begin(), this->w.cdf.end(), u);
+        return std::min(size_t(it - this->w.cdf.begin()), this->w.naccounts - 1);
+    } else if (this->w.kind == hotspot
+               && this->pick_real(this->randomness) * 100 < this->w.param) {
+        std::uniform_int_distribution<size_t> pick_hot(0, std::min(this->w.naccounts, size_t(3)) - 1);
+        return pick_hot(this->randomness);
+    } else {
+        return this->pick_account(this->randomness);
+    }
+}
+
+// Store two different accounts in `aindex`
+inline void ftx_workload::picker::pick(size_t aindex[2]) {
+    if (this->w.kind == scan) {
+        aindex[0] = this->cursor;
+        this->cursor = (this->cursor + 1) % this->w.naccounts;
+        aindex[1] = this->cursor;
+        return;
+    }
+    do {
+        aindex[0] = this->pick_one();
+        aindex[1] = this->pick_one();
+    } while (aindex[0] == aindex[1]);
+}
+
+
+// Forget everything read and written, to start over
+inline void ftx_txn::reset() {
+    this->entries.clear();
+}
+
+
+// Open a snapshot of the current balances
+inline ftx_snapshot ftx_db::snapshot() {
+    return ftx_snapshot(*this);
+}
+
 #endif
@@ -0,0 +1,97 @@
+#include "ftxdb.hh"
+#include <sys/resource.h>
+#include <thread>
+
+// Usage: ./ftxgen [-j NTHREADS] [-n NACCOUNTS] [-r SEED] [FILE]
+//    Write a fresh account database of NACCOUNTS accounts to FILE
+//    (default /tmp/genaccounts.fdb). Accounts 0-2 are SBF, Alameda, and
+//    FTX, as in accounts.fdb; the rest are named `a` plus the account
+//    number in base 36, with random balances. NTHREADS threads each
+//    write a contiguous share of the file with large `pwrite`s, so
+//    multi-gigabyte databases take seconds.
+
+static constexpr size_t asize = 16;          // as in ftx_db
+static constexpr size_t chunk_records = 1 << 16;
+
+static void format_record(char* rec, size_t aindex, long balance) {
+    static const char* const special[] = {"SBF", "Alameda", "FTX"};
+    char name[8];
+    if (aindex < 3) {
+        snprintf(name, sizeof(name), "%s", special[aindex]);
+    } else {
+        // `a` plus up to 6 base-36 digits
+        char digits[8];
+        size_t nd = 0;
+        do {
+            digits[nd++] = "0123456789abcdefghijklmnopqrstuvwxyz"[aindex % 36];
+            aindex /= 36;
+        } while (aindex != 0);
+        name[0] = 'a';
+        for (size_t i = 0; i != nd; ++i) {
+            name[i + 1] = digits[nd - 1 - i];
+        }
+        name[nd + 1] = '\0';
+    }
+    char buf[asize + 1];
+    snprintf(buf, sizeof(buf), "%-7s %7ld\n", name, balance);
+    memcpy(rec, buf, asize);
+}
+
+static void gen_thread(int fd, size_t first, size_t last, unsigned seed) {
+    std::mt19937 randomness(seed);
+    std::uniform_int_distribution pick_balance(0L, 99999L);
+    std::vector<char> buf(chunk_records * asize);
+
+    for (size_t a = first; a < last; a += chunk_records) {
+        size_t n = std::min(chunk_records, last - a);
+        for (size_t i = 0; i != n; ++i) {
+            format_record(&buf[i * asize], a + i, pick_balance(randomness));
+        }
+        size_t nw = 0;
+        while (nw != n * asize) {
+            ssize_t w = pwrite(fd, &buf[nw], n * asize - nw, a * asize + nw);
+            if (w == -1 && errno != EINTR) {
+                perror("ftxgen: pwrite");
+                exit(1);
+            }
+            nw += std::max(w, ssize_t(0));
+        }
+    }
+}
+
+
+int main(int argc, char* argv[]) {
+    io61_args args = io61_args("j:n:r:").set_nthreads(8)
+        .set_noperations(1'000'000)
+        .parse(argc, argv);
+    const char* filename = args.input_file ? args.input_file : "/tmp/genaccounts.fdb";
+    size_t naccounts = args.noperations;
+    if (naccounts < 3 || naccounts > 2'176'782'336) {  // 36**6
+        fprintf(stderr, "ftxgen: NACCOUNTS must be between 3 and 36**6\n");
+        exit(1);
+    }
+
+    double start_time = monotonic_timestamp();
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1 || ftruncate(fd, naccounts * asize) == -1) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    // Split on chunk boundaries, so no two threads write one chunk
+    size_t nchunks = (naccounts + chunk_records - 1) / chunk_records;
+    std::vector<std::thread> th(args.nthreads);
+    for (int i = 0; i != args.nthreads; ++i) {
+        size_t first = std::min(nchunks * i / args.nthreads * chunk_records, naccounts);
+        size_t last = std::min(nchunks * (i + 1) / args.nthreads * chunk_records, naccounts);
+        th[i] = std::thread(gen_thread, fd, first, last, unsigned(args.engine()));
+    }
+    for (auto& t : th) {
+        t.join();
+    }
+    close(fd);
+
+    fprintf(stderr, "%s: %zu accounts, %zu bytes, %.6fs real time\n",
+            filename, naccounts, naccounts * asize,
+            monotonic_timestamp() - start_time);
+}
@@ -1,12 +1,40 @@
 #include "ftxdb.hh"
 #include <charconv>
+#include <cmath>
 #include <cstdlib>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-ftx_db::ftx_db(io61_file* f_) {
-    this->f = f_;
-    size_t sz = io61_filesize(this->f);
-    assert(sz % this->asize == 0);
-    this->naccounts = sz / this->asize;
+ftx_db::ftx_db(io61_file* f_, int flags)
+    : ftx_db(std::vector<io61_file*>{f_}, flags) {
+}
+
+ftx_db::ftx_db(std::vector<io61_file*> shards_, int flags)
+    : shards(std::move(shards_)) {
+    assert(!this->shards.empty());
+    this->f = this->shards[0];
+    this->naccounts = 0;
+    for (io61_file* sf : this->shards) {
+        off_t ssz = io61_filesize(sf);
+        assert(ssz > 0 && ssz % this->asize == 0);
+        // cache blocks hold whole records
+        int r = io61_set_record_size(sf, this->asize);
+        assert(r == 0);
+        this->shard_base.push_back(this->naccounts);
+        this->naccounts += ssz / this->asize;
+    }
+    size_t sz = this->naccounts * this->asize;
+    this->locks = io61_array<ftx_acct_lock>(this->naccounts);
+    this->history = io61_array<ftx_acct_history>(this->naccounts);
+    if (flags & mmap_flag) {
+        assert(this->shards.size() == 1);
+        void* p = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       io61_fileno(this->f), 0);
+        assert(p != MAP_FAILED);
+        this->map = reinterpret_cast<char*>(p);
+    }
 
     // ensure data is cached
     ftx_acct acct(*this, 0);
@@ -15,13 +43,613 @@ ftx_db::ftx_db(io61_file* f_) {
     int r = acct.read(buf, sizeof(buf), &balance);
     assert(r == 0);
     assert(balance >= 0);
+
+    if (flags & binary_flag) {
+        // parse every record once; `to_chars` must fit the balance field
+        // (one of its characters may be a minus sign)
+        this->balance_max = 9;
+        for (size_t i = 1; i != this->balance_size; ++i) {
+            this->balance_max = this->balance_max * 10 + 9;
+        }
+        this->balance_min = -(this->balance_max / 10);
+        this->balances = std::vector<std::atomic<long>>(this->naccounts);
+        this->names.resize(this->naccounts * this->balance_offset);
+        this->dirty = io61_array<std::atomic<uint64_t>>((this->naccounts + 63) / 64);
+        for (size_t i = 0; i != this->naccounts; ++i) {
+            const char* rec = buf;
+            if (this->map) {
+                rec = this->map + i * this->asize;
+            } else {
+                ftx_acct a(*this, i);
+                ssize_t nr = io61_pread(a.f, buf, this->asize, a.offset);
+                assert(size_t(nr) == this->asize);
+            }
+            r = ftx_acct::parse(rec, this->asize, *this, nullptr, 0, &balance);
+            assert(r == 0);
+            this->balances[i].store(balance, std::memory_order_relaxed);
+            memcpy(&this->names[i * this->balance_offset], rec, this->balance_offset);
+        }
+        this->binary = true;
+    }
+}
+
+
+// ftx_db::write_back()
+//    In binary mode, write dirty balances back to the text records. Each
+//    run of consecutive dirty records becomes one text buffer and one
+//    write. Returns 0 on success and -1 on error.
+
+int ftx_db::write_back() {
+    if (!this->binary) {
+        return 0;
+    }
+    std::vector<ftx_run> runs;
+    this->collect_dirty(runs);
+    return this->write_runs(runs);
+}
+
+// Clear the dirty bitmap, appending the text of every dirty record to
+// `runs`, in offset order, one entry per run of consecutive records
+void ftx_db::collect_dirty(std::vector<ftx_run>& runs) {
+    assert(this->asize == this->balance_offset + this->balance_size + 1);
+    bool in_run = false;
+    for (size_t w = 0; w * 64 < this->naccounts; ++w) {
+        uint64_t bits = this->dirty[w].exchange(0, std::memory_order_relaxed);
+        for (size_t i = w * 64; i != std::min(w * 64 + 64, this->naccounts); ++i) {
+            if (!(bits & (uint64_t(1) << (i % 64)))) {
+                in_run = false;
+                continue;
+            }
+            if (!in_run) {
+                runs.push_back({off_t(i * this->asize), {}});
+                in_run = true;
+            }
+            char buf[ftx_db::max_asize];
+            long balance = this->balances[i].load(std::memory_order_relaxed);
+            auto [ptr, len] = ftx_acct::unparse(buf, sizeof(buf), *this, balance);
+            assert(len == this->balance_size + 1);
+            const char* name = &this->names[i * this->balance_offset];
+            std::vector<char>& text = runs.back().text;
+            text.insert(text.end(), name, name + this->balance_offset);
+            text.insert(text.end(), ptr, ptr + len);
+        }
+    }
+}
+
+int ftx_db::write_runs(const std::vector<ftx_run>& runs) {
+    int result = 0;
+    for (auto& run : runs) {
+        if (this->map) {
+            memcpy(this->map + run.off, run.text.data(), run.text.size());
+            continue;
+        }
+        // A run may cross into the next shard
+        size_t pos = 0;
+        while (pos != run.text.size()) {
+            ftx_acct a(*this, (run.off + pos) / this->asize);
+            size_t shard = this->shard_of(a.aindex);
+            size_t n = std::min(run.text.size() - pos,
+                                (this->shard_end(shard) - a.aindex) * this->asize);
+            if (io61_pwrite(a.f, &run.text[pos], n, a.offset) != ssize_t(n)) {
+                result = -1;
+            }
+            pos += n;
+        }
+    }
+    return result;
+}
+
+// Make the account files durable
+int ftx_db::sync_files() {
+    if (this->map) {
+        return msync(this->map, this->naccounts * this->asize, MS_SYNC);
+    }
+    for (io61_file* sf : this->shards) {
+        if (io61_flush(sf) != 0 || fsync(io61_fileno(sf)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Sort and deduplicate `aindexes` into `buf`, or into `v` if it's too
+// small; return the result
+static std::span<const size_t> sorted_accounts(
+    std::span<const size_t> aindexes, std::span<size_t> buf,
+    std::vector<size_t>& v
+) {
+    size_t* a = buf.data();
+    if (aindexes.size() > buf.size()) {
+        v.resize(aindexes.size());
+        a = v.data();
+    }
+    std::copy(aindexes.begin(), aindexes.end(), a);
+    std::sort(a, a + aindexes.size());
+    size_t n = std::unique(a, a + aindexes.size()) - a;
+    return {a, n};
+}
+
+// Range-lock (if `lock`) or unlock the records of the sorted accounts
+// `aindexes`, with one `io61_lock_many` or `io61_unlock_many` call per
+// shard, in shard order
+static void lock_account_ranges(
+    const ftx_db& db, std::span<const size_t> aindexes, bool lock
+) {
+    std::vector<io61_lock_request> reqs;
+    reqs.reserve(aindexes.size());
+    size_t i = 0;
+    while (i != aindexes.size()) {
+        size_t shard = db.shard_of(aindexes[i]);
+        reqs.clear();
+        for (; i != aindexes.size() && aindexes[i] < db.shard_end(shard); ++i) {
+            ftx_acct a(db, aindexes[i]);
+            reqs.push_back({a.offset, off_t(db.asize), LOCK_EX});
+        }
+        io61_file* sf = db.shards[shard];
+        int r = lock ? io61_lock_many(sf, reqs.data(), reqs.size())
+            : io61_unlock_many(sf, reqs.data(), reqs.size());
+        assert(r == 0);
+    }
+}
+
+
+// ftx_db::lock_accounts(aindexes)
+//    Exclusively lock every account in `aindexes`, which may list an
+//    account more than once. Accounts are locked in account order, so
+//    concurrent callers can't deadlock, and with `range_locks` all their
+//    records are range-locked in one `io61_lock_many` call per shard.
+//    Release them
+//    with `unlock_accounts` on the same accounts.
+
+void ftx_db::lock_accounts(std::span<const size_t> aindexes) {
+    size_t buf[16];
+    std::vector<size_t> v;
+    auto sorted = sorted_accounts(aindexes, buf, v);
+    for (size_t aindex : sorted) {
+        assert(aindex < this->naccounts);
+        this->locks[aindex].m.lock();
+    }
+    if (this->range_locks) {
+        lock_account_ranges(*this, sorted, true);
+    }
+}
+
+void ftx_db::unlock_accounts(std::span<const size_t> aindexes) {
+    size_t buf[16];
+    std::vector<size_t> v;
+    auto sorted = sorted_accounts(aindexes, buf, v);
+    if (this->range_locks) {
+        lock_account_ranges(*this, sorted, false);
+    }
+    for (size_t aindex : sorted) {
+        this->locks[aindex].m.unlock();
+    }
+}
+
+
+// ftx_db::commit(updates, n)
+//    Store `n` new balances, whose accounts the caller has locked. In WAL
+//    mode, first append them to the log as one redo transaction. Returns
+//    the log position that must be durable before the transaction is
+//    (pass it to `sync` after unlocking), or 0 outside WAL mode.
+
+off_t ftx_db::commit(const ftx_update* updates, size_t n) {
+    if (!this->wal || n == 0) {
+        this->write_updates(updates, n);
+        return 0;
+    }
+    std::shared_lock guard(this->commit_m);
+    off_t lsn = this->wal->append(updates, n);
+    this->write_updates(updates, n);
+    return lsn;
+}
+
+// Store `n` new balances. In text mode, each run of updates to adjacent
+// records (in order) is read, patched, and written back as one buffer,
+// so the run costs one `io61_pread` and one `io61_pwrite`.
+void ftx_db::write_updates(const ftx_update* updates, size_t n) {
+    uint64_t e = this->begin_update(updates, n);
+    size_t i = 0;
+    while (i != n) {
+        size_t j = i + 1;
+        if (!this->binary && !this->map) {
+            size_t end = this->shard_end(this->shard_of(updates[i].aindex));
+            while (j != n && updates[j].aindex == updates[j - 1].aindex + 1
+                   && updates[j].aindex < end) {
+                ++j;
+            }
+        }
+        if (j == i + 1) {
+            int r = ftx_acct{*this, updates[i].aindex}.store(updates[i].balance);
+            assert(r == 0);
+            i = j;
+            continue;
+        }
+
+        ftx_acct a(*this, updates[i].aindex);
+        off_t off = a.offset;
+        size_t sz = (j - i) * this->asize;
+        std::vector<char> text(sz);
+        ssize_t nr = io61_pread(a.f, text.data(), sz, off);
+        assert(nr == ssize_t(sz));
+        for (size_t k = i; k != j; ++k) {
+            char buf[ftx_db::max_asize];
+            auto [ptr, len] = ftx_acct::unparse(buf, sizeof(buf), *this,
+                                                updates[k].balance);
+            assert(len != 0 && this->balance_offset + len <= this->asize);
+            memcpy(&text[(k - i) * this->asize + this->balance_offset], ptr, len);
+        }
+        ssize_t nw = io61_pwrite(a.f, text.data(), sz, off);
+        assert(nw == ssize_t(sz));
+        for (size_t k = i; k != j; ++k) {
+            this->locks[updates[k].aindex].version.fetch_add(1, std::memory_order_release);
+        }
+        i = j;
+    }
+    this->end_update(updates, n, e);
+}
+
+
+// ftx_db::begin_update(updates, n)
+//    Start a commit of `n` new balances to distinct accounts, which the
+//    caller has locked, and return its epoch. The accounts are marked
+//    pending before the epoch is taken, so a snapshot that could
+//    include the commit waits for it. If a snapshot is open, each
+//    account's old balance joins its history, and versions no open
+//    snapshot can reach are freed. Pass the epoch to `end_update` once
+//    the balances are written.
+
+uint64_t ftx_db::begin_update(const ftx_update* updates, size_t n) const {
+    if (n == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i != n; ++i) {
+        ftx_acct_history& h = this->history[updates[i].aindex];
+        h.prev_epoch = h.epoch.exchange(ftx_acct_history::pending);
+        assert(h.prev_epoch != ftx_acct_history::pending);
+    }
+    uint64_t e = this->epoch.fetch_add(1) + 1;
+    uint64_t min = this->snapshot_min.load();
+
+    for (size_t i = 0; i != n; ++i) {
+        ftx_acct_history& h = this->history[updates[i].aindex];
+        ftx_version* v = h.old.load(std::memory_order_relaxed);
+        if (min == no_snapshot) {
+            h.old.store(nullptr, std::memory_order_relaxed);
+        } else {
+            // save the old balance, then cut the list after the newest
+            // version the oldest snapshot can see
+            auto nv = new ftx_version{h.prev_epoch, 0, v};
+            int r = ftx_acct{*this, updates[i].aindex}.read(nullptr, 0, &nv->balance);
+            assert(r == 0);
+            h.old.store(nv, std::memory_order_release);
+            while (nv->epoch > min && nv->next) {
+                nv = nv->next;
+            }
+            v = std::exchange(nv->next, nullptr);
+        }
+        while (v) {
+            delete std::exchange(v, v->next);
+        }
+    }
+    return e;
+}
+
+void ftx_db::end_update(const ftx_update* updates, size_t n, uint64_t e) const {
+    for (size_t i = 0; i != n; ++i) {
+        this->history[updates[i].aindex].epoch.store(e, std::memory_order_release);
+    }
+}
+
+ftx_acct_history::~ftx_acct_history() {
+    ftx_version* v = this->old.load(std::memory_order_relaxed);
+    while (v) {
+        delete std::exchange(v, v->next);
+    }
+}
+
+
+// ftx_snapshot(db) constructor
+//    Open a snapshot of `db` at its newest epoch. The snapshot registers
+//    before it reads the epoch, so every commit with a later epoch sees
+//    the registration and keeps the versions it needs.
+
+ftx_snapshot::ftx_snapshot(ftx_db& db_)
+    : db(db_) {
+    std::unique_lock guard(this->db.snapshot_m);
+    this->registered = this->db.epoch.load();
+    this->db.snapshot_epochs.insert(this->registered);
+    this->db.snapshot_min.store(*this->db.snapshot_epochs.begin());
+    this->epoch = this->db.epoch.load();
+}
+
+ftx_snapshot::~ftx_snapshot() {
+    std::unique_lock guard(this->db.snapshot_m);
+    auto& epochs = this->db.snapshot_epochs;
+    epochs.erase(epochs.find(this->registered));
+    this->db.snapshot_min.store(epochs.empty() ? ftx_db::no_snapshot
+                                : *epochs.begin());
+}
+
+// Return account `aindex`'s balance as of this snapshot. In binary mode
+// a current balance is read like a seqlock: it is valid if the
+// account's epoch is the same, and not pending, before and after (the
+// balance is stored with release order after the pending mark). Text
+// and mapped records aren't atomic, so they are read under the
+// account's shared lock, which is only tried: a reader never makes a
+// writer wait, except for one that arrives during the read itself.
+long ftx_snapshot::read(size_t aindex) const {
+    ftx_acct_history& h = this->db.history[aindex];
+    while (true) {
+        std::shared_lock<std::shared_mutex> guard;
+        if (!this->db.binary) {
+            guard = std::shared_lock(this->db.locks[aindex].m, std::try_to_lock);
+        }
+        uint64_t e = h.epoch.load(std::memory_order_acquire);
+        if (e == ftx_acct_history::pending
+            || (!this->db.binary && !guard.owns_lock())) {
+            std::this_thread::yield();
+            continue;
+        } else if (e > this->epoch) {
+            // rewritten since the snapshot: the list holds what it saw
+            for (ftx_version* v = h.old.load(std::memory_order_acquire);
+                 v; v = v->next) {
+                if (v->epoch <= this->epoch) {
+                    return v->balance;
+                }
+            }
+            // reclamation freed a version this snapshot still needs;
+            // the current balance would make its total wrong
+            fprintf(stderr, "ftx_snapshot: account %zu: no version for "
+                    "epoch %llu\n", aindex, (unsigned long long) this->epoch);
+            abort();
+        }
+        if (guard.owns_lock()) {
+            long balance;
+            int r = ftx_acct{this->db, aindex}.read(nullptr, 0, &balance);
+            assert(r == 0);
+            return balance;
+        }
+        long balance = this->db.balances[aindex].load(std::memory_order_acquire);
+        if (h.epoch.load(std::memory_order_relaxed) == e) {
+            return balance;
+        }
+    }
+}
+
+// Return the sum of every balance as of this snapshot
+long ftx_snapshot::total() const {
+    long sum = 0;
+    for (size_t i = 0; i != this->db.naccounts; ++i) {
+        sum += this->read(i);
+    }
+    return sum;
+}
+
+void ftx_db::sync(off_t lsn) {
+    if (this->wal) {
+        this->wal->sync(lsn);
+    }
+}
+
+
+// ftx_batch::execute()
+//    Execute and forget the queued transfers. Returns the total amount
+//    moved.
+
+long ftx_batch::execute() {
+    this->aindexes.clear();
+    for (auto& t : this->transfers) {
+        this->aindexes.push_back(t.from);
+        this->aindexes.push_back(t.to);
+    }
+    this->db.lock_accounts(this->aindexes);
+
+    // Read each account once, into `updates` in account order
+    std::sort(this->aindexes.begin(), this->aindexes.end());
+    this->aindexes.erase(std::unique(this->aindexes.begin(), this->aindexes.end()),
+                         this->aindexes.end());
+    this->updates.clear();
+    for (size_t aindex : this->aindexes) {
+        long balance;
+        int r = ftx_acct{this->db, aindex}.read(nullptr, 0, &balance);
+        assert(r == 0);
+        this->updates.push_back({aindex, balance});
+    }
+    auto find = [&] (size_t aindex) -> long& {
+        auto it = std::lower_bound(this->aindexes.begin(), this->aindexes.end(), aindex);
+        return this->updates[it - this->aindexes.begin()].balance;
+    };
+
+    long moved = 0;
+    for (auto& t : this->transfers) {
+        long& src = find(t.from);
+        long& dst = find(t.to);
+        long delta = std::min(src, t.amount);
+        delta = std::min(delta, balance_limit - dst);
+        src -= delta;
+        dst += delta;
+        moved += delta;
+    }
+
+    off_t lsn = this->db.commit(this->updates.data(), this->updates.size());
+    this->db.unlock_accounts(this->aindexes);
+    this->db.sync(lsn);
+    this->transfers.clear();
+    return moved;
+}
+
+
+// ftx_db::checkpoint()
+//    In WAL mode, write every balance change logged so far to the account
+//    file in offset order, make it durable, and record in the log that
+//    replay can start after it. Writers are paused only while the dirty
+//    records are collected, so the collected state is exactly the state
+//    after every logged transaction. Returns 0 on success and -1 on error.
+
+int ftx_db::checkpoint() {
+    std::vector<ftx_run> runs;
+    off_t lsn;
+    {
+        std::unique_lock guard(this->commit_m);
+        lsn = this->wal->end();
+        this->collect_dirty(runs);
+    }
+    if (lsn == this->wal->checkpointed()) {
+        return 0;
+    }
+    // Changes reach the account file only after their log records do
+    this->wal->sync(lsn);
+    int r = this->write_runs(runs);
+    r = r == 0 ? this->sync_files() : r;
+    return r == 0 ? this->wal->checkpoint(lsn) : -1;
+}
+
+void ftx_db::checkpoint_thread() {
+    std::unique_lock guard(this->checkpoint_m);
+    while (!this->checkpoint_stop) {
+        this->checkpoint_cv.wait_for(guard, std::chrono::milliseconds(100));
+        guard.unlock();
+        int r = this->checkpoint();
+        assert(r == 0);
+        guard.lock();
+    }
+}
+
+
+// ftx_db::open_wal(filename, recover)
+//    Enter WAL mode (binary mode is required), logging to `filename`. If
+//    `recover` is true, first replay any transactions the log holds from
+//    a previous run; otherwise start a fresh log.
+
+void ftx_db::open_wal(const char* filename, bool recover) {
+    assert(this->binary && !this->wal);
+    auto w = std::make_unique<ftx_wal>(filename);
+    if (recover) {
+        size_t n = w->replay([&] (size_t aindex, long balance) {
+            if (aindex < this->naccounts
+                && balance >= 0 && balance <= this->balance_max) {
+                this->balances[aindex].store(balance, std::memory_order_relaxed);
+                this->dirty[aindex / 64].fetch_or(uint64_t(1) << (aindex % 64),
+                                                  std::memory_order_relaxed);
+            }
+        });
+        if (n != 0) {
+            fprintf(stderr, "%s: replayed %zu transactions\n", filename, n);
+        }
+    }
+    int r = this->write_back();
+    assert(r == 0);
+    r = this->sync_files();
+    assert(r == 0);
+    r = w->reset();
+    assert(r == 0);
+    this->wal = std::move(w);
+    this->checkpointer = std::thread(&ftx_db::checkpoint_thread, this);
 }
 
 ftx_db::~ftx_db() {
-    io61_close(this->f);
+    assert(this->snapshot_epochs.empty());
+    int r;
+    if (this->wal) {
+        {
+            std::unique_lock guard(this->checkpoint_m);
+            this->checkpoint_stop = true;
+            this->checkpoint_cv.notify_all();
+        }
+        this->checkpointer.join();
+        r = this->checkpoint();
+        assert(r == 0);
+        r = this->wal->reset();
+        assert(r == 0);
+        this->wal.reset();
+    }
+    r = this->write_back();
+    assert(r == 0);
+    if (this->map) {
+        size_t sz = this->naccounts * this->asize;
+        r = msync(this->map, sz, MS_SYNC);
+        assert(r == 0);
+        munmap(this->map, sz);
+    }
+    for (io61_file* sf : this->shards) {
+        io61_close(sf);
+    }
 }
 
 
+// Copy bytes [`start`, `start + len`) of the file `original` to `copy`,
+// replacing it; `len == -1` means through the end of `original`. For a
+// whole file, prefer a reflink, which shares the blocks; otherwise
+// `copy_file_range` the data extents, skipping holes, so the kernel
+// copies (and a sparse original stays sparse); otherwise `read` and
+// `write`. Exits on error.
+static void copy_database(const char* original, const char* copy,
+                          off_t start = 0, off_t len = -1) {
+    int ifd = fd_open_check(original, O_RDONLY);
+    int ofd = fd_open_check(copy, O_WRONLY | O_CREAT | O_TRUNC);
+    struct stat st;
+    int r = fstat(ifd, &st);
+    assert(r == 0);
+    off_t end = len == -1 ? st.st_size : std::min(start + len, st.st_size);
+    assert(start <= end);
+
+    if (start != 0 || end != st.st_size || ioctl(ofd, FICLONE, ifd) == -1) {
+        r = ftruncate(ofd, end - start);
+        assert(r == 0);
+        off_t off = start;
+        bool use_cfr = true;
+        while (off < end) {
+            off_t data = lseek(ifd, off, SEEK_DATA);
+            if (data == -1 && errno == ENXIO) {
+                break;          // only a hole remains
+            } else if (data == -1) {
+                data = off;     // no SEEK_DATA here: copy everything
+            }
+            off_t hole = lseek(ifd, data, SEEK_HOLE);
+            if (hole == -1 || hole > end) {
+                hole = end;
+            }
+            while (data < hole) {
+                ssize_t n = -1;
+                if (use_cfr) {
+                    off_t ioff = data, ooff = data - start;
+                    n = copy_file_range(ifd, &ioff, ofd, &ooff, hole - data, 0);
+                    if (n == -1 && errno != EINTR) {
+                        use_cfr = false;
+                    }
+                }
+                if (!use_cfr) {
+                    char buf[BUFSIZ * 16];
+                    n = pread(ifd, buf, std::min(off_t(sizeof(buf)), hole - data), data);
+                    if (n > 0) {
+                        n = pwrite(ofd, buf, n, data - start);
+                    }
+                }
+                if (n == 0 || (n == -1 && errno != EINTR)) {
+                    fprintf(stderr, "%s: %s\n", copy, n == 0 ? "Short copy" : strerror(errno));
+                    exit(1);
+                }
+                data += std::max(n, ssize_t(0));
+            }
+            off = hole;
+        }
+    }
+    close(ifd);
+    close(ofd);
+}
+
+
+// ftx_db::open_args(args)
+//    Open the database the arguments describe, copying it first unless
+//    `-M` is given. With `-P N`, the database is N shard files named
+//    COPY.0 through COPY.N-1, split from the original at account
+//    boundaries (or, with `-M`, the existing files ORIGINAL.0 ...).
+//    With `-x`, the files are shared with other processes (see
+//    `io61_share`) and accounts are range-locked; this is useful with
+//    `-M`, where the processes open the same files.
+
 ftx_db* ftx_db::open_args(const io61_args& args) {
     const char* original = args.input_file;
     if (original == nullptr) {
@@ -35,20 +663,50 @@ ftx_db* ftx_db::open_args(const io61_args& args) {
     } else {
         copy = "/tmp/newaccounts.fdb";
     }
-    if (strcmp(original, copy) != 0) {
-        const char* allowed = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789~./-_";
-        // check filenames
-        if (strspn(original, allowed) != strlen(original)
-            || strspn(copy, allowed) != strlen(copy)) {
-            fprintf(stderr, "Bad filenames\n");
+    std::vector<io61_file*> files;
+    if (args.nshards > 1) {
+        constexpr off_t asize = 16;   // default `ftx_db::asize`
+        off_t naccounts = 0;
+        if (!args.modify) {
+            struct stat st;
+            if (stat(original, &st) != 0) {
+                fprintf(stderr, "%s: %s\n", original, strerror(errno));
+                exit(1);
+            }
+            naccounts = st.st_size / asize;
+        }
+        for (int i = 0; i != args.nshards; ++i) {
+            std::string name = std::string(copy) + "." + std::to_string(i);
+            if (!args.modify) {
+                off_t first = naccounts * i / args.nshards;
+                off_t last = naccounts * (i + 1) / args.nshards;
+                copy_database(original, name.c_str(), first * asize,
+                              (last - first) * asize);
+            }
+            files.push_back(io61_open_check(name.c_str(), O_RDWR));
+        }
+    } else {
+        if (strcmp(original, copy) != 0) {
+            copy_database(original, copy);
+        }
+        files.push_back(io61_open_check(copy, O_RDWR));
+    }
+    for (io61_file* f : files) {
+        if (args.shared && io61_share(f) == -1) {
+            fprintf(stderr, "%s: %s\n", copy, strerror(errno));
             exit(1);
         }
-        std::string command = std::string("cp ") + std::string(original) + std::string(" ") + std::string(copy);
-        int r = system(command.c_str());
-        assert(r == 0);
     }
-    io61_file* f = io61_open_check(copy, O_RDWR);
-    return new ftx_db(f);
+    ftx_db* db = new ftx_db(files, (args.mmap ? ftx_db::mmap_flag : 0)
+                                     | (args.binary || args.lockfree || args.wal
+                                        ? ftx_db::binary_flag : 0));
+    db->range_locks = args.range_locks || args.shared;
+    if (args.wal) {
+        // A fresh copy must not replay an old log
+        std::string walname = std::string(copy) + ".wal";
+        db->open_wal(walname.c_str(), strcmp(original, copy) == 0);
+    }
+    return db;
 }
 
 
@@ -107,3 +765,300 @@ std::pair<const char*, size_t> ftx_acct::unparse(char* buf, size_t len,
     *tcr.ptr++ = '\n';
     return std::make_pair(tcr.ptr - db.balance_size - 1, db.balance_size + 1);
 }
+
+
+ftx_workload::ftx_workload(size_t naccounts_, kind_type kind_, double param_)
+    : kind(kind_), param(param_), naccounts(naccounts_) {
+    if (this->kind == zipf) {
+        // cumulative weights, then normalize to [0, 1]
+        this->cdf.resize(this->naccounts);
+        double sum = 0;
+        for (size_t i = 0; i != this->naccounts; ++i) {
+            sum += std::pow(double(i + 1), -this->param);
+            this->cdf[i] = sum;
+        }
+        for (double& c : this->cdf) {
+            c /= sum;
+        }
+    }
+}
+
+ftx_workload ftx_workload::from_args(const io61_args& args, size_t naccounts) {
+    if (args.zipf > 0) {
+        return ftx_workload(naccounts, zipf, args.zipf);
+    } else if (args.hotspot > 0) {
+        return ftx_workload(naccounts, hotspot, args.hotspot);
+    } else if (args.scan) {
+        return ftx_workload(naccounts, scan);
+    } else {
+        return ftx_workload(naccounts);
+    }
+}
+
+// Return a description like `zipf:0.99` or `hotspot:90`
+std::string ftx_workload::name() const {
+    char buf[64];
+    switch (this->kind) {
+    case zipf:
+        snprintf(buf, sizeof(buf), "zipf:%g", this->param);
+        return buf;
+    case hotspot:
+        snprintf(buf, sizeof(buf), "hotspot:%g", this->param);
+        return buf;
+    case scan:
+        return "scan";
+    default:
+        return "uniform";
+    }
+}
+
+
+ftx_ledger::ftx_ledger(io61_file* f)
+    : fd(io61_fileno(f)) {
+    for (size_t i = 0; i != nchunks; ++i) {
+        this->chunks[i].base = i * chunksz;
+        this->chunks[i].buf.reset(new char[chunksz]);
+    }
+}
+
+ftx_ledger::~ftx_ledger() {
+    this->flush();
+}
+
+
+// ftx_ledger::append(data, n)
+//    Append `n` bytes to the ledger. A record may straddle two chunks.
+//    Chunk `c` uses slot `c % nchunks`, so a thread that gets more than
+//    `nchunks` chunks ahead of the file waits for the slot's write.
+
+void ftx_ledger::append(const char* data, size_t n) {
+    off_t off = this->end.fetch_add(n, std::memory_order_relaxed);
+    while (n != 0) {
+        off_t base = off - off % chunksz;
+        chunk& c = this->chunks[(base / chunksz) % nchunks];
+        off_t cbase;
+        while ((cbase = c.base.load(std::memory_order_acquire)) != base) {
+            c.base.wait(cbase, std::memory_order_acquire);
+        }
+        size_t m = std::min(n, size_t(base + chunksz - off));
+        memcpy(&c.buf[off - base], data, m);
+        if (c.filled.fetch_add(m, std::memory_order_acq_rel) + m == chunksz) {
+            // Last writer into the chunk: write it and hand the slot on
+            if (pwrite(this->fd, c.buf.get(), chunksz, base) != ssize_t(chunksz)) {
+                this->error = errno ? errno : EIO;
+            }
+            c.filled.store(0, std::memory_order_relaxed);
+            c.base.store(base + nchunks * chunksz, std::memory_order_release);
+            c.base.notify_all();
+        }
+        off += m;
+        data += m;
+        n -= m;
+    }
+}
+
+
+// ftx_ledger::flush()
+//    Write the partly filled chunk at the end of the ledger. Returns 0,
+//    or -1 if any write failed.
+
+int ftx_ledger::flush() {
+    off_t end_ = this->end.load(std::memory_order_relaxed);
+    off_t base = end_ - end_ % chunksz;
+    chunk& c = this->chunks[(base / chunksz) % nchunks];
+    size_t n = end_ - base;
+    if (n != 0
+        && c.base.load(std::memory_order_acquire) == base
+        && c.filled.load(std::memory_order_acquire) == n
+        && pwrite(this->fd, c.buf.get(), n, base) != ssize_t(n)) {
+        this->error = errno ? errno : EIO;
+    }
+    return this->error ? -1 : 0;
+}
+
+
+// ftx_wal
+//    The log file starts with a header: `ftx_wal::magic` and the offset
+//    where replay starts (the last checkpoint). Each transaction is an
+//    `ftx_wal::txn_header` with its record count and a hash of the
+//    records, then the records. Log positions are file offsets.
+
+static uint32_t ftx_wal_hash(const ftx_wal::record* r, uint32_t n) {
+    uint32_t h = 2166136261U ^ n;
+    auto p = reinterpret_cast<const unsigned char*>(r);
+    for (size_t i = 0; i != n * sizeof(ftx_wal::record); ++i) {
+        h = (h ^ p[i]) * 16777619U;
+    }
+    return h;
+}
+
+ftx_wal::ftx_wal(const char* filename) {
+    this->fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (this->fd < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    this->flusher = std::thread(&ftx_wal::flush_thread, this);
+}
+
+ftx_wal::~ftx_wal() {
+    {
+        std::unique_lock guard(this->m);
+        this->stop = true;
+        this->cv.notify_all();
+    }
+    this->flusher.join();
+    close(this->fd);
+}
+
+
+// ftx_wal::replay(apply)
+//    Call `apply(aindex, balance)` for every record of every complete
+//    transaction after the last checkpoint, stopping at the first torn
+//    or corrupt one. Returns the number of transactions replayed.
+
+size_t ftx_wal::replay(const std::function<void(size_t, long)>& apply) {
+    header h;
+    struct stat st;
+    if (pread(this->fd, &h, sizeof(h), 0) != ssize_t(sizeof(h))
+        || memcmp(h.magic, magic, sizeof(h.magic)) != 0
+        || fstat(this->fd, &st) != 0
+        || h.checkpoint < off_t(sizeof(h)) || h.checkpoint > st.st_size) {
+        return 0;
+    }
+    std::vector<char> log(st.st_size - h.checkpoint);
+    if (pread(this->fd, log.data(), log.size(), h.checkpoint) != ssize_t(log.size())) {
+        return 0;
+    }
+
+    size_t ntxns = 0, pos = 0;
+    while (pos + sizeof(txn_header) <= log.size()) {
+        txn_header th;
+        memcpy(&th, &log[pos], sizeof(th));
+        size_t sz = th.n * sizeof(record);
+        if (th.n == 0 || sz > log.size() - pos - sizeof(th)) {
+            break;
+        }
+        std::vector<record> recs(th.n);
+        memcpy(recs.data(), &log[pos + sizeof(th)], sz);
+        if (ftx_wal_hash(recs.data(), th.n) != th.hash) {
+            break;
+        }
+        for (auto& r : recs) {
+            apply(r.aindex, r.balance);
+        }
+        pos += sizeof(th) + sz;
+        ++ntxns;
+    }
+    return ntxns;
+}
+
+
+// ftx_wal::reset()
+//    Empty the log. Only call this when every logged change is in the
+//    account file and nothing is appending.
+
+int ftx_wal::reset() {
+    std::unique_lock guard(this->m);
+    assert(this->buf.empty() && this->durable == this->end_);
+    header h;
+    memcpy(h.magic, magic, sizeof(h.magic));
+    h.checkpoint = sizeof(h);
+    if (ftruncate(this->fd, 0) != 0
+        || pwrite(this->fd, &h, sizeof(h), 0) != ssize_t(sizeof(h))
+        || fdatasync(this->fd) != 0) {
+        return -1;
+    }
+    this->buf_start = this->end_ = this->durable = this->checkpoint_ = sizeof(h);
+    return 0;
+}
+
+
+// ftx_wal::append(updates, n)
+//    Append one transaction; return the log position after it.
+
+off_t ftx_wal::append(const ftx_update* updates, size_t n) {
+    std::vector<record> recs(n);
+    for (size_t i = 0; i != n; ++i) {
+        recs[i] = {uint32_t(updates[i].aindex), int32_t(updates[i].balance)};
+    }
+    txn_header th = {uint32_t(n), ftx_wal_hash(recs.data(), n)};
+
+    std::unique_lock guard(this->m);
+    this->buf.insert(this->buf.end(), reinterpret_cast<const char*>(&th),
+                     reinterpret_cast<const char*>(&th + 1));
+    this->buf.insert(this->buf.end(), reinterpret_cast<const char*>(recs.data()),
+                     reinterpret_cast<const char*>(recs.data() + n));
+    this->end_ += sizeof(th) + n * sizeof(record);
+    this->cv.notify_one();
+    return this->end_;
+}
+
+off_t ftx_wal::end() {
+    std::unique_lock guard(this->m);
+    return this->end_;
+}
+
+off_t ftx_wal::checkpointed() {
+    std::unique_lock guard(this->m);
+    return this->checkpoint_;
+}
+
+// Block until the log is durable through position `lsn`
+void ftx_wal::sync(off_t lsn) {
+    std::unique_lock guard(this->m);
+    while (this->durable < lsn) {
+        this->durable_cv.wait(guard);
+    }
+}
+
+
+// ftx_wal::flush_thread()
+//    Group commit: write everything appended since the last write, with
+//    one `fdatasync`, and wake the threads waiting for it. Transactions
+//    that arrive during an `fdatasync` all go out in the next one.
+
+void ftx_wal::flush_thread() {
+    std::vector<char> out;
+    std::unique_lock guard(this->m);
+    while (true) {
+        while (this->buf.empty() && !this->stop) {
+            this->cv.wait(guard);
+        }
+        if (this->buf.empty()) {
+            break;
+        }
+        out.swap(this->buf);
+        off_t pos = this->buf_start;
+        this->buf_start = this->end_;
+        guard.unlock();
+
+        ssize_t nw = pwrite(this->fd, out.data(), out.size(), pos);
+        int r = fdatasync(this->fd);
+        assert(nw == ssize_t(out.size()) && r == 0);
+
+        guard.lock();
+        this->durable = pos + out.size();
+        out.clear();
+        this->durable_cv.notify_all();
+    }
+}
+
+
+// ftx_wal::checkpoint(lsn)
+//    Record that replay can start at `lsn`, and free the log's space
+//    before it.
+
+int ftx_wal::checkpoint(off_t lsn) {
+    std::unique_lock guard(this->m);
+    if (pwrite(this->fd, &lsn, sizeof(lsn), offsetof(header, checkpoint))
+            != ssize_t(sizeof(lsn))
+        || fdatasync(this->fd) != 0) {
+        return -1;
+    }
+    // Discarding old records is only an optimization
+    (void) fallocate(this->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     sizeof(header), lsn - sizeof(header));
+    this->checkpoint_ = lsn;
+    return 0;
+}
@@ -1,34 +1,70 @@
 #include "ftxdb.hh"
+#include "prof61.hh"
 #include <sys/resource.h>
 #include <thread>
 #include <mutex>
 
-// Usage: ./ftxrocket [-j NTHREADS] [-n NOPS] [FILE]
+// Usage: ./ftxrocket [-j NTHREADS] [-n NOPS] [-O] [-w] [-Z S|-H PCT|-S] [FILE]
 //    Perform NOPS * NTHREADS “bank transfers” within FILE, completely
-//    legally.
+//    legally. With `-O`, transfers are optimistic transactions, which
+//    hold no locks during the delay. `-Z`, `-H`, and `-S` skew the
+//    accounts ordinary threads pick (see `ftx_workload`).
+
+static bool optimistic;
+
+// Profiled in the fd 100 report: how long each transfer takes, from
+// picking accounts through `sync`, and how often optimistic commits fail
+static prof61_histogram transfer_latency("transfer", true);
+static prof61_counter txn_retries("txn_retries");
+
+// Transfer as much of `amount` as possible between two accounts with an
+// `ftx_txn`, retrying until it commits
+static void optimistic_transfer(ftx_db& db, const size_t aindex[2],
+                                long amount) {
+    ftx_txn txn{db};
+    bool retry = false;
+    do {
+        if (retry) {
+            txn_retries.add();
+        }
+        retry = true;
+        txn.reset();
+        long bal[2] = {txn.read(aindex[0]), txn.read(aindex[1])};
+
+        // Model network delay or heavy computation
+        usleep(1);
 
-static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
-                            unsigned seed) {
+        long delta = std::min(bal[0], amount);
+        delta = std::min(delta, 9999999 - bal[1]);
+        txn.write(aindex[0], bal[0] - delta);
+        txn.write(aindex[1], bal[1] + delta);
+    } while (!txn.commit());
+}
+
+static void transfer_thread(ftx_db& db, const ftx_workload& workload,
+                            size_t nops, size_t& opcount, unsigned seed) {
     // Obtain a source of random account numbers
     std::default_random_engine randomness(seed);
-    std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
+    ftx_workload::picker picker(workload, randomness());
     std::normal_distribution pick_amount(100.0, 10.0);
 
     size_t i = 0;
     while (i != nops) {
-        // Pick two random accounts for transfer
-        size_t aindex[2] = {
-            pick_account(randomness), pick_account(randomness)
-        };
-        if (aindex[0] == aindex[1]) {
+        // Pick two accounts for transfer
+        size_t aindex[2];
+        picker.pick(aindex);
+
+        prof61_timer timer(transfer_latency);
+        if (optimistic) {
+            optimistic_transfer(db, aindex, pick_amount(randomness));
+            ++i;
             continue;
         }
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        // Lock both accounts at once (`lock_accounts` orders them)
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        db.lock_accounts(aindex);
 
         // Read current balances
         long bal[2];
@@ -44,9 +80,11 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
         bal[0] -= delta;
         bal[1] += delta;
 
-        // Update balances
-        acct1.write(bal[0]);
-        acct2.write(bal[1]);
+        // Update balances, then wait for the log outside the locks
+        ftx_update update[2] = {{aindex[0], bal[0]}, {aindex[1], bal[1]}};
+        off_t lsn = db.commit(update, 2);
+        db.unlock_accounts(aindex);
+        db.sync(lsn);
 
         ++i;
     }
@@ -81,11 +119,17 @@ static void sbf_transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
             aindex[1] = pick_sbf_account(randomness);
         }
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        prof61_timer timer(transfer_latency);
+        if (optimistic) {
+            optimistic_transfer(db, aindex, pick_amount(randomness));
+            ++i;
+            continue;
+        }
+
+        // Lock both accounts at once (`lock_accounts` orders them)
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        db.lock_accounts(aindex);
 
         // Read current balances
         long bal[2];
@@ -101,9 +145,11 @@ static void sbf_transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
         bal[0] -= delta;
         bal[1] += delta;
 
-        // Update balances
-        acct1.write(bal[0]);
-        acct2.write(bal[1]);
+        // Update balances, then wait for the log outside the locks
+        ftx_update update[2] = {{aindex[0], bal[0]}, {aindex[1], bal[1]}};
+        off_t lsn = db.commit(update, 2);
+        db.unlock_accounts(aindex);
+        db.sync(lsn);
 
         ++i;
     }
@@ -113,36 +159,41 @@ static void sbf_transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("i:D:j:J:n:").set_nthreads(4)
+    io61_args args = io61_args("i:D:j:J:n:LmcOwMZ:H:SAP:").set_nthreads(4)
         .set_noperations(100'000)
         .set_ndistinguished_threads(1)
         .parse(argc, argv);
+    optimistic = args.optimistic;
 
     // Allocate buffer, open files
     ftx_db* db = ftx_db::open_args(args);
     args.after_open(db->f, O_RDWR);
+    ftx_workload workload = ftx_workload::from_args(args, db->naccounts);
     std::random_device seed_randomness;
     double start_time = monotonic_timestamp();
 
     // Run transfers
     std::vector<std::thread> th(args.nthreads);
-    std::vector<size_t> opcounts(args.nthreads, 0);
+    std::vector<ftx_padded<size_t>> opcounts(args.nthreads);
     for (int i = 0; i != args.nthreads; ++i) {
         if (i < args.ndistinguished_threads) {
             th[i] = std::thread(sbf_transfer_thread, std::ref(*db),
-                                args.noperations, std::ref(opcounts[i]),
+                                args.noperations, std::ref(opcounts[i].value),
                                 seed_randomness());
         } else {
             th[i] = std::thread(transfer_thread, std::ref(*db),
-                                args.noperations, std::ref(opcounts[i]),
-                                seed_randomness());
+                                std::cref(workload), args.noperations,
+                                std::ref(opcounts[i].value), seed_randomness());
+        }
+        if (args.affinity) {
+            pin_thread(th[i].native_handle(), i);
         }
     }
 
     size_t totalops = 0;
     for (int i = 0; i != args.nthreads; ++i) {
         th[i].join();
-        totalops += opcounts[i];
+        totalops += opcounts[i].value;
     }
 
     // Flush and close
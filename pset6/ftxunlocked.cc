@@ -3,27 +3,24 @@
 #include <thread>
 #include <mutex>
 
-// Usage: ./ftxunlocked [-j NTHREADS] [-n NOPS] [FILE]
+// Usage: ./ftxunlocked [-j NTHREADS] [-n NOPS] [-Z S|-H PCT|-S] [FILE]
 //    Perform NOPS * NTHREADS “bank transfers” within FILE.
+//    `-Z`, `-H`, and `-S` skew the accounts picked (see `ftx_workload`).
 //    This versiond oes not acquire file locks, and thus cannot be made
 //    correct.
 
-static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
-                            unsigned seed) {
+static void transfer_thread(ftx_db& db, const ftx_workload& workload,
+                            size_t nops, size_t& opcount, unsigned seed) {
     // Obtain a source of random account numbers
     std::default_random_engine randomness(seed);
-    std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
+    ftx_workload::picker picker(workload, randomness());
     std::normal_distribution pick_amount(100.0, 10.0);
 
     size_t i = 0;
     while (i != nops) {
-        // Pick two random accounts for transfer
-        size_t aindex[2] = {
-            pick_account(randomness), pick_account(randomness)
-        };
-        if (aindex[0] == aindex[1]) {
-            continue;
-        }
+        // Pick two accounts for transfer
+        size_t aindex[2];
+        picker.pick(aindex);
 
         // Lock both accounts; prevent deadlock with lock ordering
         ftx_acct acct1{db, aindex[0]};
@@ -55,29 +52,33 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("i:D:j:n:").set_nthreads(4)
+    io61_args args = io61_args("i:D:j:n:mcZ:H:SAP:").set_nthreads(4)
         .set_noperations(100'000)
         .parse(argc, argv);
 
     // Allocate buffer, open files
     ftx_db* db = ftx_db::open_args(args);
     args.after_open(db->f, O_RDWR);
+    ftx_workload workload = ftx_workload::from_args(args, db->naccounts);
     std::random_device seed_randomness;
     double start_time = monotonic_timestamp();
 
     // Run transfers
     std::vector<std::thread> th(args.nthreads);
-    std::vector<size_t> opcounts(args.nthreads, 0);
+    std::vector<ftx_padded<size_t>> opcounts(args.nthreads);
     for (int i = 0; i != args.nthreads; ++i) {
         th[i] = std::thread(transfer_thread, std::ref(*db),
-                            args.noperations, std::ref(opcounts[i]),
-                            seed_randomness());
+                            std::cref(workload), args.noperations,
+                            std::ref(opcounts[i].value), seed_randomness());
+        if (args.affinity) {
+            pin_thread(th[i].native_handle(), i);
+        }
     }
 
     size_t totalops = 0;
     for (int i = 0; i != args.nthreads; ++i) {
         th[i].join();
-        totalops += opcounts[i];
+        totalops += opcounts[i].value;
     }
 
     // Flush and close
@@ -3,31 +3,70 @@
 #include <thread>
 #include <mutex>
 
-// Usage: ./ftxxfer [-j NTHREADS] [-n NOPS] [FILE]
-//    Perform NOPS * NTHREADS “bank transfers” within FILE.
+// Usage: ./ftxxfer [-j NTHREADS] [-n NOPS] [-f] [-w] [-k N] [-x] [-V]
+//                  [-Z S|-H PCT|-S] [FILE]
+//    Perform NOPS * NTHREADS “bank transfers” within FILE. With `-f`,
+//    each transfer is one lock-free `ftx_db::transfer`, with no delay.
+//    With `-w`, each transfer is logged and durable before the next.
+//    With `-k N`, transfers are executed in `ftx_batch`es of N.
+//    `-Z`, `-H`, and `-S` skew the accounts picked (see `ftx_workload`).
+//    With `-x -M`, several ftxxfer processes can work on FILE at once.
+//    With `-V`, another thread sums every balance in a snapshot, over
+//    and over while transfers run, and exits with an error if a total
+//    ever differs from the starting one.
+
+static bool lockfree;
+static size_t batch_size;
+static std::atomic<bool> transfers_done;
+
+static void audit_thread(ftx_db& db, long expected, size_t& naudits) {
+    do {
+        long total = db.snapshot().total();
+        if (total != expected) {
+            fprintf(stderr, "ftxxfer: audit %zu: total balance %ld, expected %ld\n",
+                    naudits, total, expected);
+            exit(1);
+        }
+        ++naudits;
+    } while (!transfers_done);
+}
 
-static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
-                            unsigned seed) {
+static void transfer_thread(ftx_db& db, const ftx_workload& workload,
+                            size_t nops, size_t& opcount, unsigned seed) {
     // Obtain a source of random account numbers
     std::mt19937 randomness(seed);
-    std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
+    ftx_workload::picker picker(workload, randomness());
     std::normal_distribution pick_amount(100.0, 10.0);
+    ftx_batch batch(db);
 
     size_t i = 0;
     while (i != nops) {
-        // Pick two random accounts for transfer
-        size_t aindex[2] = {
-            pick_account(randomness), pick_account(randomness)
-        };
-        if (aindex[0] == aindex[1]) {
+        // Pick two accounts for transfer
+        size_t aindex[2];
+        picker.pick(aindex);
+
+        if (db.binary && lockfree) {
+            db.transfer(aindex[0], aindex[1], pick_amount(randomness));
+            ++i;
+            continue;
+        }
+
+        if (batch_size) {
+            // Model network delay or heavy computation, then queue the
+            // transfer; the batch locks and writes its accounts once
+            usleep(1);
+            batch.add(aindex[0], aindex[1], pick_amount(randomness));
+            if (batch.size() == batch_size) {
+                batch.execute();
+            }
+            ++i;
             continue;
         }
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        // Lock both accounts at once (`lock_accounts` orders them)
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        db.lock_accounts(aindex);
 
         // Read current balances
         long bal[2];
@@ -43,41 +82,69 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
         bal[0] -= delta;
         bal[1] += delta;
 
-        // Update balances
-        acct1.write(bal[0]);
-        acct2.write(bal[1]);
+        // Update balances, then wait for the log outside the locks
+        ftx_update update[2] = {{aindex[0], bal[0]}, {aindex[1], bal[1]}};
+        off_t lsn = db.commit(update, 2);
+        db.unlock_accounts(aindex);
+        db.sync(lsn);
 
         ++i;
     }
+    if (batch.size()) {
+        batch.execute();
+    }
     opcount = i;
 }
 
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("i:D:j:n:").set_nthreads(4)
+    io61_args args = io61_args("i:D:j:n:k:LmcfwMZ:H:SAP:xV").set_nthreads(4)
         .set_noperations(100'000)
         .parse(argc, argv);
+    lockfree = args.lockfree;
+    batch_size = args.batch;
+    if (args.audit && args.lockfree) {
+        fprintf(stderr, "ftxxfer: -V does not work with lock-free transfers (-f)\n");
+        exit(1);
+    }
 
     // Allocate buffer, open files
     ftx_db* db = ftx_db::open_args(args);
     args.after_open(db->f, O_RDWR);
+    ftx_workload workload = ftx_workload::from_args(args, db->naccounts);
     std::random_device seed_randomness;
     double start_time = monotonic_timestamp();
 
+    // Start the auditor
+    std::thread auditor;
+    size_t naudits = 0;
+    if (args.audit) {
+        auditor = std::thread(audit_thread, std::ref(*db), db->snapshot().total(),
+                              std::ref(naudits));
+    }
+
     // Run transfers
     std::vector<std::thread> th(args.nthreads);
-    std::vector<size_t> opcounts(args.nthreads, 0);
+    std::vector<ftx_padded<size_t>> opcounts(args.nthreads);
     for (int i = 0; i != args.nthreads; ++i) {
         th[i] = std::thread(transfer_thread, std::ref(*db),
-                            args.noperations, std::ref(opcounts[i]),
-                            seed_randomness());
+                            std::cref(workload), args.noperations,
+                            std::ref(opcounts[i].value), seed_randomness());
+        if (args.affinity) {
+            pin_thread(th[i].native_handle(), i);
+        }
     }
 
     size_t totalops = 0;
     for (int i = 0; i != args.nthreads; ++i) {
         th[i].join();
-        totalops += opcounts[i];
+        totalops += opcounts[i].value;
+    }
+    if (auditor.joinable()) {
+        transfers_done = true;
+        auditor.join();
+        fprintf(stderr, "%zu audits, all consistent\n", naudits);
     }
 
     // Flush and close
@@ -1,9 +1,13 @@
 #include "io61.hh"
+#include "prof61.hh"
 #include <ctime>
 #include <csignal>
 #include <cerrno>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <vector>
+#include <string>
+#include <mutex>
 
 // helpers.cc
 //    The io61_args() structure parses command line arguments.
@@ -65,6 +69,72 @@ double monotonic_timestamp() {
 }
 
 
+// pin_thread(t, index)
+//    Pin thread `t`, the `index`th worker, to one CPU. Workers take the
+//    CPUs this process may use in order of NUMA node, then CPU number,
+//    so a group of workers fills one node (and its caches and memory)
+//    before spilling onto the next. Workers past the CPU count wrap.
+
+static void parse_cpulist(const char* s, std::vector<int>& cpus) {
+    // format: `0-3,8,10-11`
+    while (*s && *s != '\n') {
+        char* end;
+        int lo = strtol(s, &end, 10), hi = lo;
+        if (*end == '-') {
+            hi = strtol(end + 1, &end, 10);
+        }
+        for (int c = lo; c <= hi; ++c) {
+            cpus.push_back(c);
+        }
+        s = *end == ',' ? end + 1 : end;
+    }
+}
+
+static std::vector<int> worker_cpus() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    int r = sched_getaffinity(0, sizeof(allowed), &allowed);
+    assert(r == 0);
+    std::vector<int> order;
+    for (int node = 0; ; ++node) {
+        char fn[128], buf[4096];
+        snprintf(fn, sizeof(fn), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(fn, "r");
+        if (!f) {
+            break;
+        }
+        if (fgets(buf, sizeof(buf), f)) {
+            parse_cpulist(buf, order);
+        }
+        fclose(f);
+    }
+    // CPUs on no node we found (or no NUMA information) go last
+    for (int c = 0; c != CPU_SETSIZE; ++c) {
+        order.push_back(c);
+    }
+    std::vector<int> cpus;
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    for (int c : order) {
+        if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed) && !CPU_ISSET(c, &seen)) {
+            CPU_SET(c, &seen);
+            cpus.push_back(c);
+        }
+    }
+    return cpus;
+}
+
+void pin_thread(pthread_t t, int index) {
+    static const std::vector<int> cpus = worker_cpus();
+    assert(!cpus.empty());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % cpus.size()], &set);
+    int r = pthread_setaffinity_np(t, sizeof(set), &set);
+    (void) r;
+}
+
+
 // io61_args functions
 
 io61_args::io61_args(const char* opts_, size_t block_size_)
@@ -162,6 +232,64 @@ io61_args& io61_args::parse(int argc, char** argv) {
         case 'M':
             this->modify = true;
             break;
+        case 'L':
+            this->range_locks = true;
+            break;
+        case 'm':
+            this->mmap = true;
+            break;
+        case 'c':
+            this->binary = true;
+            break;
+        case 'f':
+            this->lockfree = true;
+            break;
+        case 'O':
+            this->optimistic = true;
+            break;
+        case 'w':
+            this->wal = true;
+            break;
+        case 'V':
+            this->audit = true;
+            break;
+        case 'Z':
+            this->zipf = strtod(optarg, &endptr);
+            if (endptr == optarg || *endptr || !(this->zipf > 0)) {
+                goto usage;
+            }
+            break;
+        case 'H': {
+            unsigned long n = strtoul(optarg, &endptr, 0);
+            if (endptr == optarg || *endptr || n > 100) {
+                goto usage;
+            }
+            this->hotspot = n;
+            break;
+        }
+        case 'S':
+            this->scan = true;
+            break;
+        case 'A':
+            this->affinity = true;
+            break;
+        case 'P': {
+            int n = strtol(optarg, &endptr, 0);
+            if (endptr == optarg || *endptr || n <= 0) {
+                goto usage;
+            }
+            this->nshards = n;
+            break;
+        }
+        case 'x':
+            this->shared = true;
+            break;
+        case 'k':
+            this->batch = (size_t) strtoul(optarg, &endptr, 0);
+            if (this->batch == 0 || endptr == optarg || *endptr) {
+                goto usage;
+            }
+            break;
         case 'r': {
             unsigned long n = strtoul(optarg, &endptr, 0);
             if (endptr == optarg || *endptr) {
@@ -250,6 +378,16 @@ io61_args& io61_args::parse(int argc, char** argv) {
     if (this->ndistinguished_threads > this->nthreads) {
         goto usage;
     }
+    if (this->nshards > 1 && this->mmap) {
+        fprintf(stderr, "%s: -P and -m are incompatible\n", this->program_name);
+        goto usage;
+    }
+    if (this->shared
+        && (this->binary || this->lockfree || this->optimistic || this->wal)) {
+        fprintf(stderr, "%s: -x is incompatible with -c, -f, -O, and -w\n",
+                this->program_name);
+        goto usage;
+    }
     this->block_size = block_size_;
     return *this;
 
@@ -331,6 +469,48 @@ void io61_args::usage() {
     if (strchr(this->opts, 'M')) {
         fprintf(stderr, "    -M            Modify input file in place\n");
     }
+    if (strchr(this->opts, 'L')) {
+        fprintf(stderr, "    -L            Also lock accounts with io61 range locks\n");
+    }
+    if (strchr(this->opts, 'm')) {
+        fprintf(stderr, "    -m            Memory-map the account database\n");
+    }
+    if (strchr(this->opts, 'c')) {
+        fprintf(stderr, "    -c            Keep balances in memory in binary\n");
+    }
+    if (strchr(this->opts, 'f')) {
+        fprintf(stderr, "    -f            Transfer without locks (implies -c)\n");
+    }
+    if (strchr(this->opts, 'O')) {
+        fprintf(stderr, "    -O            Use optimistic transactions\n");
+    }
+    if (strchr(this->opts, 'w')) {
+        fprintf(stderr, "    -w            Log transfers to FILE.wal (implies -c)\n");
+    }
+    if (strchr(this->opts, 'V')) {
+        fprintf(stderr, "    -V            Audit the total balance with snapshots\n");
+    }
+    if (strchr(this->opts, 'A')) {
+        fprintf(stderr, "    -A            Pin threads to CPUs, filling NUMA nodes in turn\n");
+    }
+    if (strchr(this->opts, 'P')) {
+        fprintf(stderr, "    -P N          Split the database into N shard files\n");
+    }
+    if (strchr(this->opts, 'x')) {
+        fprintf(stderr, "    -x            Share the database with other processes (implies -L)\n");
+    }
+    if (strchr(this->opts, 'k')) {
+        fprintf(stderr, "    -k N          Execute transfers in batches of N\n");
+    }
+    if (strchr(this->opts, 'Z')) {
+        fprintf(stderr, "    -Z S          Pick accounts with Zipf exponent S\n");
+    }
+    if (strchr(this->opts, 'H')) {
+        fprintf(stderr, "    -H PCT        Send PCT%% of transfers among accounts 0-2\n");
+    }
+    if (strchr(this->opts, 'S')) {
+        fprintf(stderr, "    -S            Transfer between consecutive accounts\n");
+    }
 }
 
 void io61_args::after_open() {
@@ -398,6 +578,47 @@ void io61_args::after_write(FILE* f) {
 
 namespace {
 
+// Counters of closed files, in closing order; the profiler lists at most
+// MAX_STATS_FILES of them after their totals
+struct io61_file_stats {
+    int fd;
+    int mode;
+    io61_stats st;
+};
+static std::mutex closed_stats_mutex;
+static std::vector<io61_file_stats> closed_stats;
+static constexpr size_t MAX_STATS_FILES = 32;
+
+static std::string lock_stats_json(const io61_lock_stats& ls) {
+    char buf[200];
+    snprintf(buf, sizeof(buf),
+        "{\"acquisitions\":%llu, \"contended\":%llu, \"wait_ns\":%llu, "
+        "\"wait_hist\":[", ls.acquisitions, ls.contended, ls.wait_ns);
+    std::string json = buf;
+    // Trailing empty buckets are omitted
+    int n = io61_lock_stats::nbuckets;
+    while (n != 0 && ls.wait_hist[n - 1] == 0) {
+        --n;
+    }
+    for (int b = 0; b != n; ++b) {
+        snprintf(buf, sizeof(buf), "%s%llu", b ? "," : "", ls.wait_hist[b]);
+        json += buf;
+    }
+    return json + "]}";
+}
+
+static std::string stats_json(const io61_stats& st) {
+    char buf[300];
+    snprintf(buf, sizeof(buf),
+        ", \"wakeups\":%llu, \"futile_wakeups\":%llu, "
+        "\"spurious_wakeups\":%llu, \"deadlock_checks\":%llu",
+        st.wakeups, st.futile_wakeups, st.spurious_wakeups,
+        st.deadlock_checks);
+    return "\"range_locks\":" + lock_stats_json(st.ranges)
+        + ", \"lock_table\":" + lock_stats_json(st.lock_table)
+        + ", \"slot_locks\":" + lock_stats_json(st.slots) + buf;
+}
+
 struct io61_profiler {
     double begin_at;
     io61_profiler();
@@ -432,27 +653,47 @@ io61_profiler::~io61_profiler() {
 #endif
 
     char buf[1000];
-    ssize_t len = snprintf(buf, sizeof(buf),
-        "{\"time\":%.6f, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld}\n",
+    snprintf(buf, sizeof(buf),
+        "{\"time\":%.6f, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld",
         real_elapsed,
         usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
         usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
         maxrss);
-
-    off_t off = lseek(100, 0, SEEK_CUR);
-    int fd = (off != (off_t) -1 || errno == ESPIPE ? 100 : STDERR_FILENO);
-    if (fd == STDERR_FILENO && !getenv("TIMING")) {
-        return;
-    } else if (fd == STDERR_FILENO) {
-        fflush(stderr);
-    }
-    while (true) {
-        ssize_t nw = write(fd, buf, len);
-        if (nw == len) {
-            break;
+    std::string json = buf;
+
+    // io61 lock counters: totals over all closed files, then each file
+    std::unique_lock guard(closed_stats_mutex);
+    if (!closed_stats.empty()) {
+        io61_stats total;
+        for (auto& cs : closed_stats) {
+            total += cs.st;
         }
-        assert(nw == -1 && (errno == EINTR || errno == EAGAIN));
+        json += ", " + stats_json(total) + ", \"files\":[";
+        for (size_t i = 0; i != closed_stats.size() && i != MAX_STATS_FILES; ++i) {
+            auto& cs = closed_stats[i];
+            snprintf(buf, sizeof(buf), "%s{\"fd\":%d, \"mode\":\"%s\", ",
+                     i ? ", " : "", cs.fd,
+                     cs.mode == O_RDONLY ? "r" : cs.mode == O_WRONLY ? "w" : "rw");
+            json += buf + stats_json(cs.st) + "}";
+        }
+        json += "]";
+    }
+    // metrics from prof61.hh, if any recorded something
+    std::string metrics = prof61_json();
+    if (!metrics.empty()) {
+        json += ", \"prof61\":" + metrics;
     }
+    json += "}\n";
+    prof61_emit(json);
 }
 
 }
+
+
+// io61_record_stats(fd, mode, st)
+//    Saves the counters of a file being closed for the profiler.
+
+void io61_record_stats(int fd, int mode, const io61_stats& st) {
+    std::unique_lock guard(closed_stats_mutex);
+    closed_stats.push_back({fd, mode, st});
+}
@@ -8,8 +8,66 @@
 #include <sys/stat.h>
 #include <thread>
 #include <map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
 
 
+// io61_slot
+//    One block of the positioned-mode cache. Each slot has its own mutex,
+//    so threads working on different blocks never wait for each other.
+//
+//    `seq` is a sequence lock over `tag`, `end_tag`, and `buf`: holders
+//    of `m` make it odd while they change them, and even afterwards.
+//    Cache-hit reads copy without locking, then check that `seq` didn't
+//    move (see `io61_pread_hit`).
+
+struct alignas(64) io61_slot {
+    static constexpr off_t slotsz = 8192;
+    std::mutex m;
+    std::atomic<unsigned> seq = 0;
+    io61_lock_stats stats;     // acquisitions of `m`, protected by `m`
+    off_t tag = -1;            // offset of first byte in `buf`, or -1
+    off_t end_tag = -1;        // offset one past last valid byte
+    off_t dirty_tag = 0;       // written bytes are [dirty_tag, dirty_end_tag)
+    off_t dirty_end_tag = 0;
+    unsigned char buf[slotsz];
+};
+
+
+// io61_range
+//    A locked range [start, end) of a file, shared (`LOCK_SH`) or
+//    exclusive (`LOCK_EX`). Threads blocked on it wait on their own
+//    condition variables, linked from `waiters`.
+//
+//    A `pending` range is a reservation for an exclusive lock that is
+//    waiting. Requests that arrive after it (with a later `ticket`) treat
+//    it as held, so a stream of shared lockers can't starve a writer.
+//
+//    Each range records the thread that `owner`s it, and each waiter the
+//    range it is queued `on`; together they form the wait-for graph that
+//    `io61_lock` searches for deadlocks.
+
+struct io61_range;
+
+struct io61_range_waiter {
+    std::condition_variable cv;
+    bool woken = false;
+    io61_range_waiter* next = nullptr;
+    io61_range* on = nullptr;  // range waited for, until woken
+};
+
+struct io61_range {
+    off_t end;
+    int type;                  // LOCK_SH or LOCK_EX
+    unsigned long ticket;      // arrival order of the request
+    std::thread::id owner;
+    bool pending = false;
+    io61_range_waiter* waiters = nullptr;
+};
+
 
 // io61_file
 //    Data structure for io61 file wrappers.
@@ -19,25 +77,164 @@ struct io61_file {
     int mode;        // O_RDONLY, O_WRONLY, or O_RDWR
     bool seekable;   // is this file seekable?
 
-    // Single-slot cache
+    // Single-slot cache for streaming reads and writes
     static constexpr off_t cbufsz = 8192;
     unsigned char cbuf[cbufsz];
     off_t tag;       // offset of first character in `cbuf`
     off_t pos_tag;   // next offset to read or write (non-positioned mode)
     off_t end_tag;   // offset one past last valid character in `cbuf`
 
-    // Positioned mode
+    // Positioned mode: a direct-mapped cache of `nslots` blocks, where
+    // block `off / blocksz` lives in slot `(off / blocksz) % nslots`.
+    // Hits and misses lock only their slot, not `m`. `blocksz` is at
+    // most `slotsz`; `io61_set_record_size` can shrink it to a multiple
+    // of the file's record size.
     //bool dirty = false;       // make this atomic (give the dirty member an atomic type.)
     std::atomic<bool> dirty = false;  //has cache been written? 
-    bool positioned = false;  // is cache in positioned mode?
+    std::atomic<bool> positioned = false;  // is cache in positioned mode?
+    static constexpr size_t nslots = 64;
+    io61_array<io61_slot> slots;          // allocated for O_RDWR files
+    off_t blocksz = io61_slot::slotsz;
+
+    // Write-back thread: once more than `dirty_high_water` slots are
+    // dirty, it writes slots back until at most `dirty_low_water` are,
+    // so refills rarely wait for a `pwrite`. Started by the first write.
+    static constexpr size_t dirty_high_water = nslots / 2;
+    static constexpr size_t dirty_low_water = nslots / 4;
+    std::atomic<size_t> ndirty = 0;       // number of dirty slots
+    std::once_flag wb_once;
+    std::thread wb_thread;
+    std::mutex wb_m;
+    std::condition_variable wb_cv;
+    bool wb_stop = false;
+
+    // Protects the streaming cache. Not recursive: public entry points
+    // lock it once and call `_locked` helpers, which assume it is held.
+    std::mutex m;
+
+    // File range locks, indexed by start offset, under their own mutex
+    std::mutex lock_m;
+    std::multimap<off_t, io61_range> ranges;
+    off_t max_range_len = 0;  // no held range is longer
+    unsigned long next_ticket = 0;
+    std::unordered_map<std::thread::id, io61_range_waiter*> waiting;
+
+    // Shared mode (`io61_share`): range locks are also open file
+    // description locks, and positioned I/O bypasses the cache
+    bool shared = false;
+
+    // Contention counters for the profiler, protected by `lock_m`; the
+    // slots count their own
+    io61_stats stats;
 
-    // file range lock
-    std::recursive_mutex m; //mutex
-    std::condition_variable_any condition_v;
-    std::map<off_t, off_t> locked_range_map; //Each key-value pair in the locked_range_map corresponds to a locked range in the file: key: start offset, value: end offset
+};
 
 
-};
+// io61_begin_change(s), io61_end_change(s)
+//    Bracket changes to slot `s`'s data, which the caller has locked, so
+//    unlocked readers notice them. ThreadSanitizer would report the
+//    (discarded) racing copies of unlocked reads, and doesn't support
+//    fences, so sanitized builds always lock instead.
+
+#if defined(__SANITIZE_THREAD__)
+static constexpr bool io61_unlocked_hits = false;
+#else
+static constexpr bool io61_unlocked_hits = true;
+#endif
+
+static inline void io61_begin_change(io61_slot& s) {
+    if (!io61_unlocked_hits) {
+        return;
+    }
+    s.seq.store(s.seq.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+static inline void io61_end_change(io61_slot& s) {
+    if (!io61_unlocked_hits) {
+        return;
+    }
+    s.seq.store(s.seq.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+}
+
+
+// io61_counted_lock(m, st), io61_counted_relock(guard, st)
+//    Lock `m` (or relock `guard`), counting the acquisition in `st`,
+//    which the mutex protects. Only a failed `try_lock` reads the clock.
+
+static void io61_counted_relock(std::unique_lock<std::mutex>& guard,
+                                io61_lock_stats& st) {
+    if (!guard.try_lock()) {
+        auto t0 = std::chrono::steady_clock::now();
+        guard.lock();
+        st.add_wait(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - t0).count());
+    }
+    ++st.acquisitions;
+}
+
+static std::unique_lock<std::mutex> io61_counted_lock(std::mutex& m,
+                                                      io61_lock_stats& st) {
+    std::unique_lock guard(m, std::defer_lock);
+    io61_counted_relock(guard, st);
+    return guard;
+}
+
+
+// io61_set_allocator(alloc, dealloc), io61_allocate(align, size),
+// io61_deallocate(ptr, size)
+//    The allocator hooks. `io61_nallocated` counts the allocations still
+//    outstanding, so the hooks never change under live memory.
+
+static void* io61_default_alloc(size_t align, size_t size) {
+    // aligned_alloc wants a multiple of the alignment
+    return aligned_alloc(align, (size + align - 1) & ~(align - 1));
+}
+
+static void io61_default_free(void* ptr, size_t size) {
+    (void) size;
+    free(ptr);
+}
+
+static std::mutex io61_alloc_m;
+static void* (*io61_alloc_hook)(size_t, size_t) = io61_default_alloc;
+static void (*io61_free_hook)(void*, size_t) = io61_default_free;
+static std::atomic<size_t> io61_nallocated;
+
+int io61_set_allocator(void* (*alloc)(size_t align, size_t size),
+                       void (*dealloc)(void* ptr, size_t size)) {
+    if (!alloc != !dealloc) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::unique_lock guard(io61_alloc_m);
+    if (io61_nallocated != 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    io61_alloc_hook = alloc ? alloc : io61_default_alloc;
+    io61_free_hook = dealloc ? dealloc : io61_default_free;
+    return 0;
+}
+
+void* io61_allocate(size_t align, size_t size) {
+    void* ptr = io61_alloc_hook(align, size);
+    if (ptr) {
+        ++io61_nallocated;
+    } else {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void io61_deallocate(void* ptr, size_t size) {
+    if (ptr) {
+        io61_free_hook(ptr, size);
+        --io61_nallocated;
+    }
+}
 
 
 // io61_fdopen(fd, mode)
@@ -48,7 +245,12 @@ struct io61_file {
 io61_file* io61_fdopen(int fd, int mode) {
     assert(fd >= 0);
     assert((mode & O_APPEND) == 0);
-    io61_file* f = new io61_file;
+    void* mem = io61_allocate(std::max(alignof(io61_file), size_t(64)),
+                              sizeof(io61_file));
+    if (!mem) {
+        return nullptr;
+    }
+    io61_file* f = new (mem) io61_file;
     f->fd = fd;
     f->mode = mode & O_ACCMODE;
     off_t off = lseek(fd, 0, SEEK_CUR);
@@ -60,6 +262,9 @@ io61_file* io61_fdopen(int fd, int mode) {
         f->tag = f->pos_tag = f->end_tag = 0;
     }
     f->dirty = f->positioned = false;
+    if (f->mode == O_RDWR) {
+        f->slots = io61_array<io61_slot>(io61_file::nslots);
+    }
     return f;
 }
 
@@ -68,9 +273,24 @@ io61_file* io61_fdopen(int fd, int mode) {
 //    Closes the io61_file `f` and releases all its resources.
 
 int io61_close(io61_file* f) {
+    if (f->wb_thread.joinable()) {
+        {
+            std::unique_lock guard(f->wb_m);
+            f->wb_stop = true;
+        }
+        f->wb_cv.notify_all();
+        f->wb_thread.join();
+    }
     io61_flush(f);
+    if (f->slots) {
+        for (size_t i = 0; i != io61_file::nslots; ++i) {
+            f->stats.slots += f->slots[i].stats;
+        }
+    }
+    io61_record_stats(f->fd, f->mode, f->stats);
     int r = close(f->fd);
-    delete f;
+    f->~io61_file();
+    io61_deallocate(f, sizeof(io61_file));
     return r;
 }
 
@@ -81,13 +301,14 @@ int io61_close(io61_file* f) {
 //    Reads a single (unsigned) byte from `f` and returns it. Returns EOF,
 //    which equals -1, on end of file or error.
 
-static int io61_fill(io61_file* f);
+static int io61_fill_locked(io61_file* f);
+static int io61_flush_locked(io61_file* f);
 
 int io61_readc(io61_file* f) {
     assert(!f->positioned);
     std::unique_lock guard(f->m); // Locking here, if this function is called concurrently by multiple threads, placing the lock at the beginning ensures that only one thread can read or modify the position-related data (pos_tag, end_tag) at a time, preventing race conditions
     if (f->pos_tag == f->end_tag) {
-        io61_fill(f);
+        io61_fill_locked(f);
         if (f->pos_tag == f->end_tag) {
             return -1;
         }
@@ -115,7 +336,7 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
     size_t nread = 0;
     while (nread != sz) {
         if (f->pos_tag == f->end_tag) {
-            int r = io61_fill(f);
+            int r = io61_fill_locked(f);
             if (r == -1 && nread == 0) {
                 return -1;
             } else if (f->pos_tag == f->end_tag) {
@@ -138,17 +359,16 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
 
 int io61_writec(io61_file* f, int c) {
     assert(!f->positioned);
+    // protect the update of pos_tag, end_tag, and dirty
+    // no data races!
+    std::unique_lock guard(f->m); // Locking here
     if (f->pos_tag == f->tag + f->cbufsz) {
-        int r = io61_flush(f);
+        int r = io61_flush_locked(f);
         if (r == -1) {
             return -1;
         }
     }
 
-    // protect the update of pos_tag, end_tag, and dirty
-    // no data races!
-    std::unique_lock guard(f->m); // Locking here
-
     f->cbuf[f->pos_tag - f->tag] = c;
     ++f->pos_tag;
     ++f->end_tag;
@@ -172,7 +392,7 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
     size_t nwritten = 0;
     while (nwritten != sz) {
         if (f->end_tag == f->tag + f->cbufsz) {
-            int r = io61_flush(f);
+            int r = io61_flush_locked(f);
             if (r == -1 && nwritten == 0) {
                 return -1;
             } else if (r == -1) {
@@ -200,15 +420,21 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 //    data cached for reading and seeks to the logical file position.
 
 static int io61_flush_dirty(io61_file* f);
-static int io61_flush_dirty_positioned(io61_file* f);
+static int io61_flush_slots(io61_file* f);
 static int io61_flush_clean(io61_file* f);
 
 int io61_flush(io61_file* f) {
     // place before accessing/modifying shared state
     std::unique_lock guard(f->m);
+    return io61_flush_locked(f);
+}
+
+// io61_flush_locked(f)
+//    Like `io61_flush(f)`, for callers that have locked `f->m`.
 
-    if (f->dirty && f->positioned) {
-        return io61_flush_dirty_positioned(f);
+static int io61_flush_locked(io61_file* f) {
+    if (f->positioned) {
+        return io61_flush_slots(f);
     } else if (f->dirty) {
         return io61_flush_dirty(f);
     } else {
@@ -223,15 +449,23 @@ int io61_flush(io61_file* f) {
 
 int io61_seek(io61_file* f, off_t off) {
     std::unique_lock guard(f->m);
-    int r = io61_flush(f);
+    int r = io61_flush_locked(f);
     if (r == -1) {
         return -1;
     }
-    // std::unique_lock guard(f->m);
     off_t roff = lseek(f->fd, off, SEEK_SET);
     if (roff == -1) {
         return -1;
     }
+    // Streaming writes bypass the positioned cache, so forget it
+    if (f->positioned) {
+        for (size_t i = 0; i != io61_file::nslots; ++i) {
+            auto slot_guard = io61_counted_lock(f->slots[i].m, f->slots[i].stats);
+            io61_begin_change(f->slots[i]);
+            f->slots[i].tag = f->slots[i].end_tag = -1;
+            io61_end_change(f->slots[i]);
+        }
+    }
     f->tag = f->pos_tag = f->end_tag = off;
     f->positioned = false;
     return 0;
@@ -240,13 +474,14 @@ int io61_seek(io61_file* f, off_t off) {
 
 // Helper functions
 
-// io61_fill(f)
+// io61_fill_locked(f)
 //    Fill the cache by reading from the file. Returns 0 on success,
-//    -1 on error. Used only for non-positioned files.
+//    -1 on error. Used only for non-positioned files; the caller must
+//    have locked `f->m`.
 
-static int io61_fill(io61_file* f) {
-    std::unique_lock guard(f->m);
-    assert(f->tag == f->end_tag && f->pos_tag == f->end_tag);
+static int io61_fill_locked(io61_file* f) {
+    assert(f->pos_tag == f->end_tag && !f->dirty);
+    f->tag = f->end_tag;
     ssize_t nr;
     while (true) {
         nr = read(f->fd, f->cbuf, f->cbufsz);
@@ -282,23 +517,37 @@ static int io61_flush_dirty(io61_file* f) {
     return 0;
 }
 
-static int io61_flush_dirty_positioned(io61_file* f) {
-    // Called when `f`’s cache is dirty and positioned.
+static int io61_flush_slot(io61_file* f, io61_slot& s) {
+    // Write back the dirty bytes of slot `s`, which the caller has locked.
     // Uses `pwrite`; does not change file position.
-    off_t flush_tag = f->tag;
-    while (flush_tag != f->end_tag) {
-        ssize_t nw = pwrite(f->fd, &f->cbuf[flush_tag - f->tag],
-                            f->end_tag - flush_tag, flush_tag);
+    if (s.dirty_tag == s.dirty_end_tag) {
+        return 0;
+    }
+    while (s.dirty_tag != s.dirty_end_tag) {
+        ssize_t nw = pwrite(f->fd, &s.buf[s.dirty_tag - s.tag],
+                            s.dirty_end_tag - s.dirty_tag, s.dirty_tag);
         if (nw >= 0) {
-            flush_tag += nw;
+            s.dirty_tag += nw;
         } else if (errno != EINTR && errno != EINVAL) {
             return -1;
         }
     }
-    f->dirty = false;
+    --f->ndirty;
     return 0;
 }
 
+static int io61_flush_slots(io61_file* f) {
+    // Called when `f`’s cache is positioned.
+    int r = 0;
+    for (size_t i = 0; i != io61_file::nslots; ++i) {
+        auto slot_guard = io61_counted_lock(f->slots[i].m, f->slots[i].stats);
+        if (io61_flush_slot(f, f->slots[i]) == -1) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
 static int io61_flush_clean(io61_file* f) {
     // Called when `f`’s cache is clean.
     if (!f->positioned && f->seekable) {
@@ -316,90 +565,483 @@ static int io61_flush_clean(io61_file* f) {
 
 // io61_pread(f, buf, sz, off)
 //    Read up to `sz` bytes from `f` into `buf`, starting at offset `off`.
-//    Returns the number of characters read or -1 on error.
+//    Returns the number of characters read or -1 on error. A read may
+//    span cache blocks; it is short only at end of file.
 //
 //    This function can only be called when `f` was opened in read/write
 //    more (O_RDWR).
 
-static int io61_pfill(io61_file* f, off_t off);
+static int io61_pfill(io61_file* f, io61_slot& s, off_t off);
 
-ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz,
-                   off_t off) {
-    // protect the update of cbuf, tag, end_tag
-    std::unique_lock guard(f->m);
-    if (!f->positioned || off < f->tag || off >= f->end_tag) {
-        if (io61_pfill(f, off) == -1) {
-            return -1;
+// Return the slot for offset `off`, locked by `guard`, after filling it
+// with the block containing `off` if necessary
+static io61_slot* io61_pslot(io61_file* f, off_t off,
+                             std::unique_lock<std::mutex>& guard) {
+    assert(f->mode == O_RDWR);
+    if (!f->positioned) {
+        f->positioned = true;
+    }
+    off_t block = off / f->blocksz;
+    io61_slot* s = &f->slots[block % io61_file::nslots];
+    guard = io61_counted_lock(s->m, s->stats);
+    if (s->tag != block * f->blocksz
+        && io61_pfill(f, *s, block * f->blocksz) == -1) {
+        return nullptr;
+    }
+    return s;
+}
+
+// io61_pread_hit(f, buf, sz, off)
+//    Try to read from a cached block without locking its slot: copy, then
+//    check that the slot's `seq` was even and unchanged throughout.
+//    Returns the number of bytes read, or -1 on a miss or a concurrent
+//    change, after which the caller must lock.
+
+static ssize_t io61_pread_hit(io61_file* f, unsigned char* buf, size_t sz,
+                              off_t off) {
+    off_t block = off / f->blocksz;
+    io61_slot& s = f->slots[block % io61_file::nslots];
+    unsigned seq = s.seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+        return -1;
+    }
+    // A holder of `s.m` may be reassigning the slot, so the tags can be
+    // stale or mismatched: check that they describe one block before
+    // trusting them to bound the copy
+    off_t tag = std::atomic_ref(s.tag).load(std::memory_order_relaxed);
+    off_t end_tag = std::atomic_ref(s.end_tag).load(std::memory_order_relaxed);
+    if (tag != block * f->blocksz
+        || end_tag < tag || end_tag > tag + f->blocksz) {
+        return -1;
+    }
+    size_t ncopy = off >= end_tag ? 0 : std::min(sz, size_t(end_tag - off));
+    memcpy(buf, &s.buf[off - tag], ncopy);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.seq.load(std::memory_order_relaxed) != seq) {
+        return -1;
+    }
+    return ncopy;
+}
+
+static ssize_t io61_pio_uncached(io61_file* f, unsigned char* buf,
+                                 size_t sz, off_t off, bool write);
+
+// Read from the one block containing `off`
+static ssize_t io61_pread_block(io61_file* f, unsigned char* buf, size_t sz,
+                                off_t off) {
+    if (io61_unlocked_hits && f->positioned) {
+        ssize_t n = io61_pread_hit(f, buf, sz, off);
+        if (n >= 0) {
+            return n;
         }
     }
-    size_t nleft = f->end_tag - off;
+    std::unique_lock<std::mutex> guard;
+    io61_slot* s = io61_pslot(f, off, guard);
+    if (!s) {
+        return -1;
+    } else if (off >= s->end_tag) {
+        return 0;
+    }
+    size_t nleft = s->end_tag - off;
     size_t ncopy = std::min(sz, nleft);
-    memcpy(buf, &f->cbuf[off - f->tag], ncopy);
+    memcpy(buf, &s->buf[off - s->tag], ncopy);
     return ncopy;
 }
 
+ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz,
+                   off_t off) {
+    assert(f->mode == O_RDWR);
+    if (f->shared) {
+        return io61_pio_uncached(f, buf, sz, off, false);
+    }
+    // Read block by block; a read that stops short of its block's end
+    // has reached end of file
+    size_t nread = 0;
+    while (nread != sz) {
+        ssize_t n = io61_pread_block(f, &buf[nread], sz - nread, off + nread);
+        if (n <= 0) {
+            return nread ? ssize_t(nread) : n;
+        }
+        nread += n;
+        if ((off + nread) % f->blocksz != 0) {
+            break;
+        }
+    }
+    return nread;
+}
+
 
 // io61_pwrite(f, buf, sz, off)
 //    Write up to `sz` bytes from `buf` into `f`, starting at offset `off`.
-//    Returns the number of characters written or -1 on error.
+//    Returns the number of characters written or -1 on error. A write
+//    may span cache blocks; it is short only on error.
 //
 //    This function can only be called when `f` was opened in read/write
 //    more (O_RDWR).
 
+static void io61_writeback_thread(io61_file* f);
+
+static ssize_t io61_pwrite_block(io61_file* f, const unsigned char* buf,
+                                 size_t sz, off_t off);
+
 ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
                     off_t off) {
-    std::unique_lock guard(f->m);
-    if (!f->positioned || off < f->tag || off >= f->end_tag) {
-        if (io61_pfill(f, off) == -1) {
-            return -1;
+    if (f->shared) {
+        return io61_pio_uncached(f, const_cast<unsigned char*>(buf), sz,
+                                 off, true);
+    }
+    size_t nwritten = 0;
+    while (nwritten != sz) {
+        ssize_t n = io61_pwrite_block(f, &buf[nwritten], sz - nwritten,
+                                      off + nwritten);
+        if (n <= 0) {
+            return nwritten ? ssize_t(nwritten) : n;
         }
+        nwritten += n;
     }
-    size_t nleft = f->end_tag - off;
+    return nwritten;
+}
+
+// Write to the one block containing `off`
+static ssize_t io61_pwrite_block(io61_file* f, const unsigned char* buf,
+                                 size_t sz, off_t off) {
+    std::unique_lock<std::mutex> guard;
+    io61_slot* s = io61_pslot(f, off, guard);
+    if (!s) {
+        return -1;
+    }
+    bool was_clean = s->dirty_tag == s->dirty_end_tag;
+    io61_begin_change(*s);
+    // Writes may extend the file; a gap before them reads as zeros
+    if (off > s->end_tag) {
+        memset(&s->buf[s->end_tag - s->tag], 0, off - s->end_tag);
+    }
+    size_t nleft = s->tag + f->blocksz - off;
     size_t ncopy = std::min(sz, nleft);
-    memcpy(&f->cbuf[off - f->tag], buf, ncopy);
-    f->dirty = true;
+    memcpy(&s->buf[off - s->tag], buf, ncopy);
+    // Only the changed bytes are written back
+    off_t w0 = std::min(off, s->end_tag), w1 = off + ncopy;
+    if (s->dirty_tag == s->dirty_end_tag) {
+        s->dirty_tag = w0;
+        s->dirty_end_tag = w1;
+    } else {
+        s->dirty_tag = std::min(s->dirty_tag, w0);
+        s->dirty_end_tag = std::max(s->dirty_end_tag, w1);
+    }
+    s->end_tag = std::max(s->end_tag, w1);
+    io61_end_change(*s);
+    if (was_clean && ++f->ndirty > io61_file::dirty_high_water) {
+        std::call_once(f->wb_once, [f] {
+            f->wb_thread = std::thread(io61_writeback_thread, f);
+        });
+        // The write-back thread tests `ndirty` under `wb_m`; taking it
+        // here keeps the wakeup from landing between its test and its wait
+        {
+            std::unique_lock wb_guard(f->wb_m);
+        }
+        f->wb_cv.notify_one();
+    }
     return ncopy;
 }
 
 
-// io61_pfill(f, off)
-//    Fill the single-slot cache with data including offset `off`.
-//    The handout code rounds `off` down to a multiple of 8192.
+// io61_writeback_thread(f)
+//    Body of `f`'s write-back thread. Each time more than
+//    `dirty_high_water` slots are dirty, walk the slots, writing back
+//    dirty ones, until no more than `dirty_low_water` are. A slot in use
+//    is waited for, which only delays that slot's thread.
 
-static int io61_pfill(io61_file* f, off_t off) {
-    std::unique_lock guard(f->m);
-    assert(f->mode == O_RDWR);
-    if (f->dirty && io61_flush(f) == -1) {
+static void io61_writeback_thread(io61_file* f) {
+    std::unique_lock guard(f->wb_m);
+    size_t i = 0;
+    while (true) {
+        f->wb_cv.wait(guard, [f] {
+            return f->wb_stop || f->ndirty > io61_file::dirty_high_water;
+        });
+        if (f->wb_stop) {
+            return;
+        }
+        guard.unlock();
+        bool progress = false;
+        for (size_t n = 0; n != io61_file::nslots
+                 && f->ndirty > io61_file::dirty_low_water; ++n) {
+            auto slot_guard = io61_counted_lock(f->slots[i].m, f->slots[i].stats);
+            bool dirty = f->slots[i].dirty_tag != f->slots[i].dirty_end_tag;
+            progress |= dirty && io61_flush_slot(f, f->slots[i]) == 0;
+            i = (i + 1) % io61_file::nslots;
+        }
+        guard.lock();
+        if (!progress) {
+            // writes are failing; don't spin
+            f->wb_cv.wait_for(guard, std::chrono::milliseconds(10));
+        }
+    }
+}
+
+
+// io61_pfill(f, s, off)
+//    Fill slot `s`, which the caller has locked, with the block starting
+//    at `off`, first writing back the block it held.
+
+static int io61_pfill(io61_file* f, io61_slot& s, off_t off) {
+    assert(off % f->blocksz == 0);
+    if (io61_flush_slot(f, s) == -1) {
         return -1;
     }
 
-    off = off - (off % 8192);
-    ssize_t nr = pread(f->fd, f->cbuf, f->cbufsz, off);
+    io61_begin_change(s);
+    ssize_t nr = pread(f->fd, s.buf, f->blocksz, off);
     if (nr == -1) {
+        // `buf` may be clobbered, so forget it
+        s.tag = s.end_tag = -1;
+        io61_end_change(s);
+        return -1;
+    }
+    s.tag = off;
+    s.end_tag = off + nr;
+    s.dirty_tag = s.dirty_end_tag = off;
+    io61_end_change(s);
+    return 0;
+}
+
+
+
+// io61_pio_uncached(f, buf, sz, off, write)
+//    Positioned I/O for shared files, straight to the kernel, since
+//    other processes may change any block this process could cache.
+
+static ssize_t io61_pio_uncached(io61_file* f, unsigned char* buf,
+                                 size_t sz, off_t off, bool write) {
+    while (true) {
+        ssize_t n = write ? pwrite(f->fd, buf, sz, off)
+                          : pread(f->fd, buf, sz, off);
+        if (n >= 0 || (errno != EINTR && errno != EAGAIN)) {
+            return n;
+        }
+    }
+}
+
+
+// io61_share(f)
+//    Share `f`, which must be open O_RDWR, with other processes that
+//    share it too. Range locks then also take open file description
+//    locks (`F_OFD_SETLKW`) on the same bytes, which exclude locks held
+//    through other opens of the file, and positioned reads and writes
+//    go straight to the file, so each sees the others' committed
+//    writes. Threads of this process still arbitrate among themselves
+//    in the range-lock table first, so at most one kernel lock request
+//    per range is outstanding. Call before locking any range. Returns
+//    0 on success and -1 on error, for instance if the kernel lacks OFD
+//    locks.
+
+int io61_share(io61_file* f) {
+    assert(f->mode == O_RDWR);
+    if (io61_flush(f) == -1) {
+        return -1;
+    }
+    struct flock fl = {};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if (fcntl(f->fd, F_OFD_GETLK, &fl) == -1) {
         return -1;
     }
-    f->tag = off;
-    f->end_tag = off + nr;
-    f->positioned = true;
+    auto guard = io61_counted_lock(f->lock_m, f->stats.lock_table);
+    assert(f->ranges.empty());
+    for (size_t i = 0; i != io61_file::nslots; ++i) {
+        auto slot_guard = io61_counted_lock(f->slots[i].m, f->slots[i].stats);
+        io61_begin_change(f->slots[i]);
+        f->slots[i].tag = f->slots[i].end_tag = -1;
+        io61_end_change(f->slots[i]);
+    }
+    f->shared = true;
     return 0;
 }
 
 
+// io61_set_record_size(f, rsz)
+//    Align `f`'s positioned-mode cache blocks to records of `rsz` bytes:
+//    blocks become the largest multiple of `rsz` that fits in a slot,
+//    so no record straddles two blocks and each record access is one
+//    cache operation. Call before any positioned I/O. Returns 0 on
+//    success and -1 if `rsz` is 0 or larger than a slot.
+
+int io61_set_record_size(io61_file* f, size_t rsz) {
+    assert(f->mode == O_RDWR && !f->positioned);
+    if (rsz == 0 || rsz > size_t(io61_slot::slotsz)) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->blocksz = io61_slot::slotsz / rsz * rsz;
+    return 0;
+}
+
 
 // FILE LOCKING FUNCTIONS
 
-// Function declaration (prototype)
-bool may_overlap_with_other_lock(io61_file* f, off_t off, off_t len);
+// io61_find_conflict(f, off, len, type, ticket, self)
+//    Return a range lock on `f` that blocks a `type` lock on
+//    [off, off + len) requested at `ticket`, or nullptr if there is none.
+//    Overlapping ranges conflict unless both are shared; reservations
+//    only block later requests, and the request's own reservation `self`
+//    never does. Ranges the calling thread already owns never conflict,
+//    so a thread may re-lock, or lock inside, a range it holds. Held
+//    ranges are at most `f->max_range_len` long, so only those starting
+//    in [off - max_range_len, off + len) can overlap, and `lower_bound`
+//    finds the first of them. The caller must have locked `f->lock_m`.
+
+static io61_range* io61_find_conflict(io61_file* f, off_t off, off_t len,
+                                      int type, unsigned long ticket,
+                                      const io61_range* self = nullptr) {
+    std::thread::id me = std::this_thread::get_id();
+    auto it = f->ranges.lower_bound(std::max(off - f->max_range_len, off_t(0)));
+    for (; it != f->ranges.end() && it->first < off + len; ++it) {
+        io61_range& r = it->second;
+        if (r.end > off && &r != self && r.owner != me
+            && (type == LOCK_EX || r.type == LOCK_EX)
+            && (!r.pending || r.ticket < ticket)) {
+            return &r;
+        }
+    }
+    return nullptr;
+}
+
+static std::multimap<off_t, io61_range>::iterator
+io61_add_range(io61_file* f, off_t off, off_t len, int type,
+               unsigned long ticket) {
+    f->max_range_len = std::max(f->max_range_len, len);
+    return f->ranges.emplace(off, io61_range{off + len, type, ticket,
+                                             std::this_thread::get_id()});
+}
+
+// Remove a range lock, waking the threads queued on it. Waiters can't
+// leave `wait` until `lock_m` is released, so each one is still there
+// after it's marked woken.
+static void io61_erase_range(io61_file* f,
+                             std::multimap<off_t, io61_range>::iterator it) {
+    io61_range_waiter* w = it->second.waiters;
+    while (w) {
+        io61_range_waiter* next = w->next;
+        w->woken = true;
+        w->on = nullptr;
+        w->cv.notify_one();
+        w = next;
+    }
+    f->ranges.erase(it);
+    if (f->ranges.empty()) {
+        f->max_range_len = 0;
+    }
+}
+
+// io61_deadlocked(f)
+//    Return true if the calling thread, which is waiting for a range
+//    lock, is part of a cycle in the wait-for graph: it waits for a
+//    range whose owner waits for a range ... whose owner is the caller.
+//    Each thread waits on one range at a time, so the walk follows a
+//    single path. The caller must have locked `f->lock_m`.
+
+static bool io61_deadlocked(io61_file* f) {
+    std::thread::id self = std::this_thread::get_id();
+    std::thread::id t = self;
+    for (size_t steps = 0; steps <= f->waiting.size(); ++steps) {
+        auto it = f->waiting.find(t);
+        if (it == f->waiting.end() || !it->second->on) {
+            return false;
+        }
+        t = it->second->on->owner;
+        if (t == self) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// How long a blocked `io61_lock` waits before looking for a deadlock
+static constexpr auto io61_deadlock_check_interval = std::chrono::milliseconds(10);
+
+
+// io61_kernel_lock(f, off, len, type, wait)
+//    Apply an open file description lock of `type` (LOCK_EX, LOCK_SH,
+//    or LOCK_UN) to [off, off + len) of shared file `f`, waiting for
+//    other processes' locks if `wait`. Locks through one description
+//    never conflict, so this only excludes other processes; relocking
+//    bytes replaces their lock type.
+
+static int io61_kernel_lock(io61_file* f, off_t off, off_t len, int type,
+                            bool wait) {
+    struct flock fl = {};
+    fl.l_type = type == LOCK_EX ? F_WRLCK : (type == LOCK_SH ? F_RDLCK : F_UNLCK);
+    fl.l_whence = SEEK_SET;
+    fl.l_start = off;
+    fl.l_len = len;
+    while (true) {
+        int r = fcntl(f->fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+        if (r != -1 || errno != EINTR) {
+            return r;
+        }
+    }
+}
+
+// Return the kernel lock type for newly granted range `it`: exclusive if
+// it, or any range it overlaps (which the caller must own), is, so a
+// shared relock can't downgrade the caller's exclusive kernel lock.
+// The caller must have locked `f->lock_m`.
+static int io61_kernel_type(io61_file* f,
+                            std::multimap<off_t, io61_range>::iterator it) {
+    off_t off = it->first, end = it->second.end;
+    if (it->second.type == LOCK_EX) {
+        return LOCK_EX;
+    }
+    auto r = f->ranges.lower_bound(std::max(off - f->max_range_len, off_t(0)));
+    for (; r != f->ranges.end() && r->first < end; ++r) {
+        if (r->second.end > off && !r->second.pending
+            && r->second.type == LOCK_EX) {
+            return LOCK_EX;
+        }
+    }
+    return LOCK_SH;
+}
+
+// Release the kernel lock on the parts of [off, off + len) that no
+// remaining range covers; covered bytes stay locked for their holders.
+// The caller must have locked `f->lock_m`.
+static int io61_kernel_unlock_uncovered(io61_file* f, off_t off, off_t len) {
+    off_t end = off + len;
+    std::vector<std::pair<off_t, off_t>> covered;
+    auto r = f->ranges.lower_bound(std::max(off - f->max_range_len, off_t(0)));
+    for (; r != f->ranges.end() && r->first < end; ++r) {
+        if (r->second.end > off && !r->second.pending) {
+            covered.emplace_back(std::max(r->first, off),
+                                 std::min(r->second.end, end));
+        }
+    }
+    std::sort(covered.begin(), covered.end());
+    int result = 0;
+    off_t pos = off;
+    for (auto [c0, c1] : covered) {
+        if (c0 > pos && io61_kernel_lock(f, pos, c0 - pos, LOCK_UN, false) == -1) {
+            result = -1;
+        }
+        pos = std::max(pos, c1);
+    }
+    if (pos < end && io61_kernel_lock(f, pos, end - pos, LOCK_UN, false) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
 
 // io61_try_lock(f, off, len, locktype)
 //    Attempts to acquire a lock on offsets `[off, off + len)` in file `f`.
 //    `locktype` must be `LOCK_EX`, which requests an exclusive lock,
-//    or `LOCK_SH`, which requests an shared lock. (The applications we
-//    provide in pset 6 only ever use `LOCK_EX`; `LOCK_SH` support is extra
-//    credit.)
+//    or `LOCK_SH`, which requests a shared lock. Any number of shared
+//    locks may overlap; an exclusive lock overlaps no other thread's
+//    lock. Locks are owned by threads: a thread's own locks never block
+//    it, so it can take a lock overlapping one it holds, of either type.
+//    Each successful call must be matched by its own `io61_unlock`.
 //
 //    Returns 0 if the lock was acquired and -1 if it was not. Does not
-//    block: if the lock cannot be acquired, it returns -1 right away.
+//    block: if the lock cannot be acquired, including because an earlier
+//    exclusive request is waiting for it, it returns -1 right away.
 
 int io61_try_lock(io61_file* f, off_t off, off_t len, int locktype) {
     assert(off >= 0 && len >= 0);
@@ -407,15 +1049,18 @@ int io61_try_lock(io61_file* f, off_t off, off_t len, int locktype) {
     if (len == 0) { //nothing to lock
         return 0;
     }
-    // no data races
-    std::unique_lock guard(f->m);
-    if (may_overlap_with_other_lock(f, off, len)) {
+    auto guard = io61_counted_lock(f->lock_m, f->stats.lock_table);
+    unsigned long ticket = f->next_ticket++;
+    if (io61_find_conflict(f, off, len, locktype, ticket)) {
         return -1;
     }
-    // store a specific range entry in locked_range_map, 
-    //l locks specific ranges of file
-    f->locked_range_map[off] = off + len;  
-
+    auto it = io61_add_range(f, off, len, locktype, ticket);
+    if (f->shared
+        && io61_kernel_lock(f, off, len, io61_kernel_type(f, it), false) == -1) {
+        io61_erase_range(f, it);
+        return -1;
+    }
+    ++f->stats.ranges.acquisitions;
     return 0;
 }
 
@@ -423,13 +1068,26 @@ int io61_try_lock(io61_file* f, off_t off, off_t len, int locktype) {
 // io61_lock(f, off, len, locktype)
 //    Acquire a lock on offsets `[off, off + len)` in file `f`.
 //    `locktype` must be `LOCK_EX`, which requests an exclusive lock,
-//    or `LOCK_SH`, which requests an shared lock. (The applications we
-//    provide in pset 6 only ever use `LOCK_EX`; `LOCK_SH` support is extra
-//    credit.)
+//    or `LOCK_SH`, which requests a shared lock. Any number of shared
+//    locks may overlap; an exclusive lock overlaps no other thread's
+//    lock. As with `io61_try_lock`, the caller's own locks never block
+//    it, and each acquisition needs its own unlock. A shared request
+//    waits behind any earlier exclusive request for an overlapping
+//    range, so writers aren't starved.
 //
 //    Returns 0 if the lock was acquired and -1 on error. Blocks until
 //    the lock can be acquired; the -1 return value is reserved for true
 //    error conditions, such as EDEADLK (a deadlock was detected).
+//
+//    Deadlock detection costs nothing while locks are granted quickly:
+//    only a thread that has been blocked for
+//    `io61_deadlock_check_interval` walks the wait-for graph, and it
+//    does so again each interval. A thread that finds itself in a cycle
+//    gives up its place, sets `errno` to EDEADLK, and returns -1; it
+//    should release its other locks and retry.
+
+static int io61_lock_held(io61_file* f, std::unique_lock<std::mutex>& guard,
+                          off_t off, off_t len, int locktype);
 
 int io61_lock(io61_file* f, off_t off, off_t len, int locktype) {
     assert(off >= 0 && len >= 0);
@@ -437,20 +1095,100 @@ int io61_lock(io61_file* f, off_t off, off_t len, int locktype) {
     if (len == 0) {
         return 0;
     }
-    // mutex ensures that only one thread can modify the lock state of the file at a time,
-    // lock is held for the duration of the function, ensuring thread safety when modifying the file's state
-    std::unique_lock guard(f->m);
-    while (may_overlap_with_other_lock(f, off, len)) {
-        // If there is overlap, the thread waits on the condition variable f->condition_v while holding the lock
-        // the thread will release the mutex temporarily and block, allowing other threads to potentially release their locks and notify this thread when the lock can be acquired
-        f->condition_v.wait(guard);
-    }
-    // lock is acquired for certain range by storing a specific range entry in locked_range_map, 
-    f->locked_range_map[off] = off + len;  
+    auto guard = io61_counted_lock(f->lock_m, f->stats.lock_table);
+    return io61_lock_held(f, guard, off, len, locktype);
+}
 
-    // The handout code polls using `io61_try_lock`.
-    // while (io61_try_lock(f, off, len, locktype) != 0) {
-    // }
+// Acquire a lock as `io61_lock` does; `guard` holds `f->lock_m`, and
+// holds it again on return
+static int io61_lock_held(io61_file* f, std::unique_lock<std::mutex>& guard,
+                          off_t off, off_t len, int locktype) {
+    unsigned long ticket = f->next_ticket++;
+    io61_range* self = nullptr;
+    std::multimap<off_t, io61_range>::iterator self_it;
+    std::chrono::steady_clock::time_point wait_start;
+    bool waited = false;
+    // A blocked thread queues on the one range it conflicts with and
+    // sleeps until that range is unlocked, then checks again; unlocking
+    // wakes only the threads queued on that range. A blocked exclusive
+    // request leaves a reservation, which becomes its lock.
+    while (io61_range* r = io61_find_conflict(f, off, len, locktype,
+                                              ticket, self)) {
+        if (!waited) {
+            wait_start = std::chrono::steady_clock::now();
+            waited = true;
+        }
+        if (locktype == LOCK_EX && !self) {
+            self_it = io61_add_range(f, off, len, locktype, ticket);
+            self = &self_it->second;
+            self->pending = true;
+        }
+        io61_range_waiter w;
+        w.next = r->waiters;
+        w.on = r;
+        r->waiters = &w;
+        f->waiting[std::this_thread::get_id()] = &w;
+        while (!w.woken) {
+            bool timeout = w.cv.wait_for(guard, io61_deadlock_check_interval)
+                == std::cv_status::timeout;
+            if (w.woken) {
+                ++f->stats.wakeups;
+            } else if (!timeout) {
+                ++f->stats.spurious_wakeups;
+            } else {
+                ++f->stats.deadlock_checks;
+            }
+            if (timeout && !w.woken && io61_deadlocked(f)) {
+                // Back out: leave the queue and drop the reservation
+                io61_range_waiter** wp = &r->waiters;
+                while (*wp != &w) {
+                    wp = &(*wp)->next;
+                }
+                *wp = w.next;
+                f->waiting.erase(std::this_thread::get_id());
+                if (self) {
+                    io61_erase_range(f, self_it);
+                }
+                errno = EDEADLK;
+                return -1;
+            }
+        }
+        f->waiting.erase(std::this_thread::get_id());
+        if (io61_find_conflict(f, off, len, locktype, ticket, self)) {
+            ++f->stats.futile_wakeups;
+        }
+    }
+    if (self) {
+        self->pending = false;
+    } else {
+        self_it = io61_add_range(f, off, len, locktype, ticket);
+    }
+    if (f->shared) {
+        // Wait for other processes without blocking this one's threads;
+        // the table entry keeps them off the range meanwhile
+        int ktype = io61_kernel_type(f, self_it);
+        guard.unlock();
+        int r = io61_kernel_lock(f, off, len, ktype, false);
+        if (r == -1 && (errno == EAGAIN || errno == EACCES)) {
+            if (!waited) {
+                wait_start = std::chrono::steady_clock::now();
+                waited = true;
+            }
+            r = io61_kernel_lock(f, off, len, ktype, true);
+        }
+        int saved_errno = errno;
+        io61_counted_relock(guard, f->stats.lock_table);
+        if (r == -1) {
+            io61_erase_range(f, self_it);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    ++f->stats.ranges.acquisitions;
+    if (waited) {
+        f->stats.ranges.add_wait(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - wait_start).count());
+    }
     return 0;
 }
 
@@ -459,57 +1197,104 @@ int io61_lock(io61_file* f, off_t off, off_t len, int locktype) {
 //    Release the lock on offsets `[off, off + len)` in file `f`.
 //    Returns 0 on success and -1 on error.
 
+static int io61_unlock_held(io61_file* f, off_t off, off_t len);
+
 int io61_unlock(io61_file* f, off_t off, off_t len) {
-    // (void) f;
     assert(off >= 0 && len >= 0);
     if (len == 0) {
         return 0;
     }
-    std::unique_lock guard(f->m);
-    // remove lock by erasing the range starting at off, so if the range is locked,
-    // this will unlock it by removing it from the locked_range_map
-    int remove = f->locked_range_map.erase(off);
-    if (remove == 0) { // lock was not found
+    auto guard = io61_counted_lock(f->lock_m, f->stats.lock_table);
+    return io61_unlock_held(f, off, len);
+}
+
+// Release a lock as `io61_unlock` does; the caller has locked `f->lock_m`
+static int io61_unlock_held(io61_file* f, off_t off, off_t len) {
+    // Prefer the caller's own range, so the wait-for graph stays right
+    // when threads hold identical shared ranges
+    auto [first, last] = f->ranges.equal_range(off);
+    auto found = last;
+    for (auto it = first; it != last; ++it) {
+        if (it->second.end == off + len && !it->second.pending
+            && (found == last
+                || it->second.owner == std::this_thread::get_id())) {
+            found = it;
+        }
+    }
+    if (found == last) { // lock was not found
         return -1;
     }
-    // after the lock has been removed, the function notifies all threads that are waiting on the condition variable
-    // could wake up other files waiting for lock on the file to be released
-    f->condition_v.notify_all();  // spurious wakeup possible, prob no big deal
+    auto it = found;
+    io61_erase_range(f, it);
+    if (f->shared) {
+        return io61_kernel_unlock_uncovered(f, off, len);
+    }
     return 0;
 }
 
 
+// io61_lock_many(f, reqs, n)
+//    Acquire all `n` locks described by `reqs` in file `f`, as if by
+//    `io61_lock` on each, under one acquisition of the lock table. The
+//    requests are sorted into offset order first, so callers locking
+//    overlapping sets of ranges can't deadlock each other; `reqs` is
+//    left sorted. Requests may overlap, since a thread's own locks never
+//    block it.
+//
+//    Returns 0 once every lock is held. Returns -1 on error (such as
+//    EDEADLK, which only a caller also holding other locks can cause),
+//    after releasing any of the `reqs` it had acquired.
+
+int io61_lock_many(io61_file* f, io61_lock_request* reqs, size_t n) {
+    std::sort(reqs, reqs + n, [] (const io61_lock_request& a,
+                                  const io61_lock_request& b) {
+        return a.off < b.off || (a.off == b.off && a.len < b.len);
+    });
+    auto guard = io61_counted_lock(f->lock_m, f->stats.lock_table);
+    for (size_t i = 0; i != n; ++i) {
+        assert(reqs[i].off >= 0 && reqs[i].len >= 0);
+        assert(reqs[i].locktype == LOCK_EX || reqs[i].locktype == LOCK_SH);
+        if (reqs[i].len != 0
+            && io61_lock_held(f, guard, reqs[i].off, reqs[i].len,
+                              reqs[i].locktype) == -1) {
+            int saved_errno = errno;
+            while (i != 0) {
+                --i;
+                if (reqs[i].len != 0) {
+                    io61_unlock_held(f, reqs[i].off, reqs[i].len);
+                }
+            }
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    return 0;
+}
 
-// HELPER FUNCTIONS
-// You shouldn't need to change these functions.
 
-// may_overlap_with_other_lock(f, off, len) predicate
-// Return true if some other thread (not `std::this_thread::get_id()`)
-// has a lock on a range of `f`, and that range might overlap with the
-// range [off, off + len).
-//
-// This function may return true when another thread has a range lock on
-// `f` that *doesn’t* overlap with [off, off + len). That is, it can
-// be conservative, rather than precise. However, it *must return false*
-// if all range locks on `f` are held by *this* thread.
-//
-// The caller must have locked all mutexes required to examine `f`’s
-// range lock state.
+// io61_unlock_many(f, reqs, n)
+//    Release all `n` locks described by `reqs` in file `f`, under one
+//    acquisition of the lock table. Returns 0 on success and -1 if any
+//    of the locks was not held.
 
-bool may_overlap_with_other_lock(io61_file* f, off_t off, off_t len) {
-    // 
-    for (const auto& [beg, end] : f->locked_range_map) { 
-        // check if beginning of the new range (off) is less than the end of an existing range (end)
-        // or end of the new range (off + len) is greater than or equal to the beginning of an existing range (beg)
-        // if first is false, no need to check further
-        if (off < end && off + len >= beg) {
-            return true;  // overlapping range found
+int io61_unlock_many(io61_file* f, const io61_lock_request* reqs, size_t n) {
+    auto guard = io61_counted_lock(f->lock_m, f->stats.lock_table);
+    int r = 0;
+    for (size_t i = 0; i != n; ++i) {
+        assert(reqs[i].off >= 0 && reqs[i].len >= 0);
+        if (reqs[i].len != 0
+            && io61_unlock_held(f, reqs[i].off, reqs[i].len) == -1) {
+            r = -1;
         }
     }
-    // no overlapping found
-    return false;
+    return r;
 }
 
+
+
+// HELPER FUNCTIONS
+// You shouldn't need to change these functions.
+
 // io61_open_check(filename, mode)
 //    Opens the file corresponding to `filename` and returns its io61_file.
 //    If `!filename`, returns either the standard input or the
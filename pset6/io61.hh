@@ -5,10 +5,14 @@
 #include <cstring>
 #include <cassert>
 #include <vector>
+#include <algorithm>
+#include <new>
 #include <random>
+#include <utility>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <pthread.h>
 
 struct io61_file;
 
@@ -36,11 +40,136 @@ int io61_try_lock(io61_file* f, off_t start, off_t len, int locktype);
 int io61_lock(io61_file* f, off_t start, off_t len, int locktype);
 int io61_unlock(io61_file* f, off_t start, off_t len);
 
+struct io61_lock_request {
+    off_t off;
+    off_t len;
+    int locktype;
+};
+int io61_lock_many(io61_file* f, io61_lock_request* reqs, size_t n);
+int io61_unlock_many(io61_file* f, const io61_lock_request* reqs, size_t n);
+
 int io61_flush(io61_file* f);
+int io61_share(io61_file* f);
+int io61_set_record_size(io61_file* f, size_t rsz);
+
+// Allocator: io61 takes each io61_file and positioned-mode cache from
+// `alloc(align, size)` (cache-line aligned), and returns them to
+// `dealloc(ptr, size)`; `io61_set_allocator(alloc, dealloc)` installs
+// them, and nullptrs the default (aligned_alloc). Call it before opening
+// files: it returns -1 (EBUSY) while io61 holds memory from the current
+// allocator. `io61_allocate` and `io61_deallocate` use the installed
+// allocator, so a program's own tables (like ftx_db's) can live with its
+// buffers; `io61_allocate` returns nullptr (ENOMEM) on failure.
+int io61_set_allocator(void* (*alloc)(size_t align, size_t size),
+                       void (*dealloc)(void* ptr, size_t size));
+void* io61_allocate(size_t align, size_t size);
+void io61_deallocate(void* ptr, size_t size);
+
+// io61_array<T>
+//    A fixed-size array of value-initialized `T`s, allocated with
+//    `io61_allocate` on at least a cache line. Empty by default.
+template <typename T>
+class io61_array {
+  public:
+    io61_array() = default;
+    explicit io61_array(size_t n)
+        : n_(n) {
+        void* mem = io61_allocate(std::max(alignof(T), size_t(64)), n * sizeof(T));
+        if (!mem) {
+            throw std::bad_alloc();
+        }
+        this->a_ = static_cast<T*>(mem);
+        for (size_t i = 0; i != n; ++i) {
+            new (&this->a_[i]) T();
+        }
+    }
+    io61_array(io61_array<T>&& x) noexcept
+        : a_(std::exchange(x.a_, nullptr)), n_(std::exchange(x.n_, 0)) {
+    }
+    io61_array<T>& operator=(io61_array<T>&& x) noexcept {
+        std::swap(this->a_, x.a_);
+        std::swap(this->n_, x.n_);
+        return *this;
+    }
+    ~io61_array() {
+        if (this->a_) {
+            for (size_t i = 0; i != this->n_; ++i) {
+                this->a_[i].~T();
+            }
+            io61_deallocate(this->a_, this->n_ * sizeof(T));
+        }
+    }
+
+    explicit operator bool() const {
+        return this->a_ != nullptr;
+    }
+    size_t size() const {
+        return this->n_;
+    }
+    T& operator[](size_t i) const {
+        return this->a_[i];
+    }
+
+  private:
+    T* a_ = nullptr;
+    size_t n_ = 0;
+};
+
+// Lock contention counters. io61_close hands each file's to
+// `io61_record_stats`, and the profiler reports them with its timing
+// results. A wait of `ns` nanoseconds is counted in `wait_hist[b]` for
+// the least `b` with `ns < 2**b`. Unlocked cache hits count nothing.
+struct io61_lock_stats {
+    static constexpr int nbuckets = 40;
+    unsigned long long acquisitions = 0;   // times the lock was taken
+    unsigned long long contended = 0;      // ... after waiting for it
+    unsigned long long wait_ns = 0;        // total time spent waiting
+    unsigned long long wait_hist[nbuckets] = {};
+
+    void add_wait(unsigned long long ns) {
+        ++this->contended;
+        this->wait_ns += ns;
+        int b = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+        ++this->wait_hist[std::min(b, nbuckets - 1)];
+    }
+    io61_lock_stats& operator+=(const io61_lock_stats& x) {
+        this->acquisitions += x.acquisitions;
+        this->contended += x.contended;
+        this->wait_ns += x.wait_ns;
+        for (int b = 0; b != nbuckets; ++b) {
+            this->wait_hist[b] += x.wait_hist[b];
+        }
+        return *this;
+    }
+};
+
+struct io61_stats {
+    io61_lock_stats ranges;                // range locks
+    io61_lock_stats lock_table;            // mutex on the range-lock table
+    io61_lock_stats slots;                 // positioned-cache slot mutexes
+    unsigned long long wakeups = 0;        // range waiters woken by unlocks
+    unsigned long long futile_wakeups = 0; // ... whose range was still blocked
+    unsigned long long spurious_wakeups = 0;  // waits ending unwoken, early
+    unsigned long long deadlock_checks = 0;   // waits timing out to check
+
+    io61_stats& operator+=(const io61_stats& x) {
+        this->ranges += x.ranges;
+        this->lock_table += x.lock_table;
+        this->slots += x.slots;
+        this->wakeups += x.wakeups;
+        this->futile_wakeups += x.futile_wakeups;
+        this->spurious_wakeups += x.spurious_wakeups;
+        this->deadlock_checks += x.deadlock_checks;
+        return *this;
+    }
+};
+
+void io61_record_stats(int fd, int mode, const io61_stats& st);
 
 int fd_open_check(const char* filename, int mode);
 FILE* stdio_open_check(const char* filename, int mode);
 double monotonic_timestamp();
+void pin_thread(pthread_t t, int index);
 
 
 struct io61_args {
@@ -54,7 +183,21 @@ struct io61_args {
     bool flush = false;                 // `-F`: flush output
     bool quiet = false;                 // `-q`: ignore errors
     bool modify = false;                // `-M`: modify in place
+    bool range_locks = false;           // `-L`: also use io61 range locks
+    bool mmap = false;                  // `-m`: memory-map the database
+    bool binary = false;                // `-c`: cache balances in binary
+    bool lockfree = false;              // `-f`: lock-free transfers
+    bool optimistic = false;            // `-O`: optimistic transactions
+    bool wal = false;                   // `-w`: write-ahead log
+    bool audit = false;                 // `-V`: audit totals with snapshots
     bool exponential = false;           // `-X`: exponential distribution
+    double zipf = 0.0;                  // `-Z`: Zipf exponent for accounts
+    unsigned hotspot = 0;               // `-H`: % of transfers on hot accounts
+    bool scan = false;                  // `-S`: sequential account scan
+    bool affinity = false;              // `-A`: pin threads to CPUs
+    size_t batch = 0;                   // `-k`: transfers per batch
+    int nshards = 1;                    // `-P`: number of database shards
+    bool shared = false;                // `-x`: share with other processes
     unsigned yield = 0;                 // `-y`: yield after output
     const char* output_file = nullptr;  // `-o`: output file
     const char* input_file = nullptr;   // input file
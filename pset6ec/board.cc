@@ -1,11 +1,13 @@
 #include "board.hh"
+#include "scheduler.hh"
 
 
 // pong_board(w, h) constructor
 //    Construct a new `w x h` pong board with all empty cells.
 pong_board::pong_board(int w, int h)
-    : width(w), height(h), cells(w * h, pong_cell()) {
-    obstacle_cell.type = cell_obstacle;
+    : width(w), height(h), kinds(w * h, cell_empty),
+      tile_columns((w + tile_size - 1) >> tile_shift),
+      tiles(tile_columns * ((h + tile_size - 1) >> tile_shift)) {
 }
 
 
@@ -17,6 +19,29 @@ pong_board::~pong_board() {
 }
 
 
+// pong_tile_guard(board, x0, y0, x1, y1) constructor
+//    Lock the tiles covering the cells from `x0, y0` to `x1, y1` in
+//    increasing tile order (row-major), which every multi-tile locker
+//    shares, so tile locking cannot deadlock.
+pong_tile_guard::pong_tile_guard(pong_board& board, int x0, int y0,
+                                 int x1, int y1) {
+    x0 = std::clamp(x0, 0, board.width - 1);
+    x1 = std::clamp(x1, 0, board.width - 1);
+    y0 = std::clamp(y0, 0, board.height - 1);
+    y1 = std::clamp(y1, 0, board.height - 1);
+    int tx0 = x0 >> pong_board::tile_shift, tx1 = x1 >> pong_board::tile_shift;
+    int ty0 = y0 >> pong_board::tile_shift, ty1 = y1 >> pong_board::tile_shift;
+    assert(tx1 - tx0 <= 1 && ty1 - ty0 <= 1);
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            this->ts[this->n] = &board.tiles[ty * board.tile_columns + tx];
+            this->ts[this->n]->lock();
+            ++this->n;
+        }
+    }
+}
+
+
 // pong_ball::move()
 //    Move this ball once.
 //
@@ -29,7 +54,40 @@ pong_board::~pong_board() {
 //    holes, and sticky cells. You should preserve its current logic while
 //    adding sufficient synchronization to make it thread-safe.
 int pong_ball::move() {
-    pong_cell& ccur = board.cell(this->x, this->y);
+    // fast path: the usual move into a free cell reads and writes only
+    // the cells between this one and `x + dx, y + dy`, which mostly lie
+    // in one tile, so lock just those. A colliding ball may change `dx`
+    // and `dy` until we hold our own tile, so read them atomically and
+    // check them again once locked.
+    {
+        int fdx = std::atomic_ref(this->dx).load(std::memory_order_relaxed);
+        int fdy = std::atomic_ref(this->dy).load(std::memory_order_relaxed);
+        pong_tile_guard guard(this->board,
+                              std::min(this->x, this->x + fdx),
+                              std::min(this->y, this->y + fdy),
+                              std::max(this->x, this->x + fdx),
+                              std::max(this->y, this->y + fdy));
+        if (this->stopped) {
+            return 0;
+        }
+        pong_cell ccur = this->board.cell(this->x, this->y);
+        pong_cell cnext = this->board.cell(this->x + fdx, this->y + fdy);
+        if (fdx == this->dx && fdy == this->dy
+            && this->board.cell(this->x + fdx, this->y).type() < cell_obstacle
+            && this->board.cell(this->x, this->y + fdy).type() < cell_obstacle
+            && cnext.type() <= cell_sticky
+            && !cnext.ball()) {
+            assert(ccur.ball() == this);
+            return this->advance(ccur, cnext);
+        }
+    }
+
+    // otherwise, lock the tiles covering this cell and all its neighbors,
+    // since bounces can turn the ball toward any of them; only this
+    // ball's own moves (or its warp) change `x` and `y`
+    pong_tile_guard guard(this->board, this->x - 1, this->y - 1,
+                          this->x + 1, this->y + 1);
+    pong_cell ccur = board.cell(this->x, this->y);
 
     // if stopped, nothing to do
     if (this->stopped) {
@@ -37,48 +95,54 @@ int pong_ball::move() {
     }
 
     // otherwise, ball is on board in this cell
-    assert(ccur.ball == this);
+    assert(ccur.ball() == this);
 
     // change direction on hitting an obstacle
-    pong_cell& cx = this->board.cell(this->x + this->dx, this->y);
-    if (cx.type >= cell_obstacle) {
+    pong_cell cx = this->board.cell(this->x + this->dx, this->y);
+    if (cx.type() >= cell_obstacle) {
         cx.hit_obstacle();
         this->dx = -this->dx;
     }
 
-    pong_cell& cy = this->board.cell(this->x, this->y + this->dy);
-    if (cy.type >= cell_obstacle) {
+    pong_cell cy = this->board.cell(this->x, this->y + this->dy);
+    if (cy.type() >= cell_obstacle) {
         cy.hit_obstacle();
         this->dy = -this->dy;
     }
 
     // check next cell
-    pong_cell& cnext = this->board.cell(this->x + this->dx,
-                                        this->y + this->dy);
-    if (cnext.ball) {
+    pong_cell cnext = this->board.cell(this->x + this->dx,
+                                       this->y + this->dy);
+    pong_celltype tnext = cnext.type();
+    if (pong_ball* bnext = cnext.ball()) {
         // collision: change both balls' directions without moving them
-        if (cnext.ball->dx != this->dx) {
-            cnext.ball->dx = this->dx;
+        // (`bnext` may be reading its direction unlocked; see above)
+        if (bnext->dx != this->dx) {
+            std::atomic_ref(bnext->dx).store(this->dx, std::memory_order_relaxed);
             this->dx = -this->dx;
         }
-        if (cnext.ball->dy != this->dy) {
-            cnext.ball->dy = this->dy;
+        if (bnext->dy != this->dy) {
+            std::atomic_ref(bnext->dy).store(this->dy, std::memory_order_relaxed);
             this->dy = -this->dy;
         }
-        cnext.ball->stopped = false;
-        ++this->board.ncollisions;
+        if (bnext->stopped) {
+            bnext->stopped = false;
+            bnext->unpark();
+        }
+        this->board.ncollisions.add(1);
         return 0;
-    } else if (cnext.type == cell_warp) {
+    } else if (tnext == cell_warp) {
         // warp: fall off board into warp tunnel
-        ccur.ball = nullptr;
+        ccur.remove_ball();
         this->stopped = true;
-        cnext.warp->accept_ball(this);
+        this->parked = true;
+        cnext.warp()->accept_ball(this);
         return 0;
-    } else if (cnext.type == cell_trash) {
+    } else if (tnext == cell_trash) {
         // trash: kill ball
-        ccur.ball = nullptr;
+        ccur.remove_ball();
         return -1;
-    } else if (cnext.type >= cell_obstacle) {
+    } else if (tnext >= cell_obstacle) {
         // obstacle: reverse direction (but do not move)
         cnext.hit_obstacle();
         this->dx = -this->dx;
@@ -86,43 +150,163 @@ int pong_ball::move() {
         return 0;
     } else {
         // empty or sticky: move into it
-        this->x += this->dx;
-        this->y += this->dy;
-        ccur.ball = nullptr;
-        cnext.ball = this;
-        if (cnext.type == cell_sticky) {
-            // sticky: stay put until next collision
-            this->dx = this->dy = 0;
-            this->stopped = true;
-        }
-        return 1;
+        return this->advance(ccur, cnext);
     }
 }
 
 
+// pong_ball::advance(ccur, cnext)
+//    Move this ball from `ccur` into empty or sticky cell `cnext`, which
+//    is at `x + dx, y + dy`. Called by `move()`, and by `pong_stepper`
+//    for balls it has checked itself.
+
+int pong_ball::advance(pong_cell ccur, pong_cell cnext) {
+    this->x += this->dx;
+    this->y += this->dy;
+    ccur.remove_ball();
+    cnext.set_ball(this);
+    if (cnext.type() == cell_sticky) {
+        // sticky: stay put until next collision
+        this->dx = this->dy = 0;
+        this->stopped = true;
+        this->parked = true;
+    }
+    this->board.nmoves.add(1);
+    return 1;
+}
+
+
 // pong_cell::hit_obstacle()
 //    Called from pong_ball::move when a ball hits an obstacle or paddle.
 
 void pong_cell::hit_obstacle() {
-    if (this->type == cell_obstacle
-        && this->strength != 0
-        && --this->strength == 0) {
-        this->type = cell_empty;
+    if (this->type() == cell_obstacle) {
+        int strength = this->strength();
+        if (strength == 1) {
+            this->set_type(cell_empty);
+        } else if (strength != 0) {
+            this->set_strength(strength - 1);
+        }
     }
 }
 
 
+// pong_cell::remove_ball()
+//    Called from pong_ball::move when a ball leaves this cell. If it was
+//    released here from a warp tunnel, the tunnel may release the next.
+
+void pong_cell::remove_ball() {
+    pong_tile& t = this->board.tile(this->x, this->y);
+    unsigned bit = pong_tile::bit(this->x, this->y);
+    assert(t.occupied & (uint64_t(1) << bit));
+    t.balls.erase(t.balls.begin() + t.rank(bit));
+    t.occupied &= ~(uint64_t(1) << bit);
+    if (this->type() == cell_warp) {
+        // `this->warp()` leads into the tunnel whose balls come out here
+        this->warp()->peer->release_exit();
+    }
+}
+
+
+// pong_cell::warp(), pong_cell::set_warp(w)
+//    Warps are few, so they live in a map rather than in every cell.
+//    All are set before any ball moves.
+
+pong_warp* pong_cell::warp() const {
+    auto it = this->board.warp_cells.find(this->y * this->board.width + this->x);
+    return it == this->board.warp_cells.end() ? nullptr : it->second;
+}
+
+void pong_cell::set_warp(pong_warp* w) {
+    assert(this->on_board() && this->type() == cell_warp);
+    this->board.warp_cells[this->y * this->board.width + this->x] = w;
+}
+
+
 // pong_warp::accept_ball(b)
 //    Called from pong_ball::move when ball `b` lands on one end of a warp
 //    tunnel. Hands `b` off to that tunnel for further processing (see
-//    `warp_thread` in `breakout61.cc`).
+//    `warp_thread` in `breakout61.cc`, or `pong_scheduler::warp_ball` in
+//    `-E` mode).
 //
-//    The handout code has several synchronization bugs, including that if
-//    multiple balls enter a warp tunnel too close together, an assertion will
-//    fail. (Instead, all balls should be accepted and then processed in
-//    order.)
+//    Balls that enter close together queue in arrival order.
 
 void pong_warp::accept_ball(pong_ball* b) {
-    assert(!this->ball);
-    this->ball = b;
+    if (this->board.scheduler) {
+        this->board.scheduler->warp_ball(this, b);
+        return;
+    }
+    std::unique_lock guard(this->m);
+    this->balls.push_back(b);
+    this->cv.notify_all();
+}
+
+
+// pong_warp::next_ball()
+//    Block until a ball is in this tunnel; then remove the earliest
+//    arrival and return it.
+
+pong_ball* pong_warp::next_ball() {
+    std::unique_lock guard(this->m);
+    this->cv.wait(guard, [&] () { return !this->balls.empty(); });
+    pong_ball* b = this->balls.front();
+    this->balls.pop_front();
+    return b;
+}
+
+
+// pong_warp::claim_exit()
+//    Block until the last ball released at this tunnel's exit has moved
+//    away; then claim the exit for the next. Only this tunnel places balls
+//    on its exit cell, since balls moving onto a warp cell fall in.
+
+void pong_warp::claim_exit() {
+    std::unique_lock guard(this->m);
+    this->cv.wait(guard, [&] () { return !this->occupied; });
+    this->occupied = true;
+}
+
+
+// pong_warp::release_exit()
+//    Called when the ball on this tunnel's exit cell leaves it.
+
+void pong_warp::release_exit() {
+    std::unique_lock guard(this->m);
+    this->occupied = false;
+    this->cv.notify_all();
+}
+
+
+// pong_paddle::move(board)
+//    Step the paddle one cell, reversing direction at the edges of
+//    `board`. Only the cell it leaves and the cell it enters change, so
+//    a step locks at most two tiles, however wide the board.
+
+void pong_paddle::move(pong_board& board) {
+    if (this->x + this->dx < 0 || this->x + this->dx + this->width > board.width) {
+        // hit edge of screen; reverse
+        this->dx = -this->dx;
+        return;
+    }
+
+    int xleave, xenter;
+    if (this->dx > 0) {
+        xleave = this->x;
+        xenter = this->x + this->width;
+    } else {
+        xleave = this->x + this->width - 1;
+        xenter = this->x - 1;
+    }
+    this->x += this->dx;
+
+    // lock both edge tiles, in increasing tile order, for one update
+    pong_tile* t0 = &board.tile(std::min(xleave, xenter), this->y);
+    pong_tile* t1 = &board.tile(std::max(xleave, xenter), this->y);
+    std::unique_lock guard0(*t0);
+    std::unique_lock<pong_tile> guard1;
+    if (t1 != t0) {
+        guard1 = std::unique_lock(*t1);
+    }
+    board.cell(xleave, this->y).set_type(cell_empty);
+    board.cell(xenter, this->y).set_type(cell_paddle);
 }
@@ -1,13 +1,19 @@
 #ifndef PONGBOARD_HH
 #define PONGBOARD_HH
 #include <cassert>
+#include <algorithm>
 #include <vector>
+#include <deque>
+#include <unordered_map>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include "helpers.hh"
+#include "prof61.hh"
 struct pong_ball;
 struct pong_warp;
+struct pong_board;
+struct pong_scheduler;
 int random_int(int min, int max);
 
 
@@ -21,31 +27,143 @@ enum pong_celltype {
 };
 
 
+// pong_cell
+//    A handle on the cell at position `x, y` of `board`, as returned by
+//    `board.cell(x, y)`. The board stores cells in compact arrays (see
+//    `pong_board`); these accessors hide that layout. Positions off the
+//    board behave as indestructible obstacles.
+
 struct pong_cell {
-    pong_celltype type = cell_empty;  // type of cell
+    pong_board& board;
+    int x;
+    int y;
+
+    inline bool on_board() const;
+
+    inline pong_celltype type() const;
+    inline void set_type(pong_celltype type);
 
-    // Non-obstacles only:
-    pong_ball* ball = nullptr;        // pointer to ball currently in cell
-                                      // (if any)
+    // Obstacles only: obstacle strength (0 means indestructible)
+    inline int strength() const;
+    inline void set_strength(int strength);
 
-    // Obstacles only:
-    int strength = 0;                 // obstacle strength
+    // Non-obstacles only: pointer to ball currently in cell (if any)
+    inline pong_ball* ball() const;
+    inline void set_ball(pong_ball* b);   // cell must be empty
+    void remove_ball();
 
-    // Warp cells only:
-    pong_warp* warp = nullptr;        // pointer to warp (if any)
+    // Warp cells only: pointer to warp (if any)
+    pong_warp* warp() const;
+    void set_warp(pong_warp* w);
 
     void hit_obstacle();
 };
 
 
+// pong_counter
+//    An event counter sharded across cache lines, so that threads
+//    counting at once rarely touch the same line.
+
+struct pong_counter {
+    static constexpr unsigned nshards = 16;
+    struct alignas(64) shard {
+        std::atomic<unsigned long> n = 0;
+    };
+    shard shards[nshards];
+
+    void add(unsigned long n) {
+        static std::atomic<unsigned> next_shard;
+        static thread_local unsigned my_shard = next_shard++ % nshards;
+        this->shards[my_shard].n.fetch_add(n, std::memory_order_relaxed);
+    }
+    unsigned long load() const {
+        unsigned long sum = 0;
+        for (auto& sh : this->shards) {
+            sum += sh.n.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+};
+
+
+// pong_tile
+//    A `pong_board::tile_size`-square tile of cells. Its mutex protects
+//    its cells and the balls in them. Balls are kept sparsely: `occupied`
+//    has one bit per cell, and `balls` lists the balls present in cell
+//    order, so finding a ball is a popcount.
+//
+//    Lock a tile with `lock()`, which also makes its sequence number
+//    `seq` odd until `unlock()`, so the printer can copy the tile without
+//    locking (see `extract_board`). ThreadSanitizer would report the
+//    (discarded) racing copies, and doesn't support fences, so sanitized
+//    builds always lock instead. `lock()` also records how long each
+//    contended acquisition waited in `pong_lock_wait`.
+
+inline prof61_histogram pong_lock_wait("tile_lock_wait", true);
+
+#if defined(__SANITIZE_THREAD__)
+static constexpr bool pong_unlocked_snapshots = false;
+#else
+static constexpr bool pong_unlocked_snapshots = true;
+#endif
+
+struct alignas(64) pong_tile {
+    std::mutex m;
+    std::atomic<unsigned> seq = 0;
+    uint64_t occupied = 0;
+    std::vector<pong_ball*> balls;
+    unsigned char colors[64];         // display color of each cell's ball
+
+    static unsigned bit(int x, int y) {
+        return ((y & 7) << 3) | (x & 7);
+    }
+    unsigned rank(unsigned bit) const {
+        return __builtin_popcountll(this->occupied & ((uint64_t(1) << bit) - 1));
+    }
+    static unsigned char color(const pong_ball* b) {
+        return (reinterpret_cast<uintptr_t>(b) / 131) % 6;
+    }
+
+    void lock() {
+        if (!this->m.try_lock()) {
+            prof61_timer timer(pong_lock_wait);
+            this->m.lock();
+        }
+        if (pong_unlocked_snapshots) {
+            this->seq.store(this->seq.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+    }
+    void unlock() {
+        if (pong_unlocked_snapshots) {
+            this->seq.store(this->seq.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_release);
+        }
+        this->m.unlock();
+    }
+};
+
+
 struct pong_board {
     int width;
     int height;
-    std::vector<pong_cell> cells;     // `width * height`, row-major order
     std::vector<pong_warp*> warps;
 
-    pong_cell obstacle_cell;          // represents off-board positions
-    unsigned long ncollisions = 0;
+    // Cell types, one byte per cell in row-major order. Values below
+    // `kind_brick` are `pong_celltype`s (an obstacle of strength 0 is
+    // `cell_obstacle`); `kind_brick + s - 1` is an obstacle of strength
+    // `s`, up to `max_strength`. Balls live in `tiles`, and warps in the
+    // sparse `warp_cells` map, so the hot checks in `pong_ball::move`
+    // touch a cache line for a 64-cell stretch of row.
+    static constexpr unsigned char kind_brick = 6;
+    static constexpr int max_strength = 256 - kind_brick;
+    std::vector<unsigned char> kinds;
+    std::unordered_map<int, pong_warp*> warp_cells;
+
+    pong_counter ncollisions;
+    pong_counter nmoves;              // moves into empty or sticky cells
+    pong_scheduler* scheduler = nullptr;  // event engine (`-E` mode only)
 
 
     pong_board(int w, int h);
@@ -57,16 +175,125 @@ struct pong_board {
 
 
     // cell(x, y)
-    //    Return a reference to the cell at position `x, y`. If there is
-    //    no such position, returns `obstacle_cell`, a cell containing an
-    //    obstacle.
-    pong_cell& cell(int x, int y) {
-        if (x < 0 || x >= this->width || y < 0 || y >= this->height) {
-            return this->obstacle_cell;
-        } else {
-            return this->cells[y * this->width + x];
+    //    Return the cell at position `x, y`. If there is no such
+    //    position, the cell acts as an obstacle.
+    pong_cell cell(int x, int y) {
+        return pong_cell{*this, x, y};
+    }
+
+
+    // Cells are locked in square tiles of `tile_size x tile_size`: a
+    // tile's mutex protects its cells and the balls in them. A ball move
+    // touches cells at most one away from its own, so it needs at most
+    // 2x2 tiles, and balls in different regions move in parallel. Hold
+    // several tile mutexes only via `pong_tile_guard`, which locks them
+    // in increasing tile order; off-board cells need no lock.
+    static constexpr int tile_shift = 3;
+    static constexpr int tile_size = 1 << tile_shift;
+    int tile_columns;
+    std::vector<pong_tile> tiles;
+
+    // tile(x, y)
+    //    Return the tile containing on-board position `x, y`.
+    pong_tile& tile(int x, int y) {
+        return this->tiles[(y >> tile_shift) * this->tile_columns
+                           + (x >> tile_shift)];
+    }
+
+    // tile_near(x, y)
+    //    Return the tile containing position `x, y`, for locking.
+    //    Off-board positions use the nearest tile.
+    pong_tile& tile_near(int x, int y) {
+        return this->tile(std::clamp(x, 0, this->width - 1),
+                          std::clamp(y, 0, this->height - 1));
+    }
+
+    // kind_type(k), kind_strength(k)
+    //    Decode the type and obstacle strength of cell kind `k`.
+    static pong_celltype kind_type(unsigned char k) {
+        return k >= kind_brick ? cell_obstacle : pong_celltype(k);
+    }
+    static int kind_strength(unsigned char k) {
+        return k >= kind_brick ? k - kind_brick + 1 : 0;
+    }
+};
+
+
+inline bool pong_cell::on_board() const {
+    return this->x >= 0 && this->x < this->board.width
+        && this->y >= 0 && this->y < this->board.height;
+}
+
+inline pong_celltype pong_cell::type() const {
+    if (!this->on_board()) {
+        return cell_obstacle;
+    }
+    return pong_board::kind_type(this->board.kinds[this->y * this->board.width
+                                                   + this->x]);
+}
+
+inline void pong_cell::set_type(pong_celltype type) {
+    assert(this->on_board());
+    this->board.kinds[this->y * this->board.width + this->x] = type;
+}
+
+inline int pong_cell::strength() const {
+    if (!this->on_board()) {
+        return 0;
+    }
+    return pong_board::kind_strength(this->board.kinds[this->y * this->board.width
+                                                       + this->x]);
+}
+
+inline void pong_cell::set_strength(int strength) {
+    assert(this->on_board() && this->type() == cell_obstacle);
+    assert(strength >= 0 && strength <= pong_board::max_strength);
+    this->board.kinds[this->y * this->board.width + this->x] =
+        strength ? pong_board::kind_brick + strength - 1 : cell_obstacle;
+}
+
+inline pong_ball* pong_cell::ball() const {
+    if (!this->on_board()) {
+        return nullptr;
+    }
+    pong_tile& t = this->board.tile(this->x, this->y);
+    unsigned bit = pong_tile::bit(this->x, this->y);
+    if (!(t.occupied & (uint64_t(1) << bit))) {
+        return nullptr;
+    }
+    return t.balls[t.rank(bit)];
+}
+
+inline void pong_cell::set_ball(pong_ball* b) {
+    assert(this->on_board() && b);
+    pong_tile& t = this->board.tile(this->x, this->y);
+    unsigned bit = pong_tile::bit(this->x, this->y);
+    assert(!(t.occupied & (uint64_t(1) << bit)));
+    t.balls.insert(t.balls.begin() + t.rank(bit), b);
+    t.occupied |= uint64_t(1) << bit;
+    t.colors[bit] = pong_tile::color(b);
+}
+
+
+// pong_tile_guard
+//    Locks the tiles covering the cells from `x0, y0` to `x1, y1`
+//    (inclusive), which must span at most two tiles in each direction,
+//    until destroyed.
+
+struct pong_tile_guard {
+    pong_tile* ts[4];
+    int n = 0;
+
+    pong_tile_guard(pong_board& board, int x0, int y0, int x1, int y1);
+    ~pong_tile_guard() {
+        while (this->n > 0) {
+            this->ts[--this->n]->unlock();
         }
     }
+
+    // guards can't be copied, moved, or assigned
+    pong_tile_guard(const pong_tile_guard&) = delete;
+    pong_tile_guard& operator=(const pong_tile_guard&) = delete;
 };
 
 
@@ -74,6 +301,8 @@ struct pong_board {
 struct pong_ball {
     pong_board& board;
     bool stopped = false;
+    std::atomic<bool> parked = false; // stopped on a sticky cell or in a
+                                      // warp; cleared when restarted
     int x = 0;
     int y = 0;
     int dx = 1;
@@ -95,6 +324,26 @@ struct pong_ball {
     //    Move this ball once on its board. Returns 1 if the ball moved to an
     //    empty cell, -1 if it fell off the board, and 0 otherwise.
     int move();
+
+    // advance(ccur, cnext)
+    //    The last step of `move()`: move from `ccur` into the adjacent
+    //    empty or sticky cell `cnext`. The caller holds the tiles covering
+    //    both. Returns 1.
+    int advance(pong_cell ccur, pong_cell cnext);
+
+    // wait_unparked()
+    //    Block until this ball is no longer parked.
+    void wait_unparked() {
+        this->parked.wait(true);
+    }
+
+    // unpark()
+    //    Restart a parked ball. Call after setting `stopped = false`.
+    void unpark() {
+        if (this->parked.exchange(false)) {
+            this->parked.notify_one();
+        }
+    }
 };
 
 
@@ -102,7 +351,12 @@ struct pong_warp {
     pong_board& board;
     int x;
     int y;
-    pong_ball* ball = nullptr;
+    pong_warp* peer = nullptr;        // other end of this tunnel
+
+    std::mutex m;                     // protects the members below
+    std::condition_variable cv;       // signaled on arrival or departure
+    std::deque<pong_ball*> balls;     // balls in the tunnel, in arrival order
+    bool occupied = false;            // a released ball is still on `x, y`
 
 
     pong_warp(pong_board& board_)
@@ -111,6 +365,34 @@ struct pong_warp {
 
     // transfer a ball into this warp tunnel
     void accept_ball(pong_ball* b);
+
+    // wait for the next ball to enter this tunnel, and remove it
+    pong_ball* next_ball();
+
+    // wait until the cell at `x, y` is free, and claim it
+    void claim_exit();
+
+    // note that the ball released at `x, y` left it
+    void release_exit();
+};
+
+
+struct pong_paddle {
+    int x;
+    int y;
+    int width;
+    int dx = 1;
+
+
+    pong_paddle(int x_, int y_, int width_)
+        : x(x_), y(y_), width(width_) {
+    }
+
+    // move()
+    //    Step this paddle once along its row of `board`, reversing at
+    //    the edges. Its `width` cells from `x` must already be marked
+    //    `cell_paddle`.
+    void move(pong_board& board);
 };
 
 #endif
@@ -1,4 +1,7 @@
 #include "board.hh"
+#include "scheduler.hh"
+#include "pool.hh"
+#include "stepper.hh"
 #include "helpers.hh"
 #include <unistd.h>
 #include <sys/time.h>
@@ -23,7 +26,7 @@ static unsigned long delay = 50'000;
 // warp delay, in microseconds
 static unsigned long warp_delay = 200'000;
 
-// number of running threads
+// number of balls in play (incremented as balls are started)
 static std::atomic<long> nrunning = 0;
 
 
@@ -34,8 +37,6 @@ static std::atomic<long> nrunning = 0;
 //    ball and exit.
 
 void ball_thread(pong_ball* b) {
-    ++nrunning;
-
     while (true) {
         int mval = b->move();
         if (mval > 0) {
@@ -46,6 +47,10 @@ void ball_thread(pong_ball* b) {
         } else if (mval < 0) {
             // ball destroyed
             break;
+        } else {
+            // stuck on a sticky cell or in a warp tunnel: sleep until
+            // another ball or the tunnel restarts it
+            b->wait_unparked();
         }
     }
 
@@ -55,7 +60,7 @@ void ball_thread(pong_ball* b) {
 
 
 // warp_thread(w)
-//    Handle a warp tunnel. Must behave as follows:
+//    Handle a warp tunnel:
 //
 //    1. Wait for a ball to enter this tunnel
 //       (see `warp_thread::accept_ball()`).
@@ -64,30 +69,28 @@ void ball_thread(pong_ball* b) {
 //       position is available) and send it on its way.
 //    4. Return to step 1.
 //
-//    The handout code is not thread-safe. Remove the `usleep(0)` functions
-//    and it doesn’t work at all!
+//    Each wait sleeps on the tunnel's condition variable, so idle
+//    tunnels use no CPU.
 
 void warp_thread(pong_warp* w) {
-    pong_cell& cdest = w->board.cell(w->x, w->y);
+    pong_cell cdest = w->board.cell(w->x, w->y);
     while (true) {
-        // wait for a ball to arrive
-        while (!w->ball) {
-            usleep(0);
-        }
-
-        // claim ball (move ball to warp tunnel)
-        pong_ball* b = w->ball;
-        w->ball = nullptr;
+        // wait for a ball to arrive, and claim it
+        pong_ball* b = w->next_ball();
 
         // ball stays in warp tunnel for `warp_delay` usec
         usleep(warp_delay);
 
-        // then it appears on the destination cell
-        assert(!cdest.ball);
-        cdest.ball = b;
-        b->x = w->x;
-        b->y = w->y;
-        b->stopped = false;
+        // then it appears on the destination cell, once that is free
+        w->claim_exit();
+        {
+            std::unique_lock guard(w->board.tile_near(w->x, w->y));
+            cdest.set_ball(b);
+            b->x = w->x;
+            b->y = w->y;
+            b->stopped = false;
+        }
+        b->unpark();
     }
 }
 
@@ -99,29 +102,59 @@ void warp_thread(pong_warp* w) {
 //    Your code here! Our handout code just moves the paddle back & forth.
 
 void paddle_thread(pong_board* b, int px, int py, int pw) {
-    int dx = 1;
+    pong_paddle p(px, py, pw);
     while (true) {
-        if (px + dx >= 0 && px + dx + pw <= b->width) {
-            px += dx;
-        } else {
-            // hit edge of screen; reverse
-            dx = -dx;
-        }
-
-        // represent paddle position as cell_paddle vs. cell_empty
-        for (int x = 0; x < b->width; ++x) {
-            if (x >= px && x < px + pw) {
-                b->cell(x, py).type = cell_paddle;
-            } else {
-                b->cell(x, py).type = cell_empty;
-            }
-        }
-
+        p.move(*b);
         usleep(delay / 2);
     }
 }
 
 
+// BENCHMARK MODE
+
+// `-T`/`-N` limits: stop after this many seconds or successful moves
+// (0 means no limit)
+static double bench_seconds = 0;
+static unsigned long bench_moves = 0;
+static std::chrono::steady_clock::time_point bench_start;
+
+// bench_done(board)
+//    Return true if a benchmark run on `board` is over: it reached its
+//    limits, or no balls are left.
+static bool bench_done(pong_board& board) {
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - bench_start;
+    return (bench_seconds > 0 && t.count() >= bench_seconds)
+        || (bench_moves > 0 && board.nmoves.load() >= bench_moves)
+        || nrunning == 0;
+}
+
+// bench_report(board, mode, nballs, nthreads)
+//    Print one line of JSON describing the run so far, then exit.
+[[noreturn]] static void bench_report(pong_board& board, const char* mode,
+                                      int nballs, int nthreads) {
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - bench_start;
+    unsigned long nmoves = board.nmoves.load(),
+        ncollisions = board.ncollisions.load();
+    double ns_per_cycle = prof61_ns_per_cycle();
+    printf("{\"bench\":\"breakout61\", \"mode\":\"%s\", \"width\":%d, "
+           "\"height\":%d, \"balls\":%d, \"threads\":%d, \"time\":%.6f, "
+           "\"moves\":%lu, \"moves_per_sec\":%.0f, \"collisions\":%lu, "
+           "\"collisions_per_sec\":%.0f, \"lock_contended\":%lu, "
+           "\"lock_wait_ns\":%.0f, \"lock_wait_p50_ns\":%.0f, "
+           "\"lock_wait_p99_ns\":%.0f}\n",
+           mode, board.width, board.height, nballs, nthreads, t.count(),
+           nmoves, nmoves / t.count(), ncollisions, ncollisions / t.count(),
+           (unsigned long) pong_lock_wait.count(),
+           pong_lock_wait.total() * ns_per_cycle,
+           pong_lock_wait.percentile(0.5) * ns_per_cycle,
+           pong_lock_wait.percentile(0.99) * ns_per_cycle);
+    fflush(stdout);
+    prof61_report();
+    // other threads are still running, so skip static destructors
+    _exit(0);
+}
+
+
 // MAIN
 
 static void print_thread(pong_board*, long print_interval);
@@ -130,19 +163,27 @@ static void print_thread(pong_board*, long print_interval);
 //    Explain how breakout61 should be run.
 static void usage() {
     fprintf(stderr, "\
-Usage: ./breakout61 [-P] [-1] [-w WIDTH] [-h HEIGHT] [-b NBALLS] [-s NSTICKY]\n\
-                    [-W NWARP] [-B NBRICKS] [-d MOVEPAUSE] [-p PRINTTIMER]\n");
+Usage: ./breakout61 [-P] [-1 | -E | -S] [-j NWORKERS] [-w WIDTH] [-h HEIGHT]\n\
+                    [-b NBALLS] [-s NSTICKY] [-W NWARP] [-B NBRICKS]\n\
+                    [-d MOVEPAUSE] [-p PRINTTIMER] [-T SECONDS] [-N MOVES]\n\
+\n\
+-E runs balls as timed events, and -S runs them in a work-stealing pool;\n\
+both use NWORKERS threads.\n\
+-T and -N run a headless benchmark (no delay, no printing, fixed seed)\n\
+that stops after SECONDS or MOVES and prints its throughput as JSON.\n");
     exit(1);
 }
 
 int main(int argc, char** argv) {
     // parse arguments and check size invariants
     int width = 100, height = 31, nballs = 24, nsticky = 12,
-        nwarps = 0, nbricks = -1;
+        nwarps = 0, nbricks = -1, nworkers = 1;
     long print_interval = 50'000;
-    bool single_threaded = false, paddle = false, has_size = false;
+    bool single_threaded = false, event_driven = false, pooled = false,
+        paddle = false,
+        has_size = false, bench = false;
     int ch;
-    while ((ch = getopt(argc, argv, "w:h:b:B:s:d:p:W:j:1P")) != -1) {
+    while ((ch = getopt(argc, argv, "w:h:b:B:s:d:p:W:j:T:N:1ESP")) != -1) {
         if (ch == 'w' && is_integer_string(optarg)) {
             width = strtol(optarg, nullptr, 10);
             has_size = true;
@@ -161,14 +202,31 @@ int main(int argc, char** argv) {
             delay = (unsigned long) (strtod(optarg, nullptr) * 1000000);
         } else if (ch == 'p' && is_real_string(optarg)) {
             print_interval = (long) (strtod(optarg, nullptr) * 1000000);
+        } else if (ch == 'j' && is_integer_string(optarg)) {
+            nworkers = strtol(optarg, nullptr, 10);
+        } else if (ch == 'T' && is_real_string(optarg)) {
+            bench_seconds = strtod(optarg, nullptr);
+            bench = true;
+        } else if (ch == 'N' && is_integer_string(optarg)) {
+            bench_moves = strtoul(optarg, nullptr, 10);
+            bench = true;
         } else if (ch == 'P') {
             paddle = true;
         } else if (ch == '1') {
             single_threaded = true;
+        } else if (ch == 'E') {
+            event_driven = true;
+        } else if (ch == 'S') {
+            pooled = true;
         } else {
             usage();
         }
     }
+    if (bench) {
+        delay = 0;
+        print_interval = 0;
+        set_random_seed(61);
+    }
 #ifdef TIOCGWINSZ
     if (!has_size && print_interval > 0) {
         // limit to size of terminal
@@ -188,7 +246,10 @@ int main(int argc, char** argv) {
         || nballs + nsticky + nwarps + width * nbricks >= width * (height - 2)
         || width > 1024
         || nwarps % 2 != 0
-        || nballs == 0) {
+        || nballs == 0
+        || single_threaded + event_driven + pooled > 1
+        || nworkers < 1
+        || (bench && bench_seconds <= 0 && bench_moves == 0)) {
         usage();
     }
 
@@ -199,18 +260,19 @@ int main(int argc, char** argv) {
     // place bricks
     for (int n = 0; n < nbricks; ++n) {
         for (int x = 0; x < width; ++x) {
-            board.cell(x, n).type = cell_obstacle;
-            board.cell(x, n).strength = (nbricks - n - 1) / 2 + 1;
+            board.cell(x, n).set_type(cell_obstacle);
+            board.cell(x, n).set_strength(std::min((nbricks - n - 1) / 2 + 1,
+                                                   pong_board::max_strength));
         }
     }
 
     // place paddle
     if (paddle) {
         for (int x = 0; x < width; ++x) {
-            board.cell(x, height - 1).type = cell_trash;
+            board.cell(x, height - 1).set_type(cell_trash);
         }
         for (int x = 0; x < 8 && x < width; ++x) {
-            board.cell(x, height - 2).type = cell_paddle;
+            board.cell(x, height - 2).set_type(cell_paddle);
         }
     }
 
@@ -220,8 +282,8 @@ int main(int argc, char** argv) {
         do {
             x = random_int(0, width - 1);
             y = random_int(0, height - 3);
-        } while (board.cell(x, y).type != cell_empty);
-        board.cell(x, y).type = cell_sticky;
+        } while (board.cell(x, y).type() != cell_empty);
+        board.cell(x, y).set_type(cell_sticky);
     }
 
     // place warp pairs
@@ -232,18 +294,20 @@ int main(int argc, char** argv) {
         do {
             w1->x = random_int(0, width - 1);
             w1->y = random_int(0, height - 3);
-        } while (board.cell(w1->x, w1->y).type != cell_empty);
-        board.cell(w1->x, w1->y).type = cell_warp;
+        } while (board.cell(w1->x, w1->y).type() != cell_empty);
+        board.cell(w1->x, w1->y).set_type(cell_warp);
 
         do {
             w2->x = random_int(0, width - 1);
             w2->y = random_int(0, height - 3);
-        } while (board.cell(w2->x, w2->y).type != cell_empty);
-        board.cell(w2->x, w2->y).type = cell_warp;
+        } while (board.cell(w2->x, w2->y).type() != cell_empty);
+        board.cell(w2->x, w2->y).set_type(cell_warp);
 
         // Each warp cell contains a pointer to the other end of the warp.
-        board.cell(w1->x, w1->y).warp = w2;
-        board.cell(w2->x, w2->y).warp = w1;
+        board.cell(w1->x, w1->y).set_warp(w2);
+        board.cell(w2->x, w2->y).set_warp(w1);
+        w1->peer = w2;
+        w2->peer = w1;
 
         board.warps.push_back(w1);
         board.warps.push_back(w2);
@@ -256,11 +320,11 @@ int main(int argc, char** argv) {
         do {
             b->x = random_int(0, width - 1);
             b->y = random_int(0, height - 3);
-        } while (board.cell(b->x, b->y).type > cell_sticky
-                 || board.cell(b->x, b->y).ball);
+        } while (board.cell(b->x, b->y).type() > cell_sticky
+                 || board.cell(b->x, b->y).ball());
         b->dx = random_int(0, 1) ? 1 : -1;
         b->dy = random_int(0, 1) ? 1 : -1;
-        board.cell(b->x, b->y).ball = b;
+        board.cell(b->x, b->y).set_ball(b);
         balls.push_back(b);
     }
 
@@ -271,36 +335,77 @@ int main(int argc, char** argv) {
     }
 
     // single-threaded mode: one thread runs all balls
+    bench_start = std::chrono::steady_clock::now();
     if (single_threaded) {
         assert(nwarps == 0);
+        pong_stepper stepper(board, balls);
+        nrunning = nballs;
         while (true) {
-            for (auto b : balls) {
-                b->move();
-            }
+            nrunning = stepper.step();
             if (delay) {
                 usleep(delay);
             }
+            if (bench && bench_done(board)) {
+                bench_report(board, "single", nballs, 1);
+            }
         }
     }
 
-    // otherwise, multithreaded mode
-    // create ball threads
-    for (auto b : balls) {
-        std::thread t(ball_thread, b);
-        t.detach();
-    }
+    // event-driven mode: a pool of `nworkers` threads runs timed events
+    int nthreads;
+    if (event_driven) {
+        pong_scheduler* sched = new pong_scheduler(board, delay, warp_delay,
+                                                   nrunning);
+        auto now = pong_scheduler::clock::now();
+        for (auto b : balls) {
+            sched->add_ball(b, now);
+        }
+        if (paddle) {
+            sched->add_paddle(new pong_paddle(0, height - 2, std::min(8, width)),
+                              now);
+        }
+        sched->start(nworkers);
+        nthreads = nworkers;
+    } else {
+        // otherwise, multithreaded mode, with balls either in a pool of
+        // `nworkers` threads or in threads of their own
+        if (pooled) {
+            pong_pool* pool = new pong_pool(board, nworkers, delay, nrunning);
+            for (auto b : balls) {
+                pool->add_ball(b);
+            }
+            pool->start();
+        } else {
+            nrunning += nballs;
+            for (auto b : balls) {
+                std::thread t(ball_thread, b);
+                t.detach();
+            }
+        }
 
-    // create warp threads
-    for (auto w : board.warps) {
-        std::thread t(warp_thread, w);
-        t.detach();
+        // create warp threads
+        for (auto w : board.warps) {
+            std::thread t(warp_thread, w);
+            t.detach();
+        }
+
+        // create paddle thread
+        if (paddle) {
+            std::thread t(paddle_thread, main_board, 0, height - 2,
+                          std::min(8, width));
+            t.detach();
+        }
+        nthreads = (pooled ? nworkers : nballs) + nwarps + (paddle ? 1 : 0);
     }
 
-    // create paddle thread
-    if (paddle) {
-        std::thread t(paddle_thread, main_board, 0, height - 2,
-                      std::min(8, width));
-        t.detach();
+    // benchmarks check their limits every millisecond
+    while (bench) {
+        usleep(1000);
+        if (bench_done(board)) {
+            bench_report(board, event_driven ? "events"
+                                : pooled ? "pool" : "threads",
+                         nballs, nthreads);
+        }
     }
 
     // main thread blocks forever
@@ -312,52 +417,216 @@ int main(int argc, char** argv) {
 
 // BOARD PRINTING THREAD
 
+// tile_snapshot
+//    A copy of one tile's cells, taken by `extract_board`.
+
+struct tile_snapshot {
+    unsigned char kinds[64];
+    uint64_t occupied;
+    unsigned char colors[64];
+
+    void copy(pong_board& board, pong_tile& t, int tx, int ty,
+              int xend, int yend) {
+        for (int y = ty; y < yend; ++y) {
+            for (int x = tx; x < xend; ++x) {
+                this->kinds[pong_tile::bit(x, y)] = board.kinds[y * board.width + x];
+            }
+        }
+        this->occupied = t.occupied;
+        memcpy(this->colors, t.colors, sizeof(this->colors));
+    }
+
+    // render(bit)
+    //    Return the character for cell `bit` in an extracted board.
+    unsigned char render(unsigned bit) const {
+        pong_celltype type = pong_board::kind_type(this->kinds[bit]);
+        if (this->occupied & (uint64_t(1) << bit)) {
+            return (type == cell_sticky ? 'g' : 'a') + this->colors[bit];
+        } else if (type == cell_empty) {
+            return '.';
+        } else if (type == cell_sticky) {
+            return '_';
+        } else if (type == cell_obstacle) {
+            return 128 + std::min(pong_board::kind_strength(this->kinds[bit]), 16);
+        } else if (type == cell_paddle) {
+            return '=';
+        } else if (type == cell_warp) {
+            return 'W';
+        } else if (type == cell_trash) {
+            return 'X';
+        } else {
+            return '?';
+        }
+    }
+};
+
 // extract_board
 //    Renders the board into an array of characters `buf`, and stores the
 //    number of collisions in `ncollisions`. This is in a separate function
-//    so we can localize unsafe access to `pong_board`.
+//    so we can localize access to `pong_board`.
 //
-//    NOTE: This function accesses the board in a thread-unsafe way. There is no
-//    easy way to fix this and you aren't expected to fix it.
-__attribute__((no_sanitize("thread")))
+//    Each tile is copied without locking, seqlock-style: a copy taken
+//    while the tile's `seq` was odd, or that changed, is retried. So the
+//    picture is consistent within each tile (though not across tiles),
+//    and printing never stalls a ball. A tile that stays busy is copied
+//    under its lock.
 void extract_board(pong_board& board, unsigned char* buf,
                    unsigned long& ncollisions) {
-    ncollisions = board.ncollisions;
-    for (int y = 0; y < board.height; ++y) {
-        for (int x = 0; x < board.width; ++x) {
-            pong_cell& c = board.cell(x, y);
-            if (auto b = c.ball) {
-                int color = (reinterpret_cast<uintptr_t>(b) / 131) % 6;
-                *buf = (c.type == cell_sticky ? 'g' : 'a') + color;
-            } else if (c.type == cell_empty) {
-                *buf = '.';
-            } else if (c.type == cell_sticky) {
-                *buf = '_';
-            } else if (c.type == cell_obstacle) {
-                *buf = 128 + std::min(c.strength, 16);
-            } else if (c.type == cell_paddle) {
-                *buf = '=';
-            } else if (c.type == cell_warp) {
-                *buf = 'W';
-            } else if (c.type == cell_trash) {
-                *buf = 'X';
-            } else {
-                *buf = '?';
+    ncollisions = board.ncollisions.load();
+    tile_snapshot snap;
+    for (int ty = 0; ty < board.height; ty += pong_board::tile_size) {
+        for (int tx = 0; tx < board.width; tx += pong_board::tile_size) {
+            pong_tile& t = board.tile(tx, ty);
+            int yend = std::min(ty + pong_board::tile_size, board.height);
+            int xend = std::min(tx + pong_board::tile_size, board.width);
+
+            bool copied = false;
+            for (int tries = 0;
+                 pong_unlocked_snapshots && !copied && tries != 64;
+                 ++tries) {
+                unsigned seq = t.seq.load(std::memory_order_acquire);
+                if (seq & 1) {
+                    continue;
+                }
+                snap.copy(board, t, tx, ty, xend, yend);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                copied = t.seq.load(std::memory_order_relaxed) == seq;
+            }
+            if (!copied) {
+                std::unique_lock guard(t);
+                snap.copy(board, t, tx, ty, xend, yend);
+            }
+
+            for (int y = ty; y < yend; ++y) {
+                for (int x = tx; x < xend; ++x) {
+                    buf[y * board.width + x] = snap.render(pong_tile::bit(x, y));
+                }
             }
-            ++buf;
         }
     }
 }
 
+// cell_glyph(c), cell_sgr(c)
+//    Return the character printed for extracted cell `c`, and the SGR
+//    parameters that color it on a TTY ("" for the default colors).
+static char cell_glyph(unsigned char c) {
+    if (c >= 'a' && c <= 'l') {
+        return 'O';
+    } else if (c == 128) {
+        return 'X';
+    } else if (c > 128) {
+        return c > 137 ? '%' : '0' + c - 128;
+    } else {
+        return c;
+    }
+}
+
+static const char* cell_sgr(unsigned char c) {
+    static const char* const ball_sgr[12] = {
+        "1;31", "1;32", "1;33", "1;34", "1;35", "1;36",
+        "31", "32", "33", "34", "35", "36"
+    };
+    static const char* const obstacle_sgr[16] = {
+        "48;5;227", "48;5;46", "48;5;214", "48;5;160",
+        "48;5;100", "48;5;101", "48;5;136", "48;5;137",
+        "48;5;138", "48;5;173", "48;5;174", "48;5;175",
+        "48;5;210", "48;5;211", "48;5;212", "48;5;213"
+    };
+    if (c >= 'a' && c <= 'l') {
+        return ball_sgr[c - 'a'];
+    } else if (c == '_') {
+        return "37";
+    } else if (c == 'W') {
+        return "97;45";
+    } else if (c == 'X') {
+        return "32;40";
+    } else if (c == '=') {
+        return "97;104";
+    } else if (c > 128) {
+        return obstacle_sgr[std::min(c - 128, 16) - 1];
+    } else {
+        return "";
+    }
+}
+
+// tty_painter
+//    Writes changed cells to a TTY. It remembers where the cursor is and
+//    which SGR attributes are set, so it moves the cursor only to skip
+//    unchanged cells and sets attributes only when they change.
+
+struct tty_painter {
+    // a cursor move costs about as much as reprinting this many cells
+    static constexpr int max_gap = 6;
+
+    simple_printer& sp;
+    int row = -1;                   // cursor position (1-based; -1 unknown)
+    int col = -1;
+    const char* sgr = "";           // current attributes
+
+    explicit tty_painter(simple_printer& sp_)
+        : sp(sp_) {
+    }
+
+    // move(row, col)
+    //    Move the cursor to `row`, `col`, if it isn't there already.
+    void move(int row_, int col_) {
+        if (this->row != row_ || this->col != col_) {
+            sp << "\x1B[" << long(row_) << ';' << long(col_) << 'H';
+            this->row = row_;
+            this->col = col_;
+        }
+    }
+
+    // set(sgr)
+    //    Select attributes `sgr`.
+    void set(const char* sgr_) {
+        if (strcmp(this->sgr, sgr_) != 0) {
+            sp << "\x1B[";
+            if (*sgr_) {
+                sp << "0;" << sgr_;
+            }
+            sp << 'm';
+            this->sgr = sgr_;
+        }
+    }
+
+    // paint_row(row, cells, prev, width)
+    //    Update screen row `row`, which showed `prev[0, width)`, to show
+    //    `cells[0, width)`. Short runs of unchanged cells between changed
+    //    ones are reprinted rather than skipped.
+    void paint_row(int row_, const unsigned char* cells,
+                   const unsigned char* prev, int width) {
+        int x = 0;
+        while (true) {
+            while (x < width && cells[x] == prev[x]) {
+                ++x;
+            }
+            if (x == width) {
+                return;
+            }
+            // extend the run through changes fewer than `max_gap` cells on
+            int end = x + 1;
+            for (int k = end; k < width && k < end + max_gap; ++k) {
+                if (cells[k] != prev[k]) {
+                    end = k + 1;
+                }
+            }
+            this->move(row_, x + 1);
+            for (; x < end; ++x) {
+                this->set(cell_sgr(cells[x]));
+                sp << cell_glyph(cells[x]);
+            }
+            // the cursor stops on the last column rather than wrapping
+            this->col = x < width ? x + 1 : -1;
+        }
+    }
+};
+
 // print_thread
 //    Prints out the current state of the `board` to standard output every
-//    `print_interval` microseconds.
+//    `print_interval` microseconds. Each frame is one `write`. On a TTY,
+//    a frame rewrites only the cells that changed since the last one.
 void print_thread(pong_board* board, long print_interval) {
-    static const unsigned char obstacle_colors[16] = {
-        227, 46, 214, 160, 100, 101, 136, 137,
-        138, 173, 174, 175, 210, 211, 212, 213
-    };
-
     int width = main_board->width, height = main_board->height;
     unsigned char* mb[2] = {
         new unsigned char[width * height],
@@ -366,8 +635,11 @@ void print_thread(pong_board* board, long print_interval) {
     int mbi = 0;
     memset(mb[1], 0, width * height);
 
-    char buf[8192];
-    simple_printer sp(buf, sizeof(buf));
+    // room for the header and footer, plus the longest escape sequences
+    // for every cell and line
+    size_t bufsz = 256 + size_t(height) * (width * 32 + 16);
+    char* buf = new char[bufsz];
+    simple_printer sp(buf, bufsz);
 
     bool is_tty = isatty(STDOUT_FILENO);
     if (is_tty) {
@@ -388,61 +660,28 @@ void print_thread(pong_board* board, long print_interval) {
         if (is_tty) {
             sp << " \x1B[1;30m(Ctrl-C to quit)\x1B[m";
         }
-        sp << '\n' << spflush(STDOUT_FILENO);
+        sp << '\n';
 
-        // print board
+        // print board: on a TTY, only the cells that changed
         unsigned char* mbp = mb[mbi];
         unsigned char* mbprev = mb[1 - mbi];
-        int lasty = 0;
-        for (int y = 0; y < height; ++y, mbprev += width) {
-            // don't reprint a TTY line if unchanged from last time
-            if (is_tty && memcmp(mbp, mbprev, width) == 0) {
-                mbp += width;
-                continue;
-            }
-            if (is_tty && lasty != y) {
-                sp << "\x1B[" << long(2 + y) << "H";
+        if (is_tty) {
+            tty_painter painter(sp);
+            painter.row = 2;
+            painter.col = 1;
+            for (int y = 0; y < height; ++y) {
+                painter.paint_row(2 + y, mbp + y * width, mbprev + y * width,
+                                  width);
             }
-            for (int x = 0; x < width; ++x, ++mbp) {
-                if (*mbp >= 'a' && *mbp <= 'l') {
-                    if (is_tty && *mbp >= 'g') {
-                        sp.snprintf("\x1B[%dmO\x1B[m", 31 + *mbp - 'g');
-                    } else if (is_tty) {
-                        sp.snprintf("\x1B[1;%dmO\x1B[m", 31 + *mbp - 'a');
-                    } else {
-                        sp << 'O';
-                    }
-                } else if (*mbp == '_' && is_tty) {
-                    sp << "\x1B[37m_\x1B[m";
-                } else if (*mbp == 'W' && is_tty) {
-                    sp << "\x1B[97;45mW\x1B[m";
-                } else if (*mbp == 'X' && is_tty) {
-                    sp << "\x1B[32;40mX\x1B[m";
-                } else if (*mbp == '=' && is_tty) {
-                    sp << "\x1B[97;104m=\x1B[m";
-                } else if (*mbp == 128) {
-                    sp << (is_tty ? "\x1B[48;5;%dmX\x1B[m" : "X");
-                } else if (*mbp > 128) {
-                    char ch = (char) (*mbp > 137 ? '%' : '0' + *mbp - 128);
-                    if (is_tty) {
-                        sp.snprintf("\x1B[48;5;%dm%c\x1B[m",
-                            obstacle_colors[std::min(*mbp - 128, 16) - 1],
-                            ch);
-                    } else {
-                        sp << ch;
-                    }
-                } else {
-                    sp << (char) *mbp;
+            painter.set("");
+            painter.move(2 + height, 1);
+        } else {
+            for (int y = 0; y < height; ++y) {
+                for (int x = 0; x < width; ++x, ++mbp) {
+                    sp << cell_glyph(*mbp);
                 }
+                sp << '\n';
             }
-            if (is_tty) {
-                sp << "\x1B[K";
-            }
-            sp << '\n' << spflush(STDOUT_FILENO);
-            lasty = y + 1;
-        }
-        if (is_tty && lasty != height) {
-            sp << "\x1B[" << long(2 + height) << "H";
         }
 
         // print footer (blank line)
@@ -455,4 +694,5 @@ void print_thread(pong_board* board, long print_interval) {
 
     delete[] mb[0];
     delete[] mb[1];
+    delete[] buf;
 }
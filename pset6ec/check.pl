@@ -394,4 +394,36 @@ if ($info->{"output"} =~ /\S/) {
     print OUT "${Green}PASS${Off}\n";
 }
 
+# Sanitizer run in event-driven mode
+print OUT "\n${Cyan}Sanitizer check in event mode (should see no sanitizer messages)...${Off}\n";
+$info = run_sh61("./breakout61 -E -j4 -W10 -P -p0", "stdin" => "/dev/null", "stdout" => "pipe", "time_limit" => 3, "size_limit" => 20000);
+if (!exists($info->{"killed"}) || $info->{"killed"} !~ /^timeout/) {
+    print OUT "${Red}FAILURE${Redctx} (expected timeout, got ",
+        (exists($info->{"killed"}) ? $info->{"killed"} : "exit status " . $info->{"status"}),
+        ")${Off}\n";
+}
+$info->{"output"} =~ s/\x1b\[\?\d*h//g;
+if ($info->{"output"} =~ /\S/) {
+    $info->{"output"} .= "…\n" if $info->{"output"} !~ /\n\z/;
+    print OUT "${Red}ERROR:${Off}\n", $info->{"output"};
+} elsif (exists($info->{"killed"}) && $info->{"killed"} =~ /^timeout/) {
+    print OUT "${Green}PASS${Off}\n";
+}
+
+# Sanitizer run in work-stealing pool mode
+print OUT "\n${Cyan}Sanitizer check in pool mode (should see no sanitizer messages)...${Off}\n";
+$info = run_sh61("./breakout61 -S -j4 -W10 -P -p0", "stdin" => "/dev/null", "stdout" => "pipe", "time_limit" => 3, "size_limit" => 20000);
+if (!exists($info->{"killed"}) || $info->{"killed"} !~ /^timeout/) {
+    print OUT "${Red}FAILURE${Redctx} (expected timeout, got ",
+        (exists($info->{"killed"}) ? $info->{"killed"} : "exit status " . $info->{"status"}),
+        ")${Off}\n";
+}
+$info->{"output"} =~ s/\x1b\[\?\d*h//g;
+if ($info->{"output"} =~ /\S/) {
+    $info->{"output"} .= "…\n" if $info->{"output"} !~ /\n\z/;
+    print OUT "${Red}ERROR:${Off}\n", $info->{"output"};
+} elsif (exists($info->{"killed"}) && $info->{"killed"} =~ /^timeout/) {
+    print OUT "${Green}PASS${Off}\n";
+}
+
 exit(0);
@@ -1,22 +1,37 @@
 #include "helpers.hh"
 #include <random>
+#include <atomic>
 #include <cstdlib>
 #include <cctype>
 #include <cassert>
 #include <cstring>
 #include <cstdarg>
+#include <cerrno>
+#include <algorithm>
 #include <unistd.h>
 
+static std::atomic<unsigned> random_seed;
+static std::atomic<bool> has_random_seed;
+
 // random_int(min, max)
 //    Returns a random number in the range [`min`, `max`], inclusive.
 int random_int(int min, int max) {
     static thread_local std::default_random_engine* random_engine;
     if (!random_engine) {
-        random_engine = new std::default_random_engine{std::random_device()()};
+        random_engine = new std::default_random_engine{
+            has_random_seed ? random_seed.load() : std::random_device()()
+        };
     }
     return std::uniform_int_distribution<int>(min, max)(*random_engine);
 }
 
+// set_random_seed(seed)
+//    Seed later `random_int` generators with `seed`.
+void set_random_seed(unsigned seed) {
+    random_seed = seed;
+    has_random_seed = true;
+}
+
 // is_integer_string, is_real_string
 //    Check whether `s` is a correctly-formatted decimal integer or
 //    real number.
@@ -84,10 +99,12 @@ simple_printer& simple_printer::snprintf(const char* fmt, ...) {
 }
 
 simple_printer& simple_printer::operator<<(spflush flush) {
-    if (s_ != buf_) {
-        ssize_t nw = write(flush.fd_, buf_, s_ - buf_);
-        assert(nw == s_ - buf_);
-        s_ = buf_;
+    // large buffers may be written in pieces
+    for (char* p = buf_; p != s_; ) {
+        ssize_t nw = write(flush.fd_, p, s_ - p);
+        assert(nw > 0 || (nw == -1 && errno == EINTR));
+        p += std::max(nw, ssize_t(0));
     }
+    s_ = buf_;
     return *this;
 }
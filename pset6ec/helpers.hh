@@ -8,6 +8,12 @@
 //    This function is thread-safe.
 int random_int(int min, int max);
 
+// set_random_seed(seed)
+//    Make `random_int` deterministic: threads that first call it after
+//    this seed their generators from `seed` rather than the system's
+//    random device.
+void set_random_seed(unsigned seed);
+
 // is_integer_string, is_real_string
 //    Check whether `s` is a correctly-formatted decimal integer or
 //    real number.
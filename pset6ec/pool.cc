@@ -0,0 +1,135 @@
+#include "pool.hh"
+
+
+// pong_pool(board, nworkers, delay, nrunning) constructor
+//    Construct a pool of `nworkers` threads that move balls on `board`
+//    every `delay` microseconds. `nrunning` counts the balls it owns.
+pong_pool::pong_pool(pong_board& board_, int nworkers, unsigned long delay_,
+                     std::atomic<long>& nrunning_)
+    : board(board_), delay(delay_), nrunning(nrunning_) {
+    assert(nworkers > 0);
+    for (int i = 0; i != nworkers; ++i) {
+        this->states.push_back(std::make_unique<worker_state>());
+    }
+}
+
+
+// pong_pool destructor
+//    Stop and join the workers, then destroy the remaining balls.
+pong_pool::~pong_pool() {
+    this->stopping = true;
+    for (auto& t : this->workers) {
+        t.join();
+    }
+    for (auto& s : this->states) {
+        for (auto b : s->balls) {
+            delete b;
+        }
+    }
+}
+
+
+// pong_pool::add_ball(b)
+//    Give `b` to the next worker, round robin. Call before `start`.
+void pong_pool::add_ball(pong_ball* b) {
+    assert(this->workers.empty());
+    ++this->nrunning;
+    this->states[this->next_worker]->balls.push_back(b);
+    this->next_worker = (this->next_worker + 1) % this->states.size();
+}
+
+
+// pong_pool::start()
+//    Start the worker threads.
+void pong_pool::start() {
+    for (int i = 0; i != int(this->states.size()); ++i) {
+        this->workers.emplace_back(&pong_pool::worker, this, i);
+    }
+}
+
+
+// pong_pool::next_ball(i)
+//    Pop the next ball for worker `i` to move this tick, stealing if its
+//    own deque is empty. Returns nullptr when there is nothing to steal.
+pong_ball* pong_pool::next_ball(int i) {
+    worker_state& s = *this->states[i];
+    do {
+        std::unique_lock guard(s.m);
+        if (!s.balls.empty()) {
+            pong_ball* b = s.balls.front();
+            s.balls.pop_front();
+            return b;
+        }
+    } while (this->steal(i));
+    return nullptr;
+}
+
+
+// pong_pool::steal(i)
+//    Move half the balls waiting in some other worker's deque (at least
+//    one) to worker `i`'s deque. Returns false if every deque was empty.
+//    Holds one deque lock at a time, so stealing cannot deadlock.
+bool pong_pool::steal(int i) {
+    int n = this->states.size();
+    for (int k = 1; k != n; ++k) {
+        worker_state& victim = *this->states[(i + k) % n];
+        std::deque<pong_ball*> loot;
+        {
+            std::unique_lock guard(victim.m);
+            size_t nsteal = (victim.balls.size() + 1) / 2;
+            loot.assign(victim.balls.end() - nsteal, victim.balls.end());
+            victim.balls.erase(victim.balls.end() - nsteal, victim.balls.end());
+        }
+        if (!loot.empty()) {
+            worker_state& s = *this->states[i];
+            std::unique_lock guard(s.m);
+            s.balls.insert(s.balls.end(), loot.begin(), loot.end());
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// pong_pool::worker(i)
+//    Body of worker thread `i`: once per tick, move each ball in its
+//    deque (or stolen from another's) once. The balls it moved return to
+//    its deque only when its next tick starts, so no other worker can
+//    steal and move them twice in one tick. Ticks never run closer
+//    together than `delay`, or than 1 ms for a worker with no balls.
+void pong_pool::worker(int i) {
+    worker_state& s = *this->states[i];
+    std::vector<pong_ball*> moved;
+    auto next_tick = clock::now();
+    while (!this->stopping) {
+        {
+            std::unique_lock guard(s.m);
+            s.balls.insert(s.balls.end(), moved.begin(), moved.end());
+        }
+        moved.clear();
+
+        while (pong_ball* b = this->next_ball(i)) {
+            // a parked ball waits for a collision or its warp to restart
+            // it; `unpark` publishes its new position
+            if (!b->parked && b->move() < 0) {
+                delete b;
+                --this->nrunning;
+            } else {
+                moved.push_back(b);
+            }
+        }
+
+        auto now = clock::now();
+        next_tick = std::max(next_tick + this->delay, now);
+        if (moved.empty()) {
+            next_tick = std::max(next_tick, now + std::chrono::milliseconds(1));
+        }
+        if (next_tick > now) {
+            std::this_thread::sleep_until(next_tick);
+        }
+    }
+
+    // leave the balls for the destructor
+    std::unique_lock guard(s.m);
+    s.balls.insert(s.balls.end(), moved.begin(), moved.end());
+}
@@ -0,0 +1,61 @@
+#ifndef PONG_POOL_HH
+#define PONG_POOL_HH
+#include "board.hh"
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <thread>
+
+
+// pong_pool
+//    The work-stealing engine (`-S`). A fixed pool of `nworkers` threads
+//    moves every ball, so CPU use stays at `nworkers` however many balls
+//    there are. Each worker owns a deque of balls. Once every `delay`
+//    (a tick), it moves each of its balls once: it pops balls from the
+//    front of its deque, and when that runs dry -- for instance, because
+//    its balls fell into the trash -- steals half the balls still
+//    waiting at the back of another worker's deque. A stolen ball
+//    belongs to the thief from then on, so the load evens out.
+//
+//    Parked balls (stuck on sticky cells or in warp tunnels) are skipped
+//    until they are restarted, and a ball that bounces moves again on
+//    the next tick. Warps and the paddle keep their own threads.
+
+struct pong_pool {
+    using clock = std::chrono::steady_clock;
+
+    pong_board& board;
+    std::chrono::microseconds delay;       // between ticks
+    std::atomic<long>& nrunning;           // balls on the board
+
+    pong_pool(pong_board& board, int nworkers, unsigned long delay,
+              std::atomic<long>& nrunning);
+    ~pong_pool();
+
+    // pools can't be copied, moved, or assigned
+    pong_pool(const pong_pool&) = delete;
+    pong_pool& operator=(const pong_pool&) = delete;
+
+    // add a ball, which the pool takes ownership of
+    void add_ball(pong_ball* b);
+
+    // start the worker threads
+    void start();
+
+private:
+    struct alignas(64) worker_state {
+        std::mutex m;                 // protects `balls`
+        std::deque<pong_ball*> balls; // balls still to move this tick
+    };
+
+    std::vector<std::unique_ptr<worker_state>> states;
+    std::vector<std::thread> workers;
+    std::atomic<bool> stopping = false;
+    unsigned next_worker = 0;         // for `add_ball`, before `start`
+
+    pong_ball* next_ball(int i);
+    bool steal(int i);
+    void worker(int i);
+};
+
+#endif
@@ -0,0 +1,321 @@
+#ifndef CS61_PROF61_HH
+#define CS61_PROF61_HH
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <string>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// prof61.hh
+//    Header-only instrumentation shared by the psets (the same file is
+//    kept in each pset that uses it):
+//
+//    - `prof61_cycles()` is a cheap timestamp (the TSC on x86);
+//    - `prof61_counter` is a named counter sharded across threads, so
+//      hot increments don't bounce one cache line;
+//    - `prof61_histogram` is a named, lock-free HDR-style histogram
+//      (log-linear buckets, at most 12.5% relative error);
+//    - `prof61_timer` records the lifetime of a scope into a histogram.
+//
+//    Counters and histograms register themselves when constructed
+//    (make them static), and `prof61_json()` describes every one that
+//    recorded anything. `prof61_emit()` writes a line of JSON to file
+//    descriptor 100, where the check scripts collect profiles, or to
+//    stderr if fd 100 is closed and `TIMING` is set.
+
+
+// prof61_cycles()
+//    Return the current timestamp in cycles: the time stamp counter on
+//    x86, nanoseconds elsewhere. `prof61_ns_per_cycle()` converts.
+inline uint64_t prof61_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// prof61_epoch
+//    A pair of timestamps taken at startup, for calibrating cycles.
+struct prof61_clock_epoch {
+    uint64_t cycles = prof61_cycles();
+    std::chrono::steady_clock::time_point when = std::chrono::steady_clock::now();
+};
+inline const prof61_clock_epoch prof61_epoch;
+
+// prof61_ns_per_cycle()
+//    Return the length of a `prof61_cycles()` cycle in nanoseconds,
+//    measured against the steady clock over the life of the program
+//    (at least 1 ms).
+inline double prof61_ns_per_cycle() {
+#if defined(__x86_64__) || defined(__i386__)
+    std::chrono::nanoseconds elapsed;
+    uint64_t cycles;
+    do {
+        elapsed = std::chrono::steady_clock::now() - prof61_epoch.when;
+        cycles = prof61_cycles() - prof61_epoch.cycles;
+    } while (elapsed < std::chrono::milliseconds(1));
+    return double(elapsed.count()) / double(cycles);
+#else
+    return 1.0;
+#endif
+}
+
+// prof61_thread_index()
+//    Return a small number unique to the calling thread.
+inline unsigned prof61_thread_index() {
+    static std::atomic<unsigned> next_index;
+    thread_local unsigned index = next_index++;
+    return index;
+}
+
+
+// prof61_counter
+//    A named counter, sharded by thread. Increments are relaxed; `load()`
+//    sums the shards.
+
+struct prof61_counter {
+    static constexpr int nshards = 16;
+
+    const char* name;
+    prof61_counter* next = nullptr;
+
+    explicit prof61_counter(const char* name_);
+
+    // counters can't be copied, moved, or assigned
+    prof61_counter(const prof61_counter&) = delete;
+    prof61_counter& operator=(const prof61_counter&) = delete;
+
+    void add(uint64_t n = 1) {
+        this->shards[prof61_thread_index() % nshards].n.fetch_add(
+            n, std::memory_order_relaxed);
+    }
+    uint64_t load() const {
+        uint64_t n = 0;
+        for (auto& s : this->shards) {
+            n += s.n.load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+private:
+    struct alignas(64) shard {
+        std::atomic<uint64_t> n = 0;
+    };
+    shard shards[nshards];
+};
+
+
+// prof61_histogram
+//    A named histogram of nonnegative values. Values below 8 have their
+//    own buckets; above that, each power of two splits into 8 buckets. A
+//    histogram constructed with `cycles = true` holds `prof61_cycles()`
+//    differences and reports them in nanoseconds.
+
+struct prof61_histogram {
+    static constexpr int sub_bits = 3;
+    static constexpr int nsub = 1 << sub_bits;
+    static constexpr int nbuckets = (64 - sub_bits + 1) * nsub;
+
+    const char* name;
+    bool cycles;
+    prof61_histogram* next = nullptr;
+
+    explicit prof61_histogram(const char* name_, bool cycles_ = false);
+
+    // histograms can't be copied, moved, or assigned
+    prof61_histogram(const prof61_histogram&) = delete;
+    prof61_histogram& operator=(const prof61_histogram&) = delete;
+
+    void record(uint64_t v) {
+        this->buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+        this->sum.fetch_add(v, std::memory_order_relaxed);
+        uint64_t m = this->max.load(std::memory_order_relaxed);
+        while (v > m
+               && !this->max.compare_exchange_weak(m, v, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const;
+    uint64_t total() const {
+        return this->sum.load(std::memory_order_relaxed);
+    }
+    // percentile(q)
+    //    Return the (approximate) `q`th quantile, 0 <= q <= 1, in raw units.
+    uint64_t percentile(double q) const;
+    // json()
+    //    Return a JSON object summarizing this histogram.
+    std::string json() const;
+
+    static int bucket(uint64_t v) {
+        if (v < nsub) {
+            return v;
+        }
+        int msb = 63 - __builtin_clzll(v);
+        return (msb - sub_bits + 1) * nsub + ((v >> (msb - sub_bits)) & (nsub - 1));
+    }
+    // bucket_value(i)
+    //    Return the midpoint of the values recorded in bucket `i`.
+    static uint64_t bucket_value(int i) {
+        if (i < nsub) {
+            return i;
+        }
+        int shift = i / nsub - 1;
+        return ((uint64_t(nsub + i % nsub) << shift)) + (uint64_t(1) << shift) / 2;
+    }
+
+private:
+    std::atomic<uint64_t> buckets[nbuckets] = {};
+    std::atomic<uint64_t> sum = 0;
+    std::atomic<uint64_t> max = 0;
+};
+
+
+// prof61_timer
+//    Records the cycles from its construction to its destruction in a
+//    histogram, which should have been constructed with `cycles = true`.
+
+struct prof61_timer {
+    prof61_histogram& h;
+    uint64_t start = prof61_cycles();
+
+    explicit prof61_timer(prof61_histogram& h_)
+        : h(h_) {
+    }
+    ~prof61_timer() {
+        this->h.record(prof61_cycles() - this->start);
+    }
+
+    // timers can't be copied, moved, or assigned
+    prof61_timer(const prof61_timer&) = delete;
+    prof61_timer& operator=(const prof61_timer&) = delete;
+};
+
+
+// registered metrics, newest first
+inline std::atomic<prof61_counter*> prof61_counters;
+inline std::atomic<prof61_histogram*> prof61_histograms;
+
+inline prof61_counter::prof61_counter(const char* name_)
+    : name(name_), next(prof61_counters.load()) {
+    while (!prof61_counters.compare_exchange_weak(this->next, this)) {
+    }
+}
+
+inline prof61_histogram::prof61_histogram(const char* name_, bool cycles_)
+    : name(name_), cycles(cycles_), next(prof61_histograms.load()) {
+    while (!prof61_histograms.compare_exchange_weak(this->next, this)) {
+    }
+}
+
+inline uint64_t prof61_histogram::count() const {
+    uint64_t n = 0;
+    for (auto& b : this->buckets) {
+        n += b.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+inline uint64_t prof61_histogram::percentile(double q) const {
+    uint64_t n = this->count();
+    if (n == 0) {
+        return 0;
+    }
+    uint64_t rank = uint64_t(q * (n - 1)), seen = 0;
+    for (int i = 0; i != nbuckets; ++i) {
+        seen += this->buckets[i].load(std::memory_order_relaxed);
+        if (seen > rank) {
+            return std::min(bucket_value(i), this->max.load(std::memory_order_relaxed));
+        }
+    }
+    return this->max.load(std::memory_order_relaxed);
+}
+
+inline std::string prof61_histogram::json() const {
+    double scale = this->cycles ? prof61_ns_per_cycle() : 1.0;
+    const char* unit = this->cycles ? "_ns" : "";
+    uint64_t n = this->count();
+    char buf[400];
+    snprintf(buf, sizeof(buf),
+             "{\"count\":%llu, \"mean%s\":%.1f, \"p50%s\":%.0f, "
+             "\"p90%s\":%.0f, \"p99%s\":%.0f, \"max%s\":%.0f}",
+             (unsigned long long) n,
+             unit, n ? this->sum.load(std::memory_order_relaxed) * scale / n : 0.0,
+             unit, this->percentile(0.5) * scale,
+             unit, this->percentile(0.9) * scale,
+             unit, this->percentile(0.99) * scale,
+             unit, this->max.load(std::memory_order_relaxed) * scale);
+    return buf;
+}
+
+
+// prof61_json()
+//    Return a JSON object describing every registered metric that has
+//    recorded something, or an empty string if there are none.
+inline std::string prof61_json() {
+    std::string counters, histograms;
+    for (auto c = prof61_counters.load(); c; c = c->next) {
+        if (uint64_t n = c->load()) {
+            counters += (counters.empty() ? "\"" : ", \"") + std::string(c->name)
+                + "\":" + std::to_string(n);
+        }
+    }
+    for (auto h = prof61_histograms.load(); h; h = h->next) {
+        if (h->count()) {
+            histograms += (histograms.empty() ? "\"" : ", \"") + std::string(h->name)
+                + "\":" + h->json();
+        }
+    }
+    std::string json;
+    if (!counters.empty()) {
+        json = "\"counters\":{" + counters + "}";
+    }
+    if (!histograms.empty()) {
+        json += (json.empty() ? "" : ", ") + ("\"histograms\":{" + histograms + "}");
+    }
+    return json.empty() ? json : "{" + json + "}";
+}
+
+// prof61_emit(line)
+//    Write `line`, which should be a line of JSON, to file descriptor
+//    100 if it's open, otherwise to stderr if the `TIMING` environment
+//    variable is set. Returns false if the line was dropped.
+inline bool prof61_emit(const std::string& line) {
+    off_t off = lseek(100, 0, SEEK_CUR);
+    int fd = (off != (off_t) -1 || errno == ESPIPE ? 100 : STDERR_FILENO);
+    if (fd == STDERR_FILENO && !getenv("TIMING")) {
+        return false;
+    } else if (fd == STDERR_FILENO) {
+        fflush(stderr);
+    }
+    size_t pos = 0;
+    while (pos != line.size()) {
+        ssize_t nw = write(fd, line.data() + pos, line.size() - pos);
+        if (nw > 0) {
+            pos += nw;
+        } else if (nw == 0 || (errno != EINTR && errno != EAGAIN)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// prof61_report()
+//    Emit `{"prof61":prof61_json()}` if any metric recorded something.
+//    For programs without a profile line of their own.
+inline void prof61_report() {
+    std::string json = prof61_json();
+    if (!json.empty()) {
+        prof61_emit("{\"prof61\":" + json + "}\n");
+    }
+}
+
+#endif
@@ -0,0 +1,154 @@
+#include "scheduler.hh"
+#include <utility>
+
+
+// pong_scheduler(board, delay, warp_delay, nrunning) constructor
+//    Construct an engine for `board` that moves balls every `delay`
+//    microseconds and holds warped balls for `warp_delay`. `nrunning`
+//    counts the balls it owns.
+pong_scheduler::pong_scheduler(pong_board& board_, unsigned long delay_,
+                               unsigned long warp_delay_,
+                               std::atomic<long>& nrunning_)
+    : board(board_), delay(delay_), warp_delay(warp_delay_),
+      nrunning(nrunning_) {
+    assert(!this->board.scheduler);
+    this->board.scheduler = this;
+}
+
+
+// pong_scheduler destructor
+//    Stop and join the workers.
+pong_scheduler::~pong_scheduler() {
+    {
+        std::unique_lock guard(this->m);
+        this->stopping = true;
+    }
+    this->cv.notify_all();
+    for (auto& t : this->workers) {
+        t.join();
+    }
+    this->board.scheduler = nullptr;
+}
+
+
+void pong_scheduler::add_ball(pong_ball* b, clock::time_point when) {
+    ++this->nrunning;
+    this->schedule({when, 0, ev_ball, b});
+}
+
+void pong_scheduler::add_paddle(pong_paddle* p, clock::time_point when) {
+    this->schedule({when, 0, ev_paddle, nullptr, nullptr, p});
+}
+
+
+// the warp that the ball moving on this worker just entered
+static thread_local pong_warp* entered_warp;
+
+// pong_scheduler::warp_ball(w, b)
+//    Called by `w->accept_ball(b)` from within `b->move()`: `b` reappears
+//    at `w`'s position after `warp_delay`. `run` schedules the release
+//    once `move` returns, so the release cannot touch `b` before then.
+void pong_scheduler::warp_ball(pong_warp* w, pong_ball*) {
+    assert(!entered_warp);
+    entered_warp = w;
+}
+
+
+// pong_scheduler::start(n)
+//    Start `n` worker threads.
+void pong_scheduler::start(int n) {
+    for (int i = 0; i != n; ++i) {
+        this->workers.emplace_back(&pong_scheduler::worker, this);
+    }
+}
+
+
+void pong_scheduler::schedule(event e) {
+    std::unique_lock guard(this->m);
+    e.seq = this->next_seq++;
+    bool earliest = this->events.empty() || e.when < this->events.top().when;
+    this->events.push(e);
+    if (earliest) {
+        this->cv.notify_one();
+    }
+}
+
+
+// pong_scheduler::worker()
+//    Body of a worker thread: run each event once it is due.
+void pong_scheduler::worker() {
+    std::unique_lock guard(this->m);
+    while (!this->stopping) {
+        if (this->events.empty()) {
+            this->cv.wait(guard);
+            continue;
+        }
+        clock::time_point when = this->events.top().when;
+        if (clock::now() < when) {
+            this->cv.wait_until(guard, when);
+            continue;
+        }
+        event e = this->events.top();
+        this->events.pop();
+        // another event may be due already
+        if (!this->events.empty()) {
+            this->cv.notify_one();
+        }
+        guard.unlock();
+        this->run(e, clock::now());
+        guard.lock();
+    }
+}
+
+
+// pong_scheduler::run(e, now)
+//    Run event `e`, scheduling whatever follows from it. Events for
+//    different balls run in parallel, synchronized by the board's tile
+//    locks; each ball has at most one pending event.
+void pong_scheduler::run(const event& e, clock::time_point now) {
+    if (e.type == ev_ball) {
+        pong_ball* b = e.ball;
+        int mval = b->move();
+        if (mval < 0) {
+            delete b;
+            --this->nrunning;
+            return;
+        }
+        if (pong_warp* w = std::exchange(entered_warp, nullptr)) {
+            // fell into a warp tunnel
+            this->schedule({now + this->warp_delay, 0, ev_warp, b, w});
+            return;
+        }
+        bool stuck;
+        {
+            std::unique_lock guard(this->board.tile_near(b->x, b->y));
+            stuck = b->stopped;
+        }
+        if (mval > 0 || stuck) {
+            // moved, or is stuck until another ball hits it
+            this->schedule({now + this->delay, 0, ev_ball, b});
+        } else {
+            // bounced: move again right away, as `ball_thread` does
+            this->schedule({now, 0, ev_ball, b});
+        }
+    } else if (e.type == ev_warp) {
+        std::unique_lock guard(this->board.tile_near(e.warp->x, e.warp->y));
+        pong_cell cdest = this->board.cell(e.warp->x, e.warp->y);
+        if (cdest.ball()) {
+            // destination busy; try again later
+            auto retry = std::max(this->delay, std::chrono::microseconds(1000));
+            this->schedule({now + retry, 0, ev_warp, e.ball, e.warp});
+        } else {
+            cdest.set_ball(e.ball);
+            e.ball->x = e.warp->x;
+            e.ball->y = e.warp->y;
+            e.ball->stopped = false;
+            e.ball->parked = false;
+            this->schedule({now, 0, ev_ball, e.ball});
+        }
+    } else {
+        e.paddle->move(this->board);
+        this->schedule({now + this->delay / 2, 0, ev_paddle,
+                        nullptr, nullptr, e.paddle});
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef PONG_SCHEDULER_HH
+#define PONG_SCHEDULER_HH
+#include "board.hh"
+#include <chrono>
+#include <queue>
+#include <thread>
+
+
+// pong_scheduler
+//    The event-driven engine (`-E`). A priority queue of timed events
+//    drives every ball move, warp release, and paddle step from a pool
+//    of `nworkers` threads, so thousands of balls need no threads (or
+//    stacks) of their own. Workers sleep until the earliest event is
+//    due, so an idle board costs no CPU.
+//
+//    Events run in parallel on up to `nworkers` threads; the board's tile
+//    locks keep moves in the same region apart.
+
+struct pong_scheduler {
+    using clock = std::chrono::steady_clock;
+
+    enum event_type {
+        ev_ball,                      // move `ball`
+        ev_warp,                      // release `ball` from `warp`
+        ev_paddle                     // step `paddle`
+    };
+
+    struct event {
+        clock::time_point when;
+        unsigned long seq;            // ties run in scheduling order
+        event_type type;
+        pong_ball* ball = nullptr;
+        pong_warp* warp = nullptr;
+        pong_paddle* paddle = nullptr;
+
+        bool operator>(const event& e) const {
+            return this->when > e.when
+                || (this->when == e.when && this->seq > e.seq);
+        }
+    };
+
+    pong_board& board;
+    std::chrono::microseconds delay;       // between ball moves
+    std::chrono::microseconds warp_delay;  // time in a warp tunnel
+    std::atomic<long>& nrunning;           // balls on the board
+
+    pong_scheduler(pong_board& board, unsigned long delay,
+                   unsigned long warp_delay, std::atomic<long>& nrunning);
+    ~pong_scheduler();
+
+    // schedulers can't be copied, moved, or assigned
+    pong_scheduler(const pong_scheduler&) = delete;
+    pong_scheduler& operator=(const pong_scheduler&) = delete;
+
+    // add events; the scheduler takes ownership of balls
+    void add_ball(pong_ball* b, clock::time_point when);
+    void add_paddle(pong_paddle* p, clock::time_point when);
+    void warp_ball(pong_warp* w, pong_ball* b);
+
+    // start `n` worker threads
+    void start(int n);
+
+private:
+    std::mutex m;                 // protects `events` and `next_seq`
+    std::condition_variable cv;   // signaled when an earlier event arrives
+    std::priority_queue<event, std::vector<event>,
+                        std::greater<event>> events;
+    unsigned long next_seq = 0;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    void schedule(event e);
+    void worker();
+    void run(const event& e, clock::time_point now);
+};
+
+#endif
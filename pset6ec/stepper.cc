@@ -0,0 +1,139 @@
+#include "stepper.hh"
+#include <cstring>
+
+typedef int pong_vint __attribute__((vector_size(pong_stepper::lanes * sizeof(int))));
+
+// On x86-64, `check_batch` is also compiled for AVX2, where each vector
+// operation handles all 8 lanes at once; the loader picks the best
+// version the CPU supports. (Not under ThreadSanitizer, whose runtime
+// isn't ready when the loader runs the clone resolver.)
+#if defined(__x86_64__) && !defined(__SANITIZE_THREAD__)
+#define PONG_VECTOR_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define PONG_VECTOR_CLONES
+#endif
+
+
+// pong_stepper(board, balls) constructor
+//    Construct a stepper for `balls`, which are on `board`. The stepper
+//    owns the balls.
+pong_stepper::pong_stepper(pong_board& board_, std::vector<pong_ball*> balls_)
+    : board(board_), balls(std::move(balls_)) {
+}
+
+
+// pong_stepper destructor
+pong_stepper::~pong_stepper() {
+    for (auto b : this->balls) {
+        delete b;
+    }
+}
+
+
+// pong_stepper::check_batch()
+//    Compute `clear` for the batch in `xs`, `ys`, `dxs`, `dys`, and
+//    `active`: -1 for each active ball that neither bounces off its x or
+//    y neighbor nor meets anything but an empty or sticky cell, which
+//    is what `move()` requires to go straight to `advance()`.
+
+PONG_VECTOR_CLONES
+void pong_stepper::check_batch() {
+    pong_vint x, y, dx, dy, act;
+    memcpy(&x, this->xs, sizeof(x));
+    memcpy(&y, this->ys, sizeof(y));
+    memcpy(&dx, this->dxs, sizeof(dx));
+    memcpy(&dy, this->dys, sizeof(dy));
+    memcpy(&act, this->active, sizeof(act));
+
+    int width = this->board.width, height = this->board.height;
+    pong_vint nx = x + dx, ny = y + dy;
+    pong_vint nx_in = (nx >= 0) & (nx < width);
+    pong_vint ny_in = (ny >= 0) & (ny < height);
+    pong_vint ix = y * width + nx;         // x neighbor
+    pong_vint iy = ny * width + x;         // y neighbor
+    pong_vint inext = ny * width + nx;     // next cell
+
+    // gather cell kinds (off-board cells are obstacles) and occupancy
+    pong_vint kx, ky, knext, occupied;
+    const unsigned char* kinds = this->board.kinds.data();
+    for (int i = 0; i != lanes; ++i) {
+        kx[i] = nx_in[i] ? kinds[ix[i]] : int(cell_obstacle);
+        ky[i] = ny_in[i] ? kinds[iy[i]] : int(cell_obstacle);
+        if (nx_in[i] && ny_in[i]) {
+            knext[i] = kinds[inext[i]];
+            pong_tile& t = this->board.tile(nx[i], ny[i]);
+            occupied[i] = (t.occupied >> pong_tile::bit(nx[i], ny[i])) & 1;
+        } else {
+            knext[i] = cell_obstacle;
+            occupied[i] = 0;
+        }
+    }
+
+    pong_vint clear_v = act
+        & (kx < int(cell_obstacle)) & (ky < int(cell_obstacle))
+        & (knext <= int(cell_sticky)) & (occupied == 0);
+    memcpy(this->clear, &clear_v, sizeof(clear_v));
+}
+
+
+// pong_stepper::step()
+//    Move every ball once, as `for (auto b : balls) { b->move(); }`
+//    would. A ball's move reads and writes only cells within one of it,
+//    so a batch's checks stay valid for a ball unless an earlier ball in
+//    the batch acted within two cells of it; such balls, and those
+//    `check_batch` did not clear, take the general path.
+
+size_t pong_stepper::step() {
+    size_t nballs = this->balls.size(), nkept = 0;
+    for (size_t first = 0; first < nballs; first += lanes) {
+        int n = std::min(size_t(lanes), nballs - first);
+        pong_ball* batch[lanes];
+        for (int i = 0; i != lanes; ++i) {
+            pong_ball* b = i < n ? this->balls[first + i] : nullptr;
+            batch[i] = b;
+            this->xs[i] = b ? b->x : 0;
+            this->ys[i] = b ? b->y : 0;
+            this->dxs[i] = b ? b->dx : 0;
+            this->dys[i] = b ? b->dy : 0;
+            this->active[i] = b && !b->stopped ? -1 : 0;
+        }
+        check_batch();
+
+        bool acted[lanes];
+        for (int i = 0; i != n; ++i) {
+            bool near = false;
+            for (int j = 0; j != i && !near; ++j) {
+                near = acted[j]
+                    && abs(this->xs[j] - this->xs[i]) <= 2
+                    && abs(this->ys[j] - this->ys[i]) <= 2;
+            }
+
+            pong_ball* b = batch[i];
+            int mval;
+            if (!near && !this->active[i]) {
+                // stopped, and nothing nearby has restarted it
+                acted[i] = false;
+                this->balls[nkept++] = b;
+                continue;
+            } else if (!near && this->clear[i]) {
+                int x = this->xs[i], y = this->ys[i],
+                    nx = x + this->dxs[i], ny = y + this->dys[i];
+                pong_tile_guard guard(this->board, std::min(x, nx), std::min(y, ny),
+                                      std::max(x, nx), std::max(y, ny));
+                mval = b->advance(this->board.cell(x, y),
+                                  this->board.cell(nx, ny));
+            } else {
+                mval = b->move();
+            }
+            acted[i] = true;
+
+            if (mval < 0) {
+                delete b;
+            } else {
+                this->balls[nkept++] = b;
+            }
+        }
+    }
+    this->balls.resize(nkept);
+    return nkept;
+}
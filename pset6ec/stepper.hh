@@ -0,0 +1,47 @@
+#ifndef PONG_STEPPER_HH
+#define PONG_STEPPER_HH
+#include "board.hh"
+
+
+// pong_stepper
+//    The single-threaded (`-1`) engine. `step()` moves every ball once,
+//    in order, with exactly the effect of calling `move()` on each, but
+//    checks balls `lanes` at a time: their positions and directions are
+//    copied into structure-of-arrays form, and vector operations compute
+//    their next cells and test them for obstacles, other balls, and
+//    special cells. A ball whose next cell is plainly free then moves
+//    directly. Anything else -- bounces, collisions, bricks, stopped
+//    balls, and any ball near one that already acted in the same batch
+//    -- falls back to `pong_ball::move()`.
+
+struct pong_stepper {
+    static constexpr int lanes = 8;
+
+    pong_board& board;
+    std::vector<pong_ball*> balls;    // balls in play, in move order
+
+    pong_stepper(pong_board& board, std::vector<pong_ball*> balls);
+    ~pong_stepper();
+
+    // steppers can't be copied, moved, or assigned
+    pong_stepper(const pong_stepper&) = delete;
+    pong_stepper& operator=(const pong_stepper&) = delete;
+
+    // step()
+    //    Move every ball once. Balls that fall off the board are deleted.
+    //    Returns the number of balls left.
+    size_t step();
+
+private:
+    // current batch, in structure-of-arrays form
+    alignas(32) int xs[lanes];
+    alignas(32) int ys[lanes];
+    alignas(32) int dxs[lanes];
+    alignas(32) int dys[lanes];
+    alignas(32) int active[lanes];    // -1 if the ball may move
+    alignas(32) int clear[lanes];     // -1 if it can `advance` directly
+
+    void check_batch();
+};
+
+#endif